@@ -50,12 +50,19 @@ include_directories("${CMAKE_CURRENT_BINARY_DIR}")  # required for importing ver
 
 set(SUNSHINE_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/smemory.h"
+        "${CMAKE_SOURCE_DIR}/Input.h"
         "${CMAKE_SOURCE_DIR}/src/interprocess.h"
         "${CMAKE_SOURCE_DIR}/src/interprocess.cpp"
         "${CMAKE_SOURCE_DIR}/src/cbs.cpp"
         "${CMAKE_SOURCE_DIR}/src/utility.h"
         "${CMAKE_SOURCE_DIR}/src/config.h"
         "${CMAKE_SOURCE_DIR}/src/config.cpp"
+        "${CMAKE_SOURCE_DIR}/src/congestion.h"
+        "${CMAKE_SOURCE_DIR}/src/congestion.cpp"
+        "${CMAKE_SOURCE_DIR}/src/control.h"
+        "${CMAKE_SOURCE_DIR}/src/control.cpp"
+        "${CMAKE_SOURCE_DIR}/src/cursor.h"
+        "${CMAKE_SOURCE_DIR}/src/cursor.cpp"
         "${CMAKE_SOURCE_DIR}/src/file_handler.cpp"
         "${CMAKE_SOURCE_DIR}/src/file_handler.h"
         "${CMAKE_SOURCE_DIR}/src/globals.cpp"
@@ -69,17 +76,57 @@ set(SUNSHINE_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/video_colorspace.cpp"
         "${CMAKE_SOURCE_DIR}/src/video_colorspace.h"
         "${CMAKE_SOURCE_DIR}/src/input.h"
+        "${CMAKE_SOURCE_DIR}/src/input.cpp"
         "${CMAKE_SOURCE_DIR}/src/audio.cpp"
         "${CMAKE_SOURCE_DIR}/src/audio.h"
+        "${CMAKE_SOURCE_DIR}/src/cipher.h"
+        "${CMAKE_SOURCE_DIR}/src/cipher.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/common.h"
         "${CMAKE_SOURCE_DIR}/src/move_by_copy.h"
         "${CMAKE_SOURCE_DIR}/src/task_pool.h"
+        "${CMAKE_SOURCE_DIR}/src/timer_wheel.h"
         "${CMAKE_SOURCE_DIR}/src/thread_pool.h"
         "${CMAKE_SOURCE_DIR}/src/thread_safe.h"
+        "${CMAKE_SOURCE_DIR}/src/futex.h"
+        "${CMAKE_SOURCE_DIR}/src/futex.cpp"
         "${CMAKE_SOURCE_DIR}/src/sync.h"
         "${CMAKE_SOURCE_DIR}/src/round_robin.h"
         "${CMAKE_SOURCE_DIR}/src/stat_trackers.h"
         "${CMAKE_SOURCE_DIR}/src/stat_trackers.cpp"
+        "${CMAKE_SOURCE_DIR}/src/stream.h"
+        "${CMAKE_SOURCE_DIR}/src/stream.cpp"
+        "${CMAKE_SOURCE_DIR}/src/fec.h"
+        "${CMAKE_SOURCE_DIR}/src/fec.cpp"
+        "${CMAKE_SOURCE_DIR}/src/buffer_pool.h"
+        "${CMAKE_SOURCE_DIR}/src/buffer_pool.cpp"
+        "${CMAKE_SOURCE_DIR}/src/memory.h"
+        "${CMAKE_SOURCE_DIR}/src/memory.cpp"
+        "${CMAKE_SOURCE_DIR}/src/latency.h"
+        "${CMAKE_SOURCE_DIR}/src/latency.cpp"
+        "${CMAKE_SOURCE_DIR}/src/metrics.h"
+        "${CMAKE_SOURCE_DIR}/src/metrics.cpp"
+        "${CMAKE_SOURCE_DIR}/src/recorder.h"
+        "${CMAKE_SOURCE_DIR}/src/recorder.cpp"
+        "${CMAKE_SOURCE_DIR}/src/content.h"
+        "${CMAKE_SOURCE_DIR}/src/content.cpp"
+        "${CMAKE_SOURCE_DIR}/src/focus.h"
+        "${CMAKE_SOURCE_DIR}/src/focus.cpp"
+        "${CMAKE_SOURCE_DIR}/src/scheduler.h"
+        "${CMAKE_SOURCE_DIR}/src/scheduler.cpp"
+        "${CMAKE_SOURCE_DIR}/src/overload.h"
+        "${CMAKE_SOURCE_DIR}/src/overload.cpp"
+        "${CMAKE_SOURCE_DIR}/src/reactor.h"
+        "${CMAKE_SOURCE_DIR}/src/reactor.cpp"
+        "${CMAKE_SOURCE_DIR}/src/trace.h"
+        "${CMAKE_SOURCE_DIR}/src/trace.cpp"
+        "${CMAKE_SOURCE_DIR}/src/test_pattern.h"
+        "${CMAKE_SOURCE_DIR}/src/test_pattern.cpp"
+        "${CMAKE_SOURCE_DIR}/src/pixel.h"
+        "${CMAKE_SOURCE_DIR}/src/pixel.cpp"
+        "${CMAKE_SOURCE_DIR}/src/pcm.h"
+        "${CMAKE_SOURCE_DIR}/src/pcm.cpp"
+        "${CMAKE_SOURCE_DIR}/src/yuv.h"
+        "${CMAKE_SOURCE_DIR}/src/yuv.cpp"
         ${PLATFORM_TARGET_FILES})
 
 if(NOT SUNSHINE_ASSETS_DIR_DEF)
@@ -89,12 +136,17 @@ list(APPEND SUNSHINE_DEFINITIONS SUNSHINE_ASSETS_DIR="${SUNSHINE_ASSETS_DIR_DEF}
 
 list(APPEND SUNSHINE_DEFINITIONS SUNSHINE_TRAY=${SUNSHINE_TRAY})
 
+if(SUNSHINE_ENABLE_TRACE)
+    list(APPEND SUNSHINE_DEFINITIONS SUNSHINE_TRACE)
+endif()
+
 include_directories("${CMAKE_SOURCE_DIR}")
 
 include_directories(
         SYSTEM
         "${CMAKE_SOURCE_DIR}/third-party"
         ${FFMPEG_INCLUDE_DIRS}
+        ${OPENSSL_INCLUDE_DIR}
         ${PLATFORM_INCLUDE_DIRS}
 )
 
@@ -116,6 +116,37 @@ elseif(NOT LIBDRM_FOUND)
     message(WARNING "Missing libcap")
 endif()
 
+# io_uring
+if(${SUNSHINE_ENABLE_IO_URING})
+    pkg_check_modules(LIBURING liburing)
+else()
+    set(LIBURING_FOUND OFF)
+endif()
+if(LIBURING_FOUND)
+    add_compile_definitions(SUNSHINE_BUILD_IO_URING)
+    include_directories(SYSTEM ${LIBURING_INCLUDE_DIRS})
+    list(APPEND PLATFORM_LIBRARIES ${LIBURING_LIBRARIES})
+    list(APPEND PLATFORM_TARGET_FILES
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/io_uring.h"
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/io_uring.cpp")
+else()
+    message(STATUS "liburing not found, sends use sendmsg()")
+endif()
+
+# AF_XDP
+if(${SUNSHINE_ENABLE_XDP})
+    include(CheckIncludeFile)
+    check_include_file(linux/if_xdp.h HAVE_LINUX_IF_XDP_H)
+endif()
+if(HAVE_LINUX_IF_XDP_H)
+    add_compile_definitions(SUNSHINE_BUILD_XDP)
+    list(APPEND PLATFORM_TARGET_FILES
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/xdp.h"
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/xdp.cpp")
+elseif(${SUNSHINE_ENABLE_XDP})
+    message(STATUS "linux/if_xdp.h not found, sends don't use AF_XDP")
+endif()
+
 # evdev
 pkg_check_modules(PC_EVDEV libevdev REQUIRED)
 find_path(EVDEV_INCLUDE_DIR libevdev/libevdev.h
@@ -142,6 +173,22 @@ if(LIBVA_FOUND)
             "${CMAKE_SOURCE_DIR}/src/platform/linux/vaapi.cpp")
 endif()
 
+# vulkan
+if(${SUNSHINE_ENABLE_VULKAN})
+    find_package(Vulkan)
+else()
+    set(Vulkan_FOUND OFF)
+endif()
+if(Vulkan_FOUND AND LIBDRM_FOUND)
+    add_compile_definitions(SUNSHINE_BUILD_VULKAN)
+    include_directories(SYSTEM ${Vulkan_INCLUDE_DIRS})
+    list(APPEND PLATFORM_TARGET_FILES
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/vulkan.h"
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/vulkan.cpp")
+elseif(${SUNSHINE_ENABLE_VULKAN})
+    message(STATUS "Vulkan headers or libdrm not found, encoding through Vulkan Video is disabled")
+endif()
+
 # wayland
 if(${SUNSHINE_ENABLE_WAYLAND})
     find_package(Wayland)
@@ -189,17 +236,57 @@ if(X11_FOUND)
             "${CMAKE_SOURCE_DIR}/src/platform/linux/x11grab.cpp")
 endif()
 
+# pipewire
+if(${SUNSHINE_ENABLE_PIPEWIRE})
+    pkg_check_modules(PIPEWIRE libpipewire-0.3)
+else()
+    set(PIPEWIRE_FOUND OFF)
+endif()
+if(PIPEWIRE_FOUND)
+    add_compile_definitions(SUNSHINE_BUILD_PIPEWIRE)
+    include_directories(SYSTEM ${PIPEWIRE_INCLUDE_DIRS})
+    list(APPEND PLATFORM_LIBRARIES ${PIPEWIRE_LIBRARIES})
+    list(APPEND PLATFORM_TARGET_FILES
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/pipewire.h"
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/audio_pipewire.h"
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/audio_pipewire.cpp")
+else()
+    message(STATUS "libpipewire-0.3 not found, audio is captured through PulseAudio")
+endif()
+
+# xdg-desktop-portal
+if(${SUNSHINE_ENABLE_PORTAL} AND PIPEWIRE_FOUND)
+    pkg_check_modules(GIO gio-unix-2.0)
+else()
+    set(GIO_FOUND OFF)
+endif()
+if(GIO_FOUND)
+    set(PORTAL_FOUND ON)
+    add_compile_definitions(SUNSHINE_BUILD_PORTAL)
+    include_directories(SYSTEM ${GIO_INCLUDE_DIRS})
+    list(APPEND PLATFORM_LIBRARIES ${GIO_LIBRARIES})
+    list(APPEND PLATFORM_TARGET_FILES
+            "${CMAKE_SOURCE_DIR}/src/platform/linux/portalgrab.cpp")
+else()
+    set(PORTAL_FOUND OFF)
+    if(${SUNSHINE_ENABLE_PORTAL})
+        message(STATUS "libpipewire-0.3 or gio-unix-2.0 not found, screencasting through xdg-desktop-portal is disabled")
+    endif()
+endif()
+
 if(NOT ${CUDA_FOUND}
         AND NOT ${WAYLAND_FOUND}
         AND NOT ${X11_FOUND}
+        AND NOT ${PORTAL_FOUND}
         AND NOT (${LIBDRM_FOUND} AND ${LIBCAP_FOUND})
         AND NOT ${LIBVA_FOUND})
-    message(FATAL_ERROR "Couldn't find either cuda, wayland, x11, (libdrm and libcap), or libva")
+    message(FATAL_ERROR "Couldn't find either cuda, wayland, x11, pipewire, (libdrm and libcap), or libva")
 endif()
 
 list(APPEND PLATFORM_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/platform/linux/graphics.h"
         "${CMAKE_SOURCE_DIR}/src/platform/linux/graphics.cpp"
+        "${CMAKE_SOURCE_DIR}/src/platform/linux/input.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/linux/misc.h"
         "${CMAKE_SOURCE_DIR}/src/platform/linux/misc.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/linux/audio.cpp"
@@ -215,7 +302,8 @@ list(APPEND PLATFORM_LIBRARIES
         dl
         numa
         pulse
-        pulse-simple)
+        pulse-simple
+        rt)
 
 include_directories(
         SYSTEM
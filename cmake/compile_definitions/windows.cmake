@@ -12,6 +12,23 @@ list(APPEND SUNSHINE_COMPILE_OPTIONS -Wno-misleading-indentation)
 # see gcc bug 98723
 add_definitions(-DUSE_BOOST_REGEX)
 
+# the update options of Windows.Graphics.Capture sessions arrived with Windows 11 24H2, older SDKs don't project them
+include(CheckCXXSourceCompiles)
+check_cxx_source_compiles("
+#define ____FIReference_1_boolean_INTERFACE_DEFINED__
+#include <winrt/windows.foundation.collections.h>
+#include <winrt/windows.graphics.capture.h>
+int main() {
+  winrt::Windows::Graphics::Capture::GraphicsCaptureSession session { nullptr };
+  session.MinUpdateInterval(winrt::Windows::Foundation::TimeSpan {});
+  session.DirtyRegionMode(winrt::Windows::Graphics::Capture::GraphicsCaptureDirtyRegionMode::ReportOnly);
+  winrt::Windows::Graphics::Capture::Direct3D11CaptureFrame frame { nullptr };
+  return frame.DirtyRegions().Size();
+}" SUNSHINE_WGC_UPDATE_OPTIONS)
+if(SUNSHINE_WGC_UPDATE_OPTIONS)
+    add_compile_definitions(SUNSHINE_BUILD_WGC_UPDATE_OPTIONS)
+endif()
+
 # extra tools/binaries for audio/display devices
 add_subdirectory(tools)  # todo - this is temporary, only tools for Windows are needed, for now
 
@@ -22,6 +39,11 @@ file(GLOB NVPREFS_FILES CONFIGURE_DEPENDS
         "${CMAKE_SOURCE_DIR}/src/platform/windows/nvprefs/*.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/windows/nvprefs/*.h")
 
+# amd
+file(GLOB AMF_SOURCES CONFIGURE_DEPENDS
+        "${CMAKE_SOURCE_DIR}/src/amf/*.cpp"
+        "${CMAKE_SOURCE_DIR}/src/amf/*.h")
+
 set(PLATFORM_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/platform/windows/misc.h"
         "${CMAKE_SOURCE_DIR}/src/platform/windows/misc.cpp"
@@ -30,8 +52,10 @@ set(PLATFORM_TARGET_FILES
         "${CMAKE_SOURCE_DIR}/src/platform/windows/display_vram.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/windows/display_wgc.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/windows/display_ram.cpp"
+        "${CMAKE_SOURCE_DIR}/src/platform/windows/input.cpp"
         "${CMAKE_SOURCE_DIR}/src/platform/windows/audio.cpp"
-        ${NVPREFS_FILES})
+        ${NVPREFS_FILES}
+        ${AMF_SOURCES})
 
 set(OPENSSL_LIBRARIES
         libssl.a
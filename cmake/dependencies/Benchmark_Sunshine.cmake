@@ -0,0 +1,29 @@
+#
+# Loads Google Benchmark for the microbenchmarks, giving the priority to the system package first,
+# with a fallback to FetchContent.
+#
+include_guard(GLOBAL)
+
+set(BENCHMARK_VERSION 1.9.1)
+
+find_package(benchmark CONFIG)
+if(NOT benchmark_FOUND)
+    message(STATUS "Google Benchmark package not found in the system. Falling back to FetchContent.")
+    include(FetchContent)
+
+    # only the library, none of its own tests
+    set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+    set(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+    set(BENCHMARK_ENABLE_INSTALL OFF CACHE BOOL "" FORCE)
+    set(BENCHMARK_ENABLE_WERROR OFF CACHE BOOL "" FORCE)
+
+    FetchContent_Declare(
+            benchmark
+            GIT_REPOSITORY https://github.com/google/benchmark.git
+            GIT_TAG v${BENCHMARK_VERSION}
+            GIT_SHALLOW TRUE
+    )
+    FetchContent_MakeAvailable(benchmark)
+endif()
+
+message(STATUS "Google Benchmark: ${benchmark_VERSION}")
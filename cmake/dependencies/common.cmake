@@ -3,9 +3,14 @@
 
 include(dependencies/Boost_Sunshine)
 
+if(BUILD_BENCHMARKS)
+    include(dependencies/Benchmark_Sunshine)
+endif()
+
 # common dependencies
 find_package(PkgConfig REQUIRED)
 find_package(Threads REQUIRED)
+find_package(OpenSSL REQUIRED)
 
 # ffmpeg pre-compiled binaries
 if(NOT DEFINED FFMPEG_PREPARED_BINARIES)
@@ -1,5 +1,6 @@
 option(BUILD_TESTS "Build tests" ON)
 option(TESTS_ENABLE_PYTHON_TESTS "Enable Python tests" ON)
+option(BUILD_BENCHMARKS "Build the microbenchmarks, Google Benchmark is fetched when it is not installed." OFF)
 
 # DirectX11 is not available in GitHub runners, so even software encoding fails
 set(TESTS_SOFTWARE_ENCODER_UNAVAILABLE "fail"
@@ -13,6 +14,9 @@ option(SUNSHINE_CONFIGURE_ONLY "Configure special files only, then exit." OFF)
 option(SUNSHINE_ENABLE_TRAY "Enable system tray icon. This option will be ignored on macOS." ON)
 option(SUNSHINE_REQUIRE_TRAY "Require system tray icon. Fail the build if tray requirements are not met." ON)
 
+option(SUNSHINE_ENABLE_TRACE
+        "Compile in the trace points of the streaming pipeline, they are written as a Chrome trace on request." OFF)
+
 option(SUNSHINE_SYSTEM_WAYLAND_PROTOCOLS "Use system installation of wayland-protocols rather than the submodule." OFF)
 
 option(CUDA_INHERIT_COMPILE_OPTIONS
@@ -49,8 +53,22 @@ elseif(UNIX)  # Linux
             "Enable KMS grab if available." ON)
     option(SUNSHINE_ENABLE_VAAPI
             "Enable building vaapi specific code." ON)
+    option(SUNSHINE_ENABLE_VULKAN
+            "Enable encoding through the Vulkan Video encoders of FFmpeg, requires the Vulkan headers and libdrm." ON)
     option(SUNSHINE_ENABLE_WAYLAND
             "Enable building wayland specific code." ON)
     option(SUNSHINE_ENABLE_X11
             "Enable X11 grab if available." ON)
+    option(SUNSHINE_ENABLE_PORTAL
+            "Enable PipeWire screencasting through xdg-desktop-portal if available, requires SUNSHINE_ENABLE_PIPEWIRE." ON)
+
+    # Linux audio capture
+    option(SUNSHINE_ENABLE_PIPEWIRE
+            "Capture audio natively through PipeWire if available, instead of the PulseAudio simple API." ON)
+
+    # Linux send backends
+    option(SUNSHINE_ENABLE_IO_URING
+            "Enable the io_uring send backend if liburing is available." ON)
+    option(SUNSHINE_ENABLE_XDP
+            "Enable the AF_XDP send backend if the kernel headers provide it, it's used when stream.xdp_interface is set." ON)
 endif()
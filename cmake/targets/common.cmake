@@ -37,4 +37,39 @@ endif()
 
 target_compile_options(sunshine PRIVATE $<$<COMPILE_LANGUAGE:CXX>:${SUNSHINE_COMPILE_OPTIONS}>;$<$<COMPILE_LANGUAGE:CUDA>:${SUNSHINE_COMPILE_OPTIONS_CUDA};-std=c++17>)  # cmake-lint: disable=C0301
 
-# custom compile flags, must be after adding tests
\ No newline at end of file
+# custom compile flags, must be after adding tests
+
+# the tools link everything but main()
+set(SUNSHINE_TOOL_FILES ${SUNSHINE_TARGET_FILES})
+list(REMOVE_ITEM SUNSHINE_TOOL_FILES "${CMAKE_SOURCE_DIR}/src/main.cpp")
+
+# offline encoder benchmark, built on demand with `--target sunshine-encode-bench`
+add_executable(sunshine-encode-bench EXCLUDE_FROM_ALL
+        ${SUNSHINE_TOOL_FILES}
+        "${CMAKE_SOURCE_DIR}/tools/encode_bench.cpp")
+target_link_libraries(sunshine-encode-bench ${SUNSHINE_EXTERNAL_LIBRARIES} ${EXTRA_LIBS})
+target_compile_definitions(sunshine-encode-bench PUBLIC ${SUNSHINE_DEFINITIONS})
+set_target_properties(sunshine-encode-bench PROPERTIES CXX_STANDARD 20)
+target_compile_options(sunshine-encode-bench PRIVATE $<$<COMPILE_LANGUAGE:CXX>:${SUNSHINE_COMPILE_OPTIONS}>;$<$<COMPILE_LANGUAGE:CUDA>:${SUNSHINE_COMPILE_OPTIONS_CUDA};-std=c++17>)  # cmake-lint: disable=C0301
+if(WIN32)
+    set_target_properties(sunshine-encode-bench PROPERTIES LINK_SEARCH_START_STATIC 1)
+endif()
+
+# microbenchmarks of the building blocks, enabled with BUILD_BENCHMARKS
+if(BUILD_BENCHMARKS)
+    add_executable(sunshine_bench
+            ${SUNSHINE_TOOL_FILES}
+            "${CMAKE_SOURCE_DIR}/tools/bench/main.cpp"
+            "${CMAKE_SOURCE_DIR}/tools/bench/cbs.cpp"
+            "${CMAKE_SOURCE_DIR}/tools/bench/interprocess.cpp"
+            "${CMAKE_SOURCE_DIR}/tools/bench/queue.cpp"
+            "${CMAKE_SOURCE_DIR}/tools/bench/send.cpp"
+            "${CMAKE_SOURCE_DIR}/tools/bench/task_pool.cpp")
+    target_link_libraries(sunshine_bench ${SUNSHINE_EXTERNAL_LIBRARIES} ${EXTRA_LIBS} benchmark::benchmark)
+    target_compile_definitions(sunshine_bench PUBLIC ${SUNSHINE_DEFINITIONS})
+    set_target_properties(sunshine_bench PROPERTIES CXX_STANDARD 20)
+    target_compile_options(sunshine_bench PRIVATE $<$<COMPILE_LANGUAGE:CXX>:${SUNSHINE_COMPILE_OPTIONS}>;$<$<COMPILE_LANGUAGE:CUDA>:${SUNSHINE_COMPILE_OPTIONS_CUDA};-std=c++17>)  # cmake-lint: disable=C0301
+    if(WIN32)
+        set_target_properties(sunshine_bench PROPERTIES LINK_SEARCH_START_STATIC 1)
+    endif()
+endif()
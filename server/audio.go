@@ -0,0 +1,250 @@
+package main
+
+import (
+	"crypto/cipher"
+	"encoding/binary"
+	"time"
+)
+
+// Shards of an audio FEC block, the little-endian payload size followed by the payload, data shards first
+type audioBlock struct {
+	shards     [][]byte
+	dataShards int
+	received   int
+	last       time.Time
+	verified   bool
+}
+
+type audioPacket struct {
+	header    audioHeader
+	size      int
+	complete  int64 // Microseconds since the Unix epoch
+	recovered bool
+}
+
+// Collects the audio packets of a session and decides in order whether each arrived, FEC recovered it or it was lost
+type audioReceiver struct {
+	timeout time.Duration
+	verify  bool
+	aead    cipher.AEAD // Decrypts the encrypted packets, nil without a key
+	stats   streamStats
+
+	packets map[uint32]*audioPacket
+	blocks  map[uint32]*audioBlock // By the index of the first packet of the block
+	arrived map[uint32]time.Time   // First datagram of a packet or of a parity shard of a block starting at the index
+	next    uint32
+	started bool
+
+	report reportWindow
+}
+
+func newAudioReceiver(timeout time.Duration, verify bool, aead cipher.AEAD) *audioReceiver {
+	return &audioReceiver{
+		timeout: timeout,
+		verify:  verify,
+		aead:    aead,
+		packets: map[uint32]*audioPacket{},
+		blocks:  map[uint32]*audioBlock{},
+		arrived: map[uint32]time.Time{},
+	}
+}
+
+func (a *audioReceiver) packet(b []byte, now time.Time) {
+	h, ok := parseAudioHeader(b)
+	if !ok {
+		a.stats.Malformed++
+		return
+	}
+	payload, ok := openPayload(a.aead, b, audioHeaderSize, h.flags)
+	if !ok {
+		a.stats.Forged++
+		return
+	}
+	if len(payload) != int(h.payloadSize) || (h.fecParity > 0 && (h.fecData == 0 || int(h.fecIndex) >= int(h.fecData)+int(h.fecParity))) {
+		a.stats.Malformed++
+		return
+	}
+
+	parity := h.fecParity > 0 && h.fecIndex >= h.fecData
+	start := h.frameIndex
+	if !parity {
+		start -= uint32(h.fecIndex)
+	}
+
+	if !a.started || int32(start-a.next) < -resyncFrames {
+		a.packets = map[uint32]*audioPacket{}
+		a.blocks = map[uint32]*audioBlock{}
+		a.arrived = map[uint32]time.Time{}
+		a.next = start
+		a.started = true
+	}
+
+	if !parity {
+		if before(h.frameIndex, a.next) {
+			a.stats.Late++
+			return
+		}
+		if p := a.packets[h.frameIndex]; p != nil {
+			if p.recovered {
+				a.stats.Late++
+			} else {
+				a.stats.Duplicates++
+			}
+			return
+		}
+
+		a.packets[h.frameIndex] = &audioPacket{header: h, size: len(payload), complete: now.UnixMicro()}
+	}
+	if _, ok := a.arrived[h.frameIndex]; !ok {
+		a.arrived[h.frameIndex] = now
+	}
+	a.stats.Shards++
+	a.report.shard(len(b), now.UnixMicro()-int64(h.captureTime)-int64(h.sendTime))
+
+	if h.fecParity == 0 {
+		return
+	}
+
+	block := a.blocks[start]
+	if block == nil {
+		if before(start+uint32(h.fecData), a.next) {
+			a.stats.Late++
+			return
+		}
+		block = &audioBlock{shards: make([][]byte, int(h.fecData)+int(h.fecParity)), dataShards: int(h.fecData)}
+		a.blocks[start] = block
+	}
+	if len(block.shards) != int(h.fecData)+int(h.fecParity) || block.shards[h.fecIndex] != nil {
+		a.stats.Duplicates++
+		return
+	}
+
+	var shard []byte
+	if parity {
+		shard = append(shard, payload...)
+	} else {
+		shard = binary.LittleEndian.AppendUint16(make([]byte, 0, 2+len(payload)), h.payloadSize)
+		shard = append(shard, payload...)
+	}
+	block.shards[h.fecIndex] = shard
+	block.received++
+	block.last = now
+
+	a.recover(start, block, now)
+}
+
+// Data shards of a block padded to its largest shard, the parity shards always are
+func (b *audioBlock) padded() ([][]byte, int) {
+	size := 0
+	for _, shard := range b.shards {
+		size = max(size, len(shard))
+	}
+
+	shards := make([][]byte, len(b.shards))
+	for x, shard := range b.shards {
+		if shard != nil {
+			shards[x] = padded(shard, size)
+		}
+	}
+	return shards, size
+}
+
+func (a *audioReceiver) recover(start uint32, block *audioBlock, now time.Time) {
+	if a.verify && !block.verified && block.received == len(block.shards) {
+		block.verified = true
+
+		shards, size := block.padded()
+		if verifyBlock(shards, block.dataShards, size) {
+			a.stats.FecVerified++
+		} else {
+			a.stats.FecMismatches++
+		}
+	}
+
+	missing := 0
+	for x := 0; x < block.dataShards; x++ {
+		if block.shards[x] == nil {
+			missing++
+		}
+	}
+	if missing == 0 || block.received < block.dataShards {
+		return
+	}
+
+	shards, size := block.padded()
+	recovered, ok := reconstruct(shards, block.dataShards, size)
+	if !ok {
+		return
+	}
+
+	for _, x := range recovered {
+		index := start + uint32(x)
+		length := int(binary.LittleEndian.Uint16(shards[x]))
+		if length > size-2 {
+			a.stats.FecMismatches++
+			continue
+		}
+
+		block.shards[x] = shards[x][:2+length]
+		if a.packets[index] == nil && !before(index, a.next) {
+			a.packets[index] = &audioPacket{size: length, complete: now.UnixMicro(), recovered: true}
+		}
+	}
+}
+
+// decide gives up on the packets that didn't arrive in time
+func (a *audioReceiver) decide(now time.Time) {
+	for a.started {
+		if p := a.packets[a.next]; p != nil {
+			if p.recovered {
+				a.stats.Frames++
+				a.stats.FrameBytes += uint64(p.size)
+				a.stats.Recovered++
+				a.stats.LostShards++
+				a.report.lostShards(1)
+			} else {
+				a.stats.frame(p.size, p.header.encodeTime, p.header.sendTime, p.header.captureTime, p.complete)
+			}
+			delete(a.packets, a.next)
+			a.next++
+			continue
+		}
+
+		// Lost once a later packet or parity waited as long as a late packet would
+		deadline := time.Time{}
+		for index, arrival := range a.arrived {
+			if before(a.next, index) && (deadline.IsZero() || arrival.Before(deadline)) {
+				deadline = arrival
+			}
+		}
+		if deadline.IsZero() || now.Sub(deadline) < a.timeout {
+			break
+		}
+
+		a.stats.Lost++
+		a.stats.LostShards++
+		a.report.lostShards(1)
+		a.next++
+	}
+
+	for index, arrival := range a.arrived {
+		if before(index, a.next) && now.Sub(arrival) >= a.timeout {
+			delete(a.arrived, index)
+		}
+	}
+
+	// Blocks are kept for the parity that follows their packets, for the erasure test and the loss count
+	for start, block := range a.blocks {
+		if !before(start+uint32(block.dataShards)-1, a.next) || now.Sub(block.last) < a.timeout {
+			continue
+		}
+
+		for _, shard := range block.shards[block.dataShards:] {
+			if shard == nil {
+				a.stats.LostShards++
+				a.report.lostShards(1)
+			}
+		}
+		delete(a.blocks, start)
+	}
+}
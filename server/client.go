@@ -0,0 +1,279 @@
+package main
+
+import (
+	"errors"
+	"log"
+	"math/rand"
+	"net"
+	"sync"
+	"time"
+)
+
+// A receiver of the video of a rung and of the audio. The first client is the destination given
+// to the sender on its command line, the others subscribe as viewers.
+type client struct {
+	id   int
+	opts *options
+
+	video *net.UDPConn
+	audio *net.UDPConn
+
+	mu         sync.Mutex
+	videoRx    *videoReceiver
+	audioRx    *audioReceiver
+	sequence   uint16
+	sent       map[string]uint64
+	acks       map[string]uint64
+	metadata   uint64
+	subscribed bool
+	pattern    *patternResult
+}
+
+func newClient(id int, opts *options) (*client, error) {
+	c := &client{
+		id:      id,
+		opts:    opts,
+		videoRx: newVideoReceiver(opts.timeout, opts.verify, opts.aead),
+		audioRx: newAudioReceiver(opts.timeout, opts.verify, opts.aead),
+		sent:    map[string]uint64{},
+		acks:    map[string]uint64{},
+	}
+
+	// Viewers listen on ports of their own on the address of the destination
+	listen := func(address string) (*net.UDPConn, error) {
+		addr, err := net.ResolveUDPAddr("udp", address)
+		if err != nil {
+			return nil, err
+		}
+		if id > 0 {
+			addr.Port = 0
+		}
+
+		conn, err := net.ListenUDP("udp", addr)
+		if err != nil {
+			return nil, err
+		}
+		conn.SetReadBuffer(opts.socketBuffer)
+		return conn, nil
+	}
+
+	var err error
+	if opts.videoAddress != "" {
+		if c.video, err = listen(opts.videoAddress); err != nil {
+			return nil, err
+		}
+	}
+	if opts.audioAddress != "" {
+		if c.audio, err = listen(opts.audioAddress); err != nil {
+			c.close()
+			return nil, err
+		}
+	}
+
+	// A decoder per client would measure the decoders competing for the CPU
+	if opts.pattern != "" && id == 0 {
+		if c.videoRx.pattern, err = newPatternDecoder(opts.pattern, opts.ffmpeg); err != nil {
+			c.close()
+			return nil, err
+		}
+	}
+	return c, nil
+}
+
+func (c *client) close() {
+	if c.video != nil {
+		c.video.Close()
+	}
+	if c.audio != nil {
+		c.audio.Close()
+	}
+}
+
+var eventNames = map[uint8]string{
+	eventBitrate:             "bitrate",
+	eventIdr:                 "idr",
+	eventInvalidateRefFrames: "invalidate_ref_frames",
+	eventReceiverReport:      "receiver_report",
+	eventSubscribe:           "subscribe",
+	eventUnsubscribe:         "unsubscribe",
+}
+
+// Control commands leave from the video socket, so the sender pushes the metadata to it and
+// resends the shards a viewer lost to the viewer
+func (c *client) control(commands ...command) {
+	if c.opts.control == nil || len(commands) == 0 {
+		return
+	}
+
+	conn := c.video
+	if conn == nil {
+		conn = c.audio
+	}
+
+	c.mu.Lock()
+	c.sequence++
+	datagram := encodeControl(c.sequence, commands...)
+	for _, command := range commands {
+		c.sent[eventNames[command.typ]]++
+	}
+	c.mu.Unlock()
+
+	if _, err := conn.WriteToUDP(datagram, c.opts.control); err != nil {
+		log.Printf("client %d: control failed: %v", c.id, err)
+	}
+}
+
+// The port of a socket followed by the address the sender reaches it at
+func (c *client) endpoint(conn *net.UDPConn) []byte {
+	port := uint32(conn.LocalAddr().(*net.UDPAddr).Port)
+	address := c.opts.advertise.To4()
+	if address == nil {
+		address = c.opts.advertise.To16()
+	}
+	return append(u32s(port), address...)
+}
+
+func (c *client) subscriptions(typ uint8) (commands []command) {
+	if c.id == 0 {
+		return nil
+	}
+	if c.video != nil {
+		commands = append(commands, command{typ, uint8(c.opts.rung), c.endpoint(c.video)})
+	}
+	if c.audio != nil {
+		commands = append(commands, command{typ, uint8(c.opts.audioSession), c.endpoint(c.audio)})
+	}
+	return commands
+}
+
+func (c *client) receive(conn *net.UDPConn, audio bool) {
+	buf := make([]byte, 64*1024)
+	for {
+		n, _, err := conn.ReadFromUDP(buf)
+		if err != nil {
+			if !errors.Is(err, net.ErrClosed) {
+				log.Printf("client %d: receive failed: %v", c.id, err)
+			}
+			return
+		}
+		now := time.Now()
+		datagram := buf[:n]
+
+		c.mu.Lock()
+		c.dispatch(datagram, audio, now)
+		c.mu.Unlock()
+	}
+}
+
+func (c *client) dispatch(datagram []byte, audio bool, now time.Time) {
+	switch {
+	case len(datagram) == 0:
+	case datagram[0] == controlVersion:
+		parseReply(datagram, func(typ uint8, status string) {
+			c.acks[eventNames[typ]+":"+status]++
+			if typ == eventSubscribe {
+				c.subscribed = c.subscribed || status == "ok"
+			}
+		})
+	case datagram[0] == eventMetadata:
+		c.metadata++
+		printMetadata(c.id, datagram)
+	case datagram[0] == eventCursorUpdate:
+	default:
+		stats := &c.videoRx.stats
+		if audio {
+			stats = &c.audioRx.stats
+		}
+		stats.datagram(len(datagram), now)
+
+		if c.opts.drop > 0 && rand.Float64()*100 < c.opts.drop {
+			stats.Dropped++
+			return
+		}
+
+		if audio {
+			c.audioRx.packet(datagram, now)
+		} else {
+			c.videoRx.shard(datagram, now)
+		}
+	}
+}
+
+// run receives until the end of the benchmark, drives the control channel and decides on late frames
+func (c *client) run(done <-chan struct{}) {
+	var wg sync.WaitGroup
+	for _, conn := range []*net.UDPConn{c.video, c.audio} {
+		if conn != nil {
+			wg.Add(1)
+			go func(conn *net.UDPConn) {
+				defer wg.Done()
+				c.receive(conn, conn == c.audio)
+			}(conn)
+		}
+	}
+
+	// Rate control and key frame requests are for the whole rung, only the destination sends them
+	primary := c.id == 0
+	start := time.Now()
+
+	tick := time.NewTicker(10 * time.Millisecond)
+	defer tick.Stop()
+	var lastReport, lastIdr, lastSubscribe time.Time
+	bitrateStep := -1
+	for {
+		select {
+		case <-done:
+			c.control(c.subscriptions(eventUnsubscribe)...)
+			c.close()
+			wg.Wait()
+			if c.videoRx.pattern != nil {
+				c.pattern = c.videoRx.pattern.close()
+			}
+			return
+		case now := <-tick.C:
+			var commands []command
+
+			c.mu.Lock()
+			lost := c.videoRx.decide(now)
+			c.audioRx.decide(now)
+			if c.opts.rfi {
+				for _, frames := range lost {
+					commands = append(commands, command{eventInvalidateRefFrames, uint8(c.opts.rung), u32s(frames[0], frames[1])})
+				}
+			}
+
+			if primary && c.opts.reportInterval > 0 && now.Sub(lastReport) >= c.opts.reportInterval {
+				lastReport = now
+				// Nothing to report before the stream started
+				if c.videoRx.stats.Datagrams > 0 {
+					commands = append(commands, command{eventReceiverReport, uint8(c.opts.rung), c.videoRx.report.take(now)})
+				}
+				if c.audioRx.stats.Datagrams > 0 {
+					commands = append(commands, command{eventReceiverReport, uint8(c.opts.audioSession), c.audioRx.report.take(now)})
+				}
+			}
+
+			// Subscribing is repeated until it's acknowledged or packets arrive, the sender may not be up yet
+			if !c.subscribed && c.videoRx.stats.Datagrams+c.audioRx.stats.Datagrams == 0 && now.Sub(lastSubscribe) >= time.Second {
+				lastSubscribe = now
+				commands = append(commands, c.subscriptions(eventSubscribe)...)
+			}
+			c.mu.Unlock()
+
+			if primary && c.opts.idrInterval > 0 && now.Sub(lastIdr) >= c.opts.idrInterval {
+				lastIdr = now
+				commands = append(commands, command{eventIdr, uint8(c.opts.rung), nil})
+			}
+
+			if primary && len(c.opts.bitrates) > 0 {
+				step := int(now.Sub(start) / c.opts.bitrateInterval)
+				if step != bitrateStep {
+					bitrateStep = step
+					commands = append(commands, command{eventBitrate, uint8(c.opts.rung), u32s(c.opts.bitrates[step%len(c.opts.bitrates)])})
+				}
+			}
+
+			c.control(commands...)
+		}
+	}
+}
@@ -0,0 +1,184 @@
+package main
+
+// Systematic Reed-Solomon over GF(2^8) with the Cauchy matrix of src/fec.cpp
+
+const gfPoly = 0x11D
+
+var (
+	gfExp [510]byte
+	gfLog [256]int
+	gfMul [256][256]byte
+)
+
+func init() {
+	x := 1
+	for i := 0; i < 255; i++ {
+		gfExp[i] = byte(x)
+		gfLog[x] = i
+		x <<= 1
+		if x&0x100 != 0 {
+			x ^= gfPoly
+		}
+	}
+	for i := 255; i < len(gfExp); i++ {
+		gfExp[i] = gfExp[i-255]
+	}
+
+	for a := 1; a < 256; a++ {
+		for b := 1; b < 256; b++ {
+			gfMul[a][b] = gfExp[gfLog[a]+gfLog[b]]
+		}
+	}
+}
+
+func gfInv(a byte) byte {
+	return gfExp[255-gfLog[a]]
+}
+
+// Coefficient of data shard j in parity shard i
+func cauchy(dataShards, i, j int) byte {
+	return gfInv(byte(dataShards+i) ^ byte(j))
+}
+
+// dst ^= c * src
+func mulAdd(dst, src []byte, c byte) {
+	if c == 0 {
+		return
+	}
+
+	row := &gfMul[c]
+	src = src[:len(dst)]
+	for i, v := range src {
+		dst[i] ^= row[v]
+	}
+}
+
+// Gauss-Jordan elimination, false if the matrix is singular
+func invert(m [][]byte) ([][]byte, bool) {
+	n := len(m)
+	a := make([][]byte, n)
+	out := make([][]byte, n)
+	for r := range m {
+		a[r] = append([]byte(nil), m[r]...)
+		out[r] = make([]byte, n)
+		out[r][r] = 1
+	}
+
+	for col := 0; col < n; col++ {
+		pivot := col
+		for pivot < n && a[pivot][col] == 0 {
+			pivot++
+		}
+		if pivot == n {
+			return nil, false
+		}
+		a[col], a[pivot] = a[pivot], a[col]
+		out[col], out[pivot] = out[pivot], out[col]
+
+		scale := gfInv(a[col][col])
+		for k := 0; k < n; k++ {
+			a[col][k] = gfMul[scale][a[col][k]]
+			out[col][k] = gfMul[scale][out[col][k]]
+		}
+
+		for r := 0; r < n; r++ {
+			if r == col || a[r][col] == 0 {
+				continue
+			}
+			c := a[r][col]
+			mulAdd(a[r], a[col], c)
+			mulAdd(out[r], out[col], c)
+		}
+	}
+
+	return out, true
+}
+
+// reconstruct fills in the missing data shards of a block. shards holds the data shards followed
+// by the parity shards, nil when missing, every present shard is size bytes long.
+// It returns the indices of the recovered shards, false when too many shards are missing.
+func reconstruct(shards [][]byte, dataShards, size int) ([]int, bool) {
+	var missing []int
+	for j := 0; j < dataShards; j++ {
+		if shards[j] == nil {
+			missing = append(missing, j)
+		}
+	}
+	if len(missing) == 0 {
+		return nil, true
+	}
+
+	var rows []int
+	for i := 0; dataShards+i < len(shards) && len(rows) < len(missing); i++ {
+		if shards[dataShards+i] != nil {
+			rows = append(rows, i)
+		}
+	}
+	if len(rows) < len(missing) {
+		return nil, false
+	}
+
+	// Parity minus the contribution of the data shards that arrived leaves the missing ones
+	rhs := make([][]byte, len(rows))
+	matrix := make([][]byte, len(rows))
+	for r, i := range rows {
+		rhs[r] = append([]byte(nil), shards[dataShards+i]...)
+		for j := 0; j < dataShards; j++ {
+			if shards[j] != nil {
+				mulAdd(rhs[r], shards[j], cauchy(dataShards, i, j))
+			}
+		}
+
+		matrix[r] = make([]byte, len(missing))
+		for k, j := range missing {
+			matrix[r][k] = cauchy(dataShards, i, j)
+		}
+	}
+
+	inverse, ok := invert(matrix)
+	if !ok {
+		return nil, false
+	}
+
+	for k, j := range missing {
+		out := make([]byte, size)
+		for r := range rows {
+			mulAdd(out, rhs[r], inverse[k][r])
+		}
+		shards[j] = out
+	}
+	return missing, true
+}
+
+// verifyBlock erases as many data shards of a complete block as there are parity shards and checks
+// that reconstruct() brings them back, so both the parity of the sender and the decoder are checked.
+func verifyBlock(shards [][]byte, dataShards, size int) bool {
+	erased := append([][]byte(nil), shards...)
+	parity := len(shards) - dataShards
+	for k := 0; k < parity && k < dataShards; k++ {
+		// Spread over the block rather than always the first shards
+		erased[k*dataShards/min(parity, dataShards)] = nil
+	}
+
+	if _, ok := reconstruct(erased, dataShards, size); !ok {
+		return false
+	}
+
+	for j := 0; j < dataShards; j++ {
+		if string(erased[j]) != string(shards[j]) {
+			return false
+		}
+	}
+	return true
+}
+
+// Copy of b zero padded to size
+func padded(b []byte, size int) []byte {
+	if len(b) == size {
+		return b
+	}
+
+	out := make([]byte, size)
+	copy(out, b)
+	return out
+}
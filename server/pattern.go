@@ -0,0 +1,238 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"io"
+	"log"
+	"os"
+	"os/exec"
+	"sync"
+	"time"
+)
+
+// Layout of src/test_pattern.h, a grid over the left half and the top quarter of the frame
+const (
+	patternColumns  = 16
+	patternRows     = 8
+	patternSyncWord = 0xA55A
+
+	// Size the decoded frames are scaled to, the cells stay in place relative to the frame
+	patternWidth  = 640
+	patternHeight = 360
+)
+
+// Demuxers of ffmpeg for the elementary streams of the codecs
+var patternFormats = map[string]string{"h264": "h264", "hevc": "hevc", "av1": "obu"}
+
+type patternStats struct {
+	Decoded    uint64 `json:"decoded"` // Frames that came out of the decoder
+	Read       uint64 `json:"read"`    // Of them with a valid pattern
+	Unreadable uint64 `json:"unreadable"`
+	Skipped    uint64 `json:"skipped"` // Frame numbers of the pattern that never came out of the decoder
+	Repeated   uint64 `json:"repeated"`
+	Dropped    uint64 `json:"dropped"` // Frames not handed to the decoder because it fell behind
+
+	latency samples // Capture until the frame was decoded
+	decode  samples // Complete on this host until decoded
+}
+
+type patternResult struct {
+	*patternStats
+	Latency summary `json:"latency"`
+	Decode  summary `json:"decode"`
+}
+
+// Decodes the frames of a rung with ffmpeg and reads the test pattern of the sender back
+type patternDecoder struct {
+	cmd    *exec.Cmd
+	frames chan []byte
+	done   chan struct{}
+
+	mu         sync.Mutex
+	stats      patternStats
+	complete   map[uint64]int64 // Capture time to the time the frame was complete, both microseconds since the Unix epoch
+	order      []uint64
+	lastNumber uint32
+	started    bool
+}
+
+func newPatternDecoder(codec, ffmpeg string) (*patternDecoder, error) {
+	format, ok := patternFormats[codec]
+	if !ok {
+		return nil, fmt.Errorf("unknown codec %q", codec)
+	}
+
+	// Every frame leaves the decoder as soon as it can, without probing or frame threads
+	cmd := exec.Command(ffmpeg, "-hide_banner", "-loglevel", "error",
+		"-fflags", "nobuffer", "-flags", "low_delay", "-probesize", "32", "-analyzeduration", "0",
+		"-threads", "1", "-f", format, "-i", "pipe:0",
+		"-vf", fmt.Sprintf("scale=%d:%d", patternWidth, patternHeight), "-pix_fmt", "gray", "-f", "rawvideo", "pipe:1")
+	cmd.Stderr = os.Stderr
+
+	stdin, err := cmd.StdinPipe()
+	if err != nil {
+		return nil, err
+	}
+	stdout, err := cmd.StdoutPipe()
+	if err != nil {
+		return nil, err
+	}
+	if err := cmd.Start(); err != nil {
+		return nil, err
+	}
+
+	d := &patternDecoder{
+		cmd:      cmd,
+		frames:   make(chan []byte, 64),
+		done:     make(chan struct{}),
+		complete: map[uint64]int64{},
+	}
+
+	go func() {
+		for frame := range d.frames {
+			if _, err := stdin.Write(frame); err != nil {
+				log.Printf("pattern: decoder input failed: %v", err)
+				break
+			}
+		}
+		stdin.Close()
+		for range d.frames {
+		}
+	}()
+
+	go func() {
+		defer close(d.done)
+		image := make([]byte, patternWidth*patternHeight)
+		for {
+			if _, err := io.ReadFull(stdout, image); err != nil {
+				return
+			}
+			d.decoded(image, time.Now())
+		}
+	}()
+	return d, nil
+}
+
+// frame hands the payload of a complete frame to the decoder, in the order of the frames
+func (d *patternDecoder) frame(payload []byte, captureTime uint64, complete int64) {
+	d.mu.Lock()
+	d.complete[captureTime] = complete
+	d.order = append(d.order, captureTime)
+	if len(d.order) > 1024 {
+		delete(d.complete, d.order[0])
+		d.order = d.order[1:]
+	}
+	d.mu.Unlock()
+
+	select {
+	case d.frames <- payload:
+	default:
+		d.mu.Lock()
+		d.stats.Dropped++
+		d.mu.Unlock()
+	}
+}
+
+func (d *patternDecoder) decoded(image []byte, now time.Time) {
+	number, captureTime, ok := readPattern(image, patternWidth, patternHeight)
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	d.stats.Decoded++
+	if !ok {
+		d.stats.Unreadable++
+		return
+	}
+	d.stats.Read++
+
+	if d.started {
+		switch {
+		case number == d.lastNumber:
+			d.stats.Repeated++
+			return
+		case int32(number-d.lastNumber) > 0:
+			d.stats.Skipped += uint64(number - d.lastNumber - 1)
+		}
+	}
+	d.lastNumber = number
+	d.started = true
+
+	decoded := now.UnixMicro()
+	d.stats.latency = append(d.stats.latency, float64(decoded-int64(captureTime))/1000)
+	if complete, ok := d.complete[captureTime]; ok {
+		d.stats.decode = append(d.stats.decode, float64(decoded-complete)/1000)
+	}
+}
+
+// close waits for the decoder to drain and returns what it read
+func (d *patternDecoder) close() *patternResult {
+	close(d.frames)
+	select {
+	case <-d.done:
+	case <-time.After(5 * time.Second):
+		d.cmd.Process.Kill()
+		<-d.done
+	}
+	d.cmd.Wait()
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	return &patternResult{patternStats: &d.stats, Latency: d.stats.latency.summary(), Decode: d.stats.decode.summary()}
+}
+
+// readPattern reads the frame number and the capture time from the luma of a decoded frame
+func readPattern(image []byte, width, height int) (number uint32, captureTime uint64, ok bool) {
+	var levels [patternColumns * patternRows]int
+	darkest, brightest := 255, 0
+	for cell := range levels {
+		column, row := cell%patternColumns, cell/patternColumns
+
+		// The middle half of the cell, its edges blur with its neighbours
+		x0, x1 := (4*column+1)*width/128, (4*column+3)*width/128
+		y0, y1 := (4*row+1)*height/128, (4*row+3)*height/128
+		sum, count := 0, 0
+		for y := y0; y <= y1; y++ {
+			for x := x0; x <= x1; x++ {
+				sum += int(image[y*width+x])
+				count++
+			}
+		}
+		levels[cell] = sum / count
+		darkest = min(darkest, levels[cell])
+		brightest = max(brightest, levels[cell])
+	}
+	if brightest-darkest < 64 {
+		return 0, 0, false
+	}
+
+	threshold := (darkest + brightest) / 2
+	var bytes [16]byte
+	for cell, level := range levels {
+		if level > threshold {
+			bytes[cell/8] |= 1 << (cell % 8)
+		}
+	}
+
+	if binary.LittleEndian.Uint16(bytes[14:]) != patternSyncWord || binary.LittleEndian.Uint16(bytes[12:]) != crc16(bytes[:12]) {
+		return 0, 0, false
+	}
+	return binary.LittleEndian.Uint32(bytes[0:]), binary.LittleEndian.Uint64(bytes[4:]), true
+}
+
+// CRC-16/CCITT-FALSE, as test_pattern::crc16()
+func crc16(data []byte) uint16 {
+	crc := uint16(0xFFFF)
+	for _, b := range data {
+		crc ^= uint16(b) << 8
+		for bit := 0; bit < 8; bit++ {
+			if crc&0x8000 != 0 {
+				crc = crc<<1 ^ 0x1021
+			} else {
+				crc <<= 1
+			}
+		}
+	}
+	return crc
+}
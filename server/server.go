@@ -1,3 +1,21 @@
+// Receiver and load generator for the UDP transport of the sender.
+//
+// Every client reassembles the video shards of a rung and the audio packets, recovers what FEC can
+// recover and measures loss, jitter, throughput and the one-way latency from the timestamps of the
+// datagram headers, so the clocks of both hosts must be synchronized for the latency to be meaningful.
+// The first client receives on the destinations given to the sender on its command line, any other
+// client subscribes as a viewer from the control channel. The results are printed as JSON.
+//
+//	sunshine <display>+audio 127.0.0.1:32520 127.0.0.1:32521 127.0.0.1:32522 &
+//	go run . -control 127.0.0.1:32520 -video :32521 -audio :32522 -clients 8 -duration 30s
+//
+// When the sender streams its test pattern, the first client decodes the video with ffmpeg and reads
+// the frame number and the capture time back, the latency from the capture until the frame was decoded.
+//
+//	sunshine <display>+pattern 127.0.0.1:32520 127.0.0.1:32521 &
+//	go run . -control 127.0.0.1:32520 -video :32521 -pattern h264
+//
+// Encrypted streams are decrypted with the key the sender has, the same SUNSHINE_STREAM_KEY.
 package main
 
 /*
@@ -18,50 +36,220 @@ typedef struct {
 */
 import "C"
 import (
+	"crypto/cipher"
+	"encoding/json"
+	"flag"
 	"fmt"
 	"log"
 	"net"
 	"os"
+	"os/signal"
+	"strconv"
+	"strings"
+	"sync"
 	"time"
 	"unsafe"
 )
 
-func main() {
-	// listen to incoming udp packets
-	pc, err := net.ListenPacket("udp", ":32521")
-	if err != nil {
-		log.Fatal(err)
+type options struct {
+	control         *net.UDPAddr
+	advertise       net.IP
+	videoAddress    string
+	audioAddress    string
+	clients         int
+	rung            int
+	audioSession    int
+	duration        time.Duration
+	timeout         time.Duration
+	reportInterval  time.Duration
+	idrInterval     time.Duration
+	bitrates        []uint32
+	bitrateInterval time.Duration
+	rfi             bool
+	verify          bool
+	drop            float64
+	socketBuffer    int
+	output          string
+	pattern         string
+	ffmpeg          string
+	aead            cipher.AEAD // Of SUNSHINE_STREAM_KEY, nil if the streams aren't encrypted
+}
+
+func parseOptions() (*options, error) {
+	opts := &options{}
+	control := flag.String("control", "", "Control endpoint of the sender, the second argument of sunshine; empty to only receive")
+	advertise := flag.String("advertise", "", "Address the sender reaches the viewers at, by default the local address towards -control")
+	flag.StringVar(&opts.videoAddress, "video", ":32521", "Address the sender sends the video of the rung to, empty without video")
+	flag.StringVar(&opts.audioAddress, "audio", "", "Address the sender sends the audio to, empty without audio")
+	flag.IntVar(&opts.clients, "clients", 1, "Concurrent clients, all but the first subscribe as viewers")
+	flag.IntVar(&opts.rung, "rung", 0, "Session of the video, the rung of the simulcast ladder")
+	flag.IntVar(&opts.audioSession, "audio-session", 1, "Session of the audio, it follows the rungs of the video")
+	flag.DurationVar(&opts.duration, "duration", 30*time.Second, "Length of the benchmark, it also ends on SIGINT")
+	flag.DurationVar(&opts.timeout, "timeout", 200*time.Millisecond, "Frames not complete this long after their first datagram are lost")
+	flag.DurationVar(&opts.reportInterval, "report", 100*time.Millisecond, "Interval of the receiver reports of the first client, 0 disables them")
+	flag.DurationVar(&opts.idrInterval, "idr", 0, "Interval of the IDR requests of the first client, 0 disables them")
+	bitrates := flag.String("bitrates", "", "Bitrates in kbps the first client cycles through, such as 5000,20000")
+	flag.DurationVar(&opts.bitrateInterval, "bitrate-interval", 5*time.Second, "Time between bitrate changes")
+	flag.BoolVar(&opts.rfi, "rfi", true, "Request reference frame invalidation of lost frames")
+	flag.BoolVar(&opts.verify, "verify", true, "Erase and recover the data shards of complete FEC blocks to verify the parity")
+	flag.Float64Var(&opts.drop, "drop", 0, "Percentage of media datagrams discarded on arrival to exercise FEC")
+	flag.IntVar(&opts.socketBuffer, "socket-buffer", 8*1024*1024, "Receive buffer of every socket in bytes")
+	flag.StringVar(&opts.output, "o", "-", "File the JSON results are written to, - for stdout")
+	flag.StringVar(&opts.pattern, "pattern", "", "Codec of the test pattern the sender streams, h264, hevc or av1; the first client decodes it to measure the latency until decoded")
+	flag.StringVar(&opts.ffmpeg, "ffmpeg", "ffmpeg", "ffmpeg executable that decodes the test pattern")
+	flag.Parse()
+
+	if opts.clients < 1 {
+		return nil, fmt.Errorf("at least one client is needed")
+	}
+	if opts.videoAddress == "" && opts.audioAddress == "" {
+		return nil, fmt.Errorf("neither -video nor -audio is given")
+	}
+	if _, ok := patternFormats[opts.pattern]; opts.pattern != "" && (!ok || opts.videoAddress == "") {
+		return nil, fmt.Errorf("-pattern needs -video and one of h264, hevc or av1")
 	}
-	defer pc.Close()
 
-	go func() {
-		var metadata C.QueueMetadata
-		for {
-			data,err := os.ReadFile("C:\\ideacrawler\\binary\\metadata.bin")
-			if err != nil {
-				panic(err)
-			}
+	for _, value := range strings.Split(*bitrates, ",") {
+		if value = strings.TrimSpace(value); value == "" {
+			continue
+		}
+		bitrate, err := strconv.ParseUint(value, 10, 32)
+		if err != nil || bitrate == 0 {
+			return nil, fmt.Errorf("invalid bitrate %q", value)
+		}
+		opts.bitrates = append(opts.bitrates, uint32(bitrate))
+	}
+	if opts.bitrateInterval <= 0 {
+		return nil, fmt.Errorf("invalid bitrate interval %v", opts.bitrateInterval)
+	}
 
-			from := unsafe.Pointer(&data[0])
-			to := unsafe.Pointer(&metadata)
-			C.memcpy(to,from,C.ulonglong(len(data)))
+	var err error
+	if opts.aead, err = streamCipher(); err != nil {
+		return nil, err
+	}
 
-			fmt.Printf("%v\n",metadata)
-			time.Sleep(time.Second)
+	if *control == "" {
+		if opts.clients > 1 {
+			return nil, fmt.Errorf("viewers subscribe from the control channel, -control is needed")
 		}
-	}()
+		return opts, nil
+	}
+
+	if opts.control, err = net.ResolveUDPAddr("udp", *control); err != nil {
+		return nil, err
+	}
 
-	fmt.Printf("start serving\n")
-	buf := make([]byte, 1024*1024*10)
-	for {
-		_, addr, err := pc.ReadFrom(buf)
+	if *advertise != "" {
+		if opts.advertise = net.ParseIP(*advertise); opts.advertise == nil {
+			return nil, fmt.Errorf("invalid address %q", *advertise)
+		}
+	} else {
+		// Nothing is sent, connecting only picks the route
+		conn, err := net.DialUDP("udp", nil, opts.control)
 		if err != nil {
-			fmt.Printf("error serving %s\n", err.Error())
+			return nil, err
 		}
+		opts.advertise = conn.LocalAddr().(*net.UDPAddr).IP
+		conn.Close()
+	}
+	return opts, nil
+}
+
+// Metadata is pushed by the sender whenever it changes, prefixed by the Metadata event type
+func printMetadata(id int, datagram []byte) {
+	if len(datagram) != 1+C.sizeof_QueueMetadata {
+		return
+	}
+
+	var metadata C.QueueMetadata
+	C.memcpy(unsafe.Pointer(&metadata), unsafe.Pointer(&datagram[1]), C.sizeof_QueueMetadata)
+	log.Printf("client %d: metadata %+v", id, metadata)
+}
 
-		_, err = pc.WriteTo([]byte{6, 0}, addr)
+type clientResult struct {
+	Client   int               `json:"client"`
+	Video    *streamResult     `json:"video,omitempty"`
+	Audio    *streamResult     `json:"audio,omitempty"`
+	Sent     map[string]uint64 `json:"control_sent"`
+	Acks     map[string]uint64 `json:"control_acks"`
+	Metadata uint64            `json:"metadata"`
+	Pattern  *patternResult    `json:"pattern,omitempty"`
+}
+
+type results struct {
+	Clients   int            `json:"clients"`
+	Duration  float64        `json:"duration_s"`
+	Video     *streamResult  `json:"video,omitempty"` // All clients together
+	Audio     *streamResult  `json:"audio,omitempty"`
+	PerClient []clientResult `json:"per_client"`
+}
+
+func main() {
+	opts, err := parseOptions()
+	if err != nil {
+		log.Fatal(err)
+	}
+
+	var clients []*client
+	for id := 0; id < opts.clients; id++ {
+		c, err := newClient(id, opts)
 		if err != nil {
-			panic(err)
+			log.Fatalf("client %d: %v", id, err)
+		}
+		clients = append(clients, c)
+	}
+
+	interrupt := make(chan os.Signal, 1)
+	signal.Notify(interrupt, os.Interrupt)
+
+	done := make(chan struct{})
+	var wg sync.WaitGroup
+	start := time.Now()
+	for _, c := range clients {
+		wg.Add(1)
+		go func(c *client) {
+			defer wg.Done()
+			c.run(done)
+		}(c)
+	}
+	log.Printf("receiving with %d clients for %v", len(clients), opts.duration)
+
+	select {
+	case <-time.After(opts.duration):
+	case <-interrupt:
+	}
+	close(done)
+	wg.Wait()
+
+	r := results{Clients: len(clients), Duration: time.Since(start).Seconds()}
+	video, audio := &streamStats{}, &streamStats{}
+	for _, c := range clients {
+		video.merge(&c.videoRx.stats)
+		audio.merge(&c.audioRx.stats)
+		r.PerClient = append(r.PerClient, clientResult{
+			Client:   c.id,
+			Video:    c.videoRx.stats.result(),
+			Audio:    c.audioRx.stats.result(),
+			Sent:     c.sent,
+			Acks:     c.acks,
+			Metadata: c.metadata,
+			Pattern:  c.pattern,
+		})
+	}
+	r.Video = video.result()
+	r.Audio = audio.result()
+
+	out := os.Stdout
+	if opts.output != "-" {
+		if out, err = os.Create(opts.output); err != nil {
+			log.Fatal(err)
 		}
+		defer out.Close()
+	}
+
+	encoder := json.NewEncoder(out)
+	encoder.SetIndent("", "  ")
+	if err := encoder.Encode(r); err != nil {
+		log.Fatal(err)
 	}
 }
@@ -0,0 +1,217 @@
+package main
+
+import (
+	"math"
+	"sort"
+	"time"
+)
+
+// Milliseconds of a stage of every frame
+type samples []float64
+
+type summary struct {
+	Count int     `json:"count"`
+	Mean  float64 `json:"mean_ms"`
+	P50   float64 `json:"p50_ms"`
+	P95   float64 `json:"p95_ms"`
+	P99   float64 `json:"p99_ms"`
+	Max   float64 `json:"max_ms"`
+}
+
+func (s samples) summary() summary {
+	if len(s) == 0 {
+		return summary{}
+	}
+
+	sorted := append(samples(nil), s...)
+	sort.Float64s(sorted)
+
+	sum := 0.0
+	for _, v := range sorted {
+		sum += v
+	}
+	at := func(p float64) float64 {
+		return sorted[int(math.Ceil(p*float64(len(sorted))))-1]
+	}
+	return summary{len(sorted), sum / float64(len(sorted)), at(0.5), at(0.95), at(0.99), sorted[len(sorted)-1]}
+}
+
+// Interarrival jitter of RFC 3550, the variation of the transit time of consecutive frames
+type jitter struct {
+	value   float64 // Microseconds
+	transit int64
+	started bool
+}
+
+func (j *jitter) update(arrival, capture int64) {
+	transit := arrival - capture
+	if j.started {
+		d := math.Abs(float64(transit - j.transit))
+		j.value += (d - j.value) / 16
+	}
+	j.transit = transit
+	j.started = true
+}
+
+// Counters and timings of the video or the audio of a client
+type streamStats struct {
+	Datagrams  uint64 `json:"datagrams"`
+	Bytes      uint64 `json:"bytes"`
+	Frames     uint64 `json:"frames"`
+	FrameBytes uint64 `json:"frame_bytes"`
+	Recovered  uint64 `json:"recovered"` // Frames or packets that only FEC completed
+	Lost       uint64 `json:"lost"`
+	Shards     uint64 `json:"shards"`
+	LostShards uint64 `json:"lost_shards"` // Of frames that at least partially arrived
+	IDR        uint64 `json:"idr,omitempty"`
+	AfterRFI   uint64 `json:"after_rfi,omitempty"`
+	Late       uint64 `json:"late"` // Datagrams of frames that were already given up on
+	Duplicates uint64 `json:"duplicates"`
+	Malformed  uint64 `json:"malformed"`
+	Forged     uint64 `json:"forged"`  // Encrypted datagrams that failed authentication, or arrived without a key
+	Dropped    uint64 `json:"dropped"` // Discarded on purpose to simulate loss
+
+	FecVerified   uint64 `json:"fec_verified"` // Complete blocks whose erasure test passed
+	FecMismatches uint64 `json:"fec_mismatches"`
+
+	first, last time.Time
+	latency     samples // Capture until the frame was complete on this host
+	network     samples // Handed to the pacer until complete
+	encode      samples // Capture until the encoder returned the frame
+	jitter      jitter
+}
+
+func (s *streamStats) datagram(size int, now time.Time) {
+	if s.first.IsZero() {
+		s.first = now
+	}
+	s.last = now
+	s.Datagrams++
+	s.Bytes += uint64(size)
+}
+
+// A frame is complete, times are microseconds since the Unix epoch
+func (s *streamStats) frame(size int, encode, send uint32, captureTime uint64, complete int64) {
+	s.Frames++
+	s.FrameBytes += uint64(size)
+
+	s.latency = append(s.latency, float64(complete-int64(captureTime))/1000)
+	s.network = append(s.network, float64(complete-int64(captureTime)-int64(send))/1000)
+	if encode != 0 {
+		s.encode = append(s.encode, float64(encode)/1000)
+	}
+	s.jitter.update(complete, int64(captureTime))
+}
+
+func (s *streamStats) merge(other *streamStats) {
+	s.Datagrams += other.Datagrams
+	s.Bytes += other.Bytes
+	s.Frames += other.Frames
+	s.FrameBytes += other.FrameBytes
+	s.Recovered += other.Recovered
+	s.Lost += other.Lost
+	s.Shards += other.Shards
+	s.LostShards += other.LostShards
+	s.IDR += other.IDR
+	s.AfterRFI += other.AfterRFI
+	s.Late += other.Late
+	s.Duplicates += other.Duplicates
+	s.Malformed += other.Malformed
+	s.Forged += other.Forged
+	s.Dropped += other.Dropped
+	s.FecVerified += other.FecVerified
+	s.FecMismatches += other.FecMismatches
+
+	if !other.first.IsZero() && (s.first.IsZero() || other.first.Before(s.first)) {
+		s.first = other.first
+	}
+	if other.last.After(s.last) {
+		s.last = other.last
+	}
+	s.latency = append(s.latency, other.latency...)
+	s.network = append(s.network, other.network...)
+	s.encode = append(s.encode, other.encode...)
+	s.jitter.value = math.Max(s.jitter.value, other.jitter.value)
+}
+
+type streamResult struct {
+	*streamStats
+	Seconds       float64 `json:"seconds"`
+	ThroughputBps float64 `json:"throughput_bps"` // Every datagram, including headers and parity
+	GoodputBps    float64 `json:"goodput_bps"`    // Payload of the complete frames
+	LossRate      float64 `json:"loss_rate"`      // Frames that neither arrived nor were recovered
+	ShardLossRate float64 `json:"shard_loss_rate"`
+	JitterMs      float64 `json:"jitter_ms"`
+	Latency       summary `json:"latency"`
+	Network       summary `json:"network"`
+	Encode        summary `json:"encode"`
+}
+
+func (s *streamStats) result() *streamResult {
+	if s.Datagrams == 0 {
+		return nil
+	}
+
+	r := &streamResult{streamStats: s, JitterMs: s.jitter.value / 1000}
+	r.Seconds = s.last.Sub(s.first).Seconds()
+	if r.Seconds > 0 {
+		r.ThroughputBps = float64(s.Bytes) * 8 / r.Seconds
+		r.GoodputBps = float64(s.FrameBytes) * 8 / r.Seconds
+	}
+	if frames := s.Frames + s.Lost; frames > 0 {
+		r.LossRate = float64(s.Lost) / float64(frames)
+	}
+	if shards := s.Shards + s.LostShards; shards > 0 {
+		r.ShardLossRate = float64(s.LostShards) / float64(shards)
+	}
+	r.Latency = s.latency.summary()
+	r.Network = s.network.summary()
+	r.Encode = s.encode.summary()
+	return r
+}
+
+// Counters of a congestion::receiver_report_t since the previous report
+type reportWindow struct {
+	start         time.Time
+	received      uint32
+	lost          uint32
+	bytes         uint32
+	delaySum      int64 // Microseconds from handing each shard to the pacer until it arrived
+	delayCount    int64
+	previousDelay int64
+	hasPrevious   bool
+}
+
+func (w *reportWindow) shard(size int, delay int64) {
+	w.received++
+	w.bytes += uint32(size)
+	w.delaySum += delay
+	w.delayCount++
+}
+
+func (w *reportWindow) lostShards(n int) {
+	w.lost += uint32(n)
+}
+
+// take returns the value of a ReceiverReport command and starts the next window
+func (w *reportWindow) take(now time.Time) []byte {
+	interval := now.Sub(w.start).Milliseconds()
+	if w.start.IsZero() {
+		interval = 0
+	}
+
+	// The gradient is the change of the mean one-way delay, the offset between the clocks cancels out
+	gradient := int64(0)
+	if w.delayCount > 0 {
+		delay := w.delaySum / w.delayCount
+		if w.hasPrevious {
+			gradient = delay - w.previousDelay
+		}
+		w.previousDelay = delay
+		w.hasPrevious = true
+	}
+
+	value := u32s(uint32(interval), w.received, w.lost, w.bytes, uint32(int32(gradient)))
+	*w = reportWindow{start: now, previousDelay: w.previousDelay, hasPrevious: w.hasPrevious}
+	return value
+}
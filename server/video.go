@@ -0,0 +1,310 @@
+package main
+
+import (
+	"crypto/cipher"
+	"time"
+)
+
+// Shards of a slice of a frame, payloads by shard index with the parity shards after the data shards
+type videoSlice struct {
+	header    videoHeader // Of the first shard that arrived
+	shards    [][]byte
+	received  int
+	shardSize int // Payload of a full shard, the parity shards always are
+	verified  []bool
+	complete  bool
+	recovered bool
+}
+
+type videoFrame struct {
+	slices    map[uint8]*videoSlice
+	lastSlice int // -1 until the slice without MORE_SLICES arrived
+	first     time.Time
+	complete  int64 // Microseconds since the Unix epoch, 0 until every slice is complete
+	decided   bool
+}
+
+// Reassembles the frames of a rung and decides in order whether each arrived, FEC recovered it or it was lost
+type videoReceiver struct {
+	timeout time.Duration
+	verify  bool
+	aead    cipher.AEAD // Decrypts the encrypted shards, nil without a key
+	stats   streamStats
+
+	frames  map[uint32]*videoFrame
+	next    uint32 // Oldest frame not decided yet
+	started bool
+
+	// Since the last receiver report
+	report reportWindow
+
+	// Decodes the complete frames when the sender streams the test pattern, nil otherwise
+	pattern *patternDecoder
+}
+
+func newVideoReceiver(timeout time.Duration, verify bool, aead cipher.AEAD) *videoReceiver {
+	return &videoReceiver{timeout: timeout, verify: verify, aead: aead, frames: map[uint32]*videoFrame{}}
+}
+
+// Frames far behind the oldest frame that isn't decided yet come from a new stream
+const resyncFrames = 1024
+
+// before reports whether frame index a precedes b, indices wrap around
+func before(a, b uint32) bool {
+	return int32(a-b) < 0
+}
+
+func (v *videoReceiver) shard(b []byte, now time.Time) {
+	h, ok := parseVideoHeader(b)
+	if !ok || int(h.shardIndex) >= h.totalShards() {
+		v.stats.Malformed++
+		return
+	}
+
+	// Parity is computed over the plaintext, FEC works on the decrypted shards. The datagram buffer is reused
+	// for the next one, the payload gets a buffer of its own
+	payload, ok := openPayload(v.aead, b, videoHeaderSize, h.flags)
+	if !ok {
+		v.stats.Forged++
+		return
+	}
+
+	// The sender restarted its frame indices, or this is the first frame
+	if !v.started || int32(h.frameIndex-v.next) < -resyncFrames {
+		v.frames = map[uint32]*videoFrame{}
+		v.next = h.frameIndex
+		v.started = true
+	}
+	if before(h.frameIndex, v.next) && v.frames[h.frameIndex] == nil {
+		v.stats.Late++
+		return
+	}
+
+	frame := v.frames[h.frameIndex]
+	if frame == nil {
+		frame = &videoFrame{slices: map[uint8]*videoSlice{}, lastSlice: -1, first: now}
+		v.frames[h.frameIndex] = frame
+	}
+	if h.flags&flagMoreSlices == 0 {
+		frame.lastSlice = int(h.slice)
+	}
+
+	slice := frame.slices[h.slice]
+	if slice == nil {
+		slice = &videoSlice{header: h, shards: make([][]byte, h.totalShards()), verified: make([]bool, h.blocks())}
+		frame.slices[h.slice] = slice
+	}
+	if len(slice.shards) != h.totalShards() {
+		v.stats.Malformed++
+		return
+	}
+	if slice.shards[h.shardIndex] != nil {
+		v.stats.Duplicates++
+		return
+	}
+
+	slice.shards[h.shardIndex] = payload
+	slice.received++
+	slice.shardSize = max(slice.shardSize, len(payload))
+	v.stats.Shards++
+	v.report.shard(len(b), now.UnixMicro()-int64(h.captureTime)-int64(h.sendTime))
+
+	if !slice.complete {
+		v.complete(slice)
+	}
+	if v.verify && slice.received == len(slice.shards) {
+		v.verifySlice(slice)
+	}
+
+	if frame.complete == 0 && frame.lastSlice >= 0 {
+		for x := 0; x <= frame.lastSlice; x++ {
+			if s := frame.slices[uint8(x)]; s == nil || !s.complete {
+				return
+			}
+		}
+		frame.complete = now.UnixMicro()
+	}
+}
+
+// Data shards of block b of a slice with zero padding, the short last block is filled with zeroes
+func (s *videoSlice) block(b int) [][]byte {
+	h := &s.header
+	data, parity := int(h.fecData), int(h.fecParity)
+
+	shards := make([][]byte, data+parity)
+	for x := 0; x < data; x++ {
+		index := b*data + x
+		if index >= int(h.shardCount) {
+			shards[x] = make([]byte, s.shardSize)
+		} else if s.shards[index] != nil {
+			shards[x] = padded(s.shards[index], s.shardSize)
+		}
+	}
+	for x := 0; x < parity; x++ {
+		shards[data+x] = s.shards[int(h.shardCount)+b*parity+x]
+	}
+	return shards
+}
+
+func (v *videoReceiver) complete(s *videoSlice) {
+	h := &s.header
+	count := int(h.shardCount)
+
+	missing := 0
+	for x := 0; x < count; x++ {
+		if s.shards[x] == nil {
+			missing++
+		}
+	}
+	if missing == 0 {
+		s.complete = true
+		return
+	}
+
+	// Without a parity shard the size of a full shard isn't known for sure yet
+	if h.blocks() == 0 || s.received == count-missing {
+		return
+	}
+
+	data := int(h.fecData)
+	for b := 0; b < h.blocks(); b++ {
+		shards := s.block(b)
+		present := 0
+		for _, shard := range shards {
+			if shard != nil {
+				present++
+			}
+		}
+		if present == len(shards) || present < data {
+			continue
+		}
+
+		recovered, ok := reconstruct(shards, data, s.shardSize)
+		if !ok {
+			continue
+		}
+		for _, x := range recovered {
+			index := b*data + x
+			if index < count && s.shards[index] == nil {
+				s.shards[index] = shards[x]
+				missing--
+				s.recovered = true
+			}
+		}
+	}
+
+	s.complete = missing == 0
+}
+
+func (v *videoReceiver) verifySlice(s *videoSlice) {
+	data := int(s.header.fecData)
+	for b := range s.verified {
+		if s.verified[b] {
+			continue
+		}
+		s.verified[b] = true
+
+		if verifyBlock(s.block(b), data, s.shardSize) {
+			v.stats.FecVerified++
+		} else {
+			v.stats.FecMismatches++
+		}
+	}
+}
+
+// decide gives up on frames that didn't complete in time and returns the first and the last
+// index of the frames that were lost, in order to invalidate them
+func (v *videoReceiver) decide(now time.Time) (lost [][2]uint32) {
+	for v.started {
+		frame := v.frames[v.next]
+		if frame != nil && frame.complete != 0 {
+			v.account(frame)
+			v.next++
+			continue
+		}
+
+		// A frame nothing arrived of is lost once a later frame waited as long as a late one would
+		deadline := time.Time{}
+		if frame != nil {
+			deadline = frame.first
+		} else {
+			for index, f := range v.frames {
+				if before(v.next, index) && (deadline.IsZero() || f.first.Before(deadline)) {
+					deadline = f.first
+				}
+			}
+		}
+		if deadline.IsZero() || now.Sub(deadline) < v.timeout {
+			break
+		}
+
+		v.stats.Lost++
+		if frame != nil {
+			frame.decided = true
+		}
+		if n := len(lost); n > 0 && lost[n-1][1]+1 == v.next {
+			lost[n-1][1] = v.next
+		} else {
+			lost = append(lost, [2]uint32{v.next, v.next})
+		}
+		v.next++
+	}
+
+	// Decided frames are kept for the parity that follows their data, for the erasure test and the loss count
+	for index, frame := range v.frames {
+		if !frame.decided || now.Sub(frame.first) < v.timeout {
+			continue
+		}
+
+		for _, s := range frame.slices {
+			v.stats.LostShards += uint64(len(s.shards) - s.received)
+			v.report.lostShards(len(s.shards) - s.received)
+		}
+		delete(v.frames, index)
+	}
+	return lost
+}
+
+func (v *videoReceiver) account(frame *videoFrame) {
+	frame.decided = true
+
+	size := 0
+	recovered := false
+	var first *videoHeader
+	for _, s := range frame.slices {
+		size += int(s.header.frameSize)
+		recovered = recovered || s.recovered
+		if s.header.slice == 0 {
+			first = &s.header
+		}
+	}
+
+	if first.flags&flagIDR != 0 {
+		v.stats.IDR++
+	}
+	if first.flags&flagAfterRFI != 0 {
+		v.stats.AfterRFI++
+	}
+	if recovered {
+		v.stats.Recovered++
+	}
+	v.stats.frame(size, first.encodeTime, first.sendTime, first.captureTime, frame.complete)
+
+	if v.pattern != nil {
+		v.pattern.frame(frame.payload(), first.captureTime, frame.complete)
+	}
+}
+
+// The bitstream of a complete frame, the data shards of its slices in order
+func (f *videoFrame) payload() []byte {
+	var payload []byte
+	for x := 0; x <= f.lastSlice; x++ {
+		s := f.slices[uint8(x)]
+		start := len(payload)
+		for _, shard := range s.shards[:s.header.shardCount] {
+			payload = append(payload, shard...)
+		}
+		payload = payload[:min(len(payload), start+int(s.header.frameSize))]
+	}
+	return payload
+}
@@ -0,0 +1,215 @@
+package main
+
+import (
+	"crypto/aes"
+	"crypto/cipher"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"os"
+)
+
+// Datagram headers of src/stream.h, all fields are little-endian
+const (
+	headerVersion = 2
+
+	flagIDR        = 0x01
+	flagAfterRFI   = 0x02
+	flagMoreSlices = 0x04
+	flagEncrypted  = 0x08 // The only flag of audio
+
+	videoHeaderSize = 36
+	audioHeaderSize = 28
+)
+
+type videoHeader struct {
+	flags       uint8
+	slice       uint8
+	fecData     uint8 // Data shards per FEC block, the last block may be shorter
+	fecParity   uint8 // Parity shards per FEC block, 0 when FEC is disabled
+	captureTime uint64
+	frameIndex  uint32
+	frameSize   uint32
+	encodeTime  uint32
+	sendTime    uint32
+	shardIndex  uint16
+	shardCount  uint16 // Data shards, the parity shards follow them
+}
+
+func parseVideoHeader(b []byte) (h videoHeader, ok bool) {
+	if len(b) < videoHeaderSize || b[0] != headerVersion {
+		return h, false
+	}
+
+	h.flags = b[1]
+	h.slice = b[2]
+	h.fecData = b[3]
+	h.fecParity = b[4]
+	h.captureTime = binary.LittleEndian.Uint64(b[8:])
+	h.frameIndex = binary.LittleEndian.Uint32(b[16:])
+	h.frameSize = binary.LittleEndian.Uint32(b[20:])
+	h.encodeTime = binary.LittleEndian.Uint32(b[24:])
+	h.sendTime = binary.LittleEndian.Uint32(b[28:])
+	h.shardIndex = binary.LittleEndian.Uint16(b[32:])
+	h.shardCount = binary.LittleEndian.Uint16(b[34:])
+	return h, h.shardCount > 0
+}
+
+// Number of FEC blocks the data shards are spread over, 0 without FEC
+func (h *videoHeader) blocks() int {
+	if h.fecParity == 0 || h.fecData == 0 {
+		return 0
+	}
+	return (int(h.shardCount) + int(h.fecData) - 1) / int(h.fecData)
+}
+
+func (h *videoHeader) totalShards() int {
+	return int(h.shardCount) + h.blocks()*int(h.fecParity)
+}
+
+type audioHeader struct {
+	fecIndex    uint8 // Position within the FEC block, parity shards start at fecData
+	fecData     uint8
+	fecParity   uint8  // 0 when FEC is disabled
+	payloadSize uint16 // Of the plaintext
+	flags       uint8
+	captureTime uint64
+	frameIndex  uint32 // Parity carries the index of the first packet of its block
+	encodeTime  uint32
+	sendTime    uint32
+}
+
+func parseAudioHeader(b []byte) (h audioHeader, ok bool) {
+	if len(b) < audioHeaderSize || b[0] != headerVersion {
+		return h, false
+	}
+
+	h.fecIndex = b[1]
+	h.fecData = b[2]
+	h.fecParity = b[3]
+	h.payloadSize = binary.LittleEndian.Uint16(b[4:])
+	h.flags = b[6]
+	h.captureTime = binary.LittleEndian.Uint64(b[8:])
+	h.frameIndex = binary.LittleEndian.Uint32(b[16:])
+	h.encodeTime = binary.LittleEndian.Uint32(b[20:])
+	h.sendTime = binary.LittleEndian.Uint32(b[24:])
+	return h, true
+}
+
+// Encrypted datagrams of src/cipher.h carry the IV, the AES-GCM ciphertext and the tag behind the header,
+// with the header as additional authenticated data
+const (
+	ivSize  = 12
+	tagSize = 16
+)
+
+// The cipher of the key in SUNSHINE_STREAM_KEY, nil if the variable isn't set
+func streamCipher() (cipher.AEAD, error) {
+	value := os.Getenv("SUNSHINE_STREAM_KEY")
+	if value == "" {
+		return nil, nil
+	}
+
+	key, err := hex.DecodeString(value)
+	if err != nil || (len(key) != 16 && len(key) != 32) {
+		return nil, fmt.Errorf("SUNSHINE_STREAM_KEY must be 32 or 64 hex digits")
+	}
+	block, err := aes.NewCipher(key)
+	if err != nil {
+		return nil, err
+	}
+	return cipher.NewGCM(block)
+}
+
+// The payload behind a header of headerSize bytes in a buffer of its own, decrypted if the flags say
+// it's encrypted. Fails for an encrypted payload without the key or whose tag doesn't match
+func openPayload(aead cipher.AEAD, b []byte, headerSize int, flags uint8) ([]byte, bool) {
+	if flags&flagEncrypted == 0 {
+		return append([]byte(nil), b[headerSize:]...), true
+	}
+	if aead == nil || len(b) < headerSize+ivSize+tagSize {
+		return nil, false
+	}
+
+	payload, err := aead.Open(nil, b[headerSize:headerSize+ivSize], b[headerSize+ivSize:], b[:headerSize])
+	return payload, err == nil
+}
+
+// Control channel of src/control.h
+const (
+	controlVersion   = 0xC1
+	allSessions      = 0xFF
+	flagAckRequested = 0x01
+	flagReply        = 0x80
+
+	messageHeaderSize = 4
+	commandHeaderSize = 4
+)
+
+// EventType of smemory.h
+const (
+	eventBitrate             = 1
+	eventIdr                 = 3
+	eventInvalidateRefFrames = 7
+	eventMetadata            = 9
+	eventReceiverReport      = 10
+	eventSubscribe           = 12
+	eventUnsubscribe         = 13
+	eventCursorUpdate        = 14
+)
+
+// control::status_e
+var statusNames = []string{"ok", "unknown_command", "invalid_session", "invalid_value", "late", "forbidden"}
+
+type command struct {
+	typ     uint8
+	session uint8
+	value   []byte
+}
+
+func u32s(values ...uint32) []byte {
+	b := make([]byte, 0, 4*len(values))
+	for _, v := range values {
+		b = binary.LittleEndian.AppendUint32(b, v)
+	}
+	return b
+}
+
+// A versioned datagram, every command is acknowledged with its status
+func encodeControl(sequence uint16, commands ...command) []byte {
+	b := []byte{controlVersion, flagAckRequested}
+	b = binary.LittleEndian.AppendUint16(b, sequence)
+	for _, c := range commands {
+		b = append(b, c.typ, c.session)
+		b = binary.LittleEndian.AppendUint16(b, uint16(len(c.value)))
+		b = append(b, c.value...)
+	}
+	return b
+}
+
+// Calls fn with the status of every acknowledged command of a reply
+func parseReply(b []byte, fn func(typ uint8, status string)) bool {
+	if len(b) < messageHeaderSize || b[0] != controlVersion || b[1]&flagReply == 0 {
+		return false
+	}
+
+	b = b[messageHeaderSize:]
+	for len(b) >= commandHeaderSize {
+		typ := b[0]
+		length := int(binary.LittleEndian.Uint16(b[2:]))
+		if len(b) < commandHeaderSize+length {
+			break
+		}
+
+		value := b[commandHeaderSize : commandHeaderSize+length]
+		if length == 1 {
+			status := "unknown"
+			if int(value[0]) < len(statusNames) {
+				status = statusNames[value[0]]
+			}
+			fn(typ, status)
+		}
+		b = b[commandHeaderSize+length:]
+	}
+	return true
+}
@@ -1,14 +1,26 @@
-#define QUEUE_SIZE 128
-#ifdef _WIN32
-#define PACKET_SIZE 512 * 1024
+// Bytes of the packet ring of every queue, a power of two
+#define RING_SIZE (8 * 1024 * 1024)
+// Largest packet, a packet never takes more than half of the ring
+#define PACKET_SIZE (RING_SIZE / 2 - RECORD_ALIGNMENT)
+// Largest value of an event
+#define EVENT_SIZE 4096
+
+// Records start on their own cache line, so do the producer and the consumer positions
+#define CACHE_LINE_SIZE 64
+#define RECORD_ALIGNMENT CACHE_LINE_SIZE
+
+#ifdef __cplusplus
+#define CACHE_ALIGNED alignas(CACHE_LINE_SIZE)
 #else
-#define PACKET_SIZE 1024 * 1024
+#define CACHE_ALIGNED _Alignas(CACHE_LINE_SIZE)
 #endif
 
 
 enum QueueType {
     Video,
     Audio,
+    // Cursor shapes and positions for clients that draw the cursor themselves
+    Cursor,
     QueueMax
 };
 
@@ -19,12 +31,43 @@ typedef enum _EventType {
     Idr,
     Hdr,
     Stop,
+    FecPercentage,
+    InvalidateRefFrames,
+    LatencyReport,
+    // Sent to the control peer with the QueueMetadata that follows, whenever it changes
+    Metadata,
+    // Receiver report of the client, feeds the congestion controller of the rung
+    ReceiverReport,
+    // Shards of a video frame the client lost, resent from the retransmission cache
+    Nack,
+    // Add or remove a viewer that gets the packets of the session next to its destination
+    Subscribe,
+    Unsubscribe,
+    // Sent to the control peer with a CursorShapeHeader or a CursorPositionRecord that follows
+    CursorUpdate,
+    // Loss in percent Opus protects the audio against with in-band FEC, 0 disables it
+    AudioPacketLoss,
+    // 1 lets Opus skip the packets of silence, 0 sends every packet
+    AudioDtx,
+    // Write the timeline of the pipeline to the trace file, only builds with SUNSHINE_ENABLE_TRACE have one
+    TraceDump,
+    // Counters of the session for dashboards, answered with a metrics::report_t of src/metrics.h
+    Metrics,
+    // Give a session started in standby its destination and the settings of the client
+    Start,
+    // Decode capabilities of the client, the session picks the most efficient codec both ends have
+    Negotiate,
     EventMax
 } EventType;
 
 typedef struct {
     int is_idr;
+    // Time since the previous packet, in steady_clock ticks
     long long duration;
+    // Microseconds since the Unix epoch, the clock is the one of the datagram headers
+    long long capture_time;
+    // Microseconds from the capture until the encoder returned the packet, 0 when unknown
+    int encode_time;
 }PacketMetadata;
 
 typedef struct {
@@ -40,11 +83,43 @@ typedef struct {
     float scalar_inv;
 }QueueMetadata;
 
+typedef enum _RecordType {
+    RecordPacket,
+    // The rest of the ring is unused, the next record starts at the beginning of the ring
+    RecordWrap,
+} RecordType;
+
+// Header of a record in the ring, the payload follows right after it
 typedef struct {
+    int type;
     int size;
     PacketMetadata metadata;
-    char data[PACKET_SIZE];
-} Packet;
+} RecordHeader;
+
+typedef enum _CursorRecordType {
+    CursorShape,
+    CursorPosition,
+} CursorRecordType;
+
+#pragma pack(push, 1)
+// Rows of a cursor shape, row_count rows of width premultiplied BGRA pixels follow it.
+// A shape is sent once per hash, it may be split into several records of consecutive rows.
+typedef struct {
+    int type;
+    unsigned long long hash;
+    int width, height;
+    int hotspot_x, hotspot_y;
+    int first_row, row_count;
+} CursorShapeHeader;
+
+// Top-left corner of the cursor image in pixels of the captured display, drawn with the shape of shape_hash
+typedef struct {
+    int type;
+    unsigned long long shape_hash;
+    int x, y;
+    int visible;
+} CursorPositionRecord;
+#pragma pack(pop)
 
 typedef enum _DataType {
     HDR_INFO,
@@ -57,14 +132,37 @@ typedef struct {
     DataType type;
     int data_size;
     int value_number;
-    char value_raw[PACKET_SIZE];
+    char value_raw[EVENT_SIZE];
 } Event;
 
+/*
+ * Packets are records of a byte-addressed ring. Positions only ever grow, the offset in the ring
+ * is the position modulo RING_SIZE. The producer never waits for consumers, a consumer whose next
+ * record the producer may already be coming around to skips ahead to the latest packet.
+ */
 typedef struct _Queue{
+    // Written by the producer
+    // Position after the last record, published with release semantics once the record is written
+    CACHE_ALIGNED unsigned long long head;
+    // Position up to which the producer may be writing, set before the record is written.
+    // Bytes more than RING_SIZE before it may have been overwritten.
+    unsigned long long claim;
+    // Number of the last packet, published after head, consumers sleep on a futex on it
     int index;
+    // Consumers sleeping on index, the producer only wakes them when there are any
+    int waiters;
+
+    // Written by the consumer
+    // Position the consumer has read up to
+    CACHE_ALIGNED unsigned long long tail;
+
+    // Odd while the producer updates metadata, readers retry until it is even and unchanged
+    int metadata_sequence;
     QueueMetadata metadata;
     Event events[EventMax];
-    Packet array[QUEUE_SIZE];
+
+    // Records are aligned to RECORD_ALIGNMENT
+    CACHE_ALIGNED char ring[RING_SIZE];
 }Queue;
 
 typedef struct {
@@ -0,0 +1,714 @@
+#include "amf_base.h"
+
+#include "src/config.h"
+#include "src/logging.h"
+#include "src/stat_trackers.h"
+#include "src/utility.h"
+
+#include <AMF/components/VideoEncoderAV1.h>
+#include <AMF/components/VideoEncoderHEVC.h>
+#include <AMF/components/VideoEncoderVCE.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <tuple>
+
+namespace {
+
+  // Frames between two long-term reference frames, one of them is always old enough to predate a loss
+  constexpr uint64_t LTR_INTERVAL = 8;
+
+  // Blocks the capture reports as changed are always encoded at the highest importance
+  constexpr int MAX_IMPORTANCE = 10;
+
+  std::string
+  narrow(const wchar_t *name) {
+    std::string result;
+    for (; *name; ++name) {
+      result += (char) *name;
+    }
+    return result;
+  }
+
+}  // namespace
+
+namespace amfenc {
+
+  /**
+   * @brief Names of the properties that differ between the AVC, HEVC and AV1 components.
+   * @details Properties of only some codecs are nullptr for the others.
+   */
+  struct codec_properties_t {
+    const wchar_t *component;
+    const wchar_t *usage;
+    const wchar_t *profile;
+    const wchar_t *bit_depth;
+    const wchar_t *frame_size;
+    const wchar_t *frame_rate;
+    const wchar_t *rate_control;
+    const wchar_t *target_bitrate;
+    const wchar_t *peak_bitrate;
+    const wchar_t *vbv_buffer_size;
+    const wchar_t *quality_preset;
+    const wchar_t *enforce_hrd;
+    const wchar_t *filler_data;
+    const wchar_t *preanalysis;
+    const wchar_t *vbaq;
+    const wchar_t *gop_size;
+    const wchar_t *slices;
+    const wchar_t *max_ref_frames;
+    const wchar_t *max_ltr_frames;
+    const wchar_t *query_timeout;
+    const wchar_t *color_profile;
+    const wchar_t *transfer_characteristic;
+    const wchar_t *color_primaries;
+
+    // Per frame
+    const wchar_t *force_picture_type;
+    amf_int64 idr_picture_type;
+    const wchar_t *insert_headers[2];
+    const wchar_t *mark_ltr;
+    const wchar_t *force_ltr_reference;
+    const wchar_t *roi_data;
+    uint32_t roi_block_size;
+
+    // Output
+    const wchar_t *output_type;
+    amf_int64 idr_output_type;
+  };
+
+  constexpr codec_properties_t avc_properties {
+    AMFVideoEncoderVCE_AVC,
+    AMF_VIDEO_ENCODER_USAGE,
+    AMF_VIDEO_ENCODER_PROFILE,
+    nullptr,
+    AMF_VIDEO_ENCODER_FRAMESIZE,
+    AMF_VIDEO_ENCODER_FRAMERATE,
+    AMF_VIDEO_ENCODER_RATE_CONTROL_METHOD,
+    AMF_VIDEO_ENCODER_TARGET_BITRATE,
+    AMF_VIDEO_ENCODER_PEAK_BITRATE,
+    AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE,
+    AMF_VIDEO_ENCODER_QUALITY_PRESET,
+    AMF_VIDEO_ENCODER_ENFORCE_HRD,
+    AMF_VIDEO_ENCODER_FILLER_DATA_ENABLE,
+    AMF_VIDEO_ENCODER_PREENCODE_ENABLE,
+    AMF_VIDEO_ENCODER_ENABLE_VBAQ,
+    AMF_VIDEO_ENCODER_IDR_PERIOD,
+    AMF_VIDEO_ENCODER_SLICES_PER_FRAME,
+    AMF_VIDEO_ENCODER_MAX_NUM_REFRAMES,
+    AMF_VIDEO_ENCODER_MAX_LTR_FRAMES,
+    AMF_VIDEO_ENCODER_QUERY_TIMEOUT,
+    AMF_VIDEO_ENCODER_OUTPUT_COLOR_PROFILE,
+    AMF_VIDEO_ENCODER_OUTPUT_TRANSFER_CHARACTERISTIC,
+    AMF_VIDEO_ENCODER_OUTPUT_COLOR_PRIMARIES,
+    AMF_VIDEO_ENCODER_FORCE_PICTURE_TYPE,
+    AMF_VIDEO_ENCODER_PICTURE_TYPE_IDR,
+    { AMF_VIDEO_ENCODER_INSERT_SPS, AMF_VIDEO_ENCODER_INSERT_PPS },
+    AMF_VIDEO_ENCODER_MARK_CURRENT_WITH_LTR_INDEX,
+    AMF_VIDEO_ENCODER_FORCE_LTR_REFERENCE_BITFIELD,
+    AMF_VIDEO_ENCODER_ROI_DATA,
+    16,
+    AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE,
+    AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_IDR,
+  };
+
+  constexpr codec_properties_t hevc_properties {
+    AMFVideoEncoder_HEVC,
+    AMF_VIDEO_ENCODER_HEVC_USAGE,
+    AMF_VIDEO_ENCODER_HEVC_PROFILE,
+    AMF_VIDEO_ENCODER_HEVC_COLOR_BIT_DEPTH,
+    AMF_VIDEO_ENCODER_HEVC_FRAMESIZE,
+    AMF_VIDEO_ENCODER_HEVC_FRAMERATE,
+    AMF_VIDEO_ENCODER_HEVC_RATE_CONTROL_METHOD,
+    AMF_VIDEO_ENCODER_HEVC_TARGET_BITRATE,
+    AMF_VIDEO_ENCODER_HEVC_PEAK_BITRATE,
+    AMF_VIDEO_ENCODER_HEVC_VBV_BUFFER_SIZE,
+    AMF_VIDEO_ENCODER_HEVC_QUALITY_PRESET,
+    AMF_VIDEO_ENCODER_HEVC_ENFORCE_HRD,
+    AMF_VIDEO_ENCODER_HEVC_FILLER_DATA_ENABLE,
+    AMF_VIDEO_ENCODER_HEVC_PREENCODE_ENABLE,
+    AMF_VIDEO_ENCODER_HEVC_ENABLE_VBAQ,
+    AMF_VIDEO_ENCODER_HEVC_GOP_SIZE,
+    AMF_VIDEO_ENCODER_HEVC_SLICES_PER_FRAME,
+    AMF_VIDEO_ENCODER_HEVC_MAX_NUM_REFRAMES,
+    AMF_VIDEO_ENCODER_HEVC_MAX_LTR_FRAMES,
+    AMF_VIDEO_ENCODER_HEVC_QUERY_TIMEOUT,
+    AMF_VIDEO_ENCODER_HEVC_OUTPUT_COLOR_PROFILE,
+    AMF_VIDEO_ENCODER_HEVC_OUTPUT_TRANSFER_CHARACTERISTIC,
+    AMF_VIDEO_ENCODER_HEVC_OUTPUT_COLOR_PRIMARIES,
+    AMF_VIDEO_ENCODER_HEVC_FORCE_PICTURE_TYPE,
+    AMF_VIDEO_ENCODER_HEVC_PICTURE_TYPE_IDR,
+    { AMF_VIDEO_ENCODER_HEVC_INSERT_HEADER, nullptr },
+    AMF_VIDEO_ENCODER_HEVC_MARK_CURRENT_WITH_LTR_INDEX,
+    AMF_VIDEO_ENCODER_HEVC_FORCE_LTR_REFERENCE_BITFIELD,
+    AMF_VIDEO_ENCODER_HEVC_ROI_DATA,
+    64,
+    AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE,
+    AMF_VIDEO_ENCODER_HEVC_OUTPUT_DATA_TYPE_IDR,
+  };
+
+  constexpr codec_properties_t av1_properties {
+    AMFVideoEncoder_AV1,
+    AMF_VIDEO_ENCODER_AV1_USAGE,
+    AMF_VIDEO_ENCODER_AV1_PROFILE,
+    AMF_VIDEO_ENCODER_AV1_COLOR_BIT_DEPTH,
+    AMF_VIDEO_ENCODER_AV1_FRAMESIZE,
+    AMF_VIDEO_ENCODER_AV1_FRAMERATE,
+    AMF_VIDEO_ENCODER_AV1_RATE_CONTROL_METHOD,
+    AMF_VIDEO_ENCODER_AV1_TARGET_BITRATE,
+    AMF_VIDEO_ENCODER_AV1_PEAK_BITRATE,
+    AMF_VIDEO_ENCODER_AV1_VBV_BUFFER_SIZE,
+    AMF_VIDEO_ENCODER_AV1_QUALITY_PRESET,
+    AMF_VIDEO_ENCODER_AV1_ENFORCE_HRD,
+    AMF_VIDEO_ENCODER_AV1_FILLER_DATA,
+    AMF_VIDEO_ENCODER_AV1_RATE_CONTROL_PREENCODE,
+    nullptr,
+    AMF_VIDEO_ENCODER_AV1_GOP_SIZE,
+    nullptr,
+    AMF_VIDEO_ENCODER_AV1_MAX_NUM_REFRAMES,
+    AMF_VIDEO_ENCODER_AV1_MAX_LTR_FRAMES,
+    AMF_VIDEO_ENCODER_AV1_QUERY_TIMEOUT,
+    AMF_VIDEO_ENCODER_AV1_OUTPUT_COLOR_PROFILE,
+    AMF_VIDEO_ENCODER_AV1_OUTPUT_TRANSFER_CHARACTERISTIC,
+    AMF_VIDEO_ENCODER_AV1_OUTPUT_COLOR_PRIMARIES,
+    AMF_VIDEO_ENCODER_AV1_FORCE_FRAME_TYPE,
+    AMF_VIDEO_ENCODER_AV1_FORCE_FRAME_TYPE_KEY,
+    { AMF_VIDEO_ENCODER_AV1_FORCE_INSERT_SEQUENCE_HEADER, nullptr },
+    AMF_VIDEO_ENCODER_AV1_MARK_CURRENT_WITH_LTR_INDEX,
+    AMF_VIDEO_ENCODER_AV1_FORCE_LTR_REFERENCE_BITFIELD,
+    nullptr,
+    64,
+    AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE,
+    AMF_VIDEO_ENCODER_AV1_OUTPUT_FRAME_TYPE_KEY,
+  };
+
+  amf_base::amf_base():
+      bitstream_pool(std::make_shared<buffer_pool::pool_t>(buffer_pool::ENCODER_SLABS)) {
+  }
+
+  amf_base::~amf_base() {
+    // Use destroy_encoder() instead
+  }
+
+  template <class T>
+  bool
+  amf_base::set_property(const wchar_t *name, const T &value, bool required) {
+    if (!name) return !required;
+
+    if (amf_failed(encoder->SetProperty(name, value))) {
+      if (required) {
+        BOOST_LOG(error) << "AMF: couldn't set " << narrow(name) << ": " << last_error_string;
+        return false;
+      }
+
+      BOOST_LOG(debug) << "AMF: ignoring unsupported " << narrow(name) << ": " << last_error_string;
+    }
+
+    return true;
+  }
+
+  bool
+  amf_base::create_encoder(const video::config_t &client_config, const video::sunshine_colorspace_t &colorspace, amf::AMF_SURFACE_FORMAT surface_format) {
+    if (!factory && !init_library()) return false;
+
+    if (encoder) destroy_encoder();
+    auto fail_guard = util::fail_guard([this] { destroy_encoder(); });
+
+    if (!context && !init_context()) return false;
+
+    encoder_params.width = client_config.width;
+    encoder_params.height = client_config.height;
+    encoder_params.surface_format = surface_format;
+    encoder_params.video_format = client_config.videoFormat;
+
+    auto &amd = config::video.amd;
+    int usage;
+    std::optional<int> rate_control, quality;
+    switch (client_config.videoFormat) {
+      case 0:
+        properties = &avc_properties;
+        usage = amd.amd_usage_h264.value_or(AMF_VIDEO_ENCODER_USAGE_ULTRA_LOW_LATENCY);
+        rate_control = amd.amd_rc_h264;
+        quality = amd.amd_quality_h264;
+        break;
+
+      case 1:
+        properties = &hevc_properties;
+        usage = amd.amd_usage_hevc.value_or(AMF_VIDEO_ENCODER_HEVC_USAGE_ULTRA_LOW_LATENCY);
+        rate_control = amd.amd_rc_hevc;
+        quality = amd.amd_quality_hevc;
+        break;
+
+      case 2:
+        properties = &av1_properties;
+        usage = amd.amd_usage_av1.value_or(AMF_VIDEO_ENCODER_AV1_USAGE_ULTRA_LOW_LATENCY);
+        rate_control = amd.amd_rc_av1;
+        quality = amd.amd_quality_av1;
+        break;
+
+      default:
+        BOOST_LOG(error) << "AMF: unknown video format " << client_config.videoFormat;
+        return false;
+    }
+
+    if (client_config.chromaSamplingType == 1) {
+      BOOST_LOG(error) << "AMF: YUV 4:4:4 encoding is not supported";
+      return false;
+    }
+
+    const bool ten_bit = surface_format == amf::AMF_SURFACE_P010;
+    if (ten_bit && client_config.videoFormat == 0) {
+      BOOST_LOG(error) << "AMF: 10-bit H.264 encoding is not supported";
+      return false;
+    }
+
+    auto &props = *properties;
+
+    if (amf_failed(factory->CreateComponent(context, props.component, &encoder))) {
+      BOOST_LOG(error) << "AMF: CreateComponent failed: " << last_error_string;
+      return false;
+    }
+
+    // The usage resets every other property to its defaults, so it comes first
+    if (!set_property(props.usage, (amf_int64) usage, true)) return false;
+
+    switch (client_config.videoFormat) {
+      case 0:
+        set_property(props.profile, (amf_int64) AMF_VIDEO_ENCODER_PROFILE_HIGH);
+        set_property(AMF_VIDEO_ENCODER_B_PIC_PATTERN, (amf_int64) 0);
+        set_property(AMF_VIDEO_ENCODER_LOWLATENCY_MODE, true);
+        set_property(AMF_VIDEO_ENCODER_CABAC_ENABLE, (amf_int64) amd.amd_coder);
+        set_property(AMF_VIDEO_ENCODER_FULL_RANGE_COLOR, colorspace.full_range);
+        break;
+
+      case 1:
+        set_property(props.profile, (amf_int64) (ten_bit ? AMF_VIDEO_ENCODER_HEVC_PROFILE_MAIN_10 : AMF_VIDEO_ENCODER_HEVC_PROFILE_MAIN));
+        set_property(AMF_VIDEO_ENCODER_HEVC_LOWLATENCY_MODE, true);
+        set_property(AMF_VIDEO_ENCODER_HEVC_NOMINAL_RANGE, (amf_int64) (colorspace.full_range ? AMF_VIDEO_ENCODER_HEVC_NOMINAL_RANGE_FULL : AMF_VIDEO_ENCODER_HEVC_NOMINAL_RANGE_STUDIO));
+        break;
+
+      case 2:
+        set_property(props.profile, (amf_int64) AMF_VIDEO_ENCODER_AV1_PROFILE_MAIN);
+        set_property(AMF_VIDEO_ENCODER_AV1_ENCODING_LATENCY_MODE, (amf_int64) AMF_VIDEO_ENCODER_AV1_ENCODING_LATENCY_MODE_LOWEST_LATENCY);
+        set_property(AMF_VIDEO_ENCODER_AV1_ALIGNMENT_MODE, (amf_int64) AMF_VIDEO_ENCODER_AV1_ALIGNMENT_MODE_NO_RESTRICTIONS);
+        break;
+    }
+
+    set_property(props.bit_depth, (amf_int64) (ten_bit ? AMF_COLOR_BIT_DEPTH_10 : AMF_COLOR_BIT_DEPTH_8));
+
+    if (!set_property(props.frame_size, AMFConstructSize(client_config.width, client_config.height), true) ||
+        !set_property(props.frame_rate, AMFConstructRate(client_config.framerate, 1), true)) {
+      return false;
+    }
+
+    if (rate_control) set_property(props.rate_control, (amf_int64) *rate_control);
+    if (quality) set_property(props.quality_preset, (amf_int64) *quality);
+
+    // A VBV of a single frame, like NvENC, keeps every frame close to the average size
+    const amf_int64 bitrate = (amf_int64) client_config.bitrate * 1000;
+    if (!set_property(props.target_bitrate, bitrate, true)) return false;
+    set_property(props.peak_bitrate, bitrate);
+    set_property(props.vbv_buffer_size, bitrate / client_config.framerate);
+
+    set_property(props.enforce_hrd, amd.amd_enforce_hrd.value_or(0) != 0);
+    set_property(props.filler_data, false);
+    if (amd.amd_preanalysis) set_property(props.preanalysis, *amd.amd_preanalysis != 0);
+    if (amd.amd_vbaq) set_property(props.vbaq, *amd.amd_vbaq != 0);
+
+    // I-frames are generated on demand
+    set_property(props.gop_size, (amf_int64) std::numeric_limits<std::int16_t>::max());
+    if (client_config.slicesPerFrame > 1) set_property(props.slices, (amf_int64) client_config.slicesPerFrame);
+    if (client_config.numRefFrames) set_property(props.max_ref_frames, (amf_int64) client_config.numRefFrames);
+
+    // QueryOutput() waits for the frame instead of returning AMF_REPEAT right away
+    set_property(props.query_timeout, (amf_int64) 100);
+
+    auto [color_profile, transfer, primaries] = [&]() -> std::tuple<amf_int64, amf_int64, amf_int64> {
+      switch (colorspace.colorspace) {
+        case video::colorspace_e::rec601:
+          return {
+            colorspace.full_range ? AMF_VIDEO_CONVERTER_COLOR_PROFILE_FULL_601 : AMF_VIDEO_CONVERTER_COLOR_PROFILE_601,
+            AMF_COLOR_TRANSFER_CHARACTERISTIC_SMPTE170M,
+            AMF_COLOR_PRIMARIES_SMPTE170M,
+          };
+
+        case video::colorspace_e::rec709:
+        default:
+          return {
+            colorspace.full_range ? AMF_VIDEO_CONVERTER_COLOR_PROFILE_FULL_709 : AMF_VIDEO_CONVERTER_COLOR_PROFILE_709,
+            AMF_COLOR_TRANSFER_CHARACTERISTIC_BT709,
+            AMF_COLOR_PRIMARIES_BT709,
+          };
+
+        case video::colorspace_e::bt2020sdr:
+          return {
+            colorspace.full_range ? AMF_VIDEO_CONVERTER_COLOR_PROFILE_FULL_2020 : AMF_VIDEO_CONVERTER_COLOR_PROFILE_2020,
+            AMF_COLOR_TRANSFER_CHARACTERISTIC_BT2020_10,
+            AMF_COLOR_PRIMARIES_BT2020,
+          };
+
+        case video::colorspace_e::bt2020:
+          return {
+            colorspace.full_range ? AMF_VIDEO_CONVERTER_COLOR_PROFILE_FULL_2020 : AMF_VIDEO_CONVERTER_COLOR_PROFILE_2020,
+            AMF_COLOR_TRANSFER_CHARACTERISTIC_SMPTE2084,
+            AMF_COLOR_PRIMARIES_BT2020,
+          };
+      }
+    }();
+    set_property(props.color_profile, color_profile);
+    set_property(props.transfer_characteristic, transfer);
+    set_property(props.color_primaries, primaries);
+
+    // Long-term references are what invalidation falls back to, without them every loss costs an IDR frame
+    encoder_params.ltr_frames = (uint32_t) std::clamp(amd.amd_ltr_frames, 0, 8);
+    if (encoder_params.ltr_frames && !set_property(props.max_ltr_frames, (amf_int64) encoder_params.ltr_frames)) {
+      encoder_params.ltr_frames = 0;
+    }
+
+    auto status = encoder->Init(surface_format, client_config.width, client_config.height);
+    if (status != AMF_OK && encoder_params.ltr_frames) {
+      BOOST_LOG(warning) << "AMF: encoder doesn't accept " << encoder_params.ltr_frames << " long-term reference frames, reference frame invalidation is disabled";
+      encoder_params.ltr_frames = 0;
+      set_property(props.max_ltr_frames, (amf_int64) 0);
+      status = encoder->Init(surface_format, client_config.width, client_config.height);
+    }
+    if (amf_failed(status)) {
+      BOOST_LOG(error) << "AMF: encoder Init failed: " << last_error_string;
+      return false;
+    }
+
+    if (!create_input_buffer()) {
+      return false;
+    }
+
+    encoder_state.ltr_frame_indices.assign(encoder_params.ltr_frames, std::nullopt);
+
+    encoder_params.static_importance = std::clamp(amd.amd_static_importance, 0, MAX_IMPORTANCE);
+    encoder_params.roi_block_size = props.roi_block_size;
+    if (encoder_params.static_importance < MAX_IMPORTANCE && props.roi_data) {
+      const auto block_size = encoder_params.roi_block_size;
+      const auto blocks_x = (encoder_params.width + block_size - 1) / block_size;
+      const auto blocks_y = (encoder_params.height + block_size - 1) / block_size;
+      if (amf_failed(context->AllocSurface(amf::AMF_MEMORY_HOST, amf::AMF_SURFACE_GRAY32, blocks_x, blocks_y, &roi_map))) {
+        BOOST_LOG(warning) << "AMF: couldn't allocate the ROI map, damage is ignored: " << last_error_string;
+        roi_map = nullptr;
+      }
+    }
+
+    {
+      auto f = stat_trackers::one_digit_after_decimal();
+      BOOST_LOG(debug) << "AMF: requested encoded frame size " << f % (client_config.bitrate / 8. / client_config.framerate) << " kB";
+    }
+
+    {
+      std::string extra;
+      if (encoder_params.ltr_frames) extra += " ltr " + std::to_string(encoder_params.ltr_frames);
+      if (roi_map) extra += " roi " + std::to_string(encoder_params.static_importance);
+      if (client_config.slicesPerFrame > 1) extra += " slices " + std::to_string(client_config.slicesPerFrame);
+
+      std::string codec = client_config.videoFormat == 0 ? "H.264" :
+                          client_config.videoFormat == 1 ? "HEVC" :
+                                                           "AV1";
+      BOOST_LOG(info) << "AMF: created encoder " << codec << (ten_bit ? " 10-bit" : "") << extra;
+    }
+
+    fail_guard.disable();
+    return true;
+  }
+
+  void
+  amf_base::destroy_encoder() {
+    if (encoder) {
+      encoder->Terminate();
+      encoder = nullptr;
+    }
+
+    roi_map = nullptr;
+    damage_added = false;
+    pending_damage = std::nullopt;
+    properties = nullptr;
+
+    encoder_state = {};
+    encoder_params = {};
+  }
+
+  void
+  amf_base::add_damage(const std::optional<std::vector<platf::rect_t>> &damage) {
+    if (!damage_added) {
+      pending_damage = damage;
+      damage_added = true;
+    }
+    else if (pending_damage && damage) {
+      pending_damage->insert(pending_damage->end(), damage->begin(), damage->end());
+    }
+    else {
+      pending_damage = std::nullopt;
+    }
+  }
+
+  amf_encoded_frame
+  amf_base::encode_frame(uint64_t frame_index, bool force_idr) {
+    if (!encoder) {
+      return {};
+    }
+
+    auto &props = *properties;
+
+    amf::AMFSurfacePtr surface;
+    if (!create_input_surface(surface)) {
+      BOOST_LOG(error) << "AMF: couldn't wrap the input of frame " << frame_index;
+      return {};
+    }
+    surface->SetPts(frame_index);
+
+    // The first frame is an IDR frame anyway
+    if (!encoder_state.last_encoded_frame_index) {
+      force_idr = true;
+    }
+
+    if (force_idr) {
+      surface->SetProperty(props.force_picture_type, props.idr_picture_type);
+      for (auto name : props.insert_headers) {
+        if (name) surface->SetProperty(name, true);
+      }
+
+      // An IDR frame drops every reference, long-term ones included
+      std::fill(encoder_state.ltr_frame_indices.begin(), encoder_state.ltr_frame_indices.end(), std::nullopt);
+      encoder_state.pending_ltr_reference = std::nullopt;
+    }
+
+    bool after_ref_frame_invalidation = false;
+    if (encoder_params.ltr_frames) {
+      if (encoder_state.pending_ltr_reference) {
+        surface->SetProperty(props.force_ltr_reference, (amf_int64) (1 << *encoder_state.pending_ltr_reference));
+        after_ref_frame_invalidation = true;
+        encoder_state.pending_ltr_reference = std::nullopt;
+      }
+
+      // The IDR frame itself is left unmarked, the next frame can only reference it anyway
+      if (!force_idr && frame_index - encoder_state.last_ltr_mark >= LTR_INTERVAL) {
+        const auto slot = encoder_state.next_ltr_slot;
+        surface->SetProperty(props.mark_ltr, (amf_int64) slot);
+        encoder_state.ltr_frame_indices[slot] = frame_index;
+        encoder_state.next_ltr_slot = (slot + 1) % encoder_params.ltr_frames;
+        encoder_state.last_ltr_mark = frame_index;
+      }
+    }
+
+    // IDR frames are encoded at full quality, there is nothing to predict the unchanged blocks from
+    if (roi_map && damage_added && pending_damage && !force_idr) {
+      auto plane = roi_map->GetPlaneAt(0);
+      auto data = (uint8_t *) plane->GetNative();
+      const auto pitch = plane->GetHPitch();
+      const auto block_size = encoder_params.roi_block_size;
+      const auto blocks_x = (uint32_t) plane->GetWidth();
+      const auto blocks_y = (uint32_t) plane->GetHeight();
+
+      for (uint32_t y = 0; y < blocks_y; y++) {
+        auto row = (uint32_t *) (data + y * pitch);
+        std::fill_n(row, blocks_x, (uint32_t) encoder_params.static_importance);
+      }
+      for (auto &rect : *pending_damage) {
+        auto left = std::min<uint32_t>(std::max(rect.left, 0), encoder_params.width) / block_size;
+        auto top = std::min<uint32_t>(std::max(rect.top, 0), encoder_params.height) / block_size;
+        auto right = std::min<uint32_t>((std::max(rect.right, 0) + block_size - 1) / block_size, blocks_x);
+        auto bottom = std::min<uint32_t>((std::max(rect.bottom, 0) + block_size - 1) / block_size, blocks_y);
+
+        for (auto y = top; y < bottom; y++) {
+          std::fill_n((uint32_t *) (data + y * pitch) + left, right > left ? right - left : 0, (uint32_t) MAX_IMPORTANCE);
+        }
+      }
+
+      surface->SetProperty(props.roi_data, (amf::AMFInterface *) roi_map.GetPtr());
+    }
+    damage_added = false;
+    pending_damage = std::nullopt;
+
+    if (amf_failed(encoder->SubmitInput(surface))) {
+      BOOST_LOG(error) << "AMF: SubmitInput failed: " << last_error_string;
+      return {};
+    }
+
+    // Runtimes that ignore the query timeout return AMF_REPEAT until the frame is done
+    amf::AMFDataPtr data;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    while (true) {
+      auto status = encoder->QueryOutput(&data);
+      if (status == AMF_OK && data) break;
+
+      if (status != AMF_OK && status != AMF_REPEAT) {
+        amf_failed(status);
+        BOOST_LOG(error) << "AMF: QueryOutput failed: " << last_error_string;
+        return {};
+      }
+
+      if (std::chrono::steady_clock::now() >= deadline) {
+        BOOST_LOG(error) << "AMF: timed out waiting for frame " << frame_index;
+        return {};
+      }
+
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    amf::AMFBufferPtr buffer(data);
+    if (!buffer) {
+      BOOST_LOG(error) << "AMF: output of frame " << frame_index << " is not a buffer";
+      return {};
+    }
+
+    // The output buffer belongs to the encoder, so it has to be copied before the next frame
+    auto size = buffer->GetSize();
+    auto slab = bitstream_pool->acquire(size);
+    if (slab) {
+      std::memcpy(slab.data(), buffer->GetNative(), size);
+    }
+    else {
+      BOOST_LOG(error) << "AMF: couldn't allocate " << size << " bytes for frame " << frame_index;
+    }
+
+    amf_int64 output_type = -1;
+    buffer->GetProperty(props.output_type, &output_type);
+
+    amf_encoded_frame encoded_frame {
+      std::move(slab),
+      (uint64_t) buffer->GetPts(),
+      output_type == props.idr_output_type,
+      after_ref_frame_invalidation,
+    };
+
+    if (encoded_frame.idr) {
+      BOOST_LOG(debug) << "AMF: idr frame " << encoded_frame.frame_index;
+    }
+
+    if (after_ref_frame_invalidation) {
+      BOOST_LOG(debug) << "AMF: ref frame invalidation confirmed by frame " << encoded_frame.frame_index;
+    }
+
+    encoder_state.last_encoded_frame_index = frame_index;
+
+    return encoded_frame;
+  }
+
+  bool
+  amf_base::invalidate_ref_frames(uint64_t first_frame, uint64_t last_frame) {
+    if (!encoder || !encoder_params.ltr_frames) return false;
+
+    if (first_frame >= encoder_state.last_rfi_range.first &&
+        last_frame <= encoder_state.last_rfi_range.second) {
+      BOOST_LOG(debug) << "AMF: rfi request " << first_frame << "-" << last_frame << " already done";
+      return true;
+    }
+
+    if (last_frame < first_frame) {
+      BOOST_LOG(error) << "AMF: invalid rfi request " << first_frame << "-" << last_frame << ", generating IDR";
+      return false;
+    }
+
+    BOOST_LOG(debug) << "AMF: rfi request " << first_frame << "-" << last_frame << " expanding to last encoded frame " << encoder_state.last_encoded_frame_index;
+    last_frame = encoder_state.last_encoded_frame_index;
+
+    encoder_state.last_rfi_range = { first_frame, last_frame };
+
+    // Long-term references encoded since the loss predict from frames the client doesn't have
+    std::optional<uint32_t> newest_slot;
+    for (uint32_t slot = 0; slot < encoder_params.ltr_frames; slot++) {
+      auto &frame = encoder_state.ltr_frame_indices[slot];
+      if (frame && *frame >= first_frame) {
+        frame = std::nullopt;
+      }
+
+      if (frame && (!newest_slot || *frame > *encoder_state.ltr_frame_indices[*newest_slot])) {
+        newest_slot = slot;
+      }
+    }
+
+    if (!newest_slot) {
+      BOOST_LOG(debug) << "AMF: no long-term reference frame before " << first_frame << ", generating IDR";
+      return false;
+    }
+
+    // Whether the encoder keeps the other long-term references after this one is forced depends on its LTR mode,
+    // so only the forced one is trusted from here on
+    for (uint32_t slot = 0; slot < encoder_params.ltr_frames; slot++) {
+      if (slot != *newest_slot) encoder_state.ltr_frame_indices[slot] = std::nullopt;
+    }
+
+    BOOST_LOG(debug) << "AMF: recovering from long-term reference frame " << *encoder_state.ltr_frame_indices[*newest_slot];
+    encoder_state.pending_ltr_reference = newest_slot;
+
+    return true;
+  }
+
+  bool
+  amf_base::reconfigure(int bitrate, int framerate) {
+    if (!encoder || bitrate <= 0 || framerate <= 0) return false;
+
+    auto &props = *properties;
+
+    // Rate control properties are dynamic, the references survive the change
+    const amf_int64 bits = (amf_int64) bitrate * 1000;
+    if (!set_property(props.target_bitrate, bits, true) ||
+        !set_property(props.peak_bitrate, bits, true) ||
+        !set_property(props.vbv_buffer_size, bits / framerate, true) ||
+        !set_property(props.frame_rate, AMFConstructRate(framerate, 1), true)) {
+      return false;
+    }
+
+    {
+      auto f = stat_trackers::one_digit_after_decimal();
+      BOOST_LOG(debug) << "AMF: reconfigured encoded frame size " << f % (bitrate / 8. / framerate) << " kB";
+    }
+
+    return true;
+  }
+
+  bool
+  amf_base::amf_failed(AMF_RESULT status) {
+    auto status_string = [](AMF_RESULT status) -> std::string {
+      switch (status) {
+#define amf_status_case(x) \
+  case x:                  \
+    return #x;
+        amf_status_case(AMF_OK);
+        amf_status_case(AMF_FAIL);
+        amf_status_case(AMF_UNEXPECTED);
+        amf_status_case(AMF_ACCESS_DENIED);
+        amf_status_case(AMF_INVALID_ARG);
+        amf_status_case(AMF_OUT_OF_RANGE);
+        amf_status_case(AMF_OUT_OF_MEMORY);
+        amf_status_case(AMF_INVALID_POINTER);
+        amf_status_case(AMF_NO_INTERFACE);
+        amf_status_case(AMF_NOT_IMPLEMENTED);
+        amf_status_case(AMF_NOT_SUPPORTED);
+        amf_status_case(AMF_NOT_FOUND);
+        amf_status_case(AMF_ALREADY_INITIALIZED);
+        amf_status_case(AMF_NOT_INITIALIZED);
+        amf_status_case(AMF_INVALID_FORMAT);
+        amf_status_case(AMF_WRONG_STATE);
+        amf_status_case(AMF_NO_DEVICE);
+        amf_status_case(AMF_DIRECTX_FAILED);
+        amf_status_case(AMF_INPUT_FULL);
+        amf_status_case(AMF_EOF);
+        amf_status_case(AMF_REPEAT);
+        amf_status_case(AMF_NEED_MORE_INPUT);
+        amf_status_case(AMF_INVALID_RESOLUTION);
+        amf_status_case(AMF_ENCODER_NOT_PRESENT);
+#undef amf_status_case
+        default:
+          return std::to_string(status);
+      }
+    };
+
+    last_error_string.clear();
+    if (status != AMF_OK) {
+      last_error_string = status_string(status);
+      return true;
+    }
+
+    return false;
+  }
+
+}  // namespace amfenc
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "amf_encoded_frame.h"
+
+#include "src/platform/common.h"
+#include "src/video.h"
+#include "src/video_colorspace.h"
+
+#include <AMF/components/Component.h>
+#include <AMF/core/Context.h>
+#include <AMF/core/Factory.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace amfenc {
+
+  struct codec_properties_t;
+
+  /**
+   * @brief Drives the AMF encoder component directly, without going through FFmpeg.
+   * @details Frames are encoded synchronously, the caller converts into the input of the encoder
+   *          and waits for the bitstream of that frame.
+   */
+  class amf_base {
+  public:
+    amf_base();
+    virtual ~amf_base();
+
+    amf_base(const amf_base &) = delete;
+    amf_base &
+    operator=(const amf_base &) = delete;
+
+    bool
+    create_encoder(const video::config_t &client_config, const video::sunshine_colorspace_t &colorspace, amf::AMF_SURFACE_FORMAT surface_format);
+
+    void
+    destroy_encoder();
+
+    /**
+     * @brief Encode the frame in the input surface and wait for its bitstream.
+     */
+    amf_encoded_frame
+    encode_frame(uint64_t frame_index, bool force_idr);
+
+    /**
+     * @brief Record the regions of the input surface the next frame changes.
+     * @details Blocks outside of these regions get the importance `amd_static_importance` in the ROI map
+     *          of the frame, the changed blocks the highest one. Regions added before the same frame accumulate.
+     * @param damage Changed regions in input surface coordinates, std::nullopt if unknown.
+     */
+    void
+    add_damage(const std::optional<std::vector<platf::rect_t>> &damage);
+
+    /**
+     * @brief Make the next frame reference the newest long-term reference frame the client received.
+     * @return `false` if there is no such frame, an IDR frame must be forced instead.
+     */
+    bool
+    invalidate_ref_frames(uint64_t first_frame, uint64_t last_frame);
+
+    /**
+     * @brief Change the bitrate and framerate of the encoder without recreating it.
+     * @param bitrate Video bitrate in kilobits.
+     * @param framerate Requested framerate.
+     * @return `true` on success, `false` if the encoder has to be recreated.
+     */
+    bool
+    reconfigure(int bitrate, int framerate);
+
+  protected:
+    /**
+     * @brief Load the AMF runtime and set `factory`.
+     */
+    virtual bool
+    init_library() = 0;
+
+    /**
+     * @brief Create `context` on the device the input is converted on.
+     */
+    virtual bool
+    init_context() = 0;
+
+    /**
+     * @brief Create the input the frames are converted into, once the encoder exists.
+     */
+    virtual bool
+    create_input_buffer() = 0;
+
+    /**
+     * @brief Wrap the input the frame was converted into in an AMF surface.
+     */
+    virtual bool
+    create_input_surface(amf::AMFSurfacePtr &surface) = 0;
+
+    bool
+    amf_failed(AMF_RESULT status);
+
+    amf::AMFFactory *factory = nullptr;
+    amf::AMFContextPtr context;
+    amf::AMFComponentPtr encoder;
+
+    struct {
+      uint32_t width = 0;
+      uint32_t height = 0;
+      amf::AMF_SURFACE_FORMAT surface_format = amf::AMF_SURFACE_UNKNOWN;
+      int video_format = 0;
+      uint32_t ltr_frames = 0;
+      int static_importance = 0;
+      uint32_t roi_block_size = 16;
+    } encoder_params;
+
+    std::string last_error_string;
+
+  private:
+    template <class T>
+    bool
+    set_property(const wchar_t *name, const T &value, bool required = false);
+
+    const codec_properties_t *properties = nullptr;
+
+    // Encoded frames are copied out of the output buffer of the encoder into recycled slabs
+    std::shared_ptr<buffer_pool::pool_t> bitstream_pool;
+
+    // Damage of the next frame and the ROI map it is turned into, the encoder reads the map during SubmitInput()
+    bool damage_added = false;
+    std::optional<std::vector<platf::rect_t>> pending_damage;
+    amf::AMFSurfacePtr roi_map;
+
+    struct {
+      uint64_t last_encoded_frame_index = 0;
+      std::pair<uint64_t, uint64_t> last_rfi_range;
+
+      // Frame held by every long-term reference slot, std::nullopt if the slot can't be referenced
+      std::vector<std::optional<uint64_t>> ltr_frame_indices;
+      uint32_t next_ltr_slot = 0;
+      uint64_t last_ltr_mark = 0;
+
+      // Slot the next frame is forced to reference after an invalidation
+      std::optional<uint32_t> pending_ltr_reference;
+    } encoder_state;
+  };
+
+}  // namespace amfenc
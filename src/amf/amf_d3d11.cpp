@@ -0,0 +1,115 @@
+#include "src/logging.h"
+
+#ifdef _WIN32
+  #include "amf_d3d11.h"
+
+  #include "amf_utils.h"
+
+namespace amfenc {
+
+  amf_d3d11::amf_d3d11(ID3D11Device *d3d_device):
+      d3d_device(d3d_device) {
+  }
+
+  amf_d3d11::~amf_d3d11() {
+    if (encoder) destroy_encoder();
+
+    if (context) {
+      context->Terminate();
+      context = nullptr;
+    }
+
+    // The factory belongs to the runtime, it goes away with the library
+    factory = nullptr;
+    if (dll) {
+      FreeLibrary(dll);
+      dll = NULL;
+    }
+  }
+
+  ID3D11Texture2D *
+  amf_d3d11::get_input_texture() {
+    return d3d_input_texture.GetInterfacePtr();
+  }
+
+  bool
+  amf_d3d11::init_library() {
+    if (dll) return true;
+
+    if ((dll = LoadLibraryW(AMF_DLL_NAME))) {
+      if (auto amf_init = (AMFInit_Fn) GetProcAddress(dll, AMF_INIT_FUNCTION_NAME)) {
+        auto status = amf_init(AMF_FULL_VERSION, &factory);
+        if (status == AMF_OK && factory) {
+          return true;
+        }
+
+        amf_failed(status);
+        BOOST_LOG(error) << "AMFInit failed: " << last_error_string;
+        factory = nullptr;
+      }
+      else {
+        BOOST_LOG(error) << "No " << AMF_INIT_FUNCTION_NAME << " in the AMF runtime";
+      }
+    }
+    else {
+      BOOST_LOG(debug) << "Couldn't load the AMF runtime";
+    }
+
+    if (dll) {
+      FreeLibrary(dll);
+      dll = NULL;
+    }
+
+    return false;
+  }
+
+  bool
+  amf_d3d11::init_context() {
+    if (amf_failed(factory->CreateContext(&context))) {
+      BOOST_LOG(error) << "AMF: CreateContext failed: " << last_error_string;
+      return false;
+    }
+
+    if (amf_failed(context->InitDX11(d3d_device.GetInterfacePtr()))) {
+      BOOST_LOG(error) << "AMF: InitDX11 failed: " << last_error_string;
+      context = nullptr;
+      return false;
+    }
+
+    return true;
+  }
+
+  bool
+  amf_d3d11::create_input_buffer() {
+    if (d3d_input_texture) return true;
+
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = encoder_params.width;
+    desc.Height = encoder_params.height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = dxgi_format_from_amf_format(encoder_params.surface_format);
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+    if (d3d_device->CreateTexture2D(&desc, nullptr, &d3d_input_texture) != S_OK) {
+      BOOST_LOG(error) << "AMF: couldn't create input texture";
+      return false;
+    }
+
+    return true;
+  }
+
+  bool
+  amf_d3d11::create_input_surface(amf::AMFSurfacePtr &surface) {
+    // A fresh wrapper per frame, so the per-frame properties of the previous frame don't carry over
+    if (amf_failed(context->CreateSurfaceFromDX11Native(d3d_input_texture.GetInterfacePtr(), &surface, nullptr))) {
+      BOOST_LOG(error) << "AMF: CreateSurfaceFromDX11Native failed: " << last_error_string;
+      return false;
+    }
+
+    return true;
+  }
+
+}  // namespace amfenc
+#endif
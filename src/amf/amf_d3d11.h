@@ -0,0 +1,45 @@
+#pragma once
+#ifdef _WIN32
+
+  #include <comdef.h>
+  #include <d3d11.h>
+
+  #include "amf_base.h"
+
+namespace amfenc {
+
+  _COM_SMARTPTR_TYPEDEF(ID3D11Device, IID_ID3D11Device);
+  _COM_SMARTPTR_TYPEDEF(ID3D11Texture2D, IID_ID3D11Texture2D);
+
+  class amf_d3d11 final: public amf_base {
+  public:
+    amf_d3d11(ID3D11Device *d3d_device);
+    ~amf_d3d11();
+
+    /**
+     * @brief The texture frames are converted into, the encoder reads it without a copy.
+     * @details Created by `create_encoder()`.
+     */
+    ID3D11Texture2D *
+    get_input_texture();
+
+  private:
+    bool
+    init_library() override;
+
+    bool
+    init_context() override;
+
+    bool
+    create_input_buffer() override;
+
+    bool
+    create_input_surface(amf::AMFSurfacePtr &surface) override;
+
+    HMODULE dll = NULL;
+    const ID3D11DevicePtr d3d_device;
+    ID3D11Texture2DPtr d3d_input_texture;
+  };
+
+}  // namespace amfenc
+#endif
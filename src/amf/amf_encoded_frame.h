@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+#include "src/buffer_pool.h"
+
+namespace amfenc {
+  struct amf_encoded_frame {
+    buffer_pool::slab_t data;
+    uint64_t frame_index = 0;
+    bool idr = false;
+    bool after_ref_frame_invalidation = false;
+  };
+}  // namespace amfenc
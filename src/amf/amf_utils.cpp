@@ -0,0 +1,35 @@
+#include "amf_utils.h"
+
+namespace amfenc {
+
+#ifdef _WIN32
+  DXGI_FORMAT
+  dxgi_format_from_amf_format(amf::AMF_SURFACE_FORMAT format) {
+    switch (format) {
+      case amf::AMF_SURFACE_P010:
+        return DXGI_FORMAT_P010;
+
+      case amf::AMF_SURFACE_NV12:
+        return DXGI_FORMAT_NV12;
+
+      default:
+        return DXGI_FORMAT_UNKNOWN;
+    }
+  }
+#endif
+
+  amf::AMF_SURFACE_FORMAT
+  amf_format_from_sunshine_format(platf::pix_fmt_e format) {
+    switch (format) {
+      case platf::pix_fmt_e::nv12:
+        return amf::AMF_SURFACE_NV12;
+
+      case platf::pix_fmt_e::p010:
+        return amf::AMF_SURFACE_P010;
+
+      default:
+        return amf::AMF_SURFACE_UNKNOWN;
+    }
+  }
+
+}  // namespace amfenc
@@ -0,0 +1,21 @@
+#pragma once
+
+#ifdef _WIN32
+  #include <dxgiformat.h>
+#endif
+
+#include "src/platform/common.h"
+
+#include <AMF/core/Surface.h>
+
+namespace amfenc {
+
+#ifdef _WIN32
+  DXGI_FORMAT
+  dxgi_format_from_amf_format(amf::AMF_SURFACE_FORMAT format);
+#endif
+
+  amf::AMF_SURFACE_FORMAT
+  amf_format_from_sunshine_format(platf::pix_fmt_e format);
+
+}  // namespace amfenc
@@ -2,6 +2,7 @@
  * @file src/audio.cpp
  * @brief todo
  */
+#include <algorithm>
 #include <thread>
 
 #include <opus/opus_multistream.h>
@@ -12,13 +13,20 @@
 #include "config.h"
 #include "globals.h"
 #include "logging.h"
+#include "pcm.h"
 #include "thread_safe.h"
+#include "trace.h"
 #include "utility.h"
 
 namespace audio {
   using namespace std::literals;
   using opus_t = util::safe_ptr<OpusMSEncoder, opus_multistream_encoder_destroy>;
-  using sample_queue_t = std::shared_ptr<safe::queue_t<std::vector<std::int16_t>>>;
+  struct pcm_frame_t {
+    std::vector<std::int16_t> samples;
+    std::chrono::steady_clock::time_point capture_time;
+  };
+  using sample_queue_t = std::shared_ptr<safe::queue_t<pcm_frame_t>>;
+  using free_sample_queue_t = std::shared_ptr<safe::queue_t<std::vector<std::int16_t>>>;
 
   struct audio_ctx_t {
     // We want to change the sink for the first stream only
@@ -35,9 +43,6 @@ namespace audio {
   static void
   stop_audio_control(audio_ctx_t &);
 
-  int
-  map_stream(int channels, bool quality);
-
   constexpr auto SAMPLE_RATE = 48000;
 
   // NOTE: If you adjust the bitrates listed here, make sure to update the
@@ -95,31 +100,131 @@ namespace audio {
 
   auto control_shared = safe::make_shared<audio_ctx_t>(start_audio_control, stop_audio_control);
 
+  // Largest Opus packet, in bytes
+  constexpr std::size_t MAX_PACKET_SIZE = 1400;
+
+  // Highest bitrate a client may ask for, in kilobits per second
+  constexpr int MAX_BITRATE = 4096;
+
+  // What the client or the congestion controller change while streaming
+  struct encoder_settings_t {
+    int bitrate;  // Bits per second
+    int packet_loss_percentage;  // 0 disables in-band FEC
+    bool dtx;
+
+    bool
+    operator==(const encoder_settings_t &) const = default;
+  };
+
+  static void
+  apply_settings(OpusMSEncoder *opus, const encoder_settings_t &settings) {
+    opus_multistream_encoder_ctl(opus, OPUS_SET_BITRATE(settings.bitrate));
+    opus_multistream_encoder_ctl(opus, OPUS_SET_INBAND_FEC(settings.packet_loss_percentage ? 1 : 0));
+    opus_multistream_encoder_ctl(opus, OPUS_SET_PACKET_LOSS_PERC(settings.packet_loss_percentage));
+    opus_multistream_encoder_ctl(opus, OPUS_SET_DTX(settings.dtx ? 1 : 0));
+
+    // Silence is only cheaper with a variable bitrate, it stays constrained so packets don't burst
+    opus_multistream_encoder_ctl(opus, OPUS_SET_VBR(settings.dtx ? 1 : 0));
+    opus_multistream_encoder_ctl(opus, OPUS_SET_VBR_CONSTRAINT(1));
+  }
+
+  /**
+   * @brief Create the encoder for the settings.
+   * @details In-band FEC lives in the SILK layer, which OPUS_APPLICATION_RESTRICTED_LOWDELAY leaves out.
+   *          The encoder is only built with it, at 2.5 ms more of lookahead, while FEC is enabled.
+   */
+  static opus_t
+  make_encoder(const opus_stream_config_t &stream, const encoder_settings_t &settings) {
+    int status;
+    opus_t opus { opus_multistream_encoder_create(
+      stream.sampleRate,
+      stream.channelCount,
+      stream.streams,
+      stream.coupledStreams,
+      stream.mapping,
+      settings.packet_loss_percentage ? OPUS_APPLICATION_AUDIO : OPUS_APPLICATION_RESTRICTED_LOWDELAY,
+      &status) };
+
+    if (!opus) {
+      BOOST_LOG(error) << "Couldn't create audio encoder: "sv << opus_strerror(status);
+      return nullptr;
+    }
+
+    apply_settings(opus.get(), settings);
+    return opus;
+  }
+
   void
-  encodeThread(safe::mail_t mail,sample_queue_t samples, config_t config, void *channel_data) {
-    auto packets = mail->queue<packet_t>(mail::audio_packets);
+  encodeThread(safe::mail_t mail, sample_queue_t samples, free_sample_queue_t free_samples, config_t config, void *channel_data) {
+    auto packets = mail->queue<packet_t>(mail::audio_packets, mail::audio_packets_mode);
     auto stream = &stream_configs[map_stream(config.channels, config.flags[config_t::HIGH_QUALITY])];
 
     // Encoding takes place on this thread
     platf::adjust_thread_priority(platf::thread_priority_e::high);
+    platf::place_pipeline_thread("audio encode"sv);
+    TRACE_THREAD("audio encode");
 
-    opus_t opus { opus_multistream_encoder_create(
-      stream->sampleRate,
-      stream->channelCount,
-      stream->streams,
-      stream->coupledStreams,
-      stream->mapping,
-      OPUS_APPLICATION_RESTRICTED_LOWDELAY,
-      nullptr) };
-
-    opus_multistream_encoder_ctl(opus.get(), OPUS_SET_BITRATE(stream->bitrate));
-    opus_multistream_encoder_ctl(opus.get(), OPUS_SET_VBR(0));
-
-    auto frame_size = config.packetDuration * stream->sampleRate / 1000;
+    auto bitrate_event = mail->event<int>(mail::bitrate);
+    auto packet_loss_event = mail->event<int>(mail::audio_packet_loss);
+    auto dtx_event = mail->event<int>(mail::audio_dtx);
+
+    encoder_settings_t settings { stream->bitrate, 0, false };
+    auto opus = make_encoder(*stream, settings);
+    if (!opus) {
+      packets->stop();
+
+      return;
+    }
+
+    // As many packets as the queue to the sender holds, steady-state encoding allocates nothing
+    auto packet_pool = std::make_shared<buffer_pool::pool_t>(32);
+
+    auto frame_size = config.packetDuration * stream->sampleRate / 1000000;
+
+    // A silent Opus frame takes at most 2 bytes. Every stream but the last of a multistream packet
+    // is self-delimited, its length takes another byte
+    auto silence_size = 3 * stream->streams - 1;
     while (auto sample = samples->pop()) {
-      buffer_t packet { 1400 };
+      auto next = settings;
+      if (bitrate_event->peek()) {
+        next.bitrate = std::clamp(*bitrate_event->pop(), 1, MAX_BITRATE) * 1000;
+      }
+      if (packet_loss_event->peek()) {
+        next.packet_loss_percentage = std::clamp(*packet_loss_event->pop(), 0, 100);
+      }
+      if (dtx_event->peek()) {
+        next.dtx = *dtx_event->pop() != 0;
+      }
 
-      int bytes = opus_multistream_encode(opus.get(), sample->data(), frame_size, std::begin(packet), packet.size());
+      if (next != settings) {
+        BOOST_LOG(debug) << "Audio encoder: "sv << next.bitrate / 1000 << " kbps, in-band FEC for "sv << next.packet_loss_percentage << "%, DTX "sv << (next.dtx ? "on"sv : "off"sv);
+
+        // The application of the encoder can't change once it was created
+        if (!next.packet_loss_percentage != !settings.packet_loss_percentage) {
+          auto replacement = make_encoder(*stream, next);
+          if (!replacement) {
+            packets->stop();
+
+            return;
+          }
+          opus = std::move(replacement);
+        }
+        else {
+          apply_settings(opus.get(), next);
+        }
+        settings = next;
+      }
+
+      auto packet = packet_pool->acquire(MAX_PACKET_SIZE);
+      if (!packet) {
+        BOOST_LOG(error) << "Couldn't allocate audio packet"sv;
+        packets->stop();
+
+        return;
+      }
+
+      TRACE_SCOPE("audio.encode");
+      int bytes = opus_multistream_encode(opus.get(), sample->samples.data(), frame_size, packet.data(), MAX_PACKET_SIZE);
       if (bytes < 0) {
         BOOST_LOG(error) << "Couldn't encode audio: "sv << opus_strerror(bytes);
         packets->stop();
@@ -127,8 +232,16 @@ namespace audio {
         return;
       }
 
-      packet.fake_resize(bytes);
-      packets->raise(channel_data, std::move(packet));
+      // The capture reuses the samples for a later frame
+      free_samples->raise(std::move(sample->samples));
+
+      // Silence in every stream doesn't need to be sent
+      if (settings.dtx && bytes <= silence_size) {
+        continue;
+      }
+
+      packet.resize(bytes);
+      packets->raise(packet_t { channel_data, std::move(packet), sample->capture_time });
     }
   }
 
@@ -137,6 +250,13 @@ namespace audio {
     auto shutdown_event = mail->event<bool>(mail::shutdown);
     auto stream = &stream_configs[map_stream(config.channels, config.flags[config_t::HIGH_QUALITY])];
 
+    // Opus only encodes packets of these durations, the backends capture blocks of a single packet
+    if (config.packetDuration != 2500 && config.packetDuration != 5000 && config.packetDuration != 10000 && config.packetDuration != 20000) {
+      BOOST_LOG(error) << "Unsupported audio packet duration of "sv << config.packetDuration << " us"sv;
+      shutdown_event->view();
+      return;
+    }
+
     auto ref = control_shared.ref();
     if (!ref) {
       return;
@@ -191,7 +311,7 @@ namespace audio {
       }
     }
 
-    auto frame_size = config.packetDuration * stream->sampleRate / 1000;
+    auto frame_size = config.packetDuration * stream->sampleRate / 1000000;
     auto mic = control->microphone(stream->mapping, stream->channelCount, stream->sampleRate, frame_size);
     if (!mic) {
       return;
@@ -202,9 +322,13 @@ namespace audio {
 
     // Capture takes place on this thread
     platf::adjust_thread_priority(platf::thread_priority_e::critical);
+    platf::place_pipeline_thread("audio capture"sv);
+    TRACE_THREAD("audio capture");
 
-    auto samples = std::make_shared<sample_queue_t::element_type>(30);
-    std::thread thread { encodeThread, mail, samples, config, channel_data };
+    // PCM frames go back and forth between the capture and the encoder instead of being allocated for every frame
+    auto samples = std::make_shared<sample_queue_t::element_type>(30, safe::queue_mode_e::spsc);
+    auto free_samples = std::make_shared<free_sample_queue_t::element_type>(30, safe::queue_mode_e::spsc);
+    std::thread thread { encodeThread, mail, samples, free_samples, config, channel_data };
 
     auto fg = util::fail_guard([&]() {
       samples->stop();
@@ -215,11 +339,26 @@ namespace audio {
 
     int samples_per_frame = frame_size * stream->channelCount;
 
+    // Silent blocks after which the encoder idles, and between the keepalives it still encodes then
+    int hangover_blocks = config::audio.silence_hangover * 1000 / config.packetDuration;
+    int keepalive_blocks = config::audio.silence_keepalive * 1000 / config.packetDuration;
+    int silent_blocks = 0;
+    if (config::audio.silence_threshold) {
+      BOOST_LOG(info) << "Audio level kernel: "sv << pcm::kernel_name();
+    }
+
+    // Kept across timeouts, only replaced once it was handed to the encoder
+    std::vector<std::int16_t> sample_buffer;
+    std::chrono::steady_clock::time_point capture_time;
     while (!shutdown_event->peek()) {
-      std::vector<std::int16_t> sample_buffer;
-      sample_buffer.resize(samples_per_frame);
+      if (sample_buffer.empty()) {
+        if (free_samples->peek()) {
+          sample_buffer = std::move(*free_samples->pop());
+        }
+        sample_buffer.resize(samples_per_frame);
+      }
 
-      auto status = mic->sample(sample_buffer);
+      auto status = mic->sample(sample_buffer, capture_time);
       switch (status) {
         case platf::capture_e::ok:
           break;
@@ -239,7 +378,27 @@ namespace audio {
           return;
       }
 
-      samples->raise(std::move(sample_buffer));
+      // Sound is encoded right away, silence only until the hangover has passed
+      if (config::audio.silence_threshold) {
+        if (pcm::peak(sample_buffer.data(), sample_buffer.size()) > (std::uint32_t) config::audio.silence_threshold) {
+          if (silent_blocks > hangover_blocks) {
+            BOOST_LOG(debug) << "Audio resumed after "sv << silent_blocks << " silent blocks"sv;
+          }
+          silent_blocks = 0;
+        }
+        else if (++silent_blocks > hangover_blocks) {
+          if (silent_blocks == hangover_blocks + 1) {
+            BOOST_LOG(debug) << "Audio is silent, suspending the encoder"sv;
+          }
+
+          auto idle = silent_blocks - hangover_blocks;
+          if (!keepalive_blocks || idle % std::max(1, keepalive_blocks)) {
+            continue;
+          }
+        }
+      }
+
+      samples->raise(pcm_frame_t { std::move(sample_buffer), capture_time });
     }
   }
 
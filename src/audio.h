@@ -4,6 +4,9 @@
  */
 #pragma once
 
+#include <chrono>
+
+#include "buffer_pool.h"
 #include "thread_safe.h"
 #include "utility.h"
 namespace audio {
@@ -35,7 +38,7 @@ namespace audio {
       MAX_FLAGS
     };
 
-    int packetDuration;
+    int packetDuration;  // Microseconds
     int channels;
     int mask;
 
@@ -43,7 +46,19 @@ namespace audio {
   };
 
   using buffer_t = util::buffer_t<std::uint8_t>;
-  using packet_t = std::pair<void *, buffer_t>;
+  struct packet_t {
+    void *channel_data;
+    // Returns to the pool of the encoder once it was sent
+    buffer_pool::slab_t data;
+    // When the first sample was recorded, on the clock of the video frame timestamps
+    std::chrono::steady_clock::time_point capture_time;
+  };
+
+  /**
+   * @return The index of the entry of `stream_configs` for the number of channels.
+   */
+  int
+  map_stream(int channels, bool quality);
   void
   capture(safe::mail_t mail, config_t config, void *channel_data);
 }  // namespace audio
@@ -0,0 +1,173 @@
+/**
+ * @file src/buffer_pool.cpp
+ * @brief Recycled, page-aligned buffers for encoded frames.
+ */
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+#include "buffer_pool.h"
+
+namespace buffer_pool {
+  struct slab_t::entry_t {
+    std::uint8_t *data = nullptr;
+    std::size_t capacity = 0;
+
+    // Set while the slab is borrowed, keeps the pool alive
+    std::shared_ptr<pool_t> owner;
+
+    ~entry_t() {
+      free();
+    }
+
+    void
+    free() {
+      if (data) {
+        ::operator delete(data, std::align_val_t { PAGE_SIZE });
+        data = nullptr;
+        capacity = 0;
+      }
+    }
+
+    bool
+    reserve(std::size_t size) {
+      if (size <= capacity) {
+        return true;
+      }
+
+      free();
+
+      auto new_capacity = (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+      data = (std::uint8_t *) ::operator new(new_capacity, std::align_val_t { PAGE_SIZE }, std::nothrow);
+      if (!data) {
+        return false;
+      }
+
+      capacity = new_capacity;
+      return true;
+    }
+  };
+
+  slab_t::slab_t(slab_t &&other) noexcept:
+      entry { other.entry }, _size { other._size } {
+    other.entry = nullptr;
+    other._size = 0;
+  }
+
+  slab_t::~slab_t() {
+    if (entry) {
+      pool_t::recycle(release());
+    }
+  }
+
+  slab_t &
+  slab_t::operator=(slab_t &&other) noexcept {
+    std::swap(entry, other.entry);
+    std::swap(_size, other._size);
+
+    return *this;
+  }
+
+  std::uint8_t *
+  slab_t::data() const {
+    return entry ? entry->data : nullptr;
+  }
+
+  std::size_t
+  slab_t::capacity() const {
+    return entry ? entry->capacity : 0;
+  }
+
+  void
+  slab_t::resize(std::size_t size) {
+    assert(size <= capacity());
+    _size = size;
+  }
+
+  void *
+  slab_t::release() {
+    auto opaque = entry;
+
+    entry = nullptr;
+    _size = 0;
+
+    return opaque;
+  }
+
+  pool_t::pool_t(std::size_t max_slabs):
+      max_slabs { max_slabs } {
+    free_slabs.reserve(max_slabs);
+  }
+
+  pool_t::~pool_t() {
+    for (auto entry : free_slabs) {
+      delete entry;
+    }
+  }
+
+  slab_t
+  pool_t::acquire(std::size_t size) {
+    slab_t::entry_t *entry = nullptr;
+    {
+      std::lock_guard lg { mutex };
+
+      if (!free_slabs.empty()) {
+        // Prefer a slab that is large enough, otherwise grow the largest one
+        auto it = std::find_if(std::begin(free_slabs), std::end(free_slabs), [size](auto entry) {
+          return entry->capacity >= size;
+        });
+        if (it == std::end(free_slabs)) {
+          it = std::max_element(std::begin(free_slabs), std::end(free_slabs), [](auto a, auto b) {
+            return a->capacity < b->capacity;
+          });
+        }
+
+        entry = *it;
+        free_slabs.erase(it);
+      }
+    }
+
+    if (!entry) {
+      entry = new (std::nothrow) slab_t::entry_t;
+      if (!entry) {
+        return {};
+      }
+    }
+
+    if (!entry->reserve(size)) {
+      delete entry;
+      return {};
+    }
+
+    entry->owner = shared_from_this();
+    return slab_t { entry, size };
+  }
+
+  void
+  pool_t::recycle(void *opaque) {
+    auto entry = (slab_t::entry_t *) opaque;
+
+    // The pool may be gone once the last slab is back, so hold on to it until then
+    auto pool = std::move(entry->owner);
+    pool->give_back(entry);
+  }
+
+  std::size_t
+  pool_t::free_count() {
+    std::lock_guard lg { mutex };
+    return free_slabs.size();
+  }
+
+  void
+  pool_t::give_back(slab_t::entry_t *entry) {
+    {
+      std::lock_guard lg { mutex };
+      if (free_slabs.size() < max_slabs) {
+        free_slabs.push_back(entry);
+        return;
+      }
+    }
+
+    delete entry;
+  }
+}  // namespace buffer_pool
@@ -0,0 +1,125 @@
+/**
+ * @file src/buffer_pool.h
+ * @brief Recycled, page-aligned buffers for encoded frames.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace buffer_pool {
+  // Slabs are page-aligned and their capacity is a multiple of the page size
+  constexpr std::size_t PAGE_SIZE = 4096;
+
+  // Slabs the pool of an encoder keeps, enough for the frames queued for sending plus the one being encoded
+  constexpr std::size_t ENCODER_SLABS = 8;
+
+  class pool_t;
+
+  /**
+   * @brief A buffer borrowed from a `pool_t`, it is returned to the pool when destroyed.
+   */
+  class slab_t {
+  public:
+    slab_t() = default;
+    slab_t(slab_t &&other) noexcept;
+    ~slab_t();
+
+    slab_t &
+    operator=(slab_t &&other) noexcept;
+
+    std::uint8_t *
+    data() const;
+
+    std::size_t
+    capacity() const;
+
+    std::size_t
+    size() const {
+      return _size;
+    }
+
+    bool
+    empty() const {
+      return !_size;
+    }
+
+    /**
+     * @brief Change the size of the data in the slab, it must not exceed `capacity()`.
+     */
+    void
+    resize(std::size_t size);
+
+    explicit operator bool() const {
+      return entry;
+    }
+
+    /**
+     * @brief Give up ownership of the slab, for C APIs with a free callback.
+     * @return Opaque pointer to hand to `pool_t::recycle()` once the data is no longer used.
+     */
+    void *
+    release();
+
+  private:
+    friend class pool_t;
+
+    struct entry_t;
+
+    explicit slab_t(entry_t *entry, std::size_t size):
+        entry { entry }, _size { size } {}
+
+    entry_t *entry = nullptr;
+    std::size_t _size = 0;
+  };
+
+  /**
+   * @brief A fixed set of slabs that are recycled instead of freed.
+   * @details Slabs that are too small are grown on demand and keep their size, so once the largest
+   *          frames have been seen steady-state encoding allocates nothing. Borrowed slabs keep the
+   *          pool alive, they may outlive the owner of the pool. The pool must be owned by a `std::shared_ptr`.
+   */
+  class pool_t: public std::enable_shared_from_this<pool_t> {
+  public:
+    /**
+     * @param max_slabs Number of slabs kept for reuse, slabs returned beyond that are freed.
+     */
+    explicit pool_t(std::size_t max_slabs);
+    ~pool_t();
+
+    pool_t(const pool_t &) = delete;
+    pool_t &
+    operator=(const pool_t &) = delete;
+
+    /**
+     * @brief Borrow a slab of at least `size` bytes.
+     * @return The slab, empty if the allocation failed.
+     */
+    slab_t
+    acquire(std::size_t size);
+
+    /**
+     * @brief Return a slab given up with `slab_t::release()`.
+     */
+    static void
+    recycle(void *opaque);
+
+    /**
+     * @brief Number of slabs currently waiting for reuse.
+     */
+    std::size_t
+    free_count();
+
+  private:
+    void
+    give_back(slab_t::entry_t *entry);
+
+    std::size_t max_slabs;
+
+    std::mutex mutex;
+    std::vector<slab_t::entry_t *> free_slabs;
+  };
+}  // namespace buffer_pool
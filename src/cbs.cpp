@@ -4,12 +4,19 @@
  */
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavcodec/cbs_av1.h>
 #include <libavcodec/cbs_h264.h>
 #include <libavcodec/cbs_h265.h>
 #include <libavcodec/h264_levels.h>
 #include <libavutil/pixdesc.h>
 }
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+
 #include "cbs.h"
 #include "logging.h"
 #include "utility.h"
@@ -217,6 +224,143 @@ namespace cbs {
     };
   }
 
+  av1_t
+  make_sequence_header_av1(const AVCodecContext *avctx, const AVPacket *packet) {
+    cbs::ctx_t ctx;
+    if (ff_cbs_init(&ctx, AV_CODEC_ID_AV1, nullptr)) {
+      return {};
+    }
+
+    cbs::frag_t frag;
+
+    int err = ff_cbs_read_packet(ctx.get(), &frag, packet);
+    if (err < 0) {
+      char err_str[AV_ERROR_MAX_STRING_SIZE] { 0 };
+      BOOST_LOG(error) << "Couldn't read packet: "sv << av_make_error_string(err_str, AV_ERROR_MAX_STRING_SIZE, err);
+
+      return {};
+    }
+
+    auto unit = std::find_if(frag.units, frag.units + frag.nb_units, [](const CodedBitstreamUnit &unit) {
+      return unit.type == AV1_OBU_SEQUENCE_HEADER;
+    });
+    if (unit == frag.units + frag.nb_units) {
+      BOOST_LOG(error) << "No sequence header in AV1 packet"sv;
+
+      return {};
+    }
+
+    // This is a very large struct that cannot safely be stored on the stack
+    auto obu = std::make_unique<AV1RawOBU>(*(AV1RawOBU *) unit->content);
+
+    auto &color_config = obu->obu.sequence_header.color_config;
+    color_config.color_description_present_flag = 1;
+    color_config.color_primaries = avctx->color_primaries;
+    color_config.transfer_characteristics = avctx->color_trc;
+    color_config.matrix_coefficients = avctx->colorspace;
+    color_config.color_range = avctx->color_range == AVCOL_RANGE_JPEG;
+
+    // The original OBU is replaced as it is in the packet
+    util::buffer_t<std::uint8_t> old { unit->data_size };
+    std::copy_n(unit->data, unit->data_size, std::begin(old));
+
+    cbs::ctx_t write_ctx;
+    ff_cbs_init(&write_ctx, AV_CODEC_ID_AV1, nullptr);
+
+    return av1_t {
+      nal_t {
+        write(write_ctx, AV1_OBU_SEQUENCE_HEADER, (void *) obu.get(), AV_CODEC_ID_AV1),
+        std::move(old),
+      },
+    };
+  }
+
+  namespace {
+    // Encoder, codec, resolution, color range, primaries, transfer characteristics, matrix coefficients and reference frames
+    using parameter_key_t = std::tuple<std::string, int, int, int, int, int, int, int, int>;
+
+    // Sessions of a process use a handful of keys, the cache starts over once it holds more
+    constexpr std::size_t MAX_CACHED_PARAMETER_SETS = 32;
+
+    std::mutex parameter_sets_mutex;
+    std::map<parameter_key_t, std::shared_ptr<const parameter_sets_t>> cached_parameter_sets;
+
+    bool
+    contains(const AVPacket *packet, const util::buffer_t<std::uint8_t> &unit) {
+      auto end = packet->data + packet->size;
+      return std::search(packet->data, end, std::begin(unit), std::end(unit)) != end;
+    }
+
+    std::shared_ptr<const parameter_sets_t>
+    rewrite_parameter_sets(const AVCodecContext *ctx, const AVPacket *packet) {
+      auto parameter_sets = std::make_shared<parameter_sets_t>();
+      switch (ctx->codec_id) {
+        case AV_CODEC_ID_H264:
+          parameter_sets->units.emplace_back(std::move(make_sps_h264(ctx, packet).sps));
+          break;
+        case AV_CODEC_ID_H265: {
+          auto hevc = make_sps_hevc(ctx, packet);
+          parameter_sets->units.emplace_back(std::move(hevc.vps));
+          parameter_sets->units.emplace_back(std::move(hevc.sps));
+          break;
+        }
+        case AV_CODEC_ID_AV1:
+          parameter_sets->units.emplace_back(std::move(make_sequence_header_av1(ctx, packet).sequence_header));
+          break;
+        default:
+          return nullptr;
+      }
+
+      for (auto &unit : parameter_sets->units) {
+        if (!unit.old.size() || !unit._new.size()) {
+          return nullptr;
+        }
+      }
+
+      return parameter_sets;
+    }
+  }  // namespace
+
+  std::shared_ptr<const parameter_sets_t>
+  parameter_sets(const AVCodecContext *ctx, const AVPacket *packet) {
+    parameter_key_t key {
+      ctx->codec ? ctx->codec->name : "",
+      ctx->codec_id,
+      ctx->width,
+      ctx->height,
+      ctx->color_range,
+      ctx->color_primaries,
+      ctx->color_trc,
+      ctx->colorspace,
+      ctx->refs,
+    };
+
+    {
+      std::lock_guard lg { parameter_sets_mutex };
+      auto it = cached_parameter_sets.find(key);
+      if (it != std::end(cached_parameter_sets)) {
+        // The encoder may still pick different parameters, such as another level for a new bitrate
+        auto &units = it->second->units;
+        if (std::all_of(std::begin(units), std::end(units), [packet](auto &unit) { return contains(packet, unit.old); })) {
+          return it->second;
+        }
+      }
+    }
+
+    auto parameter_sets = rewrite_parameter_sets(ctx, packet);
+    if (!parameter_sets) {
+      return nullptr;
+    }
+
+    std::lock_guard lg { parameter_sets_mutex };
+    if (cached_parameter_sets.size() >= MAX_CACHED_PARAMETER_SETS) {
+      cached_parameter_sets.clear();
+    }
+    cached_parameter_sets[key] = parameter_sets;
+
+    return parameter_sets;
+  }
+
   bool
   validate_sps(const AVPacket *packet, int codec_id) {
     cbs::ctx_t ctx;
@@ -244,6 +388,12 @@ namespace cbs {
       return true;
     }
 
+    if (codec_id == AV_CODEC_ID_AV1) {
+      auto sequence_header = ((CodedBitstreamAV1Context *) ctx->priv_data)->sequence_header;
+
+      return sequence_header && sequence_header->color_config.color_description_present_flag;
+    }
+
     return ((CodedBitstreamH265Context *) ctx->priv_data)->active_sps->vui_parameters_present_flag;
   }
 }  // namespace cbs
@@ -4,6 +4,9 @@
  */
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "utility.h"
 
 struct AVPacket;
@@ -25,13 +28,41 @@ namespace cbs {
     nal_t sps;
   };
 
+  struct av1_t {
+    nal_t sequence_header;
+  };
+
+  /**
+   * @brief Parameter sets of an IDR frame, rewritten with the colorspace of the encoder.
+   */
+  struct parameter_sets_t {
+    // In the order the replacements are applied
+    std::vector<nal_t> units;
+  };
+
   hevc_t
   make_sps_hevc(const AVCodecContext *ctx, const AVPacket *packet);
   h264_t
   make_sps_h264(const AVCodecContext *ctx, const AVPacket *packet);
 
   /**
-   * Check if SPS->VUI is present
+   * @brief Rewrite the color config of the AV1 sequence header in `packet`.
+   */
+  av1_t
+  make_sequence_header_av1(const AVCodecContext *ctx, const AVPacket *packet);
+
+  /**
+   * @brief Parameter sets of the first IDR frame of a session, rewritten for the codec of `ctx`.
+   * @details Rewrites are cached by encoder, codec, resolution and colorspace. A session rebuilt with
+   *          the same key reuses the cached rewrite without parsing the packet, as long as the original
+   *          units are still found in it.
+   * @return The parameter sets, nullptr if the packet couldn't be parsed.
+   */
+  std::shared_ptr<const parameter_sets_t>
+  parameter_sets(const AVCodecContext *ctx, const AVPacket *packet);
+
+  /**
+   * Check if SPS->VUI is present, or the color description of the AV1 sequence header
    */
   bool
   validate_sps(const AVPacket *packet, int codec_id);
@@ -0,0 +1,101 @@
+/**
+ * @file src/cipher.cpp
+ * @brief AES-GCM encryption of the datagrams of the streams.
+ */
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include <openssl/rand.h>
+
+#include "cipher.h"
+#include "logging.h"
+
+using namespace std::literals;
+
+namespace cipher {
+  std::string
+  stream_key() {
+    auto hex = std::getenv("SUNSHINE_STREAM_KEY");
+    if (!hex || !*hex) {
+      return {};
+    }
+
+    std::string_view key { hex };
+    if ((key.size() != 32 && key.size() != 64) || !std::all_of(std::begin(key), std::end(key), [](char ch) { return std::isxdigit((unsigned char) ch); })) {
+      BOOST_LOG(error) << "SUNSHINE_STREAM_KEY must be 32 or 64 hex digits, the streams aren't encrypted"sv;
+      return {};
+    }
+
+    return util::from_hex_vec(std::string { key });
+  }
+
+  std::unique_ptr<gcm_t>
+  gcm_t::make(std::string_view key) {
+    const EVP_CIPHER *evp_cipher;
+    switch (key.size()) {
+      case 16:
+        evp_cipher = EVP_aes_128_gcm();
+        break;
+      case 32:
+        evp_cipher = EVP_aes_256_gcm();
+        break;
+      default:
+        BOOST_LOG(error) << "Invalid AES key of "sv << key.size() << " bytes"sv;
+        return nullptr;
+    }
+
+    std::unique_ptr<gcm_t> gcm { new gcm_t };
+    gcm->ctx.reset(EVP_CIPHER_CTX_new());
+    if (!gcm->ctx ||
+        EVP_EncryptInit_ex(gcm->ctx.get(), evp_cipher, nullptr, nullptr, nullptr) != 1 ||
+        EVP_CIPHER_CTX_ctrl(gcm->ctx.get(), EVP_CTRL_GCM_SET_IVLEN, IV_SIZE, nullptr) != 1 ||
+        EVP_EncryptInit_ex(gcm->ctx.get(), nullptr, nullptr, (const unsigned char *) key.data(), nullptr) != 1) {
+      BOOST_LOG(error) << "Couldn't set up AES-GCM"sv;
+      return nullptr;
+    }
+
+    if (RAND_bytes((unsigned char *) &gcm->salt, sizeof(gcm->salt)) != 1 ||
+        RAND_bytes((unsigned char *) &gcm->counter, sizeof(gcm->counter)) != 1) {
+      BOOST_LOG(error) << "Couldn't generate the IV salt"sv;
+      return nullptr;
+    }
+
+    return gcm;
+  }
+
+  bool
+  gcm_t::encrypt(std::string_view aad, const platf::buffer_descriptor_t *segments, std::size_t segment_count, char *out) {
+    auto iv = (unsigned char *) out;
+    auto salt = util::endian::little(this->salt);
+    auto counter = util::endian::little(this->counter++);
+    std::memcpy(iv, &salt, sizeof(salt));
+    std::memcpy(iv + sizeof(salt), &counter, sizeof(counter));
+
+    // Only the IV changes, the key schedule stays
+    int size;
+    if (EVP_EncryptInit_ex(ctx.get(), nullptr, nullptr, nullptr, iv) != 1 ||
+        EVP_EncryptUpdate(ctx.get(), nullptr, &size, (const unsigned char *) aad.data(), (int) aad.size()) != 1) {
+      BOOST_LOG(error) << "Couldn't start an AES-GCM message"sv;
+      return false;
+    }
+
+    auto ciphertext = iv + IV_SIZE;
+    for (std::size_t x = 0; x < segment_count; ++x) {
+      if (EVP_EncryptUpdate(ctx.get(), ciphertext, &size, (const unsigned char *) segments[x].buffer, (int) segments[x].size) != 1) {
+        BOOST_LOG(error) << "Couldn't encrypt with AES-GCM"sv;
+        return false;
+      }
+      ciphertext += size;
+    }
+
+    if (EVP_EncryptFinal_ex(ctx.get(), ciphertext, &size) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, TAG_SIZE, ciphertext + size) != 1) {
+      BOOST_LOG(error) << "Couldn't finish an AES-GCM message"sv;
+      return false;
+    }
+
+    return true;
+  }
+}  // namespace cipher
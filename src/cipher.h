@@ -0,0 +1,69 @@
+/**
+ * @file src/cipher.h
+ * @brief AES-GCM encryption of the datagrams of the streams.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <openssl/evp.h>
+
+#include "platform/common.h"
+#include "utility.h"
+
+namespace cipher {
+  constexpr std::size_t IV_SIZE = 12;
+  constexpr std::size_t TAG_SIZE = 16;
+
+  // An encrypted payload is sent with the IV in front of it and the tag behind it
+  constexpr std::size_t OVERHEAD = IV_SIZE + TAG_SIZE;
+
+  /**
+   * @brief The key of the streams, from the hex encoded AES-128 or AES-256 key in SUNSHINE_STREAM_KEY.
+   * @return The raw key, empty if the variable isn't set or doesn't hold a valid key.
+   */
+  std::string
+  stream_key();
+
+  /**
+   * @brief Encrypts datagrams with AES-GCM, each of them as a message of its own.
+   * @details The key schedule is set up once, a datagram only resets the IV. OpenSSL picks the
+   *          AES-NI and PCLMULQDQ or ARMv8 crypto extension code paths when the CPU has them.
+   *
+   *          IVs are a random 32-bit salt followed by a 64-bit counter that starts at a random value,
+   *          so sessions sharing the key, or a restarted server, never reuse one. The counter is not
+   *          thread safe, a cipher belongs to the thread that sends its session.
+   */
+  class gcm_t {
+  public:
+    /**
+     * @param key The raw key, 16 or 32 bytes.
+     * @return nullptr if the key has the wrong size or OpenSSL couldn't set it up.
+     */
+    static std::unique_ptr<gcm_t>
+    make(std::string_view key);
+
+    /**
+     * @brief Encrypt the payload of a datagram.
+     * @param aad The header of the datagram, it's sent in the clear but authenticated.
+     * @param segments The plaintext, encrypted in order as a single message.
+     * @param segment_count Number of segments.
+     * @param out The IV, the ciphertext and the tag, OVERHEAD bytes more than the plaintext. The
+     *            ciphertext may overwrite a plaintext of a single segment that starts at out + IV_SIZE.
+     * @return false on error.
+     */
+    bool
+    encrypt(std::string_view aad, const platf::buffer_descriptor_t *segments, std::size_t segment_count, char *out);
+
+  private:
+    gcm_t() = default;
+
+    util::safe_ptr<EVP_CIPHER_CTX, EVP_CIPHER_CTX_free> ctx;
+    std::uint32_t salt = 0;
+    std::uint64_t counter = 0;
+  };
+}  // namespace cipher
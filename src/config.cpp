@@ -346,6 +346,8 @@ namespace config {
       0,  // preanalysis
       1,  // vbaq
       (int) amd::coder_e::_auto,  // coder
+      2,  // ltr_frames
+      10,  // static_importance
     },  // amd
 
     {
@@ -355,21 +357,139 @@ namespace config {
       -1,
     },  // vt
 
+    {
+      true,  // low_power
+    },  // vaapi
+
+    {
+      3,  // frame_buffers
+    },  // wgc
+
+    {
+      12,  // size
+      2,  // preallocate
+    },  // image_pool
+
+    1,  // huge_pages
+
     {},  // capture
     {},  // encoder
     {},  // adapter_name
+    {},  // encode_adapter_name
     {},  // output_name
+    "encoder_cache.json"s,  // encoder_cache
+
+    false,  // encode_on_arrival
+
+    true,  // capture_throttle
+
+    false,  // test_pattern
+
+    {
+      0,  // x
+      0,  // y
+      0,  // width
+      0,  // height
+      {},  // window
+    },  // crop
+
+    {
+      false,  // enabled
+      10,  // min_framerate
+      1000,  // refresh_interval
+    },  // static_content
+
+    {
+      false,  // enabled
+      5,  // screen_percentage
+      20,  // motion_percentage
+    },  // content_adaptive
+
+    {
+      0,  // qp_delta
+      64,  // radius
+    },  // focus
+
+    {
+      true,  // enabled
+      0,  // max_sessions
+      90,  // max_utilization
+      2,  // concurrent_submissions
+      30,  // min_framerate
+      360,  // min_height
+    },  // scheduler
+
+    {
+      true,  // enabled
+      90,  // max_load
+      40,  // min_load
+      4,  // max_queued
+      540,  // min_height
+      30,  // min_framerate
+    },  // overload
+
+    0,  // intra_refresh_frames
+
+    1,  // temporal_layers
+
+    1,  // slices_per_frame
+
+    0,  // dynamic_range
+    0,  // chroma_sampling_type
+
+    {
+      { 0, 0, 60, 6000 },
+      { 1280, 720, 60, 3000 },
+      { 960, 540, 30, 1000 },
+    },  // ladder
+  };
+
+  stream_t stream {
+    1500,  // mtu
+    20,  // fec_percentage
+    true,  // congestion_control
+    10,  // min_bitrate_percentage
+    100,  // retransmit_window
+    100,  // playout_delay
+    50,  // queue_deadline
+    4,  // audio_fec_block_size
+    0,  // pacing_percentage
+    16,  // pacing_burst_size
+    false,  // kernel_pacing
+    true,  // dscp_tagging
+    false,  // zero_copy_send
+    {},  // xdp_interface
+    OUTPUT_UDP,  // output
+    "sunshine-sdk"s,  // shared_memory_name
+    {},  // record_file
+    240,  // record_queue_size
+    ENCRYPTION_MODE_OPPORTUNISTIC,  // encryption_mode
   };
 
   audio_t audio {
     {},  // audio_sink
     {},  // virtual_sink
     false,  // install_steam_drivers
+
+    10000,  // packet_duration
+    2,  // channels
+    false,  // high_quality
+
+    0,  // silence_threshold
+    500,  // silence_hangover
+    1000,  // silence_keepalive
+  };
+
+  input_t input {
+    0,  // port
+    1000,  // poll_rate
   };
 
 
   sunshine_t sunshine {
     2,  // min_log_level
     0,  // flags
+    "off"s,  // thread_affinity
+    "sunshine_trace.json"s,  // trace_file
   };
 }  // namespace config
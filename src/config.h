@@ -61,6 +61,8 @@ namespace config {
       std::optional<int> amd_preanalysis;
       std::optional<int> amd_vbaq;
       int amd_coder;
+      int amd_ltr_frames;  // Long-term reference frames of the native AMF encoder, reference frame invalidation falls back on them
+      int amd_static_importance;  // ROI importance from 0 to 10 of the regions the capture reports as unchanged, 10 disables
     } amd;
 
     struct {
@@ -70,16 +72,179 @@ namespace config {
       int vt_coder;
     } vt;
 
+    struct {
+      bool low_power;  // Encode through VAEntrypointEncSliceLP when the driver has it, the full-power entrypoint otherwise
+    } vaapi;
+
+    struct {
+      int frame_buffers;  // Frames the Windows.Graphics.Capture pool holds, frames arriving while all of them are in use are dropped
+    } wgc;
+
+    struct {
+      int size;  // Images a display holds for the encoders at most, a full pool drops the oldest frame no encoder took yet
+      int preallocate;  // Images allocated when the display is initialized, the pool isn't trimmed below them
+    } image_pool;
+
+    int huge_pages;  // Large buffers such as RAM captures: 0 uses normal pages, 1 transparent huge pages, 2 reserved huge pages or Windows large pages first
+
     std::string capture;
     std::string encoder;
     std::string adapter_name;
+    std::string encode_adapter_name;  // Adapter of the encoders when it isn't the one of the capture: the description on Windows, the render node with KMS
     std::string output_name;
+    std::string encoder_cache;  // Encoder probe results are kept here and trusted while the GPUs, drivers and settings stay the same, empty disables
+
+    bool encode_on_arrival;  // Encode as soon as capture delivers a frame, the frame interval only repeats the last frame
+
+    bool capture_throttle;  // Capture no faster than the fastest session encodes, the frames of a faster display in between aren't acquired
+
+    bool test_pattern;  // Stream the frame number and the capture time as a pattern instead of the display, see test_pattern.h
+
+    struct {
+      int x;  // Region of the display that is encoded, in pixels of the display
+      int y;
+      int width;  // 0 encodes the whole display
+      int height;
+      std::string window;  // Follow the window whose title contains this instead, the region above is ignored
+    } crop;
+
+    struct {
+      bool enabled;  // Step the encode rate down while capture delivers no new frames
+      int min_framerate;  // Rate floor for repeated frames, 0 stops encoding until a new frame arrives
+      int refresh_interval;  // Milliseconds between refresh frames while stopped, keeps the decoder alive
+    } static_content;
+
+    struct {
+      bool enabled;  // Retune the encoder between motion and screen content, judged by the regions the capture reports as changed
+      int screen_percentage;  // Average changed area in percent below which the content counts as screen content
+      int motion_percentage;  // Average changed area in percent above which screen content counts as motion again
+    } content_adaptive;
+
+    struct {
+      int qp_delta;  // QP lowered around the cursor, by half of it in the regions that changed, 0 disables
+      int radius;  // Pixels of the encoded frame around the cursor that get the lower QP
+    } focus;
+
+    struct {
+      bool enabled;  // Admit the sessions of a GPU within its encoder time and submit their frames earliest deadline first
+      int max_sessions;  // Sessions a GPU encodes at once, 0 learns the limit when the driver refuses a session
+      int max_utilization;  // Percent of the encoder time the admitted sessions may take
+      int concurrent_submissions;  // Frames a GPU encodes at once
+      int min_framerate;  // A session that doesn't fit is slowed down to this framerate first
+      int min_height;  // and then scaled down to this height, it's rejected if it still doesn't fit
+    } scheduler;
+
+    struct {
+      bool enabled;  // Step the resolution and then the framerate of a session down while its encoder can't keep up
+      int max_load;  // Percent of the frame interval spent converting and encoding above which the session steps down
+      int min_load;  // Percent below which it steps back up
+      int max_queued;  // Packets waiting for the send thread above which the session steps down as well, 0 ignores them
+      int min_height;  // The resolution doesn't step below this height
+      int min_framerate;  // The framerate doesn't step below this
+    } overload;
+
+    int intra_refresh_frames;  // Recover from loss with an intra-refresh wave over this many frames instead of an IDR frame, 0 disables
+
+    int temporal_layers;  // Encode hierarchical-P in this many temporal layers where the encoder supports it, the frames above the base layer are dropped under congestion, 1 disables
+
+    int slices_per_frame;  // Encode frames in slices and send every slice as soon as it is encoded, 1 sends whole frames
+
+    int dynamic_range;  // 1 encodes 10-bit, in HDR while the captured display is in HDR mode
+    int chroma_sampling_type;  // 1 encodes full resolution 4:4:4 chroma, the encoder must support it
+
+    struct rung_t {
+      int width;  // 0 follows the display resolution
+      int height;  // 0 follows the display resolution
+      int framerate;
+      int bitrate;  // Video bitrate in kilobits
+    };
+
+    // Simulcast ladder, one capture feeds an encode session per rung and rung N is sent to the Nth destination
+    std::vector<rung_t> ladder;
   };
 
+  struct stream_t {
+    // Path MTU towards the client, video frames are split into datagrams that fit it
+    int mtu;
+
+    // Parity shards in percent of the data shards, 0 disables forward error correction
+    int fec_percentage;
+
+    // Let receiver reports of the client drive the bitrate and the parity overhead of every video rung
+    bool congestion_control;
+
+    // Lowest bitrate the congestion controller goes down to, in percent of the rung bitrate
+    int min_bitrate_percentage;
+
+    // Milliseconds sent video shards are kept for retransmission on NACK, 0 disables retransmission
+    int retransmit_window;
+
+    // Milliseconds after the capture a frame has to be at the client, later retransmissions are skipped
+    int playout_delay;
+
+    // Milliseconds a video frame may wait for the sender, a backlog of older frames is dropped, 0 sends every frame
+    int queue_deadline;
+
+    // Number of audio packets protected by a single FEC block
+    int audio_fec_block_size;
+
+    // Spread the shards of a video frame over this percentage of the frame interval, 0 disables pacing
+    int pacing_percentage;
+
+    // Largest number of shards the pacer sends back to back
+    int pacing_burst_size;
+
+    // Hand the departure times of the paced bursts to the kernel with SO_TXTIME on Linux, needs the fq qdisc. Off with xdp_interface
+    bool kernel_pacing;
+
+    // Mark the video and audio datagrams with DSCP and the platform QoS APIs
+    bool dscp_tagging;
+
+    // Send video without copying it into the socket buffers, where the platform supports it
+    bool zero_copy_send;
+
+    // Interface whose NIC gets the video straight through an AF_XDP socket on Linux, empty sends through the UDP stack
+    std::string xdp_interface;
+
+    // Where packets are published, a combination of OUTPUT_UDP and OUTPUT_SHARED_MEMORY
+    int output;
+
+    // Name of the shared memory segment co-located consumers map, the first rung is published there
+    std::string shared_memory_name;
+
+    // MPEG-TS file the first rung and the audio are recorded into from their encoded packets, empty disables recording
+    std::string record_file;
+
+    // Packets queued for the disk before the recording only keeps IDR frames
+    int record_queue_size;
+
+    // One of ENCRYPTION_MODE_*, the key is the hex encoded AES key in SUNSHINE_STREAM_KEY
+    int encryption_mode;
+  };
+
+  constexpr int OUTPUT_UDP = 0x01;  // Send packets to the remote endpoints
+  constexpr int OUTPUT_SHARED_MEMORY = 0x02;  // Publish packets to the shared memory queues
+
   struct audio_t {
     std::string sink;
     std::string virtual_sink;
     bool install_steam_drivers;
+
+    int packet_duration;  // Microseconds of audio per packet: 2500, 5000, 10000 or 20000
+    int channels;  // 2 for stereo, 6 for 5.1 or 8 for 7.1
+    bool high_quality;  // Encode at the higher bitrate of the channel layout
+
+    int silence_threshold;  // Peak sample magnitude up to which a block is silence, 0 encodes every block
+    int silence_hangover;  // Milliseconds of silence before blocks are no longer encoded
+    int silence_keepalive;  // Milliseconds between the blocks still encoded during silence, 0 encodes none
+  };
+
+  struct input_t {
+    // UDP port of the input channel on the address of the control channel, only the clients of the sessions may inject. 0 disables input injection
+    int port;
+
+    // Injections per second of the coalesced relative mouse motion and gamepad axes
+    int poll_rate;
   };
 
   constexpr int ENCRYPTION_MODE_NEVER = 0;  // Never use video encryption, even if the client supports it
@@ -109,9 +274,17 @@ namespace config {
   struct sunshine_t {
     int min_log_level;
     std::bitset<flag::FLAG_SIZE> flags;
+
+    // CPUs of the capture, encode and send threads: "off", "auto" for one cache domain near the GPU, or a list such as "0-7,16"
+    std::string thread_affinity;
+
+    // Chrome trace of the pipeline, written on SIGUSR1 or a TraceDump command in builds with SUNSHINE_ENABLE_TRACE
+    std::string trace_file;
   };
 
   extern video_t video;
+  extern stream_t stream;
   extern audio_t audio;
+  extern input_t input;
   extern sunshine_t sunshine;
 }  // namespace config
@@ -0,0 +1,168 @@
+/**
+ * @file src/congestion.cpp
+ * @brief Congestion control of the video rungs and the audio, driven by receiver reports of the client.
+ */
+#include <algorithm>
+#include <cmath>
+
+#include "congestion.h"
+#include "logging.h"
+
+namespace congestion {
+  using namespace std::literals;
+
+  namespace {
+    // Delay gradient smoothing and the slope, in microseconds of queueing per millisecond, that counts as overuse
+    constexpr double TREND_SMOOTHING = 0.3;
+    constexpr double OVERUSE_SLOPE = 10.0;
+
+    // Loss below LOW_LOSS leaves room to grow, above HIGH_LOSS the bitrate drops in proportion to it
+    constexpr double LOW_LOSS = 0.02;
+    constexpr double HIGH_LOSS = 0.10;
+
+    constexpr double INCREASE = 1.08;
+    constexpr double BACKOFF = 0.85;
+    constexpr int HOLD_REPORTS = 2;
+
+    // Changes below this are not worth a reconfiguration of the encoder
+    constexpr double MIN_BITRATE_CHANGE = 0.03;
+    constexpr int MIN_FEC_CHANGE = 5;
+    constexpr int MAX_FEC_PERCENTAGE = 50;
+
+    // In-band FEC of the audio starts above START_LOSS and stops below STOP_LOSS of the smoothed loss
+    constexpr double LOSS_SMOOTHING = 0.3;
+    constexpr double START_LOSS = 0.01;
+    constexpr double STOP_LOSS = 0.002;
+    constexpr int MAX_PACKET_LOSS_PERCENTAGE = 30;
+  }  // namespace
+
+  controller_t::controller_t(int max_bitrate, int min_bitrate, int fec_percentage):
+      max { std::max(1, max_bitrate) },
+      configured_min { std::max(1, min_bitrate) },
+      min { std::min(configured_min, max) },
+      base_fec_percentage { std::max(0, fec_percentage) },
+      current { max, base_fec_percentage } {}
+
+  void
+  controller_t::max_bitrate(int bitrate) {
+    max = std::max(1, bitrate);
+    min = std::min(configured_min, max);
+    current.bitrate = max;
+    hold = 0;
+    dropped.store(0, std::memory_order_relaxed);
+  }
+
+  std::optional<decision_t>
+  controller_t::update(const receiver_report_t &report) {
+    auto shards = (double) report.received_shards + report.lost_shards;
+    if (!report.interval_ms || !shards) {
+      return std::nullopt;
+    }
+
+    auto loss = report.lost_shards / shards;
+    auto received_rate = (double) report.received_bytes * 8 / report.interval_ms;
+
+    auto slope = (double) report.delay_gradient_us / report.interval_ms;
+    delay_trend += TREND_SMOOTHING * (slope - delay_trend);
+
+    auto target = (double) current.bitrate;
+    if (delay_trend > OVERUSE_SLOPE) {
+      // Queues are building up, the path carries less than what was received
+      target = std::min(target, received_rate * BACKOFF);
+      hold = HOLD_REPORTS;
+    }
+    else if (loss > HIGH_LOSS) {
+      target *= 1 - loss / 2;
+      hold = HOLD_REPORTS;
+    }
+    else if (hold) {
+      --hold;
+    }
+    else if (loss < LOW_LOSS && delay_trend > -OVERUSE_SLOPE) {
+      // Growing much beyond what arrives only fills the queues, unless the encoder undershoots its target
+      target = std::min(target * INCREASE, std::max(target, received_rate * 1.5));
+    }
+
+    // The frames of the top layers go as soon as the path is congested, before the encoder reaches the lower bitrate
+    if (hold) {
+      dropped.store(target <= min ? 2 : 1, std::memory_order_relaxed);
+    }
+    else {
+      dropped.store(0, std::memory_order_relaxed);
+    }
+
+    decision_t next {
+      (int) std::clamp<double>(target, min, max),
+      std::clamp(base_fec_percentage + (int) std::ceil(loss * 200), base_fec_percentage, std::max(base_fec_percentage, MAX_FEC_PERCENTAGE)),
+    };
+
+    bool bitrate_changed = std::abs(next.bitrate - current.bitrate) >= current.bitrate * MIN_BITRATE_CHANGE ||
+                           (next.bitrate != current.bitrate && (next.bitrate == min || next.bitrate == max));
+    bool fec_changed = std::abs(next.fec_percentage - current.fec_percentage) >= MIN_FEC_CHANGE ||
+                       (next.fec_percentage != current.fec_percentage && next.fec_percentage == base_fec_percentage);
+    if (!bitrate_changed && !fec_changed) {
+      return std::nullopt;
+    }
+
+    if (bitrate_changed) {
+      current.bitrate = next.bitrate;
+    }
+    if (fec_changed) {
+      current.fec_percentage = next.fec_percentage;
+    }
+
+    BOOST_LOG(debug) << "Congestion control: loss "sv << loss * 100 << "%, delay trend "sv << delay_trend
+                     << " us/ms, received "sv << (int) received_rate << " kbps -> "sv << current.bitrate << " kbps, FEC "sv
+                     << current.fec_percentage << '%';
+    return current;
+  }
+
+  audio_controller_t::audio_controller_t(int max_bitrate, int min_bitrate):
+      rate { max_bitrate, min_bitrate, 0 },
+      current { rate.bitrate(), 0 } {}
+
+  void
+  audio_controller_t::max_bitrate(int bitrate) {
+    rate.max_bitrate(bitrate);
+    current.bitrate = rate.bitrate();
+  }
+
+  std::optional<audio_decision_t>
+  audio_controller_t::update(const receiver_report_t &report) {
+    auto packets = (double) report.received_shards + report.lost_shards;
+    if (!report.interval_ms || !packets) {
+      return std::nullopt;
+    }
+
+    auto loss = report.lost_shards / packets;
+    loss_trend += LOSS_SMOOTHING * (loss - loss_trend);
+
+    audio_decision_t next { current.bitrate, current.packet_loss_percentage };
+    if (auto decision = rate.update(report)) {
+      next.bitrate = decision->bitrate;
+    }
+
+    if (loss_trend > START_LOSS || (current.packet_loss_percentage && loss_trend > STOP_LOSS)) {
+      // Opus expects the loss in whole percent, the estimate errs on the side of more redundancy
+      next.packet_loss_percentage = std::clamp((int) std::ceil(loss_trend * 100), 1, MAX_PACKET_LOSS_PERCENTAGE);
+    }
+    else {
+      next.packet_loss_percentage = 0;
+    }
+
+    bool loss_changed = std::abs(next.packet_loss_percentage - current.packet_loss_percentage) >= MIN_FEC_CHANGE ||
+                        (next.packet_loss_percentage != current.packet_loss_percentage && (!next.packet_loss_percentage || !current.packet_loss_percentage));
+    if (next.bitrate == current.bitrate && !loss_changed) {
+      return std::nullopt;
+    }
+
+    current.bitrate = next.bitrate;
+    if (loss_changed) {
+      current.packet_loss_percentage = next.packet_loss_percentage;
+    }
+
+    BOOST_LOG(debug) << "Audio congestion control: loss "sv << loss_trend * 100 << "% -> "sv << current.bitrate
+                     << " kbps, in-band FEC for "sv << current.packet_loss_percentage << '%';
+    return current;
+  }
+}  // namespace congestion
@@ -0,0 +1,129 @@
+/**
+ * @file src/congestion.h
+ * @brief Congestion control of the video rungs and the audio, driven by receiver reports of the client.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+
+namespace congestion {
+  /**
+   * @brief What the client received since its previous report.
+   */
+  struct receiver_report_t {
+    std::uint32_t interval_ms;  // Time covered by the report
+    std::uint32_t received_shards;
+    std::uint32_t lost_shards;  // Shards that never arrived, whether FEC recovered their frame or not
+    std::uint32_t received_bytes;
+    std::int32_t delay_gradient_us;  // Change of the one-way delay over the interval, positive while queues build up
+  };
+
+  struct decision_t {
+    int bitrate;  // Kilobits per second
+    int fec_percentage;
+  };
+
+  /**
+   * @brief Loss and delay based rate control in the spirit of Google Congestion Control.
+   * @details The delay gradient is smoothed and compared against a threshold. While queues build up,
+   *          the bitrate drops below what the client actually received. Heavy loss lowers it in
+   *          proportion to the loss. Otherwise the bitrate grows by a few percent per report, up to
+   *          the ceiling and not far beyond the received rate.
+   *
+   *          The parity overhead follows the loss, so random loss is repaired rather than treated
+   *          as congestion. Changes that are too small to matter are not reported, so the encoder
+   *          isn't reconfigured on every report.
+   */
+  class controller_t {
+  public:
+    /**
+     * @param max_bitrate Ceiling in kilobits per second, the bitrate starts there.
+     * @param min_bitrate Floor in kilobits per second.
+     * @param fec_percentage Parity overhead without loss.
+     */
+    controller_t(int max_bitrate, int min_bitrate, int fec_percentage);
+
+    /**
+     * @return The new bitrate and parity overhead, empty if neither changed.
+     */
+    std::optional<decision_t>
+    update(const receiver_report_t &report);
+
+    /**
+     * @brief The client asked for a bitrate, it becomes the ceiling and the reports continue from there.
+     */
+    void
+    max_bitrate(int bitrate);
+
+    int
+    bitrate() const {
+      return current.bitrate;
+    }
+
+    /**
+     * @brief Top temporal layers the sender drops, one while the path is congested and two once the
+     *        bitrate is at its floor as well.
+     * @details The sender reads it while the reports update it.
+     */
+    int
+    dropped_layers() const {
+      return dropped.load(std::memory_order_relaxed);
+    }
+
+  private:
+    int max;
+
+    // The floor as configured, a lower ceiling only lowers the floor while it lasts
+    int configured_min;
+    int min;
+    int base_fec_percentage;
+
+    decision_t current;
+    double delay_trend = 0;
+
+    // Reports to skip before growing again, the reports right after a decrease still show the old queue
+    int hold = 0;
+
+    std::atomic<int> dropped { 0 };
+  };
+
+  struct audio_decision_t {
+    int bitrate;  // Kilobits per second
+    int packet_loss_percentage;  // Loss Opus protects against with in-band FEC, 0 disables it
+  };
+
+  /**
+   * @brief Rate control of the audio stream, driven by the same receiver reports as the video.
+   * @details The bitrate follows a controller_t. The loss is smoothed, in-band FEC starts once it
+   *          exceeds a percent and stops once it falls well below, so the encoder doesn't switch modes
+   *          on every report.
+   */
+  class audio_controller_t {
+  public:
+    /**
+     * @param max_bitrate Ceiling in kilobits per second, the bitrate starts there.
+     * @param min_bitrate Floor in kilobits per second.
+     */
+    audio_controller_t(int max_bitrate, int min_bitrate);
+
+    /**
+     * @return The new bitrate and protected loss, empty if neither changed.
+     */
+    std::optional<audio_decision_t>
+    update(const receiver_report_t &report);
+
+    /**
+     * @brief The client asked for a bitrate, it becomes the ceiling.
+     */
+    void
+    max_bitrate(int bitrate);
+
+  private:
+    controller_t rate;
+
+    audio_decision_t current;
+    double loss_trend = 0;
+  };
+}  // namespace congestion
@@ -0,0 +1,74 @@
+/**
+ * @file src/content.cpp
+ * @brief Tells screen content such as text and desktops apart from motion such as games and video.
+ */
+#include <algorithm>
+
+#include "config.h"
+#include "content.h"
+
+namespace content {
+  namespace {
+    // Weight of a new frame in the moving average, about the last 16 frames count
+    constexpr double SMOOTHING = 1.0 / 16;
+  }  // namespace
+
+  double
+  changed_fraction(const platf::img_t &img) {
+    if (!img.damage || img.width <= 0 || img.height <= 0) {
+      return 1.0;
+    }
+
+    double area = 0;
+    for (auto &rect : *img.damage) {
+      auto width = std::clamp(rect.right, 0, img.width) - std::clamp(rect.left, 0, img.width);
+      auto height = std::clamp(rect.bottom, 0, img.height) - std::clamp(rect.top, 0, img.height);
+      if (width > 0 && height > 0) {
+        area += (double) width * height;
+      }
+    }
+
+    return std::min(1.0, area / ((double) img.width * img.height));
+  }
+
+  const char *
+  to_string(content_e content) {
+    switch (content) {
+      case content_e::motion:
+        return "motion";
+      case content_e::screen:
+        return "screen content";
+    }
+    return "unknown";
+  }
+
+  classifier_t::classifier_t(int framerate):
+      min_frames { std::max(1, framerate) } {}
+
+  std::optional<content_e>
+  classifier_t::frame(const platf::img_t &img) {
+    auto &settings = config::video.content_adaptive;
+
+    average += (changed_fraction(img) - average) * SMOOTHING;
+    if (++frames < min_frames) {
+      return std::nullopt;
+    }
+
+    auto percentage = average * 100;
+    auto next = content;
+    if (content == content_e::motion && percentage < settings.screen_percentage) {
+      next = content_e::screen;
+    }
+    else if (content == content_e::screen && percentage > settings.motion_percentage) {
+      next = content_e::motion;
+    }
+
+    if (next == content) {
+      return std::nullopt;
+    }
+
+    content = next;
+    frames = 0;
+    return content;
+  }
+}  // namespace content
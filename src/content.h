@@ -0,0 +1,55 @@
+/**
+ * @file src/content.h
+ * @brief Tells screen content such as text and desktops apart from motion such as games and video.
+ */
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "platform/common.h"
+
+namespace content {
+  enum class content_e {
+    motion,  ///< Most of the picture changes from frame to frame
+    screen,  ///< Small regions change over a static picture
+  };
+
+  const char *
+  to_string(content_e content);
+
+  /**
+   * @brief Fraction of the image its damage covers, 1 if the damage is unknown.
+   * @details Overlapping rectangles are counted twice, the fraction only tells small changes from large ones.
+   */
+  double
+  changed_fraction(const platf::img_t &img);
+
+  /**
+   * @brief Classifies the captured frames of a session from the regions the capture reports as changed.
+   * @details The changed fraction of every new frame goes into a moving average, the class follows the
+   *          average with hysteresis and stays at least a second, so scrolling text or a short animation
+   *          don't retune the encoder back and forth. A capture that reports no damage counts as a frame
+   *          that changed entirely, such a capture always stays motion.
+   */
+  class classifier_t {
+  public:
+    /**
+     * @param framerate Frames per second of the session, sets how many frames the class stays.
+     */
+    explicit classifier_t(int framerate);
+
+    /**
+     * @brief Account a new frame.
+     * @return The new class when the content changed class, std::nullopt otherwise.
+     */
+    std::optional<content_e>
+    frame(const platf::img_t &img);
+
+  private:
+    double average = 1.0;  // Changed fraction of the picture
+    content_e content = content_e::motion;
+    int min_frames;
+    int frames = 0;  // Since the last change of class
+  };
+}  // namespace content
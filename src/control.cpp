@@ -0,0 +1,71 @@
+/**
+ * @file src/control.cpp
+ * @brief Wire format of the control channel.
+ */
+#include <cstring>
+
+#include "control.h"
+#include "utility.h"
+
+namespace control {
+  std::optional<std::uint32_t>
+  command_t::u32(std::size_t index) const {
+    std::uint32_t result;
+    if ((index + 1) * sizeof(result) > value.size()) {
+      return std::nullopt;
+    }
+
+    std::memcpy(&result, value.data() + index * sizeof(result), sizeof(result));
+    return util::endian::little(result);
+  }
+
+  parser_t::parser_t(std::string_view datagram) {
+    if (datagram.size() < sizeof(header)) {
+      return;
+    }
+
+    std::memcpy(&header, datagram.data(), sizeof(header));
+    header.sequence = util::endian::little(header.sequence);
+    rest = datagram.substr(sizeof(header));
+  }
+
+  std::optional<command_t>
+  parser_t::next() {
+    if (!valid() || rest.size() < sizeof(command_header_t)) {
+      return std::nullopt;
+    }
+
+    command_header_t command;
+    std::memcpy(&command, rest.data(), sizeof(command));
+    auto length = util::endian::little(command.length);
+    if (rest.size() - sizeof(command) < length) {
+      rest = {};
+      return std::nullopt;
+    }
+
+    auto value = rest.substr(sizeof(command), length);
+    rest.remove_prefix(sizeof(command) + length);
+
+    return command_t { command.type, command.session, value };
+  }
+
+  reply_t::reply_t(std::uint16_t sequence):
+      size { sizeof(message_header_t) } {
+    message_header_t header { VERSION, flag::REPLY, util::endian::little(sequence) };
+    std::memcpy(buffer.data(), &header, sizeof(header));
+  }
+
+  bool
+  reply_t::append(std::uint8_t type, std::uint8_t session, std::string_view value) {
+    if (buffer.size() - size < sizeof(command_header_t) + value.size()) {
+      return false;
+    }
+
+    command_header_t command { type, session, util::endian::little((std::uint16_t) value.size()) };
+    std::memcpy(buffer.data() + size, &command, sizeof(command));
+    std::memcpy(buffer.data() + size + sizeof(command), value.data(), value.size());
+    size += sizeof(command) + value.size();
+
+    return true;
+  }
+}  // namespace control
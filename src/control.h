@@ -0,0 +1,174 @@
+/**
+ * @file src/control.h
+ * @brief Wire format of the control channel.
+ */
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace control {
+  /**
+   * @brief First byte of a versioned control datagram.
+   * @details Legacy datagrams start with the event type, which is always below this value.
+   */
+  constexpr std::uint8_t VERSION = 0xC1;
+
+  // Commands for the session that doesn't depend on it, or for all sessions when it does
+  constexpr std::uint8_t ALL_SESSIONS = 0xFF;
+
+  // Largest reply, so it fits in a single datagram on any path
+  constexpr std::size_t MAX_REPLY_SIZE = 1200;
+
+  namespace flag {
+    constexpr std::uint8_t ACK_REQUESTED = 0x01;  ///< Every command is answered with its status
+    constexpr std::uint8_t REPLY = 0x80;  ///< The datagram answers the request with the same sequence
+  }  // namespace flag
+
+  enum class status_e : std::uint8_t {
+    ok,
+    unknown_command,
+    invalid_session,  ///< The session doesn't exist or doesn't accept the command
+    invalid_value,
+    late,  ///< Too late to act on, such as a retransmission that would miss its playout deadline
+    forbidden,  ///< The sender isn't the client of the session
+  };
+
+#pragma pack(push, 1)
+  /**
+   * @brief Header of a versioned control datagram, followed by the commands. All fields are little-endian.
+   */
+  struct message_header_t {
+    std::uint8_t version;  // VERSION
+    std::uint8_t flags;
+    std::uint16_t sequence;  // Echoed in the reply
+  };
+
+  /**
+   * @brief Header of a command, followed by `length` bytes of value.
+   * @details Values are little-endian 32-bit integers: Bitrate in kbps, Framerate in frames per
+   *          second, the first and the last lost transport frame index for InvalidateRefFrames.
+   *          ReceiverReport carries the fields of a congestion::receiver_report_t in order. Nack
+   *          carries the transport frame index, the slice index and the first and the last lost shard.
+   *          Subscribe and Unsubscribe carry the port of the viewer followed by the 4 or 16 bytes of its
+   *          address in network order. AudioPacketLoss carries the expected loss in percent, AudioDtx
+   *          1 to enable discontinuous transmission and 0 to disable it. Start carries the bitrate and
+   *          the framerate, 0 keeps the one of the session, followed by the destination as in Subscribe.
+   *          Negotiate carries the codecs the client decodes as bits of their video format, its flags
+   *          of NEGOTIATE_10BIT and NEGOTIATE_YUV444, and the largest width, height and framerate it
+   *          decodes, 0 if it has no limit. It's answered with a negotiation_t of every selected rung.
+   *          Idr, LatencyReport, TraceDump and Metrics take no value, LatencyReport is answered with a
+   *          latency::report_t and Metrics with a metrics::report_t of every selected session.
+   *          Subscribe, Unsubscribe, Negotiate, ReceiverReport and TraceDump are refused as forbidden
+   *          unless they come from the host of the client of every selected session, Nack unless it
+   *          comes from the client or a viewer of the session.
+   */
+  struct command_header_t {
+    std::uint8_t type;  // EventType
+    std::uint8_t session;  // The rungs of the video followed by audio, or ALL_SESSIONS
+    std::uint16_t length;
+  };
+
+  constexpr std::uint32_t NEGOTIATE_10BIT = 0x01;
+  constexpr std::uint32_t NEGOTIATE_YUV444 = 0x02;
+
+  /**
+   * @brief Answer to Negotiate for a rung. All fields are little-endian.
+   * @details A rung that changed rebuilds its encode session, the first frame of the new codec is an IDR frame.
+   */
+  struct negotiation_t {
+    std::uint8_t type;  // EventType::Negotiate
+    std::uint8_t session;
+    std::uint8_t video_format;  // 0 - H.264, 1 - HEVC, 2 - AV1
+    std::uint8_t flags;  // The NEGOTIATE_10BIT and NEGOTIATE_YUV444 the rung encodes with
+    std::uint16_t width;  // 0 follows the display resolution, within the limits of the client
+    std::uint16_t height;
+    std::uint32_t framerate;
+  };
+#pragma pack(pop)
+
+  struct command_t {
+    std::uint8_t type;
+    std::uint8_t session;
+    std::string_view value;
+
+    /**
+     * @brief The little-endian 32-bit integer at `index` of the value.
+     */
+    std::optional<std::uint32_t>
+    u32(std::size_t index = 0) const;
+  };
+
+  /**
+   * @brief Walks the commands of a versioned datagram in place.
+   */
+  class parser_t {
+  public:
+    /**
+     * @param datagram The received datagram, it must outlive the parser.
+     */
+    explicit parser_t(std::string_view datagram);
+
+    /**
+     * @return Whether the datagram starts with a header of a known version.
+     */
+    bool
+    valid() const {
+      return header.version == VERSION;
+    }
+
+    const message_header_t &
+    message() const {
+      return header;
+    }
+
+    /**
+     * @return The next command, empty at the end of the datagram or when the rest of it is truncated.
+     */
+    std::optional<command_t>
+    next();
+
+  private:
+    message_header_t header {};
+    std::string_view rest;
+  };
+
+  /**
+   * @brief Builds a reply of several commands in a fixed buffer.
+   */
+  class reply_t {
+  public:
+    explicit reply_t(std::uint16_t sequence);
+
+    /**
+     * @return false if the command doesn't fit in the reply anymore, it isn't added.
+     */
+    bool
+    append(std::uint8_t type, std::uint8_t session, std::string_view value);
+
+    bool
+    append(std::uint8_t type, std::uint8_t session, status_e status) {
+      return append(type, session, std::string_view { (const char *) &status, sizeof(status) });
+    }
+
+    /**
+     * @return Whether any command was added.
+     */
+    bool
+    empty() const {
+      return size == sizeof(message_header_t);
+    }
+
+    std::string_view
+    data() const {
+      return { buffer.data(), size };
+    }
+
+  private:
+    std::array<char, MAX_REPLY_SIZE> buffer;
+    std::size_t size;
+  };
+}  // namespace control
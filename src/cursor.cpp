@@ -0,0 +1,103 @@
+/**
+ * @file src/cursor.cpp
+ * @brief Cursor shape and position for clients that draw the cursor themselves.
+ */
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
+#include "cursor.h"
+
+namespace cursor {
+  namespace {
+    std::atomic_bool publishing { false };
+
+    // Only the latest cursor matters, the consumer skips the changes it was too slow to see
+    std::mutex mutex;
+    std::condition_variable changed;
+    state_t current;
+
+    // FNV-1a of the size, the hotspot and the pixels, clients cache shapes by it
+    std::uint64_t
+    hash_shape(int width, int height, int hotspot_x, int hotspot_y, const std::vector<std::uint8_t> &pixels) {
+      std::uint64_t hash = 0xcbf29ce484222325ULL;
+      auto mix = [&](const void *data, std::size_t size) {
+        auto bytes = (const std::uint8_t *) data;
+        for (std::size_t x = 0; x < size; ++x) {
+          hash = (hash ^ bytes[x]) * 0x100000001b3ULL;
+        }
+      };
+
+      int header[] { width, height, hotspot_x, hotspot_y };
+      mix(header, sizeof(header));
+      mix(pixels.data(), pixels.size());
+      return hash;
+    }
+
+    void
+    publish() {
+      ++current.serial;
+      changed.notify_all();
+    }
+  }  // namespace
+
+  bool
+  enabled() {
+    return publishing.load(std::memory_order_relaxed);
+  }
+
+  void
+  enable(bool enabled) {
+    std::lock_guard lg { mutex };
+    publishing.store(enabled, std::memory_order_relaxed);
+    if (enabled) {
+      ++current.generation;
+      publish();
+    }
+  }
+
+  void
+  update_shape(int width, int height, int hotspot_x, int hotspot_y, const std::uint8_t *pixels, std::size_t row_pitch) {
+    auto shape = std::make_shared<shape_t>();
+    shape->width = width;
+    shape->height = height;
+    shape->hotspot_x = hotspot_x;
+    shape->hotspot_y = hotspot_y;
+    shape->pixels.resize((std::size_t) width * height * 4);
+    for (int y = 0; y < height; ++y) {
+      std::memcpy(&shape->pixels[(std::size_t) y * width * 4], pixels + y * row_pitch, (std::size_t) width * 4);
+    }
+    shape->hash = hash_shape(width, height, hotspot_x, hotspot_y, shape->pixels);
+
+    std::lock_guard lg { mutex };
+    if (current.shape && current.shape->hash == shape->hash) {
+      return;
+    }
+
+    current.shape = std::move(shape);
+    publish();
+  }
+
+  void
+  update_position(int x, int y, bool visible) {
+    std::lock_guard lg { mutex };
+    auto &position = current.position;
+    if (position.x == x && position.y == y && position.visible == visible) {
+      return;
+    }
+
+    position = { x, y, visible };
+    publish();
+  }
+
+  std::optional<state_t>
+  wait(std::uint64_t serial, std::chrono::milliseconds timeout) {
+    std::unique_lock ul { mutex };
+    if (!changed.wait_for(ul, timeout, [serial]() { return current.serial != serial; })) {
+      return std::nullopt;
+    }
+
+    return current;
+  }
+}  // namespace cursor
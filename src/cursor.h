@@ -0,0 +1,75 @@
+/**
+ * @file src/cursor.h
+ * @brief Cursor shape and position for clients that draw the cursor themselves.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace cursor {
+  struct shape_t {
+    std::uint64_t hash;
+    int width;
+    int height;
+    // Point of the image that is at the position of the pointer
+    int hotspot_x;
+    int hotspot_y;
+    // Premultiplied BGRA, tightly packed
+    std::vector<std::uint8_t> pixels;
+  };
+
+  struct position_t {
+    // Top-left corner of the cursor image, in pixels of the captured display
+    int x = 0;
+    int y = 0;
+    bool visible = false;
+  };
+
+  /**
+   * @brief Latest cursor of the captured display.
+   * @details `serial` grows with every change, `generation` whenever every shape must be sent again.
+   */
+  struct state_t {
+    std::shared_ptr<const shape_t> shape;
+    position_t position;
+    std::uint64_t serial = 0;
+    std::uint64_t generation = 0;
+  };
+
+  /**
+   * @brief Whether the capture backends publish the cursor, they only pay for it while a client asked for it.
+   */
+  bool
+  enabled();
+
+  /**
+   * @brief Start or stop publishing the cursor, starting again sends the shapes again.
+   */
+  void
+  enable(bool enabled);
+
+  /**
+   * @brief Replace the shape of the cursor, nothing is published if the image didn't change.
+   * @param pixels Premultiplied BGRA rows of `row_pitch` bytes.
+   */
+  void
+  update_shape(int width, int height, int hotspot_x, int hotspot_y, const std::uint8_t *pixels, std::size_t row_pitch);
+
+  /**
+   * @brief Move, show or hide the cursor, nothing is published if it didn't change.
+   */
+  void
+  update_position(int x, int y, bool visible);
+
+  /**
+   * @brief Wait until the cursor changes after `serial`.
+   * @return The latest cursor, std::nullopt on timeout.
+   */
+  std::optional<state_t>
+  wait(std::uint64_t serial, std::chrono::milliseconds timeout);
+}  // namespace cursor
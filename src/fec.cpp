@@ -0,0 +1,226 @@
+/**
+ * @file src/fec.cpp
+ * @brief Reed-Solomon forward error correction over GF(2^8).
+ */
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+  #define SUNSHINE_FEC_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+  #define SUNSHINE_FEC_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#include "fec.h"
+
+namespace fec {
+  namespace {
+    // x^8 + x^4 + x^3 + x^2 + 1, the usual Reed-Solomon field polynomial
+    constexpr unsigned GF_POLY = 0x11D;
+
+    struct gf_tables_t {
+      std::array<std::uint8_t, 512> exp;
+      std::array<std::uint8_t, 256> log;
+
+      // Split multiplication tables used by the shuffle based kernels:
+      // c * b == lo[c][b & 0xF] ^ hi[c][b >> 4]
+      std::array<std::array<std::uint8_t, 16>, 256> lo;
+      std::array<std::array<std::uint8_t, 16>, 256> hi;
+
+      gf_tables_t() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; ++i) {
+          exp[i] = (std::uint8_t) x;
+          log[x] = (std::uint8_t) i;
+
+          x <<= 1;
+          if (x & 0x100) {
+            x ^= GF_POLY;
+          }
+        }
+        for (int i = 255; i < 512; ++i) {
+          exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+
+        for (int c = 0; c < 256; ++c) {
+          for (int n = 0; n < 16; ++n) {
+            lo[c][n] = mul(c, n);
+            hi[c][n] = mul(c, n << 4);
+          }
+        }
+      }
+
+      std::uint8_t
+      mul(unsigned a, unsigned b) const {
+        if (!a || !b) {
+          return 0;
+        }
+
+        return exp[log[a] + log[b]];
+      }
+
+      std::uint8_t
+      inv(unsigned a) const {
+        return exp[255 - log[a]];
+      }
+    };
+
+    const gf_tables_t &
+    gf() {
+      static const gf_tables_t tables;
+      return tables;
+    }
+
+    using mul_add_fn = void (*)(std::uint8_t *dst, const std::uint8_t *src, std::uint8_t c, std::size_t size);
+
+    /**
+     * @brief dst ^= c * src, one byte at a time.
+     */
+    void
+    mul_add_scalar(std::uint8_t *dst, const std::uint8_t *src, std::uint8_t c, std::size_t size) {
+      auto &lo = gf().lo[c];
+      auto &hi = gf().hi[c];
+
+      for (std::size_t x = 0; x < size; ++x) {
+        dst[x] ^= lo[src[x] & 0xF] ^ hi[src[x] >> 4];
+      }
+    }
+
+#ifdef SUNSHINE_FEC_X86
+    __attribute__((target("ssse3"))) void
+    mul_add_ssse3(std::uint8_t *dst, const std::uint8_t *src, std::uint8_t c, std::size_t size) {
+      auto lo = _mm_loadu_si128((const __m128i *) gf().lo[c].data());
+      auto hi = _mm_loadu_si128((const __m128i *) gf().hi[c].data());
+      auto mask = _mm_set1_epi8(0x0F);
+
+      std::size_t x = 0;
+      for (; x + 16 <= size; x += 16) {
+        auto in = _mm_loadu_si128((const __m128i *) (src + x));
+        auto out = _mm_loadu_si128((const __m128i *) (dst + x));
+
+        auto l = _mm_shuffle_epi8(lo, _mm_and_si128(in, mask));
+        auto h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(in, 4), mask));
+
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_xor_si128(out, _mm_xor_si128(l, h)));
+      }
+
+      mul_add_scalar(dst + x, src + x, c, size - x);
+    }
+
+    __attribute__((target("avx2"))) void
+    mul_add_avx2(std::uint8_t *dst, const std::uint8_t *src, std::uint8_t c, std::size_t size) {
+      auto lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) gf().lo[c].data()));
+      auto hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) gf().hi[c].data()));
+      auto mask = _mm256_set1_epi8(0x0F);
+
+      std::size_t x = 0;
+      for (; x + 32 <= size; x += 32) {
+        auto in = _mm256_loadu_si256((const __m256i *) (src + x));
+        auto out = _mm256_loadu_si256((const __m256i *) (dst + x));
+
+        auto l = _mm256_shuffle_epi8(lo, _mm256_and_si256(in, mask));
+        auto h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(in, 4), mask));
+
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_xor_si256(out, _mm256_xor_si256(l, h)));
+      }
+
+      mul_add_scalar(dst + x, src + x, c, size - x);
+    }
+#endif
+
+#ifdef SUNSHINE_FEC_NEON
+    void
+    mul_add_neon(std::uint8_t *dst, const std::uint8_t *src, std::uint8_t c, std::size_t size) {
+      auto lo = vld1q_u8(gf().lo[c].data());
+      auto hi = vld1q_u8(gf().hi[c].data());
+      auto mask = vdupq_n_u8(0x0F);
+
+      std::size_t x = 0;
+      for (; x + 16 <= size; x += 16) {
+        auto in = vld1q_u8(src + x);
+        auto out = vld1q_u8(dst + x);
+
+        auto l = vqtbl1q_u8(lo, vandq_u8(in, mask));
+        auto h = vqtbl1q_u8(hi, vshrq_n_u8(in, 4));
+
+        vst1q_u8(dst + x, veorq_u8(out, veorq_u8(l, h)));
+      }
+
+      mul_add_scalar(dst + x, src + x, c, size - x);
+    }
+#endif
+
+    struct kernel_t {
+      mul_add_fn mul_add;
+      const char *name;
+    };
+
+    kernel_t
+    select_kernel() {
+#ifdef SUNSHINE_FEC_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return { mul_add_avx2, "avx2" };
+      }
+      if (__builtin_cpu_supports("ssse3")) {
+        return { mul_add_ssse3, "ssse3" };
+      }
+#elif defined(SUNSHINE_FEC_NEON)
+      return { mul_add_neon, "neon" };
+#endif
+      return { mul_add_scalar, "scalar" };
+    }
+
+    const kernel_t &
+    kernel() {
+      static const kernel_t selected = select_kernel();
+      return selected;
+    }
+  }  // namespace
+
+  const char *
+  kernel_name() {
+    return kernel().name;
+  }
+
+  rs_t::rs_t(std::size_t data_shards, std::size_t parity_shards):
+      _data_shards { data_shards }, _parity_shards { parity_shards }, matrix(data_shards * parity_shards) {
+    auto &tables = gf();
+
+    // Cauchy matrix: m[i][j] = 1 / (x_i + y_j), with x_i = data_shards + i and y_j = j.
+    // All x_i and y_j are distinct, so every square submatrix is invertible.
+    for (std::size_t i = 0; i < parity_shards; ++i) {
+      for (std::size_t j = 0; j < data_shards; ++j) {
+        matrix[i * data_shards + j] = tables.inv((data_shards + i) ^ j);
+      }
+    }
+  }
+
+  void
+  rs_t::encode(const std::uint8_t *const *data, std::uint8_t *const *parity, std::size_t size) const {
+    auto mul_add = kernel().mul_add;
+
+    for (std::size_t i = 0; i < _parity_shards; ++i) {
+      std::memset(parity[i], 0, size);
+
+      auto row = &matrix[i * _data_shards];
+      for (std::size_t j = 0; j < _data_shards; ++j) {
+        mul_add(parity[i], data[j], row[j], size);
+      }
+    }
+  }
+
+  std::size_t
+  parity_shards_for(std::size_t data_shards, int percentage) {
+    if (percentage <= 0 || !data_shards) {
+      return 0;
+    }
+
+    auto parity = std::max<std::size_t>(1, (data_shards * percentage + 99) / 100);
+    return std::min(parity, MAX_SHARDS - std::min(data_shards, MAX_SHARDS - 1));
+  }
+}  // namespace fec
@@ -0,0 +1,65 @@
+/**
+ * @file src/fec.h
+ * @brief Reed-Solomon forward error correction over GF(2^8).
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fec {
+  // Data and parity shards of a single FEC block must fit in the field
+  constexpr std::size_t MAX_SHARDS = 255;
+
+  /**
+   * @brief Name of the GF(2^8) multiply kernel that was selected for this CPU.
+   */
+  const char *
+  kernel_name();
+
+  /**
+   * @brief Systematic Reed-Solomon encoder based on a Cauchy matrix.
+   * @details Any `data_shards` out of the `data_shards + parity_shards` shards are
+   *          sufficient to reconstruct the data.
+   */
+  class rs_t {
+  public:
+    rs_t(std::size_t data_shards, std::size_t parity_shards);
+
+    /**
+     * @brief Compute the parity shards.
+     * @param data Pointers to `data_shards` shards of `size` bytes.
+     * @param parity Pointers to `parity_shards` shards of `size` bytes, they are overwritten.
+     * @param size Size of every shard in bytes.
+     */
+    void
+    encode(const std::uint8_t *const *data, std::uint8_t *const *parity, std::size_t size) const;
+
+    std::size_t
+    data_shards() const {
+      return _data_shards;
+    }
+
+    std::size_t
+    parity_shards() const {
+      return _parity_shards;
+    }
+
+  private:
+    std::size_t _data_shards;
+    std::size_t _parity_shards;
+
+    // parity_shards x data_shards coefficients
+    std::vector<std::uint8_t> matrix;
+  };
+
+  /**
+   * @brief Number of parity shards for a block of data shards.
+   * @param data_shards Number of data shards.
+   * @param percentage Parity overhead in percent of the data shards.
+   * @return At least one parity shard when percentage is positive.
+   */
+  std::size_t
+  parity_shards_for(std::size_t data_shards, int percentage);
+}  // namespace fec
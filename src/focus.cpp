@@ -0,0 +1,67 @@
+/**
+ * @file src/focus.cpp
+ * @brief Regions of a frame the viewer looks at, encoded at a lower QP.
+ */
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
+#include "config.h"
+#include "content.h"
+#include "focus.h"
+
+namespace focus {
+  namespace {
+    // Beyond this many rectangles the damage is scattered, emphasis wouldn't point anywhere
+    constexpr std::size_t MAX_DAMAGE_REGIONS = 16;
+
+    // Damage covering more of the picture is motion, the whole frame matters
+    constexpr double MAX_DAMAGE_FRACTION = 0.25;
+  }  // namespace
+
+  std::vector<region_t>
+  regions(const platf::img_t &img, int frame_width, int frame_height) {
+    auto &settings = config::video.focus;
+
+    std::vector<region_t> regions;
+    if (settings.qp_delta <= 0 || img.width <= 0 || img.height <= 0 || frame_width <= 0 || frame_height <= 0) {
+      return regions;
+    }
+
+    const auto scale = std::min((double) frame_width / img.width, (double) frame_height / img.height);
+    const auto offset_x = (frame_width - img.width * scale) / 2;
+    const auto offset_y = (frame_height - img.height * scale) / 2;
+
+    auto to_frame = [&](const platf::rect_t &rect, int margin) -> std::optional<platf::rect_t> {
+      platf::rect_t result {
+        std::max(0, (int) std::floor(offset_x + rect.left * scale) - margin),
+        std::max(0, (int) std::floor(offset_y + rect.top * scale) - margin),
+        std::min(frame_width, (int) std::ceil(offset_x + rect.right * scale) + margin),
+        std::min(frame_height, (int) std::ceil(offset_y + rect.bottom * scale) + margin),
+      };
+
+      if (result.left >= result.right || result.top >= result.bottom) {
+        return std::nullopt;
+      }
+      return result;
+    };
+
+    const auto qp_delta = std::min(settings.qp_delta, 51);
+
+    if (img.cursor_rect) {
+      if (auto rect = to_frame(*img.cursor_rect, std::max(0, settings.radius))) {
+        regions.push_back({ *rect, -qp_delta });
+      }
+    }
+
+    if (qp_delta / 2 && img.damage && img.damage->size() <= MAX_DAMAGE_REGIONS && content::changed_fraction(img) <= MAX_DAMAGE_FRACTION) {
+      for (auto &damage : *img.damage) {
+        if (auto rect = to_frame(damage, 0)) {
+          regions.push_back({ *rect, -(qp_delta / 2) });
+        }
+      }
+    }
+
+    return regions;
+  }
+}  // namespace focus
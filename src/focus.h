@@ -0,0 +1,26 @@
+/**
+ * @file src/focus.h
+ * @brief Regions of a frame the viewer looks at, encoded at a lower QP.
+ */
+#pragma once
+
+#include <vector>
+
+#include "platform/common.h"
+
+namespace focus {
+  struct region_t {
+    platf::rect_t rect;  // In pixels of the encoded frame
+    int qp_delta;  // Negative, lowers the QP
+  };
+
+  /**
+   * @brief Regions of an image the viewer looks at, mapped onto the encoded frame.
+   * @details The area around the cursor gets the whole `config::video.focus.qp_delta` and comes first, the
+   *          regions that changed get half of it while they cover a small part of the picture. The frame
+   *          keeps the aspect ratio of the image and centers it, as the encode devices scale it.
+   * @return Nothing if emphasis is disabled or the image tells neither the cursor nor its damage.
+   */
+  std::vector<region_t>
+  regions(const platf::img_t &img, int frame_width, int frame_height);
+}  // namespace focus
@@ -0,0 +1,79 @@
+/**
+ * @file src/futex.cpp
+ * @brief Sleeping on the value of an atomic word, futex on Linux and WaitOnAddress on Windows.
+ */
+#if defined(__linux__)
+  #include <climits>
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#elif defined(_WIN32)
+  #include <windows.h>
+#else
+  #include <thread>
+#endif
+
+#include "futex.h"
+
+using namespace std::literals;
+
+namespace futex {
+  static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "The kernel waits on the word itself");
+
+#if defined(__linux__)
+  void
+  wait(std::atomic<std::uint32_t> &word, std::uint32_t expected) {
+    syscall(SYS_futex, (std::uint32_t *) &word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+  }
+
+  void
+  wait_for(std::atomic<std::uint32_t> &word, std::uint32_t expected, std::chrono::nanoseconds timeout) {
+    timespec relative {
+      (time_t) (timeout / 1s),
+      (long) (timeout % 1s).count(),
+    };
+    syscall(SYS_futex, (std::uint32_t *) &word, FUTEX_WAIT_PRIVATE, expected, &relative, nullptr, 0);
+  }
+
+  void
+  wake_all(std::atomic<std::uint32_t> &word) {
+    syscall(SYS_futex, (std::uint32_t *) &word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+#elif defined(_WIN32)
+  void
+  wait(std::atomic<std::uint32_t> &word, std::uint32_t expected) {
+    WaitOnAddress((volatile void *) &word, &expected, sizeof(expected), INFINITE);
+  }
+
+  void
+  wait_for(std::atomic<std::uint32_t> &word, std::uint32_t expected, std::chrono::nanoseconds timeout) {
+    // Rounded up, a timeout shorter than a millisecond would otherwise spin
+    auto milliseconds = std::chrono::ceil<std::chrono::milliseconds>(timeout).count();
+    WaitOnAddress((volatile void *) &word, &expected, sizeof(expected), (DWORD) milliseconds);
+  }
+
+  void
+  wake_all(std::atomic<std::uint32_t> &word) {
+    WakeByAddressAll((void *) &word);
+  }
+#else
+  void
+  wait(std::atomic<std::uint32_t> &word, std::uint32_t expected) {
+    word.wait(expected);
+  }
+
+  // std::atomic has no timed wait, the word is polled instead
+  void
+  wait_for(std::atomic<std::uint32_t> &word, std::uint32_t expected, std::chrono::nanoseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (word.load() == expected && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(100us);
+    }
+  }
+
+  void
+  wake_all(std::atomic<std::uint32_t> &word) {
+    word.notify_all();
+  }
+#endif
+}  // namespace futex
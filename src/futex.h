@@ -0,0 +1,41 @@
+/**
+ * @file src/futex.h
+ * @brief Sleeping on the value of an atomic word, futex on Linux and WaitOnAddress on Windows.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace futex {
+  /**
+   * @brief Hint to the CPU that the thread is spinning.
+   */
+  inline void
+  pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  /**
+   * @brief Sleep while `word` holds `expected`, returns spuriously like a condition variable.
+   */
+  void
+  wait(std::atomic<std::uint32_t> &word, std::uint32_t expected);
+
+  /**
+   * @brief Sleep while `word` holds `expected`, at most for `timeout`.
+   */
+  void
+  wait_for(std::atomic<std::uint32_t> &word, std::uint32_t expected, std::chrono::nanoseconds timeout);
+
+  /**
+   * @brief Wake every thread sleeping on `word`.
+   */
+  void
+  wake_all(std::atomic<std::uint32_t> &word);
+}  // namespace futex
@@ -30,6 +30,9 @@ namespace mail {
   MAIL(audio_packets);
   MAIL(bitrate);
   MAIL(framerate);
+  MAIL(fec_percentage);
+  MAIL(audio_packet_loss);
+  MAIL(audio_dtx);
 
   // Local mail
   MAIL(touch_port);
@@ -37,6 +40,12 @@ namespace mail {
   MAIL(invalidate_ref_frames);
   MAIL(gamepad_feedback);
   MAIL(hdr);
+  MAIL(encoding);
 #undef MAIL
 
+  // The sending thread of the session is the only consumer of the packets, the slices of a frame may come from several threads.
+  // A full ring drops the newest packet, the sender then flushes up to an IDR frame it requests
+  constexpr auto video_packets_mode = safe::queue_mode_e::mpsc;
+  constexpr auto audio_packets_mode = safe::queue_mode_e::spsc;
+
 }  // namespace mail
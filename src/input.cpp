@@ -0,0 +1,375 @@
+/**
+ * @file src/input.cpp
+ * @brief Injects the input packets of the client through the platform.
+ */
+#include <algorithm>
+#include <string>
+
+#include <Input.h>
+
+#include "input.h"
+#include "logging.h"
+#include "utility.h"
+
+using namespace std::literals;
+
+namespace input {
+  namespace {
+    /**
+     * @return The packet as T, nullptr if it's too short for one.
+     */
+    template <class T>
+    const T *
+    as(std::string_view packet) {
+      return packet.size() >= sizeof(T) ? (const T *) packet.data() : nullptr;
+    }
+  }  // namespace
+
+  std::shared_ptr<receiver_t>
+  receiver_t::make(int poll_rate) {
+    if (poll_rate <= 0) {
+      BOOST_LOG(error) << "The poll rate of the input channel must be positive"sv;
+      return nullptr;
+    }
+
+    auto platf_input = platf::input();
+    if (!platf_input) {
+      BOOST_LOG(error) << "Couldn't create the virtual input devices, input isn't injected"sv;
+      return nullptr;
+    }
+
+    return std::shared_ptr<receiver_t>(new receiver_t(std::move(platf_input), std::chrono::nanoseconds { 1s } / poll_rate));
+  }
+
+  receiver_t::receiver_t(platf::input_t &&platf_input, std::chrono::nanoseconds period):
+      platf_input { std::move(platf_input) }, period { period } {
+    thread = std::thread { &receiver_t::run, this };
+  }
+
+  receiver_t::~receiver_t() {
+    {
+      std::lock_guard lg { mutex };
+      stopped = true;
+    }
+    cv.notify_one();
+    thread.join();
+  }
+
+  void
+  receiver_t::datagram(std::string_view buffer) {
+    while (buffer.size() >= sizeof(NV_INPUT_HEADER)) {
+      // The size doesn't count the size field itself
+      auto header = (const NV_INPUT_HEADER *) buffer.data();
+      auto size = (std::size_t) util::endian::big(header->size) + sizeof(header->size);
+      if (size < sizeof(NV_INPUT_HEADER) || size > buffer.size()) {
+        BOOST_LOG_LIMITED(warning) << "invalid input packet of "sv << size << " bytes"sv;
+        return;
+      }
+
+      packet(buffer.substr(0, size));
+      buffer.remove_prefix(size);
+    }
+  }
+
+  void
+  receiver_t::set_touch_port(const touch_port_t &touch_port) {
+    std::lock_guard lg { mutex };
+    this->touch_port = touch_port;
+  }
+
+  void
+  receiver_t::packet(std::string_view packet) {
+    // Only the magic numbers of Gen 5 and later clients, the older ones collide with them
+    auto magic = util::endian::little(as<NV_INPUT_HEADER>(packet)->magic);
+    switch (magic) {
+      case MOUSE_MOVE_REL_MAGIC_GEN5: {
+        auto move = as<NV_REL_MOUSE_MOVE_PACKET>(packet);
+        if (!move) {
+          break;
+        }
+
+        std::lock_guard lg { mutex };
+        delta_x += util::endian::big(move->deltaX);
+        delta_y += util::endian::big(move->deltaY);
+        coalesce();
+        return;
+      }
+      case MOUSE_MOVE_ABS_MAGIC: {
+        auto move = as<NV_ABS_MOUSE_MOVE_PACKET>(packet);
+        if (!move) {
+          break;
+        }
+
+        float width = util::endian::big(move->width);
+        float height = util::endian::big(move->height);
+        if (width <= 0 || height <= 0) {
+          break;
+        }
+
+        std::lock_guard lg { mutex };
+        if (!touch_port || !*touch_port) {
+          return;
+        }
+
+        // From the size the client renders the video at to the encoded frame, then to the display
+        auto &port = *touch_port;
+        auto x = std::clamp<float>(util::endian::big(move->x), 0, width) * port.width / width;
+        auto y = std::clamp<float>(util::endian::big(move->y), 0, height) * port.height / height;
+        x = std::clamp(x, port.client_offsetX, port.width - port.client_offsetX);
+        y = std::clamp(y, port.client_offsetY, port.height - port.client_offsetY);
+
+        position = std::pair { (x - port.client_offsetX) * port.scalar_inv, (y - port.client_offsetY) * port.scalar_inv };
+        coalesce();
+        return;
+      }
+      case MOUSE_BUTTON_DOWN_EVENT_MAGIC_GEN5:
+      case MOUSE_BUTTON_UP_EVENT_MAGIC_GEN5: {
+        auto button = as<NV_MOUSE_BUTTON_PACKET>(packet);
+        if (!button) {
+          break;
+        }
+
+        push([button = (int) button->button, release = magic == MOUSE_BUTTON_UP_EVENT_MAGIC_GEN5](platf::input_t &input) {
+          platf::button_mouse(input, button, release);
+        });
+        return;
+      }
+      case SCROLL_MAGIC_GEN5: {
+        auto scroll = as<NV_SCROLL_PACKET>(packet);
+        if (!scroll) {
+          break;
+        }
+
+        push([distance = (int) util::endian::big(scroll->scrollAmt1)](platf::input_t &input) {
+          platf::scroll(input, distance);
+        });
+        return;
+      }
+      case SS_HSCROLL_MAGIC: {
+        auto scroll = as<SS_HSCROLL_PACKET>(packet);
+        if (!scroll) {
+          break;
+        }
+
+        push([distance = (int) util::endian::big(scroll->scrollAmount)](platf::input_t &input) {
+          platf::hscroll(input, distance);
+        });
+        return;
+      }
+      case KEY_DOWN_EVENT_MAGIC:
+      case KEY_UP_EVENT_MAGIC: {
+        auto key = as<NV_KEYBOARD_PACKET>(packet);
+        if (!key) {
+          break;
+        }
+
+        // The high byte of the key code is a flag of the client, the low byte is the virtual key
+        auto modcode = (std::uint16_t) (util::endian::little((std::uint16_t) key->keyCode) & 0x00FF);
+        push([modcode, release = magic == KEY_UP_EVENT_MAGIC, flags = (std::uint8_t) key->flags](platf::input_t &input) {
+          platf::keyboard_update(input, modcode, release, flags);
+        });
+        return;
+      }
+      case UTF8_TEXT_EVENT_MAGIC: {
+        auto size = std::min<std::size_t>(packet.size() - sizeof(NV_INPUT_HEADER), UTF8_TEXT_EVENT_MAX_COUNT);
+        push([text = std::string { packet.substr(sizeof(NV_INPUT_HEADER), size) }](platf::input_t &input) mutable {
+          platf::unicode(input, text.data(), (int) text.size());
+        });
+        return;
+      }
+      case MULTI_CONTROLLER_MAGIC_GEN5: {
+        auto controller = as<NV_MULTI_CONTROLLER_PACKET>(packet);
+        if (!controller) {
+          break;
+        }
+
+        platf::gamepad_state_t state {
+          (std::uint32_t) (std::uint16_t) util::endian::little(controller->buttonFlags) |
+            ((std::uint32_t) (std::uint16_t) util::endian::little(controller->buttonFlags2) << 16),
+          controller->leftTrigger,
+          controller->rightTrigger,
+          util::endian::little(controller->leftStickX),
+          util::endian::little(controller->leftStickY),
+          util::endian::little(controller->rightStickX),
+          util::endian::little(controller->rightStickY),
+        };
+        gamepad(util::endian::little(controller->controllerNumber), (std::uint16_t) util::endian::little(controller->activeGamepadMask), state);
+        return;
+      }
+      case SS_CONTROLLER_ARRIVAL_MAGIC: {
+        auto arrival = as<SS_CONTROLLER_ARRIVAL_PACKET>(packet);
+        if (!arrival || arrival->controllerNumber >= platf::MAX_GAMEPADS) {
+          break;
+        }
+
+        int nr = arrival->controllerNumber;
+        if (active_gamepads & (1 << nr)) {
+          return;
+        }
+        active_gamepads |= 1 << nr;
+        last_gamepads[nr] = {};
+
+        platf::gamepad_arrival_t metadata {
+          arrival->type,
+          util::endian::little(arrival->capabilities),
+          util::endian::little(arrival->supportedButtonFlags),
+        };
+        push([this, nr, metadata](platf::input_t &input) {
+          plugged[nr] = !platf::alloc_gamepad(input, { nr, (std::uint8_t) nr }, metadata);
+        });
+        return;
+      }
+      case SS_TOUCH_MAGIC:
+      case SS_PEN_MAGIC:
+      case SS_CONTROLLER_TOUCH_MAGIC:
+      case SS_CONTROLLER_MOTION_MAGIC:
+      case SS_CONTROLLER_BATTERY_MAGIC:
+      case ENABLE_HAPTICS_MAGIC:
+        BOOST_LOG(debug) << "input packet "sv << util::hex(magic).to_string_view() << " isn't injected"sv;
+        return;
+      default:
+        BOOST_LOG_LIMITED(warning) << "unknown input packet "sv << util::hex(magic).to_string_view();
+        return;
+    }
+
+    BOOST_LOG_LIMITED(warning) << "invalid input packet "sv << util::hex(magic).to_string_view() << " of "sv << packet.size() << " bytes"sv;
+  }
+
+  void
+  receiver_t::gamepad(int nr, std::uint16_t active_mask, const platf::gamepad_state_t &state) {
+    // Gamepads the client no longer has
+    for (int x = 0; x < platf::MAX_GAMEPADS; ++x) {
+      if ((active_gamepads & (1 << x)) && !(active_mask & (1 << x))) {
+        active_gamepads &= ~(1 << x);
+        push([this, x](platf::input_t &input) {
+          if (plugged[x]) {
+            platf::free_gamepad(input, x);
+            plugged[x] = false;
+          }
+        });
+      }
+    }
+
+    if (nr < 0 || nr >= platf::MAX_GAMEPADS || !(active_mask & (1 << nr))) {
+      return;
+    }
+
+    // Clients that don't announce their gamepads get one of the default type
+    if (!(active_gamepads & (1 << nr))) {
+      active_gamepads |= 1 << nr;
+      last_gamepads[nr] = {};
+      push([this, nr](platf::input_t &input) {
+        plugged[nr] = !platf::alloc_gamepad(input, { nr, (std::uint8_t) nr }, {});
+      });
+    }
+
+    // A changed button is injected in order, a change of the axes alone is coalesced
+    auto buttons_changed = state.buttonFlags != last_gamepads[nr].buttonFlags;
+    last_gamepads[nr] = state;
+    if (buttons_changed) {
+      push(gamepad_update(nr, state));
+      return;
+    }
+
+    std::lock_guard lg { mutex };
+    gamepads[nr] = state;
+    coalesce();
+  }
+
+  receiver_t::event_t
+  receiver_t::gamepad_update(int nr, const platf::gamepad_state_t &state) {
+    return [this, nr, state](platf::input_t &input) {
+      if (plugged[nr]) {
+        platf::gamepad_update(input, nr, state);
+      }
+    };
+  }
+
+  void
+  receiver_t::push(event_t &&event) {
+    {
+      std::lock_guard lg { mutex };
+      flush();
+      events.emplace_back(std::move(event));
+    }
+    cv.notify_one();
+  }
+
+  void
+  receiver_t::coalesce() {
+    // Later updates of the same tick don't wake the thread again
+    if (!coalesced) {
+      coalesced = true;
+      cv.notify_one();
+    }
+  }
+
+  void
+  receiver_t::flush() {
+    if (!coalesced) {
+      return;
+    }
+    coalesced = false;
+
+    if (delta_x || delta_y) {
+      events.emplace_back([delta_x = delta_x, delta_y = delta_y](platf::input_t &input) {
+        platf::move_mouse(input, delta_x, delta_y);
+      });
+      delta_x = 0;
+      delta_y = 0;
+    }
+
+    if (position && touch_port) {
+      platf::touch_port_t desktop { touch_port->offset_x, touch_port->offset_y, touch_port->env_width, touch_port->env_height };
+      events.emplace_back([desktop, position = *position](platf::input_t &input) {
+        platf::abs_mouse(input, desktop, position.first, position.second);
+      });
+    }
+    position.reset();
+
+    for (int nr = 0; nr < platf::MAX_GAMEPADS; ++nr) {
+      if (gamepads[nr]) {
+        events.emplace_back(gamepad_update(nr, *gamepads[nr]));
+        gamepads[nr].reset();
+      }
+    }
+  }
+
+  void
+  receiver_t::run() {
+    platf::adjust_thread_priority(platf::thread_priority_e::high);
+
+    auto next_tick = std::chrono::steady_clock::now();
+    std::deque<event_t> batch;
+
+    std::unique_lock ul { mutex };
+    while (!stopped) {
+      if (events.empty()) {
+        if (!coalesced) {
+          cv.wait(ul);
+          continue;
+        }
+
+        // The first update after a pause goes out right away, the next one a tick later
+        auto now = std::chrono::steady_clock::now();
+        if (now < next_tick) {
+          cv.wait_until(ul, next_tick);
+          continue;
+        }
+
+        flush();
+        next_tick = now + period;
+      }
+
+      batch.swap(events);
+      ul.unlock();
+
+      for (auto &event : batch) {
+        event(platf_input);
+      }
+      batch.clear();
+
+      ul.lock();
+    }
+  }
+}  // namespace input
@@ -1,10 +1,21 @@
 /**
  * @file src/input.h
- * @brief todo
+ * @brief Injects the input packets of the client through the platform.
  */
 #pragma once
 
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <utility>
 
 #include "platform/common.h"
 #include "thread_safe.h"
@@ -23,4 +34,91 @@ namespace input {
       return width != 0 && height != 0 && env_width != 0 && env_height != 0;
     }
   };
+
+  /**
+   * @brief Parses the NV input packets of Input.h in place and injects them on a thread of its own.
+   * @details Buttons, keys and text are injected in the order they arrived. Relative mouse motion,
+   *          absolute positions and gamepad axes are coalesced instead: whatever arrives within a poll
+   *          tick is injected once at the end of it, so a mouse polled at 8 kHz doesn't flood the input
+   *          queue of the OS. A coalesced update goes out before the next button or key, so a click
+   *          always lands where the pointer moved to first.
+   */
+  class receiver_t {
+  public:
+    /**
+     * @param poll_rate Injections per second of the coalesced updates.
+     * @return nullptr if the platform can't inject input.
+     */
+    static std::shared_ptr<receiver_t>
+    make(int poll_rate);
+
+    ~receiver_t();
+
+    /**
+     * @brief Handle a datagram of one or more input packets, it is only read during the call.
+     */
+    void
+    datagram(std::string_view buffer);
+
+    /**
+     * @brief The area of the display the video shows, absolute positions are mapped onto it.
+     */
+    void
+    set_touch_port(const touch_port_t &touch_port);
+
+  private:
+    using event_t = std::function<void(platf::input_t &)>;
+
+    receiver_t(platf::input_t &&platf_input, std::chrono::nanoseconds period);
+
+    void
+    packet(std::string_view packet);
+
+    void
+    gamepad(int nr, std::uint16_t active_mask, const platf::gamepad_state_t &state);
+
+    // Injects the state if the gamepad could be plugged in
+    event_t
+    gamepad_update(int nr, const platf::gamepad_state_t &state);
+
+    /**
+     * @brief Queue a button, key or text event behind the pending coalesced updates.
+     */
+    void
+    push(event_t &&event);
+
+    // Wake the thread of the receiver for the first coalesced update of a tick, called with the mutex held
+    void
+    coalesce();
+
+    // The coalesced updates in the order queue, called with the mutex held
+    void
+    flush();
+
+    void
+    run();
+
+    platf::input_t platf_input;
+    std::chrono::nanoseconds period;
+
+    // Owned by the receiving thread
+    std::uint16_t active_gamepads = 0;
+    std::array<platf::gamepad_state_t, platf::MAX_GAMEPADS> last_gamepads {};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<event_t> events;
+    int delta_x = 0;
+    int delta_y = 0;
+    std::optional<std::pair<float, float>> position;  // Pixels of the display
+    std::array<std::optional<platf::gamepad_state_t>, platf::MAX_GAMEPADS> gamepads;
+    bool coalesced = false;  // Anything of the above is pending
+    std::optional<touch_port_t> touch_port;
+    bool stopped = false;
+
+    // Owned by the thread of the receiver
+    std::bitset<platf::MAX_GAMEPADS> plugged;
+
+    std::thread thread;
+  };
 }  // namespace input
@@ -4,59 +4,396 @@
  */
 #include "interprocess.h"
 #include "logging.h"
+#include "memory.h"
 
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstring>
 #include <thread>
 #include <stdio.h>
 #include <vector>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 
-void
-init_shared_memory(SharedMemory** _memory){
-    *_memory = (SharedMemory*) malloc(sizeof(SharedMemory));
-    SharedMemory* memory = *_memory;
-    memset(memory,0,sizeof(SharedMemory));
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+#ifdef _WIN32
+    // Doorbell of every queue, named after the segment so consumers open the same events
+    HANDLE doorbells[QueueType::QueueMax] {};
+#endif
+
+    Queue* mapped_queues = nullptr;
+
+    std::mutex metadata_mutex;
+
+    std::atomic_ref<int>
+    atomic_index(Queue* queue) {
+        return std::atomic_ref<int> { queue->index };
+    }
+
+    std::atomic_ref<unsigned long long>
+    atomic_position(unsigned long long& position) {
+        return std::atomic_ref<unsigned long long> { position };
+    }
+
+    unsigned long long
+    record_size(std::size_t payload_size) {
+        auto size = sizeof(RecordHeader) + payload_size;
+        return (size + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+    }
+
+    RecordHeader*
+    record_at(Queue* queue, unsigned long long position) {
+        return (RecordHeader*) &queue->ring[position % RING_SIZE];
+    }
+
+    std::atomic_ref<int>
+    atomic_read(Event& event) {
+        return std::atomic_ref<int> { event.read };
+    }
+
+    void
+    ring_doorbell(Queue* queue) {
+#ifdef __linux__
+        // Producers only pay for the syscall when a consumer is asleep
+        if (std::atomic_ref<int> { queue->waiters }.load(std::memory_order_seq_cst) > 0) {
+            syscall(SYS_futex, &queue->index, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+#elif defined(_WIN32)
+        if (mapped_queues) {
+            SetEvent(doorbells[queue - mapped_queues]);
+        }
+#endif
+    }
+
+    void
+    init_queue(Queue* queue) {
+        // Consumers may already be asleep on the queue
+        auto waiters = std::atomic_ref<int> { queue->waiters }.load(std::memory_order_relaxed);
+        memset(queue,0,sizeof(Queue));
+        queue->waiters = waiters;
+        for (int k = 0; k < EventType::EventMax; k++)
+            queue->events[k].read = 1;
+
+        atomic_index(queue).store(0, std::memory_order_release);
+    }
+
+    SharedMemory*
+    map_segment(const char* name) {
+#ifdef _WIN32
+        auto size = (unsigned long long) sizeof(SharedMemory);
+        auto mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, name);
+        if (!mapping) {
+            BOOST_LOG(error) << "CreateFileMapping "sv << name << " failed: "sv << GetLastError();
+            return nullptr;
+        }
+
+        auto memory = (SharedMemory*) MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedMemory));
+        if (!memory) {
+            BOOST_LOG(error) << "MapViewOfFile "sv << name << " failed: "sv << GetLastError();
+            CloseHandle(mapping);
+            return nullptr;
+        }
+
+        for (int j = 0; j < QueueType::QueueMax; j++) {
+            auto event_name = std::string(name) + "-doorbell-" + std::to_string(j);
+            doorbells[j] = CreateEventA(nullptr, FALSE, FALSE, event_name.c_str());
+            if (!doorbells[j]) {
+                BOOST_LOG(error) << "CreateEvent "sv << event_name << " failed: "sv << GetLastError();
+                return nullptr;
+            }
+        }
+
+        return memory;
+#else
+        auto path = "/"s + name;
+        auto fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            BOOST_LOG(error) << "shm_open "sv << path << " failed: "sv << strerror(errno);
+            return nullptr;
+        }
+
+        // Pages are only backed once they are written, so the size of the segment costs nothing up front
+        struct stat st {};
+        if (fstat(fd, &st) || (st.st_size < (off_t) sizeof(SharedMemory) && ftruncate(fd, sizeof(SharedMemory)))) {
+            BOOST_LOG(error) << "Couldn't size shared memory "sv << path << ": "sv << strerror(errno);
+            close(fd);
+            return nullptr;
+        }
+
+        auto memory = mmap(nullptr, sizeof(SharedMemory), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            BOOST_LOG(error) << "mmap "sv << path << " failed: "sv << strerror(errno);
+            return nullptr;
+        }
+
+        // The rings are walked end to end, huge pages save most of their TLB misses
+        ::memory::advise_huge_pages(memory, sizeof(SharedMemory));
+
+        return (SharedMemory*) memory;
+#endif
+    }
+}
+
+int
+init_shared_memory(SharedMemory** _memory, const char* name, int producers){
+    SharedMemory* memory = nullptr;
+    if (name && *name) {
+        memory = map_segment(name);
+        if (!memory) {
+            return -1;
+        }
+    }
+    else {
+        // Without a name the queues are private to this process
+        static_assert(alignof(SharedMemory) <= ::memory::ALIGNMENT);
+        memory = (SharedMemory*) ::memory::allocate(sizeof(SharedMemory));
+        if (!memory) {
+            return -1;
+        }
+
+        memset(memory,0,sizeof(SharedMemory));
+        for (int j = 0; j < QueueType::QueueMax; j++)
+            init_queue(&memory->queues[j]);
+    }
+
+    // Consumers and the producers of the other queues may already be attached, only our own queues start over
     for (int j = 0; j < QueueType::QueueMax; j++) {
-        for (int k = 0; k < EventType::EventMax; k++) 
-            memory->queues[j].events[k].read = 1;
+        if (producers & (1 << j))
+            init_queue(&memory->queues[j]);
+    }
+
+    mapped_queues = memory->queues;
+    *_memory = memory;
+    return 0;
+}
+
+void
+push_packet(Queue* queue,
+                  const std::string_view* segments,
+                  int count,
+                  PacketMetadata metadata){
+    std::size_t size = 0;
+    for (int x = 0; x < count; ++x)
+        size += segments[x].size();
+
+    if (size > PACKET_SIZE) {
+        BOOST_LOG(error) << "Packet of "sv << size << " bytes doesn't fit in shared memory"sv;
+        return;
+    }
+
+    // The producer never waits for consumers, slow consumers skip ahead to the latest packet
+    auto head = atomic_position(queue->head).load(std::memory_order_relaxed);
+    auto size_in_ring = record_size(size);
+
+    // Records don't wrap around, the rest of the ring is skipped when the record doesn't fit
+    auto offset = head % RING_SIZE;
+    auto wrap = offset + size_in_ring > RING_SIZE ? record_at(queue, head) : nullptr;
+    if (wrap) {
+        head += RING_SIZE - offset;
+    }
+
+    // Consumers that read the claim after copying a record can tell whether it was overwritten meanwhile.
+    // The claim covers the wrap marker as well, it's published before anything is written
+    atomic_position(queue->claim).store(head + size_in_ring, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
 
-        memory->queues[j].index = QUEUE_SIZE - 1;
+    if (wrap) {
+        wrap->type = RecordWrap;
+        wrap->size = 0;
     }
+
+    auto record = record_at(queue, head);
+    record->type = RecordPacket;
+    record->size = (int) size;
+    record->metadata = metadata;
+
+    char* data = (char*) (record + 1);
+    for (int x = 0; x < count; ++x) {
+        memcpy(data,segments[x].data(),segments[x].size());
+        data += segments[x].size();
+    }
+
+    // Consumers that see the new head with acquire also see the record
+    atomic_position(queue->head).store(head + size_in_ring, std::memory_order_release);
+    atomic_index(queue).fetch_add(1, std::memory_order_release);
+    ring_doorbell(queue);
 }
 
-void 
-push_packet(Queue* queue, 
-                  void* data, 
-                  int size, 
+void
+push_packet(Queue* queue,
+                  void* data,
+                  int size,
                   PacketMetadata metadata){
-    // wait while queue is full
-    auto new_index = queue->index + 1;
+    std::string_view segment { (const char*) data, (std::size_t) size };
+    push_packet(queue, &segment, 1, metadata);
+}
+
+int
+pop_packet(Queue* queue, unsigned long long* position, void* buffer, int capacity, PacketMetadata* metadata){
+    while (true) {
+        auto head = atomic_position(queue->head).load(std::memory_order_acquire);
+        if (*position == head) {
+            return 0;
+        }
+
+        if (head - *position >= RING_SIZE) {
+            *position = head;
+            return -1;
+        }
+
+        auto record = record_at(queue, *position);
+        auto type = record->type;
+        auto size = record->size;
+        auto record_metadata = record->metadata;
+
+        // The next record may already be claimed over one this close to a lap, its header can't be trusted
+        if (type == RecordPacket && (size < 0 || size > PACKET_SIZE || *position % RING_SIZE + record_size(size) > RING_SIZE ||
+                                     head - *position >= RING_SIZE - record_size(size))) {
+            *position = head;
+            return -1;
+        }
+
+        if (type == RecordPacket && size <= capacity) {
+            memcpy(buffer, record + 1, size);
+        }
+
+        // Whatever was copied is only valid when the producer hasn't come around to it yet
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto claim = atomic_position(queue->claim).load(std::memory_order_relaxed);
+        if (claim - *position > RING_SIZE) {
+            *position = head;
+            return -1;
+        }
+
+        if (type == RecordWrap) {
+            *position += RING_SIZE - *position % RING_SIZE;
+            continue;
+        }
+
+        *position += record_size(size);
+        atomic_position(queue->tail).store(*position, std::memory_order_release);
+        if (size > capacity) {
+            return -2;
+        }
+
+        if (metadata) {
+            *metadata = record_metadata;
+        }
+        return size;
+    }
+}
+
+int
+wait_packet(Queue* queue, int last_index, std::chrono::milliseconds timeout){
+    auto index = atomic_index(queue).load(std::memory_order_acquire);
+    if (index != last_index) {
+        return index;
+    }
+
+#ifdef __linux__
+    std::atomic_ref<int> waiters { queue->waiters };
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+
+    // The kernel compares the index with last_index, a packet published in between isn't missed
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    timespec ts { (time_t) seconds.count(), (long) std::chrono::nanoseconds { timeout - seconds }.count() };
+    syscall(SYS_futex, &queue->index, FUTEX_WAIT, last_index, &ts, nullptr, 0);
+
+    waiters.fetch_sub(1, std::memory_order_seq_cst);
+#elif defined(_WIN32)
+    if (mapped_queues) {
+        WaitForSingleObject(doorbells[queue - mapped_queues], (DWORD) timeout.count());
+    }
+#else
+    // No cross-process doorbell on this platform, check back shortly
+    std::this_thread::sleep_for(std::min(timeout, 1ms));
+#endif
+
+    return atomic_index(queue).load(std::memory_order_acquire);
+}
+
+void
+update_metadata(Queue* queue, const std::function<void(QueueMetadata&)>& update){
+    // The sequence only protects readers, writers of the same process take turns
+    std::lock_guard lg { metadata_mutex };
+
+    std::atomic_ref<int> sequence { queue->metadata_sequence };
+    auto start = sequence.load(std::memory_order_relaxed);
 
-    auto real_index = new_index % QUEUE_SIZE;
-    Packet* block = &queue->array[real_index];
-    memcpy(block->data,data,size);
-    block->size = size;
-    block->metadata = metadata;
+    QueueMetadata metadata;
+    memcpy(&metadata,&queue->metadata,sizeof(QueueMetadata));
+    update(metadata);
 
-    //always update index after write data
-    queue->index = new_index;
+    sequence.store(start + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&queue->metadata,&metadata,sizeof(QueueMetadata));
+    sequence.store(start + 2, std::memory_order_release);
 }
 
+QueueMetadata
+read_metadata(Queue* queue){
+    std::atomic_ref<int> sequence { queue->metadata_sequence };
+
+    QueueMetadata metadata;
+    while (true) {
+        auto start = sequence.load(std::memory_order_acquire);
+        if (start & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        memcpy(&metadata,&queue->metadata,sizeof(QueueMetadata));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) == start) {
+            return metadata;
+        }
+    }
+}
 
-void 
+void
 raise_event(Queue* queue, EventType type, Event event){
     event.read = false;
-    memcpy(&queue->events[type],&event,sizeof(Event));
+
+    // Publish the value before the flag that makes it visible
+    auto& target = queue->events[type];
+    atomic_read(target).store(true, std::memory_order_relaxed);
+    memcpy((char*) &target + offsetof(Event, type),(char*) &event + offsetof(Event, type),sizeof(Event) - offsetof(Event, type));
+    atomic_read(target).store(false, std::memory_order_release);
 }
 
 int
 peek_event(Queue* memory, EventType type){
-    return !memory->events[type].read;
+    return !atomic_read(memory->events[type]).load(std::memory_order_acquire);
 }
 
 Event
 pop_event(Queue* queue, EventType type){
-    queue->events[type].read = true;
-    BOOST_LOG(debug) << "Receive event " << type << ", value: "<< queue->events[type].value_number;
-    return queue->events[type];
-}
\ No newline at end of file
+    auto& source = queue->events[type];
+    atomic_read(source).load(std::memory_order_acquire);
+
+    Event event;
+    memcpy(&event,&source,sizeof(Event));
+    atomic_read(source).store(true, std::memory_order_release);
+
+    BOOST_LOG(debug) << "Receive event " << type << ", value: "<< event.value_number;
+    return event;
+}
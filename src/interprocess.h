@@ -9,13 +9,59 @@
 
 #include <smemory.h>
 
+#include <chrono>
+#include <functional>
+#include <string_view>
 
-void
-init_shared_memory(SharedMemory** shm);
+/**
+ * @brief Map the queues shared with co-located consumers.
+ * @param shm The mapped queues.
+ * @param name Name of the shared memory segment, the queues are private to this process when empty.
+ * @param producers Bit `1 << QueueType` is set for every queue this process publishes to, they are reset. 0 for consumers.
+ * @return 0 on success, -1 on error.
+ */
+int
+init_shared_memory(SharedMemory** shm, const char* name, int producers);
 
 void 
 push_packet(Queue* memory, void* data, int size, PacketMetadata metadata);
 
+/**
+ * @brief Publish a packet that is gathered from several segments, such as a frame with replaced parameter sets.
+ */
+void
+push_packet(Queue* memory, const std::string_view* segments, int count, PacketMetadata metadata);
+
+/**
+ * @brief Copy the packet at `position` out of the ring, a consumer starts at the `head` of the queue.
+ * @param position Position of the consumer, it is advanced past the packet.
+ * @param buffer Receives the packet, up to `PACKET_SIZE` bytes.
+ * @return The size of the packet, 0 when there is none yet, -1 when the consumer fell behind and skipped
+ *         ahead to the latest packet, -2 when the packet is larger than `capacity`, it is skipped.
+ */
+int
+pop_packet(Queue* memory, unsigned long long* position, void* buffer, int capacity, PacketMetadata* metadata);
+
+/**
+ * @brief Wait until the producer publishes a packet after `last_index`.
+ * @return The index of the latest packet, `last_index` on timeout.
+ */
+int
+wait_packet(Queue* memory, int last_index, std::chrono::milliseconds timeout);
+
+/**
+ * @brief Change the metadata of the queue, readers never see a partial update.
+ * @param update Modifies the metadata in place, updates from several threads are serialized.
+ */
+void
+update_metadata(Queue* memory, const std::function<void(QueueMetadata&)>& update);
+
+/**
+ * @brief Consistent copy of the metadata of the queue.
+ */
+QueueMetadata
+read_metadata(Queue* memory);
+
 void 
 raise_event(Queue* memory, EventType type, Event event);
 
@@ -0,0 +1,117 @@
+/**
+ * @file src/latency.cpp
+ * @brief Per-frame latency of the capture, convert, encode and send stages.
+ */
+#include <algorithm>
+#include <limits>
+
+#include "latency.h"
+#include "logging.h"
+
+namespace latency {
+  using namespace std::literals;
+
+  std::string_view
+  stage_name(stage_e stage) {
+    switch (stage) {
+      case stage_e::capture:
+        return "capture"sv;
+      case stage_e::convert:
+        return "convert"sv;
+      case stage_e::schedule:
+        return "schedule"sv;
+      case stage_e::encode:
+        return "encode"sv;
+      case stage_e::queue:
+        return "queue"sv;
+      case stage_e::send:
+        return "send"sv;
+      case stage_e::total:
+        return "total"sv;
+      case stage_e::MAX:
+        break;
+    }
+
+    return "unknown"sv;
+  }
+
+  namespace {
+    std::uint32_t
+    microseconds(std::uint64_t value) {
+      return (std::uint32_t) std::min<std::uint64_t>(value, std::numeric_limits<std::uint32_t>::max());
+    }
+
+    stage_report_t
+    stage_report(const stat_trackers::percentile_tracker &histogram) {
+      auto stats = histogram.percentiles();
+      return {
+        microseconds(stats.count),
+        microseconds(stats.min),
+        microseconds((std::uint64_t) stats.avg),
+        microseconds(stats.p50),
+        microseconds(stats.p90),
+        microseconds(stats.p99),
+        microseconds(stats.p999),
+        microseconds(stats.max),
+      };
+    }
+  }  // namespace
+
+  tracker_t::tracker_t(std::string name, std::chrono::seconds interval):
+      name { std::move(name) }, interval { interval } {}
+
+  void
+  tracker_t::record(const frame_timing_t &timing) {
+    // Stages between two points of the frame, stages with a point that wasn't reached are skipped
+    auto stage = [&](stage_e stage, time_point start, time_point end) {
+      if (start == time_point {} || end == time_point {} || end < start) {
+        return;
+      }
+
+      histograms[(std::size_t) stage].record(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    };
+
+    stage(stage_e::capture, timing.captured, timing.convert_start);
+    stage(stage_e::convert, timing.convert_start, timing.convert_end);
+    stage(stage_e::schedule, timing.convert_end, timing.encode_submit);
+    stage(stage_e::encode, timing.encode_submit, timing.encode_complete);
+    stage(stage_e::queue, timing.encode_complete, timing.queue_pop);
+    stage(stage_e::send, timing.queue_pop, timing.send_complete);
+    stage(stage_e::total, timing.captured, timing.send_complete);
+
+    if (std::chrono::steady_clock::now() > last_log + interval) {
+      log();
+
+      for (auto &histogram : histograms) {
+        histogram.reset();
+      }
+      last_log = std::chrono::steady_clock::now();
+    }
+  }
+
+  report_t
+  tracker_t::report() {
+    report_t report {};
+    report.stage_count = (std::uint16_t) stage_e::MAX;
+
+    for (std::size_t x = 0; x < histograms.size(); ++x) {
+      report.stages[x] = stage_report(histograms[x]);
+    }
+
+    return report;
+  }
+
+  void
+  tracker_t::log() {
+    for (std::size_t x = 0; x < histograms.size(); ++x) {
+      auto stage = stage_report(histograms[x]);
+      if (!stage.count) {
+        continue;
+      }
+
+      BOOST_LOG(debug) << name << " latency "sv << stage_name((stage_e) x) << " (min avg p50 p90 p99 p99.9 max, us) "sv
+                       << stage.min << ' ' << stage.avg << ' ' << stage.p50 << ' ' << stage.p90 << ' '
+                       << stage.p99 << ' ' << stage.p999 << ' ' << stage.max;
+    }
+  }
+}  // namespace latency
@@ -0,0 +1,106 @@
+/**
+ * @file src/latency.h
+ * @brief Per-frame latency of the capture, convert, encode and send stages.
+ */
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "stat_trackers.h"
+
+namespace latency {
+  using time_point = std::chrono::steady_clock::time_point;
+
+  enum class stage_e : std::uint8_t {
+    capture,  ///< Capture until the conversion starts
+    convert,  ///< Color conversion and upload
+    schedule,  ///< Wait for the frame deadline after the conversion
+    encode,  ///< Submission to the encoder until the packet is ready
+    queue,  ///< Wait in the packet queue for the sender
+    send,  ///< Packetization, FEC and pacing
+    total,  ///< Capture until the last shard was sent
+    MAX,
+  };
+
+  std::string_view
+  stage_name(stage_e stage);
+
+  /**
+   * @brief Points in time a frame passed on its way through the pipeline.
+   * @details Points that are left default constructed weren't reached, such as the conversion of a
+   *          repeated frame. Stages that start or end at such a point aren't recorded.
+   */
+  struct frame_timing_t {
+    time_point captured;
+    time_point convert_start;
+    time_point convert_end;
+    time_point encode_submit;
+    time_point encode_complete;
+    time_point queue_pop;
+    // The encode loop last took the reference frame invalidation requests before this frame
+    time_point ref_frames_invalidated;
+    time_point send_complete;
+  };
+
+#pragma pack(push, 1)
+  /**
+   * @brief Latency of a stage, in microseconds. All fields are little-endian.
+   */
+  struct stage_report_t {
+    std::uint32_t count;
+    std::uint32_t min;
+    std::uint32_t avg;
+    std::uint32_t p50;
+    std::uint32_t p90;
+    std::uint32_t p99;
+    std::uint32_t p999;
+    std::uint32_t max;
+  };
+
+  /**
+   * @brief Reply to a latency report request on the control channel.
+   */
+  struct report_t {
+    std::uint8_t type;  // The event type of the request
+    std::uint8_t rung;
+    std::uint16_t stage_count;
+    stage_report_t stages[(std::size_t) stage_e::MAX];
+  };
+#pragma pack(pop)
+
+  /**
+   * @brief Collects the timing of every frame into per stage histograms.
+   * @details The histograms are logged and restarted periodically, reports in between cover the
+   *          frames since the last time they were logged. Frames are recorded by the sender while
+   *          reports may be requested from the control channel, the histograms are lock-free.
+   */
+  class tracker_t {
+  public:
+    /**
+     * @param name Name of the stream in the log.
+     * @param interval Time between logs of the histograms.
+     */
+    tracker_t(std::string name, std::chrono::seconds interval);
+
+    void
+    record(const frame_timing_t &timing);
+
+    report_t
+    report();
+
+  private:
+    void
+    log();
+
+    std::string name;
+    std::chrono::seconds interval;
+
+    time_point last_log = std::chrono::steady_clock::now();
+    std::array<stat_trackers::percentile_tracker, (std::size_t) stage_e::MAX> histograms;
+  };
+}  // namespace latency
@@ -4,8 +4,10 @@
  */
 
 // standard includes
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <utility>
 
 // lib includes
 #include <boost/core/null_deleter.hpp>
@@ -38,6 +40,35 @@ bl::sources::severity_logger<int> fatal(5);  // Unrecoverable errors
 BOOST_LOG_ATTRIBUTE_KEYWORD(severity, "Severity", int)
 
 namespace logging {
+  std::optional<std::uint32_t>
+  rate_limit_t::admit() {
+    std::lock_guard lg { _lock };
+
+    auto now = std::chrono::steady_clock::now();
+    if (_last_refill.time_since_epoch().count()) {
+      auto elapsed = std::chrono::duration<double>(now - _last_refill) / interval;
+      _tokens = std::min<double>(burst, _tokens + elapsed);
+    }
+    _last_refill = now;
+
+    if (_tokens < 1.0) {
+      ++_suppressed;
+      return std::nullopt;
+    }
+
+    _tokens -= 1.0;
+    return std::exchange(_suppressed, 0);
+  }
+
+  std::string
+  suppressed_prefix(std::uint32_t suppressed) {
+    if (!suppressed) {
+      return {};
+    }
+
+    return "[repeated "s + std::to_string(suppressed) + " times] "s;
+  }
+
   /**
    * @brief A destructor that restores the initial state.
    */
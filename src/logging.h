@@ -6,11 +6,19 @@
 // macros
 #pragma once
 
+// standard includes
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+
 // lib includes
 #include <boost/log/common.hpp>
 #include <boost/log/sinks.hpp>
 
-using text_sink = boost::log::sinks::asynchronous_sink<boost::log::sinks::text_ostream_backend>;
+// Records are formatted and written by the feeding thread of the sink, the lock-free queue never blocks the logging thread
+using text_sink = boost::log::sinks::asynchronous_sink<boost::log::sinks::text_ostream_backend, boost::log::sinks::unbounded_fifo_queue>;
 
 extern boost::log::sources::severity_logger<int> verbose;
 extern boost::log::sources::severity_logger<int> debug;
@@ -20,6 +28,33 @@ extern boost::log::sources::severity_logger<int> error;
 extern boost::log::sources::severity_logger<int> fatal;
 
 namespace logging {
+  /**
+   * @brief Lets a burst of messages of a call site through, then one message per interval.
+   */
+  class rate_limit_t {
+  public:
+    static constexpr int burst = 5;
+    static constexpr std::chrono::seconds interval { 1 };
+
+    /**
+     * @return std::nullopt if the message is suppressed, else the number of messages suppressed before it.
+     */
+    std::optional<std::uint32_t>
+    admit();
+
+  private:
+    std::mutex _lock;
+    double _tokens = burst;
+    std::chrono::steady_clock::time_point _last_refill;
+    std::uint32_t _suppressed = 0;
+  };
+
+  /**
+   * @brief Prefix of a message that follows suppressed ones, empty if none were suppressed.
+   */
+  std::string
+  suppressed_prefix(std::uint32_t suppressed);
+
   class deinit_t {
   public:
     ~deinit_t();
@@ -36,3 +71,14 @@ namespace logging {
   void
   print_help(const char *name);
 }  // namespace logging
+
+/**
+ * @brief BOOST_LOG for call sites that can fire for every frame or packet, a storm of them is rate limited.
+ * @details Every call site has its own limit, the next message that gets through tells how many were suppressed.
+ */
+#define BOOST_LOG_LIMITED(logger)                                                              \
+  if (auto _log_admitted = [] { static logging::rate_limit_t limit; return limit.admit(); }(); \
+      !_log_admitted) {                                                                        \
+  }                                                                                            \
+  else                                                                                         \
+    BOOST_LOG(logger) << logging::suppressed_prefix(*_log_admitted)
@@ -4,26 +4,43 @@
  */
 
 // standard includes
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <codecvt>
 #include <csignal>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <boost/asio.hpp>
-#include <boost/array.hpp>
-#include <boost/bind.hpp>
 
 // local includes
+#include "cipher.h"
 #include "globals.h"
 #include "interprocess.h"
+#include "latency.h"
 #include "logging.h"
 #include "main.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "recorder.h"
 #include "version.h"
 #include "video.h"
 #include "audio.h"
 #include "input.h"
 #include "config.h"
-#include "file_handler.h"
+#include "congestion.h"
+#include "control.h"
+#include "cursor.h"
 #include "platform/common.h"
+#include "stream.h"
+#include "trace.h"
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -55,73 +72,262 @@ on_signal(int sig, FN &&fn) {
 
 
 
-template<class FN>
-class UDPClient {
+std::vector<std::string> 
+split (std::string s, char delim) {
+    std::vector<std::string> result;
+    std::stringstream ss (s);
+    std::string item;
+
+    while (getline (ss, item, delim)) {
+        result.push_back (item);
+    }
+
+    return result;
+}
+
+udp::endpoint
+parse_endpoint (std::string s) {
+  int port;
+  std::string address;
+  auto endpoint = split(s,':');
+  std::stringstream ss; ss << endpoint[0]; ss >> address;
+  std::stringstream ss2; ss2 << endpoint[1]; ss2 >> port;
+  return udp::endpoint(make_address(address), port);
+}
+
+/**
+ * @brief Maps the transport frame indices of the last frames sent to the frame indices of the encoder.
+ * @details The two drift apart whenever a frame isn't sent or the encoder is reinitialized,
+ *          so reference frame invalidation requests of the client must be translated.
+ */
+class frame_index_map_t {
 public:
-  UDPClient(FN &&handler) {
-    bufhandler = std::forward<FN>(handler);
+  static constexpr std::size_t SIZE = 256;
+
+  void
+  insert(uint32_t transport_index, int64_t frame_index) {
+    std::lock_guard lg { mutex };
+    entries[transport_index % SIZE] = { transport_index, frame_index };
   }
 
-  void Bind(udp::endpoint _remote_endpoint) {
-    if(io_service != nullptr)
-      io_service->stop();
-    if (socket != nullptr)
-      socket->close();
+  /**
+   * @return The frame index of the encoder, empty if the frame is unknown or too old.
+   */
+  std::optional<int64_t>
+  find(uint32_t transport_index) {
+    std::lock_guard lg { mutex };
+    auto &entry = entries[transport_index % SIZE];
+    if (!entry || entry->first != transport_index) {
+      return std::nullopt;
+    }
 
-    io_service = new boost::asio::io_context();
-    socket = new udp::socket(*io_service);
-    socket->open(udp::v4());
-    socket->bind(_remote_endpoint);
-    remote_endpoint = remote_endpoint;
+    return entry->second;
   }
-  void Receiver() {
-    wait();
-    io_service->run();
+
+private:
+  std::mutex mutex;
+  std::array<std::optional<std::pair<uint32_t, int64_t>>, SIZE> entries;
+};
+
+/**
+ * @brief Viewers that get the packets of a session in addition to its destination.
+ * @details Viewers are added and removed from the control channel while the sender reads the list,
+ *          the sender only copies it after it changed.
+ */
+class subscriber_list_t {
+public:
+  static constexpr std::size_t MAX_SUBSCRIBERS = 64;
+
+  /**
+   * @return false if the viewer is already subscribed or the list is full.
+   */
+  bool
+  add(const udp::endpoint &endpoint) {
+    std::lock_guard lg { mutex };
+    if (subscribers.size() >= MAX_SUBSCRIBERS || std::find(std::begin(subscribers), std::end(subscribers), endpoint) != std::end(subscribers)) {
+      return false;
+    }
+
+    subscribers.push_back(endpoint);
+    version.fetch_add(1, std::memory_order_release);
+    return true;
   }
 
-  uintptr_t GetHandle() {
-    return (uintptr_t)socket->native_handle();
+  /**
+   * @return false if the viewer wasn't subscribed.
+   */
+  bool
+  remove(const udp::endpoint &endpoint) {
+    std::lock_guard lg { mutex };
+    auto it = std::find(std::begin(subscribers), std::end(subscribers), endpoint);
+    if (it == std::end(subscribers)) {
+      return false;
+    }
+
+    subscribers.erase(it);
+    version.fetch_add(1, std::memory_order_release);
+    return true;
   }
 
-private:
-  std::function<void(std::string)> bufhandler;
-  boost::asio::io_context* io_service = nullptr;
-  udp::socket* socket = nullptr;
-  boost::array<char, 16 * 1024> recv_buffer;
-  udp::endpoint remote_endpoint;
-  void handle_receive(const boost::system::error_code& err, size_t bytes_transferred) {
-    if (!err) {
-      char* data = recv_buffer.c_array();
-      auto buff = std::string(data,data+bytes_transferred);
-      bufhandler(buff);
-      wait();
-    }
-  }
-
-  void wait() {
-    socket->async_receive_from(
-      boost::asio::buffer(recv_buffer),
-      remote_endpoint,
-      boost::bind(
-        &UDPClient::handle_receive, 
-        this, 
-        boost::asio::placeholders::error, 
-        boost::asio::placeholders::bytes_transferred
-      ));
+  bool
+  contains(const udp::endpoint &endpoint) {
+    std::lock_guard lg { mutex };
+    return std::find(std::begin(subscribers), std::end(subscribers), endpoint) != std::end(subscribers);
+  }
+
+  /**
+   * @brief Copy the viewers if they changed since `last_version`.
+   * @return Whether `out` was updated.
+   */
+  bool
+  snapshot(uint64_t &last_version, std::vector<udp::endpoint> &out) {
+    if (version.load(std::memory_order_acquire) == last_version) {
+      return false;
+    }
+
+    std::lock_guard lg { mutex };
+    out = subscribers;
+    last_version = version.load(std::memory_order_relaxed);
+    return true;
   }
+
+private:
+  std::mutex mutex;
+  std::vector<udp::endpoint> subscribers;
+  std::atomic<uint64_t> version { 0 };
 };
 
-std::vector<std::string> 
-split (std::string s, char delim) {
-    std::vector<std::string> result;
-    std::stringstream ss (s);
-    std::string item;
+// Dual-stack sockets see IPv4 senders as mapped IPv6 addresses
+boost::asio::ip::address
+host(const boost::asio::ip::address &address) {
+  if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+    return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+  }
+  return address;
+}
 
-    while (getline (ss, item, delim)) {
-        result.push_back (item);
+/**
+ * @brief Where the packets of a session go.
+ * @details A session without one, such as in standby, runs its pipeline without sending until the
+ *          Start command gives it one. The sender only copies it after it changed.
+ *
+ *          The host of the destination is the client of the session, the only one whose control
+ *          datagrams may change where the session is sent.
+ */
+class destination_t {
+public:
+  /**
+   * @param endpoint The destination, a port of 0 leaves the session without one. Its address,
+   *                 unless unspecified, is the client even before the session starts.
+   */
+  explicit destination_t(const udp::endpoint &endpoint) {
+    if (!endpoint.address().is_unspecified()) {
+      client = host(endpoint.address());
+    }
+    if (endpoint.port()) {
+      this->endpoint = endpoint;
+      version.store(1, std::memory_order_relaxed);
     }
+  }
 
-    return result;
+  /**
+   * @return Whether `address` is the host of the client of the session.
+   */
+  bool
+  from_client(const boost::asio::ip::address &address) {
+    std::lock_guard lg { mutex };
+    return client && *client == host(address);
+  }
+
+  /**
+   * @return false if the session already has a destination, or a client on another host.
+   */
+  bool
+  start(const udp::endpoint &endpoint) {
+    std::lock_guard lg { mutex };
+    if (this->endpoint || (client && *client != host(endpoint.address()))) {
+      return false;
+    }
+
+    this->endpoint = endpoint;
+    client = host(endpoint.address());
+    version.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Copy the destination if it changed since `last_version`.
+   * @return Whether `out` was updated.
+   */
+  bool
+  snapshot(uint64_t &last_version, std::optional<udp::endpoint> &out) {
+    if (version.load(std::memory_order_acquire) == last_version) {
+      return false;
+    }
+
+    std::lock_guard lg { mutex };
+    out = endpoint;
+    last_version = version.load(std::memory_order_relaxed);
+    return true;
+  }
+
+private:
+  std::mutex mutex;
+  std::optional<udp::endpoint> endpoint;
+  std::optional<boost::asio::ip::address> client;
+  std::atomic<uint64_t> version { 0 };
+};
+
+// Control events of one encode session, a session per rung of the simulcast ladder and one for audio
+struct control_events_t {
+  QueueType queue_type;
+  safe::mail_raw_t::event_t<int> bitrate;
+  safe::mail_raw_t::event_t<int> framerate;
+  safe::mail_raw_t::event_t<bool> idr;
+  safe::mail_raw_t::event_t<int> fec_percentage;
+  safe::mail_raw_t::event_t<std::pair<int64_t, int64_t>> invalidate_ref_frames;
+  safe::mail_raw_t::event_t<int> audio_packet_loss;
+  safe::mail_raw_t::event_t<int> audio_dtx;
+  safe::mail_raw_t::event_t<video::encoding_t> encoding;
+  // What the encode session was last given, only the control thread uses it. Null for audio
+  std::shared_ptr<video::encoding_t> negotiated;
+  std::shared_ptr<frame_index_map_t> frame_indices;
+  std::shared_ptr<latency::tracker_t> latency;
+  std::shared_ptr<metrics::session_t> metrics;
+  // The packet queue of the sender, only the one of the queue type is set
+  safe::mail_raw_t::queue_t<video::packet_t> video_packets;
+  safe::mail_raw_t::queue_t<audio::packet_t> audio_packets;
+  // Null for audio and when congestion control is disabled
+  std::shared_ptr<congestion::controller_t> congestion;
+  // Null for video and when congestion control is disabled
+  std::shared_ptr<congestion::audio_controller_t> audio_congestion;
+  // Null for audio and when retransmission is disabled
+  std::shared_ptr<stream::retransmit_cache_t> retransmit;
+  std::shared_ptr<subscriber_list_t> subscribers;
+  std::shared_ptr<destination_t> destination;
+};
+
+// Endpoint at the 32-bit integer `index` of a command, the port followed by the 4 or 16 bytes of the address in network order
+std::optional<udp::endpoint>
+read_endpoint(const control::command_t &command, std::size_t index = 0) {
+  auto port = command.u32(index);
+  if (!port || !*port || *port > std::numeric_limits<uint16_t>::max()) {
+    return std::nullopt;
+  }
+
+  auto address = command.value.substr((index + 1) * sizeof(uint32_t));
+  if (address.size() == sizeof(boost::asio::ip::address_v4::bytes_type)) {
+    boost::asio::ip::address_v4::bytes_type bytes;
+    std::memcpy(bytes.data(), address.data(), bytes.size());
+    return udp::endpoint { boost::asio::ip::address_v4 { bytes }, (uint16_t) *port };
+  }
+  if (address.size() == sizeof(boost::asio::ip::address_v6::bytes_type)) {
+    boost::asio::ip::address_v6::bytes_type bytes;
+    std::memcpy(bytes.data(), address.data(), bytes.size());
+    return udp::endpoint { boost::asio::ip::address_v6 { bytes }, (uint16_t) *port };
+  }
+
+  return std::nullopt;
 }
 
 /**
@@ -186,7 +392,16 @@ main(int argc, char *argv[]) {
   auto session_monitor_join_thread_future = session_monitor_join_thread_promise.get_future();
 #endif
 
-  task_pool.start(1);
+  // Encoder probes run side by side on the pool, the timer thread sleeps precisely before the delayed tasks
+  std::shared_ptr<platf::high_precision_timer> task_timer = platf::create_high_precision_timer();
+  task_pool.start(4, [task_timer](std::chrono::nanoseconds duration) {
+    if (task_timer && *task_timer) {
+      task_timer->sleep_for(duration);
+    }
+    else {
+      std::this_thread::sleep_for(duration);
+    }
+  });
 
   // Create signal handler after logging has been initialized
   auto process_shutdown_event = mail::man->event<bool>(mail::shutdown);
@@ -214,6 +429,12 @@ main(int argc, char *argv[]) {
     process_shutdown_event->raise(true);
   });
 
+#ifndef _WIN32
+  on_signal(SIGUSR1, []() {
+    task_pool.push([]() { trace::dump(config::sunshine.trace_file); });
+  });
+#endif
+
   // If any of the following fail, we log an error and continue event though sunshine will not function correctly.
   // This allows access to the UI to fix configuration problems or view the logs.
 
@@ -223,166 +444,1123 @@ main(int argc, char *argv[]) {
   }
 
 
-  int queuetype = QueueType::Video;
+  // The first argument lists the streams of this process joined by '+', "audio" and the display name,
+  // so a single process can serve both. Every display listed gets the whole ladder, "pattern" replaces
+  // their content with the test pattern of test_pattern.h to measure the latency until a client decoded it.
+  // "standby" starts the sessions without destinations, they capture and encode but only send once the
+  // Start command of the control channel gave them one. A destination with port 0, such as 192.168.1.5:0,
+  // leaves the session in standby for that host only.
   std::stringstream ss0; ss0 << argv[1]; 
   std::string target; ss0 >> target;
-  if (target == "audio")
-    queuetype = QueueType::Audio;
+  // Audio may be followed by the packet duration in milliseconds, the number of channels and "hq", such as "audio:2.5:6:hq"
+  bool has_audio = false;
+  audio::config_t audio_config { config::audio.packet_duration, config::audio.channels, 3, 0 };
+  audio_config.flags[audio::config_t::HIGH_QUALITY] = config::audio.high_quality;
+  std::vector<std::string> displays;
+  bool standby = false;
+  for (auto &stream_name : split(target, '+')) {
+    if (stream_name == "pattern") {
+      config::video.test_pattern = true;
+      continue;
+    }
+    if (stream_name == "standby") {
+      standby = true;
+      continue;
+    }
+
+    auto options = split(stream_name, ':');
+    if (options.empty() || options.front() != "audio") {
+      displays.push_back(stream_name);
+      continue;
+    }
+
+    has_audio = true;
+    try {
+      if (options.size() > 1) {
+        audio_config.packetDuration = (int) std::lround(std::stod(options[1]) * 1000);
+      }
+      if (options.size() > 2) {
+        audio_config.channels = std::stoi(options[2]);
+      }
+    }
+    catch (const std::exception &) {
+      BOOST_LOG(error) << "Invalid audio options "sv << stream_name;
+      return StatusCode::NORMAL_EXIT;
+    }
+    if (options.size() > 3) {
+      audio_config.flags[audio::config_t::HIGH_QUALITY] = options[3] == "hq";
+    }
+  }
+
+  bool has_video = !displays.empty();
+  if (!has_video && !has_audio) {
+    BOOST_LOG(error) << "Nothing to stream, neither a display nor audio given"sv;
+    return StatusCode::NORMAL_EXIT;
+  }
 
+  // Every session needs a rung of the ladder
+  if (has_video && config::video.ladder.empty()) {
+    BOOST_LOG(error) << "The simulcast ladder has no rung"sv;
+    return StatusCode::NORMAL_EXIT;
+  }
 
 
-  if(queuetype == QueueType::Video) {
+  if(has_video) {
     if (video::probe_encoders()) {
       BOOST_LOG(error) << "Video failed to find working encoder"sv;
       return StatusCode::NO_ENCODER_AVAILABLE;
     }
+
+    // The displays share the probed encoder, each of them is captured on a thread of its own
+    if (displays.size() > 1 && !video::concurrent_displays()) {
+      BOOST_LOG(error) << "The encoder can only capture a single display per process"sv;
+      return StatusCode::NORMAL_EXIT;
+    }
   }
 
-  //Get buffer local address from handle
+  // Co-located consumers map the queues by name, otherwise they stay private to this process
+  bool publish_udp = config::stream.output & config::OUTPUT_UDP;
+  bool publish_shared = config::stream.output & config::OUTPUT_SHARED_MEMORY;
+
+  // Only the datagrams are encrypted, consumers of the shared memory and the recording get the plaintext
+  std::string stream_key;
+  if (publish_udp && config::stream.encryption_mode != config::ENCRYPTION_MODE_NEVER) {
+    stream_key = cipher::stream_key();
+    if (stream_key.empty() && config::stream.encryption_mode == config::ENCRYPTION_MODE_MANDATORY) {
+      BOOST_LOG(error) << "Encryption is mandatory, but SUNSHINE_STREAM_KEY holds no key"sv;
+      return StatusCode::NORMAL_EXIT;
+    }
+    if (!stream_key.empty()) {
+      BOOST_LOG(info) << "Encrypting the streams with AES-"sv << stream_key.size() * 8 << "-GCM"sv;
+    }
+  }
   SharedMemory* memory = 0;
-  init_shared_memory(&memory);
+  int producers = (has_video ? 1 << QueueType::Video | 1 << QueueType::Cursor : 0) | (has_audio ? 1 << QueueType::Audio : 0);
+  if (init_shared_memory(&memory, publish_shared ? config::stream.shared_memory_name.c_str() : "", producers)) {
+    BOOST_LOG(error) << "Couldn't map shared memory "sv << config::stream.shared_memory_name;
+    return StatusCode::NORMAL_EXIT;
+  }
 
-  auto video_capture = [&](safe::mail_t mail, std::string displayin,int codec){
-    video::capture(mail,video::config_t{
-      displayin, 1920, 1080, 60, 6000, 1, 0, 1, codec, 0
-    },NULL);
+  // Every rung is an encode session of its own, they share the capture thread. The rungs start
+  // as H.264, the Negotiate command of the control channel moves them to the codec of the client.
+  constexpr int video_format = 0;
+  auto video_capture = [&](safe::mail_t mail, std::string displayin,int codec,config::video_t::rung_t rung,std::shared_ptr<metrics::session_t> metrics){
+    video::config_t config {
+      displayin, rung.width, rung.height, rung.framerate, rung.bitrate, config::video.slices_per_frame, 0, 1, codec,
+      config::video.dynamic_range, config::video.chroma_sampling_type
+    };
+    config.metrics = std::move(metrics);
+    video::capture(mail,config,NULL);
   };
 
   auto audio_capture = [&](safe::mail_t mail){
-    audio::capture(mail,audio::config_t{
-      10,2,3,0
-    },NULL);
+    audio::capture(mail,audio_config,NULL);
   };
     
 
 
-  int port;
-  std::string address;
-  auto rendpoint = split(std::string(argv[3]),':');
-  std::stringstream ss; ss <<   rendpoint[0]; ss >> address;
-  std::stringstream ss2; ss2 << rendpoint[1]; ss2 >> port;
-  udp::endpoint remote_endpoint = udp::endpoint(make_address(address), port);
-
-
-  int lport;
-  std::string laddress;
-  auto lendpoint = split(std::string(argv[2]),':');
-  std::stringstream ss3; ss3 << lendpoint[0]; ss3 >> laddress;
-  std::stringstream ss4; ss4 << lendpoint[1]; ss4 >> lport;
-  udp::endpoint local_endpoint = udp::endpoint(make_address(laddress), lport);
-
-  auto mail          = std::make_shared<safe::mail_raw_t>();
-  auto bitrate       = mail->event<int>(mail::bitrate);
-  auto framerate     = mail->event<int>(mail::framerate);
-  auto idr           = mail->event<bool>(mail::idr);
-  auto client = new UDPClient([queuetype,bitrate,framerate,idr](std::string buffer){
-    if (buffer.length() != 2) {
-      BOOST_LOG(error) << "invalid message "<< buffer.length();
+  // Rung N of the simulcast ladder is sent to the Nth remote endpoint, audio has the last one. With
+  // several displays the ladder of the first display is followed by the ladder of the next one.
+  std::vector<udp::endpoint> remote_endpoints;
+  for (int x = 3; x < argc; ++x) {
+    remote_endpoints.push_back(parse_endpoint(std::string(argv[x])));
+  }
+
+  // Without UDP the destinations only select the rungs, a single rung needs none. In standby the
+  // sessions without one wait for the Start command, without any every rung waits.
+  std::size_t streams = (has_video ? 1 : 0) + (has_audio ? 1 : 0);
+  if (standby && remote_endpoints.empty()) {
+    remote_endpoints.resize((has_video ? config::video.ladder.size() * displays.size() : 0) + (has_audio ? 1 : 0));
+  }
+  if (remote_endpoints.size() < streams && (!publish_udp || standby)) {
+    remote_endpoints.resize(streams);
+  }
+
+  if (remote_endpoints.size() < streams) {
+    BOOST_LOG(error) << "No destination given"sv;
+    return StatusCode::NORMAL_EXIT;
+  }
+
+  if (standby && publish_udp && std::any_of(std::begin(remote_endpoints), std::end(remote_endpoints), [](auto &endpoint) { return endpoint.address().is_unspecified(); })) {
+    BOOST_LOG(warning) << "Sessions in standby without the address of their client can be started by any host, towards itself"sv;
+  }
+
+  std::optional<udp::endpoint> audio_endpoint;
+  if (has_audio) {
+    audio_endpoint = remote_endpoints.back();
+    remote_endpoints.pop_back();
+  }
+
+  std::size_t rungs = has_video ? config::video.ladder.size() * displays.size() : 0;
+  if (remote_endpoints.size() > rungs) {
+    BOOST_LOG(warning) << "Ignoring "sv << (remote_endpoints.size() - rungs) << " destinations without a rung"sv;
+    remote_endpoints.resize(rungs);
+  }
+
+  udp::endpoint local_endpoint = parse_endpoint(std::string(argv[2]));
+
+  // Every session has its own mailbox, the rungs of the video come first and audio comes last
+  std::vector<safe::mail_t> mails;
+  std::vector<control_events_t> events;
+  auto video_sessions = remote_endpoints.size();
+  if (audio_endpoint) {
+    remote_endpoints.push_back(*audio_endpoint);
+  }
+  // Bitrate of every session together in kbps, the send buffer of the socket is sized after it
+  std::int64_t total_bitrate = 0;
+  for (std::size_t x = 0; x < remote_endpoints.size(); ++x) {
+    auto queue_type = x < video_sessions ? QueueType::Video : QueueType::Audio;
+    auto mail = mails.emplace_back(std::make_shared<safe::mail_raw_t>());
+
+    auto bitrate = queue_type == QueueType::Video ?
+                     config::video.ladder[x % config::video.ladder.size()].bitrate :
+                     audio::stream_configs[audio::map_stream(audio_config.channels, audio_config.flags[audio::config_t::HIGH_QUALITY])].bitrate / 1000;
+    total_bitrate += bitrate;
+
+    std::shared_ptr<congestion::controller_t> controller;
+    if (queue_type == QueueType::Video && config::stream.congestion_control) {
+      controller = std::make_shared<congestion::controller_t>(bitrate, bitrate * config::stream.min_bitrate_percentage / 100, config::stream.fec_percentage);
+    }
+
+    std::shared_ptr<congestion::audio_controller_t> audio_controller;
+    if (queue_type == QueueType::Audio && config::stream.congestion_control) {
+      audio_controller = std::make_shared<congestion::audio_controller_t>(bitrate, std::max(6, bitrate * config::stream.min_bitrate_percentage / 100));
+    }
+
+    std::shared_ptr<stream::retransmit_cache_t> retransmit;
+    if (queue_type == QueueType::Video && config::stream.retransmit_window > 0) {
+      retransmit = std::make_shared<stream::retransmit_cache_t>(
+        std::chrono::milliseconds { config::stream.retransmit_window },
+        std::chrono::milliseconds { config::stream.playout_delay });
+    }
+
+    std::shared_ptr<video::encoding_t> negotiated;
+    if (queue_type == QueueType::Video) {
+      auto &rung = config::video.ladder[x % config::video.ladder.size()];
+      negotiated = std::make_shared<video::encoding_t>(video::encoding_t {
+        rung.width, rung.height, 0, 0, video_format, config::video.dynamic_range, config::video.chroma_sampling_type });
+    }
+
+    events.push_back(control_events_t {
+      queue_type,
+      mail->event<int>(mail::bitrate),
+      mail->event<int>(mail::framerate),
+      mail->event<bool>(mail::idr),
+      mail->event<int>(mail::fec_percentage),
+      mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames),
+      mail->event<int>(mail::audio_packet_loss),
+      mail->event<int>(mail::audio_dtx),
+      mail->event<video::encoding_t>(mail::encoding),
+      std::move(negotiated),
+      std::make_shared<frame_index_map_t>(),
+      std::make_shared<latency::tracker_t>(queue_type == QueueType::Video ? "rung "s + std::to_string(x) : "audio"s, 20s),
+      std::make_shared<metrics::session_t>(bitrate),
+      queue_type == QueueType::Video ? mail->queue<video::packet_t>(mail::video_packets, mail::video_packets_mode) : nullptr,
+      queue_type == QueueType::Audio ? mail->queue<audio::packet_t>(mail::audio_packets, mail::audio_packets_mode) : nullptr,
+      std::move(controller),
+      std::move(audio_controller),
+      std::move(retransmit),
+      std::make_shared<subscriber_list_t>(),
+      std::make_shared<destination_t>(remote_endpoints[x]),
+    });
+  }
+  auto mail = mails.front();
+
+  // The recording takes the packets of the first rung and of the audio from their senders, the first rung
+  // keeps the codec the recording started with
+  std::shared_ptr<recorder::recorder_t> recorder;
+  if (!config::stream.record_file.empty()) {
+    if (has_video) {
+      recorder = recorder::recorder_t::make(config::stream.record_file, video_format, has_audio ? std::optional<int> { audio_config.channels } : std::nullopt, (std::size_t) config::stream.record_queue_size);
+    }
+    else {
+      BOOST_LOG(warning) << "Recordings need video, not recording"sv;
+    }
+  }
+
+  auto client = reactor::bind(local_endpoint, [events,memory,publish_shared,recorder](reactor::socket_t &socket, std::string_view buffer){
+    if (buffer.empty()) {
       return;
-    } else if (queuetype == QueueType::Audio) {
-      BOOST_LOG(error) << "audio buffer does not accept response";
+    }
+
+    // Commands are parsed in place, latency reports and metrics go into the reply of a versioned datagram or,
+    // without one, are sent on their own as a latency::report_t or a metrics::report_t
+    auto apply = [&](const control::command_t &command, control::reply_t *replies) {
+      bool all = command.session == control::ALL_SESSIONS;
+      std::size_t rung = all ? 0 : command.session;
+      if (rung >= events.size()) {
+        BOOST_LOG(error) << "invalid rung "<< rung;
+        return control::status_e::invalid_session;
+      } else if (events[rung].queue_type == QueueType::Audio && command.type != EventType::FecPercentage && command.type != EventType::LatencyReport &&
+                 command.type != EventType::Subscribe && command.type != EventType::Unsubscribe && command.type != EventType::Bitrate &&
+                 command.type != EventType::ReceiverReport && command.type != EventType::AudioPacketLoss && command.type != EventType::AudioDtx &&
+                 command.type != EventType::TraceDump && command.type != EventType::Metrics && command.type != EventType::Start &&
+                 command.type != EventType::Negotiate) {
+        BOOST_LOG(error) << "audio buffer does not accept response";
+        return control::status_e::invalid_session;
+      } else if (events[rung].queue_type == QueueType::Video && (command.type == EventType::AudioPacketLoss || command.type == EventType::AudioDtx)) {
+        BOOST_LOG(error) << "video buffer does not accept audio settings";
+        return control::status_e::invalid_session;
+      }
+
+      auto selected = [&](auto &&fn) {
+        if (!all) {
+          fn(events[rung]);
+          return;
+        }
+
+        for (auto &rung_events : events) {
+          fn(rung_events);
+        }
+      };
+
+      // Commands that steer what a session sends are only taken from its client
+      auto from_client = [&]() {
+        bool client = true;
+        selected([&](auto &rung_events) {
+          client &= rung_events.destination->from_client(socket.sender().address());
+        });
+        return client;
+      };
+
+      auto value = command.u32();
+      switch (command.type) {
+      case EventType::Bitrate:
+        if (!value || !*value || *value > (uint32_t) std::numeric_limits<int>::max()) {
+          return control::status_e::invalid_value;
+        }
+
+        BOOST_LOG(debug) << "bitrate of rung " << rung << " changed to " << *value;
+        if (events[rung].congestion) {
+          events[rung].congestion->max_bitrate((int) *value);
+        }
+        if (events[rung].audio_congestion) {
+          events[rung].audio_congestion->max_bitrate((int) *value);
+        }
+        events[rung].bitrate->raise((int) *value);
+        events[rung].metrics->target_bitrate.store((int) *value, std::memory_order_relaxed);
+        break;
+      case EventType::Framerate:
+        if (!value || !*value || *value > 1000) {
+          return control::status_e::invalid_value;
+        }
+
+        BOOST_LOG(debug) << "framerate of rung " << rung << " changed to " << *value;
+        events[rung].framerate->raise((int) *value);
+        break;
+      case EventType::Pointer:
+        if (!value) {
+          return control::status_e::invalid_value;
+        }
+
+        // 0 hides the cursor, 2 leaves it out of the video and sends it on the cursor channel, any other value draws it into the video
+        BOOST_LOG(debug) << "pointer changed to " << *value;
+        display_cursor = *value != 0 && *value != 2;
+        cursor::enable(*value == 2);
+        break;
+      case EventType::Idr:
+        BOOST_LOG(debug) << "IDR";
+        selected([](auto &rung_events) {
+          if (rung_events.queue_type == QueueType::Video) {
+            rung_events.idr->raise(true);
+          }
+        });
+        break;
+      case EventType::FecPercentage:
+        if (!value || *value > 255) {
+          return control::status_e::invalid_value;
+        }
+
+        BOOST_LOG(debug) << "fec percentage changed to " << *value;
+        selected([&](auto &rung_events) { rung_events.fec_percentage->raise((int) *value); });
+        break;
+      case EventType::InvalidateRefFrames: {
+        auto first = command.u32(0);
+        auto last = command.u32(1);
+        if (!first || !last) {
+          return control::status_e::invalid_value;
+        }
+
+        auto &rung_events = events[rung];
+
+        // Frames the map has forgotten can't be invalidated, recover with an IDR frame instead
+        auto first_frame = rung_events.frame_indices->find(*first);
+        auto last_frame = rung_events.frame_indices->find(*last);
+        if (!first_frame || !last_frame) {
+          BOOST_LOG(debug) << "unknown lost frames " << *first << '-' << *last << " of rung " << rung << ", IDR";
+          rung_events.idr->raise(true);
+          break;
+        }
+
+        BOOST_LOG(debug) << "lost frames " << *first << '-' << *last << " of rung " << rung << ", invalidating " << *first_frame << '-' << *last_frame;
+        rung_events.invalidate_ref_frames->raise(*first_frame, *last_frame);
+        break;
+      }
+      case EventType::ReceiverReport: {
+        auto interval = command.u32(0);
+        auto received = command.u32(1);
+        auto lost = command.u32(2);
+        auto bytes = command.u32(3);
+        auto gradient = command.u32(4);
+        if (!interval || !received || !lost || !bytes || !gradient) {
+          return control::status_e::invalid_value;
+        }
+        congestion::receiver_report_t report { *interval, *received, *lost, *bytes, (int32_t) *gradient };
+
+        // A forged report would clamp the bitrate of the session
+        if (!from_client()) {
+          BOOST_LOG_LIMITED(warning) << "Refused a receiver report from "sv << socket.sender() << ", it's not the client of the session"sv;
+          return control::status_e::forbidden;
+        }
+
+        auto &rung_events = events[rung];
+        if (rung_events.audio_congestion) {
+          // Opus spends part of the bitrate on in-band FEC, the parity of the transport stays as it is
+          auto decision = rung_events.audio_congestion->update(report);
+          if (decision) {
+            rung_events.bitrate->raise(decision->bitrate);
+            rung_events.metrics->target_bitrate.store(decision->bitrate, std::memory_order_relaxed);
+            rung_events.audio_packet_loss->raise(decision->packet_loss_percentage);
+          }
+          break;
+        }
+        if (!rung_events.congestion) {
+          BOOST_LOG(debug) << "receiver report of rung " << rung << " ignored, congestion control is disabled";
+          break;
+        }
+
+        // The encoder is reconfigured in place, the bitrate changes without an IDR frame
+        auto decision = rung_events.congestion->update(report);
+        if (decision) {
+          rung_events.bitrate->raise(decision->bitrate);
+          rung_events.metrics->target_bitrate.store(decision->bitrate, std::memory_order_relaxed);
+          rung_events.fec_percentage->raise(decision->fec_percentage);
+        }
+        break;
+      }
+      case EventType::Nack: {
+        auto frame_index = command.u32(0);
+        auto slice_index = command.u32(1);
+        auto first = command.u32(2);
+        auto last = command.u32(3);
+        if (!frame_index || !slice_index || !first || !last || *slice_index > std::numeric_limits<uint16_t>::max() || *first > *last || *last > std::numeric_limits<uint16_t>::max()) {
+          return control::status_e::invalid_value;
+        }
+
+        auto &rung_events = events[rung];
+        if (!rung_events.retransmit) {
+          return control::status_e::invalid_session;
+        }
+
+        // Viewers get the shards they lost, the client the destination of the session. Resends for anyone
+        // else would amplify their datagrams towards the destination
+        std::optional<udp::endpoint> target;
+        if (auto from = socket.sender(); rung_events.subscribers->contains(from)) {
+          target = from;
+        }
+        else if (!rung_events.destination->from_client(from.address())) {
+          BOOST_LOG_LIMITED(warning) << "Refused a NACK from "sv << from << ", it's neither the client nor a viewer of the session"sv;
+          return control::status_e::forbidden;
+        }
+
+        // Frames that are gone can only be recovered from the next reference frame invalidation or IDR
+        auto &metrics = *rung_events.metrics;
+        metrics.nacks.fetch_add(1, std::memory_order_relaxed);
+        auto result = rung_events.retransmit->resend(*frame_index, (uint16_t) *slice_index, (uint16_t) *first, (uint16_t) *last, target);
+        if (result == stream::retransmit_cache_t::result_e::unknown) {
+          BOOST_LOG(debug) << "NACK of unknown frame " << *frame_index << " of rung " << rung;
+          metrics.late_nacks.fetch_add(1, std::memory_order_relaxed);
+          return control::status_e::invalid_value;
+        } else if (result == stream::retransmit_cache_t::result_e::late) {
+          BOOST_LOG(debug) << "NACK of frame " << *frame_index << " of rung " << rung << " is too late";
+          metrics.late_nacks.fetch_add(1, std::memory_order_relaxed);
+          return control::status_e::late;
+        }
+        metrics.retransmitted_shards.fetch_add(*last - *first + 1, std::memory_order_relaxed);
+        break;
+      }
+      case EventType::AudioPacketLoss:
+        if (!value || *value > 100) {
+          return control::status_e::invalid_value;
+        }
+
+        BOOST_LOG(debug) << "audio packet loss changed to " << *value << '%';
+        events[rung].audio_packet_loss->raise((int) *value);
+        break;
+      case EventType::AudioDtx:
+        if (!value) {
+          return control::status_e::invalid_value;
+        }
+
+        BOOST_LOG(debug) << "audio DTX " << (*value ? "enabled" : "disabled");
+        events[rung].audio_dtx->raise(*value ? 1 : 0);
+        break;
+      case EventType::Subscribe:
+      case EventType::Unsubscribe: {
+        auto endpoint = read_endpoint(command);
+        if (!endpoint) {
+          return control::status_e::invalid_value;
+        }
+
+        // Only the client of a session adds viewers to it, anyone else could aim the session at a host
+        // that never asked for it
+        if (!from_client()) {
+          BOOST_LOG_LIMITED(warning) << "Refused viewers from "sv << socket.sender() << ", it's not the client of the session"sv;
+          return control::status_e::forbidden;
+        }
+
+        bool subscribe = command.type == EventType::Subscribe;
+        bool changed = false;
+        selected([&](auto &rung_events) {
+          if (subscribe ? rung_events.subscribers->add(*endpoint) : rung_events.subscribers->remove(*endpoint)) {
+            changed = true;
+
+            // New viewers can only start decoding from an IDR frame
+            if (subscribe && rung_events.queue_type == QueueType::Video) {
+              rung_events.idr->raise(true);
+            }
+          }
+        });
+
+        if (!changed) {
+          BOOST_LOG(warning) << "viewer " << *endpoint << (subscribe ? " already subscribed or too many viewers" : " not subscribed");
+          return control::status_e::invalid_value;
+        }
+
+        BOOST_LOG(info) << "viewer " << *endpoint << (subscribe ? " subscribed" : " unsubscribed");
+        break;
+      }
+      case EventType::Start: {
+        // The session has been capturing and encoding since the process started, only the destination
+        // and the settings of the client are left
+        auto bitrate = command.u32(0);
+        auto framerate = command.u32(1);
+        auto endpoint = read_endpoint(command, 2);
+        if (!bitrate || *bitrate > (uint32_t) std::numeric_limits<int>::max() || !framerate || *framerate > 1000 || !endpoint) {
+          return control::status_e::invalid_value;
+        }
+
+        // A session is only started towards the host that asks for it, nobody can aim it at someone else
+        if (host(endpoint->address()) != host(socket.sender().address())) {
+          BOOST_LOG_LIMITED(warning) << "Refused to start a session for "sv << *endpoint << " from "sv << socket.sender();
+          return control::status_e::forbidden;
+        }
+
+        auto &rung_events = events[rung];
+        if (!rung_events.destination->start(*endpoint)) {
+          BOOST_LOG(warning) << "session " << rung << " already has a destination or another client, not starting it for " << *endpoint;
+          return control::status_e::forbidden;
+        }
+
+        if (*bitrate) {
+          if (rung_events.congestion) {
+            rung_events.congestion->max_bitrate((int) *bitrate);
+          }
+          if (rung_events.audio_congestion) {
+            rung_events.audio_congestion->max_bitrate((int) *bitrate);
+          }
+          rung_events.bitrate->raise((int) *bitrate);
+          rung_events.metrics->target_bitrate.store((int) *bitrate, std::memory_order_relaxed);
+        }
+
+        // The client can only start decoding from an IDR frame
+        if (rung_events.queue_type == QueueType::Video) {
+          if (*framerate) {
+            rung_events.framerate->raise((int) *framerate);
+          }
+          rung_events.idr->raise(true);
+        }
+
+        BOOST_LOG(info) << "session " << rung << " started for " << *endpoint;
+        break;
+      }
+      case EventType::Negotiate: {
+        auto codecs = command.u32(0);
+        auto flags = command.u32(1);
+        auto max_width = command.u32(2);
+        auto max_height = command.u32(3);
+        auto max_framerate = command.u32(4);
+        if (!codecs || !flags || !max_width || !max_height || !max_framerate ||
+            *max_width > std::numeric_limits<uint16_t>::max() || *max_height > std::numeric_limits<uint16_t>::max() || *max_framerate > 1000) {
+          return control::status_e::invalid_value;
+        }
+
+        // Anyone else could switch the codec and the resolution of the session under its client
+        if (!from_client()) {
+          BOOST_LOG_LIMITED(warning) << "Refused a negotiation from "sv << socket.sender() << ", it's not the client of the session"sv;
+          return control::status_e::forbidden;
+        }
+
+        auto status = control::status_e::ok;
+        selected([&](auto &rung_events) {
+          if (rung_events.queue_type != QueueType::Video) {
+            return;
+          }
+          auto session = (std::size_t) (&rung_events - events.data());
+          auto &ladder_rung = config::video.ladder[session % config::video.ladder.size()];
+
+          // The most efficient codec both ends have, the recorded rung stays H.264
+          int format = -1;
+          for (int candidate : { 2, 1, 0 }) {
+            if ((*codecs & (1 << candidate)) && video::codec_supported(candidate, false, false) && (!candidate || !recorder || session)) {
+              format = candidate;
+              break;
+            }
+          }
+          if (format < 0) {
+            BOOST_LOG(warning) << "rung " << session << " can't encode any codec the client decodes";
+            status = control::status_e::invalid_value;
+            return;
+          }
+
+          // 10-bit and 4:4:4 stay what the configuration asks for, unless the client or the codec lacks them
+          bool yuv444 = config::video.chroma_sampling_type && (*flags & control::NEGOTIATE_YUV444) && video::codec_supported(format, false, true);
+          bool ten_bit = config::video.dynamic_range && (*flags & control::NEGOTIATE_10BIT) && video::codec_supported(format, true, yuv444);
+
+          video::encoding_t encoding { ladder_rung.width, ladder_rung.height, 0, 0, format, ten_bit ? 1 : 0, yuv444 ? 1 : 0 };
+          if (encoding.width && encoding.height) {
+            video::fit_resolution(encoding.width, encoding.height, (int) *max_width, (int) *max_height);
+          } else {
+            encoding.max_width = (int) *max_width;
+            encoding.max_height = (int) *max_height;
+          }
+          auto framerate = *max_framerate ? std::min(ladder_rung.framerate, (int) *max_framerate) : ladder_rung.framerate;
+
+          rung_events.framerate->raise(framerate);
+          if (*rung_events.negotiated != encoding) {
+            *rung_events.negotiated = encoding;
+            rung_events.encoding->raise(encoding);
+
+            // The shared memory queue carries the first rung
+            if (session == 0 && publish_shared) {
+              update_metadata(&memory->queues[QueueType::Video], [&](QueueMetadata &metadata) { metadata.codec = format; });
+            }
+          }
+
+          BOOST_LOG(info) << "rung " << session << " negotiated codec " << format << (ten_bit ? " 10-bit" : "") << (yuv444 ? " 4:4:4" : "")
+                          << ' ' << encoding.width << 'x' << encoding.height << '@' << framerate;
+
+          control::negotiation_t answer {
+            (uint8_t) EventType::Negotiate,
+            (uint8_t) session,
+            (uint8_t) format,
+            (uint8_t) ((ten_bit ? control::NEGOTIATE_10BIT : 0) | (yuv444 ? control::NEGOTIATE_YUV444 : 0)),
+            (uint16_t) encoding.width,
+            (uint16_t) encoding.height,
+            (uint32_t) framerate,
+          };
+          std::string_view data { (const char *) &answer, sizeof(answer) };
+          if (!replies) {
+            socket.reply(data);
+          } else if (!replies->append(command.type, (uint8_t) session, data)) {
+            BOOST_LOG(warning) << "Negotiation of rung " << session << " doesn't fit in the reply";
+          }
+        });
+        return status;
+      }
+      case EventType::LatencyReport: {
+        auto report = events[rung].latency->report();
+        report.type = EventType::LatencyReport;
+        report.rung = (uint8_t)rung;
+
+        std::string_view data { (const char *)&report, sizeof(report) };
+        if (!replies) {
+          socket.reply(data);
+        } else if (!replies->append(command.type, (uint8_t) rung, data)) {
+          BOOST_LOG(warning) << "Latency report of rung " << rung << " doesn't fit in the reply";
+        }
+        break;
+      }
+      case EventType::Metrics:
+        // Every session answers when the command is for all of them
+        selected([&](auto &rung_events) {
+          auto session = (uint8_t) (&rung_events - events.data());
+          auto queue_depth = rung_events.video_packets ? rung_events.video_packets->size() : rung_events.audio_packets->size();
+          auto queue_dropped = rung_events.video_packets ? rung_events.video_packets->dropped() : rung_events.audio_packets->dropped();
+          auto latency = rung_events.latency->report();
+
+          auto report = rung_events.metrics->report(queue_depth, queue_dropped, latency.stages[(std::size_t) latency::stage_e::encode]);
+          report.type = EventType::Metrics;
+          report.session = session;
+
+          std::string_view data { (const char *) &report, sizeof(report) };
+          if (!replies) {
+            socket.reply(data);
+          } else if (!replies->append(command.type, session, data)) {
+            BOOST_LOG(warning) << "Metrics of session " << (int) session << " don't fit in the reply";
+          }
+        });
+        break;
+      case EventType::TraceDump:
+        // Every dump writes the whole trace to disk, only the client may ask for one
+        if (!from_client()) {
+          BOOST_LOG_LIMITED(warning) << "Refused a trace dump from "sv << socket.sender() << ", it's not the client of the session"sv;
+          return control::status_e::forbidden;
+        }
+
+        // The trace covers every thread of the process, the file is written off the control thread
+        BOOST_LOG(info) << "trace dump requested";
+        task_pool.push([]() { trace::dump(config::sunshine.trace_file); });
+        break;
+      default:
+        BOOST_LOG_LIMITED(error) << "invalid message "<< u_int(command.type);
+        return control::status_e::unknown_command;
+      }
+
+      return control::status_e::ok;
+    };
+
+    if ((uint8_t) buffer[0] == control::VERSION) {
+      control::parser_t parser { buffer };
+      auto ack = parser.message().flags & control::flag::ACK_REQUESTED;
+
+      control::reply_t replies { parser.message().sequence };
+      while (auto command = parser.next()) {
+        auto status = apply(*command, &replies);
+        if (ack && command->type != EventType::LatencyReport && command->type != EventType::Metrics) {
+          replies.append(command->type, command->session, status);
+        }
+      }
+
+      if (!replies.empty()) {
+        socket.reply(replies.data());
+      }
       return;
     }
-    
-    switch (buffer.at(0)) {
-    case EventType::Bitrate:
-      BOOST_LOG(debug) << "bitrate changed to " << (buffer.at(1) * 1000);
-      bitrate->raise(buffer.at(1) * 1000);
-      break;
-    case EventType::Framerate:
-      BOOST_LOG(debug) << "framerate changed to " << (buffer.at(1));
-      framerate->raise(buffer.at(1));
-      break;
-    case EventType::Pointer:
-      BOOST_LOG(debug) << "pointer changed to " << (buffer.at(1) != 0);
-      display_cursor = buffer.at(1) != 0;
-      break;
-    case EventType::Idr:
-      BOOST_LOG(debug) << "IDR";
-      idr->raise(true);
-      break;
-    default:
-      BOOST_LOG(error) << "invalid message "<< u_int(buffer.at(0)) << " " << u_int(buffer.at(1));
-      break;
+
+    // Legacy datagrams are the event type and a single byte of value, followed by an optional byte that selects the session.
+    // Messages without it are for the first session or, when they don't depend on the session, for all of them.
+    // The value of InvalidateRefFrames is the little-endian transport index of the first and the last lost frame.
+    // Bitrate is in Mbps. LatencyReport is answered with a latency::report_t of the rung, its value is ignored.
+    // Metrics is answered with a metrics::report_t of the session, or of every session without one.
+    std::size_t value_size = buffer[0] == EventType::InvalidateRefFrames ? 8 : 1;
+    if (buffer.length() != value_size + 1 && buffer.length() != value_size + 2) {
+      BOOST_LOG_LIMITED(error) << "invalid message "<< buffer.length();
+      return;
     }
+
+    bool has_rung = buffer.length() == value_size + 2;
+    uint32_t legacy_value = (uint8_t) buffer[1];
+    if (buffer[0] == EventType::Bitrate) {
+      legacy_value *= 1000;
+    }
+    legacy_value = util::endian::little(legacy_value);
+
+    apply(control::command_t {
+      (uint8_t) buffer[0],
+      has_rung ? (uint8_t) buffer.back() : control::ALL_SESSIONS,
+      value_size == 1 ? std::string_view { (const char *) &legacy_value, sizeof(legacy_value) } : buffer.substr(1, value_size),
+    }, nullptr);
   });
 
-  client->Bind(local_endpoint);
-  std::thread recv([client,local_endpoint] { while(true) {
-    client->Receiver(); 
-    client->Bind(local_endpoint);
-    std::this_thread::sleep_for(1s);
-  }});
+  if (!client) {
+    return -1;
+  }
+
+  // Queueing longer than the playout delay is of no use, the buffer holds that much of every session with
+  // room for the bursts of IDR frames on top. There is no RTT yet, the playout delay stands in for it
+  client->send_buffer_size((int) std::clamp<std::int64_t>(total_bitrate * 1000 / 8 * config::stream.playout_delay / 1000 * 2, 256 * 1024, 64 * 1024 * 1024));
 
-  auto push = [client,process_shutdown_event,remote_endpoint,local_endpoint](safe::mail_t mail, Queue* queue, QueueType queue_type){
-    auto video_packets = mail->queue<video::packet_t>(mail::video_packets);
-    auto audio_packets = mail->queue<audio::packet_t>(mail::audio_packets);
+  // The pacer of every sender stamps departure times once the socket takes them. The datagrams sent through
+  // AF_XDP bypass the qdisc, the timestamps would only let the bursts go at once
+  bool kernel_pacing = config::stream.kernel_pacing && config::stream.pacing_percentage > 0 && config::stream.xdp_interface.empty() &&
+                       platf::enable_socket_txtime(client->native_handle());
+  if (config::stream.kernel_pacing && !config::stream.xdp_interface.empty()) {
+    BOOST_LOG(info) << "Pacing video in the senders, AF_XDP bypasses the pacing of the kernel"sv;
+  }
+  if (kernel_pacing) {
+    BOOST_LOG(info) << "Pacing video in the kernel, the interface needs the fq qdisc"sv;
+  }
+
+  // Input packets of the client get a socket of their own, so a burst of control messages doesn't fill
+  // the buffer of the input socket
+  std::shared_ptr<input::receiver_t> receiver;
+  if (config::input.port) {
+    receiver = input::receiver_t::make(config::input.poll_rate);
+  }
+  if (receiver) {
+    udp::endpoint input_endpoint { local_endpoint.address(), (unsigned short) config::input.port };
+    // Input drives the desktop of the server, it's only taken from the client of a session
+    std::vector<std::shared_ptr<destination_t>> clients;
+    for (auto &rung_events : events) {
+      clients.push_back(rung_events.destination);
+    }
+    auto input_client = reactor::bind(input_endpoint, [receiver, clients](reactor::socket_t &socket, std::string_view buffer) {
+      auto address = socket.sender().address();
+      if (std::none_of(std::begin(clients), std::end(clients), [&](auto &client) { return client->from_client(address); })) {
+        BOOST_LOG_LIMITED(warning) << "Dropped input from "sv << socket.sender() << ", it's not the client of a session"sv;
+        return;
+      }
+
+      receiver->datagram(buffer);
+    });
+    if (!input_client) {
+      return -1;
+    }
+    BOOST_LOG(info) << "Injecting input from "sv << input_endpoint;
+  }
+
+  // The shared memory queue only holds a single stream, it gets the first rung
+  auto push = [client,kernel_pacing,process_shutdown_event,local_endpoint,publish_udp,stream_key](safe::mail_t mail, Queue* queue, bool shared, QueueType queue_type, std::shared_ptr<destination_t> destination, std::shared_ptr<frame_index_map_t> frame_indices, std::shared_ptr<latency::tracker_t> latency_tracker, std::shared_ptr<metrics::session_t> metrics, std::shared_ptr<stream::retransmit_cache_t> retransmit, std::shared_ptr<congestion::controller_t> congestion, std::shared_ptr<subscriber_list_t> subscribers, std::shared_ptr<recorder::recorder_t> recorder){
+    auto video_packets = mail->queue<video::packet_t>(mail::video_packets, mail::video_packets_mode);
+    auto audio_packets = mail->queue<audio::packet_t>(mail::audio_packets, mail::audio_packets_mode);
     auto local_shutdown= mail->event<bool>(mail::shutdown);
     auto touch_port    = mail->event<input::touch_port_t>(mail::touch_port);
+    auto fec_percentage= mail->event<int>(mail::fec_percentage);
+    auto invalidate_ref_frames = mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames);
+    auto idr = mail->event<bool>(mail::idr);
 
 
 #ifdef _WIN32 
     platf::adjust_thread_priority(platf::thread_priority_e::critical);
 #endif
+    platf::place_pipeline_thread("send"sv);
+    TRACE_THREAD(queue_type == QueueType::Video ? "video send" : "audio send");
 
-    queue->metadata.active = 1;
-    auto last_timestamp = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    update_metadata(queue, [](QueueMetadata &metadata) { metadata.active = 1; });
+    // Video and audio durations share the steady clock of the frame timestamps
+    auto last_timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
     bool first_video_packet = true;
 
-    auto rAddr = remote_endpoint.address();
-    auto rPort = remote_endpoint.port();
+    // The destination of the session followed by its viewers, every packet is encoded once and sent to all of them
+    std::optional<udp::endpoint> remote_endpoint;
+    uint64_t destination_version = 0;
+    destination->snapshot(destination_version, remote_endpoint);
     auto lAddr = local_endpoint.address();
     auto lPort = local_endpoint.port();
 
-    auto buffer = (char*)malloc(5*1024*1024);
+    // Every sender has a cipher of its own, it keeps the IV counter without a lock. Once there is
+    // a key nothing is sent in the clear
+    std::unique_ptr<cipher::gcm_t> gcm;
+    if (!stream_key.empty()) {
+      gcm = cipher::gcm_t::make(stream_key);
+      if (!gcm) {
+        local_shutdown->raise(true);
+        return;
+      }
+    }
+
+    // A session in standby doesn't know the family of its destination yet, the IPv6 size fits both
+    stream::video_packetizer_t packetizer { stream::max_datagram_size(config::stream.mtu, !remote_endpoint || remote_endpoint->address().is_v6()), queue_type == QueueType::Video ? std::move(gcm) : nullptr };
+    stream::audio_packetizer_t audio_packetizer { (std::size_t) config::stream.audio_fec_block_size, std::move(gcm) };
+    stream::pacer_t pacer { config::stream.pacing_percentage, (std::size_t) config::stream.pacing_burst_size, kernel_pacing };
+    std::vector<platf::batched_send_info_t> batches;
+    std::vector<platf::buffer_descriptor_t> shared_segments;
+    std::vector<std::string_view> shared_views;
+    BOOST_LOG(info) << "FEC kernel: "sv << fec::kernel_name();
+
+    std::vector<udp::endpoint> viewers;
+    uint64_t viewers_version = 0;
+    std::vector<boost::asio::ip::address> target_addresses;
+    std::vector<uint16_t> target_ports;
+    bool targets_changed = true;
+
+    // QoS of the targets of the video. Windows has a flow per destination, it's removed once the target
+    // leaves. Elsewhere the marking belongs to the socket the senders share, removing a flow would reset it
+    // for all of them, and a flow per address family covers every destination
+    std::map<udp::endpoint, std::unique_ptr<platf::deinit_t>> qos_flows;
+    auto qos_flow_key = [](const boost::asio::ip::address &address, std::uint16_t port) {
+#ifdef _WIN32
+      return udp::endpoint { address, port };
+#else
+      bool v6 = address.is_v6() && !address.to_v6().is_v4_mapped();
+      return udp::endpoint { v6 ? udp::v6() : udp::v4(), 0 };
+#endif
+    };
+
     uint32_t index = 0;
+    // Payload of the slices of the frame being sent
+    std::size_t encoded_bytes = 0;
+    // The slices of a frame of a dropped temporal layer follow its first slice
+    bool dropping_frame = false;
+
+    // Frames that waited longer than the deadline for the sender are dropped, once a frame others reference
+    // is dropped the frames up to the recovery frame requested for it follow. An intra-refresh wave has no
+    // recovery frame, with it only the frames of enhancement layers are dropped
+    std::chrono::milliseconds queue_deadline { config::stream.queue_deadline };
+    bool flush_allowed = config::video.intra_refresh_frames <= 1;
+    std::optional<std::chrono::steady_clock::time_point> flush_start;
+    bool flush_idr_requested = false;
+    bool stale_frame = false;
+
+    // The ring drops the packets raised while it's full, the frames after them lose their references. Everything
+    // up to the IDR frame requested for the gap is flushed like the frames after a stale one
+    auto queue_dropped = video_packets->dropped();
+    bool flush_until_idr = false;
     while (!process_shutdown_event->peek() && !local_shutdown->peek()) {
+      targets_changed |= destination->snapshot(destination_version, remote_endpoint);
+      targets_changed |= subscribers->snapshot(viewers_version, viewers);
+      if (targets_changed) {
+        targets_changed = false;
+        target_addresses.clear();
+        target_ports.clear();
+        if (remote_endpoint) {
+          target_addresses.push_back(remote_endpoint->address());
+          target_ports.push_back(remote_endpoint->port());
+        }
+        for (auto &viewer : viewers) {
+          target_addresses.push_back(viewer.address());
+          target_ports.push_back(viewer.port());
+        }
+
+        // Audio shares the socket, on Linux it goes out with the marking of the video
+        if (queue_type == QueueType::Video) {
+#ifdef _WIN32
+          std::erase_if(qos_flows, [&](const auto &flow) {
+            for (std::size_t x = 0; x < target_addresses.size(); ++x) {
+              if (flow.first == qos_flow_key(target_addresses[x], target_ports[x])) {
+                return false;
+              }
+            }
+            return true;
+          });
+#endif
+          for (std::size_t x = 0; x < target_addresses.size(); ++x) {
+            auto &flow = qos_flows[qos_flow_key(target_addresses[x], target_ports[x])];
+            if (!flow) {
+              flow = platf::enable_socket_qos(client->native_handle(), target_addresses[x], target_ports[x], platf::qos_data_type_e::video, config::stream.dscp_tagging);
+            }
+          }
+        }
+      }
+
+      if (fec_percentage->peek()) {
+        auto percentage = *fec_percentage->pop();
+        packetizer.fec_percentage(percentage);
+        audio_packetizer.fec_percentage(percentage);
+      }
+
       if (queue_type == QueueType::Video) {
         do {
           auto packet = video_packets->pop();
+          packet->timing.queue_pop = std::chrono::steady_clock::now();
+          TRACE_SPAN("queue", packet->timing.encode_complete, packet->timing.queue_pop, packet->frame_index());
+          TRACE_SCOPE("send", packet->frame_index());
+
           if (first_video_packet) {
             BOOST_LOG(info) << "first frame";
             first_video_packet = false;
           }
 
-          auto timestamp = packet->frame_timestamp.value().time_since_epoch().count();
-          const char* ptr = (char*)packet->data();
-          size_t size = packet->data_size();
-          auto duration = uint32_t(timestamp - last_timestamp);;
+          auto capture_time = packet->frame_timestamp.value();
+          auto timestamp = capture_time.time_since_epoch().count();
+          auto duration = timestamp - last_timestamp;
+
+          if (shared) {
+            // Consumers get the frame in one piece, with the parameter sets of IDR frames replaced
+            stream::splice(*packet, shared_segments);
+            shared_views.clear();
+            for (auto &segment : shared_segments) {
+              shared_views.emplace_back(segment.buffer, segment.size);
+            }
+            auto encode_time = std::chrono::duration_cast<std::chrono::microseconds>(packet->timing.encode_complete - capture_time).count();
+            PacketMetadata metadata { packet->is_idr(), duration, (long long) stream::wall_clock_us(capture_time), (int) std::max<long long>(0, encode_time) };
+            push_packet(queue, shared_views.data(), (int)shared_views.size(), metadata);
+          }
+
+          if (recorder) {
+            recorder->video(*packet, capture_time, idr);
+          }
+
+          if (auto dropped = video_packets->dropped(); dropped != queue_dropped) {
+            BOOST_LOG_LIMITED(warning) << "Video queue overflowed, "sv << dropped - queue_dropped << " packets dropped, flushing up to the next IDR frame"sv;
+            queue_dropped = dropped;
+            idr->raise(true);
+
+            // The packet in hand may already follow the gap, it's flushed with the rest
+            flush_start = std::chrono::steady_clock::now();
+            flush_idr_requested = true;
+            flush_until_idr = true;
+            stale_frame = true;
+          }
+
+          // Under congestion the frames of the top temporal layers aren't sent, no frame of a lower layer
+          // references them. They take no frame index, their interval goes to the next frame. The layers are
+          // counted from those the encoder codes, it may cap the configured ones
+          if (!packet->slice_index) {
+            int layers = packet->temporal_layers;
+            dropping_frame = congestion && packet->temporal_layer && packet->temporal_layer >= layers - congestion->dropped_layers();
+          }
+          if (dropping_frame) {
+            if (packet->end_of_frame) {
+              metrics->dropped_frames.fetch_add(1, std::memory_order_relaxed);
+            }
+            continue;
+          }
 
-          memcpy(buffer,&index,sizeof(uint32_t));
-          memcpy(buffer + sizeof(uint32_t),&duration,sizeof(uint32_t));
-          memcpy(buffer + sizeof(uint32_t) + sizeof(uint32_t),ptr,size);
+          // A stale frame of a temporal enhancement layer is dropped on its own. A stale frame the next
+          // frames reference has its references invalidated, the encoder falls back to an IDR frame, and
+          // everything up to the first frame that doesn't reference it is dropped with it
+          if (!packet->slice_index) {
+            auto stale = queue_deadline.count() && packet->timing.queue_pop - packet->timing.encode_complete > queue_deadline;
+
+            if (flush_start) {
+              // Frames come out of the queue in the order they were encoded, so no IDR frame after the dropped frame
+              // references it. A frame after an invalidation only recovers when the encoder took the invalidation
+              // of this flush, an earlier one of the client leaves references to the dropped frames. A gap of the queue
+              // is only closed by an IDR frame popped after it was noticed
+              bool recovered = flush_until_idr ?
+                                 packet->is_idr() && packet->timing.queue_pop > *flush_start :
+                                 packet->is_idr() || (packet->after_ref_frame_invalidation && packet->timing.ref_frames_invalidated >= *flush_start);
+              if (recovered) {
+                BOOST_LOG(debug) << "Sender caught up at frame "sv << packet->frame_index();
+                flush_start.reset();
+                flush_until_idr = false;
+              }
+              else if (!flush_idr_requested && packet->timing.queue_pop - *flush_start > std::chrono::milliseconds { config::stream.playout_delay }) {
+                // Encoders without invalidation in the encode loop never answer it
+                BOOST_LOG(debug) << "No recovery frame since the flush, requesting an IDR frame"sv;
+                idr->raise(true);
+                flush_idr_requested = true;
+              }
+            }
+            if (!flush_start && stale && !packet->temporal_layer && flush_allowed) {
+              BOOST_LOG(debug) << "Frame "sv << packet->frame_index() << " waited "sv << std::chrono::duration_cast<std::chrono::milliseconds>(packet->timing.queue_pop - packet->timing.encode_complete).count() << " ms for the sender, dropping up to the next recovery frame"sv;
+              flush_start = std::chrono::steady_clock::now();
+              flush_idr_requested = false;
+              invalidate_ref_frames->raise(packet->frame_index(), packet->frame_index());
+            }
+
+            // Without a flush a stale frame others reference is sent, late rather than breaking the ones after it
+            stale_frame = flush_start || (stale && packet->temporal_layer);
+          }
+          if (stale_frame) {
+            if (packet->end_of_frame) {
+              metrics->stale_frames.fetch_add(1, std::memory_order_relaxed);
+            }
+            continue;
+          }
 
-          platf::batched_send_info_t send_info {
-            buffer, size + sizeof(uint32_t) + sizeof(uint32_t), 1,
-            client->GetHandle(), 
-            rAddr, rPort, lAddr
+          // Frames sent in slices are timed up to their last part
+          encoded_bytes += packet->data_size();
+          auto sent = [&]() {
+            if (packet->end_of_frame) {
+              packet->timing.send_complete = std::chrono::steady_clock::now();
+              latency_tracker->record(packet->timing);
+              metrics->frame_sent(encoded_bytes, packet->timing.send_complete);
+              encoded_bytes = 0;
+
+              last_timestamp = timestamp;
+              index++;
+            }
           };
 
-          platf::send_batch(send_info);
-          last_timestamp = timestamp;
-          index++;
+          // Without targets the frame is only accounted for, a session in standby keeps its frame indices going
+          if (!publish_udp || target_addresses.empty()) {
+            frame_indices->insert(index, packet->frame_index());
+            sent();
+            continue;
+          }
+
+          packetizer.packetize(*packet, index);
+          if (!packetizer.shard_count()) {
+            continue;
+          }
+
+          // The data shards are sent straight from the encoded frame, the same shards go to every target
+          batches.clear();
+          for (std::size_t x = 0; x < target_addresses.size(); ++x) {
+            batches.push_back(platf::batched_send_info_t {
+              nullptr, packetizer.block_size(), packetizer.shard_count(),
+              client->native_handle(), 
+              target_addresses[x], target_ports[x], lAddr,
+              packetizer.headers(), sizeof(stream::video_shard_header_t), packetizer.payload_size(),
+              packetizer.payload_buffers(), packetizer.payload_buffer_count()
+            });
+            if (packetizer.parity_count()) {
+              batches.push_back(platf::batched_send_info_t {
+                packetizer.parity(), packetizer.block_size(), packetizer.parity_count(),
+                client->native_handle(), 
+                target_addresses[x], target_ports[x], lAddr
+              });
+            }
+          }
+
+          // The parts of a frame encoded in slices share its frame index and its share of the frame interval
+          std::chrono::nanoseconds pacing_interval = std::chrono::steady_clock::duration { duration };
+          if (packet->slice_index || !packet->end_of_frame) {
+            pacing_interval /= std::max(1, config::video.slices_per_frame);
+          }
+
+          frame_indices->insert(index, packet->frame_index());
+          auto failed = pacer.send(batches, pacing_interval);
+
+          auto targets = target_addresses.size();
+          metrics->data_shards.fetch_add(packetizer.shard_count() * targets, std::memory_order_relaxed);
+          metrics->parity_shards.fetch_add(packetizer.parity_count() * targets, std::memory_order_relaxed);
+          metrics->sent_bytes.fetch_add((packetizer.shard_count() * sizeof(stream::video_shard_header_t) + packetizer.payload_size() + packetizer.parity_count() * packetizer.block_size()) * targets, std::memory_order_relaxed);
+          if (failed) {
+            metrics->send_errors.fetch_add(failed, std::memory_order_relaxed);
+          }
+
+          // The cache keeps the frame alive, its shards are resent straight from it
+          auto frame_index = index;
+          sent();
+          if (retransmit) {
+            retransmit->insert(frame_index, std::move(packet), packetizer, batches.front());
+          }
         } while (video_packets->peek());
       } else if (queue_type == QueueType::Audio) {
         do {
           auto packet = audio_packets->pop();
-          auto timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
-          const char* ptr = (char*)packet->second.begin();
-          size_t size = packet->second.size();
-          auto duration = uint32_t(timestamp - last_timestamp);;
-
-          memcpy(buffer,&index,sizeof(uint32_t));
-          memcpy(buffer + sizeof(uint32_t),&duration,sizeof(uint32_t));
-          memcpy(buffer + sizeof(uint32_t) + sizeof(uint32_t),ptr,size);
-
-          platf::batched_send_info_t send_info {
-            buffer, size + sizeof(uint32_t) + sizeof(uint32_t), 1,
-            client->GetHandle(), 
-            rAddr, rPort, lAddr
-          };
+          TRACE_SCOPE("send");
+          // Stamped when the first sample was recorded, on the same clock as the video frames
+          auto capture_time = packet->capture_time;
+          auto timestamp = capture_time.time_since_epoch().count();
+          auto duration = timestamp - last_timestamp;
+
+          std::string_view payload { (char*)packet->data.data(), packet->data.size() };
+          if (shared) {
+            push_packet(queue, &payload, 1, PacketMetadata { 0, duration, (long long) stream::wall_clock_us(capture_time), 0 });
+          }
+
+          if (recorder) {
+            recorder->audio(payload, capture_time);
+          }
+
+          // Audio is counted in packets from the encoder on
+          metrics->encoded_frames.fetch_add(1, std::memory_order_relaxed);
+          if (!publish_udp || target_addresses.empty()) {
+            metrics->frame_sent(payload.size(), std::chrono::steady_clock::now());
+            last_timestamp = timestamp;
+            index++;
+            continue;
+          }
+
+          auto header = audio_packetizer.packetize(payload, index, capture_time);
+          if (header.empty()) {
+            continue;
+          }
 
-          platf::send_batch(send_info);
+          auto sent_payload = audio_packetizer.payload();
+          for (std::size_t x = 0; x < target_addresses.size(); ++x) {
+            platf::send_info_t send_info {
+              sent_payload.data(), sent_payload.size(),
+              client->native_handle(), 
+              target_addresses[x], target_ports[x], lAddr,
+              header.data(), header.size()
+            };
+
+            std::size_t failed = platf::send(send_info) ? 0 : 1;
+
+            if (audio_packetizer.parity_block_count()) {
+              platf::batched_send_info_t parity_info {
+                audio_packetizer.parity_data(), audio_packetizer.parity_block_size(), audio_packetizer.parity_block_count(),
+                client->native_handle(), 
+                target_addresses[x], target_ports[x], lAddr
+              };
+
+              failed += stream::send_shards(parity_info);
+            }
+
+            metrics->data_shards.fetch_add(1, std::memory_order_relaxed);
+            metrics->parity_shards.fetch_add(audio_packetizer.parity_block_count(), std::memory_order_relaxed);
+            metrics->sent_bytes.fetch_add(header.size() + sent_payload.size() + audio_packetizer.parity_block_count() * audio_packetizer.parity_block_size(), std::memory_order_relaxed);
+            if (failed) {
+              metrics->send_errors.fetch_add(failed, std::memory_order_relaxed);
+            }
+          }
+          metrics->frame_sent(payload.size(), std::chrono::steady_clock::now());
           last_timestamp = timestamp;
           index++;
         } while (audio_packets->peek());
@@ -392,64 +1570,221 @@ main(int argc, char *argv[]) {
     if (!local_shutdown->peek())
       local_shutdown->raise(true);
 
-    queue->metadata.active = 0;
+    update_metadata(queue, [](QueueMetadata &metadata) { metadata.active = 0; });
   };
 
-  auto touch_fun = [mail,process_shutdown_event](Queue* queue){
+  // Touch port changes go to the shared memory queue, the input receiver and the control peer as soon as they happen
+  auto touch_fun = [client,mail,process_shutdown_event,receiver](Queue* queue){
     auto local_shutdown= mail->event<bool>(mail::shutdown);
     auto touch_port    = mail->event<input::touch_port_t>(mail::touch_port);
 
+    safe::selector_t selector;
+    selector.watch(*process_shutdown_event, *local_shutdown, *touch_port);
+
     while (!process_shutdown_event->peek() && !local_shutdown->peek()) {
-      if(touch_port->peek()) {
-        auto touch = touch_port->pop();
-        if (touch.has_value()) {
-          auto value = touch.value();
-          queue->metadata.client_offsetX = value.client_offsetX;
-          queue->metadata.client_offsetY = value.client_offsetY;
-          queue->metadata.offsetX= value.offset_x;
-          queue->metadata.offsetY = value.offset_y;
-          queue->metadata.env_height = value.env_height;
-          queue->metadata.env_width = value.env_width;
-          queue->metadata.height = value.height;
-          queue->metadata.width = value.width;
-          queue->metadata.scalar_inv = value.scalar_inv;
-          BOOST_LOG(info) << "touch port event ";
-          file_handler::write_file(
-            "./metadata.bin",
-            std::string_view((char*)&queue->metadata,sizeof(QueueMetadata))
-          );
-        }
+      selector.wait([&]() { return process_shutdown_event->peek() || local_shutdown->peek() || touch_port->peek(); });
+      if (!touch_port->peek()) {
+        continue;
       }
+
+      auto touch = touch_port->pop();
+      if (!touch) {
+        continue;
+      }
+
+      auto value = *touch;
+      if (receiver) {
+        receiver->set_touch_port(value);
+      }
+      update_metadata(queue, [&](QueueMetadata &metadata) {
+        metadata.client_offsetX = value.client_offsetX;
+        metadata.client_offsetY = value.client_offsetY;
+        metadata.offsetX = value.offset_x;
+        metadata.offsetY = value.offset_y;
+        metadata.env_height = value.env_height;
+        metadata.env_width = value.env_width;
+        metadata.height = value.height;
+        metadata.width = value.width;
+        metadata.scalar_inv = value.scalar_inv;
+      });
+      BOOST_LOG(info) << "touch port event ";
+
+      auto metadata = read_metadata(queue);
+      std::string message(1 + sizeof(QueueMetadata), '\0');
+      message[0] = (char) EventType::Metadata;
+      memcpy(message.data() + 1, &metadata, sizeof(QueueMetadata));
+      client->notify(message);
     }
 
     if (!local_shutdown->peek())
       local_shutdown->raise(true);
 
-    queue->metadata.active = 0;
+    update_metadata(queue, [](QueueMetadata &metadata) { metadata.active = 0; });
   };
 
 
-  auto queue = &memory->queues[queuetype];
-  BOOST_LOG(info) << "Starting capture on channel " << queuetype;
-  if (queuetype == QueueType::Video) {
-    auto capture = std::thread{video_capture,mail,target,0};
-    auto forward = std::thread{push,mail,queue,(QueueType)queuetype};
-    auto touch_thread = std::thread{touch_fun,queue};
-    touch_thread.detach();
-    capture.detach();
-    forward.detach();
-  } else if (queuetype == QueueType::Audio) {
-    auto capture = std::thread{audio_capture,mail};
-    auto forward = std::thread{push,mail,queue,(QueueType)queuetype};
-    capture.detach();
-    forward.detach();
+  // Cursor changes go to the shared memory queue and to the control peer, a shape only once per hash
+  // until the client asks for the cursor again. Datagrams get lost, the peer is sent the current
+  // shape and position again every second.
+  auto cursor_fun = [client,mail,process_shutdown_event,publish_udp,publish_shared](Queue* queue){
+    constexpr auto resend_interval = 1s;
+
+    // Hashes of the shapes sent in this generation, the least recently used first
+    constexpr std::size_t max_sent_shapes = 64;
+
+    auto local_shutdown= mail->event<bool>(mail::shutdown);
+
+    // Shapes are split into rows that fit into a datagram
+    auto datagram_size = stream::max_datagram_size(config::stream.mtu, true);
+    std::vector<uint64_t> sent_shapes;
+    std::uint64_t serial = 0;
+    std::uint64_t generation = 0;
+    std::optional<cursor::state_t> current;
+    auto resend_at = std::chrono::steady_clock::now();
+    std::string message;
+
+    auto send = [&](const void *record, std::size_t size, const std::uint8_t *rows, std::size_t rows_size, bool shared) {
+      if (shared) {
+        std::string_view segments[] { { (const char *) record, size }, { (const char *) rows, rows_size } };
+        push_packet(queue, segments, rows_size ? 2 : 1, PacketMetadata { 0, 0, (long long) stream::wall_clock_us(std::chrono::steady_clock::now()), 0 });
+      }
+
+      if (publish_udp) {
+        message.assign(1, (char) EventType::CursorUpdate);
+        message.append((const char *) record, size);
+        message.append((const char *) rows, rows_size);
+        client->notify(message);
+      }
+    };
+
+    auto send_shape = [&](const cursor::shape_t &shape, bool shared) {
+      std::size_t row_size = (std::size_t) shape.width * 4;
+      int rows_per_record = row_size ? std::max<int>(1, (datagram_size - 1 - sizeof(CursorShapeHeader)) / row_size) : 1;
+      if (!publish_udp) {
+        rows_per_record = std::max(1, shape.height);
+      }
+
+      for (int first_row = 0; first_row < std::max(1, shape.height); first_row += rows_per_record) {
+        auto row_count = std::max(0, std::min(rows_per_record, shape.height - first_row));
+        CursorShapeHeader header { CursorRecordType::CursorShape, shape.hash, shape.width, shape.height, shape.hotspot_x, shape.hotspot_y, first_row, row_count };
+        send(&header, sizeof(header), shape.pixels.data() + first_row * row_size, row_count * row_size, shared);
+      }
+    };
+
+    auto send_position = [&](const cursor::state_t &state, bool shared) {
+      auto &position = state.position;
+      CursorPositionRecord record { CursorRecordType::CursorPosition, state.shape ? state.shape->hash : 0, position.x, position.y, position.visible };
+      send(&record, sizeof(record), nullptr, 0, shared);
+    };
+
+    while (!process_shutdown_event->peek() && !local_shutdown->peek()) {
+      // The timeout only bounds how long a shutdown goes unnoticed
+      auto state = cursor::wait(serial, 100ms);
+
+      auto now = std::chrono::steady_clock::now();
+      if (state) {
+        serial = state->serial;
+        current = state;
+
+        if (generation != state->generation) {
+          generation = state->generation;
+          sent_shapes.clear();
+        }
+      }
+
+      if (!cursor::enabled()) {
+        continue;
+      }
+
+      if (state) {
+        auto &shape = state->shape;
+        if (shape) {
+          auto sent = std::find(std::begin(sent_shapes), std::end(sent_shapes), shape->hash);
+          if (sent != std::end(sent_shapes)) {
+            std::rotate(sent, sent + 1, std::end(sent_shapes));
+          }
+          else {
+            if (sent_shapes.size() == max_sent_shapes) {
+              sent_shapes.erase(std::begin(sent_shapes));
+            }
+            sent_shapes.push_back(shape->hash);
+
+            send_shape(*shape, publish_shared);
+            resend_at = now + resend_interval;
+          }
+        }
+
+        send_position(*state, publish_shared);
+      }
+
+      // The shared memory queue loses nothing, only the peer is sent the cursor again
+      if (publish_udp && current && now >= resend_at) {
+        resend_at = now + resend_interval;
+        if (current->shape) {
+          send_shape(*current->shape, false);
+        }
+        send_position(*current, false);
+      }
+    }
+  };
+
+  for (std::size_t x = 0; x < mails.size(); ++x) {
+    auto queue_type = events[x].queue_type;
+    auto queue = &memory->queues[queue_type];
+    BOOST_LOG(info) << "Starting capture on channel " << queue_type;
+
+    std::ostringstream destination;
+    if (remote_endpoints[x].port()) {
+      destination << remote_endpoints[x];
+    } else {
+      destination << "standby"sv;
+    }
+
+    if (queue_type == QueueType::Video) {
+      auto &rung = config::video.ladder[x % config::video.ladder.size()];
+      auto &display = displays[x / config::video.ladder.size()];
+      BOOST_LOG(info) << "Rung " << x << " of " << display << ": " << rung.width << 'x' << rung.height << '@' << rung.framerate << ' ' << rung.bitrate << " kbps to " << destination.str();
+
+      auto capture = std::thread{video_capture,mails[x],display,video_format,rung,events[x].metrics};
+      auto forward = std::thread{push,mails[x],queue,publish_shared && x == 0,queue_type,events[x].destination,events[x].frame_indices,events[x].latency,events[x].metrics,events[x].retransmit,events[x].congestion,events[x].subscribers,x == 0 ? recorder : nullptr};
+      capture.detach();
+      forward.detach();
+
+      if (x == 0) {
+        auto touch_thread = std::thread{touch_fun,queue};
+        touch_thread.detach();
+
+        auto cursor_thread = std::thread{cursor_fun,&memory->queues[QueueType::Cursor]};
+        cursor_thread.detach();
+      }
+    } else {
+      BOOST_LOG(info) << "Audio to " << destination.str();
+
+      auto capture = std::thread{audio_capture,mails[x]};
+      auto forward = std::thread{push,mails[x],queue,publish_shared,queue_type,events[x].destination,events[x].frame_indices,events[x].latency,events[x].metrics,events[x].retransmit,events[x].congestion,events[x].subscribers,recorder};
+      capture.detach();
+      forward.detach();
+    }
   }
 
-  auto local_shutdown= mail->event<bool>(mail::shutdown);
-  while (!process_shutdown_event->peek() && !local_shutdown->peek())
-    std::this_thread::sleep_for(1s);
+  // The stream ends with the first session that ends
+  std::vector<safe::mail_raw_t::event_t<bool>> local_shutdowns;
+  for (auto &rung_mail : mails) {
+    local_shutdowns.push_back(rung_mail->event<bool>(mail::shutdown));
+  }
+  auto local_shutdown = [&local_shutdowns]() {
+    return std::any_of(local_shutdowns.begin(), local_shutdowns.end(), [](auto &event) { return event->peek(); });
+  };
+  {
+    safe::selector_t selector;
+    selector.watch(*process_shutdown_event);
+    for (auto &event : local_shutdowns) {
+      selector.watch(*event);
+    }
+    selector.wait([&]() { return process_shutdown_event->peek() || local_shutdown(); });
+  }
 
-  BOOST_LOG(info) << "Closed" << queuetype;
+  BOOST_LOG(info) << "Closed " << target;
   // let other threads to close
   std::this_thread::sleep_for(1s);
   task_pool.stop();
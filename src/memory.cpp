@@ -0,0 +1,180 @@
+/**
+ * @file src/memory.cpp
+ * @brief Cache line aligned allocations, large ones are backed by huge pages.
+ */
+#if defined(__linux__)
+  #include <sys/mman.h>
+#elif defined(_WIN32)
+  #include <windows.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#include "config.h"
+#include "logging.h"
+#include "memory.h"
+
+using namespace std::literals;
+
+namespace memory {
+  namespace {
+    enum huge_pages_e : int {
+      disabled,
+      transparent,  ///< Linux backs the mapping with huge pages when it has them
+      reserved,  ///< Huge pages reserved by the administrator, Windows large pages
+    };
+
+    // Precedes every allocation on its own cache line
+    struct header_t {
+      // Bytes mapped from the system, 0 when the memory came from the heap
+      std::size_t mapped;
+    };
+    static_assert(sizeof(header_t) <= ALIGNMENT);
+
+    std::size_t
+    round_up(std::size_t size, std::size_t multiple) {
+      return (size + multiple - 1) / multiple * multiple;
+    }
+
+#if defined(__linux__)
+    void *
+    map(std::size_t size, std::size_t &mapped) {
+      mapped = round_up(size, HUGE_PAGE_SIZE);
+
+      if (config::video.huge_pages >= reserved) {
+        auto data = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED) {
+          return data;
+        }
+
+        static std::atomic_bool warned;
+        if (!warned.exchange(true, std::memory_order_relaxed)) {
+          BOOST_LOG(warning) << "No reserved huge pages left, falling back to transparent huge pages: "sv << strerror(errno);
+        }
+      }
+
+      auto data = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data == MAP_FAILED) {
+        return nullptr;
+      }
+
+      advise_huge_pages(data, mapped);
+      return data;
+    }
+
+    void
+    unmap(void *data, std::size_t mapped) {
+      munmap(data, mapped);
+    }
+#elif defined(_WIN32)
+    /**
+     * @brief Large pages need SeLockMemoryPrivilege, the account must hold it and the process enables it once.
+     * @return The size of a large page, 0 when they can't be used.
+     */
+    std::size_t
+    large_page_size() {
+      static std::once_flag once;
+      static std::size_t page_size = 0;
+
+      std::call_once(once, []() {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+          return;
+        }
+
+        TOKEN_PRIVILEGES privileges {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        auto enabled = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+                       AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+                       GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+
+        if (!enabled) {
+          BOOST_LOG(warning) << "The account lacks SeLockMemoryPrivilege, large pages are disabled"sv;
+          return;
+        }
+
+        page_size = GetLargePageMinimum();
+      });
+
+      return page_size;
+    }
+
+    void *
+    map(std::size_t size, std::size_t &mapped) {
+      if (config::video.huge_pages >= reserved) {
+        if (auto page_size = large_page_size()) {
+          mapped = round_up(size, page_size);
+          auto data = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+          if (data) {
+            return data;
+          }
+        }
+      }
+
+      // Still page aligned and kept out of the heap, so freeing a frame doesn't fragment it
+      mapped = round_up(size, HUGE_PAGE_SIZE);
+      return VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    void
+    unmap(void *data, std::size_t) {
+      VirtualFree(data, 0, MEM_RELEASE);
+    }
+#endif
+  }  // namespace
+
+  void *
+  allocate(std::size_t size) {
+    auto total = size + ALIGNMENT;
+
+    header_t *header = nullptr;
+    std::size_t mapped = 0;
+#if defined(__linux__) || defined(_WIN32)
+    if (config::video.huge_pages != disabled && total >= HUGE_PAGE_SIZE) {
+      header = (header_t *) map(total, mapped);
+    }
+#endif
+
+    if (!header) {
+      mapped = 0;
+      header = (header_t *) ::operator new(total, std::align_val_t { ALIGNMENT }, std::nothrow);
+      if (!header) {
+        return nullptr;
+      }
+    }
+
+    header->mapped = mapped;
+    return (std::uint8_t *) header + ALIGNMENT;
+  }
+
+  void
+  free(void *data) {
+    if (!data) {
+      return;
+    }
+
+    auto header = (header_t *) ((std::uint8_t *) data - ALIGNMENT);
+#if defined(__linux__) || defined(_WIN32)
+    if (header->mapped) {
+      unmap(header, header->mapped);
+      return;
+    }
+#endif
+
+    ::operator delete(header, std::align_val_t { ALIGNMENT });
+  }
+
+  void
+  advise_huge_pages(void *data, std::size_t size) {
+#if defined(__linux__)
+    if (config::video.huge_pages != disabled) {
+      madvise(data, size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+}  // namespace memory
@@ -0,0 +1,65 @@
+/**
+ * @file src/memory.h
+ * @brief Cache line aligned allocations, large ones are backed by huge pages.
+ */
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace memory {
+  // Every allocation starts on its own cache line, wide enough for AVX-512 loads
+  constexpr std::size_t ALIGNMENT = 64;
+
+  // Allocations of at least this many bytes are mapped from the system and may use huge pages
+  constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  /**
+   * @brief Allocate `size` bytes aligned to `ALIGNMENT`, the memory isn't initialized.
+   * @details Allocations of `HUGE_PAGE_SIZE` or more use huge pages as configured by `config::video.huge_pages`.
+   * @return The memory, nullptr if the allocation failed.
+   */
+  void *
+  allocate(std::size_t size);
+
+  /**
+   * @brief Release memory returned by `allocate()`, nullptr is ignored.
+   */
+  void
+  free(void *data);
+
+  /**
+   * @brief Ask the system to back an existing mapping with huge pages, as configured by `config::video.huge_pages`.
+   * @details Linux advises the kernel to use transparent huge pages, for shared memory
+   *          /sys/kernel/mm/transparent_hugepage/shmem_enabled decides whether it does.
+   */
+  void
+  advise_huge_pages(void *data, std::size_t size);
+
+  /**
+   * @brief Allocation policy of `util::buffer_t` that uses `allocate()` and `free()`.
+   */
+  template <class T>
+  struct allocator_t {
+    static_assert(std::is_trivially_destructible_v<T>, "Elements are released without running their destructor");
+    static_assert(alignof(T) <= ALIGNMENT);
+
+    static T *
+    allocate(std::size_t elements) {
+      auto data = (T *) memory::allocate(elements * sizeof(T));
+      if (!data) {
+        throw std::bad_alloc {};
+      }
+
+      std::uninitialized_value_construct_n(data, elements);
+      return data;
+    }
+
+    static void
+    deallocate(T *data) {
+      memory::free(data);
+    }
+  };
+}  // namespace memory
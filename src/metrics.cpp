@@ -0,0 +1,62 @@
+/**
+ * @file src/metrics.cpp
+ * @brief Live counters of an encode session, reported on the control channel.
+ */
+#include <algorithm>
+#include <limits>
+
+#include "metrics.h"
+
+namespace metrics {
+  using namespace std::literals;
+
+  void
+  session_t::frame_sent(std::size_t bytes, std::chrono::steady_clock::time_point now) {
+    sent_frames.fetch_add(1, std::memory_order_relaxed);
+    auto total = encoded_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - window_start);
+    if (elapsed < 1s) {
+      return;
+    }
+
+    // Bits per millisecond are kbps
+    actual_bitrate.store((int) std::min<std::uint64_t>((total - window_bytes) * 8 / elapsed.count(), std::numeric_limits<int>::max()), std::memory_order_relaxed);
+    window_start = now;
+    window_bytes = total;
+  }
+
+  report_t
+  session_t::report(std::size_t queue_depth, std::uint64_t queue_dropped, const latency::stage_report_t &encode) const {
+    constexpr auto relaxed = std::memory_order_relaxed;
+
+    return {
+      0,
+      0,
+      (std::uint16_t) std::min<std::size_t>(queue_depth, std::numeric_limits<std::uint16_t>::max()),
+      captured_frames.load(relaxed),
+      encoded_frames.load(relaxed),
+      sent_frames.load(relaxed),
+      dropped_frames.load(relaxed),
+      queue_dropped,
+      encoded_bytes.load(relaxed),
+      sent_bytes.load(relaxed),
+      data_shards.load(relaxed),
+      parity_shards.load(relaxed),
+      nacks.load(relaxed),
+      late_nacks.load(relaxed),
+      retransmitted_shards.load(relaxed),
+      send_errors.load(relaxed),
+      (std::uint32_t) std::max(0, target_bitrate.load(relaxed)),
+      (std::uint32_t) actual_bitrate.load(relaxed),
+      encode.p50,
+      encode.p90,
+      encode.p99,
+      stale_frames.load(relaxed),
+      pool_capacity.load(relaxed),
+      pool_allocated.load(relaxed),
+      pool_used.load(relaxed),
+      pool_bytes.load(relaxed),
+    };
+  }
+}  // namespace metrics
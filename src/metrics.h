@@ -0,0 +1,113 @@
+/**
+ * @file src/metrics.h
+ * @brief Live counters of an encode session, reported on the control channel.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "latency.h"
+
+namespace metrics {
+#pragma pack(push, 1)
+  /**
+   * @brief Reply to a metrics request on the control channel. All fields are little-endian.
+   * @details Counters start at 0 with the session and only grow, dashboards derive rates from
+   *          the difference between two reports. Audio counts packets where video counts frames.
+   */
+  struct report_t {
+    std::uint8_t type;  // The event type of the request
+    std::uint8_t session;
+    std::uint16_t queue_depth;  // Packets waiting for the sender
+
+    std::uint64_t captured_frames;
+    std::uint64_t encoded_frames;
+    std::uint64_t sent_frames;
+    std::uint64_t dropped_frames;  // Captured frames replaced by a newer one or taken back by the capture before the encoder got to them
+    std::uint64_t queue_dropped;  // Packets dropped because the queue of the sender was full
+
+    std::uint64_t encoded_bytes;  // Payload of the sent frames, before headers and parity
+    std::uint64_t sent_bytes;  // Datagrams to every target, headers and parity included
+    std::uint64_t data_shards;
+    std::uint64_t parity_shards;
+
+    std::uint64_t nacks;
+    std::uint64_t late_nacks;  // NACKs of frames that would miss their playout deadline or that already expired
+    std::uint64_t retransmitted_shards;  // Shards asked for by the NACKs that were served
+    std::uint64_t send_errors;  // Datagrams the OS refused
+
+    std::uint32_t target_bitrate;  // kbps the encoder is configured for
+    std::uint32_t actual_bitrate;  // kbps of encoded payload over the last second
+    std::uint32_t encode_p50;  // Encode latency in microseconds, since the latency histograms were last logged
+    std::uint32_t encode_p90;
+    std::uint32_t encode_p99;
+
+    std::uint64_t stale_frames;  // Frames the sender dropped because they waited longer than the queue deadline
+
+    // Image pool of the capture of the display, as of the last captured frame
+    std::uint32_t pool_capacity;  // Images the pool may hold
+    std::uint32_t pool_allocated;
+    std::uint32_t pool_used;  // Images the encoders held when the pool last allocated or freed one
+    std::uint64_t pool_bytes;  // Memory of the allocated images, CPU or GPU
+  };
+#pragma pack(pop)
+
+  /**
+   * @brief Counters of a session.
+   * @details The capture, encode and send threads count while the control channel reports, so every
+   *          counter is a relaxed atomic. A report isn't a consistent snapshot across counters.
+   */
+  class session_t {
+  public:
+    explicit session_t(int target_bitrate):
+        target_bitrate { target_bitrate } {}
+
+    /**
+     * @brief Count a frame the sender finished with, only called from the send thread.
+     * @param bytes Payload of the frame.
+     */
+    void
+    frame_sent(std::size_t bytes, std::chrono::steady_clock::time_point now);
+
+    /**
+     * @param queue_depth Packets waiting for the sender.
+     * @param queue_dropped Packets the queue of the sender dropped.
+     * @param encode Encode stage of the latency report of the session.
+     */
+    report_t
+    report(std::size_t queue_depth, std::uint64_t queue_dropped, const latency::stage_report_t &encode) const;
+
+    std::atomic<std::uint64_t> captured_frames { 0 };
+    std::atomic<std::uint64_t> encoded_frames { 0 };
+    std::atomic<std::uint64_t> dropped_frames { 0 };
+
+    std::atomic<std::uint64_t> sent_bytes { 0 };
+    std::atomic<std::uint64_t> data_shards { 0 };
+    std::atomic<std::uint64_t> parity_shards { 0 };
+
+    std::atomic<std::uint64_t> nacks { 0 };
+    std::atomic<std::uint64_t> late_nacks { 0 };
+    std::atomic<std::uint64_t> retransmitted_shards { 0 };
+    std::atomic<std::uint64_t> send_errors { 0 };
+    std::atomic<std::uint64_t> stale_frames { 0 };
+
+    std::atomic<std::uint32_t> pool_capacity { 0 };
+    std::atomic<std::uint32_t> pool_allocated { 0 };
+    std::atomic<std::uint32_t> pool_used { 0 };
+    std::atomic<std::uint64_t> pool_bytes { 0 };
+
+    std::atomic<int> target_bitrate;
+
+  private:
+    std::atomic<std::uint64_t> sent_frames { 0 };
+    std::atomic<std::uint64_t> encoded_bytes { 0 };
+    std::atomic<int> actual_bitrate { 0 };
+
+    // Window of the actual bitrate, owned by the send thread
+    std::chrono::steady_clock::time_point window_start = std::chrono::steady_clock::now();
+    std::uint64_t window_bytes = 0;
+  };
+}  // namespace metrics
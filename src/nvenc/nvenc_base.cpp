@@ -2,8 +2,11 @@
 
 #include "src/config.h"
 #include "src/logging.h"
+#include "src/trace.h"
 #include "src/utility.h"
 
+#include <thread>
+
 #define MAKE_NVENC_VER(major, minor) ((major) | ((minor) << 24))
 
 // Make sure we check backwards compatibility when bumping the Video Codec SDK version
@@ -83,7 +86,8 @@ namespace nvenc {
 
   nvenc_base::nvenc_base(NV_ENC_DEVICE_TYPE device_type, void *device):
       device_type(device_type),
-      device(device) {
+      device(device),
+      bitstream_pool(std::make_shared<buffer_pool::pool_t>(buffer_pool::ENCODER_SLABS)) {
   }
 
   nvenc_base::~nvenc_base() {
@@ -129,20 +133,25 @@ namespace nvenc {
 
     NV_ENC_INITIALIZE_PARAMS init_params = { min_struct_version(NV_ENC_INITIALIZE_PARAMS_VER) };
 
+    encoder_params.video_format = client_config.videoFormat;
+
     switch (client_config.videoFormat) {
       case 0:
         // H.264
         init_params.encodeGUID = NV_ENC_CODEC_H264_GUID;
+        encoder_params.qp_map_block_size = 16;
         break;
 
       case 1:
         // HEVC
         init_params.encodeGUID = NV_ENC_CODEC_HEVC_GUID;
+        encoder_params.qp_map_block_size = 32;
         break;
 
       case 2:
         // AV1
         init_params.encodeGUID = NV_ENC_CODEC_AV1_GUID;
+        encoder_params.qp_map_block_size = 64;
         break;
 
       default:
@@ -194,17 +203,36 @@ namespace nvenc {
       return false;
     }
 
-    if (async_event_handle && !get_encoder_cap(NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT)) {
-      BOOST_LOG(warning) << "NvEnc: gpu doesn't support async encode";
-      async_event_handle = nullptr;
+    // Slices are read back while the frame is still being encoded, AV1 tiles are written out as whole frames
+    if (client_config.slicesPerFrame > 1 && client_config.videoFormat <= 1) {
+      encoder_params.slice_output = client_config.slicesPerFrame;
     }
 
+    if (config.async_depth > 1 && encoder_params.slice_output) {
+      BOOST_LOG(warning) << "NvEnc: slice output needs synchronous encode, ignoring async depth";
+    }
+    else if (config.async_depth > 1) {
+      auto async_depth = std::min(config.async_depth, 16u);
+      if (!get_encoder_cap(NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT)) {
+        BOOST_LOG(warning) << "NvEnc: gpu doesn't support async encode";
+      }
+      else if (!create_async_events(async_depth)) {
+        BOOST_LOG(warning) << "NvEnc: async encode isn't available, encoding synchronously";
+      }
+      else {
+        encoder_params.async_depth = async_depth;
+      }
+    }
+    const bool async = encoder_params.async_depth > 1;
+
     encoder_params.rfi = get_encoder_cap(NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION);
 
     init_params.presetGUID = quality_preset_guid_from_number(config.quality_preset);
     init_params.tuningInfo = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
     init_params.enablePTD = 1;
-    init_params.enableEncodeAsync = async_event_handle ? 1 : 0;
+    init_params.enableEncodeAsync = async ? 1 : 0;
+    init_params.reportSliceOffsets = encoder_params.slice_output ? 1 : 0;
+    init_params.enableSubFrameWrite = encoder_params.slice_output ? 1 : 0;
     init_params.enableWeightedPrediction = config.weighted_prediction && get_encoder_cap(NV_ENC_CAPS_SUPPORT_WEIGHTED_PREDICTION);
 
     init_params.encodeWidth = encoder_params.width;
@@ -236,6 +264,16 @@ namespace nvenc {
     enc_config.rcParams.enableAQ = config.adaptive_quantization;
     enc_config.rcParams.averageBitRate = client_config.bitrate * 1000;
 
+    if (config.static_qp_delta > 0) {
+      encoder_params.static_qp_delta = std::min(config.static_qp_delta, 51);
+      enc_config.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+    }
+
+    if (config::video.focus.qp_delta > 0) {
+      encoder_params.focus = true;
+      enc_config.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+    }
+
     if (get_encoder_cap(NV_ENC_CAPS_SUPPORT_CUSTOM_VBV_BUF_SIZE)) {
       enc_config.rcParams.vbvBufferSize = client_config.bitrate * 1000 / client_config.framerate;
       if (config.vbv_percentage_increase > 0) {
@@ -278,6 +316,37 @@ namespace nvenc {
       }
     };
 
+    auto set_intra_refresh_if_enabled = [&](auto &format_config) {
+      if (!client_config.enableIntraRefresh || config::video.intra_refresh_frames <= 1) {
+        return;
+      }
+      if (!get_encoder_cap(NV_ENC_CAPS_SUPPORT_INTRA_REFRESH)) {
+        BOOST_LOG(warning) << "NvEnc: gpu doesn't support intra refresh, recovering with IDR frames";
+        return;
+      }
+
+      // Waves only start on demand through forceIntraRefreshWithFrameCnt
+      format_config.enableIntraRefresh = 1;
+      format_config.intraRefreshPeriod = NVENC_INFINITE_GOPLENGTH;
+      format_config.intraRefreshCnt = config::video.intra_refresh_frames;
+      encoder_params.intra_refresh_frames = config::video.intra_refresh_frames;
+    };
+
+    // Frames of a layer only reference the layers below, so frames above the base layer can be dropped
+    auto temporal_layers = [&]() -> uint32_t {
+      if (config::video.temporal_layers <= 1) {
+        return 0;
+      }
+
+      auto max_layers = (uint32_t) get_encoder_cap(NV_ENC_CAPS_NUM_MAX_TEMPORAL_LAYERS);
+      if (max_layers <= 1) {
+        BOOST_LOG(warning) << "NvEnc: gpu doesn't support temporal layers, encoding a single reference chain";
+        return 0;
+      }
+
+      return std::min((uint32_t) config::video.temporal_layers, max_layers);
+    };
+
     auto fill_h264_hevc_vui = [&colorspace](auto &vui_config) {
       vui_config.videoSignalTypePresentFlag = 1;
       vui_config.videoFormat = NV_ENC_VUI_VIDEO_FORMAT_UNSPECIFIED;
@@ -305,7 +374,21 @@ namespace nvenc {
         }
         set_ref_frames(format_config.maxNumRefFrames, format_config.numRefL0, 5);
         set_minqp_if_enabled(config.min_qp_h264);
+        set_intra_refresh_if_enabled(format_config);
+        format_config.outputRecoveryPointSEI = format_config.enableIntraRefresh;
         fill_h264_hevc_vui(format_config.h264VUIParameters);
+        if (get_encoder_cap(NV_ENC_CAPS_SUPPORT_TEMPORAL_SVC)) {
+          if (auto layers = temporal_layers()) {
+            format_config.enableTemporalSVC = 1;
+            format_config.h264Extension.svcTemporalConfig.numTemporalLayers = layers;
+            format_config.h264Extension.svcTemporalConfig.basePriorityID = 0;
+            format_config.maxNumRefFrames = std::max(format_config.maxNumRefFrames, layers);
+            encoder_params.temporal_layers = layers;
+          }
+        }
+        else if (config::video.temporal_layers > 1) {
+          BOOST_LOG(warning) << "NvEnc: gpu doesn't support temporal SVC, encoding a single reference chain";
+        }
         break;
       }
 
@@ -318,7 +401,14 @@ namespace nvenc {
         }
         set_ref_frames(format_config.maxNumRefFramesInDPB, format_config.numRefL0, 5);
         set_minqp_if_enabled(config.min_qp_hevc);
+        set_intra_refresh_if_enabled(format_config);
+        format_config.outputRecoveryPointSEI = format_config.enableIntraRefresh;
         fill_h264_hevc_vui(format_config.hevcVUIParameters);
+        if (auto layers = temporal_layers()) {
+          format_config.numTemporalLayers = layers;
+          format_config.maxNumRefFramesInDPB = std::max(format_config.maxNumRefFramesInDPB, layers);
+          encoder_params.temporal_layers = layers;
+        }
         break;
       }
 
@@ -340,6 +430,10 @@ namespace nvenc {
         format_config.chromaSamplePosition = 1;
         set_ref_frames(format_config.maxNumRefFramesInDPB, format_config.numFwdRefs, 8);
         set_minqp_if_enabled(config.min_qp_av1);
+        set_intra_refresh_if_enabled(format_config);
+        if (config::video.temporal_layers > 1) {
+          BOOST_LOG(warning) << "NvEnc: AV1 is encoded as a single reference chain, temporal layers need H.264 or HEVC";
+        }
 
         if (client_config.slicesPerFrame > 1) {
           // NVENC only supports slice counts that are powers of two, so we'll pick powers of two
@@ -358,25 +452,44 @@ namespace nvenc {
       return false;
     }
 
-    if (async_event_handle) {
+    for (uint32_t slot = 0; async && slot < encoder_params.async_depth; slot++) {
       NV_ENC_EVENT_PARAMS event_params = { min_struct_version(NV_ENC_EVENT_PARAMS_VER) };
-      event_params.completionEvent = async_event_handle;
+      event_params.completionEvent = async_event_handles[slot];
       if (nvenc_failed(nvenc->nvEncRegisterAsyncEvent(encoder, &event_params))) {
         BOOST_LOG(error) << "NvEncRegisterAsyncEvent failed: " << last_error_string;
         return false;
       }
     }
 
-    NV_ENC_CREATE_BITSTREAM_BUFFER create_bitstream_buffer = { min_struct_version(NV_ENC_CREATE_BITSTREAM_BUFFER_VER) };
-    if (nvenc_failed(nvenc->nvEncCreateBitstreamBuffer(encoder, &create_bitstream_buffer))) {
-      BOOST_LOG(error) << "NvEncCreateBitstreamBuffer failed: " << last_error_string;
-      return false;
+    for (uint32_t slot = 0; slot < encoder_params.async_depth; slot++) {
+      NV_ENC_CREATE_BITSTREAM_BUFFER create_bitstream_buffer = { min_struct_version(NV_ENC_CREATE_BITSTREAM_BUFFER_VER) };
+      if (nvenc_failed(nvenc->nvEncCreateBitstreamBuffer(encoder, &create_bitstream_buffer))) {
+        BOOST_LOG(error) << "NvEncCreateBitstreamBuffer failed: " << last_error_string;
+        return false;
+      }
+      output_bitstreams.push_back(create_bitstream_buffer.bitstreamBuffer);
     }
-    output_bitstream = create_bitstream_buffer.bitstreamBuffer;
 
     if (!create_and_register_input_buffer()) {
       return false;
     }
+    assert(registered_input_buffers.size() == encoder_params.async_depth);
+
+    slice_offsets.assign(encoder_params.slice_output, 0);
+
+    if (encoder_params.static_qp_delta || encoder_params.focus) {
+      auto block_size = encoder_params.qp_map_block_size;
+      auto blocks = ((encoder_params.width + block_size - 1) / block_size) * ((encoder_params.height + block_size - 1) / block_size);
+      qp_delta_maps.assign(encoder_params.async_depth, std::vector<int8_t>(blocks));
+    }
+
+    encoder_params.enc_config = enc_config;
+    encoder_params.init_params = init_params;
+    encoder_params.init_params.encodeConfig = &encoder_params.enc_config;
+    encoder_params.custom_vbv = get_encoder_cap(NV_ENC_CAPS_SUPPORT_CUSTOM_VBV_BUF_SIZE);
+    encoder_params.vbv_percentage_increase = config.vbv_percentage_increase;
+    encoder_params.adaptive_quantization = enc_config.rcParams.enableAQ;
+    encoder_params.min_qp = enc_config.rcParams.enableMinQP;
 
     {
       auto f = stat_trackers::one_digit_after_decimal();
@@ -385,7 +498,8 @@ namespace nvenc {
 
     {
       std::string extra;
-      if (init_params.enableEncodeAsync) extra += " async";
+      if (init_params.enableEncodeAsync) extra += " async=" + std::to_string(encoder_params.async_depth);
+      if (encoder_params.slice_output) extra += " slice-output=" + std::to_string(encoder_params.slice_output);
       if (buffer_is_10bit()) extra += " 10-bit";
       if (enc_config.rcParams.multiPass != NV_ENC_MULTI_PASS_DISABLED) extra += " two-pass";
       if (config.vbv_percentage_increase > 0 && get_encoder_cap(NV_ENC_CAPS_SUPPORT_CUSTOM_VBV_BUF_SIZE)) extra += " vbv+" + std::to_string(config.vbv_percentage_increase);
@@ -393,6 +507,10 @@ namespace nvenc {
       if (init_params.enableWeightedPrediction) extra += " weighted-prediction";
       if (enc_config.rcParams.enableAQ) extra += " spatial-aq";
       if (enc_config.rcParams.enableMinQP) extra += " qpmin=" + std::to_string(enc_config.rcParams.minQP.qpInterP);
+      if (encoder_params.static_qp_delta) extra += " static-qp+" + std::to_string(encoder_params.static_qp_delta);
+      if (encoder_params.focus) extra += " focus-qp-" + std::to_string(config::video.focus.qp_delta);
+      if (encoder_params.intra_refresh_frames) extra += " intra-refresh=" + std::to_string(encoder_params.intra_refresh_frames);
+      if (encoder_params.temporal_layers) extra += " temporal-layers=" + std::to_string(encoder_params.temporal_layers);
       if (config.insert_filler_data) extra += " filler-data";
       BOOST_LOG(info) << "NvEnc: created encoder " << quality_preset_string_from_guid(init_params.presetGUID) << extra;
     }
@@ -404,19 +522,33 @@ namespace nvenc {
 
   void
   nvenc_base::destroy_encoder() {
-    if (output_bitstream) {
-      nvenc->nvEncDestroyBitstreamBuffer(encoder, output_bitstream);
-      output_bitstream = nullptr;
+    for (auto &frame : in_flight) {
+      nvenc->nvEncUnmapInputResource(encoder, frame.mapped_input);
     }
-    if (encoder && async_event_handle) {
-      NV_ENC_EVENT_PARAMS event_params = { min_struct_version(NV_ENC_EVENT_PARAMS_VER) };
-      event_params.completionEvent = async_event_handle;
-      nvenc->nvEncUnregisterAsyncEvent(encoder, &event_params);
+    in_flight.clear();
+    next_slot = 0;
+
+    damage_added = false;
+    pending_damage = std::nullopt;
+    pending_focus.clear();
+    qp_delta_maps.clear();
+    slice_offsets.clear();
+
+    for (auto bitstream : output_bitstreams) {
+      nvenc->nvEncDestroyBitstreamBuffer(encoder, bitstream);
+    }
+    output_bitstreams.clear();
+    if (encoder && encoder_params.async_depth > 1) {
+      for (uint32_t slot = 0; slot < encoder_params.async_depth && slot < async_event_handles.size(); slot++) {
+        NV_ENC_EVENT_PARAMS event_params = { min_struct_version(NV_ENC_EVENT_PARAMS_VER) };
+        event_params.completionEvent = async_event_handles[slot];
+        nvenc->nvEncUnregisterAsyncEvent(encoder, &event_params);
+      }
     }
-    if (registered_input_buffer) {
-      nvenc->nvEncUnregisterResource(encoder, registered_input_buffer);
-      registered_input_buffer = nullptr;
+    for (auto input_buffer : registered_input_buffers) {
+      nvenc->nvEncUnregisterResource(encoder, input_buffer);
     }
+    registered_input_buffers.clear();
     if (encoder) {
       nvenc->nvEncDestroyEncoder(encoder);
       encoder = nullptr;
@@ -426,23 +558,86 @@ namespace nvenc {
     encoder_params = {};
   }
 
+  void
+  nvenc_base::add_damage(const std::optional<std::vector<platf::rect_t>> &damage) {
+    if (!damage_added) {
+      pending_damage = damage;
+      damage_added = true;
+    }
+    else if (pending_damage && damage) {
+      pending_damage->insert(pending_damage->end(), damage->begin(), damage->end());
+    }
+    else {
+      pending_damage = std::nullopt;
+    }
+  }
+
+  void
+  nvenc_base::add_focus(const platf::img_t &img) {
+    if (encoder_params.focus) {
+      pending_focus = focus::regions(img, encoder_params.width, encoder_params.height);
+    }
+  }
+
+  bool
+  nvenc_base::request_intra_refresh() {
+    if (!encoder || !encoder_params.intra_refresh_frames) {
+      return false;
+    }
+
+    encoder_state.intra_refresh_requested = true;
+    return true;
+  }
+
   nvenc_encoded_frame
   nvenc_base::encode_frame(uint64_t frame_index, bool force_idr) {
-    if (!encoder) {
+    if (!submit_frame(frame_index, force_idr)) {
       return {};
     }
 
-    assert(registered_input_buffer);
-    assert(output_bitstream);
+    return retrieve_frame(100);
+  }
+
+  bool
+  nvenc_base::encode_frame_in_slices(uint64_t frame_index, bool force_idr, const std::function<void(nvenc_encoded_frame &&)> &on_slice) {
+    if (!encoder_params.slice_output || !submit_frame(frame_index, force_idr)) {
+      return false;
+    }
+
+    return retrieve_slices(100, on_slice);
+  }
+
+  bool
+  nvenc_base::submit_frame(uint64_t frame_index, bool force_idr) {
+    if (!encoder) {
+      return false;
+    }
+
+    TRACE_SCOPE("nvenc.submit", (std::int64_t) frame_index);
+
+    // Slots are used round-robin, so the next slot is free as long as not every slot is in flight
+    const auto slot = next_slot;
+    {
+      std::lock_guard lg { in_flight_mutex };
+      if (in_flight.size() >= encoder_params.async_depth) {
+        BOOST_LOG(error) << "NvEnc: no free input buffer for frame " << frame_index;
+        return false;
+      }
+    }
+
+    assert(slot < registered_input_buffers.size());
+    assert(slot < output_bitstreams.size());
+
+    copy_to_input_buffer(slot);
 
     NV_ENC_MAP_INPUT_RESOURCE mapped_input_buffer = { min_struct_version(NV_ENC_MAP_INPUT_RESOURCE_VER) };
-    mapped_input_buffer.registeredResource = registered_input_buffer;
+    mapped_input_buffer.registeredResource = registered_input_buffers[slot];
 
     if (nvenc_failed(nvenc->nvEncMapInputResource(encoder, &mapped_input_buffer))) {
       BOOST_LOG(error) << "NvEncMapInputResource failed: " << last_error_string;
-      return {};
+      return false;
     }
-    auto unmap_guard = util::fail_guard([&] { nvenc->nvEncUnmapInputResource(encoder, &mapped_input_buffer); });
+    auto unmap_guard = util::fail_guard([&] { nvenc->nvEncUnmapInputResource(encoder, mapped_input_buffer.mappedResource); });
 
     NV_ENC_PIC_PARAMS pic_params = { min_struct_version(NV_ENC_PIC_PARAMS_VER, 4, 6) };
     pic_params.inputWidth = encoder_params.width;
@@ -452,43 +647,139 @@ namespace nvenc {
     pic_params.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
     pic_params.inputBuffer = mapped_input_buffer.mappedResource;
     pic_params.bufferFmt = mapped_input_buffer.mappedBufferFmt;
-    pic_params.outputBitstream = output_bitstream;
-    pic_params.completionEvent = async_event_handle;
+    pic_params.outputBitstream = output_bitstreams[slot];
+    pic_params.completionEvent = encoder_params.async_depth > 1 ? async_event_handles[slot] : nullptr;
+
+    // The first frame is an IDR frame anyway
+    if (encoder_state.intra_refresh_requested && !force_idr && encoder_state.last_encoded_frame_index) {
+      switch (encoder_params.video_format) {
+        case 0:
+          pic_params.codecPicParams.h264PicParams.forceIntraRefreshWithFrameCnt = encoder_params.intra_refresh_frames;
+          break;
+
+        case 1:
+          pic_params.codecPicParams.hevcPicParams.forceIntraRefreshWithFrameCnt = encoder_params.intra_refresh_frames;
+          break;
+
+        case 2:
+          pic_params.codecPicParams.av1PicParams.forceIntraRefreshWithFrameCnt = encoder_params.intra_refresh_frames;
+          break;
+      }
+    }
+    encoder_state.intra_refresh_requested = false;
+
+    // IDR frames are encoded at full quality, there is nothing to predict the unchanged blocks from
+    const bool raise_static = encoder_params.static_qp_delta && damage_added && pending_damage && !force_idr;
+    if (raise_static || !pending_focus.empty()) {
+      auto &qp_delta_map = qp_delta_maps[slot];
+      const auto block_size = encoder_params.qp_map_block_size;
+      const auto blocks_x = (encoder_params.width + block_size - 1) / block_size;
+      const auto blocks_y = (encoder_params.height + block_size - 1) / block_size;
+
+      auto fill_rect = [&](const platf::rect_t &rect, int8_t qp_delta) {
+        auto left = std::min<uint32_t>(std::max(rect.left, 0), encoder_params.width) / block_size;
+        auto top = std::min<uint32_t>(std::max(rect.top, 0), encoder_params.height) / block_size;
+        auto right = std::min<uint32_t>((std::max(rect.right, 0) + block_size - 1) / block_size, blocks_x);
+        auto bottom = std::min<uint32_t>((std::max(rect.bottom, 0) + block_size - 1) / block_size, blocks_y);
+
+        for (auto y = top; y < bottom; y++) {
+          std::fill_n(qp_delta_map.begin() + y * blocks_x + left, right > left ? right - left : 0, qp_delta);
+        }
+      };
+
+      std::fill(qp_delta_map.begin(), qp_delta_map.end(), (int8_t) (raise_static ? encoder_params.static_qp_delta : 0));
+      if (raise_static) {
+        for (auto &rect : *pending_damage) {
+          fill_rect(rect, 0);
+        }
+      }
+
+      // Backwards, so the region around the cursor is written last
+      for (auto it = pending_focus.rbegin(); it != pending_focus.rend(); ++it) {
+        fill_rect(it->rect, (int8_t) it->qp_delta);
+      }
+
+      pic_params.qpDeltaMap = qp_delta_map.data();
+      pic_params.qpDeltaMapSize = qp_delta_map.size();
+    }
+    damage_added = false;
+    pending_damage = std::nullopt;
+    pending_focus.clear();
 
     if (nvenc_failed(nvenc->nvEncEncodePicture(encoder, &pic_params))) {
       BOOST_LOG(error) << "NvEncEncodePicture failed: " << last_error_string;
+      return false;
+    }
+
+    // The input stays mapped until the bitstream has been retrieved
+    unmap_guard.disable();
+    {
+      std::lock_guard lg { in_flight_mutex };
+      in_flight.push_back({ slot, frame_index, mapped_input_buffer.mappedResource, encoder_state.rfi_needs_confirmation });
+    }
+    next_slot = (slot + 1) % encoder_params.async_depth;
+
+    if (encoder_state.rfi_needs_confirmation) {
+      // Invalidation request has been fulfilled, and video network packet will be marked as such
+      encoder_state.rfi_needs_confirmation = false;
+    }
+
+    encoder_state.last_encoded_frame_index = frame_index;
+
+    return true;
+  }
+
+  nvenc_encoded_frame
+  nvenc_base::retrieve_frame(uint32_t timeout_ms) {
+    if (!encoder) {
       return {};
     }
 
-    NV_ENC_LOCK_BITSTREAM lock_bitstream = { min_struct_version(NV_ENC_LOCK_BITSTREAM_VER, 1, 2) };
-    lock_bitstream.outputBitstream = output_bitstream;
-    lock_bitstream.doNotWait = 0;
+    TRACE_SCOPE("nvenc.retrieve");
+
+    in_flight_frame_t frame;
+    {
+      std::lock_guard lg { in_flight_mutex };
+      if (in_flight.empty()) {
+        return {};
+      }
+      frame = in_flight.front();
+    }
 
-    if (async_event_handle && !wait_for_async_event(100)) {
-      BOOST_LOG(error) << "NvEnc: frame " << frame_index << " encode wait timeout";
+    if (encoder_params.async_depth > 1 && !wait_for_async_event(frame.slot, timeout_ms)) {
+      BOOST_LOG(error) << "NvEnc: frame " << frame.frame_index << " encode wait timeout";
       return {};
     }
 
+    NV_ENC_LOCK_BITSTREAM lock_bitstream = { min_struct_version(NV_ENC_LOCK_BITSTREAM_VER, 1, 2) };
+    lock_bitstream.outputBitstream = output_bitstreams[frame.slot];
+    lock_bitstream.doNotWait = 0;
+
     if (nvenc_failed(nvenc->nvEncLockBitstream(encoder, &lock_bitstream))) {
       BOOST_LOG(error) << "NvEncLockBitstream failed: " << last_error_string;
       return {};
     }
 
-    auto data_pointer = (uint8_t *) lock_bitstream.bitstreamBufferPtr;
+    // The bitstream buffer belongs to the encoder slot, so it has to be copied before the slot is reused
+    auto slab = bitstream_pool->acquire(lock_bitstream.bitstreamSizeInBytes);
+    if (slab) {
+      std::memcpy(slab.data(), lock_bitstream.bitstreamBufferPtr, lock_bitstream.bitstreamSizeInBytes);
+    }
+    else {
+      BOOST_LOG(error) << "NvEnc: couldn't allocate " << lock_bitstream.bitstreamSizeInBytes << " bytes for frame " << frame.frame_index;
+    }
+
     nvenc_encoded_frame encoded_frame {
-      { data_pointer, data_pointer + lock_bitstream.bitstreamSizeInBytes },
+      std::move(slab),
       lock_bitstream.outputTimeStamp,
       lock_bitstream.pictureType == NV_ENC_PIC_TYPE_IDR,
-      encoder_state.rfi_needs_confirmation,
+      frame.after_ref_frame_invalidation,
     };
-
-    if (encoder_state.rfi_needs_confirmation) {
-      // Invalidation request has been fulfilled, and video network packet will be marked as such
-      encoder_state.rfi_needs_confirmation = false;
+    if (encoder_params.temporal_layers) {
+      encoded_frame.temporal_layer = (uint8_t) lock_bitstream.temporalId;
+      encoded_frame.temporal_layers = (uint8_t) encoder_params.temporal_layers;
     }
 
-    encoder_state.last_encoded_frame_index = frame_index;
-
     if (encoded_frame.idr) {
       BOOST_LOG(debug) << "NvEnc: idr frame " << encoded_frame.frame_index;
     }
@@ -497,17 +788,135 @@ namespace nvenc {
       BOOST_LOG(error) << "NvEncUnlockBitstream failed: " << last_error_string;
     }
 
+    release_frame(frame, encoded_frame.data.size());
+
+    return encoded_frame;
+  }
+
+  bool
+  nvenc_base::retrieve_slices(uint32_t timeout_ms, const std::function<void(nvenc_encoded_frame &&)> &on_slice) {
+    if (!encoder) {
+      return false;
+    }
+
+    TRACE_SCOPE("nvenc.retrieve");
+
+    in_flight_frame_t frame;
+    {
+      std::lock_guard lg { in_flight_mutex };
+      if (in_flight.empty()) {
+        return false;
+      }
+      frame = in_flight.front();
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds { timeout_ms };
+    std::size_t bytes_handed_over = 0;
+    uint32_t slices_handed_over = 0;
+    uint16_t slice_index = 0;
+
+    while (true) {
+      NV_ENC_LOCK_BITSTREAM lock_bitstream = { min_struct_version(NV_ENC_LOCK_BITSTREAM_VER, 1, 2) };
+      lock_bitstream.outputBitstream = output_bitstreams[frame.slot];
+      lock_bitstream.doNotWait = 1;
+      lock_bitstream.sliceOffsets = slice_offsets.data();
+
+      bool end_of_frame = false;
+      std::optional<nvenc_encoded_frame> part;
+
+      // The lock is busy until the encoder has written something
+      auto status = nvenc->nvEncLockBitstream(encoder, &lock_bitstream);
+      if (status != NV_ENC_ERR_LOCK_BUSY) {
+        if (nvenc_failed(status)) {
+          BOOST_LOG(error) << "NvEncLockBitstream failed: " << last_error_string;
+          return false;
+        }
+
+        // hwEncodeStatus is 2 once the whole frame has been written
+        end_of_frame = lock_bitstream.hwEncodeStatus == 2;
+
+        if (lock_bitstream.numSlices > slices_handed_over || end_of_frame) {
+          const auto size = lock_bitstream.bitstreamSizeInBytes - bytes_handed_over;
+
+          auto slab = bitstream_pool->acquire(size);
+          if (!slab) {
+            BOOST_LOG(error) << "NvEnc: couldn't allocate " << size << " bytes for slices of frame " << frame.frame_index;
+            nvenc->nvEncUnlockBitstream(encoder, lock_bitstream.outputBitstream);
+            return false;
+          }
+          if (size) {
+            std::memcpy(slab.data(), (uint8_t *) lock_bitstream.bitstreamBufferPtr + bytes_handed_over, size);
+          }
+
+          part = nvenc_encoded_frame {
+            std::move(slab),
+            lock_bitstream.outputTimeStamp,
+            lock_bitstream.pictureType == NV_ENC_PIC_TYPE_IDR,
+            frame.after_ref_frame_invalidation,
+            slice_index++,
+            end_of_frame,
+          };
+          if (encoder_params.temporal_layers) {
+            part->temporal_layer = (uint8_t) lock_bitstream.temporalId;
+            part->temporal_layers = (uint8_t) encoder_params.temporal_layers;
+          }
+
+          bytes_handed_over = lock_bitstream.bitstreamSizeInBytes;
+          slices_handed_over = lock_bitstream.numSlices;
+        }
+
+        if (nvenc_failed(nvenc->nvEncUnlockBitstream(encoder, lock_bitstream.outputBitstream))) {
+          BOOST_LOG(error) << "NvEncUnlockBitstream failed: " << last_error_string;
+        }
+      }
+
+      if (part) {
+        if (part->idr && part->end_of_frame) {
+          BOOST_LOG(debug) << "NvEnc: idr frame " << part->frame_index;
+        }
+
+        on_slice(std::move(*part));
+      }
+
+      if (end_of_frame) {
+        break;
+      }
+
+      if (std::chrono::steady_clock::now() > deadline) {
+        BOOST_LOG(error) << "NvEnc: frame " << frame.frame_index << " slice wait timeout";
+        return false;
+      }
+
+      std::this_thread::sleep_for(std::chrono::microseconds { 100 });
+    }
+
+    release_frame(frame, bytes_handed_over);
+
+    return true;
+  }
+
+  void
+  nvenc_base::release_frame(const in_flight_frame_t &frame, std::size_t frame_size) {
+    if (nvenc_failed(nvenc->nvEncUnmapInputResource(encoder, frame.mapped_input))) {
+      BOOST_LOG(error) << "NvEncUnmapInputResource failed: " << last_error_string;
+    }
+
+    {
+      std::lock_guard lg { in_flight_mutex };
+      in_flight.pop_front();
+    }
+
     if (config::sunshine.min_log_level <= 1) {
       // Print encoded frame size stats to debug log every 20 seconds
-      auto callback = [&](float stat_min, float stat_max, double stat_avg) {
+      auto callback = [&](const stat_trackers::percentiles_t &stats) {
         auto f = stat_trackers::one_digit_after_decimal();
-        BOOST_LOG(debug) << "NvEnc: encoded frame sizes (min max avg) " << f % stat_min << " " << f % stat_max << " " << f % stat_avg << " kB";
+        auto kb = [](std::uint64_t size) { return size / 1000.; };
+        BOOST_LOG(debug) << "NvEnc: encoded frame sizes (min avg p50 p90 p99 p99.9 max) " << f % kb(stats.min) << " " << f % (stats.avg / 1000.) << " "
+                         << f % kb(stats.p50) << " " << f % kb(stats.p90) << " " << f % kb(stats.p99) << " " << f % kb(stats.p999) << " " << f % kb(stats.max) << " kB";
       };
       using namespace std::literals;
-      encoder_state.frame_size_tracker.collect_and_callback_on_interval(encoded_frame.data.size() / 1000., callback, 20s);
+      encoder_state.frame_size_tracker.collect_and_callback_on_interval(frame_size, callback, 20s);
     }
-
-    return encoded_frame;
   }
 
   bool
@@ -547,6 +956,71 @@ namespace nvenc {
     return true;
   }
 
+  bool
+  nvenc_base::reconfigure(int bitrate, int framerate) {
+    if (!encoder || bitrate <= 0 || framerate <= 0) return false;
+
+    auto enc_config = encoder_params.enc_config;
+    enc_config.rcParams.averageBitRate = bitrate * 1000;
+    if (encoder_params.custom_vbv) {
+      enc_config.rcParams.vbvBufferSize = bitrate * 1000 / framerate;
+      if (encoder_params.vbv_percentage_increase > 0) {
+        enc_config.rcParams.vbvBufferSize += enc_config.rcParams.vbvBufferSize * encoder_params.vbv_percentage_increase / 100;
+      }
+    }
+
+    if (!reinitialize(enc_config, framerate)) {
+      return false;
+    }
+
+    {
+      auto f = stat_trackers::one_digit_after_decimal();
+      BOOST_LOG(debug) << "NvEnc: reconfigured encoded frame size " << f % (bitrate / 8. / framerate) << " kB";
+    }
+
+    return true;
+  }
+
+  bool
+  nvenc_base::set_screen_content(bool screen_content) {
+    if (!encoder) return false;
+
+    auto enc_config = encoder_params.enc_config;
+    enc_config.rcParams.enableAQ = screen_content || encoder_params.adaptive_quantization;
+    enc_config.rcParams.enableMinQP = !screen_content && encoder_params.min_qp;
+
+    if (enc_config.rcParams.enableAQ == encoder_params.enc_config.rcParams.enableAQ &&
+        enc_config.rcParams.enableMinQP == encoder_params.enc_config.rcParams.enableMinQP) {
+      return true;
+    }
+
+    return reinitialize(enc_config, encoder_params.init_params.frameRateNum);
+  }
+
+  bool
+  nvenc_base::reinitialize(const NV_ENC_CONFIG &enc_config, uint32_t framerate) {
+    auto new_config = enc_config;
+
+    NV_ENC_RECONFIGURE_PARAMS reconfigure_params = { min_struct_version(NV_ENC_RECONFIGURE_PARAMS_VER) };
+    reconfigure_params.reInitEncodeParams = encoder_params.init_params;
+    reconfigure_params.reInitEncodeParams.encodeConfig = &new_config;
+    reconfigure_params.reInitEncodeParams.frameRateNum = framerate;
+    reconfigure_params.reInitEncodeParams.frameRateDen = 1;
+
+    // Keep the references, the client must not see an IDR frame for a change of the rate control
+    reconfigure_params.resetEncoder = 0;
+    reconfigure_params.forceIDR = 0;
+
+    if (nvenc_failed(nvenc->nvEncReconfigureEncoder(encoder, &reconfigure_params))) {
+      BOOST_LOG(error) << "NvEncReconfigureEncoder failed: " << last_error_string;
+      return false;
+    }
+
+    encoder_params.enc_config = new_config;
+    encoder_params.init_params.frameRateNum = framerate;
+    return true;
+  }
+
   bool
   nvenc_base::nvenc_failed(NVENCSTATUS status) {
     auto status_string = [](NVENCSTATUS status) -> std::string {
@@ -587,8 +1061,9 @@ namespace nvenc {
       }
     };
 
-    last_error_string.clear();
+    // Only touched on failure, retrieve_frame() may run on another thread than the other calls
     if (status != NV_ENC_SUCCESS) {
+      last_error_string.clear();
       if (nvenc && encoder) {
         last_error_string = nvenc->nvEncGetLastErrorString(encoder);
         if (!last_error_string.empty()) last_error_string += " ";
@@ -4,11 +4,18 @@
 #include "nvenc_config.h"
 #include "nvenc_encoded_frame.h"
 
+#include "src/focus.h"
 #include "src/stat_trackers.h"
 #include "src/video.h"
 
 #include <ffnvcodec/nvEncodeAPI.h>
 
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
 namespace nvenc {
 
   class nvenc_base {
@@ -23,24 +30,134 @@ namespace nvenc {
     bool
     create_encoder(const nvenc_config &config, const video::config_t &client_config, const nvenc_colorspace_t &colorspace, NV_ENC_BUFFER_FORMAT buffer_format);
 
+    /**
+     * @brief Destroy the encoder, frames still in flight are dropped.
+     * @details `retrieve_frame()` must not be running on another thread.
+     */
     void
     destroy_encoder();
 
+    /**
+     * @brief Encode the frame in the input buffer and wait for its bitstream.
+     */
     nvenc_encoded_frame
     encode_frame(uint64_t frame_index, bool force_idr);
 
+    /**
+     * @brief Encode the frame in the input buffer and hand over its slices as soon as the encoder writes them.
+     * @details Only available when `slice_output()` is set. Every part holds the slices finished since the
+     *          previous part, the last part has `end_of_frame` set.
+     * @param on_slice Called with every part of the frame, on the calling thread.
+     * @return `false` on error, parts already handed over are not retracted.
+     */
+    bool
+    encode_frame_in_slices(uint64_t frame_index, bool force_idr, const std::function<void(nvenc_encoded_frame &&)> &on_slice);
+
+    /**
+     * @brief Whether the encoder writes out frames slice by slice, which needs a synchronous encoder.
+     */
+    bool
+    slice_output() const {
+      return encoder_params.slice_output;
+    }
+
+    /**
+     * @brief Submit the frame in the input buffer to the encoder without waiting for it.
+     * @details Up to `async_depth()` frames can be in flight, the input buffer can be overwritten
+     *          as soon as this returns.
+     * @return `true` on success, `false` on error or if all frames are in flight.
+     */
+    bool
+    submit_frame(uint64_t frame_index, bool force_idr);
+
+    /**
+     * @brief Wait for the oldest frame in flight and return its bitstream.
+     * @details May run on a different thread than `submit_frame()`.
+     * @param timeout_ms How long to wait for the encoder in async mode.
+     * @return The encoded frame, empty on error or if no frame is in flight.
+     */
+    nvenc_encoded_frame
+    retrieve_frame(uint32_t timeout_ms);
+
+    /**
+     * @brief Number of frames that can be in flight at once, 1 if the encoder is synchronous.
+     */
+    uint32_t
+    async_depth() const {
+      return encoder_params.async_depth;
+    }
+
+    /**
+     * @brief Record the regions of the input buffer the next submitted frame changes.
+     * @details Blocks outside of these regions are encoded with `nvenc_config::static_qp_delta` added to their QP.
+     *          Regions added before the same frame accumulate.
+     * @param damage Changed regions in input buffer coordinates, std::nullopt if unknown.
+     */
+    void
+    add_damage(const std::optional<std::vector<platf::rect_t>> &damage);
+
+    /**
+     * @brief Lower the QP of the regions of the next submitted frame the viewer looks at.
+     * @details The regions are taken from the cursor and the damage of the image, see focus::regions().
+     */
+    void
+    add_focus(const platf::img_t &img);
+
     bool
     invalidate_ref_frames(uint64_t first_frame, uint64_t last_frame);
 
+    /**
+     * @brief Start an intra-refresh wave with the next submitted frame.
+     * @details The wave spreads intra blocks over `intra_refresh_frames` frames, so the bitrate stays flat.
+     * @return `false` if the encoder was created without intra refresh, an IDR frame must be forced instead.
+     */
+    bool
+    request_intra_refresh();
+
+    /**
+     * @brief Change the bitrate and framerate of the encoder without recreating it.
+     * @param bitrate Video bitrate in kilobits.
+     * @param framerate Requested framerate.
+     * @return `true` on success, `false` if the encoder has to be recreated.
+     */
+    bool
+    reconfigure(int bitrate, int framerate);
+
+    /**
+     * @brief Switch the rate control between a tuning for screen content and the configured one for motion.
+     * @details Screen content gets spatial AQ, which spends the bits on the flat areas around text, and no
+     *          QP floor, so a static picture converges to sharp text. Motion gets the configured settings back.
+     * @return `false` if the encoder can't be reconfigured.
+     */
+    bool
+    set_screen_content(bool screen_content);
+
   protected:
     virtual bool
     init_library() = 0;
 
+    /**
+     * @brief Create and register `encoder_params.async_depth` input buffers in `registered_input_buffers`.
+     */
     virtual bool
     create_and_register_input_buffer() = 0;
 
+    /**
+     * @brief Copy the input buffer the frame was written to into the registered input buffer of a slot.
+     * @details Only needed when the frame is not written to the registered input buffers directly.
+     */
+    virtual void
+    copy_to_input_buffer(uint32_t slot) {}
+
+    /**
+     * @brief Make sure `async_event_handles` holds at least `count` completion events.
+     * @return `false` if async encode is not supported on this platform.
+     */
     virtual bool
-    wait_for_async_event(uint32_t timeout_ms) { return false; }
+    create_async_events(uint32_t count) { return false; }
+
+    virtual bool
+    wait_for_async_event(uint32_t slot, uint32_t timeout_ms) { return false; }
 
     bool
     nvenc_failed(NVENCSTATUS status);
@@ -69,23 +186,88 @@ namespace nvenc {
       NV_ENC_BUFFER_FORMAT buffer_format = NV_ENC_BUFFER_FORMAT_UNDEFINED;
       uint32_t ref_frames_in_dpb = 0;
       bool rfi = false;
+      uint32_t async_depth = 1;
+      int static_qp_delta = 0;
+      bool focus = false;  // Regions around the cursor and the damage get a lower QP, see config::video.focus
+      uint32_t qp_map_block_size = 16;
+      int video_format = 0;
+      uint32_t intra_refresh_frames = 0;
+      uint32_t temporal_layers = 0;  // Layers of the hierarchical-P structure, 0 for a single reference chain
+      uint32_t slice_output = 0;  // Slices per frame when frames are written out slice by slice
+
+      // Kept for nvEncReconfigureEncoder()
+      NV_ENC_INITIALIZE_PARAMS init_params = {};
+      NV_ENC_CONFIG enc_config = {};
+      bool custom_vbv = false;
+      int vbv_percentage_increase = 0;
+
+      // Configured rate control, restored when the content turns back into motion
+      bool adaptive_quantization = false;
+      bool min_qp = false;
     } encoder_params;
 
-    // Derived classes set these variables
-    NV_ENC_REGISTERED_PTR registered_input_buffer = nullptr;
-    void *async_event_handle = nullptr;
+    // Derived classes set these variables, one per slot
+    std::vector<NV_ENC_REGISTERED_PTR> registered_input_buffers;
+    std::vector<void *> async_event_handles;
 
     std::string last_error_string;
 
   private:
-    NV_ENC_OUTPUT_PTR output_bitstream = nullptr;
+    struct in_flight_frame_t {
+      uint32_t slot;
+      uint64_t frame_index;
+      NV_ENC_INPUT_PTR mapped_input;
+      bool after_ref_frame_invalidation;
+    };
+
+    /**
+     * @brief Unmap the input of the oldest frame in flight, free its slot and track its size.
+     */
+    void
+    release_frame(const in_flight_frame_t &frame, std::size_t frame_size);
+
+    /**
+     * @brief Apply a changed configuration to the running encoder, keeping its references.
+     */
+    bool
+    reinitialize(const NV_ENC_CONFIG &enc_config, uint32_t framerate);
+
+    /**
+     * @brief Poll the bitstream of the oldest frame in flight until it is complete, handing over the finished slices.
+     */
+    bool
+    retrieve_slices(uint32_t timeout_ms, const std::function<void(nvenc_encoded_frame &&)> &on_slice);
+
+    std::vector<NV_ENC_OUTPUT_PTR> output_bitstreams;
+
+    // Start of every slice in the bitstream, filled in by the encoder in slice output mode
+    std::vector<uint32_t> slice_offsets;
     uint32_t minimum_api_version = 0;
 
+    // Encoded frames are copied out of the locked bitstream into recycled slabs
+    std::shared_ptr<buffer_pool::pool_t> bitstream_pool;
+
+    // Frames submitted to the encoder in submission order, slots are used round-robin
+    std::mutex in_flight_mutex;
+    std::deque<in_flight_frame_t> in_flight;
+    uint32_t next_slot = 0;
+
+    // Damage of the next frame, the QP of every other block is raised by `static_qp_delta`
+    bool damage_added = false;
+    std::optional<std::vector<platf::rect_t>> pending_damage;
+
+    // Regions of the next frame encoded at a lower QP, the first one wins where they overlap
+    std::vector<focus::region_t> pending_focus;
+
+    // One QP delta map per slot, they must stay untouched while the frame is in flight
+    std::vector<std::vector<int8_t>> qp_delta_maps;
+
     struct {
       uint64_t last_encoded_frame_index = 0;
       bool rfi_needs_confirmation = false;
+      bool intra_refresh_requested = false;
       std::pair<uint64_t, uint64_t> last_rfi_range;
-      stat_trackers::min_max_avg_tracker<float> frame_size_tracker;
+      stat_trackers::percentile_tracker frame_size_tracker;
     } encoder_state;
   };
 
@@ -46,6 +46,12 @@ namespace nvenc {
 
     // Add filler data to encoded frames to stay at target bitrate, mainly for testing
     bool insert_filler_data = false;
+
+    // Frames in flight on the encoder, above 1 the next frame is converted while the previous one is encoded at the cost of latency
+    unsigned async_depth = 1;
+
+    // QP added to the regions the capture reports as unchanged, spends the bitrate where the content changes, 0 disables
+    int static_qp_delta = 0;
   };
 
 }  // namespace nvenc
@@ -0,0 +1,136 @@
+#include "src/logging.h"
+
+#ifdef SUNSHINE_BUILD_CUDA
+  #include <ffnvcodec/dynlink_loader.h>
+
+  #include "nvenc_cuda.h"
+
+namespace nvenc {
+
+  nvenc_cuda::nvenc_cuda(CudaFunctions *cdf, CUcontext cu_context, CUstream cu_stream):
+      nvenc_base(NV_ENC_DEVICE_TYPE_CUDA, cu_context),
+      cdf(cdf),
+      cu_context(cu_context),
+      cu_stream(cu_stream) {
+  }
+
+  nvenc_cuda::~nvenc_cuda() {
+    if (encoder) destroy_encoder();
+
+    free_input_buffer();
+
+    if (nvenc_dl) {
+      nvenc_free_functions(&nvenc_dl);
+    }
+  }
+
+  bool
+  nvenc_cuda::init_library() {
+    if (nvenc_dl) return true;
+
+    if (nvenc_load_functions(&nvenc_dl, nullptr)) {
+      BOOST_LOG(debug) << "Couldn't load NvEnc library libnvidia-encode.so.1";
+      return false;
+    }
+
+    auto new_nvenc = std::make_unique<NV_ENCODE_API_FUNCTION_LIST>();
+    new_nvenc->version = min_struct_version(NV_ENCODE_API_FUNCTION_LIST_VER);
+    if (nvenc_failed(nvenc_dl->NvEncodeAPICreateInstance(new_nvenc.get()))) {
+      BOOST_LOG(error) << "NvEncodeAPICreateInstance failed: " << last_error_string;
+      nvenc_free_functions(&nvenc_dl);
+      return false;
+    }
+
+    nvenc = std::move(new_nvenc);
+    return true;
+  }
+
+  bool
+  nvenc_cuda::create_and_register_input_buffer() {
+    if (encoder_params.buffer_format != NV_ENC_BUFFER_FORMAT_NV12 && encoder_params.buffer_format != NV_ENC_BUFFER_FORMAT_YUV420_10BIT) {
+      BOOST_LOG(error) << "NvEnc: unsupported CUDA input format";
+      return false;
+    }
+
+    if (cuda_input_buffer && (cuda_input_width != encoder_params.width || cuda_input_height != encoder_params.height || cuda_input_format != encoder_params.buffer_format)) {
+      free_input_buffer();
+    }
+
+    if (!cuda_input_buffer) {
+      // 4:2:0 chroma has half the rows of the luma plane, 4:4:4 has two full planes, 10-bit samples take two bytes
+      const auto format = encoder_params.buffer_format;
+      const auto bytes_per_sample = format == NV_ENC_BUFFER_FORMAT_NV12 || format == NV_ENC_BUFFER_FORMAT_YUV444 ? 1 : 2;
+      const auto rows = format == NV_ENC_BUFFER_FORMAT_YUV444 || format == NV_ENC_BUFFER_FORMAT_YUV444_10BIT ?
+                          encoder_params.height * 3 :
+                          encoder_params.height + (encoder_params.height + 1) / 2;
+
+      if (cuda_failed(cdf->cuCtxPushCurrent(cu_context), "cuCtxPushCurrent")) return false;
+      auto status = cdf->cuMemAllocPitch(&cuda_input_buffer, &cuda_input_pitch, encoder_params.width * bytes_per_sample, rows, 16);
+      CUcontext dummy;
+      cdf->cuCtxPopCurrent(&dummy);
+
+      if (cuda_failed(status, "cuMemAllocPitch")) {
+        cuda_input_buffer = 0;
+        return false;
+      }
+
+      cuda_input_width = encoder_params.width;
+      cuda_input_height = encoder_params.height;
+      cuda_input_format = encoder_params.buffer_format;
+    }
+
+    // NVENC has no async events on Linux, so there is a single slot
+    if (registered_input_buffers.empty()) {
+      NV_ENC_REGISTER_RESOURCE register_resource = { min_struct_version(NV_ENC_REGISTER_RESOURCE_VER, 3, 4) };
+      register_resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+      register_resource.width = encoder_params.width;
+      register_resource.height = encoder_params.height;
+      register_resource.pitch = cuda_input_pitch;
+      register_resource.resourceToRegister = (void *) cuda_input_buffer;
+      register_resource.bufferFormat = encoder_params.buffer_format;
+      register_resource.bufferUsage = NV_ENC_INPUT_IMAGE;
+
+      if (nvenc_failed(nvenc->nvEncRegisterResource(encoder, &register_resource))) {
+        BOOST_LOG(error) << "NvEncRegisterResource failed: " << last_error_string;
+        return false;
+      }
+
+      registered_input_buffers.push_back(register_resource.registeredResource);
+    }
+
+    // Order the encoder after the conversion on the same stream instead of synchronizing the CPU with it
+    if (cu_stream && nvenc_failed(nvenc->nvEncSetIOCudaStreams(encoder, &cu_stream, &cu_stream))) {
+      BOOST_LOG(error) << "NvEncSetIOCudaStreams failed: " << last_error_string;
+      return false;
+    }
+
+    return true;
+  }
+
+  bool
+  nvenc_cuda::cuda_failed(CUresult result, const char *what) {
+    if (result == CUDA_SUCCESS) return false;
+
+    const char *name = nullptr;
+    cdf->cuGetErrorName(result, &name);
+    BOOST_LOG(error) << what << " failed: " << (name ? name : "unknown");
+    return true;
+  }
+
+  void
+  nvenc_cuda::free_input_buffer() {
+    if (!cuda_input_buffer) return;
+
+    if (!cuda_failed(cdf->cuCtxPushCurrent(cu_context), "cuCtxPushCurrent")) {
+      cuda_failed(cdf->cuMemFree(cuda_input_buffer), "cuMemFree");
+
+      CUcontext dummy;
+      cdf->cuCtxPopCurrent(&dummy);
+    }
+
+    cuda_input_buffer = 0;
+    cuda_input_pitch = 0;
+  }
+
+}  // namespace nvenc
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+#ifdef SUNSHINE_BUILD_CUDA
+
+  #include <ffnvcodec/dynlink_cuda.h>
+
+  #include "nvenc_base.h"
+
+struct CudaFunctions;
+struct NvencFunctions;
+
+namespace nvenc {
+
+  /**
+   * @brief NVENC on a CUDA context, the frame is written into device memory the encoder reads directly.
+   */
+  class nvenc_cuda final: public nvenc_base {
+  public:
+    /**
+     * @param cdf CUDA driver functions, they must outlive the encoder.
+     * @param cu_context Context the input buffer is allocated in.
+     * @param cu_stream Stream the frame is written on, the encoder waits for its work before reading the input.
+     */
+    nvenc_cuda(CudaFunctions *cdf, CUcontext cu_context, CUstream cu_stream);
+    ~nvenc_cuda();
+
+    /**
+     * @brief The input buffer, the luma plane followed by the interleaved chroma plane.
+     */
+    CUdeviceptr
+    get_input_buffer() const {
+      return cuda_input_buffer;
+    }
+
+    /**
+     * @brief Bytes per row of both planes, the chroma plane starts `get_input_pitch() * height` bytes in.
+     */
+    std::size_t
+    get_input_pitch() const {
+      return cuda_input_pitch;
+    }
+
+  private:
+    bool
+    init_library() override;
+
+    bool
+    create_and_register_input_buffer() override;
+
+    bool
+    cuda_failed(CUresult result, const char *what);
+
+    void
+    free_input_buffer();
+
+    CudaFunctions *const cdf;
+    const CUcontext cu_context;
+    CUstream cu_stream;
+
+    NvencFunctions *nvenc_dl = nullptr;
+
+    CUdeviceptr cuda_input_buffer = 0;
+    std::size_t cuda_input_pitch = 0;
+
+    // The buffer is reallocated when the encoder is recreated with another size or format
+    uint32_t cuda_input_width = 0;
+    uint32_t cuda_input_height = 0;
+    NV_ENC_BUFFER_FORMAT cuda_input_format = NV_ENC_BUFFER_FORMAT_UNDEFINED;
+  };
+
+}  // namespace nvenc
+#endif
@@ -15,6 +15,11 @@ namespace nvenc {
   nvenc_d3d11::~nvenc_d3d11() {
     if (encoder) destroy_encoder();
 
+    for (auto event : async_event_handles) {
+      CloseHandle(event);
+    }
+    async_event_handles.clear();
+
     if (dll) {
       FreeLibrary(dll);
       dll = NULL;
@@ -66,41 +71,93 @@ namespace nvenc {
 
   bool
   nvenc_d3d11::create_and_register_input_buffer() {
-    if (!d3d_input_texture) {
-      D3D11_TEXTURE2D_DESC desc = {};
-      desc.Width = encoder_params.width;
-      desc.Height = encoder_params.height;
-      desc.MipLevels = 1;
-      desc.ArraySize = 1;
-      desc.Format = dxgi_format_from_nvenc_format(encoder_params.buffer_format);
-      desc.SampleDesc.Count = 1;
-      desc.Usage = D3D11_USAGE_DEFAULT;
-      desc.BindFlags = D3D11_BIND_RENDER_TARGET;
-      if (d3d_device->CreateTexture2D(&desc, nullptr, &d3d_input_texture) != S_OK) {
-        BOOST_LOG(error) << "NvEnc: couldn't create input texture";
-        return false;
+    if (!d3d_input_texture && !create_texture(d3d_input_texture)) {
+      BOOST_LOG(error) << "NvEnc: couldn't create input texture";
+      return false;
+    }
+
+    const auto slots = encoder_params.async_depth;
+    if (slots > 1) {
+      d3d_slot_textures.resize(slots);
+      for (auto &texture : d3d_slot_textures) {
+        if (!texture && !create_texture(texture)) {
+          BOOST_LOG(error) << "NvEnc: couldn't create input slot texture";
+          return false;
+        }
       }
     }
+    else {
+      d3d_slot_textures.clear();
+    }
 
-    if (!registered_input_buffer) {
-      NV_ENC_REGISTER_RESOURCE register_resource = { min_struct_version(NV_ENC_REGISTER_RESOURCE_VER, 3, 4) };
-      register_resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX;
-      register_resource.width = encoder_params.width;
-      register_resource.height = encoder_params.height;
-      register_resource.resourceToRegister = d3d_input_texture.GetInterfacePtr();
-      register_resource.bufferFormat = encoder_params.buffer_format;
-      register_resource.bufferUsage = NV_ENC_INPUT_IMAGE;
-
-      if (nvenc_failed(nvenc->nvEncRegisterResource(encoder, &register_resource))) {
-        BOOST_LOG(error) << "NvEncRegisterResource failed: " << last_error_string;
-        return false;
+    if (registered_input_buffers.empty()) {
+      for (uint32_t slot = 0; slot < slots; slot++) {
+        auto texture = slots > 1 ? d3d_slot_textures[slot] : d3d_input_texture;
+
+        NV_ENC_REGISTER_RESOURCE register_resource = { min_struct_version(NV_ENC_REGISTER_RESOURCE_VER, 3, 4) };
+        register_resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX;
+        register_resource.width = encoder_params.width;
+        register_resource.height = encoder_params.height;
+        register_resource.resourceToRegister = texture.GetInterfacePtr();
+        register_resource.bufferFormat = encoder_params.buffer_format;
+        register_resource.bufferUsage = NV_ENC_INPUT_IMAGE;
+
+        if (nvenc_failed(nvenc->nvEncRegisterResource(encoder, &register_resource))) {
+          BOOST_LOG(error) << "NvEncRegisterResource failed: " << last_error_string;
+          return false;
+        }
+
+        registered_input_buffers.push_back(register_resource.registeredResource);
       }
+    }
+
+    return true;
+  }
 
-      registered_input_buffer = register_resource.registeredResource;
+  void
+  nvenc_d3d11::copy_to_input_buffer(uint32_t slot) {
+    if (d3d_slot_textures.empty()) return;
+
+    if (!d3d_context) {
+      d3d_device->GetImmediateContext(&d3d_context);
+    }
+
+    // Queued after the conversion on the same context, so no explicit synchronization is needed
+    d3d_context->CopyResource(d3d_slot_textures[slot], d3d_input_texture);
+  }
+
+  bool
+  nvenc_d3d11::create_async_events(uint32_t count) {
+    while (async_event_handles.size() < count) {
+      auto event = CreateEvent(NULL, FALSE, FALSE, NULL);
+      if (!event) {
+        BOOST_LOG(error) << "NvEnc: couldn't create async event";
+        return false;
+      }
+      async_event_handles.push_back(event);
     }
 
     return true;
   }
 
+  bool
+  nvenc_d3d11::wait_for_async_event(uint32_t slot, uint32_t timeout_ms) {
+    return WaitForSingleObject(async_event_handles[slot], timeout_ms) == WAIT_OBJECT_0;
+  }
+
+  bool
+  nvenc_d3d11::create_texture(ID3D11Texture2DPtr &texture) {
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = encoder_params.width;
+    desc.Height = encoder_params.height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = dxgi_format_from_nvenc_format(encoder_params.buffer_format);
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+    return d3d_device->CreateTexture2D(&desc, nullptr, &texture) == S_OK;
+  }
+
 }  // namespace nvenc
 #endif
@@ -9,6 +9,7 @@
 namespace nvenc {
 
   _COM_SMARTPTR_TYPEDEF(ID3D11Device, IID_ID3D11Device);
+  _COM_SMARTPTR_TYPEDEF(ID3D11DeviceContext, IID_ID3D11DeviceContext);
   _COM_SMARTPTR_TYPEDEF(ID3D11Texture2D, IID_ID3D11Texture2D);
 
   class nvenc_d3d11 final: public nvenc_base {
@@ -26,9 +27,26 @@ namespace nvenc {
     bool
     create_and_register_input_buffer() override;
 
+    void
+    copy_to_input_buffer(uint32_t slot) override;
+
+    bool
+    create_async_events(uint32_t count) override;
+
+    bool
+    wait_for_async_event(uint32_t slot, uint32_t timeout_ms) override;
+
+    bool
+    create_texture(ID3D11Texture2DPtr &texture);
+
     HMODULE dll = NULL;
     const ID3D11DevicePtr d3d_device;
+    ID3D11DeviceContextPtr d3d_context;
     ID3D11Texture2DPtr d3d_input_texture;
+
+    // In async mode the encoder reads from a copy of the input texture per slot,
+    // so the next frame can be converted into the input texture right away
+    std::vector<ID3D11Texture2DPtr> d3d_slot_textures;
   };
 
 }  // namespace nvenc
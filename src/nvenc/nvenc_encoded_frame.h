@@ -1,13 +1,24 @@
 #pragma once
 
 #include <cstdint>
-#include <vector>
+
+#include "src/buffer_pool.h"
 
 namespace nvenc {
   struct nvenc_encoded_frame {
-    std::vector<uint8_t> data;
+    buffer_pool::slab_t data;
     uint64_t frame_index = 0;
     bool idr = false;
     bool after_ref_frame_invalidation = false;
+
+    // Frames output in slices take several parts, only the last one ends the frame
+    uint16_t slice_index = 0;
+    bool end_of_frame = true;
+
+    // 0 is the base layer, frames of the layers above may be dropped, see config::video.temporal_layers
+    uint8_t temporal_layer = 0;
+
+    // Layers the encoder actually codes, it may support fewer than configured, 0 without temporal layers
+    uint8_t temporal_layers = 0;
   };
 }  // namespace nvenc
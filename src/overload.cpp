@@ -0,0 +1,132 @@
+/**
+ * @file src/overload.cpp
+ * @brief Steps the resolution and the framerate of a session down while its encoder can't keep up.
+ */
+#include <algorithm>
+#include <cmath>
+
+#include "config.h"
+#include "logging.h"
+#include "overload.h"
+
+namespace overload {
+  using namespace std::literals;
+
+  namespace {
+    constexpr double LOAD_SMOOTHING = 1.0 / 8;
+
+    // A step shrinks both dimensions to this, a bit more than half of the pixels
+    constexpr double RESOLUTION_STEP = 0.75;
+
+    // How long the load must stay high before a step down, low before a step up
+    constexpr auto OVERLOAD_TIME = 1s;
+    constexpr auto IDLE_TIME = 5s;
+
+    // The first frames of a new session are slow, they don't count
+    constexpr auto HOLD_TIME = 2s;
+  }  // namespace
+
+  bool
+  controller_t::frame(std::chrono::nanoseconds busy, std::chrono::nanoseconds frame_interval, std::size_t queued) {
+    auto &settings = config::video.overload;
+    if (!settings.enabled || frame_interval.count() <= 0) {
+      return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now < hold_until) {
+      return false;
+    }
+
+    auto sample = (double) busy.count() / frame_interval.count();
+    load = load ? *load + (sample - *load) * LOAD_SMOOTHING : sample;
+
+    auto overloaded = *load * 100 > settings.max_load || (settings.max_queued > 0 && queued > (std::size_t) settings.max_queued);
+    auto idle = !overloaded && *load * 100 < settings.min_load;
+
+    if (!overloaded) {
+      overloaded_since.reset();
+    }
+    else if (!overloaded_since) {
+      overloaded_since = now;
+    }
+
+    if (!idle) {
+      idle_since.reset();
+    }
+    else if (!idle_since) {
+      idle_since = now;
+    }
+
+    bool stepped = false;
+    if (overloaded_since && now - *overloaded_since >= OVERLOAD_TIME) {
+      stepped = step_down();
+      if (!stepped) {
+        BOOST_LOG_LIMITED(warning) << "The encoder can't keep up even at the smallest step, at "sv << (int) (*load * 100) << "% of the frame interval"sv;
+      }
+    }
+    else if (idle_since && now - *idle_since >= IDLE_TIME) {
+      stepped = step_up();
+    }
+
+    if (stepped) {
+      load.reset();
+      overloaded_since.reset();
+      idle_since.reset();
+      hold_until = now + HOLD_TIME;
+    }
+
+    return stepped;
+  }
+
+  void
+  controller_t::apply(int &width, int &height, int &framerate) {
+    this->width = width;
+    this->height = height;
+    this->framerate = framerate;
+
+    auto scale = std::pow(RESOLUTION_STEP, resolution_steps);
+    width = std::max(2, (int) (width * scale) & ~1);
+    height = std::max(2, (int) (height * scale) & ~1);
+    framerate = std::max(1, framerate >> framerate_steps);
+  }
+
+  bool
+  controller_t::step_down() {
+    auto &settings = config::video.overload;
+
+    auto next_height = height * std::pow(RESOLUTION_STEP, resolution_steps + 1);
+    if (next_height >= settings.min_height) {
+      ++resolution_steps;
+      BOOST_LOG(warning) << "Encoder overloaded, lowering the resolution to "sv << (int) (width * std::pow(RESOLUTION_STEP, resolution_steps)) << 'x' << (int) next_height;
+      return true;
+    }
+
+    auto next_framerate = framerate >> (framerate_steps + 1);
+    if (next_framerate >= settings.min_framerate) {
+      ++framerate_steps;
+      BOOST_LOG(warning) << "Encoder overloaded, lowering the framerate to "sv << next_framerate;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool
+  controller_t::step_up() {
+    if (framerate_steps > 0) {
+      --framerate_steps;
+      BOOST_LOG(info) << "Encoder has headroom again, raising the framerate to "sv << (framerate >> framerate_steps);
+      return true;
+    }
+
+    if (resolution_steps > 0) {
+      --resolution_steps;
+      auto scale = std::pow(RESOLUTION_STEP, resolution_steps);
+      BOOST_LOG(info) << "Encoder has headroom again, raising the resolution to "sv << (int) (width * scale) << 'x' << (int) (height * scale);
+      return true;
+    }
+
+    return false;
+  }
+}  // namespace overload
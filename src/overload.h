@@ -0,0 +1,62 @@
+/**
+ * @file src/overload.h
+ * @brief Steps the resolution and the framerate of a session down while its encoder can't keep up.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <optional>
+
+namespace overload {
+  /**
+   * @brief Watches how much of the frame interval a session spends converting and encoding, and how many
+   *        packets wait for the send thread.
+   * @details The load is a moving average of the busy time over the frame interval. Once it stays above
+   *          `config::video.overload.max_load`, or the packets pile up, for a second, the resolution steps
+   *          down by a quarter and, at the smallest height, the framerate halves. Once the load stays below
+   *          `min_load` for several seconds, the last step is undone. A step up brings less than twice the
+   *          load, so it doesn't overload the encoder right away. After a step the new session is given
+   *          time before the load counts again.
+   */
+  class controller_t {
+  public:
+    /**
+     * @brief Account an encoded frame.
+     * @param busy Time the frame took to convert and encode.
+     * @param frame_interval Time the session has for a frame.
+     * @param queued Packets waiting for the send thread.
+     * @return Whether the session has to be rebuilt at a new step.
+     */
+    bool
+    frame(std::chrono::nanoseconds busy, std::chrono::nanoseconds frame_interval, std::size_t queued);
+
+    /**
+     * @brief Apply the current step to what the session asks for.
+     * @details The request is kept, the next step down is judged against it.
+     */
+    void
+    apply(int &width, int &height, int &framerate);
+
+  private:
+    bool
+    step_down();
+
+    bool
+    step_up();
+
+    // What the session asks for
+    int width = 0;
+    int height = 0;
+    int framerate = 0;
+
+    // Steps taken
+    int resolution_steps = 0;
+    int framerate_steps = 0;
+
+    std::optional<double> load;
+    std::optional<std::chrono::steady_clock::time_point> overloaded_since;
+    std::optional<std::chrono::steady_clock::time_point> idle_since;
+    std::chrono::steady_clock::time_point hold_until;
+  };
+}  // namespace overload
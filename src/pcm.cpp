@@ -0,0 +1,300 @@
+/**
+ * @file src/pcm.cpp
+ * @brief Level detection and channel mixing of PCM audio.
+ */
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+  #define SUNSHINE_PCM_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__)
+  #define SUNSHINE_PCM_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#include "pcm.h"
+
+namespace pcm {
+  namespace {
+    using peak_fn = std::uint32_t (*)(const std::int16_t *samples, std::size_t count);
+    using convert_fn = void (*)(const float *in, std::int16_t *out, std::size_t count);
+
+    // The magnitude of the extremes, the minimum is negated in 32 bits so -32768 doesn't overflow
+    inline std::uint32_t
+    magnitude(int max, int min) {
+      return (std::uint32_t) std::max(max, -min);
+    }
+
+    std::uint32_t
+    peak_scalar(const std::int16_t *samples, std::size_t count) {
+      int max = 0;
+      int min = 0;
+      for (std::size_t x = 0; x < count; ++x) {
+        max = std::max<int>(max, samples[x]);
+        min = std::min<int>(min, samples[x]);
+      }
+
+      return magnitude(max, min);
+    }
+
+    void
+    convert_scalar(const float *in, std::int16_t *out, std::size_t count) {
+      for (std::size_t x = 0; x < count; ++x) {
+        out[x] = (std::int16_t) std::clamp(std::lrint(in[x] * 32768.0f), -32768L, 32767L);
+      }
+    }
+
+#ifdef SUNSHINE_PCM_X86
+    __attribute__((target("sse2"))) std::uint32_t
+    peak_sse2(const std::int16_t *samples, std::size_t count) {
+      auto max = _mm_setzero_si128();
+      auto min = _mm_setzero_si128();
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto block = _mm_loadu_si128((const __m128i *) (samples + x));
+        max = _mm_max_epi16(max, block);
+        min = _mm_min_epi16(min, block);
+      }
+
+      alignas(16) std::int16_t maxs[8];
+      alignas(16) std::int16_t mins[8];
+      _mm_store_si128((__m128i *) maxs, max);
+      _mm_store_si128((__m128i *) mins, min);
+
+      auto result = magnitude(*std::max_element(maxs, maxs + 8), *std::min_element(mins, mins + 8));
+      return std::max(result, peak_scalar(samples + x, count - x));
+    }
+
+    // Rounds to the nearest integer, the pack saturates what doesn't fit in 16 bits
+    __attribute__((target("sse2"))) void
+    convert_sse2(const float *in, std::int16_t *out, std::size_t count) {
+      auto scale = _mm_set1_ps(32768.0f);
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto low = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + x), scale));
+        auto high = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + x + 4), scale));
+        _mm_storeu_si128((__m128i *) (out + x), _mm_packs_epi32(low, high));
+      }
+
+      convert_scalar(in + x, out + x, count - x);
+    }
+
+    __attribute__((target("avx2"))) std::uint32_t
+    peak_avx2(const std::int16_t *samples, std::size_t count) {
+      auto max = _mm256_setzero_si256();
+      auto min = _mm256_setzero_si256();
+
+      std::size_t x = 0;
+      for (; x + 16 <= count; x += 16) {
+        auto block = _mm256_loadu_si256((const __m256i *) (samples + x));
+        max = _mm256_max_epi16(max, block);
+        min = _mm256_min_epi16(min, block);
+      }
+
+      alignas(32) std::int16_t maxs[16];
+      alignas(32) std::int16_t mins[16];
+      _mm256_store_si256((__m256i *) maxs, max);
+      _mm256_store_si256((__m256i *) mins, min);
+
+      auto result = magnitude(*std::max_element(maxs, maxs + 16), *std::min_element(mins, mins + 16));
+      return std::max(result, peak_scalar(samples + x, count - x));
+    }
+
+    __attribute__((target("avx2"))) void
+    convert_avx2(const float *in, std::int16_t *out, std::size_t count) {
+      auto scale = _mm256_set1_ps(32768.0f);
+
+      std::size_t x = 0;
+      for (; x + 16 <= count; x += 16) {
+        auto low = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + x), scale));
+        auto high = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + x + 8), scale));
+
+        // The pack works on 128-bit lanes, the permutation restores the order of the samples
+        auto packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+        _mm256_storeu_si256((__m256i *) (out + x), packed);
+      }
+
+      convert_scalar(in + x, out + x, count - x);
+    }
+#endif
+
+#ifdef SUNSHINE_PCM_NEON
+    std::uint32_t
+    peak_neon(const std::int16_t *samples, std::size_t count) {
+      auto max = vdupq_n_s16(0);
+      auto min = vdupq_n_s16(0);
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto block = vld1q_s16(samples + x);
+        max = vmaxq_s16(max, block);
+        min = vminq_s16(min, block);
+      }
+
+      auto result = magnitude(vmaxvq_s16(max), vminvq_s16(min));
+      return std::max(result, peak_scalar(samples + x, count - x));
+    }
+
+    void
+    convert_neon(const float *in, std::int16_t *out, std::size_t count) {
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto low = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + x), 32768.0f));
+        auto high = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(in + x + 4), 32768.0f));
+        vst1q_s16(out + x, vcombine_s16(vqmovn_s32(low), vqmovn_s32(high)));
+      }
+
+      convert_scalar(in + x, out + x, count - x);
+    }
+#endif
+
+    struct kernel_t {
+      peak_fn peak;
+      convert_fn convert;
+      const char *name;
+    };
+
+    kernel_t
+    select_kernel() {
+#ifdef SUNSHINE_PCM_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return { peak_avx2, convert_avx2, "avx2" };
+      }
+
+      return { peak_sse2, convert_sse2, "sse2" };
+#elif defined(SUNSHINE_PCM_NEON)
+      return { peak_neon, convert_neon, "neon" };
+#else
+      return { peak_scalar, convert_scalar, "scalar" };
+#endif
+    }
+
+    const kernel_t &
+    kernel() {
+      static const kernel_t selected = select_kernel();
+      return selected;
+    }
+
+    constexpr float minus_3db = 0.70710678f;
+
+    /**
+     * @brief Gain of the input channel `in` in the output channel `out`.
+     * @details Without downmix the channels keep their position, a 5.1 layout is the first 6 channels of a 7.1 layout.
+     */
+    constexpr float
+    gain(int channels_in, int channels_out, int out, int in) {
+      if (channels_in <= channels_out) {
+        return out == in ? 1.0f : 0.0f;
+      }
+
+      if (channels_out == 2) {
+        // The left output takes FL, FC, BL and SL, the LFE is dropped
+        if (in == out) {
+          return 1.0f;
+        }
+        if (in == 2 || in == 4 + out || in == 6 + out) {
+          return minus_3db;
+        }
+        return 0.0f;
+      }
+
+      // 7.1 to 5.1, the side channels fold into the back channels
+      if (out < 4) {
+        return out == in ? 1.0f : 0.0f;
+      }
+      return in == out || in == out + 2 ? minus_3db : 0.0f;
+    }
+
+    template <int IN, int OUT>
+    constexpr std::array<float, IN * OUT>
+    make_matrix() {
+      std::array<float, IN * OUT> matrix {};
+      for (int out = 0; out < OUT; ++out) {
+        for (int in = 0; in < IN; ++in) {
+          matrix[out * IN + in] = gain(IN, OUT, out, in);
+        }
+      }
+      return matrix;
+    }
+
+    // Frames mixed at once into a buffer on the stack before the conversion to 16 bits
+    constexpr std::size_t block_frames = 256;
+
+    /**
+     * @brief Mixer specialized for a pair of layouts.
+     * @details The matrix is known at compile time, the zero gains fold away and the loops unroll.
+     */
+    template <int IN, int OUT>
+    void
+    mix(const float *in, std::int16_t *out, std::size_t frames) {
+      if constexpr (IN == OUT) {
+        kernel().convert(in, out, frames * OUT);
+      }
+      else {
+        static constexpr auto matrix = make_matrix<IN, OUT>();
+
+        float block[block_frames * OUT];
+        for (std::size_t first = 0; first < frames; first += block_frames) {
+          auto count = std::min(block_frames, frames - first);
+
+          auto frame_in = in + first * IN;
+          for (std::size_t x = 0; x < count; ++x, frame_in += IN) {
+            for (int channel_out = 0; channel_out < OUT; ++channel_out) {
+              float sum = 0.0f;
+              for (int channel_in = 0; channel_in < IN; ++channel_in) {
+                sum += matrix[channel_out * IN + channel_in] * frame_in[channel_in];
+              }
+              block[x * OUT + channel_out] = sum;
+            }
+          }
+
+          kernel().convert(block, out + first * OUT, count * OUT);
+        }
+      }
+    }
+
+    template <int IN>
+    mix_fn
+    mixer_from(int channels_out) {
+      switch (channels_out) {
+        case 2:
+          return mix<IN, 2>;
+        case 6:
+          return mix<IN, 6>;
+        case 8:
+          return mix<IN, 8>;
+        default:
+          return nullptr;
+      }
+    }
+  }  // namespace
+
+  const char *
+  kernel_name() {
+    return kernel().name;
+  }
+
+  std::uint32_t
+  peak(const std::int16_t *samples, std::size_t count) {
+    return kernel().peak(samples, count);
+  }
+
+  mix_fn
+  mixer(int channels_in, int channels_out) {
+    switch (channels_in) {
+      case 2:
+        return mixer_from<2>(channels_out);
+      case 6:
+        return mixer_from<6>(channels_out);
+      case 8:
+        return mixer_from<8>(channels_out);
+      default:
+        return nullptr;
+    }
+  }
+}  // namespace pcm
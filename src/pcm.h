@@ -0,0 +1,36 @@
+/**
+ * @file src/pcm.h
+ * @brief Level detection and channel mixing of PCM audio.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pcm {
+  /**
+   * @brief Converts interleaved 32-bit float frames into 16-bit frames with another number of channels.
+   * @details Channels are in WAVE order: FL FR FC LFE BL BR SL SR. Layouts with more channels than the output
+   *          are downmixed with -3 dB for the center and surround channels, layouts with fewer are padded with silence.
+   */
+  using mix_fn = void (*)(const float *in, std::int16_t *out, std::size_t frames);
+
+  /**
+   * @brief Name of the level and conversion kernels that were selected for this CPU.
+   */
+  const char *
+  kernel_name();
+
+  /**
+   * @brief Largest magnitude of the samples, 32768 for a sample of -32768.
+   */
+  std::uint32_t
+  peak(const std::int16_t *samples, std::size_t count);
+
+  /**
+   * @brief Mixer from a layout of 2, 6 or 8 channels to another one.
+   * @return nullptr if there is no mixer between these layouts.
+   */
+  mix_fn
+  mixer(int channels_in, int channels_out);
+}  // namespace pcm
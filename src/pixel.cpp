@@ -0,0 +1,366 @@
+/**
+ * @file src/pixel.cpp
+ * @brief Cursor blending and copies of 32-bit BGRA images in system memory.
+ */
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+  #define SUNSHINE_PIXEL_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+  #define SUNSHINE_PIXEL_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#include "logging.h"
+#include "pixel.h"
+
+using namespace std::literals;
+
+namespace pixel {
+  namespace {
+    using blend_fn = void (*)(std::uint32_t *dst, const std::uint32_t *src, std::size_t count);
+    using monochrome_fn = void (*)(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count);
+
+    // Exact for any product of two bytes: (x + 127) / 255 == (t + (t >> 8)) >> 8 with t = x + 128
+    inline std::uint32_t
+    div255(std::uint32_t x) {
+      x += 128;
+      return (x + (x >> 8)) >> 8;
+    }
+
+    void
+    blend_alpha_scalar(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      for (std::size_t x = 0; x < count; ++x) {
+        auto alpha = src[x] >> 24;
+        if (alpha == 0xFF) {
+          dst[x] = src[x];
+          continue;
+        }
+
+        std::uint32_t out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+          auto c = ((src[x] >> shift) & 0xFF) + div255(((dst[x] >> shift) & 0xFF) * (0xFF - alpha));
+          out |= std::min<std::uint32_t>(c, 0xFF) << shift;
+        }
+        dst[x] = out;
+      }
+    }
+
+    void
+    blend_masked_scalar(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      for (std::size_t x = 0; x < count; ++x) {
+        dst[x] = (src[x] >> 24) == 0xFF ? dst[x] ^ src[x] : src[x];
+      }
+    }
+
+    void
+    blend_monochrome_scalar(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count) {
+      for (std::size_t x = 0; x < count; ++x) {
+        auto bit = first_bit + x;
+        auto shift = 7 - bit % 8;
+
+        std::uint32_t and_ = (and_mask[bit / 8] >> shift) & 1 ? ~0u : 0;
+        std::uint32_t xor_ = (xor_mask[bit / 8] >> shift) & 1 ? ~0u : 0;
+        dst[x] = (dst[x] & and_) ^ xor_;
+      }
+    }
+
+    /**
+     * @brief The SIMD kernels work on whole mask bytes, the scalar one takes the pixels up to the next one.
+     * @return Pixels that were handled.
+     */
+    std::size_t
+    align_monochrome(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count) {
+      auto head = std::min<std::size_t>(count, (8 - first_bit % 8) % 8);
+      blend_monochrome_scalar(dst, and_mask, xor_mask, first_bit, head);
+
+      return head;
+    }
+
+#ifdef SUNSHINE_PIXEL_X86
+    __attribute__((target("ssse3"))) void
+    blend_alpha_ssse3(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      auto broadcast_alpha = _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+      auto round = _mm_set1_epi16(128);
+      auto zero = _mm_setzero_si128();
+
+      std::size_t x = 0;
+      for (; x + 4 <= count; x += 4) {
+        auto s = _mm_loadu_si128((const __m128i *) (src + x));
+        auto d = _mm_loadu_si128((const __m128i *) (dst + x));
+
+        auto inv_alpha = _mm_xor_si128(_mm_shuffle_epi8(s, broadcast_alpha), _mm_set1_epi8(-1));
+
+        auto lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(inv_alpha, zero)), round);
+        auto hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(inv_alpha, zero)), round);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+      }
+
+      blend_alpha_scalar(dst + x, src + x, count - x);
+    }
+
+    __attribute__((target("avx2"))) void
+    blend_alpha_avx2(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      auto broadcast_alpha = _mm256_setr_epi8(
+        3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15,
+        3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+      auto round = _mm256_set1_epi16(128);
+      auto zero = _mm256_setzero_si256();
+
+      // Unpacking and packing both work within 128-bit lanes, so the pixels stay in order
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto s = _mm256_loadu_si256((const __m256i *) (src + x));
+        auto d = _mm256_loadu_si256((const __m256i *) (dst + x));
+
+        auto inv_alpha = _mm256_xor_si256(_mm256_shuffle_epi8(s, broadcast_alpha), _mm256_set1_epi8(-1));
+
+        auto lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(inv_alpha, zero)), round);
+        auto hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(inv_alpha, zero)), round);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+      }
+
+      blend_alpha_scalar(dst + x, src + x, count - x);
+    }
+
+    __attribute__((target("sse2"))) void
+    blend_masked_sse2(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      auto opaque = _mm_set1_epi32((int) 0xFF000000);
+
+      // XOR where opaque, replace elsewhere: src ^ (dst & opaque)
+      std::size_t x = 0;
+      for (; x + 4 <= count; x += 4) {
+        auto s = _mm_loadu_si128((const __m128i *) (src + x));
+        auto d = _mm_loadu_si128((const __m128i *) (dst + x));
+
+        auto mask = _mm_cmpeq_epi32(_mm_and_si128(s, opaque), opaque);
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_xor_si128(s, _mm_and_si128(d, mask)));
+      }
+
+      blend_masked_scalar(dst + x, src + x, count - x);
+    }
+
+    __attribute__((target("avx2"))) void
+    blend_masked_avx2(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      auto opaque = _mm256_set1_epi32((int) 0xFF000000);
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto s = _mm256_loadu_si256((const __m256i *) (src + x));
+        auto d = _mm256_loadu_si256((const __m256i *) (dst + x));
+
+        auto mask = _mm256_cmpeq_epi32(_mm256_and_si256(s, opaque), opaque);
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_xor_si256(s, _mm256_and_si256(d, mask)));
+      }
+
+      blend_masked_scalar(dst + x, src + x, count - x);
+    }
+
+    __attribute__((target("sse2"))) void
+    blend_monochrome_sse2(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count) {
+      auto head = align_monochrome(dst, and_mask, xor_mask, first_bit, count);
+      dst += head;
+      first_bit += head;
+      count -= head;
+
+      // Bits of the first and the last four pixels of a mask byte
+      auto bits_hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+      auto bits_lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto byte = (first_bit + x) / 8;
+        auto and_ = _mm_set1_epi32(and_mask[byte]);
+        auto xor_ = _mm_set1_epi32(xor_mask[byte]);
+
+        auto d = _mm_loadu_si128((const __m128i *) (dst + x));
+        d = _mm_and_si128(d, _mm_cmpeq_epi32(_mm_and_si128(and_, bits_hi), bits_hi));
+        d = _mm_xor_si128(d, _mm_cmpeq_epi32(_mm_and_si128(xor_, bits_hi), bits_hi));
+        _mm_storeu_si128((__m128i *) (dst + x), d);
+
+        d = _mm_loadu_si128((const __m128i *) (dst + x + 4));
+        d = _mm_and_si128(d, _mm_cmpeq_epi32(_mm_and_si128(and_, bits_lo), bits_lo));
+        d = _mm_xor_si128(d, _mm_cmpeq_epi32(_mm_and_si128(xor_, bits_lo), bits_lo));
+        _mm_storeu_si128((__m128i *) (dst + x + 4), d);
+      }
+
+      blend_monochrome_scalar(dst + x, and_mask, xor_mask, first_bit + x, count - x);
+    }
+
+    __attribute__((target("avx2"))) void
+    blend_monochrome_avx2(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count) {
+      auto head = align_monochrome(dst, and_mask, xor_mask, first_bit, count);
+      dst += head;
+      first_bit += head;
+      count -= head;
+
+      auto bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto byte = (first_bit + x) / 8;
+        auto and_ = _mm256_set1_epi32(and_mask[byte]);
+        auto xor_ = _mm256_set1_epi32(xor_mask[byte]);
+
+        auto d = _mm256_loadu_si256((const __m256i *) (dst + x));
+        d = _mm256_and_si256(d, _mm256_cmpeq_epi32(_mm256_and_si256(and_, bits), bits));
+        d = _mm256_xor_si256(d, _mm256_cmpeq_epi32(_mm256_and_si256(xor_, bits), bits));
+        _mm256_storeu_si256((__m256i *) (dst + x), d);
+      }
+
+      blend_monochrome_scalar(dst + x, and_mask, xor_mask, first_bit + x, count - x);
+    }
+#endif
+
+#ifdef SUNSHINE_PIXEL_NEON
+    void
+    blend_alpha_neon(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      std::size_t x = 0;
+      for (; x + 16 <= count; x += 16) {
+        // One plane per channel, the alpha of every pixel lines up with its colors
+        auto s = vld4q_u8((const std::uint8_t *) (src + x));
+        auto d = vld4q_u8((const std::uint8_t *) (dst + x));
+
+        auto inv_alpha = vmvnq_u8(s.val[3]);
+        for (int c = 0; c < 4; ++c) {
+          auto lo = vmull_u8(vget_low_u8(d.val[c]), vget_low_u8(inv_alpha));
+          auto hi = vmull_u8(vget_high_u8(d.val[c]), vget_high_u8(inv_alpha));
+
+          // (x + ((x + 128) >> 8) + 128) >> 8, the same rounding as div255()
+          auto blended = vcombine_u8(vraddhn_u16(lo, vrshrq_n_u16(lo, 8)), vraddhn_u16(hi, vrshrq_n_u16(hi, 8)));
+          d.val[c] = vqaddq_u8(s.val[c], blended);
+        }
+
+        vst4q_u8((std::uint8_t *) (dst + x), d);
+      }
+
+      blend_alpha_scalar(dst + x, src + x, count - x);
+    }
+
+    void
+    blend_masked_neon(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+      auto opaque = vdupq_n_u32(0xFF000000);
+
+      std::size_t x = 0;
+      for (; x + 4 <= count; x += 4) {
+        auto s = vld1q_u32(src + x);
+        auto d = vld1q_u32(dst + x);
+
+        auto mask = vceqq_u32(vandq_u32(s, opaque), opaque);
+        vst1q_u32(dst + x, veorq_u32(s, vandq_u32(d, mask)));
+      }
+
+      blend_masked_scalar(dst + x, src + x, count - x);
+    }
+
+    void
+    blend_monochrome_neon(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count) {
+      auto head = align_monochrome(dst, and_mask, xor_mask, first_bit, count);
+      dst += head;
+      first_bit += head;
+      count -= head;
+
+      const std::uint32_t bits_hi_data[] { 0x80, 0x40, 0x20, 0x10 };
+      const std::uint32_t bits_lo_data[] { 0x08, 0x04, 0x02, 0x01 };
+      auto bits_hi = vld1q_u32(bits_hi_data);
+      auto bits_lo = vld1q_u32(bits_lo_data);
+
+      std::size_t x = 0;
+      for (; x + 8 <= count; x += 8) {
+        auto byte = (first_bit + x) / 8;
+        auto and_ = vdupq_n_u32(and_mask[byte]);
+        auto xor_ = vdupq_n_u32(xor_mask[byte]);
+
+        auto d = vld1q_u32(dst + x);
+        vst1q_u32(dst + x, veorq_u32(vandq_u32(d, vtstq_u32(and_, bits_hi)), vtstq_u32(xor_, bits_hi)));
+
+        d = vld1q_u32(dst + x + 4);
+        vst1q_u32(dst + x + 4, veorq_u32(vandq_u32(d, vtstq_u32(and_, bits_lo)), vtstq_u32(xor_, bits_lo)));
+      }
+
+      blend_monochrome_scalar(dst + x, and_mask, xor_mask, first_bit + x, count - x);
+    }
+#endif
+
+    struct kernel_t {
+      blend_fn alpha;
+      blend_fn masked;
+      monochrome_fn monochrome;
+      const char *name;
+    };
+
+    kernel_t
+    select_kernel() {
+#ifdef SUNSHINE_PIXEL_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return { blend_alpha_avx2, blend_masked_avx2, blend_monochrome_avx2, "avx2" };
+      }
+      if (__builtin_cpu_supports("ssse3")) {
+        return { blend_alpha_ssse3, blend_masked_sse2, blend_monochrome_sse2, "ssse3" };
+      }
+
+      return { blend_alpha_scalar, blend_masked_sse2, blend_monochrome_sse2, "sse2" };
+#elif defined(SUNSHINE_PIXEL_NEON)
+      return { blend_alpha_neon, blend_masked_neon, blend_monochrome_neon, "neon" };
+#else
+      return { blend_alpha_scalar, blend_masked_scalar, blend_monochrome_scalar, "scalar" };
+#endif
+    }
+
+    const kernel_t &
+    kernel() {
+      static const kernel_t selected = []() {
+        auto selected = select_kernel();
+        BOOST_LOG(info) << "Cursor blend kernel: "sv << selected.name;
+        return selected;
+      }();
+      return selected;
+    }
+  }  // namespace
+
+  const char *
+  kernel_name() {
+    return kernel().name;
+  }
+
+  void
+  blend_alpha(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+    kernel().alpha(dst, src, count);
+  }
+
+  void
+  blend_masked(std::uint32_t *dst, const std::uint32_t *src, std::size_t count) {
+    kernel().masked(dst, src, count);
+  }
+
+  void
+  blend_monochrome(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count) {
+    kernel().monochrome(dst, and_mask, xor_mask, first_bit, count);
+  }
+
+  void
+  copy_rows(std::uint8_t *dst, std::size_t dst_pitch, const std::uint8_t *src, std::size_t src_pitch, std::size_t row_bytes, std::size_t rows) {
+    if (!rows) {
+      return;
+    }
+
+    // memcpy() is already vectorized for this CPU, what matters is copying as much as possible at once
+    if (dst_pitch == src_pitch) {
+      std::memcpy(dst, src, dst_pitch * (rows - 1) + row_bytes);
+      return;
+    }
+
+    for (std::size_t y = 0; y < rows; ++y) {
+      std::memcpy(dst + y * dst_pitch, src + y * src_pitch, row_bytes);
+    }
+  }
+}  // namespace pixel
@@ -0,0 +1,45 @@
+/**
+ * @file src/pixel.h
+ * @brief Cursor blending and copies of 32-bit BGRA images in system memory.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pixel {
+  /**
+   * @brief Name of the blend kernels that were selected for this CPU.
+   */
+  const char *
+  kernel_name();
+
+  /**
+   * @brief Blend a row of premultiplied BGRA cursor pixels over the image.
+   * @details Every channel, alpha included, becomes `src + dst * (255 - alpha) / 255`, rounded to nearest.
+   */
+  void
+  blend_alpha(std::uint32_t *dst, const std::uint32_t *src, std::size_t count);
+
+  /**
+   * @brief Apply a row of masked color cursor pixels to the image.
+   * @details Pixels with an alpha of 0xFF are XORed into the image, the others replace it.
+   */
+  void
+  blend_masked(std::uint32_t *dst, const std::uint32_t *src, std::size_t count);
+
+  /**
+   * @brief Apply a row of a monochrome cursor to the image, `dst = (dst & AND) ^ XOR` for every pixel.
+   * @param and_mask, xor_mask One bit per pixel, the most significant bit of a byte comes first.
+   * @param first_bit Bit of the masks that applies to the first pixel.
+   */
+  void
+  blend_monochrome(std::uint32_t *dst, const std::uint8_t *and_mask, const std::uint8_t *xor_mask, std::size_t first_bit, std::size_t count);
+
+  /**
+   * @brief Copy the rows of an image, in a single copy when both buffers have the same pitch.
+   * @details The padding between the rows is copied as well in that case.
+   */
+  void
+  copy_rows(std::uint8_t *dst, std::size_t dst_pitch, const std::uint8_t *src, std::size_t src_pitch, std::size_t row_bytes, std::size_t rows);
+}  // namespace pixel
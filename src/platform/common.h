@@ -4,11 +4,13 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <bitset>
 #include <filesystem>
 #include <functional>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include "src/config.h"
 #include "src/logging.h"
@@ -75,6 +77,9 @@ namespace video {
 namespace nvenc {
   class nvenc_base;
 }
+namespace amfenc {
+  class amf_base;
+}
 
 namespace platf {
   // Limited by bits in activeGamepadMask
@@ -213,6 +218,7 @@ namespace platf {
     vaapi,
     dxgi,
     cuda,
+    vulkan,
     videotoolbox,
     unknown
   };
@@ -222,6 +228,8 @@ namespace platf {
     yuv420p10,
     nv12,
     p010,
+    yuv444p,  ///< Three planes of 8-bit samples
+    yuv444p16,  ///< Three planes of 10-bit samples in the high bits of 16-bit words
     unknown
   };
 
@@ -236,6 +244,8 @@ namespace platf {
       _CONVERT(yuv420p10);
       _CONVERT(nv12);
       _CONVERT(p010);
+      _CONVERT(yuv444p);
+      _CONVERT(yuv444p16);
       _CONVERT(unknown);
     }
 #undef _CONVERT
@@ -339,6 +349,16 @@ namespace platf {
     virtual ~deinit_t() = default;
   };
 
+  /**
+   * @brief A rectangle in pixels, `right` and `bottom` are exclusive.
+   */
+  struct rect_t {
+    std::int32_t left;
+    std::int32_t top;
+    std::int32_t right;
+    std::int32_t bottom;
+  };
+
   struct img_t: std::enable_shared_from_this<img_t> {
   public:
     img_t() = default;
@@ -358,6 +378,15 @@ namespace platf {
 
     std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
 
+    // Incremented by the capture backend for every image with new content, 0 if the backend doesn't count images
+    std::uint64_t capture_sequence {};
+
+    // Regions that changed since the image with `capture_sequence - 1`, std::nullopt if unknown
+    std::optional<std::vector<rect_t>> damage;
+
+    // Where the cursor is drawn on the image, std::nullopt if it's hidden or the backend doesn't tell
+    std::optional<rect_t> cursor_rect;
+
     virtual ~img_t() = default;
   };
 
@@ -435,6 +464,13 @@ namespace platf {
     nvenc::nvenc_base *nvenc = nullptr;
   };
 
+  struct amf_encode_device_t: encode_device_t {
+    virtual bool
+    init_encoder(const video::config_t &client_config, const video::sunshine_colorspace_t &colorspace) = 0;
+
+    amfenc::amf_base *amf = nullptr;
+  };
+
   enum class capture_e : int {
     ok,
     reinit,
@@ -493,6 +529,18 @@ namespace platf {
     virtual int
     dummy_img(img_t *img) = 0;
 
+    /**
+     * @brief Recreate only the capture after capture() returned capture_e::reinit, such as after the
+     *        access to the desktop was lost.
+     * @details The device, the images of the pool and the encode devices made from the display stay
+     *          valid, so the encode sessions keep running.
+     * @return true if the display captures again in the same mode and format, false if it has to be recreated.
+     */
+    virtual bool
+    reinit_capture() {
+      return false;
+    }
+
     virtual std::unique_ptr<avcodec_encode_device_t>
     make_avcodec_encode_device(pix_fmt_e pix_fmt) {
       return nullptr;
@@ -503,6 +551,32 @@ namespace platf {
       return nullptr;
     }
 
+    virtual std::unique_ptr<amf_encode_device_t>
+    make_amf_encode_device(pix_fmt_e pix_fmt) {
+      return nullptr;
+    }
+
+    /**
+     * @brief Whether the encode devices of the display convert only `crop`.
+     * @details They cut it out in the conversion on the GPU, so the encoder only gets the pixels of the region.
+     */
+    virtual bool
+    can_crop() {
+      return false;
+    }
+
+    /**
+     * @brief The part of the display the encode devices convert, the whole display when no crop is set.
+     */
+    rect_t
+    region() const {
+      if (crop.right > crop.left && crop.bottom > crop.top) {
+        return crop;
+      }
+
+      return rect_t { 0, 0, width, height };
+    }
+
     virtual bool
     is_hdr() {
       return false;
@@ -533,13 +607,20 @@ namespace platf {
 
     int width, height;
 
+    // Region of the display the encode devices made from now on convert, if the display can crop. Empty converts all of it.
+    rect_t crop {};
+
   protected:
   };
 
   class mic_t {
   public:
+    /**
+     * @brief Fill the buffer with the next block of interleaved samples.
+     * @param capture_time When the first sample of the block was recorded, on the clock of `img_t::frame_timestamp`.
+     */
     virtual capture_e
-    sample(std::vector<std::int16_t> &frame_buffer) = 0;
+    sample(std::vector<std::int16_t> &frame_buffer, std::chrono::steady_clock::time_point &capture_time) = 0;
 
     virtual ~mic_t() = default;
   };
@@ -586,6 +667,66 @@ namespace platf {
   void
   freeInput(void *);
 
+  using input_t = util::safe_ptr<void, freeInput>;
+
+  /**
+   * @brief Open the virtual devices input is injected through.
+   * @return nullptr if the platform refuses to create them.
+   */
+  input_t
+  input();
+
+  void
+  move_mouse(input_t &input, int deltaX, int deltaY);
+
+  /**
+   * @param touch_port The desktop the position is in, `width` and `height` are those of the whole desktop.
+   * @param x Position in pixels of the captured display, relative to `offset_x`.
+   */
+  void
+  abs_mouse(input_t &input, const touch_port_t &touch_port, float x, float y);
+
+  /**
+   * @param button 1 left, 2 middle, 3 right, 4 and 5 the side buttons.
+   */
+  void
+  button_mouse(input_t &input, int button, bool release);
+
+  /**
+   * @param distance In 1/120 of a notch of the wheel, positive scrolls up.
+   */
+  void
+  scroll(input_t &input, int distance);
+
+  /**
+   * @param distance In 1/120 of a notch of the wheel, positive scrolls right.
+   */
+  void
+  hscroll(input_t &input, int distance);
+
+  /**
+   * @param modcode Windows virtual key code.
+   * @param flags SS_KBE_FLAG_* flags of the keyboard packet.
+   */
+  void
+  keyboard_update(input_t &input, std::uint16_t modcode, bool release, std::uint8_t flags);
+
+  void
+  unicode(input_t &input, char *utf8, int size);
+
+  /**
+   * @brief Plug in a virtual gamepad.
+   * @return 0 on success, -1 if the platform can't create one.
+   */
+  int
+  alloc_gamepad(input_t &input, const gamepad_id_t &id, const gamepad_arrival_t &metadata);
+
+  void
+  free_gamepad(input_t &input, int nr);
+
+  void
+  gamepad_update(input_t &input, int nr, const gamepad_state_t &gamepad_state);
+
   std::filesystem::path
   appdata();
 
@@ -612,6 +753,14 @@ namespace platf {
   std::shared_ptr<display_t>
   display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config);
 
+  /**
+   * @brief Find a visible top-level window by its title.
+   * @param title Part of the title of the window.
+   * @return The window in desktop coordinates, nullopt if no window matches or the window system doesn't tell.
+   */
+  std::optional<rect_t>
+  window_rect(const std::string &title);
+
   // A list of names of displays accepted as display_name with the mem_type_e
   std::vector<std::string>
   display_names(mem_type_e hwdevice_type);
@@ -623,6 +772,13 @@ namespace platf {
   bool
   needs_encoder_reenumeration();
 
+  /**
+   * @brief Identify the GPUs and their drivers, encoder probe results are only reused while it stays the same.
+   * @return The identity, empty if the GPUs can't be identified.
+   */
+  std::string
+  gpu_identity();
+
   boost::process::child
   run_command(bool elevated, bool interactive, const std::string &cmd, boost::filesystem::path &working_dir, const boost::process::environment &env, FILE *file, std::error_code &ec, boost::process::group *group);
 
@@ -635,10 +791,25 @@ namespace platf {
   void
   adjust_thread_priority(thread_priority_e priority);
 
+  /**
+   * @brief Pin the calling thread to the CPUs chosen for the streaming pipeline by `config::sunshine.thread_affinity`.
+   * @details The CPUs are chosen and logged on the first call. In "auto" mode they are the CPUs sharing
+   *          the last level cache of the first CPU on the NUMA node of the GPU, so the hand-offs between
+   *          capture, encode and send stay within one cache.
+   * @param name Name of the thread in the log.
+   */
+  void
+  place_pipeline_thread(std::string_view name);
+
 
   void
   restart();
 
+  struct buffer_descriptor_t {
+    const char *buffer;
+    size_t size;
+  };
+
   struct batched_send_info_t {
     const char *buffer;
     size_t block_size;
@@ -648,8 +819,95 @@ namespace platf {
     boost::asio::ip::address &target_address;
     uint16_t target_port;
     boost::asio::ip::address &source_address;
+
+    // Optional scatter/gather layout, used when headers is set.
+    // Block x is then made of header_size bytes at headers + x * header_size, followed by
+    // its part of the payload. The payload is made of payload_buffers, which are logically
+    // concatenated and hold payload_size bytes in total. Every block but the last carries
+    // block_size - header_size bytes of payload, the last one may be shorter.
+    const char *headers = nullptr;
+    size_t header_size = 0;
+    size_t payload_size = 0;
+    const buffer_descriptor_t *payload_buffers = nullptr;
+    size_t payload_buffer_count = 0;
+
+    // Offset of the payload of the first block, set by slice()
+    size_t payload_offset = 0;
+
+    // Departure time of the blocks in steady_clock nanoseconds, for a socket with `enable_socket_txtime()`. 0 sends them at once
+    uint64_t txtime = 0;
+
+    buffer_descriptor_t
+    header_for_block(size_t x) const {
+      return { headers + x * header_size, headers ? header_size : 0 };
+    }
+
+    /**
+     * @brief Call `fn(buffer_descriptor_t)` for every contiguous segment of the payload of a block.
+     * @param x The block.
+     * @param fn Called with the segments in order.
+     */
+    template <class FN>
+    void
+    for_each_payload_segment(size_t x, FN &&fn) const {
+      if (!headers) {
+        fn(buffer_descriptor_t { buffer + x * block_size, block_size });
+        return;
+      }
+
+      auto stride = block_size - header_size;
+      auto begin = std::min(payload_offset + x * stride, payload_size);
+      auto end = std::min(begin + stride, payload_size);
+
+      size_t buffer_begin = 0;
+      for (size_t i = 0; i < payload_buffer_count && buffer_begin < end; ++i) {
+        auto &payload_buffer = payload_buffers[i];
+        auto buffer_end = buffer_begin + payload_buffer.size;
+
+        if (buffer_end > begin) {
+          auto from = std::max(begin, buffer_begin);
+          auto to = std::min(end, buffer_end);
+
+          fn(buffer_descriptor_t { payload_buffer.buffer + (from - buffer_begin), to - from });
+        }
+
+        buffer_begin = buffer_end;
+      }
+    }
+
+    /**
+     * @brief Upper bound of the number of segments `for_each_payload_segment()` yields for a block.
+     */
+    size_t
+    max_payload_segments() const {
+      return headers ? std::max<size_t>(1, payload_buffer_count) : 1;
+    }
+
+    /**
+     * @brief The blocks [offset, offset + count) as a batch of their own.
+     */
+    batched_send_info_t
+    slice(size_t offset, size_t count) const {
+      auto result = *this;
+
+      result.block_count = count;
+      if (headers) {
+        result.headers += offset * header_size;
+        result.payload_offset += offset * (block_size - header_size);
+      }
+      else {
+        result.buffer += offset * block_size;
+      }
+
+      return result;
+    }
   };
-  bool
+
+  /**
+   * @brief Send the blocks of a batch with as few system calls as the platform allows.
+   * @return Number of blocks from the start of the batch that were sent, the caller sends the rest on its own.
+   */
+  size_t
   send_batch(batched_send_info_t &send_info);
 
   struct send_info_t {
@@ -660,6 +918,13 @@ namespace platf {
     boost::asio::ip::address &target_address;
     uint16_t target_port;
     boost::asio::ip::address &source_address;
+
+    // Optional header that is sent in front of buffer
+    const char *header = nullptr;
+    size_t header_size = 0;
+
+    // Departure time as in `batched_send_info_t::txtime`, 0 sends the datagram at once
+    uint64_t txtime = 0;
   };
   bool
   send(send_info_t &send_info);
@@ -680,6 +945,16 @@ namespace platf {
   std::unique_ptr<deinit_t>
   enable_socket_qos(uintptr_t native_socket, boost::asio::ip::address &address, uint16_t port, qos_data_type_e data_type, bool dscp_tagging);
 
+  /**
+   * @brief Let the batches sent on the socket carry a departure time, see `batched_send_info_t::txtime`.
+   * @details On Linux the datagrams get an SO_TXTIME timestamp, the fq qdisc holds them until then. Without
+   *          a qdisc that honours the timestamps they're sent at once.
+   * @param native_socket The native socket handle.
+   * @return true if the platform sends at the departure times, false if they're ignored.
+   */
+  bool
+  enable_socket_txtime(std::uintptr_t native_socket);
+
   /**
    * @brief Open a url in the default web browser.
    * @param url The url to open.
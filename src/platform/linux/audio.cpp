@@ -2,6 +2,7 @@
  * @file src/platform/linux/audio.cpp
  * @brief todo
  */
+#include <algorithm>
 #include <bitset>
 #include <sstream>
 #include <thread>
@@ -14,6 +15,10 @@
 
 #include "src/platform/common.h"
 
+#ifdef SUNSHINE_BUILD_PIPEWIRE
+  #include "audio_pipewire.h"
+#endif
+
 #include "src/config.h"
 #include "src/logging.h"
 #include "src/thread_safe.h"
@@ -54,7 +59,7 @@ namespace platf {
     util::safe_ptr<pa_simple, pa_simple_free> mic;
 
     capture_e
-    sample(std::vector<std::int16_t> &sample_buf) override {
+    sample(std::vector<std::int16_t> &sample_buf, std::chrono::steady_clock::time_point &capture_time) override {
       auto sample_size = sample_buf.size();
 
       auto buf = sample_buf.data();
@@ -65,13 +70,30 @@ namespace platf {
         return capture_e::error;
       }
 
+      // The block ends where the samples still waiting in the buffers of the server begin
+      auto latency = pa_simple_get_latency(mic.get(), &status);
+      if (latency == (pa_usec_t) -1) {
+        latency = 0;
+      }
+      capture_time = std::chrono::steady_clock::now() - std::chrono::microseconds { latency } - block_duration(sample_size);
+
       return capture_e::ok;
     }
+
+    std::chrono::nanoseconds
+    block_duration(std::size_t samples) const {
+      return std::chrono::nanoseconds { (std::int64_t) (samples / channels) * 1000000000 / sample_rate };
+    }
+
+    int channels;
+    std::uint32_t sample_rate;
   };
 
   std::unique_ptr<mic_t>
   microphone(const std::uint8_t *mapping, int channels, std::uint32_t sample_rate, std::uint32_t frame_size, std::string source_name) {
     auto mic = std::make_unique<mic_attr_t>();
+    mic->channels = channels;
+    mic->sample_rate = sample_rate;
 
     pa_sample_spec ss { PA_SAMPLE_S16LE, sample_rate, (std::uint8_t) channels };
     pa_channel_map pa_map;
@@ -81,8 +103,11 @@ namespace platf {
       channel = position_mapping[*mapping++];
     });
 
+    // Fragments of a single packet, so sample() gets every packet as soon as it was recorded
     pa_buffer_attr pa_attr = {};
-    pa_attr.maxlength = frame_size * 8;
+    pa_attr.fragsize = frame_size * channels * sizeof(std::int16_t);
+    pa_attr.maxlength = std::max<std::uint32_t>(frame_size * 8, pa_attr.fragsize * 4);
+    pa_attr.tlength = pa_attr.prebuf = pa_attr.minreq = (std::uint32_t) -1;
 
     int status;
 
@@ -465,6 +490,14 @@ namespace platf {
         if (sink_name.empty()) sink_name = requested_sink;
         if (sink_name.empty()) sink_name = get_default_sink_name();
 
+#ifdef SUNSHINE_BUILD_PIPEWIRE
+        // PipeWire delivers every quantum as it's produced, without the buffering of the simple API
+        if (auto mic = pipewire::microphone(mapping, channels, sample_rate, frame_size, sink_name)) {
+          return mic;
+        }
+        BOOST_LOG(info) << "Falling back to PulseAudio for audio capture"sv;
+#endif
+
         return ::platf::microphone(mapping, channels, sample_rate, frame_size, get_monitor_name(sink_name));
       }
 
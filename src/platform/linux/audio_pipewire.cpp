@@ -0,0 +1,314 @@
+/**
+ * @file src/platform/linux/audio_pipewire.cpp
+ * @brief Native PipeWire capture of the monitor of a sink.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <spa/param/audio/format-utils.h>
+#include <spa/pod/builder.h>
+
+#include "audio_pipewire.h"
+#include "misc.h"
+#include "pipewire.h"
+#include "src/logging.h"
+
+using namespace std::literals;
+
+namespace platf::pipewire {
+  // Frames buffered between the realtime thread and the capture thread
+  constexpr std::size_t RING_FRAMES = 16;
+
+  // Frames the capture thread may lag behind before the oldest audio is dropped
+  constexpr std::size_t MAX_BACKLOG_FRAMES = 4;
+
+  // Time sample() waits for a frame, the capture loop checks for shutdown in between
+  constexpr auto SAMPLE_TIMEOUT = 100ms;
+
+  // Time the stream gets to link to the sink before falling back to PulseAudio
+  constexpr auto CONNECT_TIMEOUT = 2s;
+
+  constexpr spa_audio_channel position_mapping[] {
+    SPA_AUDIO_CHANNEL_FL,
+    SPA_AUDIO_CHANNEL_FR,
+    SPA_AUDIO_CHANNEL_FC,
+    SPA_AUDIO_CHANNEL_LFE,
+    SPA_AUDIO_CHANNEL_RL,
+    SPA_AUDIO_CHANNEL_RR,
+    SPA_AUDIO_CHANNEL_SL,
+    SPA_AUDIO_CHANNEL_SR,
+  };
+
+  class mic_pw_t: public mic_t {
+  public:
+    ~mic_pw_t() override {
+      if (loop) {
+        pw_thread_loop_stop(loop.get());
+      }
+    }
+
+    int
+    init(const std::uint8_t *mapping, int channels, std::uint32_t sample_rate, std::uint32_t frame_size, const std::string &sink_name) {
+      pw_init(nullptr, nullptr);
+
+      ring.resize(frame_size * channels * RING_FRAMES);
+      this->channels = channels;
+      this->sample_rate = sample_rate;
+
+      event = file_t { eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) };
+      if (event.el < 0) {
+        BOOST_LOG(error) << "Couldn't create eventfd: "sv << strerror(errno);
+        return -1;
+      }
+
+      loop.reset(pw_thread_loop_new("sunshine-audio", nullptr));
+      if (!loop) {
+        BOOST_LOG(error) << "Couldn't create a PipeWire thread loop"sv;
+        return -1;
+      }
+
+      context.reset(pw_context_new(pw_thread_loop_get_loop(loop.get()), nullptr, 0));
+      if (!context) {
+        BOOST_LOG(error) << "Couldn't create a PipeWire context"sv;
+        return -1;
+      }
+
+      if (pw_thread_loop_start(loop.get()) < 0) {
+        BOOST_LOG(error) << "Couldn't start the PipeWire thread loop"sv;
+        return -1;
+      }
+
+      pw::loop_lock_t lock { loop.get() };
+
+      core.reset(pw_context_connect(context.get(), nullptr, 0));
+      if (!core) {
+        BOOST_LOG(info) << "PipeWire isn't running: "sv << strerror(errno);
+        return -1;
+      }
+
+      // Ask for a quantum of a single packet, the graph then wakes us up as soon as one is ready
+      auto latency = std::to_string(frame_size) + '/' + std::to_string(sample_rate);
+      auto rate = "1/"s + std::to_string(sample_rate);
+
+      auto props = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Audio",
+        PW_KEY_MEDIA_CATEGORY, "Capture",
+        PW_KEY_NODE_NAME, "sunshine-record",
+        PW_KEY_STREAM_CAPTURE_SINK, "true",
+        PW_KEY_NODE_LATENCY, latency.c_str(),
+        PW_KEY_NODE_RATE, rate.c_str(),
+        nullptr);
+      if (!sink_name.empty()) {
+#ifdef PW_KEY_TARGET_OBJECT
+        pw_properties_set(props, PW_KEY_TARGET_OBJECT, sink_name.c_str());
+#else
+        pw_properties_set(props, PW_KEY_NODE_TARGET, sink_name.c_str());
+#endif
+      }
+
+      stream.reset(pw_stream_new(core.get(), "sunshine-record", props));
+      if (!stream) {
+        BOOST_LOG(error) << "Couldn't create a PipeWire stream"sv;
+        return -1;
+      }
+
+      static const pw_stream_events stream_events = [] {
+        pw_stream_events events {};
+        events.version = PW_VERSION_STREAM_EVENTS;
+        events.state_changed = on_state_changed;
+        events.process = on_process;
+        return events;
+      }();
+      pw_stream_add_listener(stream.get(), &stream_listener, &stream_events, this);
+
+      spa_audio_info_raw info {};
+      info.format = SPA_AUDIO_FORMAT_S16_LE;
+      info.rate = sample_rate;
+      info.channels = channels;
+      for (int x = 0; x < channels; ++x) {
+        info.position[x] = position_mapping[mapping[x]];
+      }
+
+      std::uint8_t pod_buffer[1024];
+      spa_pod_builder builder = SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+      const spa_pod *params[] { spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info) };
+
+      // The process callback only copies into the ring buffer, so it can run on the realtime data thread
+      auto flags = (pw_stream_flags) (PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS);
+      if (pw_stream_connect(stream.get(), PW_DIRECTION_INPUT, PW_ID_ANY, flags, params, 1) < 0) {
+        BOOST_LOG(error) << "Couldn't connect the PipeWire stream"sv;
+        return -1;
+      }
+
+      auto deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+      while (state == PW_STREAM_STATE_CONNECTING || state == PW_STREAM_STATE_UNCONNECTED) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+          BOOST_LOG(warning) << "Timed out linking the PipeWire stream to ["sv << sink_name << ']';
+          return -1;
+        }
+
+        timespec abstime;
+        pw_thread_loop_get_time(loop.get(), &abstime, std::chrono::nanoseconds { 100ms }.count());
+        pw_thread_loop_timed_wait_full(loop.get(), &abstime);
+      }
+
+      if (state == PW_STREAM_STATE_ERROR) {
+        return -1;
+      }
+
+      BOOST_LOG(info) << "Capturing ["sv << (sink_name.empty() ? "default sink"s : sink_name) << "] through PipeWire with a quantum of "sv << latency;
+      return 0;
+    }
+
+    capture_e
+    sample(std::vector<std::int16_t> &sample_buf, std::chrono::steady_clock::time_point &capture_time) override {
+      auto needed = sample_buf.size();
+
+      auto read = read_pos.load(std::memory_order_relaxed);
+      auto write = write_pos.load(std::memory_order_acquire);
+      while (write - read < needed) {
+        if (failed.load(std::memory_order_relaxed)) {
+          return capture_e::reinit;
+        }
+
+        pollfd pfd { event.el, POLLIN, 0 };
+        auto status = poll(&pfd, 1, std::chrono::milliseconds { SAMPLE_TIMEOUT }.count());
+        if (status == 0) {
+          return capture_e::timeout;
+        }
+        if (status < 0 && errno != EINTR) {
+          BOOST_LOG(error) << "Couldn't wait for PipeWire audio: "sv << strerror(errno);
+          return capture_e::error;
+        }
+
+        std::uint64_t count;
+        while (::read(event.el, &count, sizeof(count)) > 0) {}
+
+        write = write_pos.load(std::memory_order_acquire);
+      }
+
+      // Don't let latency build up when the encoder fell behind, skip to the most recent frame
+      if (write - read > needed * MAX_BACKLOG_FRAMES) {
+        read = write - needed;
+      }
+
+      auto offset = read % ring.size();
+      auto first = std::min(needed, ring.size() - offset);
+      std::copy_n(ring.data() + offset, first, sample_buf.data());
+      std::copy_n(ring.data(), needed - first, sample_buf.data() + first);
+
+      capture_time = time_of(read);
+
+      read_pos.store(read + needed, std::memory_order_release);
+      return capture_e::ok;
+    }
+
+  private:
+    /**
+     * @brief When the sample at `position` of the ring was recorded.
+     */
+    std::chrono::steady_clock::time_point
+    time_of(std::size_t position) const {
+      auto offset = (double) (position / channels) * 1e9 / sample_rate;
+      return std::chrono::steady_clock::time_point { std::chrono::nanoseconds { ring_start_ns.load(std::memory_order_relaxed) + (std::int64_t) offset } };
+    }
+
+    static void
+    on_state_changed(void *userdata, pw_stream_state old, pw_stream_state state, const char *error) {
+      auto self = (mic_pw_t *) userdata;
+
+      self->state = state;
+      if (state == PW_STREAM_STATE_ERROR || (state == PW_STREAM_STATE_UNCONNECTED && old != PW_STREAM_STATE_CONNECTING)) {
+        if (error) {
+          BOOST_LOG(warning) << "PipeWire audio stream failed: "sv << error;
+        }
+        self->failed.store(true, std::memory_order_relaxed);
+      }
+
+      pw_thread_loop_signal(self->loop.get(), false);
+    }
+
+    /**
+     * @brief Runs on the realtime data thread, it neither locks nor allocates.
+     */
+    static void
+    on_process(void *userdata) {
+      auto self = (mic_pw_t *) userdata;
+
+      auto buffer = pw_stream_dequeue_buffer(self->stream.get());
+      if (!buffer) {
+        return;
+      }
+
+      auto &data = buffer->buffer->datas[0];
+      if (data.data && data.chunk->size) {
+        auto samples = (const std::int16_t *) ((const std::uint8_t *) data.data + data.chunk->offset);
+        std::size_t count = std::min(data.chunk->size, data.maxsize - data.chunk->offset) / sizeof(std::int16_t);
+
+        auto write = self->write_pos.load(std::memory_order_relaxed);
+        auto read = self->read_pos.load(std::memory_order_acquire);
+
+        // The capture thread catches up by dropping frames, what doesn't fit now is lost
+        count = std::min(count, self->ring.size() - (write - read));
+
+        auto offset = write % self->ring.size();
+        auto first = std::min(count, self->ring.size() - offset);
+        std::copy_n(samples, first, self->ring.data() + offset);
+        std::copy_n(samples + first, count - first, self->ring.data());
+
+        // The last sample of the buffer was just recorded, the clock of the graph and the steady clock drift apart
+        // slowly enough that every buffer can move where the ring started
+        auto end = (double) ((write + count) / self->channels) * 1e9 / self->sample_rate;
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        self->ring_start_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() - (std::int64_t) end, std::memory_order_relaxed);
+
+        self->write_pos.store(write + count, std::memory_order_release);
+
+        std::uint64_t one = 1;
+        ::write(self->event.el, &one, sizeof(one));
+      }
+
+      pw_stream_queue_buffer(self->stream.get(), buffer);
+    }
+
+    std::vector<std::int16_t> ring;
+
+    // Total samples written by the data thread and read by the capture thread
+    std::atomic<std::size_t> write_pos { 0 };
+    std::atomic<std::size_t> read_pos { 0 };
+
+    // Steady clock time of the first sample that was ever written, in nanoseconds
+    std::atomic<std::int64_t> ring_start_ns { 0 };
+    int channels = 0;
+    std::uint32_t sample_rate = 0;
+
+    std::atomic<bool> failed { false };
+    pw_stream_state state = PW_STREAM_STATE_UNCONNECTED;
+
+    file_t event;
+
+    pw::thread_loop_t loop;
+    pw::context_t context;
+    pw::core_t core;
+    pw::stream_t stream;
+    spa_hook stream_listener {};
+  };
+
+  std::unique_ptr<mic_t>
+  microphone(const std::uint8_t *mapping, int channels, std::uint32_t sample_rate, std::uint32_t frame_size, const std::string &sink_name) {
+    auto mic = std::make_unique<mic_pw_t>();
+    if (mic->init(mapping, channels, sample_rate, frame_size, sink_name)) {
+      return nullptr;
+    }
+
+    return mic;
+  }
+}  // namespace platf::pipewire
@@ -0,0 +1,24 @@
+/**
+ * @file src/platform/linux/audio_pipewire.h
+ * @brief Native PipeWire capture of the monitor of a sink.
+ */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "src/platform/common.h"
+
+namespace platf::pipewire {
+  /**
+   * @brief Capture the monitor of a sink through a PipeWire stream of its own.
+   * @details The stream asks the graph for a quantum of `frame_size` samples and copies every
+   *          period from the realtime thread into a ring buffer, `sample()` hands it out as soon as a
+   *          full frame is available.
+   * @param sink_name Name of the sink to capture, the default sink if empty.
+   * @return nullptr if no PipeWire daemon is running or the stream couldn't be connected.
+   */
+  std::unique_ptr<mic_t>
+  microphone(const std::uint8_t *mapping, int channels, std::uint32_t sample_rate, std::uint32_t frame_size, const std::string &sink_name);
+}  // namespace platf::pipewire
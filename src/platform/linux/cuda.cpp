@@ -18,7 +18,11 @@ extern "C" {
 
 #include "cuda.h"
 #include "graphics.h"
+#include "src/config.h"
 #include "src/logging.h"
+#include "src/nvenc/nvenc_cuda.h"
+#include "src/nvenc/nvenc_utils.h"
+#include "src/trace.h"
 #include "src/utility.h"
 #include "src/video.h"
 #include "wayland.h"
@@ -86,6 +90,21 @@ namespace cuda {
     tex_t tex;
   };
 
+  /**
+   * @brief Let the conversion kernels composite the cursor that a capture kept apart from the frame.
+   */
+  static int
+  load_cursor(sws_t &sws, const platf::img_t &img, stream_t::pointer stream) {
+    auto ram = dynamic_cast<const egl::ram_img_t *>(&img);
+    if (!ram || !ram->cursor.data) {
+      sws.hide_cursor();
+      return 0;
+    }
+
+    auto &cursor = ram->cursor;
+    return sws.load_cursor(cursor.data, cursor.src_w, cursor.src_h, cursor.serial, cursor.x, cursor.y, cursor.width, cursor.height, stream);
+  }
+
   int
   init() {
     auto status = cuda_load_functions(&cdf, nullptr);
@@ -205,7 +224,8 @@ namespace cuda {
   public:
     int
     convert(platf::img_t &img) override {
-      return sws.load_ram(img, tex.array) || sws.convert(frame->data[0], frame->data[1], frame->linesize[0], frame->linesize[1], tex_obj(tex), stream.get());
+      return sws.load_ram(img, tex.array) || load_cursor(sws, img, stream.get()) ||
+             sws.convert(frame->data[0], frame->data[1], frame->linesize[0], frame->linesize[1], tex_obj(tex), stream.get());
     }
 
     int
@@ -282,10 +302,13 @@ namespace cuda {
     return -1;
   }
 
-  class gl_cuda_vram_t: public platf::avcodec_encode_device_t {
+  /**
+   * @brief Converts captured dmabufs in GL and copies the result into CUDA device memory.
+   */
+  class gl_cuda_t {
   public:
     /**
-     * @brief Initialize the GL->CUDA encoding device.
+     * @brief Initialize the EGL context the dmabufs are imported into.
      * @param in_width Width of captured frames.
      * @param in_height Height of captured frames.
      * @param offset_x Offset of content in captured frame.
@@ -294,9 +317,6 @@ namespace cuda {
      */
     int
     init(int in_width, int in_height, int offset_x, int offset_y) {
-      // This must be non-zero to tell the video core that it's a hardware encoding device.
-      data = (void *) 0x1;
-
       // TODO: Support more than one CUDA device
       file = std::move(open_drm_fd_for_cuda_device(0));
       if (file.el < 0) {
@@ -335,32 +355,26 @@ namespace cuda {
     }
 
     /**
-     * @brief Initialize color conversion into target CUDA frame.
-     * @param frame Destination CUDA frame to write into.
-     * @param hw_frames_ctx_buf FFmpeg hardware frame context.
+     * @brief Initialize color conversion into frames of the given size and format.
+     * @param out_width Width of the target frame.
+     * @param out_height Height of the target frame.
+     * @param format Pixel format of the target frame.
+     * @param stream Stream the copies into the target frame are queued on.
      * @return 0 on success or -1 on failure.
      */
     int
-    set_frame(AVFrame *frame, AVBufferRef *hw_frames_ctx_buf) override {
-      this->hwframe.reset(frame);
-      this->frame = frame;
+    init_output(int out_width, int out_height, AVPixelFormat format, cudaStream_t stream) {
+      sw_format = format;
+      this->out_width = out_width;
+      this->out_height = out_height;
+      this->stream = stream;
 
-      if (!frame->buf[0]) {
-        if (av_hwframe_get_buffer(hw_frames_ctx_buf, frame, 0)) {
-          BOOST_LOG(error) << "Couldn't get hwframe for VAAPI"sv;
-          return -1;
-        }
-      }
-
-      auto hw_frames_ctx = (AVHWFramesContext *) hw_frames_ctx_buf->data;
-      sw_format = hw_frames_ctx->sw_format;
-
-      auto nv12_opt = egl::create_target(frame->width, frame->height, sw_format);
+      auto nv12_opt = egl::create_target(out_width, out_height, sw_format);
       if (!nv12_opt) {
         return -1;
       }
 
-      auto sws_opt = egl::sws_t::make(width, height, frame->width, frame->height, sw_format);
+      auto sws_opt = egl::sws_t::make(width, height, out_width, out_height, sw_format);
       if (!sws_opt) {
         return -1;
       }
@@ -368,15 +382,6 @@ namespace cuda {
       this->sws = std::move(*sws_opt);
       this->nv12 = std::move(*nv12_opt);
 
-      auto cuda_ctx = (AVCUDADeviceContext *) hw_frames_ctx->device_ctx->hwctx;
-
-      stream = make_stream();
-      if (!stream) {
-        return -1;
-      }
-
-      cuda_ctx->stream = stream.get();
-
       CU_CHECK(cdf->cuGraphicsGLRegisterImage(&y_res, nv12->tex[0], GL_TEXTURE_2D, CU_GRAPHICS_REGISTER_FLAGS_READ_ONLY),
         "Couldn't register Y plane texture");
       CU_CHECK(cdf->cuGraphicsGLRegisterImage(&uv_res, nv12->tex[1], GL_TEXTURE_2D, CU_GRAPHICS_REGISTER_FLAGS_READ_ONLY),
@@ -386,41 +391,39 @@ namespace cuda {
     }
 
     /**
-     * @brief Convert the captured image into the target CUDA frame.
+     * @brief Convert the captured image into the target frame.
      * @param img Captured screen image.
+     * @param planes Device pointers of the luma and the chroma plane of the target frame.
+     * @param pitches Bytes per row of the planes.
      * @return 0 on success or -1 on failure.
      */
     int
-    convert(platf::img_t &img) override {
+    convert(platf::img_t &img, const std::array<CUdeviceptr, 2> &planes, const std::array<std::size_t, 2> &pitches) {
       auto &descriptor = (egl::img_descriptor_t &) img;
 
       if (descriptor.sequence == 0) {
         // For dummy images, use a blank RGB texture instead of importing a DMA-BUF
-        rgb = egl::create_blank(img);
+        blank = egl::create_blank(img);
+        rgb = &blank;
       }
       else if (descriptor.sequence > sequence) {
         sequence = descriptor.sequence;
 
-        rgb = egl::rgb_t {};
-
-        auto rgb_opt = egl::import_source(display.get(), descriptor.sd);
-
-        if (!rgb_opt) {
+        rgb = imports.import(display.get(), descriptor.sd);
+        if (!rgb) {
           return -1;
         }
-
-        rgb = std::move(*rgb_opt);
       }
 
       // Perform the color conversion and scaling in GL
-      sws.load_vram(descriptor, offset_x, offset_y, rgb->tex[0]);
-      sws.convert(nv12->buf);
+      sws.load_vram(descriptor, offset_x, offset_y, (*rgb)->tex[0]);
+      sws.convert(nv12);
 
       auto fmt_desc = av_pix_fmt_desc_get(sw_format);
 
       // Map the GL textures to read for CUDA
       CUgraphicsResource resources[2] = { y_res.get(), uv_res.get() };
-      CU_CHECK(cdf->cuGraphicsMapResources(2, resources, stream.get()), "Couldn't map GL textures in CUDA");
+      CU_CHECK(cdf->cuGraphicsMapResources(2, resources, stream), "Couldn't map GL textures in CUDA");
 
       // Copy from the GL textures to the target CUDA frame
       for (int i = 0; i < 2; i++) {
@@ -429,16 +432,16 @@ namespace cuda {
         CU_CHECK(cdf->cuGraphicsSubResourceGetMappedArray(&cpy.srcArray, resources[i], 0, 0), "Couldn't get mapped plane array");
 
         cpy.dstMemoryType = CU_MEMORYTYPE_DEVICE;
-        cpy.dstDevice = (CUdeviceptr) frame->data[i];
-        cpy.dstPitch = frame->linesize[i];
-        cpy.WidthInBytes = (frame->width * fmt_desc->comp[i].step) >> (i ? fmt_desc->log2_chroma_w : 0);
-        cpy.Height = frame->height >> (i ? fmt_desc->log2_chroma_h : 0);
+        cpy.dstDevice = planes[i];
+        cpy.dstPitch = pitches[i];
+        cpy.WidthInBytes = (out_width * fmt_desc->comp[i].step) >> (i ? fmt_desc->log2_chroma_w : 0);
+        cpy.Height = out_height >> (i ? fmt_desc->log2_chroma_h : 0);
 
-        CU_CHECK_IGNORE(cdf->cuMemcpy2DAsync(&cpy, stream.get()), "Couldn't copy texture to CUDA frame");
+        CU_CHECK_IGNORE(cdf->cuMemcpy2DAsync(&cpy, stream), "Couldn't copy texture to CUDA frame");
       }
 
       // Unmap the textures to allow modification from GL again
-      CU_CHECK(cdf->cuGraphicsUnmapResources(2, resources, stream.get()), "Couldn't unmap GL textures from CUDA");
+      CU_CHECK(cdf->cuGraphicsUnmapResources(2, resources, stream), "Couldn't unmap GL textures from CUDA");
       return 0;
     }
 
@@ -446,7 +449,7 @@ namespace cuda {
      * @brief Configures shader parameters for the specified colorspace.
      */
     void
-    apply_colorspace() override {
+    apply_colorspace(const video::sunshine_colorspace_t &colorspace) {
       sws.apply_colorspace(colorspace);
     }
 
@@ -455,23 +458,348 @@ namespace cuda {
     egl::display_t display;
     egl::ctx_t ctx;
 
-    // This must be destroyed before display_t
-    stream_t stream;
-    frame_t hwframe;
-
     egl::sws_t sws;
     egl::nv12_t nv12;
     AVPixelFormat sw_format;
 
     int width, height;
+    int out_width, out_height;
 
     std::uint64_t sequence;
-    egl::rgb_t rgb;
+    egl::import_cache_t imports;
+    egl::rgb_t blank;
+
+    // The surface of the latest frame, an entry of the cache or the blank texture
+    egl::rgb_t *rgb = nullptr;
 
     registered_resource_t y_res;
     registered_resource_t uv_res;
 
     int offset_x, offset_y;
+
+    cudaStream_t stream = nullptr;
+  };
+
+  class gl_cuda_vram_t: public platf::avcodec_encode_device_t {
+  public:
+    /**
+     * @brief Initialize the GL->CUDA encoding device.
+     * @param in_width Width of captured frames.
+     * @param in_height Height of captured frames.
+     * @param offset_x Offset of content in captured frame.
+     * @param offset_y Offset of content in captured frame.
+     * @return 0 on success or -1 on failure.
+     */
+    int
+    init(int in_width, int in_height, int offset_x, int offset_y) {
+      // This must be non-zero to tell the video core that it's a hardware encoding device.
+      data = (void *) 0x1;
+
+      return gl.init(in_width, in_height, offset_x, offset_y);
+    }
+
+    /**
+     * @brief Initialize color conversion into target CUDA frame.
+     * @param frame Destination CUDA frame to write into.
+     * @param hw_frames_ctx_buf FFmpeg hardware frame context.
+     * @return 0 on success or -1 on failure.
+     */
+    int
+    set_frame(AVFrame *frame, AVBufferRef *hw_frames_ctx_buf) override {
+      this->hwframe.reset(frame);
+      this->frame = frame;
+
+      if (!frame->buf[0]) {
+        if (av_hwframe_get_buffer(hw_frames_ctx_buf, frame, 0)) {
+          BOOST_LOG(error) << "Couldn't get hwframe for VAAPI"sv;
+          return -1;
+        }
+      }
+
+      auto hw_frames_ctx = (AVHWFramesContext *) hw_frames_ctx_buf->data;
+      auto cuda_ctx = (AVCUDADeviceContext *) hw_frames_ctx->device_ctx->hwctx;
+
+      stream = make_stream();
+      if (!stream) {
+        return -1;
+      }
+
+      cuda_ctx->stream = stream.get();
+
+      return gl.init_output(frame->width, frame->height, hw_frames_ctx->sw_format, stream.get());
+    }
+
+    /**
+     * @brief Convert the captured image into the target CUDA frame.
+     * @param img Captured screen image.
+     * @return 0 on success or -1 on failure.
+     */
+    int
+    convert(platf::img_t &img) override {
+      return gl.convert(img, { (CUdeviceptr) frame->data[0], (CUdeviceptr) frame->data[1] }, { (std::size_t) frame->linesize[0], (std::size_t) frame->linesize[1] });
+    }
+
+    /**
+     * @brief Configures shader parameters for the specified colorspace.
+     */
+    void
+    apply_colorspace() override {
+      gl.apply_colorspace(colorspace);
+    }
+
+    gl_cuda_t gl;
+
+    // This must be destroyed before the display of gl_cuda_t
+    stream_t stream;
+    frame_t hwframe;
+  };
+
+  /**
+   * @brief The CUDA device and the stream a native NVENC encoder and the conversion in front of it share.
+   */
+  class nvenc_context_t {
+  public:
+    ~nvenc_context_t() {
+      // The encoder goes before the stream and the context it uses
+      nvenc.reset();
+      stream.reset();
+
+      if (context) {
+        CU_CHECK_IGNORE(cdf->cuDevicePrimaryCtxRelease(device), "Couldn't release the primary CUDA context");
+      }
+    }
+
+    int
+    init() {
+      // TODO: Support more than one CUDA device
+      CU_CHECK(cdf->cuDeviceGet(&device, 0), "Couldn't get CUDA device");
+
+      // The runtime API of the conversion kernels runs on the primary context as well
+      CU_CHECK(cdf->cuDevicePrimaryCtxRetain(&context, device), "Couldn't retain the primary CUDA context");
+
+      // Conversions don't serialize with work on the legacy default stream, such as other sessions' uploads
+      stream = make_stream(CU_STREAM_NON_BLOCKING);
+      if (!stream) {
+        return -1;
+      }
+
+      nvenc = std::make_unique<nvenc::nvenc_cuda>(cdf.get(), context, stream.get());
+      return 0;
+    }
+
+    /**
+     * @return Device pointers of the luma and the first chroma plane of the input buffer of the encoder.
+     */
+    std::array<CUdeviceptr, 2>
+    planes() const {
+      auto buffer = nvenc->get_input_buffer();
+      return { buffer, buffer + nvenc->get_input_pitch() * height };
+    }
+
+    CUdevice device;
+    CUcontext context = nullptr;
+    stream_t stream;
+    std::unique_ptr<nvenc::nvenc_cuda> nvenc;
+
+    // Height of the encoded frames, the chroma planes follow that many rows of luma
+    int height = 0;
+  };
+
+  /**
+   * @brief Converts captured frames with the CUDA kernels straight into the input buffer of NVENC.
+   */
+  class cuda_nvenc_t: public platf::nvenc_encode_device_t {
+  public:
+    int
+    init(int in_width, int in_height, bool vram, platf::pix_fmt_e pix_fmt) {
+      switch (pix_fmt) {
+        case platf::pix_fmt_e::nv12:
+          sws_format = sws_format_e::nv12;
+          break;
+        case platf::pix_fmt_e::p010:
+          sws_format = sws_format_e::p010;
+          break;
+        case platf::pix_fmt_e::yuv444p:
+          sws_format = sws_format_e::yuv444;
+          break;
+        case platf::pix_fmt_e::yuv444p16:
+          sws_format = sws_format_e::yuv444p16;
+          break;
+        default:
+          BOOST_LOG(error) << "Unexpected pixel format for NvENC ["sv << platf::from_pix_fmt(pix_fmt) << ']';
+          return -1;
+      }
+      buffer_format = nvenc::nvenc_format_from_sunshine_format(pix_fmt);
+
+      if (ctx.init()) {
+        return -1;
+      }
+
+      width = in_width;
+      height = in_height;
+      this->vram = vram;
+
+      if (!vram) {
+        auto tex_opt = tex_t::make(height, width * 4);
+        if (!tex_opt) {
+          return -1;
+        }
+
+        tex = std::move(*tex_opt);
+      }
+
+      nvenc = ctx.nvenc.get();
+      return 0;
+    }
+
+    bool
+    init_encoder(const ::video::config_t &client_config, const ::video::sunshine_colorspace_t &colorspace) override {
+      auto nvenc_colorspace = nvenc::nvenc_colorspace_from_sunshine_colorspace(colorspace);
+      if (!ctx.nvenc->create_encoder(config::video.nv, client_config, nvenc_colorspace, buffer_format)) {
+        return false;
+      }
+
+      ctx.height = client_config.height;
+      pitch = ctx.nvenc->get_input_pitch();
+
+      auto sws_opt = sws_t::make(width, height, client_config.width, client_config.height, width * 4, sws_format);
+      if (!sws_opt) {
+        return false;
+      }
+
+      sws = std::move(*sws_opt);
+      sws.apply_colorspace(colorspace);
+
+      linear_interpolation = width != client_config.width || height != client_config.height;
+
+      return clear_input(client_config.width, client_config.height) == 0;
+    }
+
+    int
+    convert(platf::img_t &img) override {
+      auto planes = ctx.planes();
+      auto Y = (std::uint8_t *) planes[0];
+      auto UV = (std::uint8_t *) planes[1];
+
+      if (vram) {
+        return sws.convert(Y, UV, pitch, pitch, tex_obj(((img_t *) &img)->tex), ctx.stream.get());
+      }
+
+      return sws.load_ram(img, tex.array, ctx.stream.get()) || load_cursor(sws, img, ctx.stream.get()) ||
+             sws.convert(Y, UV, pitch, pitch, tex_obj(tex), ctx.stream.get());
+    }
+
+  private:
+    /**
+     * @brief Paint the whole input buffer black, the viewport of the conversion leaves the letterbox untouched.
+     */
+    int
+    clear_input(int out_width, int out_height) {
+      auto blank = tex_t::make(height, width * 4);
+      if (!blank) {
+        return -1;
+      }
+
+      platf::img_t img;
+      img.width = width;
+      img.height = height;
+      img.pixel_pitch = 4;
+      img.row_pitch = img.width * img.pixel_pitch;
+
+      std::vector<std::uint8_t> image_data;
+      image_data.resize(img.row_pitch * img.height);
+
+      img.data = image_data.data();
+
+      if (sws.load_ram(img, blank->array, ctx.stream.get())) {
+        return -1;
+      }
+
+      auto planes = ctx.planes();
+      if (sws.convert((std::uint8_t *) planes[0], (std::uint8_t *) planes[1], pitch, pitch, blank->texture.linear, ctx.stream.get(), { out_width, out_height, 0, 0 })) {
+        return -1;
+      }
+
+      // The blank texture goes out of scope here
+      CU_CHECK(cdf->cuStreamSynchronize(ctx.stream.get()), "Couldn't synchronize the CUDA stream");
+      return 0;
+    }
+
+    cudaTextureObject_t
+    tex_obj(const tex_t &tex) const {
+      return linear_interpolation ? tex.texture.linear : tex.texture.point;
+    }
+
+    nvenc_context_t ctx;
+
+    int width, height;
+    bool vram;
+    std::uint32_t pitch = 0;
+
+    sws_format_e sws_format;
+    NV_ENC_BUFFER_FORMAT buffer_format;
+
+    // When height and width don't change, it's not necessary to use linear interpolation
+    bool linear_interpolation;
+
+    sws_t sws;
+
+    // Captured frames in system memory are uploaded here first
+    tex_t tex;
+  };
+
+  /**
+   * @brief Converts captured dmabufs in GL and copies them straight into the input buffer of NVENC.
+   */
+  class gl_cuda_nvenc_t: public platf::nvenc_encode_device_t {
+  public:
+    int
+    init(int in_width, int in_height, int offset_x, int offset_y, platf::pix_fmt_e pix_fmt) {
+      sw_format = pix_fmt == platf::pix_fmt_e::p010 ? AV_PIX_FMT_P010 : AV_PIX_FMT_NV12;
+      buffer_format = nvenc::nvenc_format_from_sunshine_format(pix_fmt);
+      if (pix_fmt != platf::pix_fmt_e::nv12 && pix_fmt != platf::pix_fmt_e::p010) {
+        BOOST_LOG(error) << "Unexpected pixel format for NvENC ["sv << platf::from_pix_fmt(pix_fmt) << ']';
+        return -1;
+      }
+
+      if (gl.init(in_width, in_height, offset_x, offset_y) || ctx.init()) {
+        return -1;
+      }
+
+      nvenc = ctx.nvenc.get();
+      return 0;
+    }
+
+    bool
+    init_encoder(const ::video::config_t &client_config, const ::video::sunshine_colorspace_t &colorspace) override {
+      auto nvenc_colorspace = nvenc::nvenc_colorspace_from_sunshine_colorspace(colorspace);
+      if (!ctx.nvenc->create_encoder(config::video.nv, client_config, nvenc_colorspace, buffer_format)) {
+        return false;
+      }
+
+      ctx.height = client_config.height;
+      if (gl.init_output(client_config.width, client_config.height, sw_format, ctx.stream.get())) {
+        return false;
+      }
+
+      gl.apply_colorspace(colorspace);
+      return true;
+    }
+
+    int
+    convert(platf::img_t &img) override {
+      auto pitch = ctx.nvenc->get_input_pitch();
+      return gl.convert(img, ctx.planes(), { pitch, pitch });
+    }
+
+  private:
+    gl_cuda_t gl;
+
+    // This must be destroyed before the display of gl_cuda_t
+    nvenc_context_t ctx;
+
+    AVPixelFormat sw_format;
+    NV_ENC_BUFFER_FORMAT buffer_format;
   };
 
   std::unique_ptr<platf::avcodec_encode_device_t>
@@ -519,6 +847,36 @@ namespace cuda {
     return cuda;
   }
 
+  std::unique_ptr<platf::nvenc_encode_device_t>
+  make_nvenc_encode_device(int width, int height, bool vram, platf::pix_fmt_e pix_fmt) {
+    if (init()) {
+      return nullptr;
+    }
+
+    auto cuda = std::make_unique<cuda_nvenc_t>();
+
+    if (cuda->init(width, height, vram, pix_fmt)) {
+      return nullptr;
+    }
+
+    return cuda;
+  }
+
+  std::unique_ptr<platf::nvenc_encode_device_t>
+  make_nvenc_gl_encode_device(int width, int height, int offset_x, int offset_y, platf::pix_fmt_e pix_fmt) {
+    if (init()) {
+      return nullptr;
+    }
+
+    auto cuda = std::make_unique<gl_cuda_nvenc_t>();
+
+    if (cuda->init(width, height, offset_x, offset_y, pix_fmt)) {
+      return nullptr;
+    }
+
+    return cuda;
+  }
+
   namespace nvfbc {
     static PNVFBCCREATEINSTANCE createInstance {};
     static NVFBC_API_FUNCTION_LIST func { NVFBC_VERSION };
@@ -898,6 +1256,7 @@ namespace cuda {
 
       platf::capture_e
       snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+        TRACE_SCOPE("capture.snapshot");
         if (cursor != cursor_visible) {
           auto status = reinit(cursor);
           if (status != platf::capture_e::ok) {
@@ -908,9 +1267,10 @@ namespace cuda {
         CUdeviceptr device_ptr;
         NVFBC_FRAME_GRAB_INFO info;
 
+        // Waits for a new frame up to the timeout, unless one is ready already
         NVFBC_TOCUDA_GRAB_FRAME_PARAMS grab {
           NVFBC_TOCUDA_GRAB_FRAME_PARAMS_VER,
-          NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT,
+          NVFBC_TOCUDA_GRAB_FLAGS_NOWAIT_IF_NEW_FRAME_READY,
           &device_ptr,
           &info,
           (std::uint32_t) timeout.count(),
@@ -925,6 +1285,24 @@ namespace cuda {
           return platf::capture_e::error;
         }
 
+        // The grab timed out with the previous frame
+        if (!info.bIsNewFrame) {
+          return platf::capture_e::timeout;
+        }
+
+        // The CUDA interface of NvFBC has no difference map, the frame is compared on the GPU instead
+        // Once it couldn't be made, the frames are passed on whole
+        if (!diff_map && !diff_map_failed) {
+          diff_map = diff_map_t::make(width, height);
+          diff_map_failed = !diff_map;
+        }
+
+        int changed_tiles = diff_map ? diff_map->update((std::uint8_t *) device_ptr, width * 4) : -1;
+        if (changed_tiles == 0) {
+          // A new frame of the display server with identical content, nothing to encode
+          return platf::capture_e::timeout;
+        }
+
         if (!pull_free_image_cb(img_out)) {
           return platf::capture_e::interrupted;
         }
@@ -934,14 +1312,65 @@ namespace cuda {
           return platf::capture_e::error;
         }
 
+        // The first frame has nothing to differ from
+        if (changed_tiles < 0 || !capture_sequence) {
+          img->damage = std::nullopt;
+        }
+        else {
+          update_damage(*img);
+        }
+        img->capture_sequence = ++capture_sequence;
+
         return platf::capture_e::ok;
       }
 
+      /**
+       * @brief Turn the changed tiles of the difference map into the damage of the image, a rectangle per run of tiles in a row.
+       */
+      void
+      update_damage(platf::img_t &img) {
+        constexpr int tile_size = diff_map_t::tile_size;
+
+        if (img.damage) {
+          img.damage->clear();
+        }
+        else {
+          img.damage.emplace();
+        }
+
+        for (int y = 0; y < diff_map->tiles_y; ++y) {
+          auto row = &diff_map->tiles[y * diff_map->tiles_x];
+
+          for (int x = 0; x < diff_map->tiles_x; ++x) {
+            if (!row[x]) {
+              continue;
+            }
+
+            auto first = x;
+            while (x + 1 < diff_map->tiles_x && row[x + 1]) {
+              ++x;
+            }
+
+            img.damage->emplace_back(platf::rect_t {
+              first * tile_size,
+              y * tile_size,
+              std::min((x + 1) * tile_size, width),
+              std::min((y + 1) * tile_size, height),
+            });
+          }
+        }
+      }
+
       std::unique_ptr<platf::avcodec_encode_device_t>
       make_avcodec_encode_device(platf::pix_fmt_e pix_fmt) {
         return ::cuda::make_avcodec_encode_device(width, height, true);
       }
 
+      std::unique_ptr<platf::nvenc_encode_device_t>
+      make_nvenc_encode_device(platf::pix_fmt_e pix_fmt) override {
+        return ::cuda::make_nvenc_encode_device(width, height, true, pix_fmt);
+      }
+
       std::shared_ptr<platf::img_t>
       alloc_img() override {
         auto img = std::make_shared<cuda::img_t>();
@@ -972,6 +1401,11 @@ namespace cuda {
       handle_t handle;
 
       NVFBC_CREATE_CAPTURE_SESSION_PARAMS capture_params;
+
+      // Created on the capture thread, in its CUDA context
+      std::optional<diff_map_t> diff_map;
+      bool diff_map_failed = false;
+      std::uint64_t capture_sequence = 0;
     };
   }  // namespace nvfbc
 }  // namespace cuda
@@ -148,10 +148,110 @@ inline __device__ float calcY(float3 pixel, const cuda_color_t *const color_matr
   return (dot(pixel, make_float3(vec_y)) + vec_y.w) * color_matrix->range_y.x + color_matrix->range_y.y;
 }
 
-__global__ void RGBA_to_NV12(
+// 245.0f is a magic number to ensure slight changes in luminosity are more visible
+constexpr float Y_SCALE  = 245.0f;
+constexpr float UV_SCALE = 256.0f;
+
+/**
+ * Frames scaled down to less than half their size average four bilinear taps spread over
+ * the footprint of the output pixel, a single tap would skip source pixels and thin lines and text alias.
+ */
+inline __device__ float3 sample(cudaTextureObject_t srcImage, float x, float y, float scale) {
+  if(scale <= 2.0f) {
+    return bgra_to_rgb(tex2D<float4>(srcImage, x, y));
+  }
+
+  float d = scale * 0.25f;
+
+  float3 rgb = bgra_to_rgb(tex2D<float4>(srcImage, x - d, y - d));
+  rgb += bgra_to_rgb(tex2D<float4>(srcImage, x + d, y - d));
+  rgb += bgra_to_rgb(tex2D<float4>(srcImage, x - d, y + d));
+  rgb += bgra_to_rgb(tex2D<float4>(srcImage, x + d, y + d));
+
+  return rgb * 0.25f;
+}
+
+/**
+ * Blend the premultiplied cursor over the pixel at x, y of the captured image.
+ */
+inline __device__ float3 blend_cursor(float3 rgb, float x, float y, cudaTextureObject_t cursorImage, const cursor_rect_t &cursor) {
+  x -= cursor.x;
+  y -= cursor.y;
+
+  if(x < 0.0f || y < 0.0f || x >= cursor.width || y >= cursor.height) {
+    return rgb;
+  }
+
+  float4 overlay = tex2D<float4>(cursorImage, x * cursor.scale_x, y * cursor.scale_y);
+  return bgra_to_rgb(overlay) + rgb * (1.0f - overlay.w);
+}
+
+/**
+ * 8-bit samples are stored as they are, 10-bit ones in the high bits of 16-bit words.
+ * The 10-bit range is four times the 8-bit one, so both depths come out equally bright.
+ */
+template<class T>
+inline __device__ T pack(float value, float scale) {
+  constexpr bool wide = sizeof(T) > 1;
+
+  value = fminf(fmaxf(value * scale * (wide ? 4.0f : 1.0f), 0.0f), wide ? 1023.0f : 255.0f);
+
+  return (T)((unsigned int)value << (wide ? 6 : 0));
+}
+
+/**
+ * Scale, convert and pack into a luma plane followed by an interleaved chroma plane at half resolution,
+ * NV12 for 8-bit samples and P010 for 16-bit ones. Every thread writes a block of 2x2 pixels.
+ */
+template<class T>
+__global__ void RGBA_to_420(
   cudaTextureObject_t srcImage, std::uint8_t *dstY, std::uint8_t *dstUV,
   std::uint32_t dstPitchY, std::uint32_t dstPitchUV,
-  float scale, const viewport_t viewport, const cuda_color_t *const color_matrix) {
+  float scale, const viewport_t viewport, const cuda_color_t *const color_matrix,
+  cudaTextureObject_t cursorImage, const cursor_rect_t cursor) {
+
+  int idX = (threadIdx.x + blockDim.x * blockIdx.x) * 2;
+  int idY = (threadIdx.y + blockDim.y * blockIdx.y) * 2;
+
+  if(idX >= viewport.width) return;
+  if(idY >= viewport.height) return;
+
+  // Centers of the output pixels in the source
+  float x = (idX + 0.5f) * scale;
+  float y = (idY + 0.5f) * scale;
+
+  idX += viewport.offsetX;
+  idY += viewport.offsetY;
+
+  T *dstY0  = (T *)(dstY + idY * dstPitchY) + idX;
+  T *dstY1  = (T *)(dstY + (idY + 1) * dstPitchY) + idX;
+  T *dstUV0 = (T *)(dstUV + idY / 2 * dstPitchUV) + idX;
+
+  float3 rgb_lt = blend_cursor(sample(srcImage, x, y, scale), x, y, cursorImage, cursor);
+  float3 rgb_rt = blend_cursor(sample(srcImage, x + scale, y, scale), x + scale, y, cursorImage, cursor);
+  float3 rgb_lb = blend_cursor(sample(srcImage, x, y + scale, scale), x, y + scale, cursorImage, cursor);
+  float3 rgb_rb = blend_cursor(sample(srcImage, x + scale, y + scale, scale), x + scale, y + scale, cursorImage, cursor);
+
+  float2 uv = (calcUV(rgb_lt, color_matrix) + calcUV(rgb_rt, color_matrix) + calcUV(rgb_lb, color_matrix) + calcUV(rgb_rb, color_matrix)) * 0.25f;
+
+  dstUV0[0] = pack<T>(uv.x, UV_SCALE);
+  dstUV0[1] = pack<T>(uv.y, UV_SCALE);
+  dstY0[0]  = pack<T>(calcY(rgb_lt, color_matrix), Y_SCALE);
+  dstY0[1]  = pack<T>(calcY(rgb_rt, color_matrix), Y_SCALE);
+  dstY1[0]  = pack<T>(calcY(rgb_lb, color_matrix), Y_SCALE);
+  dstY1[1]  = pack<T>(calcY(rgb_rb, color_matrix), Y_SCALE);
+}
+
+/**
+ * Scale, convert and pack into three planes at full resolution, 8-bit or 16-bit samples.
+ * Every thread writes a block of 2x2 pixels, as with 4:2:0, so both share the launch configuration.
+ */
+template<class T>
+__global__ void RGBA_to_444(
+  cudaTextureObject_t srcImage, std::uint8_t *dstY, std::uint8_t *dstU, std::uint8_t *dstV,
+  std::uint32_t dstPitchY, std::uint32_t dstPitchUV,
+  float scale, const viewport_t viewport, const cuda_color_t *const color_matrix,
+  cudaTextureObject_t cursorImage, const cursor_rect_t cursor) {
 
   int idX = (threadIdx.x + blockDim.x * blockIdx.x) * 2;
   int idY = (threadIdx.y + blockDim.y * blockIdx.y) * 2;
@@ -159,34 +259,103 @@ __global__ void RGBA_to_NV12(
   if(idX >= viewport.width) return;
   if(idY >= viewport.height) return;
 
-  float x = idX * scale;
-  float y = idY * scale;
+  float x = (idX + 0.5f) * scale;
+  float y = (idY + 0.5f) * scale;
 
   idX += viewport.offsetX;
   idY += viewport.offsetY;
 
-  uint8_t *dstY0  = dstY + idX + idY * dstPitchY;
-  uint8_t *dstY1  = dstY + idX + (idY + 1) * dstPitchY;
-  dstUV = dstUV + idX + (idY / 2 * dstPitchUV);
+  for(int row = 0; row < 2; ++row) {
+    T *rowY = (T *)(dstY + (idY + row) * dstPitchY) + idX;
+    T *rowU = (T *)(dstU + (idY + row) * dstPitchUV) + idX;
+    T *rowV = (T *)(dstV + (idY + row) * dstPitchUV) + idX;
+
+    for(int col = 0; col < 2; ++col) {
+      float sx   = x + col * scale;
+      float sy   = y + row * scale;
+      float3 rgb = blend_cursor(sample(srcImage, sx, sy, scale), sx, sy, cursorImage, cursor);
+      float2 uv  = calcUV(rgb, color_matrix);
+
+      rowY[col] = pack<T>(calcY(rgb, color_matrix), Y_SCALE);
+      rowU[col] = pack<T>(uv.x, UV_SCALE);
+      rowV[col] = pack<T>(uv.y, UV_SCALE);
+    }
+  }
+}
+
+/**
+ * One block per tile, every thread compares a column of the tile and takes the changed pixels into the last frame.
+ */
+__global__ void diff_tiles(const std::uint32_t *src, int src_pitch, std::uint32_t *last, int width, int height, std::uint8_t *tiles) {
+  int x      = blockIdx.x * diff_map_t::tile_size + threadIdx.x;
+  int top    = blockIdx.y * diff_map_t::tile_size;
+  int bottom = min(top + diff_map_t::tile_size, height);
+
+  int changed = 0;
+  if(x < width) {
+    for(int y = top + threadIdx.y; y < bottom; y += blockDim.y) {
+      auto pixel = src[y * src_pitch + x];
+      auto &old  = last[y * width + x];
+
+      if(pixel != old) {
+        old     = pixel;
+        changed = 1;
+      }
+    }
+  }
+
+  changed = __syncthreads_or(changed);
+  if(threadIdx.x == 0 && threadIdx.y == 0) {
+    tiles[blockIdx.y * gridDim.x + blockIdx.x] = changed;
+  }
+}
+
+std::optional<diff_map_t> diff_map_t::make(int width, int height) {
+  diff_map_t diff_map;
+
+  diff_map.width   = width;
+  diff_map.height  = height;
+  diff_map.tiles_x = div_align(width, tile_size);
+  diff_map.tiles_y = div_align(height, tile_size);
+  diff_map.tiles.resize(diff_map.tiles_x * diff_map.tiles_y);
+
+  void *p;
+  CU_CHECK_OPT(cudaMalloc(&p, (std::size_t)width * height * 4), "Couldn't allocate the last frame of the difference map");
+  diff_map.last_frame.reset(p);
+
+  // The kernel only takes the pixels that differ, the first frame is compared with zeros
+  CU_CHECK_OPT(cudaMemset(p, 0, (std::size_t)width * height * 4), "Couldn't clear the last frame of the difference map");
 
-  float3 rgb_lt = bgra_to_rgb(tex2D<float4>(srcImage, x, y));
-  float3 rgb_rt = bgra_to_rgb(tex2D<float4>(srcImage, x + scale, y));
-  float3 rgb_lb = bgra_to_rgb(tex2D<float4>(srcImage, x, y + scale));
-  float3 rgb_rb = bgra_to_rgb(tex2D<float4>(srcImage, x + scale, y + scale));
+  CU_CHECK_OPT(cudaMalloc(&p, diff_map.tiles.size()), "Couldn't allocate the difference map");
+  diff_map.device_tiles.reset(p);
 
-  float2 uv_lt = calcUV(rgb_lt, color_matrix) * 256.0f;
-  float2 uv_rt = calcUV(rgb_rt, color_matrix) * 256.0f;
-  float2 uv_lb = calcUV(rgb_lb, color_matrix) * 256.0f;
-  float2 uv_rb = calcUV(rgb_rb, color_matrix) * 256.0f;
+  return diff_map;
+}
+
+int diff_map_t::update(const std::uint8_t *src, int pitch) {
+  dim3 block(tile_size, 4);
+  dim3 grid(tiles_x, tiles_y);
+
+  diff_tiles<<<grid, block>>>((const std::uint32_t *)src, pitch / 4, (std::uint32_t *)last_frame.get(), width, height, (std::uint8_t *)device_tiles.get());
+  CU_CHECK(cudaGetLastError(), "Difference map kernel failed");
+
+  // Waits for the kernel, the map is a byte per tile
+  CU_CHECK(cudaMemcpy(tiles.data(), device_tiles.get(), tiles.size(), cudaMemcpyDeviceToHost), "Couldn't copy the difference map");
+
+  // A black first frame matches the zeros, it's still all new
+  if(!initialized) {
+    initialized = true;
+    tiles.assign(tiles.size(), 1);
 
-  float2 uv = (uv_lt + uv_lb + uv_rt + uv_rb) * 0.25f;
+    return (int)tiles.size();
+  }
+
+  int changed = 0;
+  for(auto tile : tiles) {
+    changed += tile != 0;
+  }
 
-  dstUV[0] = uv.x;
-  dstUV[1] = uv.y;
-  dstY0[0]  = calcY(rgb_lt, color_matrix) * 245.0f; // 245.0f is a magic number to ensure slight changes in luminosity are more visible
-  dstY0[1]  = calcY(rgb_rt, color_matrix) * 245.0f; // 245.0f is a magic number to ensure slight changes in luminosity are more visible
-  dstY1[0]  = calcY(rgb_lb, color_matrix) * 245.0f; // 245.0f is a magic number to ensure slight changes in luminosity are more visible
-  dstY1[1]  = calcY(rgb_rb, color_matrix) * 245.0f; // 245.0f is a magic number to ensure slight changes in luminosity are more visible
+  return changed;
 }
 
 int tex_t::copy(std::uint8_t *src, int height, int pitch) {
@@ -256,8 +425,8 @@ tex_t::~tex_t() {
   }
 }
 
-sws_t::sws_t(int in_width, int in_height, int out_width, int out_height, int pitch, int threadsPerBlock, ptr_t &&color_matrix)
-    : threadsPerBlock { threadsPerBlock }, color_matrix { std::move(color_matrix) } {
+sws_t::sws_t(int in_width, int in_height, int out_width, int out_height, int pitch, int threadsPerBlock, ptr_t &&color_matrix, sws_format_e format)
+    : threadsPerBlock { threadsPerBlock }, color_matrix { std::move(color_matrix) }, format { format }, frame_height { out_height } {
   // Ensure aspect ratio is maintained
   auto scalar       = std::fminf(out_width / (float)in_width, out_height / (float)in_height);
   auto out_width_f  = in_width * scalar;
@@ -276,7 +445,7 @@ sws_t::sws_t(int in_width, int in_height, int out_width, int out_height, int pit
   scale = 1.0f / scalar;
 }
 
-std::optional<sws_t> sws_t::make(int in_width, int in_height, int out_width, int out_height, int pitch) {
+std::optional<sws_t> sws_t::make(int in_width, int in_height, int out_width, int out_height, int pitch, sws_format_e format) {
   cudaDeviceProp props;
   int device;
   CU_CHECK_OPT(cudaGetDevice(&device), "Couldn't get cuda device");
@@ -287,7 +456,7 @@ std::optional<sws_t> sws_t::make(int in_width, int in_height, int out_width, int
     return std::nullopt;
   }
 
-  return std::make_optional<sws_t>(in_width, in_height, out_width, out_height, pitch, props.maxThreadsPerMultiProcessor / props.maxBlocksPerMultiProcessor, std::move(ptr));
+  return std::make_optional<sws_t>(in_width, in_height, out_width, out_height, pitch, props.maxThreadsPerMultiProcessor / props.maxBlocksPerMultiProcessor, std::move(ptr), format);
 }
 
 int sws_t::convert(std::uint8_t *Y, std::uint8_t *UV, std::uint32_t pitchY, std::uint32_t pitchUV, cudaTextureObject_t texture, stream_t::pointer stream) {
@@ -301,9 +470,56 @@ int sws_t::convert(std::uint8_t *Y, std::uint8_t *UV, std::uint32_t pitchY, std:
   dim3 block(threadsPerBlock);
   dim3 grid(div_align(threadsX, threadsPerBlock), threadsY);
 
-  RGBA_to_NV12<<<grid, block, 0, stream>>>(texture, Y, UV, pitchY, pitchUV, scale, viewport, (cuda_color_t *)color_matrix.get());
+  auto color = (cuda_color_t *)color_matrix.get();
+
+  // The cursor texture is never sampled while the cursor is hidden
+  switch(format) {
+  case sws_format_e::nv12:
+    RGBA_to_420<std::uint8_t><<<grid, block, 0, stream>>>(texture, Y, UV, pitchY, pitchUV, scale, viewport, color, cursor_tex.texture.linear, cursor);
+    break;
+  case sws_format_e::p010:
+    RGBA_to_420<std::uint16_t><<<grid, block, 0, stream>>>(texture, Y, UV, pitchY, pitchUV, scale, viewport, color, cursor_tex.texture.linear, cursor);
+    break;
+  case sws_format_e::yuv444:
+    RGBA_to_444<std::uint8_t><<<grid, block, 0, stream>>>(texture, Y, UV, UV + pitchUV * frame_height, pitchY, pitchUV, scale, viewport, color, cursor_tex.texture.linear, cursor);
+    break;
+  case sws_format_e::yuv444p16:
+    RGBA_to_444<std::uint16_t><<<grid, block, 0, stream>>>(texture, Y, UV, UV + pitchUV * frame_height, pitchY, pitchUV, scale, viewport, color, cursor_tex.texture.linear, cursor);
+    break;
+  }
+
+  return CU_CHECK_IGNORE(cudaGetLastError(), "RGBA conversion kernel failed");
+}
+
+int sws_t::load_cursor(const std::uint8_t *pixels, int src_width, int src_height, std::uint64_t serial, int x, int y, int width, int height, stream_t::pointer stream) {
+  if(!pixels || width <= 0 || height <= 0) {
+    hide_cursor();
+    return 0;
+  }
+
+  if(!cursor_tex.array || serial != cursor_serial) {
+    if(src_width != cursor_tex_width || src_height != cursor_tex_height) {
+      auto tex_opt = tex_t::make(src_height, src_width * 4);
+      if(!tex_opt) {
+        return -1;
+      }
+
+      cursor_tex        = std::move(*tex_opt);
+      cursor_tex_width  = src_width;
+      cursor_tex_height = src_height;
+    }
+
+    CU_CHECK(cudaMemcpy2DToArrayAsync(cursor_tex.array, 0, 0, pixels, src_width * 4, src_width * 4, src_height, cudaMemcpyHostToDevice, stream), "Couldn't copy cursor to cuda array");
+    cursor_serial = serial;
+  }
+
+  cursor = { (float)x, (float)y, (float)width, (float)height, src_width / (float)width, src_height / (float)height };
+  return 0;
+}
 
-  return CU_CHECK_IGNORE(cudaGetLastError(), "RGBA_to_NV12 failed");
+void sws_t::hide_cursor() {
+  cursor.width  = 0;
+  cursor.height = 0;
 }
 
 void sws_t::apply_colorspace(const video::sunshine_colorspace_t& colorspace) {
@@ -311,8 +527,9 @@ void sws_t::apply_colorspace(const video::sunshine_colorspace_t& colorspace) {
   CU_CHECK_IGNORE(cudaMemcpy(color_matrix.get(), color_p, sizeof(video::color_t), cudaMemcpyHostToDevice), "Couldn't copy color matrix to cuda");
 }
 
-int sws_t::load_ram(platf::img_t &img, cudaArray_t array) {
-  return CU_CHECK_IGNORE(cudaMemcpy2DToArray(array, 0, 0, img.data, img.row_pitch, img.width * img.pixel_pitch, img.height, cudaMemcpyHostToDevice), "Couldn't copy to cuda array");
+int sws_t::load_ram(platf::img_t &img, cudaArray_t array, stream_t::pointer stream) {
+  // Ordered on the stream of the conversion, which doesn't wait for the default stream when it's non-blocking
+  return CU_CHECK_IGNORE(cudaMemcpy2DToArrayAsync(array, 0, 0, img.data, img.row_pitch, img.width * img.pixel_pitch, img.height, cudaMemcpyHostToDevice, stream), "Couldn't copy to cuda array");
 }
 
 } // namespace cuda
@@ -16,7 +16,9 @@
 
 namespace platf {
   class avcodec_encode_device_t;
+  struct nvenc_encode_device_t;
   class img_t;
+  enum class pix_fmt_e;
 }  // namespace platf
 
 namespace cuda {
@@ -39,6 +41,29 @@ namespace cuda {
   std::unique_ptr<platf::avcodec_encode_device_t>
   make_avcodec_gl_encode_device(int width, int height, int offset_x, int offset_y);
 
+  /**
+   * @brief Create a CUDA encoding device that converts captured frames straight into the input of NVENC.
+   * @param width Width of captured frames.
+   * @param height Height of captured frames.
+   * @param vram Whether the captured frames are in CUDA memory already, as with NvFBC.
+   * @param pix_fmt Pixel format of the encoder input: NV12, P010 or one of the 4:4:4 formats.
+   * @return Native NVENC encoding device.
+   */
+  std::unique_ptr<platf::nvenc_encode_device_t>
+  make_nvenc_encode_device(int width, int height, bool vram, platf::pix_fmt_e pix_fmt);
+
+  /**
+   * @brief Create a GL->CUDA encoding device for consuming captured dmabufs with native NVENC.
+   * @param width Width of captured frames.
+   * @param height Height of captured frames.
+   * @param offset_x Offset of content in captured frame.
+   * @param offset_y Offset of content in captured frame.
+   * @param pix_fmt Pixel format of the encoder input, the GL conversion only writes NV12 and P010.
+   * @return Native NVENC encoding device.
+   */
+  std::unique_ptr<platf::nvenc_encode_device_t>
+  make_nvenc_gl_encode_device(int width, int height, int offset_x, int offset_y, platf::pix_fmt_e pix_fmt);
+
   int
   init();
 }  // namespace cuda
@@ -102,21 +127,78 @@ namespace cuda {
     } texture;
   };
 
+  /**
+   * @brief Where the cursor lands on the captured image, in pixels, and its texels per pixel. A width of 0 hides it.
+   */
+  struct cursor_rect_t {
+    float x, y;
+    float width, height;
+    float scale_x, scale_y;
+  };
+
+  /**
+   * @brief Layout written by the conversion kernels.
+   */
+  enum class sws_format_e {
+    nv12,  ///< 8-bit luma plane followed by the interleaved chroma plane at half resolution
+    p010,  ///< As NV12, with 10-bit samples in the high bits of 16-bit words
+    yuv444,  ///< Three 8-bit planes at full resolution
+    yuv444p16,  ///< Three planes of 10-bit samples in the high bits of 16-bit words
+  };
+
+  /**
+   * @brief Compares the captured frames in video memory with the previous one in tiles, a difference map of its own
+   *        for the capture interfaces that don't generate one.
+   */
+  class diff_map_t {
+  public:
+    static constexpr int tile_size = 64;
+
+    static std::optional<diff_map_t>
+    make(int width, int height);
+
+    /**
+     * Marks the tiles of the frame that differ from the previous one, the frame is kept for the next comparison.
+     *
+     * src -- The BGRA frame in video memory, width x height
+     * pitch -- The size of a single row of the frame in bytes
+     *
+     * Returns -1 on error, otherwise the number of tiles that changed. `tiles` then holds
+     * a nonzero byte for every tile that changed, row by row. Every tile of the first frame changed.
+     */
+    int
+    update(const std::uint8_t *src, int pitch);
+
+    int width, height;
+    int tiles_x, tiles_y;
+
+    // The previous frame, tightly packed
+    ptr_t last_frame;
+    ptr_t device_tiles;
+
+    // Set by the first update, until then the last frame is only zeros
+    bool initialized = false;
+
+    std::vector<std::uint8_t> tiles;
+  };
+
   class sws_t {
   public:
     sws_t() = default;
-    sws_t(int in_width, int in_height, int out_width, int out_height, int pitch, int threadsPerBlock, ptr_t &&color_matrix);
+    sws_t(int in_width, int in_height, int out_width, int out_height, int pitch, int threadsPerBlock, ptr_t &&color_matrix, sws_format_e format);
 
     /**
      * in_width, in_height -- The width and height of the captured image in pixels
-     * out_width, out_height -- the width and height of the NV12 image in pixels
+     * out_width, out_height -- the width and height of the output image in pixels
      *
      * pitch -- The size of a single row of pixels in bytes
+     * format -- The layout of the output image
      */
     static std::optional<sws_t>
-    make(int in_width, int in_height, int out_width, int out_height, int pitch);
+    make(int in_width, int in_height, int out_width, int out_height, int pitch, sws_format_e format = sws_format_e::nv12);
 
-    // Converts loaded image into a CUDevicePtr
+    // Scales, converts and packs the loaded image into a CUDevicePtr in a single pass.
+    // For the 4:4:4 formats UV is the U plane, the V plane follows it after out_height rows of pitchUV.
     int
     convert(std::uint8_t *Y, std::uint8_t *UV, std::uint32_t pitchY, std::uint32_t pitchUV, cudaTextureObject_t texture, stream_t::pointer stream);
     int
@@ -126,7 +208,19 @@ namespace cuda {
     apply_colorspace(const video::sunshine_colorspace_t &colorspace);
 
     int
-    load_ram(platf::img_t &img, cudaArray_t array);
+    load_ram(platf::img_t &img, cudaArray_t array, stream_t::pointer stream = nullptr);
+
+    /**
+     * Composites the cursor in the following conversions, its texture is only uploaded when the serial changes.
+     *
+     * pixels -- The premultiplied BGRA image of the cursor, src_width x src_height
+     * x, y, width, height -- Where the cursor lands on the captured image in pixels
+     */
+    int
+    load_cursor(const std::uint8_t *pixels, int src_width, int src_height, std::uint64_t serial, int x, int y, int width, int height, stream_t::pointer stream);
+
+    void
+    hide_cursor();
 
     ptr_t color_matrix;
 
@@ -135,6 +229,16 @@ namespace cuda {
     viewport_t viewport;
 
     float scale;
+
+    sws_format_e format;
+
+    // Rows of every plane of the output image
+    int frame_height;
+
+    tex_t cursor_tex;
+    int cursor_tex_width = 0, cursor_tex_height = 0;
+    std::uint64_t cursor_serial = 0;
+    cursor_rect_t cursor {};
   };
 }  // namespace cuda
 
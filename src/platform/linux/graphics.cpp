@@ -7,7 +7,10 @@
 #include "src/logging.h"
 #include "src/video.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 extern "C" {
 #include <libavutil/pixdesc.h>
@@ -214,6 +217,30 @@ namespace gl {
     return program;
   }
 
+  util::Either<program_t, std::string>
+  program_t::link(const shader_t &comp) {
+    program_t program;
+
+    program._program.el = ctx.CreateProgram();
+
+    ctx.AttachShader(program.handle(), comp.handle());
+
+    auto fg = util::fail_guard([p_handle = program.handle(), &comp]() {
+      ctx.DetachShader(p_handle, comp.handle());
+    });
+
+    ctx.LinkProgram(program.handle());
+
+    int status = 0;
+    ctx.GetProgramiv(program.handle(), GL_LINK_STATUS, &status);
+
+    if (!status) {
+      return program.err_str();
+    }
+
+    return program;
+  }
+
   void
   program_t::bind(const buffer_t &buffer) {
     ctx.UseProgram(handle());
@@ -572,6 +599,95 @@ namespace egl {
     return rgb;
   }
 
+  std::vector<std::uint64_t>
+  query_modifiers(display_t::pointer egl_display, std::uint32_t fourcc) {
+    using query_dma_buf_modifiers_fn = EGLBoolean (*)(EGLDisplay, EGLint, EGLint, std::uint64_t *, EGLBoolean *, EGLint *);
+
+    // Part of EGL_EXT_image_dma_buf_import_modifiers, which make_display() requires
+    static auto query_dma_buf_modifiers = (query_dma_buf_modifiers_fn) eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+    if (!query_dma_buf_modifiers) {
+      return {};
+    }
+
+    EGLint count = 0;
+    if (!query_dma_buf_modifiers(egl_display, fourcc, 0, nullptr, nullptr, &count) || count <= 0) {
+      return {};
+    }
+
+    std::vector<std::uint64_t> modifiers(count);
+    std::vector<EGLBoolean> external_only(count);
+    if (!query_dma_buf_modifiers(egl_display, fourcc, count, modifiers.data(), external_only.data(), &count)) {
+      BOOST_LOG(warning) << "Couldn't query the DMA-BUF modifiers: "sv << util::hex(eglGetError()).to_string_view();
+      return {};
+    }
+    modifiers.resize(count);
+
+    // Those can only be sampled as GL_TEXTURE_EXTERNAL_OES, the conversion shaders sample GL_TEXTURE_2D
+    for (EGLint x = count - 1; x >= 0; --x) {
+      if (external_only[x]) {
+        modifiers.erase(std::begin(modifiers) + x);
+      }
+    }
+
+    return modifiers;
+  }
+
+  rgb_t *
+  import_cache_t::import(display_t::pointer egl_display, const surface_descriptor_t &sd) {
+    // Triple buffering with one to spare
+    constexpr std::size_t MAX_ENTRIES = 4;
+
+    // Frames since an entry was last used before the framebuffer counts as gone
+    constexpr std::uint64_t MAX_IDLE = 16;
+
+    import_key_t key { sd.fb_id, sd.fourcc, sd.modifier, sd.width, sd.height };
+    for (int x = 0; x < 4; ++x) {
+      if (sd.fds[x] < 0) {
+        continue;
+      }
+
+      // Every frame gets new descriptors of the same DMA-BUFs, the inode identifies the buffer
+      struct stat st;
+      if (fstat(sd.fds[x], &st)) {
+        BOOST_LOG(error) << "Couldn't stat DMA-BUF: "sv << strerror(errno);
+        return nullptr;
+      }
+
+      key.inodes[x] = st.st_ino;
+      key.pitches[x] = sd.pitches[x];
+      key.offsets[x] = sd.offsets[x];
+    }
+
+    ++imports;
+    std::erase_if(entries, [&](const entry_t &entry) {
+      // The ID of a removed framebuffer may be reused for new buffers right away
+      return imports - entry.last_use > MAX_IDLE || (key.fb_id && entry.key.fb_id == key.fb_id && entry.key != key);
+    });
+
+    auto it = std::find_if(std::begin(entries), std::end(entries), [&](const entry_t &entry) {
+      return entry.key == key;
+    });
+
+    if (it == std::end(entries)) {
+      auto rgb_opt = import_source(egl_display, sd);
+      if (!rgb_opt) {
+        return nullptr;
+      }
+
+      if (entries.size() >= MAX_ENTRIES) {
+        entries.erase(std::min_element(std::begin(entries), std::end(entries), [](const entry_t &l, const entry_t &r) {
+          return l.last_use < r.last_use;
+        }));
+      }
+
+      entries.push_back({ key, std::move(*rgb_opt), 0 });
+      it = std::prev(std::end(entries));
+    }
+
+    it->last_use = imports;
+    return &it->rgb;
+  }
+
   /**
    * @brief Creates a black RGB texture of the specified image size.
    * @param img The image to use for texture sizing.
@@ -730,8 +846,9 @@ namespace egl {
 
     color_matrix.update(members, sizeof(members) / sizeof(decltype(members[0])));
 
-    program[0].bind(color_matrix);
-    program[1].bind(color_matrix);
+    for (int x = 0; x < program_count; ++x) {
+      program[x].bind(color_matrix);
+    }
   }
 
   std::optional<sws_t>
@@ -766,7 +883,6 @@ namespace egl {
         SUNSHINE_SHADERS_DIR "/ConvertUV.vert",
         SUNSHINE_SHADERS_DIR "/ConvertY.frag",
         SUNSHINE_SHADERS_DIR "/Scene.vert",
-        SUNSHINE_SHADERS_DIR "/Scene.frag",
       };
 
       GLenum shader_type[2] {
@@ -795,16 +911,7 @@ namespace egl {
         return std::nullopt;
       }
 
-      auto program = gl::program_t::link(compiled_sources[3].left(), compiled_sources[4].left());
-      if (program.has_right()) {
-        BOOST_LOG(error) << "GL linker: "sv << program.right();
-        return std::nullopt;
-      }
-
-      // Cursor - shader
-      sws.program[2] = std::move(program.left());
-
-      program = gl::program_t::link(compiled_sources[1].left(), compiled_sources[0].left());
+      auto program = gl::program_t::link(compiled_sources[1].left(), compiled_sources[0].left());
       if (program.has_right()) {
         BOOST_LOG(error) << "GL linker: "sv << program.right();
         return std::nullopt;
@@ -823,6 +930,36 @@ namespace egl {
       sws.program[0] = std::move(program.left());
     }
 
+    // GL 4.3 guarantees compute shaders and image stores to R8, RG8, R16 and RG16
+    sws.program_count = 2;
+    if (gl::ctx.VERSION_4_3) {
+      const char *source = SUNSHINE_SHADERS_DIR "/ConvertNV12.comp";
+
+      auto compiled_source = gl::shader_t::compile(file_handler::read_file(source), GL_COMPUTE_SHADER);
+      gl_drain_errors;
+
+      if (compiled_source.has_right()) {
+        BOOST_LOG(warning) << source << ": "sv << compiled_source.right();
+      }
+      else {
+        auto program = gl::program_t::link(compiled_source.left());
+        if (program.has_right()) {
+          BOOST_LOG(warning) << "GL linker: "sv << program.right();
+        }
+        else {
+          sws.program[2] = std::move(program.left());
+          sws.loc_dest_rect = gl::ctx.GetUniformLocation(sws.program[2].handle(), "dest_rect");
+          if (sws.loc_dest_rect >= 0) {
+            sws.program_count = 3;
+          }
+        }
+      }
+
+      if (sws.program_count < 3) {
+        BOOST_LOG(info) << "Falling back to fragment shaders for the color conversion"sv;
+      }
+    }
+
     auto loc_width_i = gl::ctx.GetUniformLocation(sws.program[1].handle(), "width_i");
     if (loc_width_i < 0) {
       BOOST_LOG(error) << "Couldn't find uniform [width_i]"sv;
@@ -832,6 +969,19 @@ namespace egl {
     gl::ctx.UseProgram(sws.program[1].handle());
     gl::ctx.Uniform1fv(loc_width_i, 1, &width_i);
 
+    for (int x = 0; x < sws.program_count; ++x) {
+      sws.loc_cursor_rect[x] = gl::ctx.GetUniformLocation(sws.program[x].handle(), "cursor_rect");
+      auto loc_cursor = gl::ctx.GetUniformLocation(sws.program[x].handle(), "cursor");
+      if (sws.loc_cursor_rect[x] < 0 || loc_cursor < 0) {
+        BOOST_LOG(error) << "Couldn't find uniform [cursor_rect] or [cursor]"sv;
+        return std::nullopt;
+      }
+
+      // The cursor is sampled from the second texture unit
+      gl::ctx.UseProgram(sws.program[x].handle());
+      gl::ctx.Uniform1i(loc_cursor, 1);
+    }
+
     auto color_p = video::color_vectors_from_colorspace(video::colorspace_e::rec601, false);
     std::pair<const char *, std::string_view> members[] {
       std::make_pair("color_vec_y", util::view(color_p->color_vec_y)),
@@ -849,14 +999,11 @@ namespace egl {
     sws.color_matrix = std::move(*color_matrix);
 
     sws.tex = std::move(tex);
+    sws.load_cursor(cursor_t {});
 
-    sws.cursor_framebuffer = gl::frame_buf_t::make(1);
-    sws.cursor_framebuffer.bind(&sws.tex[0], &sws.tex[1]);
-
-    sws.program[0].bind(sws.color_matrix);
-    sws.program[1].bind(sws.color_matrix);
-
-    gl::ctx.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    for (int x = 0; x < sws.program_count; ++x) {
+      sws.program[x].bind(sws.color_matrix);
+    }
 
     gl_drain_errors;
 
@@ -864,7 +1011,7 @@ namespace egl {
   }
 
   int
-  sws_t::blank(gl::frame_buf_t &fb, int offsetX, int offsetY, int width, int height) {
+  sws_t::blank(nv12_t &target, int offsetX, int offsetY, int width, int height) {
     auto f = [&]() {
       std::swap(offsetX, this->offsetX);
       std::swap(offsetY, this->offsetY);
@@ -875,7 +1022,7 @@ namespace egl {
     f();
     auto fg = util::fail_guard(f);
 
-    return convert(fb);
+    return convert(target);
   }
 
   std::optional<sws_t>
@@ -915,6 +1062,13 @@ namespace egl {
 
   void
   sws_t::load_ram(platf::img_t &img) {
+    if (auto ram = dynamic_cast<ram_img_t *>(&img)) {
+      load_cursor(ram->cursor);
+    }
+    else {
+      load_cursor(cursor_t {});
+    }
+
     loaded_texture = tex[0];
 
     gl::ctx.BindTexture(GL_TEXTURE_2D, loaded_texture);
@@ -936,79 +1090,92 @@ namespace egl {
       loaded_texture = texture;
     }
 
-    if (img.data) {
-      GLenum attachment = GL_COLOR_ATTACHMENT0;
+    // The data of the descriptor is the cursor, the conversion composites it
+    load_cursor(img, offset_x, offset_y);
+  }
 
-      gl::ctx.BindFramebuffer(GL_FRAMEBUFFER, cursor_framebuffer[0]);
-      gl::ctx.UseProgram(program[2].handle());
+  void
+  sws_t::load_cursor(const cursor_t &cursor, int offset_x, int offset_y) {
+    // Beyond the image, so no pixel of it samples the cursor
+    float rect[] { 2.0f, 2.0f, 1.0f, 1.0f };
 
-      // When a copy has already been made...
-      if (!copy) {
-        gl::ctx.BindTexture(GL_TEXTURE_2D, texture);
-        gl::ctx.DrawBuffers(1, &attachment);
+    if (cursor.data && cursor.width > 0 && cursor.height > 0) {
+      if (serial != cursor.serial) {
+        serial = cursor.serial;
 
-        gl::ctx.Viewport(0, 0, in_width, in_height);
-        gl::ctx.DrawArrays(GL_TRIANGLES, 0, 3);
-
-        loaded_texture = tex[0];
+        gl::ctx.BindTexture(GL_TEXTURE_2D, tex[1]);
+        gl::ctx.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, cursor.src_w, cursor.src_h, 0, GL_BGRA, GL_UNSIGNED_BYTE, cursor.data);
+        gl::ctx.BindTexture(GL_TEXTURE_2D, 0);
       }
 
-      gl::ctx.BindTexture(GL_TEXTURE_2D, tex[1]);
-      if (serial != img.serial) {
-        serial = img.serial;
-
-        gl::ctx.TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, img.src_w, img.src_h, 0, GL_BGRA, GL_UNSIGNED_BYTE, img.data);
-      }
+      rect[0] = (cursor.x - offset_x) / (float) in_width;
+      rect[1] = (cursor.y - offset_y) / (float) in_height;
+      rect[2] = in_width / (float) cursor.width;
+      rect[3] = in_height / (float) cursor.height;
+    }
 
-      gl::ctx.Enable(GL_BLEND);
+    for (int x = 0; x < program_count; ++x) {
+      gl::ctx.UseProgram(program[x].handle());
+      gl::ctx.Uniform4fv(loc_cursor_rect[x], 1, rect);
+    }
+  }
 
-      gl::ctx.DrawBuffers(1, &attachment);
+  int
+  sws_t::convert(nv12_t &target) {
+    GLint depth = 0;
+    if (program_count == 3) {
+      // The planes are bound as images of the format they were created or imported with
+      gl::ctx.BindTexture(GL_TEXTURE_2D, target->tex[0]);
+      gl::ctx.GetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_RED_SIZE, &depth);
+    }
 
-#ifndef NDEBUG
-      auto status = gl::ctx.CheckFramebufferStatus(GL_FRAMEBUFFER);
-      if (status != GL_FRAMEBUFFER_COMPLETE) {
-        BOOST_LOG(error) << "Pass Cursor: CheckFramebufferStatus() --> [0x"sv << util::hex(status).to_string_view() << ']';
-        return;
-      }
-#endif
+    gl::ctx.ActiveTexture(GL_TEXTURE1);
+    gl::ctx.BindTexture(GL_TEXTURE_2D, tex[1]);
+    gl::ctx.ActiveTexture(GL_TEXTURE0);
+    gl::ctx.BindTexture(GL_TEXTURE_2D, loaded_texture);
 
-      gl::ctx.Viewport(img.x, img.y, img.width, img.height);
-      gl::ctx.DrawArrays(GL_TRIANGLES, 0, 3);
+    if (program_count == 3) {
+      gl::ctx.BindImageTexture(0, target->tex[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, depth > 8 ? GL_R16 : GL_R8);
+      gl::ctx.BindImageTexture(1, target->tex[1], 0, GL_FALSE, 0, GL_WRITE_ONLY, depth > 8 ? GL_RG16 : GL_RG8);
 
-      gl::ctx.Disable(GL_BLEND);
+      // Each invocation converts a 2x2 block, in work groups of 8x8 invocations
+      gl::ctx.UseProgram(program[2].handle());
+      gl::ctx.Uniform4i(loc_dest_rect, offsetX, offsetY, out_width, out_height);
+      gl::ctx.DispatchCompute((out_width + 15) / 16, (out_height + 15) / 16, 1);
 
-      gl::ctx.BindTexture(GL_TEXTURE_2D, 0);
-      gl::ctx.BindFramebuffer(GL_FRAMEBUFFER, 0);
+      // The planes are read by the encoder, outside of the image accesses of GL
+      gl::ctx.MemoryBarrier(GL_ALL_BARRIER_BITS);
     }
-  }
-
-  int
-  sws_t::convert(gl::frame_buf_t &fb) {
-    gl::ctx.BindTexture(GL_TEXTURE_2D, loaded_texture);
+    else {
+      auto &fb = target->buf;
 
-    GLenum attachments[] {
-      GL_COLOR_ATTACHMENT0,
-      GL_COLOR_ATTACHMENT1
-    };
+      GLenum attachments[] {
+        GL_COLOR_ATTACHMENT0,
+        GL_COLOR_ATTACHMENT1
+      };
 
-    for (int x = 0; x < sizeof(attachments) / sizeof(decltype(attachments[0])); ++x) {
-      gl::ctx.BindFramebuffer(GL_FRAMEBUFFER, fb[x]);
-      gl::ctx.DrawBuffers(1, &attachments[x]);
+      for (int x = 0; x < sizeof(attachments) / sizeof(decltype(attachments[0])); ++x) {
+        gl::ctx.BindFramebuffer(GL_FRAMEBUFFER, fb[x]);
+        gl::ctx.DrawBuffers(1, &attachments[x]);
 
 #ifndef NDEBUG
-      auto status = gl::ctx.CheckFramebufferStatus(GL_FRAMEBUFFER);
-      if (status != GL_FRAMEBUFFER_COMPLETE) {
-        BOOST_LOG(error) << "Pass "sv << x << ": CheckFramebufferStatus() --> [0x"sv << util::hex(status).to_string_view() << ']';
-        return -1;
-      }
+        auto status = gl::ctx.CheckFramebufferStatus(GL_FRAMEBUFFER);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+          BOOST_LOG(error) << "Pass "sv << x << ": CheckFramebufferStatus() --> [0x"sv << util::hex(status).to_string_view() << ']';
+          return -1;
+        }
 #endif
 
-      gl::ctx.UseProgram(program[x].handle());
-      gl::ctx.Viewport(offsetX / (x + 1), offsetY / (x + 1), out_width / (x + 1), out_height / (x + 1));
-      gl::ctx.DrawArrays(GL_TRIANGLES, 0, 3);
+        gl::ctx.UseProgram(program[x].handle());
+        gl::ctx.Viewport(offsetX / (x + 1), offsetY / (x + 1), out_width / (x + 1), out_height / (x + 1));
+        gl::ctx.DrawArrays(GL_TRIANGLES, 0, 3);
+      }
     }
 
     gl::ctx.BindTexture(GL_TEXTURE_2D, 0);
+    gl::ctx.ActiveTexture(GL_TEXTURE1);
+    gl::ctx.BindTexture(GL_TEXTURE_2D, 0);
+    gl::ctx.ActiveTexture(GL_TEXTURE0);
 
     gl::ctx.Flush();
 
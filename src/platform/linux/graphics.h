@@ -4,8 +4,10 @@
  */
 #pragma once
 
+#include <array>
 #include <optional>
 #include <string_view>
+#include <vector>
 
 #include <glad/egl.h>
 #include <glad/gl.h>
@@ -170,6 +172,8 @@ namespace gl {
 
     static util::Either<program_t, std::string>
     link(const shader_t &vert, const shader_t &frag);
+    static util::Either<program_t, std::string>
+    link(const shader_t &comp);
 
     void
     bind(const buffer_t &buffer);
@@ -256,6 +260,9 @@ namespace egl {
     std::uint64_t modifier;
     std::uint32_t pitches[4];
     std::uint32_t offsets[4];
+
+    // DRM framebuffer the planes belong to, 0 when they don't come from KMS
+    std::uint32_t fb_id = 0;
   };
 
   display_t
@@ -268,9 +275,61 @@ namespace egl {
     display_t::pointer egl_display,
     const surface_descriptor_t &xrgb);
 
+  /**
+   * @brief The modifiers of DMA-BUFs in the format that the display can import as a texture.
+   * @return Empty if the display doesn't list any, only the implicit modifier can be relied on then.
+   */
+  std::vector<std::uint64_t>
+  query_modifiers(display_t::pointer egl_display, std::uint32_t fourcc);
+
   rgb_t
   create_blank(platf::img_t &img);
 
+  /**
+   * @brief Keeps the imports of the few DMA-BUFs a capture cycles through.
+   * @details KMS usually flips between two or three scanout buffers, so past the first frames
+   *          every frame is one of a handful of images that are imported already. Entries are keyed by
+   *          the framebuffer, its layout and the identity of its DMA-BUFs rather than the descriptors,
+   *          which are duplicated for every frame. A framebuffer that isn't captured for a while
+   *          is gone or out of rotation, its import is dropped.
+   */
+  class import_cache_t {
+  public:
+    /**
+     * @return The imported surface or nullptr on failure, it stays valid until the next call.
+     */
+    rgb_t *
+    import(display_t::pointer egl_display, const surface_descriptor_t &sd);
+
+    void
+    clear() {
+      entries.clear();
+    }
+
+  private:
+    struct import_key_t {
+      std::uint32_t fb_id;
+      std::uint32_t fourcc;
+      std::uint64_t modifier;
+      int width, height;
+      std::array<std::uint64_t, 4> inodes;
+      std::array<std::uint32_t, 4> pitches;
+      std::array<std::uint32_t, 4> offsets;
+
+      bool
+      operator==(const import_key_t &) const = default;
+    };
+
+    struct entry_t {
+      import_key_t key;
+      rgb_t rgb;
+      std::uint64_t last_use;
+    };
+
+    std::vector<entry_t> entries;
+    std::uint64_t imports = 0;
+  };
+
   std::optional<nv12_t>
   import_target(
     display_t::pointer egl_display,
@@ -321,6 +380,17 @@ namespace egl {
     std::uint64_t sequence;
   };
 
+  /**
+   * @brief A frame in system memory with the cursor kept apart from it.
+   * @details Captures hand these to encode devices that composite the cursor on the GPU during the color
+   *          conversion, rather than blending it into the frame on the CPU. The data of the cursor is nullptr
+   *          while it's hidden, its position is relative to the frame.
+   */
+  class ram_img_t: public platf::img_t {
+  public:
+    cursor_t cursor;
+  };
+
   class sws_t {
   public:
     static std::optional<sws_t>
@@ -328,34 +398,56 @@ namespace egl {
     static std::optional<sws_t>
     make(int in_width, int in_height, int out_width, int out_height, AVPixelFormat format);
 
-    // Convert the loaded image into the first two framebuffers
+    /**
+     * @brief Convert the loaded image into the Y and the UV plane of the target.
+     * @details With compute shaders, a single dispatch reads the image once and writes both planes,
+     *          otherwise a fragment shader pass renders each of them.
+     */
     int
-    convert(gl::frame_buf_t &fb);
+    convert(nv12_t &target);
 
     // Make an area of the image black
     int
-    blank(gl::frame_buf_t &fb, int offsetX, int offsetY, int width, int height);
+    blank(nv12_t &target, int offsetX, int offsetY, int width, int height);
 
+    // Frames from a ram_img_t composite its cursor, others hide it
     void
     load_ram(platf::img_t &img);
     void
     load_vram(img_descriptor_t &img, int offset_x, int offset_y, int texture);
 
+    /**
+     * @brief Composite the cursor in the following conversions.
+     * @details The texture is only uploaded again when the serial of the cursor changes.
+     * @param cursor The cursor, hidden if its data is nullptr.
+     * @param offset_x Offset of the converted part of the image, the cursor position is relative to the whole image.
+     * @param offset_y Offset of the converted part of the image.
+     */
+    void
+    load_cursor(const cursor_t &cursor, int offset_x = 0, int offset_y = 0);
+
     void
     apply_colorspace(const video::sunshine_colorspace_t &colorspace);
 
     // The first texture is the monitor image.
-    // The second texture is the cursor image
+    // The second texture is the cursor image, the conversion shaders composite it
     gl::tex_t tex;
 
-    // The cursor image will be blended into this framebuffer
-    gl::frame_buf_t cursor_framebuffer;
     gl::frame_buf_t copy_framebuffer;
 
-    // Y - shader, UV - shader, Cursor - shader
+    // Y - shader, UV - shader, Y and UV compute shader
     gl::program_t program[3];
     gl::buffer_t color_matrix;
 
+    // 3 if the compute shader is supported, the fragment shaders are used otherwise
+    int program_count;
+
+    // Location of cursor_rect in each of the programs
+    GLint loc_cursor_rect[3];
+
+    // Location of dest_rect in the compute shader
+    GLint loc_dest_rect;
+
     int out_width, out_height;
     int in_width, in_height;
     int offsetX, offsetY;
@@ -363,7 +455,7 @@ namespace egl {
     // Pointer to the texture to be converted to nv12
     int loaded_texture;
 
-    // Store latest cursor for load_vram
+    // Serial of the cursor in the second texture
     std::uint64_t serial;
   };
 
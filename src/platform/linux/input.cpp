@@ -0,0 +1,464 @@
+/**
+ * @file src/platform/linux/input.cpp
+ * @brief Injects input through virtual uinput devices.
+ */
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <libevdev/libevdev-uinput.h>
+#include <libevdev/libevdev.h>
+
+#include "src/logging.h"
+#include "src/platform/common.h"
+#include "src/utility.h"
+
+using namespace std::literals;
+
+namespace platf {
+  namespace {
+    using evdev_t = util::safe_ptr<libevdev, libevdev_free>;
+    using uinput_t = util::safe_ptr<libevdev_uinput, libevdev_uinput_destroy>;
+
+    // Logical range of the absolute pointer, positions are scaled from the desktop to it
+    constexpr int ABS_RANGE = 32767;
+
+    // Wheel movement in 1/120 of a notch per notch
+    constexpr int WHEEL_DELTA = 120;
+
+    struct input_raw_t {
+      uinput_t mouse_rel;
+      uinput_t mouse_abs;
+      uinput_t keyboard;
+      std::array<uinput_t, MAX_GAMEPADS> gamepads;
+
+      // High resolution wheel movement that didn't add up to a notch yet
+      int scroll_residual = 0;
+      int hscroll_residual = 0;
+    };
+
+    /**
+     * @brief Windows virtual key codes to evdev key codes, 0 for keys that aren't injected.
+     */
+    constexpr std::array<std::uint16_t, 256>
+    make_keycodes() {
+      std::array<std::uint16_t, 256> keycodes {};
+
+      keycodes[0x08] = KEY_BACKSPACE;
+      keycodes[0x09] = KEY_TAB;
+      keycodes[0x0D] = KEY_ENTER;
+      keycodes[0x10] = KEY_LEFTSHIFT;
+      keycodes[0x11] = KEY_LEFTCTRL;
+      keycodes[0x12] = KEY_LEFTALT;
+      keycodes[0x13] = KEY_PAUSE;
+      keycodes[0x14] = KEY_CAPSLOCK;
+      keycodes[0x1B] = KEY_ESC;
+      keycodes[0x20] = KEY_SPACE;
+      keycodes[0x21] = KEY_PAGEUP;
+      keycodes[0x22] = KEY_PAGEDOWN;
+      keycodes[0x23] = KEY_END;
+      keycodes[0x24] = KEY_HOME;
+      keycodes[0x25] = KEY_LEFT;
+      keycodes[0x26] = KEY_UP;
+      keycodes[0x27] = KEY_RIGHT;
+      keycodes[0x28] = KEY_DOWN;
+      keycodes[0x2C] = KEY_SYSRQ;
+      keycodes[0x2D] = KEY_INSERT;
+      keycodes[0x2E] = KEY_DELETE;
+
+      constexpr std::uint16_t digits[] { KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9 };
+      for (int x = 0; x < 10; ++x) {
+        keycodes[0x30 + x] = digits[x];
+      }
+
+      constexpr std::uint16_t letters[] {
+        KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J, KEY_K, KEY_L, KEY_M,
+        KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
+      };
+      for (int x = 0; x < 26; ++x) {
+        keycodes[0x41 + x] = letters[x];
+      }
+
+      keycodes[0x5B] = KEY_LEFTMETA;
+      keycodes[0x5C] = KEY_RIGHTMETA;
+      keycodes[0x5D] = KEY_COMPOSE;
+
+      constexpr std::uint16_t keypad[] { KEY_KP0, KEY_KP1, KEY_KP2, KEY_KP3, KEY_KP4, KEY_KP5, KEY_KP6, KEY_KP7, KEY_KP8, KEY_KP9 };
+      for (int x = 0; x < 10; ++x) {
+        keycodes[0x60 + x] = keypad[x];
+      }
+      keycodes[0x6A] = KEY_KPASTERISK;
+      keycodes[0x6B] = KEY_KPPLUS;
+      keycodes[0x6C] = KEY_KPCOMMA;
+      keycodes[0x6D] = KEY_KPMINUS;
+      keycodes[0x6E] = KEY_KPDOT;
+      keycodes[0x6F] = KEY_KPSLASH;
+
+      constexpr std::uint16_t functions[] { KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6, KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12 };
+      for (int x = 0; x < 12; ++x) {
+        keycodes[0x70 + x] = functions[x];
+      }
+      for (int x = 0; x < 12; ++x) {
+        keycodes[0x7C + x] = KEY_F13 + x;
+      }
+
+      keycodes[0x90] = KEY_NUMLOCK;
+      keycodes[0x91] = KEY_SCROLLLOCK;
+      keycodes[0xA0] = KEY_LEFTSHIFT;
+      keycodes[0xA1] = KEY_RIGHTSHIFT;
+      keycodes[0xA2] = KEY_LEFTCTRL;
+      keycodes[0xA3] = KEY_RIGHTCTRL;
+      keycodes[0xA4] = KEY_LEFTALT;
+      keycodes[0xA5] = KEY_RIGHTALT;
+      keycodes[0xAD] = KEY_MUTE;
+      keycodes[0xAE] = KEY_VOLUMEDOWN;
+      keycodes[0xAF] = KEY_VOLUMEUP;
+      keycodes[0xB0] = KEY_NEXTSONG;
+      keycodes[0xB1] = KEY_PREVIOUSSONG;
+      keycodes[0xB2] = KEY_STOPCD;
+      keycodes[0xB3] = KEY_PLAYPAUSE;
+      keycodes[0xBA] = KEY_SEMICOLON;
+      keycodes[0xBB] = KEY_EQUAL;
+      keycodes[0xBC] = KEY_COMMA;
+      keycodes[0xBD] = KEY_MINUS;
+      keycodes[0xBE] = KEY_DOT;
+      keycodes[0xBF] = KEY_SLASH;
+      keycodes[0xC0] = KEY_GRAVE;
+      keycodes[0xDB] = KEY_LEFTBRACE;
+      keycodes[0xDC] = KEY_BACKSLASH;
+      keycodes[0xDD] = KEY_RIGHTBRACE;
+      keycodes[0xDE] = KEY_APOSTROPHE;
+      keycodes[0xE2] = KEY_102ND;
+
+      return keycodes;
+    }
+
+    constexpr auto KEYCODES = make_keycodes();
+
+    uinput_t
+    create(libevdev *dev, const char *name) {
+      libevdev_uinput *uidev;
+      auto err = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidev);
+      if (err) {
+        BOOST_LOG(error) << "Couldn't create the "sv << name << ": "sv << strerror(-err);
+        return nullptr;
+      }
+
+      return uinput_t { uidev };
+    }
+
+    evdev_t
+    make_device(const char *name, int vendor, int product, int bustype) {
+      evdev_t dev { libevdev_new() };
+      libevdev_set_name(dev.get(), name);
+      libevdev_set_id_vendor(dev.get(), vendor);
+      libevdev_set_id_product(dev.get(), product);
+      libevdev_set_id_bustype(dev.get(), bustype);
+      libevdev_set_id_version(dev.get(), 0x0111);
+      return dev;
+    }
+
+    void
+    enable_mouse_buttons(libevdev *dev) {
+      libevdev_enable_event_type(dev, EV_KEY);
+      for (auto button : { BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, BTN_SIDE, BTN_EXTRA }) {
+        libevdev_enable_event_code(dev, EV_KEY, button, nullptr);
+      }
+    }
+
+    uinput_t
+    make_mouse_rel() {
+      auto dev = make_device("Sunshine Mouse (relative)", 0xBEEF, 0xDEAD, BUS_USB);
+      enable_mouse_buttons(dev.get());
+
+      libevdev_enable_event_type(dev.get(), EV_REL);
+      for (auto axis : { REL_X, REL_Y, REL_WHEEL, REL_HWHEEL, REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES }) {
+        libevdev_enable_event_code(dev.get(), EV_REL, axis, nullptr);
+      }
+
+      return create(dev.get(), "relative mouse");
+    }
+
+    uinput_t
+    make_mouse_abs() {
+      // Looks like the tablet of a virtual machine, which compositors treat as an absolute pointer
+      auto dev = make_device("Sunshine Mouse (absolute)", 0xBEEF, 0xDEAE, BUS_USB);
+      enable_mouse_buttons(dev.get());
+
+      input_absinfo absinfo { 0, 0, ABS_RANGE, 0, 0, 0 };
+      libevdev_enable_event_type(dev.get(), EV_ABS);
+      libevdev_enable_event_code(dev.get(), EV_ABS, ABS_X, &absinfo);
+      libevdev_enable_event_code(dev.get(), EV_ABS, ABS_Y, &absinfo);
+
+      return create(dev.get(), "absolute mouse");
+    }
+
+    uinput_t
+    make_keyboard() {
+      auto dev = make_device("Sunshine Keyboard", 0xBEEF, 0xDEAF, BUS_USB);
+
+      libevdev_enable_event_type(dev.get(), EV_KEY);
+      for (auto keycode : KEYCODES) {
+        if (keycode) {
+          libevdev_enable_event_code(dev.get(), EV_KEY, keycode, nullptr);
+        }
+      }
+
+      return create(dev.get(), "keyboard");
+    }
+
+    uinput_t
+    make_gamepad() {
+      // Looks like an Xbox 360 controller, which games know the layout of
+      auto dev = make_device("Sunshine Gamepad", 0x045E, 0x028E, BUS_USB);
+
+      libevdev_enable_event_type(dev.get(), EV_KEY);
+      for (auto button : { BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_WEST, BTN_TL, BTN_TR, BTN_SELECT, BTN_START, BTN_MODE, BTN_THUMBL, BTN_THUMBR }) {
+        libevdev_enable_event_code(dev.get(), EV_KEY, button, nullptr);
+      }
+
+      input_absinfo stick { 0, -32768, 32767, 16, 128, 0 };
+      input_absinfo trigger { 0, 0, 255, 0, 0, 0 };
+      input_absinfo dpad { 0, -1, 1, 0, 0, 0 };
+      libevdev_enable_event_type(dev.get(), EV_ABS);
+      for (auto axis : { ABS_X, ABS_Y, ABS_RX, ABS_RY }) {
+        libevdev_enable_event_code(dev.get(), EV_ABS, axis, &stick);
+      }
+      libevdev_enable_event_code(dev.get(), EV_ABS, ABS_Z, &trigger);
+      libevdev_enable_event_code(dev.get(), EV_ABS, ABS_RZ, &trigger);
+      libevdev_enable_event_code(dev.get(), EV_ABS, ABS_HAT0X, &dpad);
+      libevdev_enable_event_code(dev.get(), EV_ABS, ABS_HAT0Y, &dpad);
+
+      return create(dev.get(), "gamepad");
+    }
+
+    void
+    write(const uinput_t &dev, unsigned int type, unsigned int code, int value) {
+      libevdev_uinput_write_event(dev.get(), type, code, value);
+    }
+
+    void
+    sync(const uinput_t &dev) {
+      libevdev_uinput_write_event(dev.get(), EV_SYN, SYN_REPORT, 0);
+    }
+
+    void
+    tap(const uinput_t &keyboard, std::uint16_t keycode) {
+      write(keyboard, EV_KEY, keycode, 1);
+      sync(keyboard);
+      write(keyboard, EV_KEY, keycode, 0);
+      sync(keyboard);
+    }
+
+    // Linux joysticks point down on positive Y, the client points up
+    int
+    invert(std::int16_t value) {
+      return std::min(32767, -(int) value);
+    }
+  }  // namespace
+
+  void
+  freeInput(void *p) {
+    delete (input_raw_t *) p;
+  }
+
+  input_t
+  input() {
+    auto raw = new input_raw_t {};
+    input_t result { raw };
+
+    raw->mouse_rel = make_mouse_rel();
+    raw->mouse_abs = make_mouse_abs();
+    raw->keyboard = make_keyboard();
+    if (!raw->mouse_rel || !raw->mouse_abs || !raw->keyboard) {
+      BOOST_LOG(error) << "Injecting input needs write access to /dev/uinput"sv;
+      return nullptr;
+    }
+
+    return result;
+  }
+
+  void
+  move_mouse(input_t &input, int deltaX, int deltaY) {
+    auto raw = (input_raw_t *) input.get();
+    if (deltaX) {
+      write(raw->mouse_rel, EV_REL, REL_X, deltaX);
+    }
+    if (deltaY) {
+      write(raw->mouse_rel, EV_REL, REL_Y, deltaY);
+    }
+    sync(raw->mouse_rel);
+  }
+
+  void
+  abs_mouse(input_t &input, const touch_port_t &touch_port, float x, float y) {
+    auto raw = (input_raw_t *) input.get();
+    if (touch_port.width <= 0 || touch_port.height <= 0) {
+      return;
+    }
+
+    auto scaled_x = std::lround((touch_port.offset_x + x) * ABS_RANGE / touch_port.width);
+    auto scaled_y = std::lround((touch_port.offset_y + y) * ABS_RANGE / touch_port.height);
+    write(raw->mouse_abs, EV_ABS, ABS_X, (int) std::clamp<long>(scaled_x, 0, ABS_RANGE));
+    write(raw->mouse_abs, EV_ABS, ABS_Y, (int) std::clamp<long>(scaled_y, 0, ABS_RANGE));
+    sync(raw->mouse_abs);
+  }
+
+  void
+  button_mouse(input_t &input, int button, bool release) {
+    constexpr int buttons[] { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, BTN_SIDE, BTN_EXTRA };
+    if (button < 1 || button > 5) {
+      BOOST_LOG(warning) << "Unknown mouse button "sv << button;
+      return;
+    }
+
+    auto raw = (input_raw_t *) input.get();
+    write(raw->mouse_rel, EV_KEY, buttons[button - 1], release ? 0 : 1);
+    sync(raw->mouse_rel);
+  }
+
+  namespace {
+    void
+    wheel(input_raw_t *raw, int &residual, unsigned int axis, unsigned int hi_res_axis, int distance) {
+      // Applications that only know notches get them once the high resolution movement adds up to one
+      residual += distance;
+      write(raw->mouse_rel, EV_REL, hi_res_axis, distance);
+      if (auto notches = residual / WHEEL_DELTA) {
+        write(raw->mouse_rel, EV_REL, axis, notches);
+        residual -= notches * WHEEL_DELTA;
+      }
+      sync(raw->mouse_rel);
+    }
+  }  // namespace
+
+  void
+  scroll(input_t &input, int distance) {
+    auto raw = (input_raw_t *) input.get();
+    wheel(raw, raw->scroll_residual, REL_WHEEL, REL_WHEEL_HI_RES, distance);
+  }
+
+  void
+  hscroll(input_t &input, int distance) {
+    auto raw = (input_raw_t *) input.get();
+    wheel(raw, raw->hscroll_residual, REL_HWHEEL, REL_HWHEEL_HI_RES, distance);
+  }
+
+  void
+  keyboard_update(input_t &input, std::uint16_t modcode, bool release, std::uint8_t flags) {
+    auto keycode = KEYCODES[modcode & 0xFF];
+    if (!keycode) {
+      BOOST_LOG(debug) << "Virtual key "sv << util::hex(modcode).to_string_view() << " has no evdev key"sv;
+      return;
+    }
+
+    auto raw = (input_raw_t *) input.get();
+    write(raw->keyboard, EV_KEY, keycode, release ? 0 : 1);
+    sync(raw->keyboard);
+  }
+
+  void
+  unicode(input_t &input, char *utf8, int size) {
+    auto raw = (input_raw_t *) input.get();
+    constexpr std::uint16_t hex_keys[] { KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F };
+
+    // Typed as Ctrl+Shift+U, the code point in hex and space, which input methods such as IBus compose
+    for (int x = 0; x < size;) {
+      auto lead = (std::uint8_t) utf8[x];
+      int length = lead < 0x80 ? 1 : (lead >> 5) == 0x06 ? 2 : (lead >> 4) == 0x0E ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+      if (!length || x + length > size) {
+        BOOST_LOG(warning) << "Invalid UTF-8 in the text of the client"sv;
+        return;
+      }
+
+      std::uint32_t codepoint = length == 1 ? lead : lead & (0x7F >> length);
+      for (int y = 1; y < length; ++y) {
+        codepoint = (codepoint << 6) | ((std::uint8_t) utf8[x + y] & 0x3F);
+      }
+      x += length;
+
+      write(raw->keyboard, EV_KEY, KEY_LEFTCTRL, 1);
+      write(raw->keyboard, EV_KEY, KEY_LEFTSHIFT, 1);
+      sync(raw->keyboard);
+      tap(raw->keyboard, KEY_U);
+      write(raw->keyboard, EV_KEY, KEY_LEFTSHIFT, 0);
+      write(raw->keyboard, EV_KEY, KEY_LEFTCTRL, 0);
+      sync(raw->keyboard);
+
+      bool leading = true;
+      for (int shift = 28; shift >= 0; shift -= 4) {
+        auto digit = (codepoint >> shift) & 0xF;
+        if (leading && !digit && shift) {
+          continue;
+        }
+        leading = false;
+        tap(raw->keyboard, hex_keys[digit]);
+      }
+      tap(raw->keyboard, KEY_SPACE);
+    }
+  }
+
+  int
+  alloc_gamepad(input_t &input, const gamepad_id_t &id, const gamepad_arrival_t &metadata) {
+    auto raw = (input_raw_t *) input.get();
+    if (id.globalIndex < 0 || id.globalIndex >= MAX_GAMEPADS) {
+      return -1;
+    }
+
+    auto &gamepad = raw->gamepads[id.globalIndex];
+    if (!gamepad) {
+      gamepad = make_gamepad();
+      if (!gamepad) {
+        return -1;
+      }
+    }
+
+    BOOST_LOG(info) << "Gamepad "sv << id.globalIndex << " of type "sv << (int) metadata.type << " plugged in as an Xbox 360 controller"sv;
+    return 0;
+  }
+
+  void
+  free_gamepad(input_t &input, int nr) {
+    auto raw = (input_raw_t *) input.get();
+    raw->gamepads[nr].reset();
+    BOOST_LOG(info) << "Gamepad "sv << nr << " unplugged"sv;
+  }
+
+  void
+  gamepad_update(input_t &input, int nr, const gamepad_state_t &gamepad_state) {
+    auto raw = (input_raw_t *) input.get();
+    auto &gamepad = raw->gamepads[nr];
+    if (!gamepad) {
+      return;
+    }
+
+    auto flags = gamepad_state.buttonFlags;
+    constexpr std::pair<std::uint32_t, int> buttons[] {
+      { A, BTN_SOUTH },
+      { B, BTN_EAST },
+      { X, BTN_NORTH },
+      { Y, BTN_WEST },
+      { LEFT_BUTTON, BTN_TL },
+      { RIGHT_BUTTON, BTN_TR },
+      { BACK, BTN_SELECT },
+      { START, BTN_START },
+      { HOME, BTN_MODE },
+      { LEFT_STICK, BTN_THUMBL },
+      { RIGHT_STICK, BTN_THUMBR },
+    };
+    for (auto &[flag, button] : buttons) {
+      write(gamepad, EV_KEY, button, (flags & flag) ? 1 : 0);
+    }
+
+    write(gamepad, EV_ABS, ABS_HAT0X, (flags & DPAD_RIGHT ? 1 : 0) - (flags & DPAD_LEFT ? 1 : 0));
+    write(gamepad, EV_ABS, ABS_HAT0Y, (flags & DPAD_DOWN ? 1 : 0) - (flags & DPAD_UP ? 1 : 0));
+    write(gamepad, EV_ABS, ABS_X, gamepad_state.lsX);
+    write(gamepad, EV_ABS, ABS_Y, invert(gamepad_state.lsY));
+    write(gamepad, EV_ABS, ABS_RX, gamepad_state.rsX);
+    write(gamepad, EV_ABS, ABS_RY, invert(gamepad_state.rsY));
+    write(gamepad, EV_ABS, ABS_Z, gamepad_state.lt);
+    write(gamepad, EV_ABS, ABS_RZ, gamepad_state.rt);
+    sync(gamepad);
+  }
+}  // namespace platf
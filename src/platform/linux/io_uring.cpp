@@ -0,0 +1,176 @@
+/**
+ * @file src/platform/linux/io_uring.cpp
+ * @brief io_uring backend of the batched UDP sends.
+ */
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#include <liburing.h>
+#include <sys/socket.h>
+
+#include "io_uring.h"
+#include "src/config.h"
+#include "src/logging.h"
+
+using namespace std::literals;
+
+namespace platf::uring {
+  namespace {
+    // Messages in flight per submission, larger batches are submitted in several rounds
+    constexpr unsigned QUEUE_DEPTH = 256;
+
+    class ring_t {
+    public:
+      ring_t() {
+        // Only the thread that owns the ring submits to it, so the kernel can skip the cross-thread wakeups
+        io_uring_params params {};
+#ifdef IORING_SETUP_SINGLE_ISSUER
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+#endif
+        auto status = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+        if (status == -EINVAL && params.flags) {
+          // Kernels older than 6.0 don't know these flags
+          params = {};
+          status = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+        }
+
+        if (status < 0) {
+          BOOST_LOG(info) << "io_uring is unavailable, falling back to sendmsg(): "sv << strerror(-status);
+          return;
+        }
+        initialized = true;
+        ok = true;
+
+#ifdef IORING_CQE_F_NOTIF
+        if (config::stream.zero_copy_send) {
+          auto probe = io_uring_get_probe_ring(&ring);
+          zero_copy = probe && io_uring_opcode_supported(probe, IORING_OP_SENDMSG_ZC);
+          io_uring_free_probe(probe);
+
+          if (!zero_copy) {
+            BOOST_LOG(info) << "Zero-copy sends are unsupported by this kernel"sv;
+          }
+        }
+#endif
+      }
+
+      ~ring_t() {
+        if (initialized) {
+          io_uring_queue_exit(&ring);
+        }
+      }
+
+      ring_t(const ring_t &) = delete;
+      ring_t &
+      operator=(const ring_t &) = delete;
+
+      void
+      send(int sockfd, struct msghdr *msgs, std::size_t count, int *results) {
+        // Messages of a round that was cut short keep this
+        std::fill_n(results, count, -ECANCELED);
+
+        for (std::size_t begin = 0; begin < count; begin += QUEUE_DEPTH) {
+          auto end = std::min<std::size_t>(count, begin + QUEUE_DEPTH);
+
+          for (auto x = begin; x < end; ++x) {
+            auto sqe = io_uring_get_sqe(&ring);
+#ifdef IORING_CQE_F_NOTIF
+            if (zero_copy) {
+              io_uring_prep_sendmsg_zc(sqe, sockfd, &msgs[x], 0);
+            }
+            else
+#endif
+            {
+              io_uring_prep_sendmsg(sqe, sockfd, &msgs[x], 0);
+            }
+            io_uring_sqe_set_data64(sqe, x);
+
+            // A failed message cancels the ones behind it, so what was sent is always a prefix of the batch
+            if (x + 1 < end) {
+              io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            }
+          }
+
+          // A zero-copy send completes twice, the second time once the kernel let go of the buffers.
+          // Every round waits for all of its completions, so none is left for the next batch to mistake
+          // for its own. An interrupted submission is retried, it only submits what's still queued
+          auto pending = end - begin;
+          int status;
+          do {
+            status = io_uring_submit_and_wait(&ring, pending);
+          } while (status == -EINTR);
+          if (status < 0) {
+            fail("io_uring_submit_and_wait()"sv, status);
+            return;
+          }
+
+          while (pending) {
+            struct io_uring_cqe *cqe;
+            status = io_uring_wait_cqe(&ring, &cqe);
+            if (status < 0) {
+              if (status == -EINTR) {
+                continue;
+              }
+
+              fail("io_uring_wait_cqe()"sv, status);
+              return;
+            }
+
+#ifdef IORING_CQE_F_NOTIF
+            if (cqe->flags & IORING_CQE_F_NOTIF) {
+              --pending;
+            }
+            else {
+              results[io_uring_cqe_get_data64(cqe)] = cqe->res;
+              if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                --pending;
+              }
+            }
+#else
+            results[io_uring_cqe_get_data64(cqe)] = cqe->res;
+            --pending;
+#endif
+
+            io_uring_cqe_seen(&ring, cqe);
+          }
+
+          // The next round isn't linked to this one
+          if (std::any_of(results + begin, results + end, [](int result) { return result < 0; })) {
+            return;
+          }
+        }
+      }
+
+      bool ok = false;
+
+    private:
+      /**
+       * @brief Give up on the ring after an error that isn't transient.
+       * @details Messages of the round may still be queued or in flight, their completions can't be
+       *          told apart from the ones of a later batch. The thread sends with sendmsg() from now on,
+       *          the ring is torn down with the thread, which cancels whatever is left on it.
+       */
+      void
+      fail(std::string_view what, int status) {
+        BOOST_LOG(error) << what << " failed, falling back to sendmsg(): "sv << strerror(-status);
+        ok = false;
+      }
+
+      struct io_uring ring;
+      bool initialized = false;
+      bool zero_copy = false;
+    };
+  }  // namespace
+
+  bool
+  sendmsg_batch(int sockfd, struct msghdr *msgs, std::size_t count, int *results) {
+    thread_local ring_t ring;
+    if (!ring.ok) {
+      return false;
+    }
+
+    ring.send(sockfd, msgs, count, results);
+    return true;
+  }
+}  // namespace platf::uring
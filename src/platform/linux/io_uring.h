@@ -0,0 +1,28 @@
+/**
+ * @file src/platform/linux/io_uring.h
+ * @brief io_uring backend of the batched UDP sends.
+ */
+#pragma once
+
+#include <cstddef>
+
+struct msghdr;
+
+namespace platf::uring {
+  /**
+   * @brief Submit the messages as a single batch and wait until the kernel is done with their buffers.
+   * @details Every thread that sends gets a ring of its own on first use. The messages are sent with
+   *          `IORING_OP_SENDMSG_ZC` when zero-copy sends are enabled and supported by the kernel, the
+   *          payload is then never copied into the socket buffer.
+   *
+   *          The messages are sent in order, a failed message cancels the ones behind it with
+   *          `-ECANCELED`, so the messages that were sent are always the first ones.
+   * @param sockfd The socket.
+   * @param msgs The messages, they and their buffers must stay valid until the call returns.
+   * @param count Number of messages.
+   * @param results Bytes sent by every message, or its negative errno.
+   * @return false if io_uring is unavailable on this system, nothing was sent.
+   */
+  bool
+  sendmsg_batch(int sockfd, struct msghdr *msgs, std::size_t count, int *results);
+}  // namespace platf::uring
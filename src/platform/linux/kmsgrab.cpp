@@ -16,15 +16,20 @@
 #include <thread>
 
 #include "src/config.h"
+#include "src/cursor.h"
 #include "src/logging.h"
+#include "src/memory.h"
+#include "src/pixel.h"
 #include "src/platform/common.h"
 #include "src/round_robin.h"
+#include "src/trace.h"
 #include "src/utility.h"
 #include "src/video.h"
 
 #include "cuda.h"
 #include "graphics.h"
 #include "vaapi.h"
+#include "vulkan.h"
 #include "wayland.h"
 
 using namespace std::literals;
@@ -558,9 +563,9 @@ namespace platf {
       return result;
     }
 
-    struct kms_img_t: public img_t {
+    struct kms_img_t: public egl::ram_img_t {
       ~kms_img_t() override {
-        delete[] data;
+        memory::free(data);
         data = nullptr;
       }
     };
@@ -1036,17 +1041,8 @@ namespace platf {
           sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
           drmIoctl(plane_fd.el, DMA_BUF_IOCTL_SYNC, &sync);
 
-          // If the image is tightly packed, copy it in one shot
-          if (fb->pitches[0] == src_w * 4 && src_x == 0) {
-            memcpy(captured_cursor.pixels.data(), &((std::uint8_t *) mapped_data)[src_y * fb->pitches[0]], src_h * fb->pitches[0]);
-          }
-          else {
-            // Copy row by row to deal with mismatched pitch or an X offset
-            auto pixel_dst = captured_cursor.pixels.data();
-            for (int y = 0; y < src_h; y++) {
-              memcpy(&pixel_dst[y * (src_w * 4)], &((std::uint8_t *) mapped_data)[(y + src_y) * fb->pitches[0] + (src_x * 4)], src_w * 4);
-            }
-          }
+          // In one shot if the image is tightly packed, row by row otherwise to deal with mismatched pitch or an X offset
+          pixel::copy_rows(captured_cursor.pixels.data(), src_w * 4, &((std::uint8_t *) mapped_data)[src_y * fb->pitches[0] + src_x * 4], fb->pitches[0], src_w * 4, src_h);
 
           // End the CPU read and unmap the dmabuf
           sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
@@ -1118,6 +1114,7 @@ namespace platf {
         sd->height = fb->height;
         sd->modifier = fb->modifier;
         sd->fourcc = fb->pixel_format;
+        sd->fb_id = fb->fb_id;
 
         if (
           fb->width != img_width ||
@@ -1126,10 +1123,32 @@ namespace platf {
         }
 
         update_cursor();
+        if (::cursor::enabled()) {
+          publish_cursor();
+        }
 
         return capture_e::ok;
       }
 
+      /**
+       * @brief Publish the cursor plane for clients that draw the cursor themselves.
+       * @details The plane doesn't tell where the hotspot is, the cursor is sent at its source size.
+       */
+      void
+      publish_cursor() {
+        if (!captured_cursor.visible) {
+          ::cursor::update_position(0, 0, false);
+          return;
+        }
+
+        if (published_cursor_serial != captured_cursor.serial) {
+          ::cursor::update_shape(captured_cursor.src_w, captured_cursor.src_h, 0, 0, captured_cursor.pixels.data(), captured_cursor.src_w * 4);
+          published_cursor_serial = captured_cursor.serial;
+        }
+
+        ::cursor::update_position(captured_cursor.x - img_offset_x, captured_cursor.y - img_offset_y, true);
+      }
+
       mem_type_e mem_type;
 
       int img_width, img_height;
@@ -1144,6 +1163,7 @@ namespace platf {
 
       int cursor_plane_id;
       cursor_t captured_cursor {};
+      unsigned long published_cursor_serial = 0;
 
       card_t card;
     };
@@ -1222,6 +1242,12 @@ namespace platf {
         }
 #endif
 
+#ifdef SUNSHINE_BUILD_VULKAN
+        if (mem_type == mem_type_e::vulkan) {
+          return vulkan::make_avcodec_encode_device(width, height, false);
+        }
+#endif
+
 #ifdef SUNSHINE_BUILD_CUDA
         if (mem_type == mem_type_e::cuda) {
           return cuda::make_avcodec_encode_device(width, height, false);
@@ -1231,11 +1257,18 @@ namespace platf {
         return std::make_unique<avcodec_encode_device_t>();
       }
 
+#ifdef SUNSHINE_BUILD_CUDA
+      std::unique_ptr<nvenc_encode_device_t>
+      make_nvenc_encode_device(pix_fmt_e pix_fmt) override {
+        return cuda::make_nvenc_encode_device(width, height, false, pix_fmt);
+      }
+#endif
+
       void
       blend_cursor(img_t &img) {
         // TODO: Cursor scaling is not supported in this codepath.
         // We always draw the cursor at the source size.
-        auto pixels = (int *) img.data;
+        auto pixels = (std::uint32_t *) img.data;
 
         int32_t screen_height = img.height;
         int32_t screen_width = img.width;
@@ -1253,36 +1286,16 @@ namespace platf {
         auto delta_width = std::min<uint32_t>(captured_cursor.src_w, std::max<int32_t>(0, screen_width - cursor_x)) - cursor_delta_x;
         for (auto y = 0; y < delta_height; ++y) {
           // Offset into the cursor image to skip drawing the parts of the cursor image that are off screen
-          //
-          // NB: We must access the elements via the data() function because cursor_end may point to the
-          // the first element beyond the valid range of the vector. Using vector's [] operator in that
-          // manner is undefined behavior (and triggers errors when using debug libc++), while doing the
-          // same with an array is fine.
-          auto cursor_begin = (uint32_t *) &captured_cursor.pixels.data()[((y + cursor_delta_y) * captured_cursor.src_w + cursor_delta_x) * 4];
-          auto cursor_end = (uint32_t *) &captured_cursor.pixels.data()[((y + cursor_delta_y) * captured_cursor.src_w + delta_width + cursor_delta_x) * 4];
+          auto cursor_begin = (const uint32_t *) &captured_cursor.pixels.data()[((y + cursor_delta_y) * captured_cursor.src_w + cursor_delta_x) * 4];
 
           auto pixels_begin = &pixels[(y + cursor_y) * (img.row_pitch / img.pixel_pitch) + cursor_x];
-
-          std::for_each(cursor_begin, cursor_end, [&](uint32_t cursor_pixel) {
-            auto colors_in = (uint8_t *) pixels_begin;
-
-            auto alpha = (*(uint *) &cursor_pixel) >> 24u;
-            if (alpha == 255) {
-              *pixels_begin = cursor_pixel;
-            }
-            else {
-              auto colors_out = (uint8_t *) &cursor_pixel;
-              colors_in[0] = colors_out[0] + (colors_in[0] * (255 - alpha) + 255 / 2) / 255;
-              colors_in[1] = colors_out[1] + (colors_in[1] * (255 - alpha) + 255 / 2) / 255;
-              colors_in[2] = colors_out[2] + (colors_in[2] * (255 - alpha) + 255 / 2) / 255;
-            }
-            ++pixels_begin;
-          });
+          pixel::blend_alpha(pixels_begin, cursor_begin, delta_width);
         }
       }
 
       capture_e
       snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+        TRACE_SCOPE("capture.snapshot");
         file_t fb_fd[4];
 
         egl::surface_descriptor_t sd;
@@ -1293,13 +1306,12 @@ namespace platf {
           return status;
         }
 
-        auto rgb_opt = egl::import_source(display.get(), sd);
-
-        if (!rgb_opt) {
+        auto rgb_p = imports.import(display.get(), sd);
+        if (!rgb_p) {
           return capture_e::error;
         }
 
-        auto &rgb = *rgb_opt;
+        auto &rgb = *rgb_p;
 
         gl::ctx.BindTexture(GL_TEXTURE_2D, rgb->tex[0]);
 
@@ -1317,8 +1329,37 @@ namespace platf {
 
         img_out->frame_timestamp = frame_timestamp;
 
+        auto img = (kms_img_t *) img_out.get();
+        if (cursor && captured_cursor.visible && (mem_type == mem_type_e::vaapi || mem_type == mem_type_e::vulkan || mem_type == mem_type_e::cuda)) {
+          // The encode device composites the cursor during the color conversion, at its scaled size
+          if (!img->cursor.data || img->cursor.serial != captured_cursor.serial) {
+            img->cursor.buffer = captured_cursor.pixels;
+            img->cursor.serial = captured_cursor.serial;
+          }
+
+          img->cursor.x = captured_cursor.x - img_offset_x;
+          img->cursor.y = captured_cursor.y - img_offset_y;
+          img->cursor.src_w = captured_cursor.src_w;
+          img->cursor.src_h = captured_cursor.src_h;
+          img->cursor.width = captured_cursor.dst_w;
+          img->cursor.height = captured_cursor.dst_h;
+          img->cursor.pixel_pitch = 4;
+          img->cursor.row_pitch = img->cursor.pixel_pitch * img->cursor.src_w;
+          img->cursor.data = img->cursor.buffer.data();
+        }
+        else {
+          img->cursor.data = nullptr;
+
+          if (cursor && captured_cursor.visible) {
+            blend_cursor(*img_out);
+          }
+        }
+
+        img->cursor_rect = std::nullopt;
         if (cursor && captured_cursor.visible) {
-          blend_cursor(*img_out);
+          auto x = captured_cursor.x - img_offset_x;
+          auto y = captured_cursor.y - img_offset_y;
+          img->cursor_rect = rect_t { x, y, x + (std::int32_t) captured_cursor.dst_w, y + (std::int32_t) captured_cursor.dst_h };
         }
 
         return capture_e::ok;
@@ -1331,7 +1372,10 @@ namespace platf {
         img->height = height;
         img->pixel_pitch = 4;
         img->row_pitch = img->pixel_pitch * width;
-        img->data = new std::uint8_t[height * img->row_pitch];
+        img->data = (std::uint8_t *) memory::allocate(height * img->row_pitch);
+        if (!img->data) {
+          return nullptr;
+        }
 
         return img;
       }
@@ -1344,6 +1388,9 @@ namespace platf {
       gbm::gbm_t gbm;
       egl::display_t display;
       egl::ctx_t ctx;
+
+      // Goes before the context and the display it imported into
+      egl::import_cache_t imports;
     };
 
     class display_vram_t: public display_t {
@@ -1351,17 +1398,65 @@ namespace platf {
       display_vram_t(mem_type_e mem_type):
           display_t(mem_type) {}
 
+      /**
+       * @brief The render device that encodes, the one of the capture card unless another GPU is configured.
+       * @details The encode GPU imports the framebuffers of the capture card as DMA-BUFs through PRIME,
+       *          it must be able to sample their modifier.
+       */
+      file_t
+      encode_render_device() {
+        if (config::video.encode_adapter_name.empty()) {
+          return dup(card.render_fd.el);
+        }
+
+        file_t render_fd = open(config::video.encode_adapter_name.c_str(), O_RDWR);
+        if (render_fd.el < 0) {
+          char string[1024];
+          BOOST_LOG(error) << "Couldn't open "sv << config::video.encode_adapter_name << ": "sv << strerror_r(errno, string, sizeof(string));
+          return render_fd;
+        }
+
+        BOOST_LOG(info) << "Encoding on "sv << config::video.encode_adapter_name << ", the frames are imported from the capture card"sv;
+        return render_fd;
+      }
+
+      bool
+      can_crop() override {
+        // The conversion through EGL copies the region out of the imported framebuffer
+        return true;
+      }
+
       std::unique_ptr<avcodec_encode_device_t>
       make_avcodec_encode_device(pix_fmt_e pix_fmt) override {
+        auto region = this->region();
+        auto region_width = region.right - region.left;
+        auto region_height = region.bottom - region.top;
+
 #ifdef SUNSHINE_BUILD_VAAPI
         if (mem_type == mem_type_e::vaapi) {
-          return va::make_avcodec_encode_device(width, height, dup(card.render_fd.el), img_offset_x, img_offset_y, true);
+          auto render_fd = encode_render_device();
+          if (render_fd.el < 0) {
+            return nullptr;
+          }
+
+          return va::make_avcodec_encode_device(region_width, region_height, std::move(render_fd), img_offset_x + region.left, img_offset_y + region.top, true);
+        }
+#endif
+
+#ifdef SUNSHINE_BUILD_VULKAN
+        if (mem_type == mem_type_e::vulkan) {
+          auto render_fd = encode_render_device();
+          if (render_fd.el < 0) {
+            return nullptr;
+          }
+
+          return vulkan::make_avcodec_encode_device(region_width, region_height, std::move(render_fd), img_offset_x + region.left, img_offset_y + region.top, true);
         }
 #endif
 
 #ifdef SUNSHINE_BUILD_CUDA
         if (mem_type == mem_type_e::cuda) {
-          return cuda::make_avcodec_gl_encode_device(width, height, img_offset_x, img_offset_y);
+          return cuda::make_avcodec_gl_encode_device(region_width, region_height, img_offset_x + region.left, img_offset_y + region.top);
         }
 #endif
 
@@ -1369,6 +1464,14 @@ namespace platf {
         return nullptr;
       }
 
+#ifdef SUNSHINE_BUILD_CUDA
+      std::unique_ptr<nvenc_encode_device_t>
+      make_nvenc_encode_device(pix_fmt_e pix_fmt) override {
+        auto region = this->region();
+        return cuda::make_nvenc_gl_encode_device(region.right - region.left, region.bottom - region.top, img_offset_x + region.left, img_offset_y + region.top, pix_fmt);
+      }
+#endif
+
       std::shared_ptr<img_t>
       alloc_img() override {
         auto img = std::make_shared<egl::img_descriptor_t>();
@@ -1422,6 +1525,7 @@ namespace platf {
 
       capture_e
       snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds /* timeout */, bool cursor) {
+        TRACE_SCOPE("capture.snapshot");
         file_t fb_fd[4];
 
         if (!pull_free_image_cb(img_out)) {
@@ -1494,7 +1598,7 @@ namespace platf {
 
   std::shared_ptr<display_t>
   kms_display(mem_type_e hwdevice_type, const std::string &display_name, const ::video::config_t &config) {
-    if (hwdevice_type == mem_type_e::vaapi || hwdevice_type == mem_type_e::cuda) {
+    if (hwdevice_type == mem_type_e::vaapi || hwdevice_type == mem_type_e::vulkan || hwdevice_type == mem_type_e::cuda) {
       auto disp = std::make_shared<kms::display_vram_t>(hwdevice_type);
 
       if (!disp->init(display_name, config)) {
@@ -9,8 +9,12 @@
 #endif
 
 // standard includes
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
 // lib includes
 #include <arpa/inet.h>
@@ -19,13 +23,23 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
+#include <linux/net_tstamp.h>
 #include <netinet/udp.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
 // local includes
 #include "graphics.h"
 #include "misc.h"
+#ifdef SUNSHINE_BUILD_IO_URING
+  #include "io_uring.h"
+#endif
+#ifdef SUNSHINE_BUILD_XDP
+  #include "xdp.h"
+#endif
 #include "src/config.h"
 #include "src/logging.h"
 #include "src/platform/common.h"
@@ -285,6 +299,132 @@ namespace platf {
     // Unimplemented
   }
 
+  namespace {
+    std::string
+    read_sysfs_line(const std::filesystem::path &path) {
+      std::ifstream in { path };
+
+      std::string line;
+      std::getline(in, line);
+      return line;
+    }
+
+    // CPUs sharing the last level cache with the CPU
+    std::vector<int>
+    cache_domain(int cpu) {
+      std::vector<int> cpus;
+
+      int top_level = 0;
+      auto caches = std::filesystem::path { "/sys/devices/system/cpu" } / ("cpu"s + std::to_string(cpu)) / "cache";
+      for (int index = 0; std::filesystem::exists(caches / ("index"s + std::to_string(index))); ++index) {
+        auto cache = caches / ("index"s + std::to_string(index));
+
+        auto level = (int) util::from_view(read_sysfs_line(cache / "level"));
+        if (level > top_level) {
+          auto shared = util::parse_cpu_list(read_sysfs_line(cache / "shared_cpu_list"));
+          if (!shared.empty()) {
+            top_level = level;
+            cpus = std::move(shared);
+          }
+        }
+      }
+
+      return cpus;
+    }
+
+    // NUMA node of the render node that is captured from, or of the first GPU, -1 if unknown
+    int
+    gpu_numa_node() {
+      std::filesystem::path device;
+      if (!config::video.adapter_name.empty()) {
+        device = std::filesystem::path { "/sys/class/drm" } / std::filesystem::path { config::video.adapter_name }.filename();
+      }
+      else {
+        std::error_code ec;
+        for (auto &entry : std::filesystem::directory_iterator { "/sys/class/drm", ec }) {
+          auto name = entry.path().filename().string();
+          if (name.rfind("renderD"sv, 0) == 0 && (device.empty() || name < device.filename().string())) {
+            device = entry.path();
+          }
+        }
+      }
+
+      auto node = read_sysfs_line(device / "device" / "numa_node");
+      return device.empty() || node.empty() ? -1 : (int) util::from_view(node);
+    }
+
+    std::vector<int>
+    pipeline_cpus() {
+      auto &policy = config::sunshine.thread_affinity;
+      if (policy.empty() || policy == "off"sv) {
+        return {};
+      }
+
+      if (policy != "auto"sv) {
+        auto cpus = util::parse_cpu_list(policy);
+        if (cpus.empty()) {
+          BOOST_LOG(warning) << "Invalid thread_affinity ["sv << policy << "], the pipeline threads are left unpinned"sv;
+        }
+        return cpus;
+      }
+
+      std::vector<int> node_cpus;
+      auto node = gpu_numa_node();
+      if (node >= 0) {
+        node_cpus = util::parse_cpu_list(read_sysfs_line("/sys/devices/system/node/node"s + std::to_string(node) + "/cpulist"));
+      }
+      if (node_cpus.empty()) {
+        node_cpus = util::parse_cpu_list(read_sysfs_line("/sys/devices/system/cpu/online"));
+      }
+      if (node_cpus.empty()) {
+        BOOST_LOG(warning) << "Unable to find the CPUs near the GPU, the pipeline threads are left unpinned"sv;
+        return {};
+      }
+
+      // The cache domain may reach past the node on some topologies, only the CPUs of the node are kept
+      std::vector<int> cpus;
+      auto domain = cache_domain(node_cpus.front());
+      std::set_intersection(std::begin(domain), std::end(domain), std::begin(node_cpus), std::end(node_cpus), std::back_inserter(cpus));
+
+      return cpus.empty() ? node_cpus : cpus;
+    }
+  }  // namespace
+
+  void
+  place_pipeline_thread(std::string_view name) {
+    static const auto cpus = []() {
+      auto cpus = pipeline_cpus();
+      if (!cpus.empty()) {
+        std::stringstream list;
+        for (auto cpu : cpus) {
+          list << (list.tellp() ? ","sv : ""sv) << cpu;
+        }
+        BOOST_LOG(info) << "Placing the pipeline threads on CPUs "sv << list.str();
+      }
+      return cpus;
+    }();
+
+    if (cpus.empty()) {
+      return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+
+    auto status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (status) {
+      BOOST_LOG(warning) << "Unable to pin the "sv << name << " thread: "sv << strerror(status);
+      return;
+    }
+
+    BOOST_LOG(debug) << "Pinned the "sv << name << " thread"sv;
+  }
+
   void
   restart_on_exit() {
     char executable[PATH_MAX];
@@ -356,8 +496,8 @@ namespace platf {
     return saddr_v6;
   }
 
-  bool
-  send_batch(batched_send_info_t &send_info) {
+  size_t
+  send_batch_socket(batched_send_info_t &send_info) {
     auto sockfd = (int) send_info.native_socket;
     struct msghdr msg = {};
 
@@ -378,7 +518,7 @@ namespace platf {
     }
 
     union {
-      char buf[CMSG_SPACE(sizeof(uint16_t)) +
+      char buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t)) +
                std::max(CMSG_SPACE(sizeof(struct in_pktinfo)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
       struct cmsghdr alignment;
     } cmbuf = {};  // Must be zeroed for CMSG_NXTHDR()
@@ -388,7 +528,7 @@ namespace platf {
     msg.msg_controllen = sizeof(cmbuf.buf);
 
     // The PKTINFO option will always be first, then we will conditionally
-    // append the UDP_SEGMENT option next if applicable.
+    // append the SCM_TXTIME and the UDP_SEGMENT options next if applicable.
     auto pktinfo_cm = CMSG_FIRSTHDR(&msg);
     if (send_info.source_address.is_v6()) {
       struct in6_pktinfo pktInfo;
@@ -419,39 +559,155 @@ namespace platf {
       memcpy(CMSG_DATA(pktinfo_cm), &pktInfo, sizeof(pktInfo));
     }
 
-#ifdef UDP_SEGMENT
-    {
-      struct iovec iov = {};
+    // The departure time stamped by the pacer follows the PKTINFO option, the fq qdisc holds the datagrams until then
+    if (send_info.txtime) {
+      auto txtime_cm = (struct cmsghdr *) (cmbuf.buf + cmbuflen);
 
-      msg.msg_iov = &iov;
-      msg.msg_iovlen = 1;
+      txtime_cm->cmsg_level = SOL_SOCKET;
+      txtime_cm->cmsg_type = SCM_TXTIME;
+      txtime_cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+      memcpy(CMSG_DATA(txtime_cm), &send_info.txtime, sizeof(uint64_t));
+
+      cmbuflen += CMSG_SPACE(sizeof(uint64_t));
+    }
 
+#ifdef UDP_SEGMENT
+    {
       // UDP GSO on Linux currently only supports sending 64K or 64 segments at a time
-      size_t seg_index = 0;
-      const size_t seg_max = 65536 / 1500;
-      while (seg_index < send_info.block_count) {
-        iov.iov_base = (void *) &send_info.buffer[seg_index * send_info.block_size];
-        iov.iov_len = send_info.block_size * std::min(send_info.block_count - seg_index, seg_max);
+      const size_t seg_max = std::max<size_t>(1, std::min<size_t>(64, 65535 / send_info.block_size));
+
+      // Point the message at the segments [seg_index, seg_index + seg_count), with the UDP_SEGMENT option in control when it's needed
+      char *pktinfo = cmbuf.buf;
+      constexpr size_t control_size = sizeof(cmbuf.buf);
+      auto prepare = [&, pktinfo](struct msghdr &chunk, struct iovec *iovs, char *control, size_t seg_index, size_t seg_count) {
+        chunk = msg;
+        chunk.msg_iov = iovs;
+
+        size_t bytes_to_send = 0;
+        if (send_info.headers) {
+          chunk.msg_iovlen = 0;
+          for (size_t x = 0; x < seg_count; ++x) {
+            auto header = send_info.header_for_block(seg_index + x);
+
+            iovs[chunk.msg_iovlen++] = { (void *) header.buffer, header.size };
+            bytes_to_send += header.size;
+
+            send_info.for_each_payload_segment(seg_index + x, [&](const buffer_descriptor_t &payload) {
+              iovs[chunk.msg_iovlen++] = { (void *) payload.buffer, payload.size };
+              bytes_to_send += payload.size;
+            });
+          }
+        }
+        else {
+          iovs[0].iov_base = (void *) &send_info.buffer[seg_index * send_info.block_size];
+          iovs[0].iov_len = send_info.block_size * seg_count;
+          chunk.msg_iovlen = 1;
+          bytes_to_send = iovs[0].iov_len;
+        }
+
+        chunk.msg_control = control;
+        if (control != pktinfo) {
+          memcpy(control, pktinfo, control_size);
+        }
 
         // We should not use GSO if the data is <= one full block size
-        if (iov.iov_len > send_info.block_size) {
-          msg.msg_controllen = cmbuflen + CMSG_SPACE(sizeof(uint16_t));
+        if (bytes_to_send > send_info.block_size) {
+          chunk.msg_controllen = cmbuflen + CMSG_SPACE(sizeof(uint16_t));
 
-          // Enable GSO to perform segmentation of our buffer for us
-          auto cm = CMSG_NXTHDR(&msg, pktinfo_cm);
+          // Enable GSO to perform segmentation of our buffer for us, behind the other options
+          auto cm = (struct cmsghdr *) ((char *) chunk.msg_control + cmbuflen);
           cm->cmsg_level = SOL_UDP;
           cm->cmsg_type = UDP_SEGMENT;
           cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
           *((uint16_t *) CMSG_DATA(cm)) = send_info.block_size;
         }
         else {
-          msg.msg_controllen = cmbuflen;
+          chunk.msg_controllen = cmbuflen;
+        }
+      };
+
+      // Blocks of the batch that were sent
+      size_t seg_index = 0;
+
+#ifdef SUNSHINE_BUILD_IO_URING
+      {
+        // All chunks of the batch go to the kernel with a single submission. The buffers belong to the
+        // thread, a batch of a large frame doesn't fit on the stack
+        thread_local std::vector<struct msghdr> chunks;
+        thread_local std::vector<struct iovec> chunk_iovs;
+        thread_local std::vector<decltype(cmbuf)> controls;
+        thread_local std::vector<int> results;
+
+        while (seg_index < send_info.block_count) {
+          auto chunk_count = (send_info.block_count - seg_index + seg_max - 1) / seg_max;
+
+          chunks.resize(chunk_count);
+          chunk_iovs.resize((send_info.block_count - seg_index) * (1 + send_info.max_payload_segments()));
+          controls.resize(chunk_count);
+          results.resize(chunk_count);
+
+          size_t iov_count = 0;
+          for (size_t x = 0; x < chunk_count; ++x) {
+            auto chunk_index = seg_index + x * seg_max;
+            auto seg_count = std::min(send_info.block_count - chunk_index, seg_max);
+
+            prepare(chunks[x], &chunk_iovs[iov_count], controls[x].buf, chunk_index, seg_count);
+            iov_count += chunks[x].msg_iovlen;
+          }
+
+          // io_uring is unavailable, sendmsg() takes over
+          if (!uring::sendmsg_batch(sockfd, chunks.data(), chunk_count, results.data())) {
+            break;
+          }
+
+          // The chunks are linked, the ones behind a failed chunk weren't sent
+          size_t x = 0;
+          for (; x < chunk_count && results[x] >= 0; ++x) {
+            seg_index += std::min(send_info.block_count - seg_index, seg_max);
+          }
+          if (x == chunk_count) {
+            return seg_index;
+          }
+
+          // Without send buffer space, wait for some and submit the rest again
+          if (results[x] == -EAGAIN) {
+            struct pollfd pfd;
+
+            pfd.fd = sockfd;
+            pfd.events = POLLOUT;
+
+            if (poll(&pfd, 1, -1) != 1) {
+              BOOST_LOG(warning) << "poll() failed: "sv << errno;
+              return seg_index;
+            }
+
+            continue;
+          }
+
+          // A failure of the first chunk most likely means GSO is unavailable, the non-GSO path below takes over
+          if (seg_index == 0) {
+            break;
+          }
+
+          BOOST_LOG(warning) << "io_uring sendmsg() failed: "sv << strerror(-results[x]);
+          return seg_index;
         }
+      }
+#endif
+
+      // A header and the payload vectors for each segment
+      struct iovec iovs[64 * (1 + send_info.max_payload_segments())];
+
+      while (seg_index < send_info.block_count) {
+        auto seg_count = std::min(send_info.block_count - seg_index, seg_max);
+
+        struct msghdr chunk;
+        prepare(chunk, iovs, cmbuf.buf, seg_index, seg_count);
 
         // This will fail if GSO is not available, so we will fall back to non-GSO if
         // it's the first sendmsg() call. On subsequent calls, we will treat errors as
         // actual failures and return to the caller.
-        auto bytes_sent = sendmsg(sockfd, &msg, 0);
+        auto bytes_sent = sendmsg(sockfd, &chunk, 0);
         if (bytes_sent < 0) {
           // If there's no send buffer space, wait for some to be available
           if (errno == EAGAIN) {
@@ -472,12 +728,13 @@ namespace platf {
           break;
         }
 
-        seg_index += bytes_sent / send_info.block_size;
+        // The last segment may be shorter than the block size
+        seg_index += (bytes_sent + send_info.block_size - 1) / send_info.block_size;
       }
 
-      // If we sent something, return the status and don't fall back to the non-GSO path.
+      // If we sent something, return how far we got and don't fall back to the non-GSO path.
       if (seg_index != 0) {
-        return seg_index >= send_info.block_count;
+        return seg_index;
       }
     }
 #endif
@@ -485,19 +742,24 @@ namespace platf {
     {
       // If GSO is not supported, use sendmmsg() instead.
       struct mmsghdr msgs[send_info.block_count];
-      struct iovec iovs[send_info.block_count];
+      struct iovec iovs[send_info.block_count * (1 + send_info.max_payload_segments())];
+      size_t iov_count = 0;
       for (size_t i = 0; i < send_info.block_count; i++) {
-        iovs[i] = {};
-        iovs[i].iov_base = (void *) &send_info.buffer[i * send_info.block_size];
-        iovs[i].iov_len = send_info.block_size;
+        auto header = send_info.header_for_block(i);
 
         msgs[i] = {};
         msgs[i].msg_hdr.msg_name = msg.msg_name;
         msgs[i].msg_hdr.msg_namelen = msg.msg_namelen;
-        msgs[i].msg_hdr.msg_iov = &iovs[i];
-        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[iov_count];
         msgs[i].msg_hdr.msg_control = cmbuf.buf;
         msgs[i].msg_hdr.msg_controllen = cmbuflen;
+
+        iovs[iov_count++] = { (void *) header.buffer, header.size };
+        send_info.for_each_payload_segment(i, [&](const buffer_descriptor_t &payload) {
+          iovs[iov_count++] = { (void *) payload.buffer, payload.size };
+        });
+
+        msgs[i].msg_hdr.msg_iovlen = &iovs[iov_count] - msgs[i].msg_hdr.msg_iov;
       }
 
       // Call sendmmsg() until all messages are sent
@@ -522,14 +784,31 @@ namespace platf {
           }
 
           BOOST_LOG(warning) << "sendmmsg() failed: "sv << errno;
-          return false;
+          break;
         }
 
         blocks_sent += msgs_sent;
       }
 
-      return true;
+      return blocks_sent;
+    }
+  }
+
+  size_t
+  send_batch(batched_send_info_t &send_info) {
+#ifdef SUNSHINE_BUILD_XDP
+    if (auto sent = xdp::send_batch(send_info)) {
+      if (sent >= send_info.block_count) {
+        return sent;
+      }
+
+      // What the transmit ring had no room for goes through the socket
+      auto rest = send_info.slice(sent, send_info.block_count - sent);
+      return sent + send_batch_socket(rest);
     }
+#endif
+
+    return send_batch_socket(send_info);
   }
 
   bool
@@ -554,9 +833,9 @@ namespace platf {
     }
 
     union {
-      char buf[std::max(CMSG_SPACE(sizeof(struct in_pktinfo)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
+      char buf[CMSG_SPACE(sizeof(uint64_t)) + std::max(CMSG_SPACE(sizeof(struct in_pktinfo)), CMSG_SPACE(sizeof(struct in6_pktinfo)))];
       struct cmsghdr alignment;
-    } cmbuf;
+    } cmbuf = {};
     socklen_t cmbuflen = 0;
 
     msg.msg_control = cmbuf.buf;
@@ -592,12 +871,26 @@ namespace platf {
       memcpy(CMSG_DATA(pktinfo_cm), &pktInfo, sizeof(pktInfo));
     }
 
-    struct iovec iov = {};
-    iov.iov_base = (void *) send_info.buffer;
-    iov.iov_len = send_info.size;
+    // Shards the batch left over keep the departure time of the batch
+    if (send_info.txtime) {
+      auto txtime_cm = (struct cmsghdr *) (cmbuf.buf + cmbuflen);
+
+      txtime_cm->cmsg_level = SOL_SOCKET;
+      txtime_cm->cmsg_type = SCM_TXTIME;
+      txtime_cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+      memcpy(CMSG_DATA(txtime_cm), &send_info.txtime, sizeof(uint64_t));
+
+      cmbuflen += CMSG_SPACE(sizeof(uint64_t));
+    }
+
+    struct iovec iovs[2] = {};
+    iovs[0].iov_base = (void *) send_info.header;
+    iovs[0].iov_len = send_info.header_size;
+    iovs[1].iov_base = (void *) send_info.buffer;
+    iovs[1].iov_len = send_info.size;
 
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = 2;
 
     msg.msg_controllen = cmbuflen;
 
@@ -730,6 +1023,24 @@ namespace platf {
     return std::make_unique<qos_t>(sockfd, reset_options);
   }
 
+  /**
+   * @brief Let the datagrams of the socket carry an SO_TXTIME departure time for the fq qdisc.
+   * @param native_socket The native socket handle.
+   */
+  bool
+  enable_socket_txtime(std::uintptr_t native_socket) {
+    // The fq qdisc paces on the monotonic clock, which steady_clock is
+    struct sock_txtime txtime {};
+    txtime.clockid = CLOCK_MONOTONIC;
+
+    if (setsockopt((int) native_socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime))) {
+      BOOST_LOG(warning) << "Failed to set SO_TXTIME, the pacer sleeps instead: "sv << errno;
+      return false;
+    }
+
+    return true;
+  }
+
   namespace source {
     enum source_e : std::size_t {
 #ifdef SUNSHINE_BUILD_CUDA
@@ -741,6 +1052,9 @@ namespace platf {
 #ifdef SUNSHINE_BUILD_DRM
       KMS,
 #endif
+#ifdef SUNSHINE_BUILD_PORTAL
+      PORTAL,
+#endif
 #ifdef SUNSHINE_BUILD_X11
       X11,
 #endif
@@ -786,11 +1100,25 @@ namespace platf {
   }
 #endif
 
+#ifdef SUNSHINE_BUILD_PORTAL
+  std::vector<std::string>
+  portal_display_names();
+  std::shared_ptr<display_t>
+  portal_display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config);
+
+  bool
+  verify_portal() {
+    return !portal_display_names().empty();
+  }
+#endif
+
 #ifdef SUNSHINE_BUILD_X11
   std::vector<std::string>
   x11_display_names();
   std::shared_ptr<display_t>
   x11_display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config);
+  std::optional<rect_t>
+  x11_window_rect(const std::string &title);
 
   bool
   verify_x11() {
@@ -810,6 +1138,9 @@ namespace platf {
 #ifdef SUNSHINE_BUILD_DRM
     if (sources[source::KMS]) return kms_display_names(hwdevice_type);
 #endif
+#ifdef SUNSHINE_BUILD_PORTAL
+    if (sources[source::PORTAL]) return portal_display_names();
+#endif
 #ifdef SUNSHINE_BUILD_X11
     if (sources[source::X11]) return x11_display_names();
 #endif
@@ -826,6 +1157,48 @@ namespace platf {
     return true;
   }
 
+  std::string
+  gpu_identity() {
+    auto read_line = [](const fs::path &path) {
+      std::ifstream in { path };
+
+      std::string line;
+      std::getline(in, line);
+      return line;
+    };
+
+    std::error_code ec;
+    std::vector<fs::path> render_nodes;
+    for (auto &entry : fs::directory_iterator { "/sys/class/drm", ec }) {
+      if (entry.path().filename().string().rfind("renderD", 0) == 0) {
+        render_nodes.push_back(entry.path());
+      }
+    }
+    if (ec || render_nodes.empty()) {
+      return {};
+    }
+    std::sort(std::begin(render_nodes), std::end(render_nodes));
+
+    std::stringstream identity;
+    for (auto &node : render_nodes) {
+      auto device = node / "device";
+      auto driver = fs::read_symlink(device / "driver", ec).filename();
+
+      // Out-of-tree drivers such as nvidia carry a version of their own
+      identity << node.filename().string() << ' '
+               << read_line(device / "vendor") << ':' << read_line(device / "device") << ':' << read_line(device / "revision") << ' '
+               << driver.string() << ' ' << read_line(fs::path { "/sys/module" } / driver / "version") << ';';
+    }
+
+    // In-tree drivers and the user mode drivers are updated along with the kernel, more or less
+    utsname name;
+    if (!uname(&name)) {
+      identity << name.release << ' ' << name.version;
+    }
+
+    return identity.str();
+  }
+
   std::shared_ptr<display_t>
   display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config) {
 #ifdef SUNSHINE_BUILD_CUDA
@@ -846,6 +1219,12 @@ namespace platf {
       return kms_display(hwdevice_type, display_name, config);
     }
 #endif
+#ifdef SUNSHINE_BUILD_PORTAL
+    if (sources[source::PORTAL]) {
+      BOOST_LOG(info) << "Screencasting with PipeWire through xdg-desktop-portal"sv;
+      return portal_display(hwdevice_type, display_name, config);
+    }
+#endif
 #ifdef SUNSHINE_BUILD_X11
     if (sources[source::X11]) {
       BOOST_LOG(info) << "Screencasting with X11"sv;
@@ -856,6 +1235,18 @@ namespace platf {
     return nullptr;
   }
 
+  std::optional<rect_t>
+  window_rect(const std::string &title) {
+#ifdef SUNSHINE_BUILD_X11
+    if (window_system == window_system_e::X11) {
+      return x11_window_rect(title);
+    }
+#endif
+
+    // Wayland doesn't tell clients where the windows are
+    return std::nullopt;
+  }
+
   std::unique_ptr<deinit_t>
   init() {
     // These are allowed to fail.
@@ -898,6 +1289,14 @@ namespace platf {
       }
     }
 #endif
+#ifdef SUNSHINE_BUILD_PORTAL
+    // The portal asks the user to pick the screen, so it comes after the backends that don't
+    if ((config::video.capture.empty() && sources.none()) || config::video.capture == "portal") {
+      if (verify_portal()) {
+        sources[source::PORTAL] = true;
+      }
+    }
+#endif
 #ifdef SUNSHINE_BUILD_X11
     // We enumerate this capture backend regardless of other suitable sources,
     // since it may be needed as a NvFBC fallback for software encoding on X11.
@@ -919,4 +1318,21 @@ namespace platf {
 
     return std::make_unique<deinit_t>();
   }
+
+  class linux_high_precision_timer: public high_precision_timer {
+  public:
+    void
+    sleep_for(const std::chrono::nanoseconds &duration) override {
+      std::this_thread::sleep_for(duration);
+    }
+
+    operator bool() override {
+      return true;
+    }
+  };
+
+  std::unique_ptr<high_precision_timer>
+  create_high_precision_timer() {
+    return std::make_unique<linux_high_precision_timer>();
+  }
 }  // namespace platf
@@ -0,0 +1,38 @@
+/**
+ * @file src/platform/linux/pipewire.h
+ * @brief Owners of the PipeWire objects shared by the capture backends.
+ */
+#pragma once
+
+#include <pipewire/pipewire.h>
+
+#include "src/utility.h"
+
+namespace pw {
+  using thread_loop_t = util::safe_ptr<pw_thread_loop, pw_thread_loop_destroy>;
+  using context_t = util::safe_ptr<pw_context, pw_context_destroy>;
+  using core_t = util::safe_ptr_v2<pw_core, int, pw_core_disconnect>;
+  using stream_t = util::safe_ptr<pw_stream, pw_stream_destroy>;
+
+  /**
+   * @brief Keeps the callbacks of the loop thread out while it lives.
+   */
+  class loop_lock_t {
+  public:
+    explicit loop_lock_t(pw_thread_loop *loop):
+        loop { loop } {
+      pw_thread_loop_lock(loop);
+    }
+
+    ~loop_lock_t() {
+      pw_thread_loop_unlock(loop);
+    }
+
+    loop_lock_t(const loop_lock_t &) = delete;
+    loop_lock_t &
+    operator=(const loop_lock_t &) = delete;
+
+  private:
+    pw_thread_loop *loop;
+  };
+}  // namespace pw
@@ -0,0 +1,1373 @@
+/**
+ * @file src/platform/linux/portalgrab.cpp
+ * @brief Screencasting with PipeWire through the ScreenCast interface of xdg-desktop-portal.
+ */
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <spa/buffer/meta.h>
+#include <spa/param/video/format-utils.h>
+#include <spa/pod/builder.h>
+
+#include "src/config.h"
+#include "src/logging.h"
+#include "src/memory.h"
+#include "src/pixel.h"
+#include "src/platform/common.h"
+#include "src/trace.h"
+#include "src/utility.h"
+#include "src/video.h"
+
+#include "cuda.h"
+#include "graphics.h"
+#include "pipewire.h"
+#include "vaapi.h"
+#include "vulkan.h"
+
+// The few DRM formats PipeWire streams map to, see graphics.cpp
+#define fourcc_code(a, b, c, d) ((std::uint32_t)(a) | ((std::uint32_t)(b) << 8) | \
+                                 ((std::uint32_t)(c) << 16) | ((std::uint32_t)(d) << 24))
+#define fourcc_mod_code(vendor, val) ((((uint64_t) vendor) << 56) | ((val) &0x00ffffffffffffffULL))
+#define DRM_FORMAT_MOD_INVALID fourcc_mod_code(0, ((1ULL << 56) - 1))
+#define DRM_FORMAT_XRGB8888 fourcc_code('X', 'R', '2', '4')
+#define DRM_FORMAT_ARGB8888 fourcc_code('A', 'R', '2', '4')
+#define DRM_FORMAT_XBGR8888 fourcc_code('X', 'B', '2', '4')
+#define DRM_FORMAT_ABGR8888 fourcc_code('A', 'B', '2', '4')
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+
+namespace portal {
+  template <class T>
+  void
+  g_unref(T *p) {
+    g_object_unref(p);
+  }
+
+  using connection_t = util::safe_ptr<GDBusConnection, g_unref<GDBusConnection>>;
+  using fd_list_t = util::safe_ptr<GUnixFDList, g_unref<GUnixFDList>>;
+  using variant_t = util::safe_ptr<GVariant, g_variant_unref>;
+  using error_t = util::safe_ptr<GError, g_error_free>;
+  using main_context_t = util::safe_ptr<GMainContext, g_main_context_unref>;
+
+  constexpr auto DESKTOP_BUS_NAME = "org.freedesktop.portal.Desktop";
+  constexpr auto DESKTOP_OBJECT_PATH = "/org/freedesktop/portal/desktop";
+  constexpr auto SCREEN_CAST_INTERFACE = "org.freedesktop.portal.ScreenCast";
+  constexpr auto REQUEST_INTERFACE = "org.freedesktop.portal.Request";
+  constexpr auto SESSION_INTERFACE = "org.freedesktop.portal.Session";
+
+  // Flags and enums of the ScreenCast interface
+  constexpr std::uint32_t SOURCE_TYPE_MONITOR = 1;
+  constexpr std::uint32_t CURSOR_MODE_EMBEDDED = 2;
+  constexpr std::uint32_t CURSOR_MODE_METADATA = 4;
+  constexpr std::uint32_t PERSIST_MODE_PERSISTENT = 2;
+
+  // Restore tokens came with version 4 of the interface
+  constexpr std::uint32_t RESTORE_TOKEN_VERSION = 4;
+
+  // Time the user gets to pick the screen in the dialog of the portal
+  constexpr auto RESPONSE_TIMEOUT = 2min;
+
+  // Time the compositor gets to agree on a format once the stream connected
+  constexpr auto NEGOTIATION_TIMEOUT = 5s;
+
+  // Past this many rectangles since the last frame, the damage is treated as unknown
+  constexpr std::size_t MAX_DAMAGE_RECTS = 64;
+
+  // Largest cursor the compositor may attach to a buffer
+  constexpr int MAX_CURSOR_SIZE = 256;
+
+  struct format_t {
+    spa_video_format spa;
+    std::uint32_t fourcc;
+
+    // Frames in system memory are BGRA, other formats can only be imported through EGL
+    bool mappable;
+  };
+
+  constexpr format_t formats[] {
+    { SPA_VIDEO_FORMAT_BGRx, DRM_FORMAT_XRGB8888, true },
+    { SPA_VIDEO_FORMAT_BGRA, DRM_FORMAT_ARGB8888, true },
+    { SPA_VIDEO_FORMAT_RGBx, DRM_FORMAT_XBGR8888, false },
+    { SPA_VIDEO_FORMAT_RGBA, DRM_FORMAT_ABGR8888, false },
+  };
+
+  static std::mutex restore_token_mutex;
+
+  // Lets the next session reuse the screen the user picked, without the dialog
+  static fs::path
+  restore_token_path() {
+    return platf::appdata() / "portal_restore_token";
+  }
+
+  static std::string
+  read_restore_token() {
+    std::lock_guard lg { restore_token_mutex };
+
+    std::ifstream in { restore_token_path() };
+
+    std::string token;
+    std::getline(in, token);
+    return token;
+  }
+
+  static void
+  write_restore_token(const std::string &token) {
+    std::lock_guard lg { restore_token_mutex };
+
+    std::ofstream out { restore_token_path(), std::ios::trunc };
+    out << token;
+    if (!out) {
+      BOOST_LOG(warning) << "Couldn't save the restore token of the portal, the next session asks for the screen again"sv;
+    }
+  }
+
+  static connection_t
+  session_bus() {
+    GError *error_p = nullptr;
+    connection_t connection { g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &error_p) };
+    error_t error { error_p };
+
+    if (!connection) {
+      BOOST_LOG(debug) << "Couldn't connect to the session bus: "sv << error->message;
+    }
+
+    return connection;
+  }
+
+  static std::optional<std::uint32_t>
+  screen_cast_property(GDBusConnection *connection, const char *name) {
+    GError *error_p = nullptr;
+    variant_t reply { g_dbus_connection_call_sync(
+      connection, DESKTOP_BUS_NAME, DESKTOP_OBJECT_PATH, "org.freedesktop.DBus.Properties", "Get",
+      g_variant_new("(ss)", SCREEN_CAST_INTERFACE, name), G_VARIANT_TYPE("(v)"),
+      G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &error_p) };
+    error_t error { error_p };
+
+    if (!reply) {
+      BOOST_LOG(debug) << "Couldn't read the "sv << name << " of the ScreenCast portal: "sv << error->message;
+      return std::nullopt;
+    }
+
+    GVariant *value_p = nullptr;
+    g_variant_get(reply.get(), "(v)", &value_p);
+    variant_t value { value_p };
+
+    if (!g_variant_is_of_type(value.get(), G_VARIANT_TYPE_UINT32)) {
+      return std::nullopt;
+    }
+
+    return g_variant_get_uint32(value.get());
+  }
+
+  /**
+   * @brief A ScreenCast session of a single monitor, it's closed along with this object.
+   */
+  class session_t {
+  public:
+    ~session_t() {
+      if (!session_handle.empty()) {
+        g_dbus_connection_call(
+          connection.get(), DESKTOP_BUS_NAME, session_handle.c_str(), SESSION_INTERFACE, "Close",
+          nullptr, nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, nullptr, nullptr);
+      }
+    }
+
+    int
+    init() {
+      connection = session_bus();
+      if (!connection) {
+        return -1;
+      }
+
+      auto version = screen_cast_property(connection.get(), "version");
+      auto cursor_modes = screen_cast_property(connection.get(), "AvailableCursorModes");
+      if (!version) {
+        BOOST_LOG(error) << "xdg-desktop-portal doesn't provide the ScreenCast interface"sv;
+        return -1;
+      }
+
+      // The request objects are named after our unique name on the bus, without the leading colon
+      sender = g_dbus_connection_get_unique_name(connection.get()) + 1;
+      std::replace(std::begin(sender), std::end(sender), '.', '_');
+
+      main_context.reset(g_main_context_new());
+
+      // Responses are dispatched to the main context of the thread that subscribed to them
+      g_main_context_push_thread_default(main_context.get());
+      auto fg = util::fail_guard([&]() {
+        g_main_context_pop_thread_default(main_context.get());
+      });
+
+      auto token = next_token();
+      GVariantBuilder options;
+      g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add(&options, "{sv}", "handle_token", g_variant_new_string(token.c_str()));
+      g_variant_builder_add(&options, "{sv}", "session_handle_token", g_variant_new_string(next_token().c_str()));
+
+      auto results = call_request("CreateSession", token, g_variant_new("(a{sv})", &options));
+      if (!results) {
+        return -1;
+      }
+
+      const char *session_handle_p = nullptr;
+      if (!g_variant_lookup(results.get(), "session_handle", "&s", &session_handle_p)) {
+        BOOST_LOG(error) << "The ScreenCast portal didn't return a session"sv;
+        return -1;
+      }
+      session_handle = session_handle_p;
+
+      // Without metadata, the cursor can't be toggled and it's part of the damage of every frame it moves in
+      std::uint32_t cursor_mode = CURSOR_MODE_EMBEDDED;
+      if (cursor_modes && (*cursor_modes & CURSOR_MODE_METADATA)) {
+        cursor_mode = CURSOR_MODE_METADATA;
+      }
+      cursor_metadata = cursor_mode == CURSOR_MODE_METADATA;
+
+      token = next_token();
+      g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add(&options, "{sv}", "handle_token", g_variant_new_string(token.c_str()));
+      g_variant_builder_add(&options, "{sv}", "types", g_variant_new_uint32(SOURCE_TYPE_MONITOR));
+      g_variant_builder_add(&options, "{sv}", "multiple", g_variant_new_boolean(false));
+      g_variant_builder_add(&options, "{sv}", "cursor_mode", g_variant_new_uint32(cursor_mode));
+      if (*version >= RESTORE_TOKEN_VERSION) {
+        g_variant_builder_add(&options, "{sv}", "persist_mode", g_variant_new_uint32(PERSIST_MODE_PERSISTENT));
+
+        auto restore_token = read_restore_token();
+        if (!restore_token.empty()) {
+          g_variant_builder_add(&options, "{sv}", "restore_token", g_variant_new_string(restore_token.c_str()));
+        }
+      }
+
+      results = call_request("SelectSources", token, g_variant_new("(oa{sv})", session_handle.c_str(), &options));
+      if (!results) {
+        return -1;
+      }
+
+      token = next_token();
+      g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add(&options, "{sv}", "handle_token", g_variant_new_string(token.c_str()));
+
+      results = call_request("Start", token, g_variant_new("(osa{sv})", session_handle.c_str(), "", &options));
+      if (!results) {
+        return -1;
+      }
+
+      // Every token can only be used once, the session hands out the next one
+      const char *restore_token = nullptr;
+      if (g_variant_lookup(results.get(), "restore_token", "&s", &restore_token)) {
+        write_restore_token(restore_token);
+      }
+
+      GVariant *streams_p = nullptr;
+      g_variant_lookup(results.get(), "streams", "@a(ua{sv})", &streams_p);
+      variant_t streams { streams_p };
+      if (!streams || !g_variant_n_children(streams.get())) {
+        BOOST_LOG(error) << "The ScreenCast portal didn't start any stream"sv;
+        return -1;
+      }
+
+      GVariant *properties_p = nullptr;
+      g_variant_get_child(streams.get(), 0, "(u@a{sv})", &node_id, &properties_p);
+      variant_t properties { properties_p };
+
+      return open_pipewire_remote();
+    }
+
+    // The connection to PipeWire that can only see the streams of the session
+    file_t pipewire_fd;
+    std::uint32_t node_id = 0;
+
+    bool cursor_metadata = false;
+
+  private:
+    struct response_t {
+      bool done = false;
+      std::uint32_t code = 0;
+      variant_t results;
+    };
+
+    static void
+    on_response(GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *, GVariant *parameters, gpointer user_data) {
+      auto response = (response_t *) user_data;
+
+      GVariant *results_p = nullptr;
+      g_variant_get(parameters, "(u@a{sv})", &response->code, &results_p);
+      response->results.reset(results_p);
+      response->done = true;
+    }
+
+    std::string
+    next_token() {
+      static std::atomic<std::uint32_t> tokens;
+
+      return "sunshine"s + std::to_string(++tokens);
+    }
+
+    /**
+     * @brief Call a method of the portal that answers through a Request object.
+     * @param token The handle_token of the options, it names the Request object.
+     * @return The results of the response, nullptr if the call failed or the user cancelled it.
+     */
+    variant_t
+    call_request(const char *method, const std::string &token, GVariant *parameters) {
+      auto request_path = "/org/freedesktop/portal/desktop/request/"s + sender + '/' + token;
+
+      // Subscribed before the call, the response may arrive right after it
+      response_t response;
+      auto subscription = g_dbus_connection_signal_subscribe(
+        connection.get(), DESKTOP_BUS_NAME, REQUEST_INTERFACE, "Response", request_path.c_str(), nullptr,
+        G_DBUS_SIGNAL_FLAGS_NONE, on_response, &response, nullptr);
+      auto fg = util::fail_guard([&]() {
+        g_dbus_connection_signal_unsubscribe(connection.get(), subscription);
+      });
+
+      GError *error_p = nullptr;
+      variant_t reply { g_dbus_connection_call_sync(
+        connection.get(), DESKTOP_BUS_NAME, DESKTOP_OBJECT_PATH, SCREEN_CAST_INTERFACE, method,
+        parameters, G_VARIANT_TYPE("(o)"), G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &error_p) };
+      error_t error { error_p };
+
+      if (!reply) {
+        BOOST_LOG(error) << "ScreenCast."sv << method << "() failed: "sv << error->message;
+        return nullptr;
+      }
+
+      auto deadline = std::chrono::steady_clock::now() + RESPONSE_TIMEOUT;
+      while (!response.done) {
+        if (std::chrono::steady_clock::now() > deadline) {
+          BOOST_LOG(error) << "ScreenCast."sv << method << "() timed out"sv;
+          return nullptr;
+        }
+
+        if (!g_main_context_iteration(main_context.get(), false)) {
+          std::this_thread::sleep_for(10ms);
+        }
+      }
+
+      if (response.code) {
+        // 1 is a cancellation by the user, 2 any other failure
+        BOOST_LOG(error) << "ScreenCast."sv << method << "() was "sv << (response.code == 1 ? "cancelled"sv : "denied"sv);
+        return nullptr;
+      }
+
+      return std::move(response.results);
+    }
+
+    int
+    open_pipewire_remote() {
+      GVariantBuilder options;
+      g_variant_builder_init(&options, G_VARIANT_TYPE_VARDICT);
+
+      GUnixFDList *fd_list_p = nullptr;
+      GError *error_p = nullptr;
+      variant_t reply { g_dbus_connection_call_with_unix_fd_list_sync(
+        connection.get(), DESKTOP_BUS_NAME, DESKTOP_OBJECT_PATH, SCREEN_CAST_INTERFACE, "OpenPipeWireRemote",
+        g_variant_new("(oa{sv})", session_handle.c_str(), &options), G_VARIANT_TYPE("(h)"),
+        G_DBUS_CALL_FLAGS_NONE, -1, nullptr, &fd_list_p, nullptr, &error_p) };
+      fd_list_t fd_list { fd_list_p };
+      error_t error { error_p };
+
+      if (!reply) {
+        BOOST_LOG(error) << "ScreenCast.OpenPipeWireRemote() failed: "sv << error->message;
+        return -1;
+      }
+
+      gint32 index;
+      g_variant_get(reply.get(), "(h)", &index);
+
+      error_p = nullptr;
+      pipewire_fd.el = g_unix_fd_list_get(fd_list.get(), index, &error_p);
+      error.reset(error_p);
+      if (pipewire_fd.el < 0) {
+        BOOST_LOG(error) << "Couldn't get the PipeWire remote of the portal: "sv << error->message;
+        return -1;
+      }
+
+      return 0;
+    }
+
+    connection_t connection;
+    main_context_t main_context;
+    std::string sender;
+    std::string session_handle;
+  };
+
+  struct img_t: public platf::img_t {
+    ~img_t() override {
+      memory::free(data);
+      data = nullptr;
+    }
+  };
+
+  // Straight from the buffers of the stream, the cursor is premultiplied BGRA
+  struct cursor_t {
+    bool visible = false;
+    int x, y;
+    int width = 0;
+    int height = 0;
+    std::vector<std::uint8_t> pixels;
+
+    // Incremented whenever the pixels change
+    unsigned long serial = 0;
+  };
+
+  /**
+   * @brief A monitor streamed by the compositor through PipeWire.
+   * @details The stream runs on a thread of its own. It dequeues every buffer as soon as it arrives, so
+   *          the compositor paces the frames with its own clock and a capture never waits more than
+   *          the next frame. Only the latest buffer is kept, the ones that got superseded before
+   *          a snapshot picked them up hand back their damage and cursor updates. The snapshot holds on
+   *          to its buffer until the next one, the compositor doesn't render into it meanwhile.
+   */
+  class portal_t: public platf::display_t {
+  public:
+    ~portal_t() override {
+      // No callbacks past this point, the stream goes before the core and the context
+      if (loop) {
+        pw_thread_loop_stop(loop.get());
+      }
+    }
+
+    int
+    init(platf::mem_type_e hwdevice_type, const ::video::config_t &config) {
+      mem_type = hwdevice_type;
+      framerate = config.framerate;
+
+      // The modifiers of the DMA-BUFs are those the GPU can import
+      if (gbm::create_device) {
+        auto render_device = config::video.adapter_name.empty() ? "/dev/dri/renderD128" : config::video.adapter_name.c_str();
+
+        render.el = open(render_device, O_RDWR);
+        if (render.el >= 0) {
+          gbm.reset(gbm::create_device(render.el));
+        }
+
+        if (gbm) {
+          egl_display = egl::make_display(gbm.get());
+        }
+      }
+
+      if (!egl_display && mem_type != platf::mem_type_e::system) {
+        BOOST_LOG(error) << "Couldn't open an EGL display for the DMA-BUFs of the stream"sv;
+        return -1;
+      }
+
+      if (session.init()) {
+        return -1;
+      }
+
+      pw_init(nullptr, nullptr);
+
+      loop.reset(pw_thread_loop_new("portal", nullptr));
+      if (!loop) {
+        BOOST_LOG(error) << "Couldn't create a PipeWire loop"sv;
+        return -1;
+      }
+
+      context.reset(pw_context_new(pw_thread_loop_get_loop(loop.get()), nullptr, 0));
+      if (!context) {
+        BOOST_LOG(error) << "Couldn't create a PipeWire context"sv;
+        return -1;
+      }
+
+      if (pw_thread_loop_start(loop.get())) {
+        BOOST_LOG(error) << "Couldn't start the PipeWire loop"sv;
+        return -1;
+      }
+
+      pw::loop_lock_t lock { loop.get() };
+
+      // Takes the file descriptor, even when it fails
+      core.reset(pw_context_connect_fd(context.get(), session.pipewire_fd.release(), nullptr, 0));
+      if (!core) {
+        BOOST_LOG(error) << "Couldn't connect to the PipeWire remote of the portal: "sv << strerror(errno);
+        return -1;
+      }
+
+      auto properties = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Video",
+        PW_KEY_MEDIA_CATEGORY, "Capture",
+        PW_KEY_MEDIA_ROLE, "Screen",
+        nullptr);
+      stream.reset(pw_stream_new(core.get(), "Sunshine", properties));
+      if (!stream) {
+        BOOST_LOG(error) << "Couldn't create a PipeWire stream"sv;
+        return -1;
+      }
+
+      static const pw_stream_events stream_events = []() {
+        pw_stream_events events {};
+        events.version = PW_VERSION_STREAM_EVENTS;
+        events.state_changed = on_state_changed;
+        events.param_changed = on_param_changed;
+        events.remove_buffer = on_remove_buffer;
+        events.process = on_process;
+        return events;
+      }();
+      pw_stream_add_listener(stream.get(), &stream_listener, &stream_events, this);
+
+      if (egl_display) {
+        for (int x = 0; x < std::size(formats); ++x) {
+          modifiers[x] = egl::query_modifiers(egl_display.get(), formats[x].fourcc);
+
+          // The compositor may still allocate buffers without an explicit layout
+          modifiers[x].emplace_back(DRM_FORMAT_MOD_INVALID);
+        }
+      }
+
+      std::uint8_t buffer[8192];
+      auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+      auto params = enum_formats(&builder);
+      auto status = pw_stream_connect(
+        stream.get(), PW_DIRECTION_INPUT, session.node_id,
+        (pw_stream_flags) (PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS),
+        params.data(), params.size());
+      if (status < 0) {
+        BOOST_LOG(error) << "Couldn't connect to the PipeWire stream: "sv << strerror(-status);
+        return -1;
+      }
+
+      timespec abstime;
+      pw_thread_loop_get_time(loop.get(), &abstime, std::chrono::nanoseconds { NEGOTIATION_TIMEOUT }.count());
+      while (!stream_width && !failed) {
+        if (pw_thread_loop_timed_wait_full(loop.get(), &abstime)) {
+          BOOST_LOG(error) << "The compositor didn't agree on a format for the stream"sv;
+          return -1;
+        }
+      }
+
+      if (failed) {
+        return -1;
+      }
+
+      width = stream_width;
+      height = stream_height;
+      env_width = width;
+      env_height = height;
+
+      BOOST_LOG(info) << "Streaming PipeWire node "sv << session.node_id << " in "sv << (dmabuf ? "DMA-BUFs"sv : "shared memory"sv);
+      BOOST_LOG(debug) << "Resolution: "sv << width << 'x' << height;
+
+      return 0;
+    }
+
+  protected:
+    /**
+     * @brief Wait until the stream delivered a new buffer or moved the cursor.
+     * @details The latest buffer becomes the current one, the previous one goes back to the compositor.
+     *          The damage since the last snapshot and the cursor are copied along. Returns with the loop
+     *          unlocked, the current buffer stays valid until the next call unless the stream renegotiates.
+     */
+    platf::capture_e
+    wait_for_frame(std::chrono::milliseconds timeout, bool cursor) {
+      pw::loop_lock_t lock { loop.get() };
+
+      timespec abstime;
+      pw_thread_loop_get_time(loop.get(), &abstime, std::chrono::nanoseconds { timeout }.count());
+      while (!latest && !(cursor && cursor_updated && current)) {
+        if (failed) {
+          return platf::capture_e::error;
+        }
+
+        if (stream_width != width || stream_height != height) {
+          return platf::capture_e::reinit;
+        }
+
+        if (pw_thread_loop_timed_wait_full(loop.get(), &abstime)) {
+          return platf::capture_e::timeout;
+        }
+      }
+
+      if (stream_width != width || stream_height != height) {
+        return platf::capture_e::reinit;
+      }
+
+      new_frame = latest != nullptr;
+      if (new_frame) {
+        if (current) {
+          pw_stream_queue_buffer(stream.get(), current);
+        }
+
+        current = latest;
+        latest = nullptr;
+        frame_timestamp = latest_timestamp;
+      }
+      else {
+        frame_timestamp = std::chrono::steady_clock::now();
+      }
+
+      frame_damage = std::move(damage);
+      damage.emplace();
+
+      if (frame_cursor.serial != stream_cursor.serial) {
+        frame_cursor.pixels = stream_cursor.pixels;
+      }
+      frame_cursor.visible = stream_cursor.visible;
+      frame_cursor.x = stream_cursor.x;
+      frame_cursor.y = stream_cursor.y;
+      frame_cursor.width = stream_cursor.width;
+      frame_cursor.height = stream_cursor.height;
+      frame_cursor.serial = stream_cursor.serial;
+      cursor_updated = false;
+
+      add_cursor_damage(cursor);
+
+      ++capture_sequence;
+
+      return platf::capture_e::ok;
+    }
+
+    /**
+     * @brief Describe the DMA-BUF of the current buffer.
+     * @param dup_fds Whether the descriptor gets descriptors of its own, the stream owns them otherwise.
+     * @return false if the current buffer isn't a DMA-BUF.
+     */
+    bool
+    describe_current(egl::surface_descriptor_t &sd, bool dup_fds) {
+      auto buffer = current->buffer;
+
+      sd.width = width;
+      sd.height = height;
+      sd.fourcc = fourcc;
+      sd.modifier = modifier;
+      sd.fb_id = 0;
+      std::fill_n(sd.fds, 4, -1);
+
+      for (std::uint32_t x = 0; x < std::min<std::uint32_t>(buffer->n_datas, 4); ++x) {
+        auto &data = buffer->datas[x];
+        if (data.type != SPA_DATA_DmaBuf) {
+          return false;
+        }
+
+        sd.fds[x] = dup_fds ? dup(data.fd) : data.fd;
+        sd.pitches[x] = data.chunk->stride;
+        sd.offsets[x] = data.chunk->offset;
+      }
+
+      return true;
+    }
+
+    platf::mem_type_e mem_type;
+
+    file_t render;
+    gbm::gbm_t gbm;
+    egl::display_t egl_display;
+
+    // The current buffer, held until the next snapshot
+    pw_buffer *current = nullptr;
+    bool new_frame = false;
+
+    // What the latest snapshot picked up
+    std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
+    std::optional<std::vector<platf::rect_t>> frame_damage;
+    cursor_t frame_cursor;
+    std::uint64_t capture_sequence = 0;
+
+    bool dmabuf = false;
+
+    session_t session;
+
+    // Destroyed in reverse order, the stream goes first
+    pw::thread_loop_t loop;
+    pw::context_t context;
+    pw::core_t core;
+    pw::stream_t stream;
+
+  private:
+    std::vector<const spa_pod *>
+    enum_formats(spa_pod_builder *builder) {
+      std::vector<const spa_pod *> params;
+
+      if (egl_display) {
+        for (int x = 0; x < std::size(formats); ++x) {
+          params.emplace_back(build_format(builder, formats[x].spa, &modifiers[x]));
+        }
+      }
+
+      // Software encoding can do with frames in shared memory
+      if (mem_type == platf::mem_type_e::system) {
+        for (auto &format : formats) {
+          if (format.mappable) {
+            params.emplace_back(build_format(builder, format.spa, nullptr));
+          }
+        }
+      }
+
+      return params;
+    }
+
+    spa_pod *
+    build_format(spa_pod_builder *builder, spa_video_format format, const std::vector<std::uint64_t> *modifiers) {
+      spa_rectangle default_size { 1920, 1080 };
+      spa_rectangle min_size { 1, 1 };
+      spa_rectangle max_size { 16384, 16384 };
+
+      // The compositor sends frames as they are rendered, up to the framerate of the client
+      spa_fraction variable_rate { 0, 1 };
+      spa_fraction min_rate { 0, 1 };
+      spa_fraction max_rate { (std::uint32_t) framerate, 1 };
+
+      spa_pod_frame object_frame;
+      spa_pod_builder_push_object(builder, &object_frame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+      spa_pod_builder_add(builder,
+        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+        SPA_FORMAT_VIDEO_format, SPA_POD_Id(format),
+        SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&default_size, &min_size, &max_size),
+        SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&variable_rate),
+        SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&max_rate, &min_rate, &max_rate),
+        0);
+
+      if (modifiers) {
+        if (modifiers->size() == 1) {
+          spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY);
+          spa_pod_builder_long(builder, modifiers->front());
+        }
+        else {
+          // The compositor narrows the list down to what it can render into, then we fixate it
+          spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+
+          spa_pod_frame choice_frame;
+          spa_pod_builder_push_choice(builder, &choice_frame, SPA_CHOICE_Enum, 0);
+
+          // The first value is the default
+          spa_pod_builder_long(builder, modifiers->front());
+          for (auto modifier : *modifiers) {
+            spa_pod_builder_long(builder, modifier);
+          }
+          spa_pod_builder_pop(builder, &choice_frame);
+        }
+      }
+
+      return (spa_pod *) spa_pod_builder_pop(builder, &object_frame);
+    }
+
+    static void
+    on_state_changed(void *data, pw_stream_state old, pw_stream_state state, const char *error_message) {
+      auto portal = (portal_t *) data;
+
+      if (state == PW_STREAM_STATE_ERROR || state == PW_STREAM_STATE_UNCONNECTED) {
+        if (error_message) {
+          BOOST_LOG(error) << "PipeWire stream failed: "sv << error_message;
+        }
+        else {
+          BOOST_LOG(info) << "PipeWire stream disconnected"sv;
+        }
+
+        portal->failed = true;
+        pw_thread_loop_signal(portal->loop.get(), false);
+      }
+    }
+
+    static void
+    on_param_changed(void *data, std::uint32_t id, const spa_pod *param) {
+      auto portal = (portal_t *) data;
+      if (!param || id != SPA_PARAM_Format) {
+        return;
+      }
+
+      portal->negotiate(param);
+      pw_thread_loop_signal(portal->loop.get(), false);
+    }
+
+    void
+    negotiate(const spa_pod *param) {
+      std::uint32_t media_type, media_subtype;
+      spa_video_info_raw info {};
+      if (spa_format_parse(param, &media_type, &media_subtype) < 0 ||
+          media_type != SPA_MEDIA_TYPE_video || media_subtype != SPA_MEDIA_SUBTYPE_raw ||
+          spa_format_video_raw_parse(param, &info) < 0) {
+        BOOST_LOG(error) << "The compositor picked a format that isn't raw video"sv;
+        failed = true;
+        return;
+      }
+
+      auto format = std::find_if(std::begin(formats), std::end(formats), [&](const format_t &format) {
+        return format.spa == info.format;
+      });
+      if (format == std::end(formats)) {
+        BOOST_LOG(error) << "The compositor picked an unsupported format: "sv << info.format;
+        failed = true;
+        return;
+      }
+
+      std::uint8_t buffer[8192];
+      auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+      auto modifier_prop = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
+      if (modifier_prop && (modifier_prop->flags & SPA_POD_PROP_FLAG_DONT_FIXATE)) {
+        std::uint32_t count, choice;
+        auto values = spa_pod_get_values(&modifier_prop->value, &count, &choice);
+        if (!values || !count || SPA_POD_TYPE(values) != SPA_TYPE_Long) {
+          BOOST_LOG(error) << "The compositor didn't offer any modifier"sv;
+          failed = true;
+          return;
+        }
+
+        // The compositor allocates the buffers once it sees the fixated format, the others remain as a fallback
+        std::vector<std::uint64_t> fixated { ((const std::uint64_t *) SPA_POD_BODY(values))[0] };
+
+        auto params = enum_formats(&builder);
+        params.insert(std::begin(params), build_format(&builder, info.format, &fixated));
+        pw_stream_update_params(stream.get(), params.data(), params.size());
+        return;
+      }
+
+      dmabuf = modifier_prop != nullptr;
+      fourcc = format->fourcc;
+      modifier = dmabuf ? info.modifier : DRM_FORMAT_MOD_INVALID;
+
+      // The frames of the old format don't describe the damage of the new one
+      damage.reset();
+      stream_width = info.size.width;
+      stream_height = info.size.height;
+
+      auto data_types = dmabuf ? 1 << SPA_DATA_DmaBuf : (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd);
+      auto damage_size = (int) sizeof(spa_meta_region);
+      auto cursor_size = [](int size) {
+        return (int) (sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap) + size * size * 4);
+      };
+
+      const spa_pod *params[] {
+        (const spa_pod *) spa_pod_builder_add_object(&builder,
+          SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+          SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(data_types)),
+        (const spa_pod *) spa_pod_builder_add_object(&builder,
+          SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+          SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+          SPA_PARAM_META_size, SPA_POD_Int(sizeof(spa_meta_header))),
+        (const spa_pod *) spa_pod_builder_add_object(&builder,
+          SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+          SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+          SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(damage_size * 16, damage_size, damage_size * (int) MAX_DAMAGE_RECTS)),
+        (const spa_pod *) spa_pod_builder_add_object(&builder,
+          SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+          SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+          SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(cursor_size(64), cursor_size(1), cursor_size(MAX_CURSOR_SIZE))),
+      };
+      pw_stream_update_params(stream.get(), params, std::size(params));
+    }
+
+    static void
+    on_remove_buffer(void *data, pw_buffer *buffer) {
+      auto portal = (portal_t *) data;
+
+      if (portal->current == buffer) {
+        portal->current = nullptr;
+      }
+
+      if (portal->latest == buffer) {
+        portal->latest = nullptr;
+      }
+    }
+
+    static void
+    on_process(void *data) {
+      auto portal = (portal_t *) data;
+
+      while (auto buffer = pw_stream_dequeue_buffer(portal->stream.get())) {
+        portal->update_cursor(buffer->buffer);
+
+        // Buffers without content only move the cursor
+        auto header = (spa_meta_header *) spa_buffer_find_meta_data(buffer->buffer, SPA_META_Header, sizeof(spa_meta_header));
+        auto chunk = buffer->buffer->datas[0].chunk;
+        if ((header && (header->flags & SPA_META_HEADER_FLAG_CORRUPTED)) || (chunk->flags & SPA_CHUNK_FLAG_CORRUPTED) || !chunk->size) {
+          pw_stream_queue_buffer(portal->stream.get(), buffer);
+          continue;
+        }
+
+        portal->add_damage(buffer->buffer);
+
+        if (portal->latest) {
+          pw_stream_queue_buffer(portal->stream.get(), portal->latest);
+        }
+        portal->latest = buffer;
+
+        // The compositor stamps the frames with CLOCK_MONOTONIC, which is what steady_clock reads
+        auto now = std::chrono::steady_clock::now();
+        portal->latest_timestamp = now;
+        if (header && header->pts > 0) {
+          std::chrono::steady_clock::time_point pts { std::chrono::nanoseconds { header->pts } };
+          if (pts <= now && now - pts < 1s) {
+            portal->latest_timestamp = pts;
+          }
+        }
+      }
+
+      pw_thread_loop_signal(portal->loop.get(), false);
+    }
+
+    void
+    add_damage(spa_buffer *buffer) {
+      if (!damage) {
+        return;
+      }
+
+      auto meta = spa_buffer_find_meta(buffer, SPA_META_VideoDamage);
+      if (!meta) {
+        damage.reset();
+        return;
+      }
+
+      spa_meta_region *region;
+      spa_meta_for_each(region, meta) {
+        if (!spa_meta_region_is_valid(region)) {
+          break;
+        }
+
+        damage->emplace_back(platf::rect_t {
+          region->region.position.x,
+          region->region.position.y,
+          region->region.position.x + (std::int32_t) region->region.size.width,
+          region->region.position.y + (std::int32_t) region->region.size.height,
+        });
+      }
+
+      if (damage->size() > MAX_DAMAGE_RECTS) {
+        damage.reset();
+      }
+    }
+
+    void
+    update_cursor(spa_buffer *buffer) {
+      auto meta = (spa_meta_cursor *) spa_buffer_find_meta_data(buffer, SPA_META_Cursor, sizeof(spa_meta_cursor));
+      if (!meta) {
+        return;
+      }
+
+      // The compositor clears the cursor while it's outside the stream
+      if (!spa_meta_cursor_is_valid(meta)) {
+        cursor_updated |= stream_cursor.visible;
+        stream_cursor.visible = false;
+        return;
+      }
+
+      // The bitmap only comes along when the shape changed
+      if (meta->bitmap_offset >= sizeof(spa_meta_cursor)) {
+        auto bitmap = SPA_PTROFF(meta, meta->bitmap_offset, spa_meta_bitmap);
+        auto swap = bitmap->format == SPA_VIDEO_FORMAT_RGBA;
+
+        if (bitmap->size.width && bitmap->size.height && bitmap->offset >= sizeof(spa_meta_bitmap) &&
+            (swap || bitmap->format == SPA_VIDEO_FORMAT_BGRA)) {
+          auto src = SPA_PTROFF(bitmap, bitmap->offset, std::uint8_t);
+          auto row_bytes = bitmap->size.width * 4;
+
+          stream_cursor.width = bitmap->size.width;
+          stream_cursor.height = bitmap->size.height;
+          stream_cursor.pixels.resize(row_bytes * bitmap->size.height);
+
+          pixel::copy_rows(stream_cursor.pixels.data(), row_bytes, src, bitmap->stride, row_bytes, bitmap->size.height);
+          if (swap) {
+            for (std::size_t x = 0; x < stream_cursor.pixels.size(); x += 4) {
+              std::swap(stream_cursor.pixels[x], stream_cursor.pixels[x + 2]);
+            }
+          }
+
+          ++stream_cursor.serial;
+        }
+      }
+
+      auto x = meta->position.x - meta->hotspot.x;
+      auto y = meta->position.y - meta->hotspot.y;
+      cursor_updated |= !stream_cursor.visible || x != stream_cursor.x || y != stream_cursor.y || stream_cursor.serial != frame_cursor.serial;
+
+      stream_cursor.visible = stream_cursor.width > 0;
+      stream_cursor.x = x;
+      stream_cursor.y = y;
+    }
+
+    /**
+     * @brief Add where the cursor was and where it's now to the damage of the frame.
+     * @details The compositor leaves the cursor out of the damage when it sends it as metadata.
+     */
+    void
+    add_cursor_damage(bool cursor) {
+      std::optional<platf::rect_t> rect;
+      if (cursor && frame_cursor.visible) {
+        rect = platf::rect_t { frame_cursor.x, frame_cursor.y, frame_cursor.x + frame_cursor.width, frame_cursor.y + frame_cursor.height };
+      }
+
+      auto changed = rect.has_value() != last_cursor_rect.has_value() || last_cursor_serial != frame_cursor.serial ||
+                     (rect && (rect->left != last_cursor_rect->left || rect->top != last_cursor_rect->top));
+
+      if (frame_damage && changed) {
+        for (auto &cursor_rect : { last_cursor_rect, rect }) {
+          if (cursor_rect) {
+            frame_damage->emplace_back(*cursor_rect);
+          }
+        }
+      }
+
+      last_cursor_rect = rect;
+      last_cursor_serial = frame_cursor.serial;
+    }
+
+    int framerate;
+
+    spa_hook stream_listener {};
+
+    std::array<std::vector<std::uint64_t>, std::size(formats)> modifiers;
+
+    // Everything below is shared with the loop thread, guarded by the lock of the loop
+    bool failed = false;
+    int stream_width = 0;
+    int stream_height = 0;
+    std::uint32_t fourcc = 0;
+    std::uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+
+    // The latest buffer, not picked up by a snapshot yet
+    pw_buffer *latest = nullptr;
+    std::chrono::steady_clock::time_point latest_timestamp;
+
+    // Accumulated over the buffers since the last snapshot, unknown until the first one
+    std::optional<std::vector<platf::rect_t>> damage;
+
+    cursor_t stream_cursor;
+    bool cursor_updated = false;
+
+    // Drawn into the previous snapshot
+    std::optional<platf::rect_t> last_cursor_rect;
+    unsigned long last_cursor_serial = 0;
+  };
+
+  template <class T>
+  platf::capture_e
+  capture_loop(T &display, const platf::display_t::push_captured_image_cb_t &push_captured_image_cb, const platf::display_t::pull_free_image_cb_t &pull_free_image_cb, bool *cursor) {
+    while (true) {
+      std::shared_ptr<platf::img_t> img_out;
+      auto status = display.snapshot(pull_free_image_cb, img_out, 1000ms, *cursor);
+      switch (status) {
+        case platf::capture_e::reinit:
+        case platf::capture_e::error:
+        case platf::capture_e::interrupted:
+          return status;
+        case platf::capture_e::timeout:
+          if (!push_captured_image_cb(std::move(img_out), false)) {
+            return platf::capture_e::ok;
+          }
+          break;
+        case platf::capture_e::ok:
+          if (!push_captured_image_cb(std::move(img_out), true)) {
+            return platf::capture_e::ok;
+          }
+          break;
+        default:
+          BOOST_LOG(error) << "Unrecognized capture status ["sv << (int) status << ']';
+          return status;
+      }
+    }
+  }
+
+  class portal_ram_t: public portal_t {
+  public:
+    int
+    init(platf::mem_type_e hwdevice_type, const ::video::config_t &config) {
+      if (portal_t::init(hwdevice_type, config)) {
+        return -1;
+      }
+
+      // The stream may renegotiate DMA-BUFs later on, even if it started in shared memory
+      if (egl_display) {
+        auto ctx_opt = egl::make_ctx(egl_display.get());
+        if (!ctx_opt) {
+          return -1;
+        }
+
+        ctx = std::move(*ctx_opt);
+      }
+
+      return 0;
+    }
+
+    platf::capture_e
+    capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override {
+      return capture_loop(*this, push_captured_image_cb, pull_free_image_cb, cursor);
+    }
+
+    platf::capture_e
+    snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+      TRACE_SCOPE("capture.snapshot");
+      auto status = wait_for_frame(timeout, cursor);
+      if (status != platf::capture_e::ok) {
+        return status;
+      }
+
+      if (!pull_free_image_cb(img_out)) {
+        return platf::capture_e::interrupted;
+      }
+
+      pw::loop_lock_t lock { loop.get() };
+      if (!current) {
+        return platf::capture_e::reinit;
+      }
+
+      if (dmabuf) {
+        egl::surface_descriptor_t sd;
+        if (!describe_current(sd, false)) {
+          return platf::capture_e::reinit;
+        }
+
+        // The compositor cycles through the same few buffers
+        auto rgb = imports.import(egl_display.get(), sd);
+        if (!rgb) {
+          return platf::capture_e::error;
+        }
+
+        gl::ctx.GetTextureSubImage((*rgb)->tex[0], 0, 0, 0, 0, width, height, 1, GL_BGRA, GL_UNSIGNED_BYTE, img_out->height * img_out->row_pitch, img_out->data);
+      }
+      else {
+        auto &data = current->buffer->datas[0];
+        if (!data.data) {
+          BOOST_LOG(error) << "Couldn't map the buffer of the PipeWire stream"sv;
+          return platf::capture_e::error;
+        }
+
+        auto src = (const std::uint8_t *) data.data + data.chunk->offset;
+        pixel::copy_rows(img_out->data, img_out->row_pitch, src, data.chunk->stride, width * 4, height);
+      }
+
+      if (cursor && frame_cursor.visible) {
+        blend_cursor(*img_out);
+      }
+
+      img_out->frame_timestamp = frame_timestamp;
+      img_out->capture_sequence = capture_sequence;
+      img_out->damage = frame_damage;
+
+      return platf::capture_e::ok;
+    }
+
+    std::unique_ptr<platf::avcodec_encode_device_t>
+    make_avcodec_encode_device(platf::pix_fmt_e pix_fmt) override {
+      return std::make_unique<platf::avcodec_encode_device_t>();
+    }
+
+    std::shared_ptr<platf::img_t>
+    alloc_img() override {
+      auto img = std::make_shared<img_t>();
+      img->width = width;
+      img->height = height;
+      img->pixel_pitch = 4;
+      img->row_pitch = img->pixel_pitch * width;
+      img->data = (std::uint8_t *) memory::allocate(height * img->row_pitch);
+      if (!img->data) {
+        return nullptr;
+      }
+
+      return img;
+    }
+
+    int
+    dummy_img(platf::img_t *img) override {
+      std::fill_n(img->data, img->height * img->row_pitch, 0);
+      return 0;
+    }
+
+  private:
+    void
+    blend_cursor(platf::img_t &img) {
+      auto left = std::max(0, frame_cursor.x);
+      auto top = std::max(0, frame_cursor.y);
+      auto right = std::min(img.width, frame_cursor.x + frame_cursor.width);
+      auto bottom = std::min(img.height, frame_cursor.y + frame_cursor.height);
+
+      for (auto y = top; y < bottom; ++y) {
+        auto src = (const std::uint32_t *) frame_cursor.pixels.data() + (y - frame_cursor.y) * frame_cursor.width + (left - frame_cursor.x);
+        auto dst = (std::uint32_t *) (img.data + y * img.row_pitch) + left;
+
+        pixel::blend_alpha(dst, src, std::max(0, right - left));
+      }
+    }
+
+    egl::ctx_t ctx;
+
+    // Goes before the context and the display it imported into
+    egl::import_cache_t imports;
+  };
+
+  class portal_vram_t: public portal_t {
+  public:
+    platf::capture_e
+    capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override {
+      return capture_loop(*this, push_captured_image_cb, pull_free_image_cb, cursor);
+    }
+
+    platf::capture_e
+    snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+      TRACE_SCOPE("capture.snapshot");
+      auto status = wait_for_frame(timeout, cursor);
+      if (status != platf::capture_e::ok) {
+        return status;
+      }
+
+      if (!pull_free_image_cb(img_out)) {
+        return platf::capture_e::interrupted;
+      }
+
+      auto img = (egl::img_descriptor_t *) img_out.get();
+      img->reset();
+
+      {
+        pw::loop_lock_t lock { loop.get() };
+        if (!current) {
+          return platf::capture_e::reinit;
+        }
+
+        // The encode device imports the buffer itself, it gets descriptors of its own
+        if (!describe_current(img->sd, true)) {
+          img->reset();
+          return platf::capture_e::reinit;
+        }
+      }
+
+      // Frames that only moved the cursor keep the import of the previous one
+      if (new_frame) {
+        ++sequence;
+      }
+      img->sequence = sequence;
+
+      if (cursor && frame_cursor.visible) {
+        if (img->serial != frame_cursor.serial) {
+          img->buffer = frame_cursor.pixels;
+          img->serial = frame_cursor.serial;
+        }
+
+        img->x = frame_cursor.x;
+        img->y = frame_cursor.y;
+        img->src_w = frame_cursor.width;
+        img->src_h = frame_cursor.height;
+        img->width = frame_cursor.width;
+        img->height = frame_cursor.height;
+        img->pixel_pitch = 4;
+        img->row_pitch = img->pixel_pitch * img->width;
+        img->data = img->buffer.data();
+      }
+      else {
+        img->data = nullptr;
+      }
+
+      img->frame_timestamp = frame_timestamp;
+      img->capture_sequence = capture_sequence;
+      img->damage = frame_damage;
+
+      return platf::capture_e::ok;
+    }
+
+    std::shared_ptr<platf::img_t>
+    alloc_img() override {
+      auto img = std::make_shared<egl::img_descriptor_t>();
+
+      img->width = width;
+      img->height = height;
+      img->sequence = 0;
+      img->serial = std::numeric_limits<decltype(img->serial)>::max();
+      img->data = nullptr;
+
+      // File descriptors aren't open
+      std::fill_n(img->sd.fds, 4, -1);
+
+      return img;
+    }
+
+    bool
+    can_crop() override {
+      // The conversion through EGL copies the region out of the imported frame
+      return mem_type == platf::mem_type_e::vaapi || mem_type == platf::mem_type_e::vulkan || mem_type == platf::mem_type_e::cuda;
+    }
+
+    std::unique_ptr<platf::avcodec_encode_device_t>
+    make_avcodec_encode_device(platf::pix_fmt_e pix_fmt) override {
+      auto region = this->region();
+
+#ifdef SUNSHINE_BUILD_VAAPI
+      if (mem_type == platf::mem_type_e::vaapi) {
+        return va::make_avcodec_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top, true);
+      }
+#endif
+
+#ifdef SUNSHINE_BUILD_VULKAN
+      if (mem_type == platf::mem_type_e::vulkan) {
+        return vulkan::make_avcodec_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top, true);
+      }
+#endif
+
+#ifdef SUNSHINE_BUILD_CUDA
+      if (mem_type == platf::mem_type_e::cuda) {
+        return cuda::make_avcodec_gl_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top);
+      }
+#endif
+
+      return std::make_unique<platf::avcodec_encode_device_t>();
+    }
+
+#ifdef SUNSHINE_BUILD_CUDA
+    std::unique_ptr<platf::nvenc_encode_device_t>
+    make_nvenc_encode_device(platf::pix_fmt_e pix_fmt) override {
+      auto region = this->region();
+      return cuda::make_nvenc_gl_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top, pix_fmt);
+    }
+#endif
+
+    int
+    dummy_img(platf::img_t *img) override {
+      // Empty images are recognized as dummies by the zero sequence number
+      return 0;
+    }
+
+    std::uint64_t sequence {};
+  };
+}  // namespace portal
+
+namespace platf {
+  std::shared_ptr<display_t>
+  portal_display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config) {
+    if (hwdevice_type != platf::mem_type_e::system && hwdevice_type != platf::mem_type_e::vaapi && hwdevice_type != platf::mem_type_e::vulkan && hwdevice_type != platf::mem_type_e::cuda) {
+      BOOST_LOG(error) << "Could not initialize display with the given hw device type."sv;
+      return nullptr;
+    }
+
+    // The user picks the monitor in the dialog of the portal, the name is ignored
+    if (hwdevice_type == platf::mem_type_e::vaapi || hwdevice_type == platf::mem_type_e::vulkan || hwdevice_type == platf::mem_type_e::cuda) {
+      auto portal = std::make_shared<portal::portal_vram_t>();
+      if (portal->init(hwdevice_type, config)) {
+        return nullptr;
+      }
+
+      return portal;
+    }
+
+    auto portal = std::make_shared<portal::portal_ram_t>();
+    if (portal->init(hwdevice_type, config)) {
+      return nullptr;
+    }
+
+    return portal;
+  }
+
+  std::vector<std::string>
+  portal_display_names() {
+    auto connection = portal::session_bus();
+    if (!connection) {
+      return {};
+    }
+
+    // Only ask whether the portal can cast a monitor, starting a session would show its dialog
+    auto source_types = portal::screen_cast_property(connection.get(), "AvailableSourceTypes");
+    if (!source_types || !(*source_types & portal::SOURCE_TYPE_MONITOR)) {
+      BOOST_LOG(debug) << "xdg-desktop-portal can't cast a monitor"sv;
+      return {};
+    }
+
+    return { "0"s };
+  }
+}  // namespace platf
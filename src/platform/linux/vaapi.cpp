@@ -2,6 +2,7 @@
  * @file src/platform/linux/vaapi.cpp
  * @brief todo
  */
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -91,6 +92,9 @@ namespace va {
   int
   vaapi_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *encode_device, AVBufferRef **hw_device_buf);
 
+  static bool
+  has_entrypoint(display_t::pointer display, VAProfile profile, VAEntrypoint wanted);
+
   class va_t: public platf::avcodec_encode_device_t {
   public:
     int
@@ -211,6 +215,49 @@ namespace va {
       sws.apply_colorspace(colorspace);
     }
 
+    void
+    init_codec_options(AVCodecContext *ctx, AVDictionary **options) override {
+      // A retry with the fallback options has it disabled already
+      if (!config::video.vaapi.low_power || av_dict_get(*options, "low_power", nullptr, 0)) {
+        return;
+      }
+
+      auto profile = va_profile(ctx);
+      if (profile == VAProfileNone) {
+        return;
+      }
+
+      // Intel's fixed-function encoder, it skips the shader cores the full-power entrypoint keeps busy
+      if (has_entrypoint(va_display, profile, VAEntrypointEncSliceLP)) {
+        BOOST_LOG(info) << "Encoding through the low-power VAAPI entrypoint"sv;
+        av_dict_set_int(options, "low_power", 1, 0);
+      }
+      else {
+        BOOST_LOG(debug) << "The VAAPI driver has no low-power entrypoint for profile "sv << profile;
+      }
+    }
+
+    VAProfile
+    va_profile(const AVCodecContext *ctx) const {
+      auto ten_bit = colorspace.bit_depth == 10;
+
+      switch (ctx->codec_id) {
+        case AV_CODEC_ID_H264:
+          return ctx->profile == FF_PROFILE_H264_HIGH ? VAProfileH264High : VAProfileNone;
+        case AV_CODEC_ID_HEVC:
+          if (ctx->profile == FF_PROFILE_HEVC_REXT) {
+            return ten_bit ? VAProfileHEVCMain444_10 : VAProfileHEVCMain444;
+          }
+          return ten_bit ? VAProfileHEVCMain10 : VAProfileHEVCMain;
+#if VA_CHECK_VERSION(1, 8, 0)
+        case AV_CODEC_ID_AV1:
+          return ctx->profile == FF_PROFILE_AV1_HIGH ? VAProfileAV1Profile1 : VAProfileAV1Profile0;
+#endif
+        default:
+          return VAProfileNone;
+      }
+    }
+
     va::display_t::pointer va_display;
     file_t file;
 
@@ -234,7 +281,7 @@ namespace va {
     convert(platf::img_t &img) override {
       sws.load_ram(img);
 
-      sws.convert(nv12->buf);
+      sws.convert(nv12);
       return 0;
     }
   };
@@ -247,25 +294,21 @@ namespace va {
 
       if (descriptor.sequence == 0) {
         // For dummy images, use a blank RGB texture instead of importing a DMA-BUF
-        rgb = egl::create_blank(img);
+        blank = egl::create_blank(img);
+        rgb = &blank;
       }
       else if (descriptor.sequence > sequence) {
         sequence = descriptor.sequence;
 
-        rgb = egl::rgb_t {};
-
-        auto rgb_opt = egl::import_source(display.get(), descriptor.sd);
-
-        if (!rgb_opt) {
+        rgb = imports.import(display.get(), descriptor.sd);
+        if (!rgb) {
           return -1;
         }
-
-        rgb = std::move(*rgb_opt);
       }
 
-      sws.load_vram(descriptor, offset_x, offset_y, rgb->tex[0]);
+      sws.load_vram(descriptor, offset_x, offset_y, (*rgb)->tex[0]);
 
-      sws.convert(nv12->buf);
+      sws.convert(nv12);
       return 0;
     }
 
@@ -284,7 +327,11 @@ namespace va {
     }
 
     std::uint64_t sequence;
-    egl::rgb_t rgb;
+    egl::import_cache_t imports;
+    egl::rgb_t blank;
+
+    // The surface of the latest frame, an entry of the cache or the blank texture
+    egl::rgb_t *rgb = nullptr;
 
     int offset_x, offset_y;
   };
@@ -394,26 +441,35 @@ namespace va {
     return 0;
   }
 
-  static bool
-  query(display_t::pointer display, VAProfile profile) {
+  static std::vector<VAEntrypoint>
+  query_entrypoints(display_t::pointer display, VAProfile profile) {
     std::vector<VAEntrypoint> entrypoints;
     entrypoints.resize(vaMaxNumEntrypoints(display));
 
     int count;
     auto status = vaQueryConfigEntrypoints(display, profile, entrypoints.data(), &count);
     if (status) {
-      BOOST_LOG(error) << "Couldn't query entrypoints: "sv << vaErrorStr(status);
-      return false;
+      // Profiles the driver doesn't know at all are no error
+      if (status != VA_STATUS_ERROR_UNSUPPORTED_PROFILE) {
+        BOOST_LOG(error) << "Couldn't query entrypoints: "sv << vaErrorStr(status);
+      }
+      return {};
     }
     entrypoints.resize(count);
 
-    for (auto entrypoint : entrypoints) {
-      if (entrypoint == VAEntrypointEncSlice || entrypoint == VAEntrypointEncSliceLP) {
-        return true;
-      }
-    }
+    return entrypoints;
+  }
+
+  static bool
+  has_entrypoint(display_t::pointer display, VAProfile profile, VAEntrypoint wanted) {
+    auto entrypoints = query_entrypoints(display, profile);
 
-    return false;
+    return std::find(std::begin(entrypoints), std::end(entrypoints), wanted) != std::end(entrypoints);
+  }
+
+  static bool
+  query(display_t::pointer display, VAProfile profile) {
+    return has_entrypoint(display, profile, VAEntrypointEncSlice) || has_entrypoint(display, profile, VAEntrypointEncSliceLP);
   }
 
   bool
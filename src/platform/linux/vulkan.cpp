@@ -0,0 +1,330 @@
+/**
+ * @file src/platform/linux/vulkan.cpp
+ * @brief Encoding through the Vulkan Video encoders of FFmpeg.
+ */
+#include <algorithm>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <drm_fourcc.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext_drm.h>
+#include <libavutil/hwcontext_vulkan.h>
+}
+
+#include "graphics.h"
+#include "misc.h"
+#include "src/config.h"
+#include "src/logging.h"
+#include "src/platform/common.h"
+#include "src/utility.h"
+#include "src/video.h"
+#include "vulkan.h"
+
+using namespace std::literals;
+
+namespace vulkan {
+  int
+  vulkan_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *encode_device, AVBufferRef **hw_device_buf);
+
+  class vk_t: public platf::avcodec_encode_device_t {
+  public:
+    int
+    init(int in_width, int in_height, file_t &&render_device) {
+      file = std::move(render_device);
+
+      if (!gbm::create_device) {
+        BOOST_LOG(warning) << "libgbm not initialized"sv;
+        return -1;
+      }
+
+      this->data = (void *) vulkan_init_avcodec_hardware_input_buffer;
+
+      gbm.reset(gbm::create_device(file.el));
+      if (!gbm) {
+        char string[1024];
+        BOOST_LOG(error) << "Couldn't create GBM device: ["sv << strerror_r(errno, string, sizeof(string)) << ']';
+        return -1;
+      }
+
+      display = egl::make_display(gbm.get());
+      if (!display) {
+        return -1;
+      }
+
+      auto ctx_opt = egl::make_ctx(display.get());
+      if (!ctx_opt) {
+        return -1;
+      }
+
+      ctx = std::move(*ctx_opt);
+
+      width = in_width;
+      height = in_height;
+
+      return 0;
+    }
+
+    void
+    init_hwframes(AVHWFramesContext *frames) override {
+      // EGL can only render into the images if their layout is described by a DRM modifier
+      auto vk_frames = (AVVulkanFramesContext *) frames->hwctx;
+      vk_frames->tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+    }
+
+    int
+    set_frame(AVFrame *frame, AVBufferRef *hw_frames_ctx_buf) override {
+      this->hwframe.reset(frame);
+      this->frame = frame;
+
+      if (!frame->buf[0]) {
+        if (av_hwframe_get_buffer(hw_frames_ctx_buf, frame, 0)) {
+          BOOST_LOG(error) << "Couldn't get hwframe for Vulkan"sv;
+          return -1;
+        }
+      }
+
+      auto hw_frames_ctx = (AVHWFramesContext *) hw_frames_ctx_buf->data;
+      auto ten_bit = hw_frames_ctx->sw_format == AV_PIX_FMT_P010;
+
+      // The mapping lives as long as the frame, the DMA-BUFs of the image stay valid with it
+      prime.reset(av_frame_alloc());
+      prime->format = AV_PIX_FMT_DRM_PRIME;
+      if (auto err = av_hwframe_map(prime.get(), frame, AV_HWFRAME_MAP_WRITE | AV_HWFRAME_MAP_OVERWRITE); err < 0) {
+        char err_str[AV_ERROR_MAX_STRING_SIZE] { 0 };
+        BOOST_LOG(error) << "Couldn't export the Vulkan image as DMA-BUF: "sv << av_make_error_string(err_str, AV_ERROR_MAX_STRING_SIZE, err);
+        return -1;
+      }
+
+      auto prime_desc = (const AVDRMFrameDescriptor *) prime->data[0];
+      if (prime_desc->nb_objects > (int) egl::nv12_img_t::num_fds) {
+        BOOST_LOG(error) << "Invalid object count for the Vulkan image: "sv << prime_desc->nb_objects;
+        return -1;
+      }
+
+      // EGL owns the file descriptors it's given, the mapping keeps its own
+      std::array<file_t, egl::nv12_img_t::num_fds> fds;
+      for (int x = 0; x < prime_desc->nb_objects; ++x) {
+        fds[x] = dup(prime_desc->objects[x].fd);
+      }
+
+      egl::surface_descriptor_t sds[2] = {};
+      for (int plane = 0; plane < 2; ++plane) {
+        auto &sd = sds[plane];
+
+        // Either a layer for every plane, or a single layer of both planes
+        const AVDRMPlaneDescriptor *drm_plane;
+        if (prime_desc->nb_layers == 2 && prime_desc->layers[plane].nb_planes == 1) {
+          drm_plane = &prime_desc->layers[plane].planes[0];
+          sd.fourcc = prime_desc->layers[plane].format;
+        }
+        else if (prime_desc->nb_layers == 1 && prime_desc->layers[0].nb_planes == 2) {
+          drm_plane = &prime_desc->layers[0].planes[plane];
+          if (plane == 0) {
+            sd.fourcc = ten_bit ? DRM_FORMAT_R16 : DRM_FORMAT_R8;
+          }
+          else {
+            sd.fourcc = ten_bit ? DRM_FORMAT_GR1616 : DRM_FORMAT_GR88;
+          }
+        }
+        else {
+          BOOST_LOG(error) << "Invalid layout of the Vulkan image: "sv << prime_desc->nb_layers << " layers"sv;
+          return -1;
+        }
+
+        // UV plane is subsampled
+        sd.width = frame->width / (plane == 0 ? 1 : 2);
+        sd.height = frame->height / (plane == 0 ? 1 : 2);
+
+        sd.modifier = prime_desc->objects[drm_plane->object_index].format_modifier;
+
+        std::fill_n(sd.fds, 4, -1);
+        sd.fds[0] = fds[drm_plane->object_index].el;
+        sd.pitches[0] = drm_plane->pitch;
+        sd.offsets[0] = drm_plane->offset;
+      }
+
+      auto nv12_opt = egl::import_target(display.get(), std::move(fds), sds[0], sds[1]);
+      if (!nv12_opt) {
+        return -1;
+      }
+
+      auto sws_opt = egl::sws_t::make(width, height, frame->width, frame->height, hw_frames_ctx->sw_format);
+      if (!sws_opt) {
+        return -1;
+      }
+
+      this->sws = std::move(*sws_opt);
+      this->nv12 = std::move(*nv12_opt);
+
+      return 0;
+    }
+
+    void
+    apply_colorspace() override {
+      sws.apply_colorspace(colorspace);
+    }
+
+    /**
+     * @brief Wait for the conversion, Vulkan doesn't wait for the implicit fences of the DMA-BUFs.
+     */
+    void
+    finish() {
+      gl::ctx.Finish();
+    }
+
+    file_t file;
+
+    gbm::gbm_t gbm;
+    egl::display_t display;
+    egl::ctx_t ctx;
+
+    // These must be destroyed before the display, the mapping before the frame it maps
+    frame_t hwframe;
+    frame_t prime;
+
+    egl::sws_t sws;
+    egl::nv12_t nv12;
+
+    int width, height;
+  };
+
+  class vk_ram_t: public vk_t {
+  public:
+    int
+    convert(platf::img_t &img) override {
+      sws.load_ram(img);
+
+      sws.convert(nv12);
+      finish();
+      return 0;
+    }
+  };
+
+  class vk_vram_t: public vk_t {
+  public:
+    int
+    convert(platf::img_t &img) override {
+      auto &descriptor = (egl::img_descriptor_t &) img;
+
+      if (descriptor.sequence == 0) {
+        // For dummy images, use a blank RGB texture instead of importing a DMA-BUF
+        blank = egl::create_blank(img);
+        rgb = &blank;
+      }
+      else if (descriptor.sequence > sequence) {
+        sequence = descriptor.sequence;
+
+        rgb = imports.import(display.get(), descriptor.sd);
+        if (!rgb) {
+          return -1;
+        }
+      }
+
+      sws.load_vram(descriptor, offset_x, offset_y, (*rgb)->tex[0]);
+
+      sws.convert(nv12);
+      finish();
+      return 0;
+    }
+
+    int
+    init(int in_width, int in_height, file_t &&render_device, int offset_x, int offset_y) {
+      if (vk_t::init(in_width, in_height, std::move(render_device))) {
+        return -1;
+      }
+
+      sequence = 0;
+
+      this->offset_x = offset_x;
+      this->offset_y = offset_y;
+
+      return 0;
+    }
+
+    std::uint64_t sequence;
+    egl::import_cache_t imports;
+    egl::rgb_t blank;
+
+    // The surface of the latest frame, an entry of the cache or the blank texture
+    egl::rgb_t *rgb = nullptr;
+
+    int offset_x, offset_y;
+  };
+
+  static void
+  drm_hwdevice_ctx_free(AVHWDeviceContext *ctx) {
+    auto hwctx = (AVDRMDeviceContext *) ctx->hwctx;
+
+    close(hwctx->fd);
+  }
+
+  /**
+   * @brief Create the DRM device of the render device, the Vulkan device of the same GPU is derived from it.
+   */
+  int
+  vulkan_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *base, AVBufferRef **hw_device_buf) {
+    auto vk = (vk_t *) base;
+
+    *hw_device_buf = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_DRM);
+    auto ctx = (AVHWDeviceContext *) (*hw_device_buf)->data;
+    auto hwctx = (AVDRMDeviceContext *) ctx->hwctx;
+
+    hwctx->fd = dup(vk->file.el);
+    ctx->free = drm_hwdevice_ctx_free;
+
+    auto err = av_hwdevice_ctx_init(*hw_device_buf);
+    if (err) {
+      char err_str[AV_ERROR_MAX_STRING_SIZE] { 0 };
+      BOOST_LOG(error) << "Failed to create FFMpeg hardware device context: "sv << av_make_error_string(err_str, AV_ERROR_MAX_STRING_SIZE, err);
+
+      return err;
+    }
+
+    return 0;
+  }
+
+  std::unique_ptr<platf::avcodec_encode_device_t>
+  make_avcodec_encode_device(int width, int height, file_t &&card, int offset_x, int offset_y, bool vram) {
+    if (vram) {
+      auto egl = std::make_unique<vk_vram_t>();
+      if (egl->init(width, height, std::move(card), offset_x, offset_y)) {
+        return nullptr;
+      }
+
+      return egl;
+    }
+
+    else {
+      auto egl = std::make_unique<vk_ram_t>();
+      if (egl->init(width, height, std::move(card))) {
+        return nullptr;
+      }
+
+      return egl;
+    }
+  }
+
+  std::unique_ptr<platf::avcodec_encode_device_t>
+  make_avcodec_encode_device(int width, int height, int offset_x, int offset_y, bool vram) {
+    auto render_device = config::video.adapter_name.empty() ? "/dev/dri/renderD128" : config::video.adapter_name.c_str();
+
+    file_t file = open(render_device, O_RDWR);
+    if (file.el < 0) {
+      char string[1024];
+      BOOST_LOG(error) << "Couldn't open "sv << render_device << ": " << strerror_r(errno, string, sizeof(string));
+
+      return nullptr;
+    }
+
+    return make_avcodec_encode_device(width, height, std::move(file), offset_x, offset_y, vram);
+  }
+
+  std::unique_ptr<platf::avcodec_encode_device_t>
+  make_avcodec_encode_device(int width, int height, bool vram) {
+    return make_avcodec_encode_device(width, height, 0, 0, vram);
+  }
+}  // namespace vulkan
@@ -0,0 +1,44 @@
+/**
+ * @file src/platform/linux/vulkan.h
+ * @brief Encoding through the Vulkan Video encoders of FFmpeg.
+ */
+#pragma once
+
+#include "misc.h"
+#include "src/platform/common.h"
+
+namespace vulkan {
+  /**
+   * @brief Create an encoding device that renders the captured frames into the Vulkan images of FFmpeg.
+   * @details The images are exported as DMA-BUFs and rendered into through EGL, the same way the VAAPI
+   *          surfaces are, so the captured DMA-BUFs reach the encoder without a copy through RAM.
+   * @param width Width of the captured frames.
+   * @param height Height of the captured frames.
+   * @param card The render device of the encoding GPU.
+   * @param offset_x Offset of the content in the captured frame.
+   * @param offset_y Offset of the content in the captured frame.
+   * @param vram Whether the captured frames are DMA-BUFs rather than images in RAM.
+   */
+  std::unique_ptr<platf::avcodec_encode_device_t>
+  make_avcodec_encode_device(int width, int height, file_t &&card, int offset_x, int offset_y, bool vram);
+
+  /**
+   * @brief Create an encoding device on the configured adapter, or `/dev/dri/renderD128` without one.
+   * @param width Width of the captured frames.
+   * @param height Height of the captured frames.
+   * @param offset_x Offset of the content in the captured frame.
+   * @param offset_y Offset of the content in the captured frame.
+   * @param vram Whether the captured frames are DMA-BUFs rather than images in RAM.
+   */
+  std::unique_ptr<platf::avcodec_encode_device_t>
+  make_avcodec_encode_device(int width, int height, int offset_x, int offset_y, bool vram);
+
+  /**
+   * @brief Create an encoding device on the configured adapter for content that fills the captured frame.
+   * @param width Width of the captured frames.
+   * @param height Height of the captured frames.
+   * @param vram Whether the captured frames are DMA-BUFs rather than images in RAM.
+   */
+  std::unique_ptr<platf::avcodec_encode_device_t>
+  make_avcodec_encode_device(int width, int height, bool vram);
+}  // namespace vulkan
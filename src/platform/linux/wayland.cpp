@@ -94,6 +94,11 @@ namespace wl {
     return true;
   }
 
+  void
+  display_t::flush() {
+    wl_display_flush(display_internal.get());
+  }
+
   wl_registry *
   display_t::registry() {
     return wl_display_get_registry(display_internal.get());
@@ -210,6 +210,10 @@ namespace wl {
     bool
     dispatch(std::chrono::milliseconds timeout);
 
+    // Send the requests that are still buffered
+    void
+    flush();
+
     // Get the registry associated with the display
     // No need to manually free the registry
     wl_registry *
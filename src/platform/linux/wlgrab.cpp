@@ -7,10 +7,13 @@
 #include "src/platform/common.h"
 
 #include "src/logging.h"
+#include "src/memory.h"
+#include "src/trace.h"
 #include "src/video.h"
 
 #include "cuda.h"
 #include "vaapi.h"
+#include "vulkan.h"
 #include "wayland.h"
 
 using namespace std::literals;
@@ -20,7 +23,7 @@ namespace wl {
 
   struct img_t: public platf::img_t {
     ~img_t() override {
-      delete[] data;
+      memory::free(data);
       data = nullptr;
     }
   };
@@ -90,8 +93,12 @@ namespace wl {
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
       auto to = std::chrono::steady_clock::now() + timeout;
 
+      // The previous snapshot requested this frame already, unless it timed out before it arrived
+      if (dmabuf.status != dmabuf_t::WAITING) {
+        dmabuf.listen(interface.dmabuf_manager, output, cursor);
+      }
+
       // Dispatch events until we get a new frame or the timeout expires
-      dmabuf.listen(interface.dmabuf_manager, output, cursor);
       do {
         auto remaining_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(to - std::chrono::steady_clock::now());
         if (remaining_time_ms.count() < 0 || !display.dispatch(remaining_time_ms)) {
@@ -108,6 +115,11 @@ namespace wl {
         return platf::capture_e::reinit;
       }
 
+      // The compositor exports the next frame while this one is processed. Its buffer goes into the other
+      // frame, the current one isn't touched before the next dispatch.
+      dmabuf.listen(interface.dmabuf_manager, output, cursor);
+      display.flush();
+
       return platf::capture_e::ok;
     }
 
@@ -153,6 +165,7 @@ namespace wl {
 
     platf::capture_e
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+      TRACE_SCOPE("capture.snapshot");
       auto status = wlr_t::snapshot(pull_free_image_cb, img_out, timeout, cursor);
       if (status != platf::capture_e::ok) {
         return status;
@@ -160,7 +173,8 @@ namespace wl {
 
       auto current_frame = dmabuf.current_frame;
 
-      auto rgb_opt = egl::import_source(egl_display.get(), current_frame->sd);
+      // The compositor hands out the same few buffers over and over
+      auto rgb_opt = imports.import(egl_display.get(), current_frame->sd);
 
       if (!rgb_opt) {
         return platf::capture_e::reinit;
@@ -213,6 +227,12 @@ namespace wl {
       }
 #endif
 
+#ifdef SUNSHINE_BUILD_VULKAN
+      if (mem_type == platf::mem_type_e::vulkan) {
+        return vulkan::make_avcodec_encode_device(width, height, false);
+      }
+#endif
+
 #ifdef SUNSHINE_BUILD_CUDA
       if (mem_type == platf::mem_type_e::cuda) {
         return cuda::make_avcodec_encode_device(width, height, false);
@@ -222,6 +242,13 @@ namespace wl {
       return std::make_unique<platf::avcodec_encode_device_t>();
     }
 
+#ifdef SUNSHINE_BUILD_CUDA
+    std::unique_ptr<platf::nvenc_encode_device_t>
+    make_nvenc_encode_device(platf::pix_fmt_e pix_fmt) override {
+      return cuda::make_nvenc_encode_device(width, height, false, pix_fmt);
+    }
+#endif
+
     std::shared_ptr<platf::img_t>
     alloc_img() override {
       auto img = std::make_shared<img_t>();
@@ -229,13 +256,19 @@ namespace wl {
       img->height = height;
       img->pixel_pitch = 4;
       img->row_pitch = img->pixel_pitch * width;
-      img->data = new std::uint8_t[height * img->row_pitch];
+      img->data = (std::uint8_t *) memory::allocate(height * img->row_pitch);
+      if (!img->data) {
+        return nullptr;
+      }
 
       return img;
     }
 
     egl::display_t egl_display;
     egl::ctx_t ctx;
+
+    // Goes before the context and the display it imported into
+    egl::import_cache_t imports;
   };
 
   class wlr_vram_t: public wlr_t {
@@ -271,6 +304,7 @@ namespace wl {
 
     platf::capture_e
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+      TRACE_SCOPE("capture.snapshot");
       auto status = wlr_t::snapshot(pull_free_image_cb, img_out, timeout, cursor);
       if (status != platf::capture_e::ok) {
         return status;
@@ -311,23 +345,45 @@ namespace wl {
       return img;
     }
 
+    bool
+    can_crop() override {
+      // The conversion through EGL copies the region out of the imported frame
+      return mem_type == platf::mem_type_e::vaapi || mem_type == platf::mem_type_e::vulkan || mem_type == platf::mem_type_e::cuda;
+    }
+
     std::unique_ptr<platf::avcodec_encode_device_t>
     make_avcodec_encode_device(platf::pix_fmt_e pix_fmt) override {
+      auto region = this->region();
+
 #ifdef SUNSHINE_BUILD_VAAPI
       if (mem_type == platf::mem_type_e::vaapi) {
-        return va::make_avcodec_encode_device(width, height, 0, 0, true);
+        return va::make_avcodec_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top, true);
+      }
+#endif
+
+#ifdef SUNSHINE_BUILD_VULKAN
+      if (mem_type == platf::mem_type_e::vulkan) {
+        return vulkan::make_avcodec_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top, true);
       }
 #endif
 
 #ifdef SUNSHINE_BUILD_CUDA
       if (mem_type == platf::mem_type_e::cuda) {
-        return cuda::make_avcodec_gl_encode_device(width, height, 0, 0);
+        return cuda::make_avcodec_gl_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top);
       }
 #endif
 
       return std::make_unique<platf::avcodec_encode_device_t>();
     }
 
+#ifdef SUNSHINE_BUILD_CUDA
+    std::unique_ptr<platf::nvenc_encode_device_t>
+    make_nvenc_encode_device(platf::pix_fmt_e pix_fmt) override {
+      auto region = this->region();
+      return cuda::make_nvenc_gl_encode_device(region.right - region.left, region.bottom - region.top, region.left, region.top, pix_fmt);
+    }
+#endif
+
     int
     dummy_img(platf::img_t *img) override {
       // Empty images are recognized as dummies by the zero sequence number
@@ -342,12 +398,12 @@ namespace wl {
 namespace platf {
   std::shared_ptr<display_t>
   wl_display(mem_type_e hwdevice_type, const std::string &display_name, const video::config_t &config) {
-    if (hwdevice_type != platf::mem_type_e::system && hwdevice_type != platf::mem_type_e::vaapi && hwdevice_type != platf::mem_type_e::cuda) {
+    if (hwdevice_type != platf::mem_type_e::system && hwdevice_type != platf::mem_type_e::vaapi && hwdevice_type != platf::mem_type_e::vulkan && hwdevice_type != platf::mem_type_e::cuda) {
       BOOST_LOG(error) << "Could not initialize display with the given hw device type."sv;
       return nullptr;
     }
 
-    if (hwdevice_type == platf::mem_type_e::vaapi || hwdevice_type == platf::mem_type_e::cuda) {
+    if (hwdevice_type == platf::mem_type_e::vaapi || hwdevice_type == platf::mem_type_e::vulkan || hwdevice_type == platf::mem_type_e::cuda) {
       auto wlr = std::make_shared<wl::wlr_vram_t>();
       if (wlr->init(hwdevice_type, display_name, config)) {
         return nullptr;
@@ -4,12 +4,16 @@
  */
 #include "src/platform/common.h"
 
+#include <cstring>
 #include <fstream>
 #include <thread>
 
+#include <poll.h>
+
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrandr.h>
 #include <sys/ipc.h>
@@ -18,15 +22,20 @@
 #include <xcb/xfixes.h>
 
 #include "src/config.h"
+#include "src/cursor.h"
 #include "src/globals.h"
 #include "src/logging.h"
+#include "src/memory.h"
+#include "src/pixel.h"
 #include "src/task_pool.h"
+#include "src/trace.h"
 #include "src/video.h"
 
 #include "cuda.h"
 #include "graphics.h"
 #include "misc.h"
 #include "vaapi.h"
+#include "vulkan.h"
 #include "x11grab.h"
 
 using namespace std::literals;
@@ -61,6 +70,30 @@ namespace platf {
     _FN(CloseDisplay, int, (Display * display));
     _FN(Free, int, (void *data));
     _FN(InitThreads, Status, (void) );
+    _FN(Pending, int, (Display * display));
+    _FN(NextEvent, int, (Display * display, XEvent *event_return));
+    _FN(QueryPointer, Bool,
+      (
+        Display * display,
+        Window w,
+        Window *root_return, Window *child_return,
+        int *root_x_return, int *root_y_return,
+        int *win_x_return, int *win_y_return,
+        unsigned int *mask_return));
+    _FN(QueryTree, Status,
+      (
+        Display * display,
+        Window w,
+        Window *root_return, Window *parent_return,
+        Window **children_return, unsigned int *nchildren_return));
+    _FN(FetchName, Status, (Display * display, Window w, char **window_name_return));
+    _FN(TranslateCoordinates, Bool,
+      (
+        Display * display,
+        Window src_w, Window dest_w,
+        int src_x, int src_y,
+        int *dest_x_return, int *dest_y_return,
+        Window *child_return));
 
     namespace rr {
       _FN(GetScreenResources, XRRScreenResources *, (Display * dpy, Window window));
@@ -104,6 +137,11 @@ namespace platf {
     }  // namespace rr
     namespace fix {
       _FN(GetCursorImage, XFixesCursorImage *, (Display * dpy));
+      _FN(QueryExtension, Bool, (Display * dpy, int *event_base_return, int *error_base_return));
+      _FN(SelectCursorInput, void, (Display * dpy, Window win, unsigned long eventMask));
+      _FN(CreateRegion, XserverRegion, (Display * dpy, XRectangle *rectangles, int nrectangles));
+      _FN(DestroyRegion, void, (Display * dpy, XserverRegion region));
+      _FN(FetchRegion, XRectangle *, (Display * dpy, XserverRegion region, int *nrectanglesRet));
 
       static int
       init() {
@@ -121,6 +159,11 @@ namespace platf {
 
         std::vector<std::tuple<dyn::apiproc *, const char *>> funcs {
           { (dyn::apiproc *) &GetCursorImage, "XFixesGetCursorImage" },
+          { (dyn::apiproc *) &QueryExtension, "XFixesQueryExtension" },
+          { (dyn::apiproc *) &SelectCursorInput, "XFixesSelectCursorInput" },
+          { (dyn::apiproc *) &CreateRegion, "XFixesCreateRegion" },
+          { (dyn::apiproc *) &DestroyRegion, "XFixesDestroyRegion" },
+          { (dyn::apiproc *) &FetchRegion, "XFixesFetchRegion" },
         };
 
         if (dyn::load(handle, funcs)) {
@@ -132,6 +175,43 @@ namespace platf {
       }
     }  // namespace fix
 
+    // Optional, without it every frame is copied
+    namespace damage {
+      _FN(QueryExtension, Bool, (Display * dpy, int *event_base_return, int *error_base_return));
+      _FN(Create, Damage, (Display * dpy, Drawable drawable, int level));
+      _FN(Destroy, void, (Display * dpy, Damage damage));
+      _FN(Subtract, void, (Display * dpy, Damage damage, XserverRegion repair, XserverRegion parts));
+
+      static int
+      init() {
+        static void *handle { nullptr };
+        static bool funcs_loaded = false;
+
+        if (funcs_loaded) return 0;
+
+        if (!handle) {
+          handle = dyn::handle({ "libXdamage.so.1", "libXdamage.so" });
+          if (!handle) {
+            return -1;
+          }
+        }
+
+        std::vector<std::tuple<dyn::apiproc *, const char *>> funcs {
+          { (dyn::apiproc *) &QueryExtension, "XDamageQueryExtension" },
+          { (dyn::apiproc *) &Create, "XDamageCreate" },
+          { (dyn::apiproc *) &Destroy, "XDamageDestroy" },
+          { (dyn::apiproc *) &Subtract, "XDamageSubtract" },
+        };
+
+        if (dyn::load(handle, funcs)) {
+          return -1;
+        }
+
+        funcs_loaded = true;
+        return 0;
+      }
+    }  // namespace damage
+
     static int
     init() {
       static void *handle { nullptr };
@@ -153,6 +233,12 @@ namespace platf {
         { (dyn::apiproc *) &Free, "XFree" },
         { (dyn::apiproc *) &CloseDisplay, "XCloseDisplay" },
         { (dyn::apiproc *) &InitThreads, "XInitThreads" },
+        { (dyn::apiproc *) &Pending, "XPending" },
+        { (dyn::apiproc *) &NextEvent, "XNextEvent" },
+        { (dyn::apiproc *) &QueryPointer, "XQueryPointer" },
+        { (dyn::apiproc *) &QueryTree, "XQueryTree" },
+        { (dyn::apiproc *) &FetchName, "XFetchName" },
+        { (dyn::apiproc *) &TranslateCoordinates, "XTranslateCoordinates" },
       };
 
       if (dyn::load(handle, funcs)) {
@@ -320,24 +406,27 @@ namespace platf {
     void *data;
   };
 
-  struct x11_img_t: public img_t {
+  struct x11_img_t: public egl::ram_img_t {
     ximg_t img;
   };
 
-  struct shm_img_t: public img_t {
+  struct shm_img_t: public egl::ram_img_t {
     ~shm_img_t() override {
-      delete[] data;
+      memory::free(data);
       data = nullptr;
     }
   };
 
-  static void
+  /**
+   * @return Where the cursor was drawn, empty if it wasn't.
+   */
+  static std::optional<rect_t>
   blend_cursor(Display *display, img_t &img, int offsetX, int offsetY) {
     xcursor_t overlay { x11::fix::GetCursorImage(display) };
 
     if (!overlay) {
       BOOST_LOG(error) << "Couldn't get cursor from XFixesGetCursorImage"sv;
-      return;
+      return std::nullopt;
     }
 
     overlay->x -= overlay->xhot;
@@ -349,39 +438,292 @@ namespace platf {
     overlay->x = std::max((short) 0, overlay->x);
     overlay->y = std::max((short) 0, overlay->y);
 
-    auto pixels = (int *) img.data;
+    auto pixels = (std::uint32_t *) img.data;
 
     auto screen_height = img.height;
     auto screen_width = img.width;
 
     auto delta_height = std::min<uint16_t>(overlay->height, std::max(0, screen_height - overlay->y));
     auto delta_width = std::min<uint16_t>(overlay->width, std::max(0, screen_width - overlay->x));
+
+    // XFixes hands out every pixel in a long, the blend works on packed rows
+    std::vector<std::uint32_t> row(delta_width);
     for (auto y = 0; y < delta_height; ++y) {
       auto overlay_begin = &overlay->pixels[y * overlay->width];
-      auto overlay_end = &overlay->pixels[y * overlay->width + delta_width];
+      std::copy_n(overlay_begin, delta_width, row.begin());
 
       auto pixels_begin = &pixels[(y + overlay->y) * (img.row_pitch / img.pixel_pitch) + overlay->x];
+      pixel::blend_alpha(pixels_begin, row.data(), delta_width);
+    }
 
-      std::for_each(overlay_begin, overlay_end, [&](long pixel) {
-        int *pixel_p = (int *) &pixel;
+    if (!delta_width || !delta_height) {
+      return std::nullopt;
+    }
 
-        auto colors_in = (uint8_t *) pixels_begin;
+    return rect_t { overlay->x, overlay->y, overlay->x + delta_width, overlay->y + delta_height };
+  }
 
-        auto alpha = (*(uint *) pixel_p) >> 24u;
-        if (alpha == 255) {
-          *pixels_begin = *pixel_p;
-        }
-        else {
-          auto colors_out = (uint8_t *) pixel_p;
-          colors_in[0] = colors_out[0] + (colors_in[0] * (255 - alpha) + 255 / 2) / 255;
-          colors_in[1] = colors_out[1] + (colors_in[1] * (255 - alpha) + 255 / 2) / 255;
-          colors_in[2] = colors_out[2] + (colors_in[2] * (255 - alpha) + 255 / 2) / 255;
-        }
-        ++pixels_begin;
+  /**
+   * @brief Capture the cursor without blending it, its pixels are only converted when its shape changed.
+   * @return false if there's no cursor, its data is then nullptr.
+   */
+  static bool
+  capture_cursor(Display *display, egl::cursor_t &img, int offsetX, int offsetY) {
+    xcursor_t xcursor { x11::fix::GetCursorImage(display) };
+
+    if (!xcursor) {
+      img.data = nullptr;
+      return false;
+    }
+
+    if (!img.data || img.serial != xcursor->cursor_serial) {
+      auto buf_size = xcursor->width * xcursor->height * sizeof(int);
+
+      if (img.buffer.size() < buf_size) {
+        img.buffer.resize(buf_size);
+      }
+
+      std::transform(xcursor->pixels, xcursor->pixels + buf_size / 4, (int *) img.buffer.data(), [](long pixel) -> int {
+        return pixel;
       });
     }
+
+    img.data = img.buffer.data();
+    img.width = img.src_w = xcursor->width;
+    img.height = img.src_h = xcursor->height;
+    img.x = xcursor->x - xcursor->xhot - offsetX;
+    img.y = xcursor->y - xcursor->yhot - offsetY;
+    img.pixel_pitch = 4;
+    img.row_pitch = img.pixel_pitch * img.width;
+    img.serial = xcursor->cursor_serial;
+
+    return true;
+  }
+
+  /**
+   * @brief Publish the cursor for clients that draw it themselves, its pixels are only converted when its shape changed.
+   * @param serial Serial of the last published shape.
+   */
+  static void
+  publish_cursor(Display *display, int offsetX, int offsetY, unsigned long &serial) {
+    xcursor_t xcursor { x11::fix::GetCursorImage(display) };
+
+    if (!xcursor) {
+      cursor::update_position(0, 0, false);
+      return;
+    }
+
+    if (serial != xcursor->cursor_serial) {
+      // XFixes hands out every premultiplied pixel in a long
+      std::vector<std::uint32_t> pixels(xcursor->pixels, xcursor->pixels + xcursor->width * xcursor->height);
+      cursor::update_shape(xcursor->width, xcursor->height, xcursor->xhot, xcursor->yhot, (const std::uint8_t *) pixels.data(), xcursor->width * 4);
+      serial = xcursor->cursor_serial;
+    }
+
+    cursor::update_position(xcursor->x - xcursor->xhot - offsetX, xcursor->y - xcursor->yhot - offsetY, true);
   }
 
+  /**
+   * @brief Tells what changed in the captured part of the root window, through XDamage.
+   * @details The tracker has a connection of its own, the refresh task and the cursor use the others.
+   *          The cursor isn't part of the root window, so moving it doesn't damage anything. Its shape
+   *          changes are reported by XFixes, its position is polled.
+   */
+  class damage_tracker_t {
+  public:
+    damage_tracker_t() = default;
+    damage_tracker_t(const damage_tracker_t &) = delete;
+    damage_tracker_t &
+    operator=(const damage_tracker_t &) = delete;
+
+    ~damage_tracker_t() {
+      if (region) {
+        x11::fix::DestroyRegion(xdisplay.get(), region);
+      }
+      if (damage) {
+        x11::damage::Destroy(xdisplay.get(), damage);
+      }
+    }
+
+    /**
+     * @return false if XDamage is unavailable, every frame must be copied then.
+     */
+    bool
+    init(int offset_x, int offset_y, int width, int height) {
+      if (x11::damage::init()) {
+        BOOST_LOG(info) << "libXdamage is unavailable, every frame is copied"sv;
+        return false;
+      }
+
+      xdisplay.reset(x11::OpenDisplay(nullptr));
+      if (!xdisplay) {
+        return false;
+      }
+
+      int error_base;
+      if (!x11::damage::QueryExtension(xdisplay.get(), &damage_event_base, &error_base) ||
+          !x11::fix::QueryExtension(xdisplay.get(), &fixes_event_base, &error_base)) {
+        BOOST_LOG(info) << "The X server doesn't support XDamage, every frame is copied"sv;
+        return false;
+      }
+
+      auto root = DefaultRootWindow(xdisplay.get());
+      damage = x11::damage::Create(xdisplay.get(), root, XDamageReportNonEmpty);
+      region = x11::fix::CreateRegion(xdisplay.get(), nullptr, 0);
+      x11::fix::SelectCursorInput(xdisplay.get(), root, XFixesDisplayCursorNotifyMask);
+
+      area = { offset_x, offset_y, offset_x + width, offset_y + height };
+      return true;
+    }
+
+    explicit operator bool() const {
+      return damage;
+    }
+
+    /**
+     * @brief The next wait reports the whole frame as changed.
+     */
+    void
+    invalidate() {
+      invalid = true;
+    }
+
+    /**
+     * @brief Wait until the captured area changes, or the cursor moves or changes its shape.
+     * @param cursor Whether the cursor is captured as well.
+     * @param interval How often the position of the cursor is polled.
+     * @param damage_out Where the frame changed relative to the captured area, std::nullopt if unknown.
+     * @return false if nothing changed before the timeout.
+     */
+    bool
+    wait(std::chrono::milliseconds timeout, bool cursor, std::chrono::nanoseconds interval, std::optional<std::vector<rect_t>> &damage_out) {
+      auto deadline = std::chrono::steady_clock::now() + timeout;
+
+      while (true) {
+        auto damaged = drain() || invalid;
+
+        if (damaged) {
+          damage_out = fetch();
+          if (invalid) {
+            invalid = false;
+            damage_out = std::nullopt;
+            return true;
+          }
+          if (!damage_out->empty()) {
+            return true;
+          }
+        }
+
+        if (cursor && cursor_changed()) {
+          damage_out.emplace();
+          return true;
+        }
+
+        // Clients that draw the cursor themselves only need it published, the frame didn't change
+        if (!cursor && cursor::enabled() && cursor_changed()) {
+          publish_cursor(xdisplay.get(), area.left, area.top, cursor_serial);
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+          return false;
+        }
+        if (cursor || cursor::enabled()) {
+          remaining = std::min(remaining, std::max(1ms, std::chrono::duration_cast<std::chrono::milliseconds>(interval)));
+        }
+
+        pollfd fd { ConnectionNumber(xdisplay.get()), POLLIN, 0 };
+        poll(&fd, 1, remaining.count());
+      }
+    }
+
+  private:
+    /**
+     * @return Whether the root window was damaged, the events are all consumed.
+     */
+    bool
+    drain() {
+      bool damaged = false;
+      while (x11::Pending(xdisplay.get())) {
+        XEvent event;
+        x11::NextEvent(xdisplay.get(), &event);
+
+        if (event.type == damage_event_base + XDamageNotify) {
+          damaged = true;
+        }
+        else if (event.type == fixes_event_base + XFixesCursorNotify) {
+          shape_changed = true;
+        }
+      }
+
+      return damaged;
+    }
+
+    /**
+     * @brief Take the damage accumulated since the last call, clipped to the captured area.
+     */
+    std::vector<rect_t>
+    fetch() {
+      x11::damage::Subtract(xdisplay.get(), damage, None, region);
+
+      int count = 0;
+      auto rects = x11::fix::FetchRegion(xdisplay.get(), region, &count);
+
+      std::vector<rect_t> result;
+      for (int x = 0; x < count; ++x) {
+        rect_t rect {
+          std::max<std::int32_t>(area.left, rects[x].x) - area.left,
+          std::max<std::int32_t>(area.top, rects[x].y) - area.top,
+          std::min<std::int32_t>(area.right, rects[x].x + rects[x].width) - area.left,
+          std::min<std::int32_t>(area.bottom, rects[x].y + rects[x].height) - area.top,
+        };
+
+        if (rect.left < rect.right && rect.top < rect.bottom) {
+          result.emplace_back(rect);
+        }
+      }
+
+      if (rects) {
+        x11::Free(rects);
+      }
+
+      return result;
+    }
+
+    bool
+    cursor_changed() {
+      Window root, child;
+      int x, y, win_x, win_y;
+      unsigned int mask;
+      if (!x11::QueryPointer(xdisplay.get(), DefaultRootWindow(xdisplay.get()), &root, &child, &x, &y, &win_x, &win_y, &mask)) {
+        return false;
+      }
+
+      bool changed = shape_changed || x != cursor_x || y != cursor_y;
+      shape_changed = false;
+      cursor_x = x;
+      cursor_y = y;
+
+      return changed;
+    }
+
+    x11::xdisplay_t xdisplay;
+    Damage damage {};
+    XserverRegion region {};
+
+    int damage_event_base;
+    int fixes_event_base;
+
+    // The captured part of the root window
+    rect_t area;
+
+    bool invalid = true;
+    bool shape_changed = false;
+    int cursor_x = -1;
+    int cursor_y = -1;
+    unsigned long cursor_serial = 0;
+  };
+
   struct x11_attr_t: public display_t {
     x11::xdisplay_t xdisplay;
     Window xwindow;
@@ -389,6 +731,19 @@ namespace platf {
 
     mem_type_e mem_type;
 
+    damage_tracker_t damage_tracker;
+
+    // Interval of the frames, the cursor position is polled as often while nothing else changes
+    std::chrono::nanoseconds delay;
+
+    std::uint64_t capture_sequence = 0;
+
+    // Where the cursor covers the last frame
+    std::optional<rect_t> last_cursor;
+
+    // Serial of the last cursor shape published without the damage tracker
+    unsigned long cursor_serial = 0;
+
     /**
      * Last X (NOT the streamed monitor!) size.
      * This way we can trigger reinitialization if the dimensions changed while streaming
@@ -463,6 +818,9 @@ namespace platf {
       env_width = xattr.width;
       env_height = xattr.height;
 
+      delay = std::chrono::nanoseconds { 1s } / config.framerate;
+      damage_tracker.init(offset_x, offset_y, width, height);
+
       return 0;
     }
 
@@ -506,6 +864,7 @@ namespace platf {
 
     capture_e
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+      TRACE_SCOPE("capture.snapshot");
       refresh();
 
       // The whole X server changed, so we must reinit everything
@@ -514,6 +873,12 @@ namespace platf {
         return capture_e::reinit;
       }
 
+      // Nothing changed, the previous frame is still the current one
+      std::optional<std::vector<rect_t>> damage;
+      if (damage_tracker && !damage_tracker.wait(timeout, cursor, delay, damage)) {
+        return capture_e::timeout;
+      }
+
       if (!pull_free_image_cb(img_out)) {
         return platf::capture_e::interrupted;
       }
@@ -529,9 +894,11 @@ namespace platf {
       img->pixel_pitch = x_img->bits_per_pixel / 8;
       img->img.reset(x_img);
 
-      if (cursor) {
-        blend_cursor(xdisplay.get(), *img, offset_x, offset_y);
-      }
+      auto cursor_rect = draw_cursor(xdisplay.get(), *img, cursor);
+
+      img->capture_sequence = ++capture_sequence;
+      img->damage = std::move(damage);
+      add_cursor_damage(*img, cursor_rect);
 
       return capture_e::ok;
     }
@@ -541,6 +908,71 @@ namespace platf {
       return std::make_shared<x11_img_t>();
     }
 
+    /**
+     * @return Whether the encode device composites the cursor during the color conversion.
+     */
+    bool
+    gpu_cursor() const {
+      return mem_type == mem_type_e::vaapi || mem_type == mem_type_e::vulkan || mem_type == mem_type_e::cuda;
+    }
+
+    /**
+     * @brief Blend the cursor into the frame, or keep it apart when the encode device composites it.
+     * @return Where the cursor covers the frame, empty if it doesn't.
+     */
+    std::optional<rect_t>
+    draw_cursor(Display *display, egl::ram_img_t &img, bool cursor) {
+      if (!cursor) {
+        // The damage tracker publishes the cursor as soon as it changes, otherwise it's published with every frame
+        if (cursor::enabled() && !damage_tracker) {
+          publish_cursor(display, offset_x, offset_y, cursor_serial);
+        }
+
+        img.cursor.data = nullptr;
+        return std::nullopt;
+      }
+
+      if (!gpu_cursor()) {
+        img.cursor.data = nullptr;
+        return blend_cursor(display, img, offset_x, offset_y);
+      }
+
+      if (!capture_cursor(display, img.cursor, offset_x, offset_y)) {
+        return std::nullopt;
+      }
+
+      rect_t rect {
+        std::max(0, img.cursor.x),
+        std::max(0, img.cursor.y),
+        std::min(img.width, img.cursor.x + img.cursor.width),
+        std::min(img.height, img.cursor.y + img.cursor.height),
+      };
+
+      if (rect.left >= rect.right || rect.top >= rect.bottom) {
+        return std::nullopt;
+      }
+
+      return rect;
+    }
+
+    /**
+     * @brief Damage doesn't know about the cursor, so where it was and where it is now changed as well.
+     */
+    void
+    add_cursor_damage(platf::img_t &img, const std::optional<rect_t> &current) {
+      if (img.damage) {
+        if (last_cursor) {
+          img.damage->emplace_back(*last_cursor);
+        }
+        if (current) {
+          img.damage->emplace_back(*current);
+        }
+      }
+
+      img.cursor_rect = current;
+      last_cursor = current;
+    }
+
     std::unique_ptr<avcodec_encode_device_t>
     make_avcodec_encode_device(pix_fmt_e pix_fmt) override {
 #ifdef SUNSHINE_BUILD_VAAPI
@@ -549,6 +981,12 @@ namespace platf {
       }
 #endif
 
+#ifdef SUNSHINE_BUILD_VULKAN
+      if (mem_type == mem_type_e::vulkan) {
+        return vulkan::make_avcodec_encode_device(width, height, false);
+      }
+#endif
+
 #ifdef SUNSHINE_BUILD_CUDA
       if (mem_type == mem_type_e::cuda) {
         return cuda::make_avcodec_encode_device(width, height, false);
@@ -558,6 +996,13 @@ namespace platf {
       return std::make_unique<avcodec_encode_device_t>();
     }
 
+#ifdef SUNSHINE_BUILD_CUDA
+    std::unique_ptr<nvenc_encode_device_t>
+    make_nvenc_encode_device(pix_fmt_e pix_fmt) override {
+      return cuda::make_nvenc_encode_device(width, height, false, pix_fmt);
+    }
+#endif
+
     int
     dummy_img(img_t *img) override {
       // TODO: stop cheating and give black image
@@ -569,6 +1014,7 @@ namespace platf {
         return true;
       };
       std::shared_ptr<platf::img_t> img_out;
+      damage_tracker.invalidate();
       snapshot(pull_dummy_img_callback, img_out, 0s, true);
       return 0;
     }
@@ -584,6 +1030,9 @@ namespace platf {
 
     shm_data_t data;
 
+    // Copy of the last captured frame, XSHM doesn't report what changed
+    std::vector<std::uint8_t> last_frame;
+
     task_pool_util::TaskPool::task_id_t refresh_task_id;
 
     void
@@ -634,12 +1083,19 @@ namespace platf {
 
     capture_e
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor) {
+      TRACE_SCOPE("capture.snapshot");
       // The whole X server changed, so we must reinit everything
       if (xattr.width != env_width || xattr.height != env_height) {
         BOOST_LOG(warning) << "X dimensions changed in SHM mode, request reinit"sv;
         return capture_e::reinit;
       }
       else {
+        // Nothing changed, the previous frame is still the current one
+        std::optional<std::vector<rect_t>> damage;
+        if (damage_tracker && !damage_tracker.wait(timeout, cursor, delay, damage)) {
+          return capture_e::timeout;
+        }
+
         auto img_cookie = xcb::shm_get_image_unchecked(xcb.get(), display->root, offset_x, offset_y, width, height, ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, seg, 0);
 
         xcb_img_t img_reply { xcb::shm_get_image_reply(xcb.get(), img_cookie, nullptr) };
@@ -652,16 +1108,82 @@ namespace platf {
           return platf::capture_e::interrupted;
         }
 
-        std::copy_n((std::uint8_t *) data.data, frame_size(), img_out->data);
+        pixel::copy_rows(img_out->data, img_out->row_pitch, (const std::uint8_t *) data.data, width * 4, width * 4, height);
+
+        auto img = (shm_img_t *) img_out.get();
+        auto cursor_rect = draw_cursor(shm_xdisplay.get(), *img, cursor);
 
-        if (cursor) {
-          blend_cursor(shm_xdisplay.get(), *img_out, offset_x, offset_y);
+        if (damage_tracker) {
+          img->capture_sequence = ++capture_sequence;
+          img->damage = std::move(damage);
         }
+        else {
+          update_damage(*img);
+        }
+        add_cursor_damage(*img, cursor_rect);
 
         return capture_e::ok;
       }
     }
 
+    /**
+     * @brief Compare the image with the last frame in tiles to find the regions that changed.
+     * @details Only the tiles that changed are copied into `last_frame`.
+     */
+    void
+    update_damage(platf::img_t &img) {
+      constexpr int tile_size = 64;
+
+      img.capture_sequence = ++capture_sequence;
+
+      const std::size_t size = img.height * img.row_pitch;
+      if (last_frame.size() != size) {
+        last_frame.assign(img.data, img.data + size);
+        img.damage = std::nullopt;
+        return;
+      }
+
+      if (img.damage) {
+        img.damage->clear();
+      }
+      else {
+        img.damage.emplace();
+      }
+
+      auto &damage = *img.damage;
+      for (int top = 0; top < img.height; top += tile_size) {
+        const int bottom = std::min(top + tile_size, img.height);
+
+        for (int left = 0; left < img.width; left += tile_size) {
+          const int right = std::min(left + tile_size, img.width);
+          const std::size_t bytes = (right - left) * img.pixel_pitch;
+
+          bool changed = false;
+          for (int y = top; y < bottom; ++y) {
+            auto offset = y * img.row_pitch + left * img.pixel_pitch;
+
+            // The rows above the first difference are identical already
+            if (changed || std::memcmp(img.data + offset, last_frame.data() + offset, bytes)) {
+              changed = true;
+              std::memcpy(last_frame.data() + offset, img.data + offset, bytes);
+            }
+          }
+
+          if (!changed) {
+            continue;
+          }
+
+          // Merge changed tiles next to each other on the same row
+          if (!damage.empty() && damage.back().top == top && damage.back().right == left) {
+            damage.back().right = right;
+          }
+          else {
+            damage.emplace_back(rect_t { left, top, right, bottom });
+          }
+        }
+      }
+    }
+
     std::shared_ptr<img_t>
     alloc_img() override {
       auto img = std::make_shared<shm_img_t>();
@@ -669,7 +1191,10 @@ namespace platf {
       img->height = height;
       img->pixel_pitch = 4;
       img->row_pitch = img->pixel_pitch * width;
-      img->data = new std::uint8_t[height * img->row_pitch];
+      img->data = (std::uint8_t *) memory::allocate(height * img->row_pitch);
+      if (!img->data) {
+        return nullptr;
+      }
 
       return img;
     }
@@ -727,7 +1252,7 @@ namespace platf {
 
   std::shared_ptr<display_t>
   x11_display(platf::mem_type_e hwdevice_type, const std::string &display_name, const ::video::config_t &config) {
-    if (hwdevice_type != platf::mem_type_e::system && hwdevice_type != platf::mem_type_e::vaapi && hwdevice_type != platf::mem_type_e::cuda) {
+    if (hwdevice_type != platf::mem_type_e::system && hwdevice_type != platf::mem_type_e::vaapi && hwdevice_type != platf::mem_type_e::vulkan && hwdevice_type != platf::mem_type_e::cuda) {
       BOOST_LOG(error) << "Could not initialize x11 display with the given hw device type"sv;
       return nullptr;
     }
@@ -798,6 +1323,52 @@ namespace platf {
     return names;
   }
 
+  std::optional<rect_t>
+  x11_window_rect(const std::string &title) {
+    if (load_x11()) {
+      return std::nullopt;
+    }
+
+    x11::xdisplay_t xdisplay { x11::OpenDisplay(nullptr) };
+    if (!xdisplay) {
+      return std::nullopt;
+    }
+
+    auto root = DefaultRootWindow(xdisplay.get());
+
+    // Window managers reparent the windows of the applications into frames of their own,
+    // so the tree is searched breadth first rather than only the children of the root
+    std::vector<Window> windows { root };
+    for (std::size_t x = 0; x < windows.size(); ++x) {
+      auto window = windows[x];
+
+      char *name = nullptr;
+      if (window != root && x11::FetchName(xdisplay.get(), window, &name) && name) {
+        bool match = std::strstr(name, title.c_str()) != nullptr;
+        x11::Free(name);
+
+        XWindowAttributes attributes;
+        if (match && x11::GetWindowAttributes(xdisplay.get(), window, &attributes) && attributes.map_state == IsViewable) {
+          int root_x, root_y;
+          Window child;
+          if (x11::TranslateCoordinates(xdisplay.get(), window, root, 0, 0, &root_x, &root_y, &child)) {
+            return rect_t { root_x, root_y, root_x + attributes.width, root_y + attributes.height };
+          }
+        }
+      }
+
+      Window root_return, parent_return;
+      Window *children = nullptr;
+      unsigned int count = 0;
+      if (x11::QueryTree(xdisplay.get(), window, &root_return, &parent_return, &children, &count) && children) {
+        windows.insert(std::end(windows), children, children + count);
+        x11::Free(children);
+      }
+    }
+
+    return std::nullopt;
+  }
+
   void
   freeImage(XImage *p) {
     XDestroyImage(p);
@@ -841,30 +1412,7 @@ namespace platf {
 
     void
     cursor_t::capture(egl::cursor_t &img) {
-      auto display = (xdisplay_t::pointer) ctx.get();
-
-      xcursor_t xcursor = fix::GetCursorImage(display);
-
-      if (img.serial != xcursor->cursor_serial) {
-        auto buf_size = xcursor->width * xcursor->height * sizeof(int);
-
-        if (img.buffer.size() < buf_size) {
-          img.buffer.resize(buf_size);
-        }
-
-        std::transform(xcursor->pixels, xcursor->pixels + buf_size / 4, (int *) img.buffer.data(), [](long pixel) -> int {
-          return pixel;
-        });
-      }
-
-      img.data = img.buffer.data();
-      img.width = img.src_w = xcursor->width;
-      img.height = img.src_h = xcursor->height;
-      img.x = xcursor->x - xcursor->xhot;
-      img.y = xcursor->y - xcursor->yhot;
-      img.pixel_pitch = 4;
-      img.row_pitch = img.pixel_pitch * img.width;
-      img.serial = xcursor->cursor_serial;
+      capture_cursor((xdisplay_t::pointer) ctx.get(), img, 0, 0);
     }
 
     void
@@ -0,0 +1,576 @@
+/**
+ * @file src/platform/linux/xdp.cpp
+ * @brief AF_XDP backend of the batched UDP sends.
+ */
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <boost/asio/ip/address.hpp>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "src/config.h"
+#include "src/logging.h"
+#include "src/platform/common.h"
+#include "xdp.h"
+
+#ifndef AF_XDP
+  #define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+  #define SOL_XDP 283
+#endif
+
+using namespace std::literals;
+
+namespace platf::xdp {
+  namespace {
+    // The UMEM is split into frames of this size, a frame holds a single datagram
+    constexpr std::uint32_t FRAME_SIZE = 2048;
+    constexpr std::uint32_t FRAME_COUNT = 4096;
+
+    // Entries of the transmit and completion rings, a power of two
+    constexpr std::uint32_t RING_SIZE = 2048;
+
+    constexpr std::size_t HEADERS_SIZE = sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr);
+
+    // Resolved destinations are looked up again after a while, those that couldn't be resolved sooner
+    constexpr auto ROUTE_LIFETIME = 10s;
+    constexpr auto UNRESOLVED_LIFETIME = 1s;
+
+    // How long a batch waits for the NIC to hand frames back before the socket takes the rest
+    constexpr auto FRAME_TIMEOUT = 20ms;
+
+    std::uint16_t
+    checksum(const void *data, std::size_t size) {
+      auto bytes = (const std::uint8_t *) data;
+
+      std::uint32_t sum = 0;
+      for (std::size_t x = 0; x + 1 < size; x += 2) {
+        sum += (bytes[x] << 8) | bytes[x + 1];
+      }
+      if (size & 1) {
+        sum += bytes[size - 1] << 8;
+      }
+
+      while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+      }
+
+      return htons(~sum);
+    }
+
+    /**
+     * @brief The next hop towards a target, if the routing table sends it out of the interface.
+     * @details Addresses are compared as /proc/net/route prints them, in network byte order.
+     */
+    std::optional<std::uint32_t>
+    next_hop(const std::string &interface_name, std::uint32_t target) {
+      std::ifstream routes { "/proc/net/route" };
+
+      std::string line;
+      std::getline(routes, line);
+
+      std::optional<std::uint32_t> best;
+      int best_prefix = -1;
+      int best_metric = 0;
+      bool best_ours = false;
+      while (std::getline(routes, line)) {
+        std::istringstream fields { line };
+
+        std::string name, destination, gateway, flags, refcnt, use, metric, mask;
+        if (!(fields >> name >> destination >> gateway >> flags >> refcnt >> use >> metric >> mask)) {
+          continue;
+        }
+
+        auto route_flags = std::stoul(flags, nullptr, 16);
+        auto route_mask = (std::uint32_t) std::stoul(mask, nullptr, 16);
+        if (!(route_flags & 0x1) || (target & route_mask) != (std::uint32_t) std::stoul(destination, nullptr, 16)) {
+          continue;
+        }
+
+        auto prefix = std::popcount(route_mask);
+        auto route_metric = std::stoi(metric);
+        if (prefix < best_prefix || (prefix == best_prefix && route_metric >= best_metric)) {
+          continue;
+        }
+
+        best_prefix = prefix;
+        best_metric = route_metric;
+        best_ours = name == interface_name;
+        best = (route_flags & 0x2) ? (std::uint32_t) std::stoul(gateway, nullptr, 16) : target;
+      }
+
+      if (!best_ours) {
+        return std::nullopt;
+      }
+
+      return best;
+    }
+
+    /**
+     * @brief The MAC address of a neighbor, if the kernel has resolved it on the interface.
+     */
+    std::optional<std::array<std::uint8_t, ETH_ALEN>>
+    neighbor(const std::string &interface_name, std::uint32_t address) {
+      std::ifstream neighbors { "/proc/net/arp" };
+
+      char text[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &address, text, sizeof(text));
+
+      std::string line;
+      std::getline(neighbors, line);
+      while (std::getline(neighbors, line)) {
+        std::istringstream fields { line };
+
+        std::string ip, type, flags, mac, mask, device;
+        if (!(fields >> ip >> type >> flags >> mac >> mask >> device)) {
+          continue;
+        }
+
+        // ATF_COM, the entry is complete
+        if (ip != text || device != interface_name || !(std::stoul(flags, nullptr, 16) & 0x2)) {
+          continue;
+        }
+
+        std::array<std::uint8_t, ETH_ALEN> result;
+        unsigned int bytes[ETH_ALEN];
+        if (std::sscanf(mac.c_str(), "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != ETH_ALEN) {
+          return std::nullopt;
+        }
+        std::copy(std::begin(bytes), std::end(bytes), std::begin(result));
+
+        return result;
+      }
+
+      return std::nullopt;
+    }
+
+    struct ring_t {
+      std::uint32_t *producer;
+      std::uint32_t *consumer;
+      std::uint32_t *flags;
+      void *entries;
+
+      void *map = MAP_FAILED;
+      std::size_t map_size = 0;
+    };
+
+    // The headers of the frames to a destination, nullopt if it's left to the socket
+    struct route_t {
+      std::optional<std::array<std::uint8_t, HEADERS_SIZE>> headers;
+      std::chrono::steady_clock::time_point expires;
+    };
+
+    class socket_t {
+    public:
+      ~socket_t() {
+        for (auto ring : { &tx, &completion }) {
+          if (ring->map != MAP_FAILED) {
+            munmap(ring->map, ring->map_size);
+          }
+        }
+        if (fd >= 0) {
+          close(fd);
+        }
+        if (umem != MAP_FAILED) {
+          munmap(umem, (std::size_t) FRAME_SIZE * FRAME_COUNT);
+        }
+      }
+
+      static std::unique_ptr<socket_t>
+      open(const std::string &interface_name) {
+        auto socket = std::make_unique<socket_t>();
+        socket->interface_name = interface_name;
+
+        if (socket->init()) {
+          return nullptr;
+        }
+
+        BOOST_LOG(info) << "Sending through AF_XDP on "sv << interface_name << " ("sv << socket->mtu << " bytes MTU)"sv;
+        return socket;
+      }
+
+      std::size_t
+      send(const batched_send_info_t &send_info) {
+        std::unique_lock ul { lock };
+
+        // A copy, another sender may resolve the route again while this one waits for room
+        auto headers = route(send_info);
+        if (!headers) {
+          return 0;
+        }
+
+        // The UDP and IP headers are followed by the block
+        if (send_info.block_size + HEADERS_SIZE > FRAME_SIZE || send_info.block_size + HEADERS_SIZE - sizeof(ethhdr) > (std::size_t) mtu) {
+          return 0;
+        }
+
+        auto descs = (xdp_desc *) tx.entries;
+
+        std::size_t sent = 0;
+        auto deadline = std::chrono::steady_clock::now() + FRAME_TIMEOUT;
+        while (sent < send_info.block_count) {
+          reclaim();
+
+          auto producer = *tx.producer;
+          auto room = RING_SIZE - (producer - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE));
+          auto count = std::min<std::size_t>({ send_info.block_count - sent, room, free_frames.size() });
+          if (!count) {
+            // The NIC only hands frames back once it is told to send them
+            kick();
+            if (std::chrono::steady_clock::now() >= deadline) {
+              BOOST_LOG_LIMITED(warning) << "AF_XDP transmit ring is full, sending the rest of the batch through the socket"sv;
+              break;
+            }
+
+            // The other senders queue and reclaim frames while this one waits
+            ul.unlock();
+            std::this_thread::yield();
+            ul.lock();
+            continue;
+          }
+
+          for (std::size_t x = 0; x < count; ++x) {
+            auto addr = free_frames.back();
+            free_frames.pop_back();
+
+            auto frame = (std::uint8_t *) umem + addr;
+            auto size = fill(frame, *headers, send_info, sent + x);
+
+            descs[(producer + x) & (RING_SIZE - 1)] = xdp_desc { addr, (std::uint32_t) size, 0 };
+          }
+
+          __atomic_store_n(tx.producer, producer + (std::uint32_t) count, __ATOMIC_RELEASE);
+          sent += count;
+        }
+
+        kick();
+        return sent;
+      }
+
+    private:
+      int
+      init() {
+        ifindex = if_nametoindex(interface_name.c_str());
+        if (!ifindex) {
+          BOOST_LOG(error) << "AF_XDP: no interface named "sv << interface_name;
+          return -1;
+        }
+
+        // The MAC, the MTU and an address of the interface for the headers
+        {
+          int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+          if (fd < 0) {
+            BOOST_LOG(error) << "AF_XDP: socket() failed: "sv << strerror(errno);
+            return -1;
+          }
+
+          ifreq request {};
+          std::strncpy(request.ifr_name, interface_name.c_str(), IFNAMSIZ - 1);
+
+          auto status = ioctl(fd, SIOCGIFHWADDR, &request);
+          if (!status) {
+            std::memcpy(source_mac.data(), request.ifr_hwaddr.sa_data, ETH_ALEN);
+            status = ioctl(fd, SIOCGIFMTU, &request);
+          }
+          if (!status) {
+            mtu = request.ifr_mtu;
+            if (!ioctl(fd, SIOCGIFADDR, &request)) {
+              interface_address = ((sockaddr_in *) &request.ifr_addr)->sin_addr.s_addr;
+            }
+          }
+          ::close(fd);
+
+          if (status) {
+            BOOST_LOG(error) << "AF_XDP: couldn't query "sv << interface_name << ": "sv << strerror(errno);
+            return -1;
+          }
+        }
+
+        fd = ::socket(AF_XDP, SOCK_RAW, 0);
+        if (fd < 0) {
+          BOOST_LOG(error) << "AF_XDP: socket() failed, it needs CAP_NET_RAW and a kernel with AF_XDP: "sv << strerror(errno);
+          return -1;
+        }
+
+        umem = mmap(nullptr, (std::size_t) FRAME_SIZE * FRAME_COUNT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (umem == MAP_FAILED) {
+          BOOST_LOG(error) << "AF_XDP: couldn't map the UMEM: "sv << strerror(errno);
+          return -1;
+        }
+
+        xdp_umem_reg reg {};
+        reg.addr = (std::uint64_t) umem;
+        reg.len = (std::uint64_t) FRAME_SIZE * FRAME_COUNT;
+        reg.chunk_size = FRAME_SIZE;
+
+        // Nothing is received, but the kernel wants a fill ring with every UMEM
+        std::uint32_t fill_size = 64;
+        std::uint32_t ring_size = RING_SIZE;
+        if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+            setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) ||
+            setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) ||
+            setsockopt(fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size))) {
+          BOOST_LOG(error) << "AF_XDP: couldn't set up the rings: "sv << strerror(errno);
+          return -1;
+        }
+
+        xdp_mmap_offsets offsets {};
+        socklen_t offsets_size = sizeof(offsets);
+        if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_size)) {
+          BOOST_LOG(error) << "AF_XDP: getsockopt(XDP_MMAP_OFFSETS) failed: "sv << strerror(errno);
+          return -1;
+        }
+
+        if (map(tx, offsets.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING) ||
+            map(completion, offsets.cr, sizeof(std::uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)) {
+          return -1;
+        }
+
+        // Kernels before 5.4 don't know XDP_USE_NEED_WAKEUP, the ring is kicked after every batch then
+        sockaddr_xdp address {};
+        address.sxdp_family = AF_XDP;
+        address.sxdp_ifindex = ifindex;
+        address.sxdp_queue_id = 0;
+        address.sxdp_flags = XDP_USE_NEED_WAKEUP;
+        if (bind(fd, (sockaddr *) &address, sizeof(address))) {
+          address.sxdp_flags = 0;
+          if (bind(fd, (sockaddr *) &address, sizeof(address))) {
+            BOOST_LOG(error) << "AF_XDP: couldn't bind to "sv << interface_name << ": "sv << strerror(errno);
+            return -1;
+          }
+        }
+        need_wakeup = address.sxdp_flags & XDP_USE_NEED_WAKEUP;
+
+        free_frames.reserve(FRAME_COUNT);
+        for (std::uint32_t x = 0; x < FRAME_COUNT; ++x) {
+          free_frames.push_back((std::uint64_t) x * FRAME_SIZE);
+        }
+
+        return 0;
+      }
+
+      int
+      map(ring_t &ring, const xdp_ring_offset &offset, std::size_t entry_size, off_t page_offset) {
+        ring.map_size = offset.desc + RING_SIZE * entry_size;
+        ring.map = mmap(nullptr, ring.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, page_offset);
+        if (ring.map == MAP_FAILED) {
+          BOOST_LOG(error) << "AF_XDP: couldn't map a ring: "sv << strerror(errno);
+          return -1;
+        }
+
+        auto base = (std::uint8_t *) ring.map;
+        ring.producer = (std::uint32_t *) (base + offset.producer);
+        ring.consumer = (std::uint32_t *) (base + offset.consumer);
+        ring.flags = (std::uint32_t *) (base + offset.flags);
+        ring.entries = base + offset.desc;
+
+        return 0;
+      }
+
+      /**
+       * @brief Take back the frames the NIC is done with.
+       */
+      void
+      reclaim() {
+        auto consumer = *completion.consumer;
+        auto producer = __atomic_load_n(completion.producer, __ATOMIC_ACQUIRE);
+
+        auto addrs = (const std::uint64_t *) completion.entries;
+        for (; consumer != producer; ++consumer) {
+          free_frames.push_back(addrs[consumer & (RING_SIZE - 1)]);
+        }
+
+        __atomic_store_n(completion.consumer, consumer, __ATOMIC_RELEASE);
+      }
+
+      void
+      kick() {
+        if (need_wakeup && !(__atomic_load_n(tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+          return;
+        }
+
+        if (sendto(fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN) {
+          BOOST_LOG_LIMITED(warning) << "AF_XDP: kicking the transmit ring failed: "sv << strerror(errno);
+        }
+      }
+
+      /**
+       * @brief The headers of the frames of a batch, resolved on the first batch to a destination.
+       * @return nullopt if the batch is left to the socket.
+       */
+      const std::optional<std::array<std::uint8_t, HEADERS_SIZE>> &
+      route(const batched_send_info_t &send_info) {
+        static const std::optional<std::array<std::uint8_t, HEADERS_SIZE>> none;
+
+        auto target = send_info.target_address;
+        if (target.is_v6() && target.to_v6().is_v4_mapped()) {
+          target = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, target.to_v6());
+        }
+        if (!target.is_v4()) {
+          return none;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto &route = routes[{ send_info.native_socket, target.to_v4().to_uint(), send_info.target_port }];
+        if (now < route.expires) {
+          return route.headers;
+        }
+
+        route.headers = resolve(send_info, htonl(target.to_v4().to_uint()));
+        route.expires = now + (route.headers ? ROUTE_LIFETIME : UNRESOLVED_LIFETIME);
+
+        if (!route.headers) {
+          BOOST_LOG(debug) << "AF_XDP: sending to "sv << target << " through the socket"sv;
+        }
+
+        return route.headers;
+      }
+
+      std::optional<std::array<std::uint8_t, HEADERS_SIZE>>
+      resolve(const batched_send_info_t &send_info, std::uint32_t target) {
+        auto sockfd = (int) send_info.native_socket;
+
+        auto hop = next_hop(interface_name, target);
+        if (!hop) {
+          return std::nullopt;
+        }
+
+        auto destination_mac = neighbor(interface_name, *hop);
+        if (!destination_mac) {
+          // The socket path makes the kernel resolve it
+          return std::nullopt;
+        }
+
+        sockaddr_storage local {};
+        socklen_t local_size = sizeof(local);
+        if (getsockname(sockfd, (sockaddr *) &local, &local_size)) {
+          return std::nullopt;
+        }
+        auto source_port = local.ss_family == AF_INET6 ? ((sockaddr_in6 *) &local)->sin6_port : ((sockaddr_in *) &local)->sin_port;
+
+        std::uint32_t source_address = interface_address;
+        if (send_info.source_address.is_v4() && !send_info.source_address.is_unspecified()) {
+          source_address = htonl(send_info.source_address.to_v4().to_uint());
+        }
+        if (!source_address) {
+          return std::nullopt;
+        }
+
+        // The DSCP tagging of the socket carries over
+        int tos = 0;
+        socklen_t tos_size = sizeof(tos);
+        if (local.ss_family != AF_INET || getsockopt(sockfd, IPPROTO_IP, IP_TOS, &tos, &tos_size)) {
+          tos = 0;
+        }
+
+        std::array<std::uint8_t, HEADERS_SIZE> headers {};
+
+        auto eth = (ethhdr *) headers.data();
+        std::memcpy(eth->h_dest, destination_mac->data(), ETH_ALEN);
+        std::memcpy(eth->h_source, source_mac.data(), ETH_ALEN);
+        eth->h_proto = htons(ETH_P_IP);
+
+        auto ip = (iphdr *) (eth + 1);
+        ip->version = 4;
+        ip->ihl = sizeof(iphdr) / 4;
+        ip->tos = (std::uint8_t) tos;
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_UDP;
+        ip->saddr = source_address;
+        ip->daddr = target;
+
+        // The UDP checksum is optional over IPv4 and left out
+        auto udp = (udphdr *) (ip + 1);
+        udp->source = source_port;
+        udp->dest = htons(send_info.target_port);
+
+        return headers;
+      }
+
+      /**
+       * @brief Write a block of the batch into a frame.
+       * @return Size of the frame.
+       */
+      static std::size_t
+      fill(std::uint8_t *frame, const std::array<std::uint8_t, HEADERS_SIZE> &headers, const batched_send_info_t &send_info, std::size_t x) {
+        auto data = frame + HEADERS_SIZE;
+        std::size_t size = 0;
+
+        auto header = send_info.header_for_block(x);
+        std::memcpy(data, header.buffer, header.size);
+        size += header.size;
+
+        send_info.for_each_payload_segment(x, [&](const buffer_descriptor_t &payload) {
+          std::memcpy(data + size, payload.buffer, payload.size);
+          size += payload.size;
+        });
+
+        std::memcpy(frame, headers.data(), HEADERS_SIZE);
+
+        auto ip = (iphdr *) (frame + sizeof(ethhdr));
+        ip->tot_len = htons((std::uint16_t) (sizeof(iphdr) + sizeof(udphdr) + size));
+        ip->check = checksum(ip, sizeof(iphdr));
+
+        auto udp = (udphdr *) (ip + 1);
+        udp->len = htons((std::uint16_t) (sizeof(udphdr) + size));
+
+        return HEADERS_SIZE + size;
+      }
+
+      std::string interface_name;
+      unsigned int ifindex = 0;
+      int mtu = 0;
+      std::array<std::uint8_t, ETH_ALEN> source_mac {};
+      std::uint32_t interface_address = 0;
+
+      int fd = -1;
+      void *umem = MAP_FAILED;
+      ring_t tx;
+      ring_t completion;
+      bool need_wakeup = false;
+
+      // The send threads of all sessions share the rings
+      std::mutex lock;
+      std::vector<std::uint64_t> free_frames;
+      std::map<std::tuple<std::uintptr_t, std::uint32_t, std::uint16_t>, route_t> routes;
+    };
+  }  // namespace
+
+  std::size_t
+  send_batch(const batched_send_info_t &send_info) {
+    if (config::stream.xdp_interface.empty()) {
+      return 0;
+    }
+
+    static auto socket = socket_t::open(config::stream.xdp_interface);
+    if (!socket) {
+      return 0;
+    }
+
+    return socket->send(send_info);
+  }
+}  // namespace platf::xdp
@@ -0,0 +1,26 @@
+/**
+ * @file src/platform/linux/xdp.h
+ * @brief AF_XDP backend of the batched UDP sends.
+ */
+#pragma once
+
+#include <cstddef>
+
+namespace platf {
+  struct batched_send_info_t;
+}
+
+namespace platf::xdp {
+  /**
+   * @brief Write the blocks of a batch straight into the transmit ring of `config::stream.xdp_interface`.
+   * @details The frames get Ethernet, IPv4 and UDP headers resolved once per destination and then kept
+   *          for a while: the next hop is looked up in the routing table and its MAC address in the ARP
+   *          table of the kernel. IPv6, destinations routed through another interface, next hops the
+   *          kernel hasn't resolved yet and blocks larger than the MTU are left to the socket, as is
+   *          everything once the interface can't be opened.
+   * @param send_info The batch, its socket provides the source port and the TOS of the frames.
+   * @return Number of blocks from the start of the batch that were queued, the rest is left to the socket.
+   */
+  std::size_t
+  send_batch(const batched_send_info_t &send_info);
+}  // namespace platf::xdp
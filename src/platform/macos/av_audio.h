@@ -6,22 +6,19 @@
 
 #import <AVFoundation/AVFoundation.h>
 
-#include "third-party/TPCircularBuffer/TPCircularBuffer.h"
+// Called on the serial capture queue with interleaved 16-bit PCM, it must not block
+typedef void (^SamplesArrivedBlock)(const void *data, UInt32 size);
 
-#define kBufferLength 2048
-
-@interface AVAudio: NSObject <AVCaptureAudioDataOutputSampleBufferDelegate> {
-@public
-  TPCircularBuffer audioSampleBuffer;
-}
+@interface AVAudio: NSObject <AVCaptureAudioDataOutputSampleBufferDelegate>
 
 @property (nonatomic, assign) AVCaptureSession *audioCaptureSession;
 @property (nonatomic, assign) AVCaptureConnection *audioConnection;
-@property (nonatomic, assign) NSCondition *samplesArrivedSignal;
+@property (nonatomic, assign) dispatch_queue_t recordingQueue;
+@property (nonatomic, copy) SamplesArrivedBlock samplesArrived;
 
 + (NSArray *)microphoneNames;
 + (AVCaptureDevice *)findMicrophone:(NSString *)name;
 
-- (int)setupMicrophone:(AVCaptureDevice *)device sampleRate:(UInt32)sampleRate frameSize:(UInt32)frameSize channels:(UInt8)channels;
+- (int)setupMicrophone:(AVCaptureDevice *)device sampleRate:(UInt32)sampleRate frameSize:(UInt32)frameSize channels:(UInt8)channels samplesArrived:(SamplesArrivedBlock)samplesArrived;
 
 @end
@@ -57,14 +57,18 @@
 - (void)dealloc {
   // make sure we don't process any further samples
   self.audioConnection = nil;
-  // make sure nothing gets stuck on this signal
-  [self.samplesArrivedSignal signal];
-  [self.samplesArrivedSignal release];
-  TPCircularBufferCleanup(&audioSampleBuffer);
+  [self.audioCaptureSession stopRunning];
+
+  // The block writes into the ring of the microphone, a callback still in flight has to finish first
+  if (self.recordingQueue) {
+    dispatch_sync(self.recordingQueue, ^{});
+    dispatch_release(self.recordingQueue);
+  }
+  [self.samplesArrived release];
   [super dealloc];
 }
 
-- (int)setupMicrophone:(AVCaptureDevice *)device sampleRate:(UInt32)sampleRate frameSize:(UInt32)frameSize channels:(UInt8)channels {
+- (int)setupMicrophone:(AVCaptureDevice *)device sampleRate:(UInt32)sampleRate frameSize:(UInt32)frameSize channels:(UInt8)channels samplesArrived:(SamplesArrivedBlock)samplesArrived {
   self.audioCaptureSession = [[AVCaptureSession alloc] init];
 
   NSError *error;
@@ -92,12 +96,14 @@
     (NSString *) AVLinearPCMIsNonInterleaved: @NO
   }];
 
-  dispatch_queue_attr_t qos = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_CONCURRENT,
-    QOS_CLASS_USER_INITIATED,
+  // A serial queue, the ring of the microphone has a single producer
+  dispatch_queue_attr_t qos = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL,
+    QOS_CLASS_USER_INTERACTIVE,
     DISPATCH_QUEUE_PRIORITY_HIGH);
-  dispatch_queue_t recordingQueue = dispatch_queue_create("audioSamplingQueue", qos);
+  self.recordingQueue = dispatch_queue_create("audioSamplingQueue", qos);
+  self.samplesArrived = samplesArrived;
 
-  [audioOutput setSampleBufferDelegate:self queue:recordingQueue];
+  [audioOutput setSampleBufferDelegate:self queue:self.recordingQueue];
 
   if ([self.audioCaptureSession canAddOutput:audioOutput]) {
     [self.audioCaptureSession addOutput:audioOutput];
@@ -115,9 +121,6 @@
   [audioInput release];
   [audioOutput release];
 
-  self.samplesArrivedSignal = [[NSCondition alloc] init];
-  TPCircularBufferInit(&self->audioSampleBuffer, kBufferLength * channels);
-
   return 0;
 }
 
@@ -128,7 +131,9 @@
     AudioBufferList audioBufferList;
     CMBlockBufferRef blockBuffer;
 
-    CMSampleBufferGetAudioBufferListWithRetainedBlockBuffer(sampleBuffer, NULL, &audioBufferList, sizeof(audioBufferList), NULL, NULL, 0, &blockBuffer);
+    if (CMSampleBufferGetAudioBufferListWithRetainedBlockBuffer(sampleBuffer, NULL, &audioBufferList, sizeof(audioBufferList), NULL, NULL, 0, &blockBuffer) != noErr) {
+      return;
+    }
 
     // NSAssert(audioBufferList.mNumberBuffers == 1, @"Expected interleaved PCM format but buffer contained %u streams", audioBufferList.mNumberBuffers);
 
@@ -136,8 +141,8 @@
     // and we don't want to do sanity checks in a performance critical exec path
     AudioBuffer audioBuffer = audioBufferList.mBuffers[0];
 
-    TPCircularBufferProduceBytes(&self->audioSampleBuffer, audioBuffer.mData, audioBuffer.mDataByteSize);
-    [self.samplesArrivedSignal signal];
+    self.samplesArrived(audioBuffer.mData, audioBuffer.mDataByteSize);
+    CFRelease(blockBuffer);
   }
 }
 
@@ -27,9 +27,10 @@ namespace platf {
         locked(false) {}
 
     [[nodiscard]] uint8_t *
-    lock() const {
+    lock() {
       if (!locked) {
         CVPixelBufferLockBaseAddress(buf, kCVPixelBufferLock_ReadOnly);
+        locked = true;
       }
       return (uint8_t *) CVPixelBufferGetBaseAddress(buf);
     }
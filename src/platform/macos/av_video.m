@@ -80,12 +80,21 @@
   @synchronized(self) {
     AVCaptureVideoDataOutput *videoOutput = [[AVCaptureVideoDataOutput alloc] init];
 
-    [videoOutput setVideoSettings:@{
+    // The output renders into a pool of its own. With the format and the size of the encoder and
+    // IOSurface backing, its buffers are what VideoToolbox takes without a copy or a conversion
+    NSMutableDictionary *videoSettings = [NSMutableDictionary dictionaryWithDictionary:@{
       (NSString *) kCVPixelBufferPixelFormatTypeKey: [NSNumber numberWithUnsignedInt:self.pixelFormat],
       (NSString *) kCVPixelBufferWidthKey: [NSNumber numberWithInt:self.frameWidth],
       (NSString *) kCVPixelBufferHeightKey: [NSNumber numberWithInt:self.frameHeight],
       (NSString *) AVVideoScalingModeKey: AVVideoScalingModeResizeAspect,
     }];
+    if (self.pixelFormat != kCVPixelFormatType_32BGRA) {
+      videoSettings[(NSString *) kCVPixelBufferIOSurfacePropertiesKey] = @{};
+    }
+    [videoOutput setVideoSettings:videoSettings];
+
+    // A frame the encoder is late for is dropped, rather than the pool running dry while it waits
+    videoOutput.alwaysDiscardsLateVideoFrames = YES;
 
     dispatch_queue_attr_t qos = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL,
       QOS_CLASS_USER_INITIATED,
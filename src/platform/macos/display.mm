@@ -9,6 +9,9 @@
 
 #include "src/config.h"
 #include "src/logging.h"
+#include "src/trace.h"
+
+#include <sys/sysctl.h>
 
 // Avoid conflict between AVFoundation and libavutil both defining AVMediaType
 #define AVMediaType AVMediaType_FFmpeg
@@ -30,7 +33,13 @@ namespace platf {
 
     capture_e
     capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override {
+      // Buffers of the encoder's format go to VideoToolbox as they are, only BGRA is converted on the CPU
+      OSType pixel_format = av_capture.pixelFormat;
+      bool zero_copy = pixel_format != kCVPixelFormatType_32BGRA;
+      __block bool checked = false;
+
       auto signal = [av_capture capture:^(CMSampleBufferRef sampleBuffer) {
+        TRACE_SCOPE("capture.snapshot");
         std::shared_ptr<img_t> img_out;
         if (!pull_free_image_cb(img_out)) {
           // got interrupt signal
@@ -41,9 +50,18 @@ namespace platf {
 
         CVPixelBufferRef pixelBuffer = CMSampleBufferGetImageBuffer(sampleBuffer);
 
+        if (zero_copy && !checked) {
+          checked = true;
+          if (!CVPixelBufferGetIOSurface(pixelBuffer) || CVPixelBufferGetPixelFormatType(pixelBuffer) != pixel_format) {
+            BOOST_LOG(warning) << "Captured buffers don't match the encoder, VideoToolbox copies every frame"sv;
+          }
+        }
+
         av_img->sample_buffer = std::make_shared<av_sample_buf_t>(sampleBuffer);
         av_img->pixel_buffer = std::make_shared<av_pixel_buf_t>(pixelBuffer);
-        img_out->data = av_img->pixel_buffer->lock();
+
+        // Mapping an IOSurface for the CPU waits for the GPU, the zero copy path never reads the pixels
+        img_out->data = zero_copy ? nullptr : av_img->pixel_buffer->lock();
 
         img_out->width = (int) CVPixelBufferGetWidth(pixelBuffer);
         img_out->height = (int) CVPixelBufferGetHeight(pixelBuffer);
@@ -168,6 +186,12 @@ namespace platf {
     return display;
   }
 
+  std::optional<rect_t>
+  window_rect(const std::string &title) {
+    // The display encodes the whole screen, so there's no region to follow a window with
+    return std::nullopt;
+  }
+
   std::vector<std::string>
   display_names(mem_type_e hwdevice_type) {
     __block std::vector<std::string> display_names;
@@ -192,4 +216,26 @@ namespace platf {
     // We don't track GPU state, so we will always reenumerate. Fortunately, it is fast on macOS.
     return true;
   }
+
+  std::string
+  gpu_identity() {
+    auto read_sysctl = [](const char *name) -> std::string {
+      char value[256] {};
+      size_t size = sizeof(value) - 1;
+      if (sysctlbyname(name, value, &size, nullptr, 0)) {
+        return {};
+      }
+
+      return value;
+    };
+
+    // GPU drivers ship with the OS, so the model and the OS build identify them
+    auto model = read_sysctl("hw.model");
+    auto os_build = read_sysctl("kern.osversion");
+    if (model.empty() || os_build.empty()) {
+      return {};
+    }
+
+    return model + ' ' + os_build;
+  }
 }  // namespace platf
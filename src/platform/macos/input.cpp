@@ -0,0 +1,335 @@
+/**
+ * @file src/platform/macos/input.cpp
+ * @brief Injects input through Quartz events.
+ */
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <ApplicationServices/ApplicationServices.h>
+
+#include "src/logging.h"
+#include "src/platform/common.h"
+
+using namespace std::literals;
+
+namespace platf {
+  namespace {
+    constexpr std::uint16_t NO_KEY = 0xFFFF;
+
+    struct input_raw_t {
+      ~input_raw_t() {
+        if (source) {
+          CFRelease(source);
+        }
+      }
+
+      CGEventSourceRef source = nullptr;
+
+      // Quartz needs the pressed buttons to tell a drag from a move and the modifiers for every key
+      std::uint32_t buttons = 0;
+      CGEventFlags modifiers = 0;
+    };
+
+    /**
+     * @brief Windows virtual key codes to macOS virtual key codes, NO_KEY for keys that aren't injected.
+     */
+    constexpr std::array<std::uint16_t, 256>
+    make_keycodes() {
+      std::array<std::uint16_t, 256> keycodes {};
+      for (auto &keycode : keycodes) {
+        keycode = NO_KEY;
+      }
+
+      keycodes[0x08] = 0x33;  // Backspace
+      keycodes[0x09] = 0x30;  // Tab
+      keycodes[0x0D] = 0x24;  // Return
+      keycodes[0x10] = 0x38;  // Shift
+      keycodes[0x11] = 0x3B;  // Control
+      keycodes[0x12] = 0x3A;  // Option
+      keycodes[0x14] = 0x39;  // Caps lock
+      keycodes[0x1B] = 0x35;  // Escape
+      keycodes[0x20] = 0x31;  // Space
+      keycodes[0x21] = 0x74;  // Page up
+      keycodes[0x22] = 0x79;  // Page down
+      keycodes[0x23] = 0x77;  // End
+      keycodes[0x24] = 0x73;  // Home
+      keycodes[0x25] = 0x7B;  // Left
+      keycodes[0x26] = 0x7E;  // Up
+      keycodes[0x27] = 0x7C;  // Right
+      keycodes[0x28] = 0x7D;  // Down
+      keycodes[0x2D] = 0x72;  // Insert as help
+      keycodes[0x2E] = 0x75;  // Forward delete
+
+      constexpr std::uint16_t digits[] { 0x1D, 0x12, 0x13, 0x14, 0x15, 0x17, 0x16, 0x1A, 0x1C, 0x19 };
+      for (int x = 0; x < 10; ++x) {
+        keycodes[0x30 + x] = digits[x];
+      }
+
+      constexpr std::uint16_t letters[] {
+        0x00, 0x0B, 0x08, 0x02, 0x0E, 0x03, 0x05, 0x04, 0x22, 0x26, 0x28, 0x25, 0x2E,
+        0x2D, 0x1F, 0x23, 0x0C, 0x0F, 0x01, 0x11, 0x20, 0x09, 0x0D, 0x07, 0x10, 0x06
+      };
+      for (int x = 0; x < 26; ++x) {
+        keycodes[0x41 + x] = letters[x];
+      }
+
+      keycodes[0x5B] = 0x37;  // Left Windows as command
+      keycodes[0x5C] = 0x36;  // Right Windows as right command
+
+      constexpr std::uint16_t keypad[] { 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5B, 0x5C };
+      for (int x = 0; x < 10; ++x) {
+        keycodes[0x60 + x] = keypad[x];
+      }
+      keycodes[0x6A] = 0x43;  // Keypad *
+      keycodes[0x6B] = 0x45;  // Keypad +
+      keycodes[0x6D] = 0x4E;  // Keypad -
+      keycodes[0x6E] = 0x41;  // Keypad .
+      keycodes[0x6F] = 0x4B;  // Keypad /
+
+      constexpr std::uint16_t functions[] { 0x7A, 0x78, 0x63, 0x76, 0x60, 0x61, 0x62, 0x64, 0x65, 0x6D, 0x67, 0x6F, 0x69, 0x6B, 0x71, 0x6A, 0x40, 0x4F, 0x50, 0x5A };
+      for (int x = 0; x < 20; ++x) {
+        keycodes[0x70 + x] = functions[x];
+      }
+
+      keycodes[0x90] = 0x47;  // Num lock as clear
+      keycodes[0xA0] = 0x38;  // Left shift
+      keycodes[0xA1] = 0x3C;  // Right shift
+      keycodes[0xA2] = 0x3B;  // Left control
+      keycodes[0xA3] = 0x3E;  // Right control
+      keycodes[0xA4] = 0x3A;  // Left alt as option
+      keycodes[0xA5] = 0x3D;  // Right alt as right option
+      keycodes[0xAD] = 0x4A;  // Mute
+      keycodes[0xAE] = 0x49;  // Volume down
+      keycodes[0xAF] = 0x48;  // Volume up
+      keycodes[0xBA] = 0x29;  // ;
+      keycodes[0xBB] = 0x18;  // =
+      keycodes[0xBC] = 0x2B;  // ,
+      keycodes[0xBD] = 0x1B;  // -
+      keycodes[0xBE] = 0x2F;  // .
+      keycodes[0xBF] = 0x2C;  // /
+      keycodes[0xC0] = 0x32;  // `
+      keycodes[0xDB] = 0x21;  // [
+      keycodes[0xDC] = 0x2A;  // Backslash
+      keycodes[0xDD] = 0x1E;  // ]
+      keycodes[0xDE] = 0x27;  // '
+
+      return keycodes;
+    }
+
+    constexpr auto KEYCODES = make_keycodes();
+
+    CGEventFlags
+    modifier_flag(std::uint16_t vk) {
+      switch (vk) {
+        case 0x10:
+        case 0xA0:
+        case 0xA1:
+          return kCGEventFlagMaskShift;
+        case 0x11:
+        case 0xA2:
+        case 0xA3:
+          return kCGEventFlagMaskControl;
+        case 0x12:
+        case 0xA4:
+        case 0xA5:
+          return kCGEventFlagMaskAlternate;
+        case 0x5B:
+        case 0x5C:
+          return kCGEventFlagMaskCommand;
+        default:
+          return 0;
+      }
+    }
+
+    void
+    post(CGEventRef event) {
+      if (!event) {
+        BOOST_LOG(error) << "Couldn't create an input event"sv;
+        return;
+      }
+
+      CGEventPost(kCGHIDEventTap, event);
+      CFRelease(event);
+    }
+
+    CGPoint
+    cursor_location() {
+      auto event = CGEventCreate(nullptr);
+      auto location = CGEventGetLocation(event);
+      CFRelease(event);
+      return location;
+    }
+
+    // The event a move is while the buttons are held
+    CGEventType
+    move_type(std::uint32_t buttons) {
+      if (buttons & (1 << kCGMouseButtonLeft)) {
+        return kCGEventLeftMouseDragged;
+      }
+      if (buttons & (1 << kCGMouseButtonRight)) {
+        return kCGEventRightMouseDragged;
+      }
+      if (buttons) {
+        return kCGEventOtherMouseDragged;
+      }
+      return kCGEventMouseMoved;
+    }
+  }  // namespace
+
+  void
+  freeInput(void *p) {
+    delete (input_raw_t *) p;
+  }
+
+  input_t
+  input() {
+    auto raw = new input_raw_t {};
+    input_t result { raw };
+
+    raw->source = CGEventSourceCreate(kCGEventSourceStateHIDSystemState);
+    if (!raw->source) {
+      BOOST_LOG(error) << "Couldn't create the event source, input needs the accessibility permission"sv;
+      return nullptr;
+    }
+
+    return result;
+  }
+
+  void
+  move_mouse(input_t &input, int deltaX, int deltaY) {
+    auto raw = (input_raw_t *) input.get();
+
+    auto location = cursor_location();
+    location.x += deltaX;
+    location.y += deltaY;
+
+    auto event = CGEventCreateMouseEvent(raw->source, move_type(raw->buttons), location, kCGMouseButtonLeft);
+    if (event) {
+      // Games that capture the cursor only read the deltas
+      CGEventSetIntegerValueField(event, kCGMouseEventDeltaX, deltaX);
+      CGEventSetIntegerValueField(event, kCGMouseEventDeltaY, deltaY);
+    }
+    post(event);
+  }
+
+  void
+  abs_mouse(input_t &input, const touch_port_t &touch_port, float x, float y) {
+    auto raw = (input_raw_t *) input.get();
+
+    // Quartz places the cursor in points, the capture is in pixels
+    auto display = CGMainDisplayID();
+    auto mode = CGDisplayCopyDisplayMode(display);
+    auto pixels = mode ? CGDisplayModeGetPixelWidth(mode) : 0;
+    CGDisplayModeRelease(mode);
+    auto scale = pixels ? CGDisplayBounds(display).size.width / pixels : 1.0;
+
+    CGPoint location { (touch_port.offset_x + x) * scale, (touch_port.offset_y + y) * scale };
+    post(CGEventCreateMouseEvent(raw->source, move_type(raw->buttons), location, kCGMouseButtonLeft));
+  }
+
+  void
+  button_mouse(input_t &input, int button, bool release) {
+    auto raw = (input_raw_t *) input.get();
+
+    CGMouseButton cg_button;
+    CGEventType type;
+    switch (button) {
+      case 1:
+        cg_button = kCGMouseButtonLeft;
+        type = release ? kCGEventLeftMouseUp : kCGEventLeftMouseDown;
+        break;
+      case 3:
+        cg_button = kCGMouseButtonRight;
+        type = release ? kCGEventRightMouseUp : kCGEventRightMouseDown;
+        break;
+      case 2:
+      case 4:
+      case 5:
+        cg_button = button == 2 ? kCGMouseButtonCenter : (CGMouseButton) (button - 1);
+        type = release ? kCGEventOtherMouseUp : kCGEventOtherMouseDown;
+        break;
+      default:
+        BOOST_LOG(warning) << "Unknown mouse button "sv << button;
+        return;
+    }
+
+    if (release) {
+      raw->buttons &= ~(1 << cg_button);
+    }
+    else {
+      raw->buttons |= 1 << cg_button;
+    }
+
+    post(CGEventCreateMouseEvent(raw->source, type, cursor_location(), cg_button));
+  }
+
+  void
+  scroll(input_t &input, int distance) {
+    auto raw = (input_raw_t *) input.get();
+    post(CGEventCreateScrollWheelEvent(raw->source, kCGScrollEventUnitPixel, 1, distance));
+  }
+
+  void
+  hscroll(input_t &input, int distance) {
+    auto raw = (input_raw_t *) input.get();
+    post(CGEventCreateScrollWheelEvent(raw->source, kCGScrollEventUnitPixel, 2, 0, distance));
+  }
+
+  void
+  keyboard_update(input_t &input, std::uint16_t modcode, bool release, std::uint8_t flags) {
+    auto raw = (input_raw_t *) input.get();
+
+    auto keycode = KEYCODES[modcode & 0xFF];
+    if (keycode == NO_KEY) {
+      BOOST_LOG(debug) << "Virtual key "sv << util::hex(modcode).to_string_view() << " has no macOS key"sv;
+      return;
+    }
+
+    if (auto modifier = modifier_flag(modcode & 0xFF)) {
+      raw->modifiers = release ? raw->modifiers & ~modifier : raw->modifiers | modifier;
+    }
+
+    auto event = CGEventCreateKeyboardEvent(raw->source, keycode, !release);
+    if (event) {
+      CGEventSetFlags(event, raw->modifiers);
+    }
+    post(event);
+  }
+
+  void
+  unicode(input_t &input, char *utf8, int size) {
+    auto raw = (input_raw_t *) input.get();
+
+    auto text = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *) utf8, size, kCFStringEncodingUTF8, false);
+    if (!text) {
+      BOOST_LOG(warning) << "Invalid UTF-8 in the text of the client"sv;
+      return;
+    }
+
+    std::vector<UniChar> characters(CFStringGetLength(text));
+    CFStringGetCharacters(text, CFRangeMake(0, characters.size()), characters.data());
+    CFRelease(text);
+
+    for (auto down : { true, false }) {
+      auto event = CGEventCreateKeyboardEvent(raw->source, 0, down);
+      if (event) {
+        CGEventKeyboardSetUnicodeString(event, characters.size(), characters.data());
+      }
+      post(event);
+    }
+  }
+
+  int
+  alloc_gamepad(input_t &input, const gamepad_id_t &id, const gamepad_arrival_t &metadata) {
+    BOOST_LOG(warning) << "Gamepad "sv << id.globalIndex << " isn't injected, macOS has no virtual gamepads"sv;
+    return -1;
+  }
+
+  void
+  free_gamepad(input_t &input, int nr) {}
+
+  void
+  gamepad_update(input_t &input, int nr, const gamepad_state_t &gamepad_state) {}
+}  // namespace platf
@@ -2,6 +2,9 @@
  * @file src/platform/macos/microphone.mm
  * @brief todo
  */
+#include <algorithm>
+#include <atomic>
+
 #include "src/platform/common.h"
 #include "src/platform/macos/av_audio.h"
 
@@ -11,31 +14,121 @@
 namespace platf {
   using namespace std::literals;
 
+  /**
+   * @brief Wait-free ring of interleaved 16-bit samples from the capture callback to `sample()`.
+   * @details There is a single writer, the serial capture queue, and a single reader. Neither takes
+   *          a lock, the reader sleeps on a semaphore that is signalled once for every whole frame
+   *          written. A reader that falls behind loses the newest samples, the callback never waits.
+   */
+  class pcm_ring_t {
+  public:
+    /**
+     * @param frame_samples Samples of all channels in a frame handed to `sample()`.
+     * @param frames Frames the ring holds.
+     * @param channels Samples are dropped in whole sample frames, so the channels stay in order.
+     */
+    pcm_ring_t(std::size_t frame_samples, std::size_t frames, int channels):
+        buffer(frame_samples * frames), frame_samples { frame_samples }, channels { (std::size_t) channels },
+        frames_ready { dispatch_semaphore_create(0) } {}
+
+    ~pcm_ring_t() {
+      dispatch_release(frames_ready);
+    }
+
+    // Called by the capture callback
+    void
+    write(const std::int16_t *samples, std::size_t count) {
+      auto head = this->head.load(std::memory_order_relaxed);
+      auto tail = this->tail.load(std::memory_order_acquire);
+
+      auto space = buffer.size() - (head - tail);
+      if (count > space) {
+        dropped.fetch_add(count - space, std::memory_order_relaxed);
+        count = space - space % channels;
+      }
+
+      auto offset = head % buffer.size();
+      auto first = std::min(count, buffer.size() - offset);
+      std::copy_n(samples, first, &buffer[offset]);
+      std::copy_n(samples + first, count - first, buffer.data());
+
+      this->head.store(head + count, std::memory_order_release);
+
+      for (auto frames = (head + count) / frame_samples - head / frame_samples; frames; --frames) {
+        dispatch_semaphore_signal(frames_ready);
+      }
+    }
+
+    /**
+     * @brief Take the oldest frame.
+     * @param out `frame_samples` samples.
+     * @param buffered Samples that were in the ring, including the frame.
+     * @return false if no frame arrived within the timeout.
+     */
+    bool
+    read(std::int16_t *out, std::chrono::nanoseconds timeout, std::size_t &buffered) {
+      if (dispatch_semaphore_wait(frames_ready, dispatch_time(DISPATCH_TIME_NOW, timeout.count()))) {
+        return false;
+      }
+
+      auto tail = this->tail.load(std::memory_order_relaxed);
+      auto head = this->head.load(std::memory_order_acquire);
+      buffered = head - tail;
+
+      auto offset = tail % buffer.size();
+      auto first = std::min(frame_samples, buffer.size() - offset);
+      std::copy_n(&buffer[offset], first, out);
+      std::copy_n(buffer.data(), frame_samples - first, out + first);
+
+      this->tail.store(tail + frame_samples, std::memory_order_release);
+      return true;
+    }
+
+    // Samples lost since the last call
+    std::size_t
+    take_dropped() {
+      return dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::vector<std::int16_t> buffer;
+    std::size_t frame_samples;
+    std::size_t channels;
+
+    // Samples ever written and read, the ring index is taken modulo its size
+    std::atomic<std::size_t> head { 0 };
+    std::atomic<std::size_t> tail { 0 };
+    std::atomic<std::size_t> dropped { 0 };
+
+    dispatch_semaphore_t frames_ready;
+  };
+
   struct av_mic_t: public mic_t {
     AVAudio *av_audio_capture {};
 
+    int channels;
+    std::uint32_t sample_rate;
+    std::unique_ptr<pcm_ring_t> ring;
+
     ~av_mic_t() override {
+      // Stops the callback before the ring goes away
       [av_audio_capture release];
     }
 
     capture_e
-    sample(std::vector<std::int16_t> &sample_in) override {
-      auto sample_size = sample_in.size();
-
-      uint32_t length = 0;
-      void *byteSampleBuffer = TPCircularBufferTail(&av_audio_capture->audioSampleBuffer, &length);
-
-      while (length < sample_size * sizeof(std::int16_t)) {
-        [av_audio_capture.samplesArrivedSignal wait];
-        byteSampleBuffer = TPCircularBufferTail(&av_audio_capture->audioSampleBuffer, &length);
+    sample(std::vector<std::int16_t> &sample_in, std::chrono::steady_clock::time_point &capture_time) override {
+      std::size_t buffered;
+      if (!ring->read(sample_in.data(), 500ms, buffered)) {
+        return capture_e::timeout;
       }
 
-      const int16_t *sampleBuffer = (int16_t *) byteSampleBuffer;
-      std::vector<int16_t> vectorBuffer(sampleBuffer, sampleBuffer + sample_size);
-
-      std::copy_n(std::begin(vectorBuffer), sample_size, std::begin(sample_in));
+      if (auto dropped = ring->take_dropped()) {
+        BOOST_LOG(warning) << "Audio capture overran, "sv << dropped / channels << " frames of samples were dropped"sv;
+      }
 
-      TPCircularBufferConsume(&av_audio_capture->audioSampleBuffer, sample_size * sizeof(std::int16_t));
+      // The frame is the oldest audio of the ring, everything after it was recorded since
+      auto buffered_frames = buffered / channels;
+      capture_time = std::chrono::steady_clock::now() - std::chrono::nanoseconds { (std::int64_t) buffered_frames * 1000000000 / sample_rate };
 
       return capture_e::ok;
     }
@@ -54,6 +147,8 @@ namespace platf {
     std::unique_ptr<mic_t>
     microphone(const std::uint8_t *mapping, int channels, std::uint32_t sample_rate, std::uint32_t frame_size) override {
       auto mic = std::make_unique<av_mic_t>();
+      mic->channels = channels;
+      mic->sample_rate = sample_rate;
       const char *audio_sink = "";
 
       if (!config::audio.sink.empty()) {
@@ -71,9 +166,15 @@ namespace platf {
         return nullptr;
       }
 
+      // Enough for the callback to run ahead of the encoder by a few packets
+      mic->ring = std::make_unique<pcm_ring_t>((std::size_t) frame_size * channels, 8, channels);
       mic->av_audio_capture = [[AVAudio alloc] init];
 
-      if ([mic->av_audio_capture setupMicrophone:audio_capture_device sampleRate:sample_rate frameSize:frame_size channels:channels]) {
+      auto ring = mic->ring.get();
+      auto samples_arrived = ^(const void *data, UInt32 size) {
+        ring->write((const std::int16_t *) data, size / sizeof(std::int16_t));
+      };
+      if ([mic->av_audio_capture setupMicrophone:audio_capture_device sampleRate:sample_rate frameSize:frame_size channels:channels samplesArrived:samples_arrived]) {
         BOOST_LOG(error) << "Failed to setup microphone."sv;
         return nullptr;
       }
@@ -16,6 +16,7 @@
 #include <mach-o/dyld.h>
 #include <net/if_dl.h>
 #include <pwd.h>
+#include <thread>
 
 #include "misc.h"
 #include "src/logging.h"
@@ -213,6 +214,11 @@ namespace platf {
     // Unimplemented
   }
 
+  void
+  place_pipeline_thread(std::string_view name) {
+    // Unimplemented, macOS only takes affinity tags as hints
+  }
+
 
 
   void
@@ -289,10 +295,10 @@ namespace platf {
     return saddr_v6;
   }
 
-  bool
+  size_t
   send_batch(batched_send_info_t &send_info) {
     // Fall back to unbatched send calls
-    return false;
+    return 0;
   }
 
   bool
@@ -355,12 +361,14 @@ namespace platf {
       memcpy(CMSG_DATA(pktinfo_cm), &pktInfo, sizeof(pktInfo));
     }
 
-    struct iovec iov = {};
-    iov.iov_base = (void *) send_info.buffer;
-    iov.iov_len = send_info.size;
+    struct iovec iovs[2] = {};
+    iovs[0].iov_base = (void *) send_info.header;
+    iovs[0].iov_len = send_info.header_size;
+    iovs[1].iov_base = (void *) send_info.buffer;
+    iovs[1].iov_len = send_info.size;
 
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = 2;
 
     msg.msg_controllen = cmbuflen;
 
@@ -418,6 +426,12 @@ namespace platf {
     std::vector<std::tuple<int, int, int>> options;
   };
 
+  bool
+  enable_socket_txtime(std::uintptr_t native_socket) {
+    // Departure times are a feature of the Linux qdiscs, the pacer sleeps instead
+    return false;
+  }
+
   /**
    * @brief Enables QoS on the given socket for traffic to the specified destination.
    * @param native_socket The native socket handle.
@@ -499,6 +513,22 @@ namespace platf {
     return std::make_unique<qos_t>(sockfd, reset_options);
   }
 
+  class macos_high_precision_timer: public high_precision_timer {
+  public:
+    void
+    sleep_for(const std::chrono::nanoseconds &duration) override {
+      std::this_thread::sleep_for(duration);
+    }
+
+    operator bool() override {
+      return true;
+    }
+  };
+
+  std::unique_ptr<high_precision_timer>
+  create_high_precision_timer() {
+    return std::make_unique<macos_high_precision_timer>();
+  }
 }  // namespace platf
 
 namespace dyn {
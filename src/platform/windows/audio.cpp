@@ -15,6 +15,7 @@
 
 #include "src/config.h"
 #include "src/logging.h"
+#include "src/pcm.h"
 #include "src/platform/common.h"
 
 #include "misc.h"
@@ -58,6 +59,7 @@ namespace platf::audio {
   using device_t = util::safe_ptr<IMMDevice, Release<IMMDevice>>;
   using collection_t = util::safe_ptr<IMMDeviceCollection, Release<IMMDeviceCollection>>;
   using audio_client_t = util::safe_ptr<IAudioClient, Release<IAudioClient>>;
+  using audio_client3_t = util::safe_ptr<IAudioClient3, Release<IAudioClient3>>;
   using audio_capture_t = util::safe_ptr<IAudioCaptureClient, Release<IAudioCaptureClient>>;
   using wave_format_t = util::safe_ptr<WAVEFORMATEX, co_task_free<WAVEFORMATEX>>;
   using wstring_t = util::safe_ptr<WCHAR, co_task_free<WCHAR>>;
@@ -193,8 +195,76 @@ namespace platf::audio {
     return 0;
   }
 
+  /**
+   * @brief Initialize a shared stream with the shortest engine period that evenly divides a packet.
+   * @details The packets then come in whole periods, so they aren't delayed by the default period of ~10 ms.
+   * @return nullptr if the device has no period shorter than the default one that fits.
+   */
   audio_client_t
-  make_audio_client(device_t &device, const format_t &format) {
+  make_low_latency_audio_client(device_t &device, const WAVEFORMATEX *wave_format, std::string_view name, std::uint32_t frame_size) {
+    audio_client3_t audio_client;
+    auto status = device->Activate(
+      IID_IAudioClient3,
+      CLSCTX_ALL,
+      nullptr,
+      (void **) &audio_client);
+
+    if (FAILED(status)) {
+      BOOST_LOG(debug) << "IAudioClient3 is unavailable: [0x"sv << util::hex(status).to_string_view() << ']';
+      return nullptr;
+    }
+
+    UINT32 default_period, fundamental_period, min_period, max_period;
+    status = audio_client->GetSharedModeEnginePeriod(
+      wave_format,
+      &default_period, &fundamental_period, &min_period, &max_period);
+
+    if (FAILED(status)) {
+      BOOST_LOG(debug) << "Couldn't get the engine periods for ["sv << name << "]: [0x"sv << util::hex(status).to_string_view() << ']';
+      return nullptr;
+    }
+
+    // Periods are multiples of the fundamental period
+    UINT32 period = 0;
+    for (auto candidate = min_period; fundamental_period && candidate < default_period && candidate <= std::min(max_period, frame_size); candidate += fundamental_period) {
+      if (frame_size % candidate == 0) {
+        period = candidate;
+        break;
+      }
+    }
+
+    if (!period) {
+      BOOST_LOG(debug) << "No engine period shorter than "sv << default_period << " frames divides packets of "sv << frame_size << " frames"sv;
+      return nullptr;
+    }
+
+    status = audio_client->InitializeSharedAudioStream(
+      AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+      period,
+      wave_format,
+      nullptr);
+
+    if (FAILED(status)) {
+      BOOST_LOG(debug) << "Couldn't initialize low latency audio client for ["sv << name << "]: [0x"sv << util::hex(status).to_string_view() << ']';
+      return nullptr;
+    }
+
+    BOOST_LOG(info) << "Capturing audio with an engine period of "sv << period << " frames instead of "sv << default_period;
+    return audio_client_t { audio_client.release() };
+  }
+
+  /**
+   * @param frame_size Frames per packet, the stream is tuned for low latency when it isn't 0.
+   */
+  audio_client_t
+  make_audio_client(device_t &device, const WAVEFORMATEX *wave_format, std::string_view name, std::uint32_t frame_size = 0) {
+    if (frame_size) {
+      auto audio_client = make_low_latency_audio_client(device, wave_format, name, frame_size);
+      if (audio_client) {
+        return audio_client;
+      }
+    }
+
     audio_client_t audio_client;
     auto status = device->Activate(
       IID_IAudioClient,
@@ -208,24 +278,70 @@ namespace platf::audio {
       return nullptr;
     }
 
-    WAVEFORMATEXTENSIBLE wave_format = create_wave_format(format);
-
     status = audio_client->Initialize(
       AUDCLNT_SHAREMODE_SHARED,
       AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK |
         AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY,  // Enable automatic resampling to 48 KHz
       0, 0,
-      (LPWAVEFORMATEX) &wave_format,
+      wave_format,
       nullptr);
 
     if (status) {
-      BOOST_LOG(debug) << "Couldn't initialize audio client for ["sv << format.name << "]: [0x"sv << util::hex(status).to_string_view() << ']';
+      BOOST_LOG(debug) << "Couldn't initialize audio client for ["sv << name << "]: [0x"sv << util::hex(status).to_string_view() << ']';
       return nullptr;
     }
 
     return audio_client;
   }
 
+  audio_client_t
+  make_audio_client(device_t &device, const format_t &format, std::uint32_t frame_size = 0) {
+    WAVEFORMATEXTENSIBLE wave_format = create_wave_format(format);
+    return make_audio_client(device, (LPWAVEFORMATEX) &wave_format, format.name, frame_size);
+  }
+
+  /**
+   * @brief Mix format of the device if it is captured without conversion by the audio engine.
+   * @details The audio engine mixes in 32-bit float, capturing that format spares its conversion and channel
+   *          mapping, pcm::mixer() converts it instead.
+   * @return nullptr if the device doesn't mix 32-bit float at 48 KHz in a layout pcm::mixer() knows.
+   */
+  wave_format_t
+  native_wave_format(device_t &device, std::uint32_t channels_out) {
+    audio_client_t audio_client;
+    auto status = device->Activate(
+      IID_IAudioClient,
+      CLSCTX_ALL,
+      nullptr,
+      (void **) &audio_client);
+
+    if (FAILED(status)) {
+      return nullptr;
+    }
+
+    wave_format_t wave_format;
+    status = audio_client->GetMixFormat(&wave_format);
+    if (FAILED(status)) {
+      BOOST_LOG(debug) << "Couldn't get the mix format of the device: [0x"sv << util::hex(status).to_string_view() << ']';
+      return nullptr;
+    }
+
+    auto is_float = wave_format->wFormatTag == WAVE_FORMAT_IEEE_FLOAT ||
+                    (wave_format->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+                      ((PWAVEFORMATEXTENSIBLE) wave_format.get())->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT);
+
+    if (!is_float || wave_format->wBitsPerSample != 32 || wave_format->nSamplesPerSec != SAMPLE_RATE ||
+        !pcm::mixer(wave_format->nChannels, channels_out)) {
+      BOOST_LOG(debug) << "Mix format of the device needs the audio engine: "sv
+                       << wave_format->nChannels << " channels, "sv
+                       << wave_format->wBitsPerSample << " bits, "sv
+                       << wave_format->nSamplesPerSec << " Hz"sv;
+      return nullptr;
+    }
+
+    return wave_format;
+  }
+
   const wchar_t *
   no_null(const wchar_t *str) {
     return str ? str : L"Unknown";
@@ -342,7 +458,7 @@ namespace platf::audio {
   class mic_wasapi_t: public mic_t {
   public:
     capture_e
-    sample(std::vector<std::int16_t> &sample_out) override {
+    sample(std::vector<std::int16_t> &sample_out, std::chrono::steady_clock::time_point &capture_time) override {
       auto sample_size = sample_out.size();
 
       // Refill the sample buffer if needed
@@ -355,6 +471,8 @@ namespace platf::audio {
 
       // Fill the output buffer with samples
       std::copy_n(std::begin(sample_buf), sample_size, std::begin(sample_out));
+      capture_time = sample_buf_time;
+      sample_buf_time += block_duration(sample_size);
 
       // Move any excess samples to the front of the buffer
       std::move(&sample_buf[sample_size], sample_buf_pos, std::begin(sample_buf));
@@ -399,14 +517,31 @@ namespace platf::audio {
         return -1;
       }
 
+      // The mix format of the device first, the audio engine converts into the format of the stream otherwise
+      if (auto wave_format = native_wave_format(device, channels_out)) {
+        audio_client = make_audio_client(device, wave_format.get(), "Native"sv, frame_size);
+
+        if (audio_client) {
+          device_channels = wave_format->nChannels;
+          mix = pcm::mixer(device_channels, channels_out);
+          channels = channels_out;
+          BOOST_LOG(info) << "Capturing the native audio format of "sv << device_channels << " channels, mixed into "sv
+                          << channels_out << " with the "sv << pcm::kernel_name() << " kernels"sv;
+        }
+      }
+
       for (auto &format : formats) {
+        if (audio_client) {
+          break;
+        }
+
         if (format.channels != channels_out) {
           BOOST_LOG(debug) << "Skipping audio format ["sv << format.name << "] with channel count ["sv << format.channels << " != "sv << channels_out << ']';
           continue;
         }
 
         BOOST_LOG(debug) << "Trying audio format ["sv << format.name << ']';
-        audio_client = make_audio_client(device, format);
+        audio_client = make_audio_client(device, format, frame_size);
 
         if (audio_client) {
           BOOST_LOG(debug) << "Found audio format ["sv << format.name << ']';
@@ -435,6 +570,7 @@ namespace platf::audio {
       // *2 --> needs to fit double
       sample_buf = util::buffer_t<std::int16_t> { std::max(frames, frame_size) * 2 * channels_out };
       sample_buf_pos = std::begin(sample_buf);
+      this->sample_rate = sample_rate;
 
       status = audio_client->GetService(IID_IAudioCaptureClient, (void **) &audio_capture);
       if (FAILED(status)) {
@@ -483,6 +619,27 @@ namespace platf::audio {
     }
 
   private:
+    std::chrono::nanoseconds
+    block_duration(std::size_t samples) const {
+      return std::chrono::nanoseconds { (std::int64_t) (samples / channels) * 1000000000 / sample_rate };
+    }
+
+    /**
+     * @brief Steady clock time of a QPC position of WASAPI, in 100 ns units.
+     */
+    static std::chrono::steady_clock::time_point
+    qpc_position_time(UINT64 qpc_position) {
+      static const auto frequency = []() {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return frequency.QuadPart;
+      }();
+
+      auto now = std::chrono::steady_clock::now();
+      auto now_100ns = (std::int64_t) ((double) qpc_counter() * 10000000 / frequency);
+      return now - std::chrono::nanoseconds { (now_100ns - (std::int64_t) qpc_position) * 100 };
+    }
+
     capture_e
     _fill_buffer() {
       HRESULT status;
@@ -490,7 +647,7 @@ namespace platf::audio {
       // Total number of samples
       struct sample_aligned_t {
         std::uint32_t uninitialized;
-        std::int16_t *samples;
+        BYTE *samples;
       } sample_aligned;
 
       // number of samples / number of channels
@@ -526,11 +683,12 @@ namespace platf::audio {
         SUCCEEDED(status) && packet_size > 0;
         status = audio_capture->GetNextPacketSize(&packet_size)) {
         DWORD buffer_flags;
+        UINT64 qpc_position = 0;
         status = audio_capture->GetBuffer(
-          (BYTE **) &sample_aligned.samples,
+          &sample_aligned.samples,
           &block_aligned.audio_sample_size,
           &buffer_flags,
-          nullptr, nullptr);
+          nullptr, &qpc_position);
 
         switch (status) {
           case S_OK:
@@ -553,11 +711,20 @@ namespace platf::audio {
           BOOST_LOG(warning) << "Audio capture buffer overflow";
         }
 
+        // The samples already in the buffer were recorded right before this packet
+        if (sample_buf_pos == std::begin(sample_buf)) {
+          auto packet_time = (buffer_flags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR) ? std::chrono::steady_clock::now() : qpc_position_time(qpc_position);
+          sample_buf_time = packet_time;
+        }
+
         if (buffer_flags & AUDCLNT_BUFFERFLAGS_SILENT) {
           std::fill_n(sample_buf_pos, n, 0);
         }
+        else if (mix) {
+          mix((const float *) sample_aligned.samples, sample_buf_pos, n / channels);
+        }
         else {
-          std::copy_n(sample_aligned.samples, n, sample_buf_pos);
+          std::copy_n((const std::int16_t *) sample_aligned.samples, n, sample_buf_pos);
         }
 
         sample_buf_pos += n;
@@ -591,7 +758,14 @@ namespace platf::audio {
 
     util::buffer_t<std::int16_t> sample_buf;
     std::int16_t *sample_buf_pos;
+    // When the first sample of sample_buf was recorded
+    std::chrono::steady_clock::time_point sample_buf_time;
     int channels;
+    std::uint32_t sample_rate;
+
+    // Converts the native format of the device into the samples of the stream, nullptr if the audio engine converts it
+    pcm::mix_fn mix = nullptr;
+    int device_channels = 0;
 
     HANDLE mmcss_task_handle = NULL;
   };
@@ -166,6 +166,13 @@ namespace platf::dxgi {
     capture_e
     capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override;
 
+    /**
+     * @brief The adapter the encoders run on.
+     * @return The adapter named by `config::video.encode_adapter_name`, or the one of the capture.
+     */
+    adapter_t
+    encode_adapter();
+
     factory1_t factory;
     adapter_t adapter;
     output_t output;
@@ -298,6 +305,9 @@ namespace platf::dxgi {
     std::unique_ptr<nvenc_encode_device_t>
     make_nvenc_encode_device(pix_fmt_e pix_fmt) override;
 
+    std::unique_ptr<amf_encode_device_t>
+    make_amf_encode_device(pix_fmt_e pix_fmt) override;
+
     sampler_state_t sampler_linear;
 
     blend_t blend_alpha;
@@ -325,6 +335,14 @@ namespace platf::dxgi {
 
     int
     init(display_base_t *display, const ::video::config_t &config);
+
+    /**
+     * @brief Duplicate the output again on the device of the display, after the access to it was lost.
+     * @return 0 if the output kept the mode of the display, -1 if the display has to be recreated.
+     */
+    int
+    reinit(display_base_t *display);
+
     capture_e
     next_frame(DXGI_OUTDUPL_FRAME_INFO &frame_info, std::chrono::milliseconds timeout, resource_t::pointer *res_p);
     capture_e
@@ -332,7 +350,17 @@ namespace platf::dxgi {
     capture_e
     release_frame();
 
+    /**
+     * @brief Regions of the acquired frame that changed since the previous frame.
+     * @return Moved and dirty rectangles in desktop texture coordinates, std::nullopt if DXGI didn't report them.
+     */
+    std::optional<std::vector<platf::rect_t>>
+    damage(const DXGI_OUTDUPL_FRAME_INFO &frame_info);
+
     ~duplication_t();
+
+  private:
+    std::vector<std::uint8_t> metadata;
   };
 
   /**
@@ -346,9 +374,32 @@ namespace platf::dxgi {
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor_visible) override;
     capture_e
     release_snapshot() override;
+    bool
+    reinit_capture() override;
 
     duplication_t dup;
     cursor_t cursor;
+
+    std::uint64_t capture_sequence = 0;
+
+    // Set when the last image holds the desktop frame without a cursor, so DXGI damage applies to it
+    bool damage_base_valid = false;
+
+    struct frame_damage_t {
+      std::uint64_t capture_sequence;
+
+      // Regions of the desktop that changed since the frame before, std::nullopt if unknown
+      std::optional<std::vector<platf::rect_t>> desktop;
+
+      // Region the cursor was blended onto
+      std::optional<platf::rect_t> cursor;
+    };
+
+    // The last frames, oldest first. Images of the pool that hold one of them are only updated where they differ
+    std::vector<frame_damage_t> frame_history;
+
+    // Set when the staging texture holds the last desktop frame, so only its damage must be copied into it
+    bool staging_valid = false;
   };
 
   /**
@@ -362,6 +413,8 @@ namespace platf::dxgi {
     snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor_visible) override;
     capture_e
     release_snapshot() override;
+    bool
+    reinit_capture() override;
 
     duplication_t dup;
     sampler_state_t sampler_linear;
@@ -379,6 +432,11 @@ namespace platf::dxgi {
     texture2d_t old_surface_delayed_destruction;
     std::chrono::steady_clock::time_point old_surface_timestamp;
     std::variant<std::monostate, texture2d_t, std::shared_ptr<platf::img_t>> last_frame_variant;
+
+    std::uint64_t capture_sequence = 0;
+
+    // Set when the last image holds the desktop frame without a cursor, so DXGI damage applies to it
+    bool damage_base_valid = false;
   };
 
   /**
@@ -393,6 +451,12 @@ namespace platf::dxgi {
     SRWLOCK frame_lock = SRWLOCK_INIT;
     CONDITION_VARIABLE frame_present_cv;
 
+    // Regions that changed in a frame since the frame before it, std::nullopt if unknown
+    std::optional<std::vector<platf::rect_t>> produced_damage, consumed_damage;
+
+    // Set when the session reports the dirty regions of its frames
+    bool report_dirty_regions = false;
+
     void
     on_frame_arrived(winrt::Windows::Graphics::Capture::Direct3D11CaptureFramePool const &sender, winrt::Windows::Foundation::IInspectable const &);
 
@@ -408,6 +472,13 @@ namespace platf::dxgi {
     release_frame();
     int
     set_cursor_visible(bool);
+
+    /**
+     * @brief Regions that changed in the frame returned by next_frame(), relative to the frame it returned before.
+     * @return std::nullopt if unknown, Windows only reports them from Windows 11 24H2 on.
+     */
+    const std::optional<std::vector<platf::rect_t>> &
+    damage() const;
   };
 
   /**
@@ -431,6 +502,8 @@ namespace platf::dxgi {
   class display_wgc_vram_t: public display_vram_t {
     wgc_capture_t dup;
 
+    std::uint64_t capture_sequence = 0;
+
   public:
     int
     init(const ::video::config_t &config, const std::string &display_name);
@@ -4,6 +4,7 @@
  */
 #include <cmath>
 #include <initguid.h>
+#include <sstream>
 #include <thread>
 
 #include <boost/process.hpp>
@@ -111,6 +112,32 @@ namespace platf::dxgi {
     return 0;
   }
 
+  int
+  duplication_t::reinit(display_base_t *display) {
+    // Adapters, outputs or the HDR state changed, the device may be gone as well
+    if (!display->factory->IsCurrent()) {
+      return -1;
+    }
+
+    auto capture_format = display->capture_format;
+    reset();
+    if (init(display, {})) {
+      return -1;
+    }
+
+    DXGI_OUTDUPL_DESC dup_desc;
+    dup->GetDesc(&dup_desc);
+    if (dup_desc.ModeDesc.Width != display->width_before_rotation || dup_desc.ModeDesc.Height != display->height_before_rotation ||
+        dup_desc.Rotation != display->display_rotation) {
+      BOOST_LOG(info) << "Display mode changed, recreating the display"sv;
+      return -1;
+    }
+
+    // A format that changed is still caught by the first frame, the display is recreated then
+    display->capture_format = capture_format;
+    return 0;
+  }
+
   capture_e
   duplication_t::next_frame(DXGI_OUTDUPL_FRAME_INFO &frame_info, std::chrono::milliseconds timeout, resource_t::pointer *res_p) {
     auto capture_status = release_frame();
@@ -178,6 +205,45 @@ namespace platf::dxgi {
     }
   }
 
+  std::optional<std::vector<platf::rect_t>>
+  duplication_t::damage(const DXGI_OUTDUPL_FRAME_INFO &frame_info) {
+    if (!has_frame || !frame_info.TotalMetadataBufferSize) {
+      return std::nullopt;
+    }
+
+    metadata.resize(frame_info.TotalMetadataBufferSize);
+
+    std::vector<platf::rect_t> rects;
+
+    // Move rectangles come first, only their destination changed
+    UINT size;
+    auto status = dup->GetFrameMoveRects(metadata.size(), (DXGI_OUTDUPL_MOVE_RECT *) metadata.data(), &size);
+    if (FAILED(status)) {
+      BOOST_LOG(debug) << "Failed to get move rectangles [0x"sv << util::hex(status).to_string_view() << ']';
+      return std::nullopt;
+    }
+
+    auto move_rects = (DXGI_OUTDUPL_MOVE_RECT *) metadata.data();
+    for (UINT x = 0; x < size / sizeof(DXGI_OUTDUPL_MOVE_RECT); ++x) {
+      auto &rect = move_rects[x].DestinationRect;
+      rects.emplace_back(platf::rect_t { rect.left, rect.top, rect.right, rect.bottom });
+    }
+
+    status = dup->GetFrameDirtyRects(metadata.size(), (RECT *) metadata.data(), &size);
+    if (FAILED(status)) {
+      BOOST_LOG(debug) << "Failed to get dirty rectangles [0x"sv << util::hex(status).to_string_view() << ']';
+      return std::nullopt;
+    }
+
+    auto dirty_rects = (RECT *) metadata.data();
+    for (UINT x = 0; x < size / sizeof(RECT); ++x) {
+      auto &rect = dirty_rects[x];
+      rects.emplace_back(platf::rect_t { rect.left, rect.top, rect.right, rect.bottom });
+    }
+
+    return rects;
+  }
+
   duplication_t::~duplication_t() {
     release_frame();
   }
@@ -719,6 +785,27 @@ namespace platf::dxgi {
     return 0;
   }
 
+  adapter_t
+  display_base_t::encode_adapter() {
+    auto encode_adapter_name = from_utf8(config::video.encode_adapter_name);
+    if (!encode_adapter_name.empty()) {
+      adapter_t::pointer adapter_p;
+      for (int x = 0; factory->EnumAdapters1(x, &adapter_p) != DXGI_ERROR_NOT_FOUND; ++x) {
+        adapter_t adapter_tmp { adapter_p };
+
+        DXGI_ADAPTER_DESC1 adapter_desc;
+        adapter_tmp->GetDesc1(&adapter_desc);
+        if (adapter_desc.Description == encode_adapter_name) {
+          return adapter_tmp;
+        }
+      }
+
+      BOOST_LOG(warning) << "Encode adapter ["sv << config::video.encode_adapter_name << "] not found, encoding on the capture adapter"sv;
+    }
+
+    adapter->AddRef();
+    return adapter_t { adapter.get() };
+  }
 
   bool
   display_base_t::is_hdr() {
@@ -996,6 +1083,12 @@ namespace platf {
     return nullptr;
   }
 
+  std::optional<rect_t>
+  window_rect(const std::string &title) {
+    // The displays of Windows encode the whole output, so there's no region to follow a window with
+    return std::nullopt;
+  }
+
   std::vector<std::string>
   display_names(mem_type_e) {
     std::vector<std::string> display_names;
@@ -1099,4 +1192,35 @@ namespace platf {
       return false;
     }
   }
+
+  std::string
+  gpu_identity() {
+    dxgi::factory1_t factory;
+    auto status = CreateDXGIFactory1(IID_IDXGIFactory1, (void **) &factory);
+    if (FAILED(status)) {
+      BOOST_LOG(error) << "Failed to create DXGIFactory1 [0x"sv << util::hex(status).to_string_view() << ']';
+      return {};
+    }
+
+    std::stringstream identity;
+
+    // The LUID changes with every boot, so adapters are identified by their PCI IDs
+    dxgi::adapter_t adapter;
+    for (int x = 0; factory->EnumAdapters1(x, &adapter) != DXGI_ERROR_NOT_FOUND; ++x) {
+      DXGI_ADAPTER_DESC1 adapter_desc;
+      adapter->GetDesc1(&adapter_desc);
+
+      // Version of the user mode driver
+      LARGE_INTEGER driver_version {};
+      adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driver_version);
+
+      identity << std::hex
+               << adapter_desc.VendorId << ':' << adapter_desc.DeviceId << ':' << adapter_desc.SubSysId << ':' << adapter_desc.Revision << ' '
+               << std::dec
+               << HIWORD(driver_version.HighPart) << '.' << LOWORD(driver_version.HighPart) << '.'
+               << HIWORD(driver_version.LowPart) << '.' << LOWORD(driver_version.LowPart) << ';';
+    }
+
+    return identity.str();
+  }
 }  // namespace platf
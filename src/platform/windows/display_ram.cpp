@@ -2,10 +2,15 @@
  * @file src/platform/windows/display_ram.cpp
  * @brief todo
  */
+#include <algorithm>
+
 #include "display.h"
 
 #include "misc.h"
 #include "src/logging.h"
+#include "src/memory.h"
+#include "src/pixel.h"
+#include "src/trace.h"
 
 namespace platf {
   using namespace std::literals;
@@ -14,7 +19,7 @@ namespace platf {
 namespace platf::dxgi {
   struct img_t: public ::platf::img_t {
     ~img_t() override {
-      delete[] data;
+      memory::free(data);
       data = nullptr;
     }
   };
@@ -48,66 +53,14 @@ namespace platf::dxgi {
     int delta_height = std::min(cursor_height - cursor_truncate_y, std::max(0, img.height - img_skip_y));
     int delta_width = std::min(cursor_width - cursor_truncate_x, std::max(0, img.width - img_skip_x));
 
-    auto pixels_per_byte = width / pitch;
-    auto bytes_per_row = delta_width / pixels_per_byte;
-
-    auto img_data = (int *) img.data;
+    // The parts of the masks left of the image are skipped bit by bit
+    auto img_data = (std::uint32_t *) img.data;
     for (int i = 0; i < delta_height; ++i) {
       auto and_mask = &cursor_img_data[i * pitch];
       auto xor_mask = &cursor_img_data[(i + height) * pitch];
 
       auto img_pixel_p = &img_data[(i + img_skip_y) * (img.row_pitch / img.pixel_pitch) + img_skip_x];
-
-      auto skip_x = cursor_skip_x;
-      for (int x = 0; x < bytes_per_row; ++x) {
-        for (auto bit = 0u; bit < 8; ++bit) {
-          if (skip_x > 0) {
-            --skip_x;
-
-            continue;
-          }
-
-          int and_ = *and_mask & (1 << (7 - bit)) ? -1 : 0;
-          int xor_ = *xor_mask & (1 << (7 - bit)) ? -1 : 0;
-
-          *img_pixel_p &= and_;
-          *img_pixel_p ^= xor_;
-
-          ++img_pixel_p;
-        }
-
-        ++and_mask;
-        ++xor_mask;
-      }
-    }
-  }
-
-  void
-  apply_color_alpha(int *img_pixel_p, int cursor_pixel) {
-    auto colors_out = (std::uint8_t *) &cursor_pixel;
-    auto colors_in = (std::uint8_t *) img_pixel_p;
-
-    // TODO: When use of IDXGIOutput5 is implemented, support different color formats
-    auto alpha = colors_out[3];
-    if (alpha == 255) {
-      *img_pixel_p = cursor_pixel;
-    }
-    else {
-      colors_in[0] = colors_out[0] + (colors_in[0] * (255 - alpha) + 255 / 2) / 255;
-      colors_in[1] = colors_out[1] + (colors_in[1] * (255 - alpha) + 255 / 2) / 255;
-      colors_in[2] = colors_out[2] + (colors_in[2] * (255 - alpha) + 255 / 2) / 255;
-    }
-  }
-
-  void
-  apply_color_masked(int *img_pixel_p, int cursor_pixel) {
-    // TODO: When use of IDXGIOutput5 is implemented, support different color formats
-    auto alpha = ((std::uint8_t *) &cursor_pixel)[3];
-    if (alpha == 0xFF) {
-      *img_pixel_p ^= cursor_pixel;
-    }
-    else {
-      *img_pixel_p = cursor_pixel;
+      pixel::blend_monochrome(img_pixel_p, and_mask, xor_mask, cursor_skip_x, std::max(0, delta_width));
     }
   }
 
@@ -135,27 +88,27 @@ namespace platf::dxgi {
       return;
     }
 
-    auto cursor_img_data = (int *) &cursor.img_data[cursor_skip_y * pitch];
+    auto cursor_img_data = (const std::uint32_t *) &cursor.img_data[cursor_skip_y * pitch];
 
     int delta_height = std::min(cursor_height - cursor_truncate_y, std::max(0, img.height - img_skip_y));
     int delta_width = std::min(cursor_width - cursor_truncate_x, std::max(0, img.width - img_skip_x));
+    if (delta_width <= 0) {
+      return;
+    }
 
-    auto img_data = (int *) img.data;
+    auto img_data = (std::uint32_t *) img.data;
 
+    // TODO: When use of IDXGIOutput5 is implemented, support different color formats
     for (int i = 0; i < delta_height; ++i) {
       auto cursor_begin = &cursor_img_data[i * cursor.shape_info.Width + cursor_skip_x];
-      auto cursor_end = &cursor_begin[delta_width];
 
       auto img_pixel_p = &img_data[(i + img_skip_y) * (img.row_pitch / img.pixel_pitch) + img_skip_x];
-      std::for_each(cursor_begin, cursor_end, [&](int cursor_pixel) {
-        if (masked) {
-          apply_color_masked(img_pixel_p, cursor_pixel);
-        }
-        else {
-          apply_color_alpha(img_pixel_p, cursor_pixel);
-        }
-        ++img_pixel_p;
-      });
+      if (masked) {
+        pixel::blend_masked(img_pixel_p, cursor_begin, delta_width);
+      }
+      else {
+        pixel::blend_alpha(img_pixel_p, cursor_begin, delta_width);
+      }
     }
   }
 
@@ -177,8 +130,40 @@ namespace platf::dxgi {
   }
 
 
+  /**
+   * @brief Region of the image a cursor is blended onto.
+   * @return std::nullopt if it doesn't overlap the image.
+   */
+  std::optional<platf::rect_t>
+  cursor_rect(const cursor_t &cursor, int width, int height) {
+    int cursor_height = cursor.shape_info.Height;
+    if (cursor.shape_info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME) {
+      cursor_height /= 2;
+    }
+
+    platf::rect_t rect {
+      std::max(0, cursor.x),
+      std::max(0, cursor.y),
+      std::min(width, cursor.x + (int) cursor.shape_info.Width),
+      std::min(height, cursor.y + cursor_height),
+    };
+
+    if (rect.left >= rect.right || rect.top >= rect.bottom) {
+      return std::nullopt;
+    }
+
+    return rect;
+  }
+
+  // Frames kept in the history, images of the pool that hold an older frame are copied in full
+  constexpr std::size_t MAX_HISTORY = 8;
+
+  // Beyond this many rectangles, a single copy of the whole frame is cheaper
+  constexpr std::size_t MAX_COPY_RECTS = 64;
+
   capture_e
   display_ddup_ram_t::snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor_visible) {
+    TRACE_SCOPE("capture.snapshot");
     HRESULT status;
     DXGI_OUTDUPL_FRAME_INFO frame_info;
 
@@ -224,6 +209,12 @@ namespace platf::dxgi {
       cursor.visible = frame_info.PointerPosition.Visible;
     }
 
+    // Regions of the desktop that changed since the last snapshot
+    std::optional<std::vector<platf::rect_t>> desktop_damage;
+    if (!frame_update_flag) {
+      desktop_damage.emplace();
+    }
+
     if (frame_update_flag) {
       {
         texture2d_t src {};
@@ -274,8 +265,24 @@ namespace platf::dxgi {
           return capture_e::reinit;
         }
 
-        // Copy from GPU to CPU
-        device_ctx->CopyResource(texture.get(), src.get());
+        // Copy from GPU to CPU, only what changed if the staging texture holds the previous frame
+        desktop_damage = dup.damage(frame_info);
+        if (staging_valid && desktop_damage && desktop_damage->size() <= MAX_COPY_RECTS) {
+          for (auto &rect : *desktop_damage) {
+            D3D11_BOX box {
+              (UINT) std::clamp(rect.left, 0, width), (UINT) std::clamp(rect.top, 0, height), 0,
+              (UINT) std::clamp(rect.right, 0, width), (UINT) std::clamp(rect.bottom, 0, height), 1
+            };
+
+            if (box.left < box.right && box.top < box.bottom) {
+              device_ctx->CopySubresourceRegion(texture.get(), 0, box.left, box.top, 0, src.get(), 0, &box);
+            }
+          }
+        }
+        else {
+          device_ctx->CopyResource(texture.get(), src.get());
+        }
+        staging_valid = true;
       }
     }
 
@@ -284,6 +291,61 @@ namespace platf::dxgi {
     }
     auto img = (img_t *) img_out.get();
 
+    const bool blended = cursor_visible && cursor.visible;
+
+    frame_damage_t frame_damage { capture_sequence + 1 };
+    if (capture_format != DXGI_FORMAT_UNKNOWN) {
+      frame_damage.desktop = std::move(desktop_damage);
+    }
+    if (blended) {
+      frame_damage.cursor = cursor_rect(cursor, width, height);
+    }
+
+    // Collect what changed since the frame the image holds: the desktop damage of the frames after it,
+    // the cursor blended onto it and the cursor that is blended now
+    std::optional<std::vector<platf::rect_t>> copy_rects;
+    auto it = std::find_if(std::begin(frame_history), std::end(frame_history), [&](const frame_damage_t &frame) {
+      return img->data && frame.capture_sequence == img->capture_sequence;
+    });
+    if (it != std::end(frame_history)) {
+      auto &rects = copy_rects.emplace();
+      if (it->cursor) {
+        rects.emplace_back(*it->cursor);
+      }
+
+      for (++it; it != std::end(frame_history) && copy_rects; ++it) {
+        if (!it->desktop) {
+          copy_rects.reset();
+          break;
+        }
+
+        rects.insert(std::end(rects), std::begin(*it->desktop), std::end(*it->desktop));
+      }
+
+      if (copy_rects && frame_damage.desktop) {
+        rects.insert(std::end(rects), std::begin(*frame_damage.desktop), std::end(*frame_damage.desktop));
+        if (frame_damage.cursor) {
+          rects.emplace_back(*frame_damage.cursor);
+        }
+      }
+      else {
+        copy_rects.reset();
+      }
+
+      if (copy_rects && copy_rects->size() > MAX_COPY_RECTS) {
+        copy_rects.reset();
+      }
+    }
+
+    // A blank image holds none of the frames before it
+    if (capture_format == DXGI_FORMAT_UNKNOWN) {
+      frame_history.clear();
+    }
+    frame_history.emplace_back(std::move(frame_damage));
+    if (frame_history.size() > MAX_HISTORY) {
+      frame_history.erase(std::begin(frame_history));
+    }
+
     // If we don't know the final capture format yet, encode a dummy image
     if (capture_format == DXGI_FORMAT_UNKNOWN) {
       BOOST_LOG(debug) << "Capture format is still unknown. Encoding a blank image"sv;
@@ -302,25 +364,55 @@ namespace platf::dxgi {
       }
 
       // Now that we know the capture format, we can finish creating the image
+      auto data = img->data;
       if (complete_img(img, false)) {
         device_ctx->Unmap(texture.get(), 0);
         img_info.pData = nullptr;
         return capture_e::error;
       }
 
-      std::copy_n((std::uint8_t *) img_info.pData, height * img_info.RowPitch, (std::uint8_t *) img->data);
+      auto src = (const std::uint8_t *) img_info.pData;
+      if (copy_rects && img->data == data) {
+        for (auto &rect : *copy_rects) {
+          auto left = std::clamp(rect.left, 0, width);
+          auto top = std::clamp(rect.top, 0, height);
+          auto right = std::clamp(rect.right, 0, width);
+          auto bottom = std::clamp(rect.bottom, 0, height);
+          if (left >= right || top >= bottom) {
+            continue;
+          }
+
+          auto offset = top * img_info.RowPitch + left * img->pixel_pitch;
+          pixel::copy_rows(img->data + offset, img->row_pitch, src + offset, img_info.RowPitch, (right - left) * img->pixel_pitch, bottom - top);
+        }
+      }
+      else {
+        pixel::copy_rows(img->data, img->row_pitch, src, img_info.RowPitch, width * img->pixel_pitch, height);
+      }
 
       // Unmap the staging texture to allow GPU access again
       device_ctx->Unmap(texture.get(), 0);
       img_info.pData = nullptr;
     }
 
-    if (cursor_visible && cursor.visible) {
+    if (blended) {
       blend_cursor(cursor, *img);
     }
 
     if (img) {
       img->frame_timestamp = frame_timestamp;
+      img->capture_sequence = ++capture_sequence;
+      img->damage = std::nullopt;
+
+      // DXGI reports damage relative to the previous desktop frame, which is only
+      // what the previous image holds if no cursor was blended onto it
+      if (damage_base_valid && !blended) {
+        img->damage = frame_history.back().desktop;
+      }
+
+      img->cursor_rect = blended ? cursor_rect(cursor, img->width, img->height) : std::nullopt;
+
+      damage_base_valid = !blended && capture_format != DXGI_FORMAT_UNKNOWN;
     }
 
     return capture_e::ok;
@@ -331,6 +423,19 @@ namespace platf::dxgi {
     return dup.release_frame();
   }
 
+  bool
+  display_ddup_ram_t::reinit_capture() {
+    if (dup.reinit(this)) {
+      return false;
+    }
+
+    // The desktop may have changed while the access was lost, the next frame is copied whole
+    staging_valid = false;
+    damage_base_valid = false;
+    frame_history.clear();
+    return true;
+  }
+
   std::shared_ptr<platf::img_t>
   display_ram_t::alloc_img() {
     auto img = std::make_shared<img_t>();
@@ -360,12 +465,16 @@ namespace platf::dxgi {
     // Reallocate the image buffer if the pitch changes
     if (!dummy && img->row_pitch != img_info.RowPitch) {
       img->row_pitch = img_info.RowPitch;
-      delete img->data;
+      memory::free(img->data);
       img->data = nullptr;
     }
 
     if (!img->data) {
-      img->data = new std::uint8_t[img->row_pitch * height];
+      img->data = (std::uint8_t *) memory::allocate(img->row_pitch * height);
+      if (!img->data) {
+        BOOST_LOG(error) << "Couldn't allocate "sv << img->row_pitch * height << " bytes for a frame"sv;
+        return -1;
+      }
     }
 
     return 0;
@@ -14,11 +14,15 @@ extern "C" {
 
 #include "display.h"
 #include "misc.h"
+#include "src/amf/amf_d3d11.h"
+#include "src/amf/amf_utils.h"
 #include "src/config.h"
+#include "src/cursor.h"
 #include "src/logging.h"
 #include "src/nvenc/nvenc_config.h"
 #include "src/nvenc/nvenc_d3d11.h"
 #include "src/nvenc/nvenc_utils.h"
+#include "src/trace.h"
 #include "src/video.h"
 
 #include <AMF/core/Factory.h>
@@ -387,7 +391,26 @@ namespace platf::dxgi {
       }
 
       auto &img = (img_d3d_t &) img_base;
-      if (!img.blank) {
+      if (img.blank) {
+        // Nothing is converted, so the output doesn't change
+        output_damage.emplace();
+        return 0;
+      }
+
+      // The output still holds this image
+      if (img.capture_sequence && img.capture_sequence == last_capture_sequence) {
+        output_damage.emplace();
+        return 0;
+      }
+
+      const bool partial = damage_to_scissor_rects(img);
+      if (partial && scissor_Y.empty()) {
+        // The image is identical to the one that was converted last
+        last_capture_sequence = img.capture_sequence;
+        return 0;
+      }
+
+      {
         auto &img_ctx = img_ctx_map[img.id];
 
         // Open the shared capture texture with our ID3D11Device
@@ -395,17 +418,28 @@ namespace platf::dxgi {
           return -1;
         }
 
-        // Acquire encoder mutex to synchronize with capture code
-        auto status = img_ctx.encoder_mutex->AcquireSync(0, INFINITE);
-        if (status != S_OK) {
-          BOOST_LOG(error) << "Failed to acquire encoder mutex [0x"sv << util::hex(status).to_string_view() << ']';
-          return -1;
+        if (copy_device) {
+          if (copy_across_adapters(img_ctx)) {
+            return -1;
+          }
+        }
+        else {
+          // Acquire encoder mutex to synchronize with capture code
+          auto status = img_ctx.encoder_mutex->AcquireSync(0, INFINITE);
+          if (status != S_OK) {
+            BOOST_LOG(error) << "Failed to acquire encoder mutex [0x"sv << util::hex(status).to_string_view() << ']';
+            return -1;
+          }
         }
 
         device_ctx->OMSetRenderTargets(1, &nv12_Y_rt, nullptr);
         device_ctx->VSSetShader(scene_vs.get(), nullptr, 0);
         device_ctx->PSSetShader(img.format == DXGI_FORMAT_R16G16B16A16_FLOAT ? convert_Y_fp16_ps.get() : convert_Y_ps.get(), nullptr, 0);
         device_ctx->RSSetViewports(1, &outY_view);
+        if (partial) {
+          device_ctx->RSSetState(scissor_raster.get());
+          device_ctx->RSSetScissorRects(scissor_Y.size(), scissor_Y.data());
+        }
         device_ctx->PSSetShaderResources(0, 1, &img_ctx.encoder_input_res);
         device_ctx->Draw(3, 0);
 
@@ -413,18 +447,100 @@ namespace platf::dxgi {
         device_ctx->VSSetShader(convert_UV_vs.get(), nullptr, 0);
         device_ctx->PSSetShader(img.format == DXGI_FORMAT_R16G16B16A16_FLOAT ? convert_UV_fp16_ps.get() : convert_UV_ps.get(), nullptr, 0);
         device_ctx->RSSetViewports(1, &outUV_view);
+        if (partial) {
+          device_ctx->RSSetScissorRects(scissor_UV.size(), scissor_UV.data());
+        }
         device_ctx->Draw(3, 0);
 
+        if (partial) {
+          device_ctx->RSSetState(nullptr);
+        }
+
         // Release encoder mutex to allow capture code to reuse this image
-        img_ctx.encoder_mutex->ReleaseSync(0);
+        if (img_ctx.encoder_mutex) {
+          img_ctx.encoder_mutex->ReleaseSync(0);
+        }
 
         ID3D11ShaderResourceView *emptyShaderResourceView = nullptr;
         device_ctx->PSSetShaderResources(0, 1, &emptyShaderResourceView);
       }
 
+      last_capture_sequence = img.capture_sequence;
+
       return 0;
     }
 
+    /**
+     * @brief Map the damage of the image to the output, so only the tiles that changed are converted.
+     * @details Fills `scissor_Y`, `scissor_UV` and `output_damage`.
+     * @return `true` if the tiles in `scissor_Y` are all that changed, `false` if the whole image must be converted.
+     */
+    bool
+    damage_to_scissor_rects(const img_d3d_t &img) {
+      scissor_Y.clear();
+      scissor_UV.clear();
+      output_damage = std::nullopt;
+
+      // The damage is relative to the previous image, which we must have converted
+      if (!img.damage || !last_capture_sequence || img.capture_sequence != last_capture_sequence + 1) {
+        return false;
+      }
+
+      // Rotated images would need their damage rotated as well
+      if (display->display_rotation != DXGI_MODE_ROTATION_UNSPECIFIED && display->display_rotation != DXGI_MODE_ROTATION_IDENTITY) {
+        return false;
+      }
+
+      // Linear sampling spreads a changed input pixel over its neighbours
+      constexpr int margin = 2;
+      constexpr int tile_size = 16;
+
+      const float scale_x = outY_view.Width / display->width;
+      const float scale_y = outY_view.Height / display->height;
+
+      const int view_left = outY_view.TopLeftX;
+      const int view_top = outY_view.TopLeftY;
+      const int view_right = std::ceil(outY_view.TopLeftX + outY_view.Width);
+      const int view_bottom = std::ceil(outY_view.TopLeftY + outY_view.Height);
+
+      for (auto &rect : *img.damage) {
+        int left = std::floor(outY_view.TopLeftX + rect.left * scale_x) - margin;
+        int top = std::floor(outY_view.TopLeftY + rect.top * scale_y) - margin;
+        int right = std::ceil(outY_view.TopLeftX + rect.right * scale_x) + margin;
+        int bottom = std::ceil(outY_view.TopLeftY + rect.bottom * scale_y) + margin;
+
+        left = std::max(left, view_left) / tile_size * tile_size;
+        top = std::max(top, view_top) / tile_size * tile_size;
+        right = std::min((std::min(right, view_right) + tile_size - 1) / tile_size * tile_size, output_width);
+        bottom = std::min((std::min(bottom, view_bottom) + tile_size - 1) / tile_size * tile_size, output_height);
+
+        if (left < right && top < bottom) {
+          scissor_Y.emplace_back(D3D11_RECT { left, top, right, bottom });
+        }
+      }
+
+      // Too many rectangles for a single draw, convert their bounding box instead
+      if (scissor_Y.size() > D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE) {
+        auto bounds = scissor_Y.front();
+        for (auto &rect : scissor_Y) {
+          bounds.left = std::min(bounds.left, rect.left);
+          bounds.top = std::min(bounds.top, rect.top);
+          bounds.right = std::max(bounds.right, rect.right);
+          bounds.bottom = std::max(bounds.bottom, rect.bottom);
+        }
+
+        scissor_Y.assign(1, bounds);
+      }
+
+      auto &damage = output_damage.emplace();
+      for (auto &rect : scissor_Y) {
+        scissor_UV.emplace_back(D3D11_RECT { rect.left / 2, rect.top / 2, rect.right / 2, rect.bottom / 2 });
+        damage.emplace_back(platf::rect_t { rect.left, rect.top, rect.right, rect.bottom });
+      }
+
+      return true;
+    }
+
     void
     apply_colorspace(const ::video::sunshine_colorspace_t &colorspace) {
       auto color_vectors = ::video::color_vectors_from_colorspace(colorspace);
@@ -442,6 +558,9 @@ namespace platf::dxgi {
 
       device_ctx->PSSetConstantBuffers(0, 1, &color_matrix);
       this->color_matrix = std::move(color_matrix);
+
+      // The whole output must be converted with the new colors
+      last_capture_sequence = 0;
     }
 
     int
@@ -453,6 +572,10 @@ namespace platf::dxgi {
       auto out_width = width;
       auto out_height = height;
 
+      output_width = width;
+      output_height = height;
+      last_capture_sequence = 0;
+
       float in_width = display->width;
       float in_height = display->height;
 
@@ -631,6 +754,33 @@ namespace platf::dxgi {
       }
       display = nullptr;
 
+      // The shared textures of the capture can't be opened on another adapter, a device of the encoder on the
+      // capture adapter copies them instead. It has a context of its own, so it never waits for the capture thread.
+      DXGI_ADAPTER_DESC capture_adapter_desc;
+      DXGI_ADAPTER_DESC encode_adapter_desc;
+      this->display->adapter->GetDesc(&capture_adapter_desc);
+      adapter_p->GetDesc(&encode_adapter_desc);
+      if (capture_adapter_desc.AdapterLuid.LowPart != encode_adapter_desc.AdapterLuid.LowPart ||
+          capture_adapter_desc.AdapterLuid.HighPart != encode_adapter_desc.AdapterLuid.HighPart) {
+        status = D3D11CreateDevice(
+          this->display->adapter.get(),
+          D3D_DRIVER_TYPE_UNKNOWN,
+          nullptr,
+          D3D11_CREATE_DEVICE_FLAGS,
+          featureLevels, sizeof(featureLevels) / sizeof(D3D_FEATURE_LEVEL),
+          D3D11_SDK_VERSION,
+          &copy_device,
+          nullptr,
+          &copy_device_ctx);
+        if (FAILED(status)) {
+          BOOST_LOG(error) << "Failed to create the D3D11 copy device on the capture adapter [0x"sv << util::hex(status).to_string_view() << ']';
+          return -1;
+        }
+
+        BOOST_LOG(info) << "Encoding on "sv << to_utf8(encode_adapter_desc.Description) << ", the frames captured on "sv
+                        << to_utf8(capture_adapter_desc.Description) << " are copied through system memory"sv;
+      }
+
       blend_disable = make_blend(device.get(), false, false);
       if (!blend_disable) {
         return -1;
@@ -651,6 +801,19 @@ namespace platf::dxgi {
         return -1;
       }
 
+      // Same as the default rasterizer state, with scissor rectangles for partial conversions
+      D3D11_RASTERIZER_DESC raster_desc {};
+      raster_desc.FillMode = D3D11_FILL_SOLID;
+      raster_desc.CullMode = D3D11_CULL_BACK;
+      raster_desc.DepthClipEnable = TRUE;
+      raster_desc.ScissorEnable = TRUE;
+
+      status = device->CreateRasterizerState(&raster_desc, &scissor_raster);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to create scissor rasterizer state [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
       device_ctx->OMSetBlendState(blend_disable.get(), nullptr, 0xFFFFFFFFu);
       device_ctx->PSSetSamplers(0, 1, &sampler_linear);
       device_ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
@@ -667,6 +830,11 @@ namespace platf::dxgi {
       shader_res_t encoder_input_res;
       keyed_mutex_t encoder_mutex;
 
+      // Across adapters: the shared texture opened on the copy device and its copy in system memory
+      texture2d_t copy_texture;
+      keyed_mutex_t copy_mutex;
+      texture2d_t staging_texture;
+
       std::weak_ptr<const platf::img_t> img_weak;
 
       void
@@ -675,6 +843,9 @@ namespace platf::dxgi {
         encoder_texture.reset();
         encoder_input_res.reset();
         encoder_mutex.reset();
+        copy_texture.reset();
+        copy_mutex.reset();
+        staging_texture.reset();
         img_weak.reset();
       }
     };
@@ -690,6 +861,10 @@ namespace platf::dxgi {
       // Textures can change when transitioning from a dummy image to a real image.
       img_ctx.reset();
 
+      if (copy_device) {
+        return initialize_copy_context(img, img_ctx);
+      }
+
       device1_t device1;
       auto status = device->QueryInterface(__uuidof(ID3D11Device1), (void **) &device1);
       if (FAILED(status)) {
@@ -725,6 +900,94 @@ namespace platf::dxgi {
       return 0;
     }
 
+    /**
+     * @brief Open the shared texture of an image on the copy device, with a texture of the encoder to copy it into.
+     */
+    int
+    initialize_copy_context(const img_d3d_t &img, encoder_img_ctx_t &img_ctx) {
+      device1_t device1;
+      auto status = copy_device->QueryInterface(__uuidof(ID3D11Device1), (void **) &device1);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to query ID3D11Device1 [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      status = device1->OpenSharedResource1(img.encoder_texture_handle, __uuidof(ID3D11Texture2D), (void **) &img_ctx.copy_texture);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to open shared image texture on the capture adapter [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      status = img_ctx.copy_texture->QueryInterface(__uuidof(IDXGIKeyedMutex), (void **) &img_ctx.copy_mutex);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to query IDXGIKeyedMutex [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      D3D11_TEXTURE2D_DESC desc;
+      img_ctx.copy_texture->GetDesc(&desc);
+      desc.MiscFlags = 0;
+
+      desc.Usage = D3D11_USAGE_STAGING;
+      desc.BindFlags = 0;
+      desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+      status = copy_device->CreateTexture2D(&desc, nullptr, &img_ctx.staging_texture);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to create staging texture [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      desc.Usage = D3D11_USAGE_DEFAULT;
+      desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+      desc.CPUAccessFlags = 0;
+      status = device->CreateTexture2D(&desc, nullptr, &img_ctx.encoder_texture);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to create encoder input texture [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      status = device->CreateShaderResourceView(img_ctx.encoder_texture.get(), nullptr, &img_ctx.encoder_input_res);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to create shader resource view for encoding [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      img_ctx.capture_texture_p = img.capture_texture.get();
+
+      img_ctx.img_weak = img.weak_from_this();
+
+      return 0;
+    }
+
+    /**
+     * @brief Copy an image from the capture adapter into the input texture of the encoder.
+     * @details The keyed mutex is released as soon as the copy is queued, the capture only waits for the
+     *          copy on its adapter. Mapping the staging texture waits for it here, while the encode adapter
+     *          still works on the previous frame.
+     */
+    int
+    copy_across_adapters(encoder_img_ctx_t &img_ctx) {
+      auto status = img_ctx.copy_mutex->AcquireSync(0, INFINITE);
+      if (status != S_OK) {
+        BOOST_LOG(error) << "Failed to acquire capture texture mutex [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+      copy_device_ctx->CopyResource(img_ctx.staging_texture.get(), img_ctx.copy_texture.get());
+      img_ctx.copy_mutex->ReleaseSync(0);
+
+      D3D11_MAPPED_SUBRESOURCE mapped;
+      status = copy_device_ctx->Map(img_ctx.staging_texture.get(), 0, D3D11_MAP_READ, 0, &mapped);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to map staging texture [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      device_ctx->UpdateSubresource(img_ctx.encoder_texture.get(), 0, nullptr, mapped.pData, mapped.RowPitch, 0);
+      copy_device_ctx->Unmap(img_ctx.staging_texture.get(), 0);
+
+      return 0;
+    }
+
     ::video::color_t *color_p;
 
     buf_t subsample_offset;
@@ -732,6 +995,10 @@ namespace platf::dxgi {
 
     blend_t blend_disable;
     sampler_state_t sampler_linear;
+    raster_state_t scissor_raster;
+
+    // Regions of the output that changed in the last conversion, std::nullopt if unknown
+    std::optional<std::vector<platf::rect_t>> output_damage;
 
     render_target_t nv12_Y_rt;
     render_target_t nv12_UV_rt;
@@ -754,11 +1021,23 @@ namespace platf::dxgi {
     D3D11_VIEWPORT outY_view;
     D3D11_VIEWPORT outUV_view;
 
+    int output_width = 0;
+    int output_height = 0;
+
+    // Sequence of the image the output holds, 0 if the output must be converted in full
+    std::uint64_t last_capture_sequence = 0;
+    std::vector<D3D11_RECT> scissor_Y;
+    std::vector<D3D11_RECT> scissor_UV;
+
     DXGI_FORMAT format;
 
     device_t device;
     device_ctx_t device_ctx;
 
+    // Set when the encoder runs on another adapter than the capture, see copy_across_adapters()
+    device_t copy_device;
+    device_ctx_t copy_device_ctx;
+
     texture2d_t output_texture;
   };
 
@@ -773,7 +1052,29 @@ namespace platf::dxgi {
 
     int
     convert(platf::img_t &img_base) override {
-      return base.convert(img_base);
+      if (base.convert(img_base)) {
+        return -1;
+      }
+
+      // Nothing changed, the frame sent last still holds the output
+      if (base.output_damage && base.output_damage->empty() && ring[current].filled) {
+        return 0;
+      }
+
+      // Move on to the frame the encoder read the longest time ago, so the copy doesn't wait for the encoder
+      auto &prev = ring[current];
+      current = (current + 1) % ring.size();
+      auto &next = ring[current];
+
+      base.device_ctx->CopySubresourceRegion(next.texture.get(), D3D11CalcSubresource(0, next.array_index, 1), 0, 0, 0, base.output_texture.get(), 0, nullptr);
+      next.filled = true;
+
+      // IDR requests were made on the previous frame
+      next.frame->pict_type = prev.frame->pict_type;
+      next.frame->flags = (next.frame->flags & ~AV_FRAME_FLAG_KEY) | (prev.frame->flags & AV_FRAME_FLAG_KEY);
+
+      frame = next.frame.get();
+      return 0;
     }
 
     void
@@ -792,8 +1093,8 @@ namespace platf::dxgi {
         d3d11_frames->MiscFlags = 0;
       }
 
-      // We require a single texture
-      frames->initial_pool_size = 1;
+      // One texture per frame of the ring
+      frames->initial_pool_size = ring_size;
     }
 
     int
@@ -816,9 +1117,68 @@ namespace platf::dxgi {
 
     int
     set_frame(AVFrame *frame, AVBufferRef *hw_frames_ctx) override {
-      this->hwframe.reset(frame);
+      ring.clear();
+      ring.resize(ring_size);
+
+      // The first frame carries the properties and side data of the session, the others are copies of it
+      ring[0].frame.reset(frame);
+      for (int x = 1; x < ring_size; ++x) {
+        ring[x].frame.reset(av_frame_alloc());
+        ring[x].frame->format = frame->format;
+        ring[x].frame->width = frame->width;
+        ring[x].frame->height = frame->height;
+
+        if (av_frame_copy_props(ring[x].frame.get(), frame) < 0) {
+          BOOST_LOG(error) << "Failed to copy the properties of the frame"sv;
+          return -1;
+        }
+      }
+
+      for (auto &slot : ring) {
+        if (map_slot(slot, hw_frames_ctx)) {
+          return -1;
+        }
+      }
+
+      current = 0;
       this->frame = frame;
 
+      // The conversion renders into a texture of its own, which is copied into the frame of the ring that is sent next
+      D3D11_TEXTURE2D_DESC desc;
+      ring[0].texture->GetDesc(&desc);
+      desc.ArraySize = 1;
+      desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+      desc.MiscFlags = 0;
+
+      texture2d_t output_texture;
+      auto status = base.device->CreateTexture2D(&desc, nullptr, &output_texture);
+      if (FAILED(status)) {
+        BOOST_LOG(error) << "Failed to create the conversion texture [0x"sv << util::hex(status).to_string_view() << ']';
+        return -1;
+      }
+
+      return base.init_output(output_texture.get(), frame->width, frame->height);
+    }
+
+  private:
+    // Frames the encoder may still be reading while the next one is converted
+    static constexpr int ring_size = 3;
+
+    struct slot_t {
+      frame_t frame;
+      texture2d_t texture;
+
+      // D3D11 frame pools are texture arrays
+      UINT array_index = 0;
+
+      // Whether the texture holds a converted image
+      bool filled = false;
+    };
+
+    int
+    map_slot(slot_t &slot, AVBufferRef *hw_frames_ctx) {
+      auto frame = slot.frame.get();
+
       // Populate this frame with a hardware buffer if one isn't there already
       if (!frame->buf[0]) {
         auto err = av_hwframe_get_buffer(hw_frames_ctx, frame, 0);
@@ -845,18 +1205,28 @@ namespace platf::dxgi {
 
         // Get the texture from the mapped frame
         frame_texture = (ID3D11Texture2D *) d3d11_frame->data[0];
+        slot.array_index = (UINT) (intptr_t) d3d11_frame->data[1];
       }
       else {
         // Otherwise, we can just use the texture inside the original frame
         frame_texture = (ID3D11Texture2D *) frame->data[0];
+        slot.array_index = (UINT) (intptr_t) frame->data[1];
       }
 
-      return base.init_output(frame_texture, frame->width, frame->height);
+      // The underlying frame pool owns the texture, so we must reference it for ourselves
+      frame_texture->AddRef();
+      slot.texture.reset(frame_texture);
+      slot.filled = false;
+
+      return 0;
     }
 
-  private:
     d3d_base_encode_device base;
-    frame_t hwframe;
+
+    std::vector<slot_t> ring;
+
+    // Index of the frame in the ring that was sent last
+    std::size_t current = 0;
   };
 
   class d3d_nvenc_encode_device_t: public nvenc_encode_device_t {
@@ -890,7 +1260,12 @@ namespace platf::dxgi {
 
     int
     convert(platf::img_t &img_base) override {
-      return base.convert(img_base);
+      if (base.convert(img_base)) {
+        return -1;
+      }
+
+      nvenc_d3d->add_damage(base.output_damage);
+      return 0;
     }
 
   private:
@@ -899,6 +1274,80 @@ namespace platf::dxgi {
     NV_ENC_BUFFER_FORMAT buffer_format = NV_ENC_BUFFER_FORMAT_UNDEFINED;
   };
 
+  class d3d_amf_encode_device_t: public amf_encode_device_t {
+  public:
+    bool
+    init_device(std::shared_ptr<platf::display_t> display, adapter_t::pointer adapter_p, pix_fmt_e pix_fmt) {
+      surface_format = amfenc::amf_format_from_sunshine_format(pix_fmt);
+      if (surface_format == amf::AMF_SURFACE_UNKNOWN) {
+        BOOST_LOG(error) << "Unexpected pixel format for AMF ["sv << from_pix_fmt(pix_fmt) << ']';
+        return false;
+      }
+
+      if (base.init(display, adapter_p, pix_fmt)) return false;
+
+      amf_d3d = std::make_unique<amfenc::amf_d3d11>(base.device.get());
+      amf = amf_d3d.get();
+
+      return true;
+    }
+
+    bool
+    init_encoder(const ::video::config_t &client_config, const ::video::sunshine_colorspace_t &colorspace) override {
+      if (!amf_d3d) return false;
+
+      if (!amf_d3d->create_encoder(client_config, colorspace, surface_format)) return false;
+
+      base.apply_colorspace(colorspace);
+      return base.init_output(amf_d3d->get_input_texture(), client_config.width, client_config.height) == 0;
+    }
+
+    int
+    convert(platf::img_t &img_base) override {
+      if (base.convert(img_base)) {
+        return -1;
+      }
+
+      amf_d3d->add_damage(base.output_damage);
+      return 0;
+    }
+
+  private:
+    d3d_base_encode_device base;
+    std::unique_ptr<amfenc::amf_d3d11> amf_d3d;
+    amf::AMF_SURFACE_FORMAT surface_format = amf::AMF_SURFACE_UNKNOWN;
+  };
+
+  /**
+   * @brief Publish the shape for clients that draw the cursor themselves.
+   * @details They can't invert the screen under the cursor, pixels that invert it are sent as opaque black.
+   */
+  void
+  publish_cursor_shape(const util::buffer_t<std::uint8_t> &alpha_img, const util::buffer_t<std::uint8_t> &xor_img, const DXGI_OUTDUPL_POINTER_SHAPE_INFO &shape_info) {
+    auto width = (int) shape_info.Width;
+    auto height = width ? (int) (alpha_img.size() / (4 * width)) : 0;
+
+    auto alpha_pixels = (const std::uint32_t *) std::begin(alpha_img);
+    auto xor_pixels = xor_img.size() == alpha_img.size() ? (const std::uint32_t *) std::begin(xor_img) : nullptr;
+
+    std::vector<std::uint32_t> pixels((std::size_t) width * height);
+    for (std::size_t x = 0; x < pixels.size(); ++x) {
+      if (xor_pixels && xor_pixels[x]) {
+        pixels[x] = 0xFF000000;
+        continue;
+      }
+
+      auto pixel = alpha_pixels[x];
+      std::uint32_t alpha = pixel >> 24;
+      auto premultiply = [&](int shift) {
+        return ((((pixel >> shift) & 0xFF) * alpha + 127) / 255) << shift;
+      };
+      pixels[x] = (alpha << 24) | premultiply(16) | premultiply(8) | premultiply(0);
+    }
+
+    cursor::update_shape(width, height, shape_info.HotSpot.x, shape_info.HotSpot.y, (const std::uint8_t *) pixels.data(), width * 4);
+  }
+
   bool
   set_cursor_texture(device_t::pointer device, gpu_cursor_t &cursor, util::buffer_t<std::uint8_t> &&cursor_img, DXGI_OUTDUPL_POINTER_SHAPE_INFO &shape_info) {
     // This cursor image may not be used
@@ -946,6 +1395,7 @@ namespace platf::dxgi {
 
   capture_e
   display_ddup_vram_t::snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor_visible) {
+    TRACE_SCOPE("capture.snapshot");
     HRESULT status;
     DXGI_OUTDUPL_FRAME_INFO frame_info;
 
@@ -987,6 +1437,9 @@ namespace platf::dxgi {
       auto alpha_cursor_img = make_cursor_alpha_image(img_data, shape_info);
       auto xor_cursor_img = make_cursor_xor_image(img_data, shape_info);
 
+      // Duplication only reports the shape when it changes, it's kept for clients that ask for the cursor later
+      publish_cursor_shape(alpha_cursor_img, xor_cursor_img, shape_info);
+
       if (!set_cursor_texture(device.get(), cursor_alpha, std::move(alpha_cursor_img), shape_info) ||
           !set_cursor_texture(device.get(), cursor_xor, std::move(xor_cursor_img), shape_info)) {
         return capture_e::error;
@@ -999,6 +1452,9 @@ namespace platf::dxgi {
 
       cursor_xor.set_pos(frame_info.PointerPosition.Position.x, frame_info.PointerPosition.Position.y,
         width, height, display_rotation, frame_info.PointerPosition.Visible);
+
+      // The shape stays unrotated, only its position is in the rotated image
+      cursor::update_position(cursor_alpha.cursor_view.TopLeftX, cursor_alpha.cursor_view.TopLeftY, frame_info.PointerPosition.Visible);
     }
 
     const bool blend_mouse_cursor_flag = (cursor_alpha.visible || cursor_xor.visible) && cursor_visible;
@@ -1323,7 +1779,31 @@ namespace platf::dxgi {
 
     if (img_out) {
       img_out->frame_timestamp = frame_timestamp;
-    }
+
+      // An image that is forwarded again keeps its sequence, so the encoder can tell nothing changed
+      if (out_frame_action != ofa::forward_last_img || last_frame_action != lfa::nothing) {
+        img_out->capture_sequence = ++capture_sequence;
+        img_out->damage = std::nullopt;
+
+        // DXGI reports damage relative to the previous desktop frame, which is only
+        // what the previous image holds if no cursor was blended onto it
+        if (last_frame_action == lfa::copy_src_to_img && damage_base_valid) {
+          img_out->damage = dup.damage(frame_info);
+        }
+      }
+
+      damage_base_valid = out_frame_action == ofa::forward_last_img;
+
+      img_out->cursor_rect = std::nullopt;
+      if (blend_mouse_cursor_flag) {
+        auto &view = cursor_alpha.texture ? cursor_alpha.cursor_view : cursor_xor.cursor_view;
+        img_out->cursor_rect = platf::rect_t {
+          (std::int32_t) view.TopLeftX,
+          (std::int32_t) view.TopLeftY,
+          (std::int32_t) (view.TopLeftX + view.Width),
+          (std::int32_t) (view.TopLeftY + view.Height),
+        };
+      }
 
     return capture_e::ok;
   }
@@ -1333,6 +1813,17 @@ namespace platf::dxgi {
     return dup.release_frame();
   }
 
+  bool
+  display_ddup_vram_t::reinit_capture() {
+    if (dup.reinit(this)) {
+      return false;
+    }
+
+    // The desktop may have changed while the access was lost, the next frame is copied whole
+    damage_base_valid = false;
+    return true;
+  }
+
   int
   display_ddup_vram_t::init(const ::video::config_t &config, const std::string &display_name) {
     if (display_base_t::init(config, display_name) || dup.init(this, config)) {
@@ -1423,6 +1914,7 @@ namespace platf::dxgi {
    */
   capture_e
   display_wgc_vram_t::snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor_visible) {
+    TRACE_SCOPE("capture.snapshot");
     texture2d_t src;
     uint64_t frame_qpc;
     dup.set_cursor_visible(cursor_visible);
@@ -1470,6 +1962,10 @@ namespace platf::dxgi {
     img_out = img;
     if (img_out) {
       img_out->frame_timestamp = frame_timestamp;
+
+      // Every image holds a new frame, its damage is relative to the frame captured before it
+      img_out->capture_sequence = ++capture_sequence;
+      img_out->damage = dup.damage();
     }
 
     return capture_e::ok;
@@ -1622,7 +2118,7 @@ namespace platf::dxgi {
   bool
   display_vram_t::is_codec_supported(std::string_view name, const ::video::config_t &config) {
     DXGI_ADAPTER_DESC adapter_desc;
-    adapter->GetDesc(&adapter_desc);
+    encode_adapter()->GetDesc(&adapter_desc);
 
     if (adapter_desc.VendorId == 0x1002) {  // AMD
       // If it's not an AMF encoder, it's not compatible with an AMD GPU
@@ -1708,7 +2204,7 @@ namespace platf::dxgi {
 
     auto device = std::make_unique<d3d_avcodec_encode_device_t>();
 
-    auto ret = device->init(shared_from_this(), adapter.get(), pix_fmt);
+    auto ret = device->init(shared_from_this(), encode_adapter().get(), pix_fmt);
 
     if (ret) {
       return nullptr;
@@ -1720,7 +2216,16 @@ namespace platf::dxgi {
   std::unique_ptr<nvenc_encode_device_t>
   display_vram_t::make_nvenc_encode_device(pix_fmt_e pix_fmt) {
     auto device = std::make_unique<d3d_nvenc_encode_device_t>();
-    if (!device->init_device(shared_from_this(), adapter.get(), pix_fmt)) {
+    if (!device->init_device(shared_from_this(), encode_adapter().get(), pix_fmt)) {
+      return nullptr;
+    }
+    return device;
+  }
+
+  std::unique_ptr<amf_encode_device_t>
+  display_vram_t::make_amf_encode_device(pix_fmt_e pix_fmt) {
+    auto device = std::make_unique<d3d_amf_encode_device_t>();
+    if (!device->init_device(shared_from_this(), encode_adapter().get(), pix_fmt)) {
       return nullptr;
     }
     return device;
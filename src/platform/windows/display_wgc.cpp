@@ -2,20 +2,26 @@
  * @file src/platform/windows/display_wgc.cpp
  * @brief Definitions for WinRT Windows.Graphics.Capture API
  */
+#include <algorithm>
+
 #include <dxgi1_2.h>
 
 #include "display.h"
 
 #include "misc.h"
+#include "src/config.h"
 #include "src/logging.h"
+#include "src/trace.h"
 
 // Gross hack to work around MINGW-packages#22160
 #define ____FIReference_1_boolean_INTERFACE_DEFINED__
 
 #include <windows.graphics.capture.interop.h>
+#include <winrt/windows.foundation.collections.h>
 #include <winrt/windows.foundation.h>
 #include <winrt/windows.foundation.metadata.h>
 #include <winrt/windows.graphics.directx.direct3d11.h>
+#include <winrt/windows.graphics.h>
 
 namespace platf {
   using namespace std::literals;
@@ -57,6 +63,9 @@ __mingw_uuidof<winrt::IDirect3DDxgiInterfaceAccess>() -> GUID const & {
 #endif
 
 namespace platf::dxgi {
+  // Rectangles kept for the frames that are dropped before the capture thread takes them, the damage is unknown beyond
+  constexpr std::size_t MAX_DAMAGE_RECTS = 64;
+
   wgc_capture_t::wgc_capture_t() {
     InitializeConditionVariable(&frame_present_cv);
   }
@@ -116,7 +125,9 @@ namespace platf::dxgi {
       display->capture_format = DXGI_FORMAT_B8G8R8A8_UNORM;
 
     try {
-      frame_pool = winrt::Direct3D11CaptureFramePool::CreateFreeThreaded(uwp_device, static_cast<winrt::Windows::Graphics::DirectX::DirectXPixelFormat>(display->capture_format), 2, item.Size());
+      // The pool hands out frames on a thread of its own, while the capture thread and the encoder hold on to the others
+      auto frame_buffers = std::max(config::video.wgc.frame_buffers, 2);
+      frame_pool = winrt::Direct3D11CaptureFramePool::CreateFreeThreaded(uwp_device, static_cast<winrt::Windows::Graphics::DirectX::DirectXPixelFormat>(display->capture_format), frame_buffers, item.Size());
       capture_session = frame_pool.CreateCaptureSession(item);
       frame_pool.FrameArrived({ this, &wgc_capture_t::on_frame_arrived });
     }
@@ -135,6 +146,26 @@ namespace platf::dxgi {
     catch (winrt::hresult_error &e) {
       BOOST_LOG(warning) << "Screen capture may not be fully supported on this device for this release of Windows: failed to disable border around capture area: [0x"sv << util::hex(e.code()).to_string_view() << ']';
     }
+#ifdef SUNSHINE_BUILD_WGC_UPDATE_OPTIONS
+    try {
+      // Windows limits the updates to 60 per second unless told otherwise, leave some slack for the jitter of the compositor
+      if (winrt::ApiInformation::IsPropertyPresent(L"Windows.Graphics.Capture.GraphicsCaptureSession", L"MinUpdateInterval")) {
+        auto interval = std::chrono::duration_cast<winrt::TimeSpan>(std::chrono::nanoseconds { 1s } * 9 / (config.framerate * 10));
+        capture_session.MinUpdateInterval(interval);
+      }
+      else {
+        BOOST_LOG(info) << "Can't raise the update rate of the capture above 60 Hz on this version of Windows"sv;
+      }
+
+      if (winrt::ApiInformation::IsPropertyPresent(L"Windows.Graphics.Capture.GraphicsCaptureSession", L"DirtyRegionMode")) {
+        capture_session.DirtyRegionMode(winrt::GraphicsCaptureDirtyRegionMode::ReportOnly);
+        report_dirty_regions = true;
+      }
+    }
+    catch (winrt::hresult_error &e) {
+      BOOST_LOG(warning) << "Failed to set the update options of the capture session: [0x"sv << util::hex(e.code()).to_string_view() << ']';
+    }
+#endif
     try {
       capture_session.StartCapture();
     }
@@ -161,11 +192,40 @@ namespace platf::dxgi {
       return;
     }
     if (frame != nullptr) {
+      std::optional<std::vector<platf::rect_t>> damage;
+#ifdef SUNSHINE_BUILD_WGC_UPDATE_OPTIONS
+      if (report_dirty_regions) {
+        try {
+          auto &rects = damage.emplace();
+          for (auto &region : frame.DirtyRegions()) {
+            rects.emplace_back(platf::rect_t { region.X, region.Y, region.X + region.Width, region.Y + region.Height });
+          }
+        }
+        catch (winrt::hresult_error &) {
+          damage.reset();
+        }
+      }
+#endif
+
       AcquireSRWLockExclusive(&frame_lock);
-      if (produced_frame)
+      if (produced_frame) {
         produced_frame.Close();
 
+        // The frame that is dropped changed regions as well
+        if (damage && produced_damage) {
+          damage->insert(std::end(*damage), std::begin(*produced_damage), std::end(*produced_damage));
+        }
+        else {
+          damage.reset();
+        }
+      }
+
+      if (damage && damage->size() > MAX_DAMAGE_RECTS) {
+        damage.reset();
+      }
+
       produced_frame = frame;
+      produced_damage = std::move(damage);
       ReleaseSRWLockExclusive(&frame_lock);
       WakeConditionVariable(&frame_present_cv);
     }
@@ -193,7 +253,9 @@ namespace platf::dxgi {
     }
     if (produced_frame) {
       consumed_frame = produced_frame;
+      consumed_damage = std::move(produced_damage);
       produced_frame = nullptr;
+      produced_damage.reset();
     }
     ReleaseSRWLockExclusive(&frame_lock);
     if (consumed_frame == nullptr)  // spurious wakeup
@@ -216,6 +278,11 @@ namespace platf::dxgi {
     return capture_e::ok;
   }
 
+  const std::optional<std::vector<platf::rect_t>> &
+  wgc_capture_t::damage() const {
+    return consumed_damage;
+  }
+
   int
   wgc_capture_t::set_cursor_visible(bool x) {
     try {
@@ -246,6 +313,7 @@ namespace platf::dxgi {
    */
   capture_e
   display_wgc_ram_t::snapshot(const pull_free_image_cb_t &pull_free_image_cb, std::shared_ptr<platf::img_t> &img_out, std::chrono::milliseconds timeout, bool cursor_visible) {
+    TRACE_SCOPE("capture.snapshot");
     HRESULT status;
     texture2d_t src;
     uint64_t frame_qpc;
@@ -0,0 +1,197 @@
+/**
+ * @file src/platform/windows/input.cpp
+ * @brief Injects input with SendInput().
+ */
+#include <cmath>
+#include <limits>
+#include <string>
+
+#include <windows.h>
+
+#include <Input.h>
+
+#include "keylayout.h"
+#include "misc.h"
+#include "src/logging.h"
+#include "src/platform/common.h"
+
+using namespace std::literals;
+
+namespace platf {
+  namespace {
+    // SendInput() needs no devices, the handle only tells a working input apart from a failed one
+    struct input_raw_t {};
+
+    void
+    send_input(INPUT &input) {
+    retry:
+      if (SendInput(1, &input, sizeof(INPUT)) != 1) {
+        // The input desktop changes with the secure desktop of UAC prompts and the lock screen
+        auto desktop = syncThreadDesktop();
+        if (desktop) {
+          CloseDesktop(desktop);
+          goto retry;
+        }
+
+        BOOST_LOG(error) << "Couldn't send input: "sv << GetLastError();
+      }
+    }
+
+    void
+    send_key(std::uint16_t vk, std::uint16_t scancode, DWORD flags) {
+      INPUT input {};
+      input.type = INPUT_KEYBOARD;
+      input.ki.wVk = vk;
+      input.ki.wScan = scancode;
+      input.ki.dwFlags = flags;
+      send_input(input);
+    }
+
+    // Keys that are sent with the E0 prefix of the extended scancodes
+    bool
+    is_extended(std::uint16_t vk) {
+      switch (vk) {
+        case VK_LEFT:
+        case VK_RIGHT:
+        case VK_UP:
+        case VK_DOWN:
+        case VK_INSERT:
+        case VK_DELETE:
+        case VK_HOME:
+        case VK_END:
+        case VK_PRIOR:
+        case VK_NEXT:
+        case VK_RCONTROL:
+        case VK_RMENU:
+        case VK_LWIN:
+        case VK_RWIN:
+        case VK_APPS:
+        case VK_DIVIDE:
+        case VK_NUMLOCK:
+        case VK_SNAPSHOT:
+          return true;
+        default:
+          return false;
+      }
+    }
+  }  // namespace
+
+  void
+  freeInput(void *p) {
+    delete (input_raw_t *) p;
+  }
+
+  input_t
+  input() {
+    return input_t { new input_raw_t {} };
+  }
+
+  void
+  move_mouse(input_t &input, int deltaX, int deltaY) {
+    INPUT i {};
+    i.type = INPUT_MOUSE;
+    i.mi.dwFlags = MOUSEEVENTF_MOVE;
+    i.mi.dx = deltaX;
+    i.mi.dy = deltaY;
+    send_input(i);
+  }
+
+  void
+  abs_mouse(input_t &input, const touch_port_t &touch_port, float x, float y) {
+    if (touch_port.width <= 0 || touch_port.height <= 0) {
+      return;
+    }
+
+    // Absolute positions of SendInput() span the virtual desktop as 0 to 65535
+    INPUT i {};
+    i.type = INPUT_MOUSE;
+    i.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_VIRTUALDESK;
+    i.mi.dx = std::lround((touch_port.offset_x + x) * 65535 / touch_port.width);
+    i.mi.dy = std::lround((touch_port.offset_y + y) * 65535 / touch_port.height);
+    send_input(i);
+  }
+
+  void
+  button_mouse(input_t &input, int button, bool release) {
+    INPUT i {};
+    i.type = INPUT_MOUSE;
+    switch (button) {
+      case 1:
+        i.mi.dwFlags = release ? MOUSEEVENTF_LEFTUP : MOUSEEVENTF_LEFTDOWN;
+        break;
+      case 2:
+        i.mi.dwFlags = release ? MOUSEEVENTF_MIDDLEUP : MOUSEEVENTF_MIDDLEDOWN;
+        break;
+      case 3:
+        i.mi.dwFlags = release ? MOUSEEVENTF_RIGHTUP : MOUSEEVENTF_RIGHTDOWN;
+        break;
+      case 4:
+      case 5:
+        i.mi.dwFlags = release ? MOUSEEVENTF_XUP : MOUSEEVENTF_XDOWN;
+        i.mi.mouseData = button == 4 ? XBUTTON1 : XBUTTON2;
+        break;
+      default:
+        BOOST_LOG(warning) << "Unknown mouse button "sv << button;
+        return;
+    }
+    send_input(i);
+  }
+
+  void
+  scroll(input_t &input, int distance) {
+    INPUT i {};
+    i.type = INPUT_MOUSE;
+    i.mi.dwFlags = MOUSEEVENTF_WHEEL;
+    i.mi.mouseData = distance;
+    send_input(i);
+  }
+
+  void
+  hscroll(input_t &input, int distance) {
+    INPUT i {};
+    i.type = INPUT_MOUSE;
+    i.mi.dwFlags = MOUSEEVENTF_HWHEEL;
+    i.mi.mouseData = distance;
+    send_input(i);
+  }
+
+  void
+  keyboard_update(input_t &input, std::uint16_t modcode, bool release, std::uint8_t flags) {
+    DWORD key_flags = release ? KEYEVENTF_KEYUP : 0;
+
+    // Scancodes keep working in games that read raw input, unless the client asks for the virtual key as it is
+    auto scancode = VK_TO_SCANCODE_MAP[modcode & 0xFF];
+    if (!(flags & SS_KBE_FLAG_NON_NORMALIZED) && scancode) {
+      key_flags |= KEYEVENTF_SCANCODE;
+      if (is_extended(modcode)) {
+        key_flags |= KEYEVENTF_EXTENDEDKEY;
+      }
+      send_key(0, scancode, key_flags);
+      return;
+    }
+
+    send_key(modcode, 0, key_flags);
+  }
+
+  void
+  unicode(input_t &input, char *utf8, int size) {
+    auto text = from_utf8(std::string { utf8, (std::size_t) size });
+    for (auto character : text) {
+      send_key(0, character, KEYEVENTF_UNICODE);
+      send_key(0, character, KEYEVENTF_UNICODE | KEYEVENTF_KEYUP);
+    }
+  }
+
+  int
+  alloc_gamepad(input_t &input, const gamepad_id_t &id, const gamepad_arrival_t &metadata) {
+    // Virtual gamepads need a bus driver such as ViGEmBus, which this build doesn't use
+    BOOST_LOG(warning) << "Gamepad "sv << id.globalIndex << " isn't injected, Windows has no virtual gamepads without a bus driver"sv;
+    return -1;
+  }
+
+  void
+  free_gamepad(input_t &input, int nr) {}
+
+  void
+  gamepad_update(input_t &input, int nr, const gamepad_state_t &gamepad_state) {}
+}  // namespace platf
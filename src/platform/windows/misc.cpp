@@ -2,7 +2,9 @@
  * @file src/platform/windows/misc.cpp
  * @brief todo
  */
+#include <atomic>
 #include <csignal>
+#include <cstdint>
 #include <filesystem>
 #include <iomanip>
 #include <set>
@@ -34,8 +36,15 @@
 #define NTDDI_VERSION NTDDI_WIN10
 #include <Shlwapi.h>
 
+// The device property keys are only declared unless initguid.h comes first
+#include <initguid.h>
+#include <devguid.h>
+#include <devpkey.h>
+#include <setupapi.h>
+
 #include "misc.h"
 
+#include "src/config.h"
 #include "src/globals.h"
 #include "src/logging.h"
 #include "src/platform/common.h"
@@ -1080,6 +1089,123 @@ namespace platf {
     }
   }
 
+  namespace {
+    // NUMA node of the first display adapter that reports one, -1 if unknown
+    int
+    gpu_numa_node() {
+      auto devices = SetupDiGetClassDevsW(&GUID_DEVCLASS_DISPLAY, nullptr, nullptr, DIGCF_PRESENT);
+      if (devices == INVALID_HANDLE_VALUE) {
+        return -1;
+      }
+      auto fg = util::fail_guard([&]() {
+        SetupDiDestroyDeviceInfoList(devices);
+      });
+
+      SP_DEVINFO_DATA device { sizeof(device) };
+      for (DWORD x = 0; SetupDiEnumDeviceInfo(devices, x, &device); ++x) {
+        DEVPROPTYPE type;
+        LONG node;
+        if (SetupDiGetDevicePropertyW(devices, &device, &DEVPKEY_Device_Numa_Node, &type, (PBYTE) &node, sizeof(node), nullptr, 0) &&
+            type == DEVPROP_TYPE_INT32 && node >= 0) {
+          return node;
+        }
+      }
+
+      return -1;
+    }
+
+    std::optional<GROUP_AFFINITY>
+    pipeline_affinity() {
+      auto &policy = config::sunshine.thread_affinity;
+      if (policy.empty() || policy == "off"sv) {
+        return std::nullopt;
+      }
+
+      if (policy != "auto"sv) {
+        auto cpus = util::parse_cpu_list(policy);
+        if (cpus.empty()) {
+          BOOST_LOG(warning) << "Invalid thread_affinity ["sv << policy << "], the pipeline threads are left unpinned"sv;
+          return std::nullopt;
+        }
+
+        // A thread runs within a single processor group of 64 processors, the group of the first CPU wins
+        GROUP_AFFINITY affinity {};
+        affinity.Group = (WORD) (cpus.front() / 64);
+        for (auto cpu : cpus) {
+          if (cpu / 64 == affinity.Group) {
+            affinity.Mask |= (KAFFINITY) 1 << (cpu % 64);
+          }
+        }
+        return affinity;
+      }
+
+      GROUP_AFFINITY node_affinity {};
+      auto node = gpu_numa_node();
+      if (node >= 0 && !GetNumaNodeProcessorMaskEx((USHORT) node, &node_affinity)) {
+        node = -1;
+      }
+
+      DWORD length = 0;
+      GetLogicalProcessorInformationEx(RelationCache, nullptr, &length);
+
+      std::vector<std::uint8_t> buffer(length);
+      if (!length || !GetLogicalProcessorInformationEx(RelationCache, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX) buffer.data(), &length)) {
+        auto winerr = GetLastError();
+        BOOST_LOG(warning) << "Unable to query the cache topology: "sv << winerr;
+        return node >= 0 ? std::optional { node_affinity } : std::nullopt;
+      }
+
+      // The first L3 domain on the node of the GPU, or the first one at all when the node is unknown
+      for (DWORD offset = 0; offset < length;) {
+        auto info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX) &buffer[offset];
+        offset += info->Size;
+
+        auto &cache = info->Cache;
+        if (cache.Level != 3 || (cache.Type != CacheUnified && cache.Type != CacheData)) {
+          continue;
+        }
+
+        GROUP_AFFINITY affinity {};
+        affinity.Group = cache.GroupMask.Group;
+        affinity.Mask = cache.GroupMask.Mask;
+        if (node >= 0) {
+          if (affinity.Group != node_affinity.Group || !(affinity.Mask & node_affinity.Mask)) {
+            continue;
+          }
+          affinity.Mask &= node_affinity.Mask;
+        }
+
+        return affinity;
+      }
+
+      return node >= 0 ? std::optional { node_affinity } : std::nullopt;
+    }
+  }  // namespace
+
+  void
+  place_pipeline_thread(std::string_view name) {
+    static const auto affinity = []() {
+      auto affinity = pipeline_affinity();
+      if (affinity) {
+        BOOST_LOG(info) << "Placing the pipeline threads on processor group "sv << affinity->Group << ", mask 0x"sv
+                        << util::hex(affinity->Mask, true).to_string_view();
+      }
+      return affinity;
+    }();
+
+    if (!affinity) {
+      return;
+    }
+
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &*affinity, nullptr)) {
+      auto winerr = GetLastError();
+      BOOST_LOG(warning) << "Unable to pin the "sv << name << " thread: "sv << winerr;
+      return;
+    }
+
+    BOOST_LOG(debug) << "Pinned the "sv << name << " thread"sv;
+  }
+
 
 
   void
@@ -1247,7 +1373,7 @@ namespace platf {
 
   // Use UDP segmentation offload if it is supported by the OS. If the NIC is capable, this will use
   // hardware acceleration to reduce CPU usage. Support for USO was introduced in Windows 10 20H1.
-  bool
+  size_t
   send_batch(batched_send_info_t &send_info) {
     WSAMSG msg;
 
@@ -1267,12 +1393,12 @@ namespace platf {
       msg.namelen = sizeof(taddr_v4);
     }
 
-    WSABUF buf;
-    buf.buf = (char *) send_info.buffer;
-    buf.len = send_info.block_size * send_info.block_count;
+    // USO is a property of the network stack rather than of the socket, once it failed it won't work later either
+    static std::atomic<bool> uso_unsupported = false;
+    if (send_info.block_count > 1 && uso_unsupported.load(std::memory_order_relaxed)) {
+      return 0;
+    }
 
-    msg.lpBuffers = &buf;
-    msg.dwBufferCount = 1;
     msg.dwFlags = 0;
 
     // At most, one DWORD option and one PKTINFO option
@@ -1313,21 +1439,68 @@ namespace platf {
       memcpy(WSA_CMSG_DATA(cm), &pktInfo, sizeof(pktInfo));
     }
 
-    if (send_info.block_count > 1) {
-      cmbuflen += WSA_CMSG_SPACE(sizeof(DWORD));
+    // The UDP_SEND_MSG_SIZE option always follows PKTINFO, it's only counted in when a chunk has several blocks
+    cm = WSA_CMSG_NXTHDR(&msg, cm);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEND_MSG_SIZE;
+    cm->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
+    *((DWORD *) WSA_CMSG_DATA(cm)) = send_info.block_size;
 
-      cm = WSA_CMSG_NXTHDR(&msg, cm);
-      cm->cmsg_level = IPPROTO_UDP;
-      cm->cmsg_type = UDP_SEND_MSG_SIZE;
-      cm->cmsg_len = WSA_CMSG_LEN(sizeof(DWORD));
-      *((DWORD *) WSA_CMSG_DATA(cm)) = send_info.block_size;
-    }
+    // Like GSO on Linux, USO sends at most 64K or 64 segments at a time
+    const size_t seg_max = std::max<size_t>(1, std::min<size_t>(64, 65535 / send_info.block_size));
 
-    msg.Control.len = cmbuflen;
+    // A header and a payload buffer for each block of a chunk, unless the blocks are contiguous
+    thread_local std::vector<WSABUF> bufs;
+    bufs.reserve(send_info.headers ? seg_max * (1 + send_info.max_payload_segments()) : 1);
 
-    // If USO is not supported, this will fail and the caller will fall back to unbatched sends.
-    DWORD bytes_sent;
-    return WSASendMsg((SOCKET) send_info.native_socket, &msg, 1, &bytes_sent, nullptr, nullptr) != SOCKET_ERROR;
+    size_t seg_index = 0;
+    while (seg_index < send_info.block_count) {
+      auto seg_count = std::min(seg_max, send_info.block_count - seg_index);
+
+      bufs.clear();
+      if (send_info.headers) {
+        for (size_t x = seg_index; x < seg_index + seg_count; ++x) {
+          auto header = send_info.header_for_block(x);
+
+          bufs.push_back(WSABUF { (ULONG) header.size, (char *) header.buffer });
+          send_info.for_each_payload_segment(x, [&](const buffer_descriptor_t &payload) {
+            bufs.push_back(WSABUF { (ULONG) payload.size, (char *) payload.buffer });
+          });
+        }
+      }
+      else {
+        bufs.push_back(WSABUF { (ULONG) (send_info.block_size * seg_count), (char *) &send_info.buffer[seg_index * send_info.block_size] });
+      }
+
+      msg.lpBuffers = bufs.data();
+      msg.dwBufferCount = bufs.size();
+      msg.Control.len = cmbuflen + (seg_count > 1 ? WSA_CMSG_SPACE(sizeof(DWORD)) : 0);
+
+      DWORD bytes_sent;
+      if (WSASendMsg((SOCKET) send_info.native_socket, &msg, 1, &bytes_sent, nullptr, nullptr) == SOCKET_ERROR) {
+        auto winerr = WSAGetLastError();
+        if (winerr == WSAEWOULDBLOCK) {
+          // The socket buffer is full, wait for room before retrying the same chunk
+          WSAPOLLFD pfd { (SOCKET) send_info.native_socket, POLLWRNORM, 0 };
+          if (WSAPoll(&pfd, 1, 1000) > 0) {
+            continue;
+          }
+        }
+        else if (seg_count > 1 && !seg_index && (winerr == WSAEINVAL || winerr == WSAEOPNOTSUPP)) {
+          BOOST_LOG(info) << "UDP segmentation offload is unavailable, falling back to unbatched sends"sv;
+          uso_unsupported = true;
+          return 0;
+        }
+
+        BOOST_LOG(verbose) << "WSASendMsg() failed: "sv << winerr;
+        break;
+      }
+
+      seg_index += seg_count;
+    }
+
+    // The caller sends the chunks that didn't make it one block at a time
+    return seg_index;
   }
 
   bool
@@ -1350,12 +1523,14 @@ namespace platf {
       msg.namelen = sizeof(taddr_v4);
     }
 
-    WSABUF buf;
-    buf.buf = (char *) send_info.buffer;
-    buf.len = send_info.size;
+    WSABUF bufs[2];
+    bufs[0].buf = (char *) send_info.header;
+    bufs[0].len = send_info.header_size;
+    bufs[1].buf = (char *) send_info.buffer;
+    bufs[1].len = send_info.size;
 
-    msg.lpBuffers = &buf;
-    msg.dwBufferCount = 1;
+    msg.lpBuffers = bufs;
+    msg.dwBufferCount = 2;
     msg.dwFlags = 0;
 
     char cmbuf[std::max(WSA_CMSG_SPACE(sizeof(IN6_PKTINFO)), WSA_CMSG_SPACE(sizeof(IN_PKTINFO)))] = {};
@@ -1422,6 +1597,12 @@ namespace platf {
     QOS_FLOWID flow_id;
   };
 
+  bool
+  enable_socket_txtime(std::uintptr_t native_socket) {
+    // Departure times are a feature of the Linux qdiscs, the pacer sleeps instead
+    return false;
+  }
+
   /**
    * @brief Enables QoS on the given socket for traffic to the specified destination.
    * @param native_socket The native socket handle.
@@ -0,0 +1,266 @@
+/**
+ * @file src/reactor.cpp
+ * @brief The thread that receives the datagrams of every socket of the process.
+ */
+#include <array>
+#include <cstring>
+#include <thread>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+#ifdef __linux__
+  #include <sys/socket.h>
+#endif
+#ifdef _WIN32
+  #include <winsock2.h>
+  #include <mstcpip.h>
+#endif
+
+#include "logging.h"
+#include "platform/common.h"
+#include "reactor.h"
+#include "trace.h"
+
+using namespace std::literals;
+
+namespace reactor {
+  namespace {
+    // Datagrams received at once, and the largest datagram
+    constexpr std::size_t BATCH_SIZE = 32;
+    constexpr std::size_t DATAGRAM_SIZE = 16 * 1024;
+
+    /**
+     * @brief The io_context of the reactor thread, it starts with the first socket and runs until the process exits.
+     * @details Like the other pipeline threads the thread is detached. The context and its work guard are never
+     *          destroyed, static destructors would otherwise tear them down under the running thread.
+     */
+    boost::asio::io_context &
+    io_context() {
+      static auto &context = *new boost::asio::io_context;
+      static auto &work = *new boost::asio::executor_work_guard<boost::asio::io_context::executor_type> { context.get_executor() };
+      static bool started = [&]() {
+        std::thread { []() {
+          // Input and the feedback of the client are latency critical
+          platf::adjust_thread_priority(platf::thread_priority_e::high);
+          platf::place_pipeline_thread("reactor"sv);
+          TRACE_THREAD("reactor");
+
+          while (true) {
+            try {
+              context.run();
+              return;
+            }
+            catch (const std::exception &e) {
+              BOOST_LOG(error) << "Reactor: "sv << e.what();
+            }
+          }
+        } }.detach();
+        return true;
+      }();
+
+      (void) work;
+      (void) started;
+      return context;
+    }
+  }  // namespace
+
+  struct socket_t::batch_t {
+    std::vector<char> buffers = std::vector<char>(BATCH_SIZE * DATAGRAM_SIZE);
+#ifdef __linux__
+    std::array<mmsghdr, BATCH_SIZE> messages {};
+    std::array<iovec, BATCH_SIZE> iovecs {};
+    std::array<sockaddr_storage, BATCH_SIZE> addresses {};
+#endif
+  };
+
+  socket_t::socket_t(udp::socket &&socket, handler_t &&handler):
+      socket { std::move(socket) }, handler { std::move(handler) }, batch { std::make_unique<batch_t>() } {
+#ifdef __linux__
+    for (std::size_t x = 0; x < BATCH_SIZE; ++x) {
+      batch->iovecs[x] = { &batch->buffers[x * DATAGRAM_SIZE], DATAGRAM_SIZE };
+      batch->messages[x].msg_hdr.msg_iov = &batch->iovecs[x];
+      batch->messages[x].msg_hdr.msg_iovlen = 1;
+      batch->messages[x].msg_hdr.msg_name = &batch->addresses[x];
+    }
+#endif
+  }
+
+  socket_t::~socket_t() = default;
+
+  std::uintptr_t
+  socket_t::native_handle() {
+    return (std::uintptr_t) socket.native_handle();
+  }
+
+  void
+  socket_t::send_buffer_size(int bytes) {
+    boost::system::error_code err;
+    socket.set_option(udp::socket::send_buffer_size { bytes }, err);
+    if (err) {
+      BOOST_LOG(error) << "Couldn't set the send buffer size: "sv << err.message();
+      return;
+    }
+
+    udp::socket::send_buffer_size effective;
+    socket.get_option(effective, err);
+    if (!err) {
+      BOOST_LOG(info) << "Send buffer size: "sv << effective.value() << " bytes, "sv << bytes << " requested"sv;
+    }
+  }
+
+  void
+  socket_t::reply(std::string_view data) {
+    boost::system::error_code err;
+    socket.send_to(boost::asio::buffer(data.data(), data.size()), current_sender, 0, err);
+    if (err) {
+      BOOST_LOG(error) << "reply failed: " << err.message();
+    }
+  }
+
+  void
+  socket_t::notify(std::string_view data) {
+    std::optional<udp::endpoint> target;
+    {
+      std::lock_guard lg { peer_mutex };
+      target = peer;
+    }
+
+    if (!target) {
+      return;
+    }
+
+    boost::system::error_code err;
+    socket.send_to(boost::asio::buffer(data.data(), data.size()), *target, 0, err);
+    if (err) {
+      BOOST_LOG(error) << "notify failed: " << err.message();
+    }
+  }
+
+  void
+  socket_t::wait() {
+    socket.async_wait(udp::socket::wait_read, [self = shared_from_this()](const boost::system::error_code &err) {
+      if (err == boost::asio::error::operation_aborted) {
+        return;
+      }
+      if (err) {
+        BOOST_LOG_LIMITED(warning) << "Waiting for datagrams failed: "sv << err.message();
+      }
+      else {
+        self->receive();
+      }
+
+      self->wait();
+    });
+  }
+
+  void
+  socket_t::receive() {
+    TRACE_SCOPE("reactor.receive");
+
+#ifdef __linux__
+    while (true) {
+      for (auto &message : batch->messages) {
+        message.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        message.msg_hdr.msg_flags = 0;
+      }
+
+      auto count = recvmmsg(socket.native_handle(), batch->messages.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          BOOST_LOG_LIMITED(warning) << "recvmmsg() failed: "sv << std::strerror(errno);
+        }
+        return;
+      }
+
+      for (int x = 0; x < count; ++x) {
+        auto &message = batch->messages[x];
+        if (message.msg_hdr.msg_flags & MSG_TRUNC) {
+          BOOST_LOG_LIMITED(warning) << "Dropped a datagram larger than "sv << DATAGRAM_SIZE << " bytes"sv;
+          continue;
+        }
+
+        udp::endpoint sender;
+        if (message.msg_hdr.msg_namelen > sender.capacity()) {
+          continue;
+        }
+        std::memcpy(sender.data(), &batch->addresses[x], message.msg_hdr.msg_namelen);
+        sender.resize(message.msg_hdr.msg_namelen);
+
+        dispatch({ &batch->buffers[x * DATAGRAM_SIZE], message.msg_len }, sender);
+      }
+
+      // A short batch emptied the socket
+      if ((std::size_t) count < BATCH_SIZE) {
+        return;
+      }
+    }
+#else
+    // Other sockets get their turn after a batch. The socket stays blocking for the senders that share it,
+    // so only what is known to be there is received. The first receive takes whatever made the socket
+    // readable, an empty datagram or a pending error leaves nothing available and would wake us forever.
+    for (std::size_t x = 0; x < BATCH_SIZE; ++x) {
+      boost::system::error_code err;
+      if (x && (!socket.available(err) || err)) {
+        return;
+      }
+
+      udp::endpoint sender;
+      auto size = socket.receive_from(boost::asio::buffer(batch->buffers.data(), DATAGRAM_SIZE), sender, 0, err);
+      if (err) {
+        // Windows reports the ICMP errors of earlier sends on the next receive
+        BOOST_LOG_LIMITED(debug) << "Receiving a datagram failed: "sv << err.message();
+        continue;
+      }
+
+      dispatch({ batch->buffers.data(), size }, sender);
+    }
+#endif
+  }
+
+  void
+  socket_t::dispatch(std::string_view datagram, const udp::endpoint &sender) {
+    if (sender != current_sender || !peer) {
+      std::lock_guard lg { peer_mutex };
+      peer = sender;
+    }
+    current_sender = sender;
+
+    handler(*this, datagram);
+  }
+
+  std::shared_ptr<socket_t>
+  bind(const udp::endpoint &endpoint, handler_t handler) {
+    boost::system::error_code err;
+    udp::socket socket { io_context() };
+    socket.open(endpoint.protocol(), err);
+    if (!err) {
+      socket.bind(endpoint, err);
+    }
+    if (err) {
+      BOOST_LOG(error) << "Couldn't bind "sv << endpoint << ": "sv << err.message();
+      return nullptr;
+    }
+
+#ifdef _WIN32
+    // Windows marks the socket readable for the port unreachable of an earlier send, with nothing to receive
+    BOOL connreset = FALSE;
+    DWORD bytes = 0;
+    if (WSAIoctl(socket.native_handle(), SIO_UDP_CONNRESET, &connreset, sizeof(connreset), nullptr, 0, &bytes, nullptr, nullptr)) {
+      BOOST_LOG(warning) << "Couldn't turn off the connection resets of "sv << endpoint << ": "sv << WSAGetLastError();
+    }
+#endif
+
+    std::shared_ptr<socket_t> bound { new socket_t { std::move(socket), std::move(handler) } };
+
+    // The first wait is started on the reactor thread, the handlers only ever run there
+    boost::asio::post(io_context(), [bound]() {
+      bound->wait();
+    });
+
+    return bound;
+  }
+}  // namespace reactor
@@ -0,0 +1,104 @@
+/**
+ * @file src/reactor.h
+ * @brief The thread that receives the datagrams of every socket of the process.
+ */
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+
+namespace reactor {
+  using udp = boost::asio::ip::udp;
+
+  class socket_t;
+
+  /**
+   * @brief Called on the reactor thread for every datagram, the datagram is only valid during the call.
+   */
+  using handler_t = std::function<void(socket_t &socket, std::string_view datagram)>;
+
+  /**
+   * @brief A bound socket, its datagrams are handed to its handler on the reactor thread.
+   * @details The socket is never recreated, errors of a receive are logged and the next datagram is
+   *          received from the same socket, so the senders that share it keep a valid handle.
+   *
+   *          Once the socket is readable, its datagrams are received in batches into buffers of the
+   *          socket, with recvmmsg() on Linux and one receive per pending datagram elsewhere, until
+   *          there are none left. Receiving allocates nothing.
+   */
+  class socket_t: public std::enable_shared_from_this<socket_t> {
+  public:
+    ~socket_t();
+
+    std::uintptr_t
+    native_handle();
+
+    /**
+     * @brief Resize the send buffer of the socket, the kernel may clamp or double the size.
+     * @param bytes Requested size of the send buffer.
+     */
+    void
+    send_buffer_size(int bytes);
+
+    /**
+     * @brief Sender of the datagram being handled, only valid on the reactor thread.
+     */
+    const udp::endpoint &
+    sender() const {
+      return current_sender;
+    }
+
+    /**
+     * @brief Answer the sender of the datagram being handled, only from its handler.
+     */
+    void
+    reply(std::string_view data);
+
+    /**
+     * @brief Send to whoever sent the last datagram, dropped until there has been one. Any thread may notify.
+     */
+    void
+    notify(std::string_view data);
+
+  private:
+    friend std::shared_ptr<socket_t>
+    bind(const udp::endpoint &endpoint, handler_t handler);
+
+    struct batch_t;
+
+    socket_t(udp::socket &&socket, handler_t &&handler);
+
+    void
+    wait();
+
+    void
+    receive();
+
+    void
+    dispatch(std::string_view datagram, const udp::endpoint &sender);
+
+    udp::socket socket;
+    handler_t handler;
+    std::unique_ptr<batch_t> batch;
+
+    udp::endpoint current_sender;
+
+    // Copy of the last sender for other threads
+    std::mutex peer_mutex;
+    std::optional<udp::endpoint> peer;
+  };
+
+  /**
+   * @brief Bind a socket, the reactor thread starts with the first one.
+   * @return nullptr if the socket couldn't be bound.
+   */
+  std::shared_ptr<socket_t>
+  bind(const udp::endpoint &endpoint, handler_t handler);
+}  // namespace reactor
@@ -0,0 +1,340 @@
+/**
+ * @file src/recorder.cpp
+ * @brief Records the encoded packets of a session into an MPEG-TS file.
+ */
+#include <algorithm>
+#include <cstring>
+
+#include "logging.h"
+#include "recorder.h"
+#include "stream.h"
+
+namespace recorder {
+  using namespace std::literals;
+
+  namespace {
+    constexpr std::size_t TS_PACKET_SIZE = 188;
+    constexpr std::uint16_t PMT_PID = 0x1000;
+    constexpr std::uint16_t VIDEO_PID = 0x100;
+    constexpr std::uint16_t AUDIO_PID = 0x101;
+
+    // Stream types of ISO/IEC 13818-1, Opus is carried as private data
+    constexpr std::uint8_t STREAM_TYPE_H264 = 0x1B;
+    constexpr std::uint8_t STREAM_TYPE_HEVC = 0x24;
+    constexpr std::uint8_t STREAM_TYPE_PRIVATE = 0x06;
+
+    // Timestamps start a second in, so the PCR can run ahead of the first frames
+    constexpr std::uint64_t PTS_OFFSET = 90000;
+    constexpr std::uint64_t PCR_DELAY = 9000;
+
+    // Access unit delimiters, the first slice of every frame starts with one
+    constexpr std::uint8_t H264_AUD[] { 0, 0, 0, 1, 0x09, 0xF0 };
+    constexpr std::uint8_t HEVC_AUD[] { 0, 0, 0, 1, 0x46, 0x01, 0x50 };
+
+    /**
+     * @brief CRC-32/MPEG-2 of the program specific information.
+     */
+    std::uint32_t
+    crc32(const std::uint8_t *data, std::size_t size) {
+      std::uint32_t crc = 0xFFFFFFFF;
+      for (std::size_t x = 0; x < size; ++x) {
+        crc ^= (std::uint32_t) data[x] << 24;
+        for (int bit = 0; bit < 8; ++bit) {
+          crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+      }
+      return crc;
+    }
+
+    void
+    append_crc(std::vector<std::uint8_t> &section) {
+      auto crc = crc32(section.data(), section.size());
+      for (int x = 3; x >= 0; --x) {
+        section.push_back((std::uint8_t) (crc >> (x * 8)));
+      }
+    }
+
+    void
+    append_pts(std::vector<std::uint8_t> &header, std::uint64_t pts) {
+      header.push_back((std::uint8_t) (0x21 | ((pts >> 29) & 0x0E)));
+      header.push_back((std::uint8_t) (pts >> 22));
+      header.push_back((std::uint8_t) (0x01 | ((pts >> 14) & 0xFE)));
+      header.push_back((std::uint8_t) (pts >> 7));
+      header.push_back((std::uint8_t) (0x01 | ((pts << 1) & 0xFE)));
+    }
+  }  // namespace
+
+  std::shared_ptr<recorder_t>
+  recorder_t::make(const std::string &path, int video_format, std::optional<int> audio_channels, std::size_t queue_size) {
+    if (video_format != 0 && video_format != 1) {
+      BOOST_LOG(error) << "Only H.264 and HEVC can be recorded into MPEG-TS"sv;
+      return nullptr;
+    }
+
+    std::ofstream file { path, std::ios::binary | std::ios::trunc };
+    if (!file) {
+      BOOST_LOG(error) << "Couldn't open the recording "sv << path;
+      return nullptr;
+    }
+
+    BOOST_LOG(info) << "Recording to "sv << path;
+    return std::shared_ptr<recorder_t> { new recorder_t { std::move(file), video_format, audio_channels, std::max<std::size_t>(queue_size, 2) } };
+  }
+
+  recorder_t::recorder_t(std::ofstream &&file, int video_format, std::optional<int> audio_channels, std::size_t queue_size):
+      file { std::move(file) }, video_format { video_format }, audio_channels { audio_channels }, queue_size { queue_size } {
+    thread = std::thread { &recorder_t::run, this };
+  }
+
+  recorder_t::~recorder_t() {
+    {
+      std::lock_guard lg { mutex };
+      stopped = true;
+    }
+    cv.notify_one();
+    thread.join();
+
+    file.flush();
+    if (dropped) {
+      BOOST_LOG(warning) << "The recording is missing "sv << dropped << " packets the disk couldn't keep up with"sv;
+    }
+  }
+
+  void
+  recorder_t::video(video::packet_raw_t &packet, std::chrono::steady_clock::time_point capture_time, safe::mail_raw_t::event_t<bool> &idr) {
+    auto frame_size = stream::splice(packet, segments);
+
+    packet_t recorded { {}, pts(capture_time), true, packet.is_idr() };
+    if (!packet.slice_index) {
+      if (video_format == 0) {
+        recorded.data.assign(std::begin(H264_AUD), std::end(H264_AUD));
+      }
+      else {
+        recorded.data.assign(std::begin(HEVC_AUD), std::end(HEVC_AUD));
+      }
+    }
+
+    recorded.data.reserve(recorded.data.size() + frame_size);
+    for (auto &segment : segments) {
+      recorded.data.insert(recorded.data.end(), (const std::uint8_t *) segment.buffer, (const std::uint8_t *) segment.buffer + segment.size);
+    }
+
+    if (push(std::move(recorded))) {
+      idr->raise(true);
+    }
+  }
+
+  void
+  recorder_t::audio(std::string_view payload, std::chrono::steady_clock::time_point capture_time) {
+    if (!audio_channels) {
+      return;
+    }
+
+    // Every Opus packet starts with the control header of the Opus mapping for MPEG-TS, its size is coded in steps of 255
+    packet_t recorded { {}, pts(capture_time), false, false };
+    recorded.data.reserve(2 + payload.size() / 255 + 1 + payload.size());
+    recorded.data.push_back(0x7F);
+    recorded.data.push_back(0xE0);
+    for (auto size = payload.size(); true; size -= 255) {
+      recorded.data.push_back((std::uint8_t) std::min<std::size_t>(size, 255));
+      if (size < 255) {
+        break;
+      }
+    }
+    recorded.data.insert(recorded.data.end(), payload.begin(), payload.end());
+
+    push(std::move(recorded));
+  }
+
+  bool
+  recorder_t::push(packet_t &&packet) {
+    {
+      std::lock_guard lg { mutex };
+
+      // Audio is small, it's only dropped while the queue is full
+      if (!packet.video) {
+        if (queue.size() >= queue_size) {
+          ++dropped;
+          return false;
+        }
+      }
+
+      // Once the disk fell behind only IDR frames are kept, until one of them finds the queue half empty
+      else if (keyframes_only) {
+        if (!packet.idr || queue.size() > queue_size / 2) {
+          ++dropped;
+
+          // The request may be lost to an IDR frame that came while the queue was still too full
+          auto now = std::chrono::steady_clock::now();
+          if (now - idr_requested >= 1s) {
+            idr_requested = now;
+            return true;
+          }
+          return false;
+        }
+
+        BOOST_LOG(info) << "The recording caught up, keeping every frame again"sv;
+        keyframes_only = false;
+      }
+      else if (queue.size() >= queue_size) {
+        BOOST_LOG(warning) << "The disk can't keep up with the recording, only keeping IDR frames"sv;
+        keyframes_only = true;
+        idr_requested = std::chrono::steady_clock::now();
+        ++dropped;
+        return true;
+      }
+
+      queue.push_back(std::move(packet));
+    }
+    cv.notify_one();
+    return false;
+  }
+
+  void
+  recorder_t::run() {
+    while (true) {
+      packet_t packet;
+      {
+        std::unique_lock ul { mutex };
+        cv.wait(ul, [this]() { return stopped || !queue.empty(); });
+        if (queue.empty()) {
+          return;
+        }
+
+        packet = std::move(queue.front());
+        queue.pop_front();
+      }
+
+      write(packet);
+    }
+  }
+
+  void
+  recorder_t::write(const packet_t &packet) {
+    // Readers can start at every IDR frame, the tables are repeated at least every second for them
+    if (!last_tables || (packet.video && packet.idr) || packet.pts - std::min(packet.pts, *last_tables) >= 90000) {
+      write_tables();
+      last_tables = packet.pts;
+    }
+
+    std::vector<std::uint8_t> header { 0, 0, 1, (std::uint8_t) (packet.video ? 0xE0 : 0xBD), 0, 0, 0x80, 0x80, 5 };
+    append_pts(header, packet.pts);
+
+    // Video may exceed the PES length field, 0 leaves it unbounded
+    auto pes_length = header.size() - 6 + packet.data.size();
+    if (!packet.video || pes_length <= 0xFFFF) {
+      header[4] = (std::uint8_t) (pes_length >> 8);
+      header[5] = (std::uint8_t) pes_length;
+    }
+
+    if (packet.video) {
+      write_pes(VIDEO_PID, header.data(), header.size(), packet.data.data(), packet.data.size(), packet.pts - PCR_DELAY);
+    }
+    else {
+      write_pes(AUDIO_PID, header.data(), header.size(), packet.data.data(), packet.data.size(), std::nullopt);
+    }
+  }
+
+  void
+  recorder_t::write_tables() {
+    // Program association: program 1 on the PMT
+    std::vector<std::uint8_t> pat { 0x00, 0xB0, 13, 0x00, 0x01, 0xC1, 0x00, 0x00, 0x00, 0x01, (std::uint8_t) (0xE0 | (PMT_PID >> 8)), (std::uint8_t) PMT_PID };
+    append_crc(pat);
+
+    std::vector<std::uint8_t> pmt { 0x02, 0xB0, 0, 0x00, 0x01, 0xC1, 0x00, 0x00, (std::uint8_t) (0xE0 | (VIDEO_PID >> 8)), (std::uint8_t) VIDEO_PID, 0xF0, 0x00 };
+    pmt.insert(pmt.end(), { video_format == 0 ? STREAM_TYPE_H264 : STREAM_TYPE_HEVC, (std::uint8_t) (0xE0 | (VIDEO_PID >> 8)), (std::uint8_t) VIDEO_PID, 0xF0, 0x00 });
+    if (audio_channels) {
+      // Registration descriptor "Opus" and the extension descriptor with the channel configuration
+      pmt.insert(pmt.end(), {
+                              STREAM_TYPE_PRIVATE,
+                              (std::uint8_t) (0xE0 | (AUDIO_PID >> 8)),
+                              (std::uint8_t) AUDIO_PID,
+                              0xF0,
+                              10,
+                              0x05,
+                              4,
+                              'O',
+                              'p',
+                              'u',
+                              's',
+                              0x7F,
+                              2,
+                              0x80,
+                              (std::uint8_t) std::clamp(*audio_channels, 1, 8),
+                            });
+    }
+    pmt[2] = (std::uint8_t) (pmt.size() - 3 + 4);
+    append_crc(pmt);
+
+    // Sections start right after a pointer field of 0
+    pat.insert(pat.begin(), 0);
+    pmt.insert(pmt.begin(), 0);
+    write_pes(0, nullptr, 0, pat.data(), pat.size(), std::nullopt);
+    write_pes(PMT_PID, nullptr, 0, pmt.data(), pmt.size(), std::nullopt);
+  }
+
+  void
+  recorder_t::write_pes(std::uint16_t pid, const std::uint8_t *header, std::size_t header_size, const std::uint8_t *data, std::size_t size, std::optional<std::uint64_t> pcr) {
+    std::uint8_t ts[TS_PACKET_SIZE];
+    bool first = true;
+    while (first || header_size || size) {
+      ts[0] = 0x47;
+      ts[1] = (std::uint8_t) ((first ? 0x40 : 0x00) | (pid >> 8));
+      ts[2] = (std::uint8_t) pid;
+
+      std::size_t offset = 4;
+      std::size_t adaptation = first && pcr ? 8 : 0;
+      auto payload = std::min(TS_PACKET_SIZE - offset - adaptation, header_size + size);
+
+      // Sections are padded with 0xFF after their end, PES packets with stuffing in the adaptation field
+      bool psi = pid == 0 || pid == PMT_PID;
+      if (!psi && payload < TS_PACKET_SIZE - offset - adaptation) {
+        adaptation = TS_PACKET_SIZE - offset - payload;
+      }
+
+      ts[3] = (std::uint8_t) ((adaptation ? 0x30 : 0x10) | (continuity[pid]++ & 0x0F));
+      if (adaptation) {
+        ts[offset] = (std::uint8_t) (adaptation - 1);
+        if (adaptation > 1) {
+          ts[offset + 1] = 0x00;
+          std::size_t fields = 2;
+          if (first && pcr) {
+            ts[offset + 1] = 0x10;
+            auto base = *pcr;
+            ts[offset + 2] = (std::uint8_t) (base >> 25);
+            ts[offset + 3] = (std::uint8_t) (base >> 17);
+            ts[offset + 4] = (std::uint8_t) (base >> 9);
+            ts[offset + 5] = (std::uint8_t) (base >> 1);
+            ts[offset + 6] = (std::uint8_t) (((base & 1) << 7) | 0x7E);
+            ts[offset + 7] = 0x00;
+            fields = 8;
+          }
+          std::memset(ts + offset + fields, 0xFF, adaptation - fields);
+        }
+        offset += adaptation;
+      }
+
+      auto from_header = std::min(payload, header_size);
+      std::memcpy(ts + offset, header, from_header);
+      header += from_header;
+      header_size -= from_header;
+      offset += from_header;
+
+      auto from_data = payload - from_header;
+      std::memcpy(ts + offset, data, from_data);
+      data += from_data;
+      size -= from_data;
+      offset += from_data;
+
+      std::memset(ts + offset, 0xFF, TS_PACKET_SIZE - offset);
+      file.write((const char *) ts, TS_PACKET_SIZE);
+      first = false;
+    }
+  }
+
+  std::uint64_t
+  recorder_t::pts(std::chrono::steady_clock::time_point capture_time) const {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::max(capture_time, start) - start).count();
+    return PTS_OFFSET + (std::uint64_t) elapsed * 9 / 100;
+  }
+}  // namespace recorder
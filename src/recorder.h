@@ -0,0 +1,116 @@
+/**
+ * @file src/recorder.h
+ * @brief Records the encoded packets of a session into an MPEG-TS file.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "platform/common.h"
+#include "thread_safe.h"
+#include "video.h"
+
+namespace recorder {
+  /**
+   * @brief Writes the packets the senders already have into a transport stream, nothing is encoded twice.
+   * @details The senders hand over a copy of every packet and return right away, a thread of the
+   *          recorder writes them. When the disk falls behind and the queue is full, the recorder only
+   *          keeps audio and IDR frames until an IDR frame finds the queue half empty again, so the live
+   *          path never waits for the disk. It asks the encoder for that IDR frame, once a second until
+   *          one is kept, with an infinite GOP none would come otherwise. A transport stream stays readable up to its last packet, a
+   *          recording that ends with the process needs no finalization.
+   */
+  class recorder_t {
+  public:
+    /**
+     * @param path The file, it's overwritten.
+     * @param video_format The codec of the video as in video::config_t, H.264 or HEVC.
+     * @param audio_channels Channels of the Opus audio, std::nullopt records no audio.
+     * @param queue_size Packets queued for the disk before the recorder drops to IDR frames.
+     * @return nullptr if the file can't be opened or the codec can't be carried in MPEG-TS.
+     */
+    static std::shared_ptr<recorder_t>
+    make(const std::string &path, int video_format, std::optional<int> audio_channels, std::size_t queue_size);
+
+    ~recorder_t();
+
+    /**
+     * @brief Record an encoded video frame, or a slice of one, with its parameter set replacements.
+     * @param idr The IDR event of the encoder, raised while the recorder waits for an IDR frame.
+     */
+    void
+    video(video::packet_raw_t &packet, std::chrono::steady_clock::time_point capture_time, safe::mail_raw_t::event_t<bool> &idr);
+
+    /**
+     * @brief Record an Opus packet.
+     */
+    void
+    audio(std::string_view payload, std::chrono::steady_clock::time_point capture_time);
+
+  private:
+    struct packet_t {
+      std::vector<std::uint8_t> data;
+      std::uint64_t pts;  // 90 kHz
+      bool video;
+      bool idr;
+    };
+
+    recorder_t(std::ofstream &&file, int video_format, std::optional<int> audio_channels, std::size_t queue_size);
+
+    /**
+     * @return true if the encoder should be asked for an IDR frame.
+     */
+    bool
+    push(packet_t &&packet);
+
+    void
+    run();
+
+    void
+    write(const packet_t &packet);
+
+    void
+    write_tables();
+
+    void
+    write_pes(std::uint16_t pid, const std::uint8_t *header, std::size_t header_size, const std::uint8_t *data, std::size_t size, std::optional<std::uint64_t> pcr);
+
+    std::uint64_t
+    pts(std::chrono::steady_clock::time_point capture_time) const;
+
+    std::ofstream file;
+    int video_format;
+    std::optional<int> audio_channels;
+    std::size_t queue_size;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<packet_t> queue;
+    bool stopped = false;
+    bool keyframes_only = false;
+    std::chrono::steady_clock::time_point idr_requested;
+    std::uint64_t dropped = 0;
+
+    // Owned by the sender of the video
+    std::vector<platf::buffer_descriptor_t> segments;
+
+    // Owned by the thread of the recorder
+    std::uint8_t continuity[0x2000] {};
+    std::optional<std::uint64_t> last_tables;
+
+    std::thread thread;
+  };
+}  // namespace recorder
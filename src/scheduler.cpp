@@ -0,0 +1,263 @@
+/**
+ * @file src/scheduler.cpp
+ * @brief Admission and deadline ordering of the encode sessions that share a GPU.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#include "config.h"
+#include "logging.h"
+#include "scheduler.h"
+
+using namespace std::literals;
+
+namespace scheduler {
+  // Weight of a new measurement of the encoder time of a pixel
+  constexpr double COST_SMOOTHING = 1.0 / 16;
+
+  class adapter_t {
+  public:
+    std::string name;
+
+    std::mutex lock;
+    std::condition_variable turn_cv;
+
+    int sessions = 0;
+
+    // The limit the driver showed by refusing a session, 0 until it did
+    int learned_max_sessions = 0;
+
+    // Pixel rate of the admitted sessions
+    double pixel_rate = 0;
+
+    // Encoder seconds of a pixel, 0 until a turn measured it
+    double cost = 0;
+
+    // Frames being encoded and the deadlines of the sessions waiting for their turn
+    int busy = 0;
+    std::multiset<std::chrono::steady_clock::time_point> waiting;
+
+    int
+    max_sessions() const {
+      return config::video.scheduler.max_sessions > 0 ? config::video.scheduler.max_sessions : learned_max_sessions;
+    }
+
+    int
+    slots() const {
+      return std::max(config::video.scheduler.concurrent_submissions, 1);
+    }
+
+    /**
+     * @brief Downgrade a load until it fits beside the others.
+     * @return false if it doesn't fit at the smallest load, the load is set to the smallest load then.
+     */
+    bool
+    fit(load_t &load, bool resize) const {
+      auto &settings = config::video.scheduler;
+
+      // Nothing to go by before the first frame is encoded
+      if (cost <= 0) {
+        return true;
+      }
+
+      auto budget = slots() * settings.max_utilization / 100.0 / cost - pixel_rate;
+      if (load.pixel_rate() <= budget) {
+        return true;
+      }
+
+      // Fewer frames keep the picture sharp, so the framerate goes first
+      auto min_framerate = std::min(load.framerate, settings.min_framerate);
+      auto framerate = (int) (budget / ((double) load.width * load.height));
+      if (framerate >= min_framerate) {
+        load.framerate = framerate;
+        return true;
+      }
+      load.framerate = min_framerate;
+
+      if (!resize) {
+        return false;
+      }
+
+      // Scaled to even dimensions with the aspect ratio kept
+      auto min_height = std::min(load.height, settings.min_height);
+      auto scale = std::sqrt(std::max(budget, 0.0) / load.pixel_rate());
+      auto height = (int) (load.height * scale) & ~1;
+      if (height >= min_height && height > 0) {
+        load.width = (int) (load.width * scale) & ~1;
+        load.height = height;
+        return true;
+      }
+
+      load.width = (int) ((std::int64_t) load.width * min_height / load.height) & ~1;
+      load.height = min_height;
+      return false;
+    }
+  };
+
+  namespace {
+    // Adapters outlive their sessions, so the next session starts with what was learned about them
+    std::mutex adapters_lock;
+    std::map<std::string, std::shared_ptr<adapter_t>> adapters;
+
+    std::shared_ptr<adapter_t>
+    ref_adapter(const std::string &name) {
+      std::lock_guard lg { adapters_lock };
+
+      auto &adapter = adapters[name];
+      if (!adapter) {
+        adapter = std::make_shared<adapter_t>();
+        adapter->name = name;
+      }
+
+      return adapter;
+    }
+  }  // namespace
+
+  turn_t::turn_t(session_t *session):
+      session { session }, start { std::chrono::steady_clock::now() } {}
+
+  turn_t::turn_t(turn_t &&other) noexcept:
+      session { std::exchange(other.session, nullptr) }, start { other.start } {}
+
+  turn_t &
+  turn_t::operator=(turn_t &&other) noexcept {
+    std::swap(session, other.session);
+    std::swap(start, other.start);
+    return *this;
+  }
+
+  turn_t::~turn_t() {
+    if (!session) {
+      return;
+    }
+
+    auto &adapter = *session->adapter;
+    auto pixels = (double) session->load.width * session->load.height;
+    std::chrono::duration<double> held = std::chrono::steady_clock::now() - start;
+
+    {
+      std::lock_guard lg { adapter.lock };
+
+      --adapter.busy;
+      if (pixels > 0) {
+        auto cost = held.count() / pixels;
+        adapter.cost = adapter.cost > 0 ? adapter.cost + (cost - adapter.cost) * COST_SMOOTHING : cost;
+      }
+    }
+
+    adapter.turn_cv.notify_all();
+  }
+
+  session_t::session_t(std::shared_ptr<adapter_t> adapter, const load_t &load):
+      adapter { std::move(adapter) }, load { load } {}
+
+  session_t::~session_t() {
+    if (!adapter) {
+      return;
+    }
+
+    std::lock_guard lg { adapter->lock };
+    --adapter->sessions;
+    adapter->pixel_rate -= load.pixel_rate();
+  }
+
+  void
+  session_t::update(load_t &load, bool resize) {
+    if (!adapter) {
+      return;
+    }
+
+    std::lock_guard lg { adapter->lock };
+    adapter->pixel_rate -= this->load.pixel_rate();
+
+    auto requested = load;
+    if (!adapter->fit(load, resize)) {
+      BOOST_LOG(warning) << "Encoder ["sv << adapter->name << "] is overloaded even at "sv << load.width << 'x' << load.height << '@' << load.framerate;
+    }
+    else if (load != requested) {
+      BOOST_LOG(info) << "Session on encoder ["sv << adapter->name << "] downgraded to "sv << load.width << 'x' << load.height << '@' << load.framerate;
+    }
+
+    adapter->pixel_rate += load.pixel_rate();
+    this->load = load;
+  }
+
+  turn_t
+  session_t::turn(std::chrono::steady_clock::time_point deadline) {
+    if (!adapter) {
+      return {};
+    }
+
+    std::unique_lock lg { adapter->lock };
+
+    auto waiting = adapter->waiting.emplace(deadline);
+    adapter->turn_cv.wait(lg, [&]() {
+      return adapter->busy < adapter->slots() && *std::begin(adapter->waiting) == deadline;
+    });
+    adapter->waiting.erase(waiting);
+    ++adapter->busy;
+
+    // The session with the next deadline may take a free slot as well
+    adapter->turn_cv.notify_all();
+
+    return turn_t { this };
+  }
+
+  bool
+  session_t::refused() {
+    if (!adapter) {
+      return false;
+    }
+
+    std::lock_guard lg { adapter->lock };
+
+    auto others = adapter->sessions - 1;
+    if (others <= 0) {
+      return false;
+    }
+
+    adapter->learned_max_sessions = others;
+    BOOST_LOG(warning) << "Encoder ["sv << adapter->name << "] refused a session, it's limited to "sv << others << " sessions from now on"sv;
+    return true;
+  }
+
+  std::unique_ptr<session_t>
+  admit(const std::string &adapter_name, load_t &load) {
+    if (!config::video.scheduler.enabled) {
+      return std::unique_ptr<session_t> { new session_t { nullptr, load } };
+    }
+
+    auto adapter = ref_adapter(adapter_name);
+
+    std::lock_guard lg { adapter->lock };
+
+    auto max_sessions = adapter->max_sessions();
+    if (max_sessions > 0 && adapter->sessions >= max_sessions) {
+      BOOST_LOG(error) << "Encoder ["sv << adapter_name << "] already encodes "sv << adapter->sessions << " sessions, rejecting the new one"sv;
+      return nullptr;
+    }
+
+    auto requested = load;
+    if (!adapter->fit(load, true)) {
+      BOOST_LOG(error) << "Encoder ["sv << adapter_name << "] can't fit a session of "sv << requested.width << 'x' << requested.height << '@' << requested.framerate << ", rejecting it"sv;
+      return nullptr;
+    }
+
+    if (load != requested) {
+      BOOST_LOG(info) << "Session on encoder ["sv << adapter_name << "] downgraded from "sv
+                      << requested.width << 'x' << requested.height << '@' << requested.framerate << " to "sv
+                      << load.width << 'x' << load.height << '@' << load.framerate;
+    }
+
+    ++adapter->sessions;
+    adapter->pixel_rate += load.pixel_rate();
+
+    return std::unique_ptr<session_t> { new session_t { std::move(adapter), load } };
+  }
+}  // namespace scheduler
@@ -0,0 +1,105 @@
+/**
+ * @file src/scheduler.h
+ * @brief Admission and deadline ordering of the encode sessions that share a GPU.
+ */
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace scheduler {
+  class adapter_t;
+  class session_t;
+
+  /**
+   * @brief What a session encodes, its cost is the pixel rate.
+   */
+  struct load_t {
+    int width;
+    int height;
+    int framerate;
+
+    double
+    pixel_rate() const {
+      return (double) width * height * framerate;
+    }
+
+    bool
+    operator==(const load_t &) const = default;
+  };
+
+  /**
+   * @brief The turn of a session at the encoder, the next session gets it when the turn is destroyed.
+   */
+  class turn_t {
+  public:
+    turn_t() = default;
+    turn_t(turn_t &&other) noexcept;
+    turn_t &
+    operator=(turn_t &&other) noexcept;
+    ~turn_t();
+
+  private:
+    friend class session_t;
+
+    turn_t(session_t *session);
+
+    session_t *session = nullptr;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  /**
+   * @brief A session admitted to an adapter, its share of the adapter is given back when it's destroyed.
+   */
+  class session_t {
+  public:
+    ~session_t();
+
+    /**
+     * @brief Change what the session encodes, such as after the client negotiated a new resolution.
+     * @details A session that is already streaming isn't rejected, a load that doesn't fit is downgraded
+     *          down to the limits.
+     * @param load The load the session asks for, it's set to the load it was granted.
+     * @param resize Whether the resolution may be lowered, only the framerate is while the encoder runs.
+     */
+    void
+    update(load_t &load, bool resize = true);
+
+    /**
+     * @brief Wait for the turn of the session to submit a frame, the sessions of an adapter are served earliest deadline first.
+     * @param deadline When the frame is due at the client.
+     */
+    turn_t
+    turn(std::chrono::steady_clock::time_point deadline);
+
+    /**
+     * @brief The driver refused to open the encoder of the session.
+     * @return Whether other sessions are open on the adapter, their number is its session limit from now on.
+     */
+    bool
+    refused();
+
+  private:
+    friend class turn_t;
+    friend std::unique_ptr<session_t>
+    admit(const std::string &adapter_name, load_t &load);
+
+    session_t(std::shared_ptr<adapter_t> adapter, const load_t &load);
+
+    std::shared_ptr<adapter_t> adapter;
+    load_t load;
+  };
+
+  /**
+   * @brief Admit a session to an adapter.
+   * @details The encoder time of a pixel is learned from the turns of the sessions. A session that
+   *          would take the adapter past `config::video.scheduler.max_utilization` is downgraded, its
+   *          framerate first and then its resolution.
+   * @param adapter_name Sessions with the same name share the adapter.
+   * @param load The load the session asks for, it's set to the load it was granted.
+   * @return nullptr if the adapter is at its session limit or the session doesn't fit at the smallest load.
+   */
+  std::unique_ptr<session_t>
+  admit(const std::string &adapter_name, load_t &load);
+}  // namespace scheduler
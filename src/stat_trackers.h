@@ -4,7 +4,12 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
+#include <cstdint>
 #include <functional>
 #include <limits>
 
@@ -47,4 +52,165 @@ namespace stat_trackers {
     } data;
   };
 
+  /**
+   * @brief Percentiles of the values collected by a `percentile_tracker`.
+   */
+  struct percentiles_t {
+    std::uint64_t count = 0;
+    std::uint64_t min = 0;
+    std::uint64_t max = 0;
+    double avg = 0;
+    std::uint64_t p50 = 0;
+    std::uint64_t p90 = 0;
+    std::uint64_t p99 = 0;
+    std::uint64_t p999 = 0;
+  };
+
+  /**
+   * @brief Log-linear histogram of integer values such as bytes or microseconds, in the style of HdrHistogram.
+   * @details Every power of two is split into `2^SUB_BUCKET_BITS` linear buckets, so percentiles are
+   *          within 1/32 of the real value at any magnitude. Memory is fixed at about 8 kB and
+   *          `record()` is lock-free, values may be recorded from any thread.
+   */
+  class percentile_tracker {
+  public:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr std::size_t SUB_BUCKETS = std::size_t { 1 } << SUB_BUCKET_BITS;
+    static constexpr std::size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    using callback_function = std::function<void(const percentiles_t &percentiles)>;
+
+    percentile_tracker() = default;
+
+    // Copies are a snapshot, values recorded into the original while copying may be missed
+    percentile_tracker(const percentile_tracker &other) {
+      *this = other;
+    }
+
+    percentile_tracker &
+    operator=(const percentile_tracker &other) {
+      for (std::size_t x = 0; x < BUCKETS; ++x) {
+        buckets[x].store(other.buckets[x].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      }
+      total.store(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      calls.store(other.calls.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      stat_min.store(other.stat_min.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      stat_max.store(other.stat_max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      last_callback_time.store(other.last_callback_time.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+      return *this;
+    }
+
+    void
+    record(std::uint64_t value) {
+      buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+      total.fetch_add(value, std::memory_order_relaxed);
+      calls.fetch_add(1, std::memory_order_relaxed);
+
+      auto current_min = stat_min.load(std::memory_order_relaxed);
+      while (value < current_min && !stat_min.compare_exchange_weak(current_min, value, std::memory_order_relaxed)) {}
+
+      auto current_max = stat_max.load(std::memory_order_relaxed);
+      while (value > current_max && !stat_max.compare_exchange_weak(current_max, value, std::memory_order_relaxed)) {}
+    }
+
+    /**
+     * @brief Record a value, the thread that finds the interval elapsed calls back with the percentiles and starts over.
+     */
+    void
+    collect_and_callback_on_interval(std::uint64_t value, const callback_function &callback, std::chrono::seconds interval_in_seconds) {
+      auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+      auto last = last_callback_time.load(std::memory_order_relaxed);
+      if (now > last + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval_in_seconds).count() &&
+          last_callback_time.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+        callback(percentiles());
+        reset();
+      }
+
+      record(value);
+    }
+
+    /**
+     * @brief Percentiles of the values recorded since the last reset.
+     * @details Values recorded while this runs may or may not be included.
+     */
+    percentiles_t
+    percentiles() const {
+      percentiles_t result;
+      result.count = calls.load(std::memory_order_relaxed);
+      if (!result.count) {
+        return result;
+      }
+
+      result.min = stat_min.load(std::memory_order_relaxed);
+      result.max = stat_max.load(std::memory_order_relaxed);
+      result.avg = (double) total.load(std::memory_order_relaxed) / result.count;
+
+      std::array<std::uint64_t *, 4> targets { &result.p50, &result.p90, &result.p99, &result.p999 };
+      std::array<double, 4> fractions { 0.5, 0.9, 0.99, 0.999 };
+
+      std::size_t target = 0;
+      std::uint64_t seen = 0;
+      for (std::size_t x = 0; x < BUCKETS && target < targets.size(); ++x) {
+        seen += buckets[x].load(std::memory_order_relaxed);
+        while (target < targets.size() && seen > (std::uint64_t) (fractions[target] * result.count)) {
+          *targets[target++] = std::clamp(highest_equivalent_value(x), result.min, result.max);
+        }
+      }
+
+      // Buckets recorded after the count was read
+      while (target < targets.size()) {
+        *targets[target++] = result.max;
+      }
+
+      return result;
+    }
+
+    void
+    reset() {
+      for (auto &bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      total.store(0, std::memory_order_relaxed);
+      calls.store(0, std::memory_order_relaxed);
+      stat_min.store(std::numeric_limits<std::uint64_t>::max(), std::memory_order_relaxed);
+      stat_max.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    static std::size_t
+    bucket_index(std::uint64_t value) {
+      if (value < SUB_BUCKETS) {
+        return (std::size_t) value;
+      }
+
+      // The bits below the leading one select the linear bucket within its power of two
+      int magnitude = std::bit_width(value) - 1;
+      auto sub_bucket = (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+
+      return SUB_BUCKETS + (magnitude - SUB_BUCKET_BITS) * SUB_BUCKETS + (std::size_t) sub_bucket;
+    }
+
+    static std::uint64_t
+    highest_equivalent_value(std::size_t index) {
+      if (index < SUB_BUCKETS) {
+        return index;
+      }
+
+      int magnitude = (int) ((index - SUB_BUCKETS) / SUB_BUCKETS) + SUB_BUCKET_BITS;
+      auto sub_bucket = (std::uint64_t) ((index - SUB_BUCKETS) % SUB_BUCKETS);
+      auto shift = magnitude - SUB_BUCKET_BITS;
+
+      auto lowest = (std::uint64_t { 1 } << magnitude) | (sub_bucket << shift);
+      return lowest + ((std::uint64_t { 1 } << shift) - 1);
+    }
+
+    std::array<std::atomic<std::uint32_t>, BUCKETS> buckets {};
+    std::atomic<std::uint64_t> total = 0;
+    std::atomic<std::uint64_t> calls = 0;
+    std::atomic<std::uint64_t> stat_min = std::numeric_limits<std::uint64_t>::max();
+    std::atomic<std::uint64_t> stat_max = 0;
+    std::atomic<std::chrono::steady_clock::rep> last_callback_time = std::chrono::steady_clock::now().time_since_epoch().count();
+  };
+
 }  // namespace stat_trackers
@@ -0,0 +1,661 @@
+/**
+ * @file src/stream.cpp
+ * @brief Packetization of encoded frames into datagrams for the UDP transport.
+ */
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#include "config.h"
+#include "logging.h"
+#include "stream.h"
+#include "utility.h"
+
+namespace stream {
+  using namespace std::literals;
+
+  std::uint64_t
+  wall_clock_us(std::chrono::steady_clock::time_point time_point) {
+    static const auto offset = std::chrono::system_clock::now().time_since_epoch() - std::chrono::steady_clock::now().time_since_epoch();
+
+    return (std::uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(time_point.time_since_epoch() + offset).count();
+  }
+
+  std::size_t
+  max_datagram_size(int mtu, bool ipv6) {
+    auto overhead = ipv6 ? IPV6_UDP_OVERHEAD : IPV4_UDP_OVERHEAD;
+
+    // Anything below the IPv6 minimum MTU is almost certainly a misconfiguration
+    if (mtu < 1280) {
+      BOOST_LOG(warning) << "MTU "sv << mtu << " is too small, using 1280"sv;
+      mtu = 1280;
+    }
+
+    return mtu - overhead;
+  }
+
+  namespace {
+    /**
+     * @brief Reuse the encoder as long as the shape of the FEC block does not change.
+     */
+    const fec::rs_t &
+    rs_for(std::optional<fec::rs_t> &rs, std::size_t data_shards, std::size_t parity_shards) {
+      if (!rs || rs->data_shards() != data_shards || rs->parity_shards() != parity_shards) {
+        rs.emplace(data_shards, parity_shards);
+      }
+
+      return *rs;
+    }
+
+    /**
+     * @brief Microseconds from the capture to a later point of the packet, 0 when the point wasn't reached.
+     */
+    std::uint32_t
+    time_since_capture(std::chrono::steady_clock::time_point capture_time, std::chrono::steady_clock::time_point time_point) {
+      if (time_point == std::chrono::steady_clock::time_point {} || time_point < capture_time) {
+        return 0;
+      }
+
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(time_point - capture_time).count();
+      return (std::uint32_t) std::min<std::int64_t>(elapsed, std::numeric_limits<std::uint32_t>::max());
+    }
+  }  // namespace
+
+  std::size_t
+  send_shards(platf::batched_send_info_t &batch) {
+    auto sent = platf::send_batch(batch);
+    if (sent >= batch.block_count) {
+      return 0;
+    }
+
+    // Batched sends may be unsupported by the OS or stop short, the rest is sent one shard at a time
+    auto send_info = batch.slice(sent, batch.block_count - sent);
+    std::size_t failed = 0;
+    std::vector<char> bounce;
+    for (std::size_t x = 0; x < send_info.block_count; ++x) {
+      auto header = send_info.header_for_block(x);
+
+      // platf::send() takes a single payload buffer, shards that span several are gathered first
+      platf::buffer_descriptor_t payload {};
+      std::size_t segments = 0;
+      bounce.clear();
+      send_info.for_each_payload_segment(x, [&](const platf::buffer_descriptor_t &segment) {
+        if (segments++ == 1) {
+          bounce.insert(std::end(bounce), payload.buffer, payload.buffer + payload.size);
+        }
+        if (segments > 1) {
+          bounce.insert(std::end(bounce), segment.buffer, segment.buffer + segment.size);
+        }
+
+        payload = segment;
+      });
+      if (segments > 1) {
+        payload = { bounce.data(), bounce.size() };
+      }
+
+      platf::send_info_t shard_info {
+        payload.buffer, payload.size,
+        send_info.native_socket,
+        send_info.target_address, send_info.target_port, send_info.source_address,
+        header.buffer, header.size,
+        send_info.txtime
+      };
+
+      if (!platf::send(shard_info)) {
+        ++failed;
+      }
+    }
+
+    return failed;
+  }
+
+  std::size_t
+  splice(video::packet_raw_t &packet, std::vector<platf::buffer_descriptor_t> &segments) {
+    std::string_view payload { (const char *) packet.data(), packet.data_size() };
+
+    segments.clear();
+
+    // Parameter sets are only sent with IDR frames, other frames are sent as they are
+    if (packet.is_idr() && packet.replacements) {
+      for (auto &replacement : *packet.replacements) {
+        auto pos = payload.find(replacement.old);
+        if (pos == std::string_view::npos) {
+          continue;
+        }
+
+        segments.push_back({ payload.data(), pos });
+        segments.push_back({ replacement._new.data(), replacement._new.size() });
+        payload.remove_prefix(pos + replacement.old.size());
+      }
+    }
+
+    segments.push_back({ payload.data(), payload.size() });
+
+    std::size_t frame_size = 0;
+    for (auto &segment : segments) {
+      frame_size += segment.size;
+    }
+
+    return frame_size;
+  }
+
+  video_packetizer_t::video_packetizer_t(std::size_t datagram_size, std::unique_ptr<cipher::gcm_t> gcm):
+      datagram_size { datagram_size }, shard_payload_size { datagram_size - sizeof(video_shard_header_t) - (gcm ? cipher::OVERHEAD : 0) },
+      percentage { std::max(0, config::stream.fec_percentage) }, gcm { std::move(gcm) } {}
+
+  void
+  video_packetizer_t::fec_percentage(int percentage) {
+    this->percentage = std::max(0, percentage);
+  }
+
+  void
+  video_packetizer_t::packetize(video::packet_raw_t &packet, std::uint32_t frame_index) {
+    frame_size = splice(packet, segments);
+
+    data_shards = std::max<std::size_t>(1, (frame_size + shard_payload_size - 1) / shard_payload_size);
+    parity_shard_count = 0;
+
+    std::size_t data_per_block = 0;
+    std::size_t parity_per_block = 0;
+    std::size_t blocks = 0;
+    if (percentage > 0) {
+      // Spread the data shards evenly over the smallest number of blocks that fit in the field
+      auto max_data = std::max<std::size_t>(1, fec::MAX_SHARDS * 100 / (100 + percentage));
+
+      blocks = (data_shards + max_data - 1) / max_data;
+      data_per_block = (data_shards + blocks - 1) / blocks;
+      parity_per_block = fec::parity_shards_for(data_per_block, percentage);
+      parity_shard_count = blocks * parity_per_block;
+    }
+
+    if (data_shards + parity_shard_count > std::numeric_limits<std::uint16_t>::max()) {
+      BOOST_LOG(error) << "Frame "sv << frame_index << " is too large to packetize: "sv << frame_size << " bytes"sv;
+      data_shards = 0;
+      parity_shard_count = 0;
+      return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto capture_time = packet.frame_timestamp.value_or(now);
+
+    video_shard_header_t header {};
+    header.version = HEADER_VERSION;
+    header.capture_time = util::endian::little(wall_clock_us(capture_time));
+    header.encode_time = util::endian::little(time_since_capture(capture_time, packet.timing.encode_complete));
+    header.send_time = util::endian::little(time_since_capture(capture_time, now));
+    header.frame_index = util::endian::little(frame_index);
+    header.frame_size = util::endian::little((std::uint32_t) frame_size);
+    header.shard_count = util::endian::little((std::uint16_t) data_shards);
+    header.flags = (packet.is_idr() ? flag::IDR : 0) |
+                   (packet.after_ref_frame_invalidation ? flag::AFTER_REF_FRAME_INVALIDATION : 0) |
+                   (packet.end_of_frame ? 0 : flag::MORE_SLICES) |
+                   (gcm ? flag::ENCRYPTED : 0);
+    header.fec_data_shards = (std::uint8_t) data_per_block;
+    header.fec_parity_shards = (std::uint8_t) parity_per_block;
+    header.slice_index = (std::uint8_t) packet.slice_index;
+    header.temporal_layer = packet.temporal_layer;
+
+    shard_headers.resize(data_shards * sizeof(header));
+    for (std::size_t x = 0; x < data_shards; ++x) {
+      header.shard_index = util::endian::little((std::uint16_t) x);
+      std::memcpy(&shard_headers[x * sizeof(header)], &header, sizeof(header));
+    }
+
+    if (gcm) {
+      // Shards only differ in their size from the plaintext, the batch keeps its stride and the short last shard
+      ciphertext.resize(frame_size + data_shards * cipher::OVERHEAD);
+      ciphertext_segment = { ciphertext.data(), ciphertext.size() };
+
+      auto segment = std::begin(segments);
+      std::size_t segment_offset = 0;
+      for (std::size_t x = 0; x < data_shards; ++x) {
+        auto remaining = std::min(shard_payload_size, frame_size - x * shard_payload_size);
+
+        shard_segments.clear();
+        while (remaining) {
+          auto size = std::min(remaining, segment->size - segment_offset);
+          if (size) {
+            shard_segments.push_back({ segment->buffer + segment_offset, size });
+          }
+
+          remaining -= size;
+          segment_offset += size;
+          if (segment_offset == segment->size) {
+            ++segment;
+            segment_offset = 0;
+          }
+        }
+
+        std::string_view aad { &shard_headers[x * sizeof(header)], sizeof(header) };
+        if (!gcm->encrypt(aad, shard_segments.data(), shard_segments.size(), &ciphertext[x * (shard_payload_size + cipher::OVERHEAD)])) {
+          BOOST_LOG(error) << "Couldn't encrypt frame "sv << frame_index;
+          data_shards = 0;
+          parity_shard_count = 0;
+          return;
+        }
+      }
+    }
+
+    if (!parity_shard_count) {
+      return;
+    }
+
+    // Shards that are short or span several segments need a contiguous, zero padded copy
+    std::vector<const std::uint8_t *> shard_ptrs(data_shards);
+    std::size_t offset = 0;
+    std::size_t copies = 0;
+    for (auto &segment : segments) {
+      for (auto x = offset / shard_payload_size; x * shard_payload_size < offset + segment.size; ++x) {
+        auto begin = x * shard_payload_size;
+        if (begin >= offset && begin + shard_payload_size <= offset + segment.size) {
+          shard_ptrs[x] = (const std::uint8_t *) segment.buffer + (begin - offset);
+        }
+      }
+
+      offset += segment.size;
+    }
+    for (auto ptr : shard_ptrs) {
+      copies += !ptr;
+    }
+
+    bounce_shards.assign(copies * shard_payload_size, 0);
+
+    for (std::size_t x = 0, copy = 0; x < data_shards; ++x) {
+      if (shard_ptrs[x]) {
+        continue;
+      }
+
+      auto out = &bounce_shards[copy++ * shard_payload_size];
+      shard_ptrs[x] = out;
+
+      auto begin = x * shard_payload_size;
+      auto end = std::min(begin + shard_payload_size, frame_size);
+
+      std::size_t segment_begin = 0;
+      for (auto &segment : segments) {
+        auto segment_end = segment_begin + segment.size;
+
+        if (segment_begin < end && segment_end > begin) {
+          auto from = std::max(begin, segment_begin);
+          auto to = std::min(end, segment_end);
+
+          std::memcpy(out + (from - begin), segment.buffer + (from - segment_begin), to - from);
+        }
+
+        segment_begin = segment_end;
+      }
+    }
+
+    // The last block may be short, the missing data shards are treated as zeroes
+    zero_shard.resize(shard_payload_size);
+
+    parity_shards.resize(parity_shard_count * datagram_size);
+
+    auto &encoder = rs_for(rs, data_per_block, parity_per_block);
+
+    std::vector<const std::uint8_t *> data_ptrs(data_per_block);
+    std::vector<std::uint8_t *> parity_ptrs(parity_per_block);
+    for (std::size_t block = 0; block < blocks; ++block) {
+      for (std::size_t x = 0; x < data_per_block; ++x) {
+        auto index = block * data_per_block + x;
+
+        data_ptrs[x] = index < data_shards ? shard_ptrs[index] : zero_shard.data();
+      }
+
+      for (std::size_t x = 0; x < parity_per_block; ++x) {
+        auto index = block * parity_per_block + x;
+        auto shard = &parity_shards[index * datagram_size];
+
+        header.shard_index = util::endian::little((std::uint16_t) (data_shards + index));
+        std::memcpy(shard, &header, sizeof(header));
+
+        // Room is left for the IV in front of the parity when it's encrypted
+        parity_ptrs[x] = (std::uint8_t *) shard + sizeof(header) + (gcm ? cipher::IV_SIZE : 0);
+      }
+
+      encoder.encode(data_ptrs.data(), parity_ptrs.data(), shard_payload_size);
+    }
+
+    if (!gcm) {
+      return;
+    }
+
+    for (std::size_t x = 0; x < parity_shard_count; ++x) {
+      auto shard = &parity_shards[x * datagram_size];
+
+      platf::buffer_descriptor_t parity { shard + sizeof(header) + cipher::IV_SIZE, shard_payload_size };
+      if (!gcm->encrypt({ shard, sizeof(header) }, &parity, 1, shard + sizeof(header))) {
+        BOOST_LOG(error) << "Couldn't encrypt the parity of frame "sv << frame_index;
+        parity_shard_count = 0;
+        return;
+      }
+    }
+  }
+
+  audio_packetizer_t::audio_packetizer_t(std::size_t block_size, std::unique_ptr<cipher::gcm_t> gcm):
+      block_size { std::clamp<std::size_t>(block_size, 1, fec::MAX_SHARDS - 1) },
+      percentage { std::max(0, config::stream.fec_percentage) },
+      block_percentage { percentage },
+      gcm { std::move(gcm) },
+      block(this->block_size) {}
+
+  void
+  audio_packetizer_t::fec_percentage(int percentage) {
+    this->percentage = std::max(0, percentage);
+  }
+
+  std::string_view
+  audio_packetizer_t::packetize(std::string_view data, std::uint32_t frame_index, std::chrono::steady_clock::time_point capture_time) {
+    parity_count = 0;
+
+    // The parity shards also carry the payload size, it has to fit in the same 16 bits
+    if (data.size() > std::numeric_limits<std::uint16_t>::max() - sizeof(std::uint16_t)) {
+      BOOST_LOG(error) << "Audio packet "sv << frame_index << " is too large to packetize: "sv << data.size() << " bytes"sv;
+      return {};
+    }
+
+    // The parity overhead can only change between blocks
+    if (!block_fill) {
+      block_start = frame_index;
+      block_percentage = percentage;
+    }
+
+    auto parity_shards = fec::parity_shards_for(block_size, block_percentage);
+
+    header = {};
+    header.version = HEADER_VERSION;
+    header.capture_time = util::endian::little(wall_clock_us(capture_time));
+    header.send_time = util::endian::little(time_since_capture(capture_time, std::chrono::steady_clock::now()));
+    header.frame_index = util::endian::little(frame_index);
+    header.payload_size = util::endian::little((std::uint16_t) data.size());
+    header.fec_index = (std::uint8_t) (parity_shards ? block_fill : 0);
+    header.fec_data_shards = (std::uint8_t) block_size;
+    header.fec_parity_shards = (std::uint8_t) parity_shards;
+    header.flags = gcm ? flag::ENCRYPTED : 0;
+
+    if (!block_fill) {
+      block_capture_time = header.capture_time;
+      block_send_time = header.send_time;
+    }
+
+    std::string_view header_view { (const char *) &header, sizeof(header) };
+    sent_payload = data;
+    if (gcm) {
+      ciphertext.resize(data.size() + cipher::OVERHEAD);
+
+      platf::buffer_descriptor_t plaintext { data.data(), data.size() };
+      if (!gcm->encrypt(header_view, &plaintext, 1, ciphertext.data())) {
+        BOOST_LOG(error) << "Couldn't encrypt audio packet "sv << frame_index;
+        return {};
+      }
+      sent_payload = { ciphertext.data(), ciphertext.size() };
+    }
+
+    if (!parity_shards) {
+      return header_view;
+    }
+
+    auto &shard = block[block_fill++];
+    auto payload_size = util::endian::little((std::uint16_t) data.size());
+    shard.resize(sizeof(payload_size) + data.size());
+    std::memcpy(shard.data(), &payload_size, sizeof(payload_size));
+    std::memcpy(shard.data() + sizeof(payload_size), data.data(), data.size());
+
+    if (block_fill < block_size) {
+      return header_view;
+    }
+
+    // Pad all shards of the block to the largest one
+    std::size_t shard_size = 0;
+    for (auto &x : block) {
+      shard_size = std::max(shard_size, x.size());
+    }
+
+    std::vector<const std::uint8_t *> data_ptrs;
+    for (auto &x : block) {
+      x.resize(shard_size);
+      data_ptrs.emplace_back(x.data());
+    }
+
+    parity_size = sizeof(audio_shard_header_t) + shard_size + (gcm ? cipher::OVERHEAD : 0);
+    parity_count = parity_shards;
+    parity.resize(parity_count * parity_size);
+
+    auto parity_header = header;
+    parity_header.frame_index = util::endian::little(block_start);
+    parity_header.capture_time = block_capture_time;
+    parity_header.send_time = block_send_time;
+    parity_header.payload_size = util::endian::little((std::uint16_t) shard_size);
+
+    std::vector<std::uint8_t *> parity_ptrs;
+    for (std::size_t x = 0; x < parity_count; ++x) {
+      auto out = &parity[x * parity_size];
+
+      parity_header.fec_index = (std::uint8_t) (block_size + x);
+      std::memcpy(out, &parity_header, sizeof(parity_header));
+
+      parity_ptrs.emplace_back((std::uint8_t *) out + sizeof(header) + (gcm ? cipher::IV_SIZE : 0));
+    }
+
+    rs_for(rs, block_size, parity_count).encode(data_ptrs.data(), parity_ptrs.data(), shard_size);
+    block_fill = 0;
+
+    for (std::size_t x = 0; gcm && x < parity_count; ++x) {
+      auto out = &parity[x * parity_size];
+
+      // Encrypted in place, the IV goes in front of the parity and the tag behind it
+      platf::buffer_descriptor_t plaintext { out + sizeof(header) + cipher::IV_SIZE, shard_size };
+      if (!gcm->encrypt({ out, sizeof(header) }, &plaintext, 1, out + sizeof(header))) {
+        BOOST_LOG(error) << "Couldn't encrypt the parity of audio packet "sv << frame_index;
+        parity_count = 0;
+        break;
+      }
+    }
+
+    return header_view;
+  }
+
+  retransmit_cache_t::retransmit_cache_t(std::chrono::milliseconds window, std::chrono::milliseconds playout_delay):
+      window { window }, playout_delay { playout_delay } {}
+
+  void
+  retransmit_cache_t::insert(std::uint32_t frame_index, video::packet_t &&packet, const video_packetizer_t &packetizer, const platf::batched_send_info_t &send_info) {
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard lg { mutex };
+
+    // The buffers of the oldest expired frame are reused for the new one
+    std::optional<frame_t> frame;
+    while (!frames.empty() && now - frames.front().sent > window) {
+      frame = std::move(frames.front());
+      frames.pop_front();
+    }
+    if (!frame) {
+      frame.emplace();
+    }
+
+    frame->frame_index = frame_index;
+    frame->slice_index = packet->slice_index;
+    frame->capture_time = packet->frame_timestamp.value_or(now);
+    frame->sent = now;
+
+    auto header_size = packetizer.shard_count() * sizeof(video_shard_header_t);
+    frame->headers.assign(packetizer.headers(), packetizer.headers() + header_size);
+    if (packetizer.encrypted()) {
+      // Resent as they were sent, a shard is never encrypted twice
+      auto ciphertext = packetizer.payload_buffers()->buffer;
+      frame->payload.assign(ciphertext, ciphertext + packetizer.payload_size());
+      frame->segments.assign(1, { frame->payload.data(), frame->payload.size() });
+    }
+    else if (packet->is_idr() && packet->replacements) {
+      // Some segments point into the replacements of the encode session, a rebuilt session frees them
+      frame->payload.clear();
+      std::for_each_n(packetizer.payload_buffers(), packetizer.payload_buffer_count(), [&](const platf::buffer_descriptor_t &segment) {
+        frame->payload.insert(std::end(frame->payload), segment.buffer, segment.buffer + segment.size);
+      });
+      frame->segments.assign(1, { frame->payload.data(), frame->payload.size() });
+    }
+    else {
+      frame->segments.assign(packetizer.payload_buffers(), packetizer.payload_buffers() + packetizer.payload_buffer_count());
+    }
+    frame->payload_size = packetizer.payload_size();
+    frame->data_shards = packetizer.shard_count();
+    frame->block_size = packetizer.block_size();
+    frame->parity.assign(packetizer.parity(), packetizer.parity() + packetizer.parity_count() * packetizer.block_size());
+    frame->parity_count = packetizer.parity_count();
+
+    frame->native_socket = send_info.native_socket;
+    frame->target_address = send_info.target_address;
+    frame->target_port = send_info.target_port;
+    frame->source_address = send_info.source_address;
+
+    // The segments point into the packet, it only goes away with the frame
+    frame->packet = std::move(packet);
+    frames.emplace_back(std::move(*frame));
+  }
+
+  retransmit_cache_t::result_e
+  retransmit_cache_t::resend(std::uint32_t frame_index, std::uint16_t slice_index, std::uint16_t first_shard, std::uint16_t last_shard,
+    const std::optional<boost::asio::ip::udp::endpoint> &target) {
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard lg { mutex };
+
+    auto frame = std::find_if(std::rbegin(frames), std::rend(frames), [&](const frame_t &entry) {
+      return entry.frame_index == frame_index && entry.slice_index == slice_index;
+    });
+    if (frame == std::rend(frames) || now - frame->sent > window) {
+      return result_e::unknown;
+    }
+
+    // The NACK took at least a round trip since the send, half of that is what the resend takes
+    if (now + (now - frame->sent) / 2 > frame->capture_time + playout_delay) {
+      return result_e::late;
+    }
+
+    auto target_address = target ? target->address() : frame->target_address;
+    auto target_port = target ? target->port() : frame->target_port;
+
+    auto shard_count = frame->data_shards + frame->parity_count;
+    std::size_t first = std::min<std::size_t>(first_shard, shard_count);
+    std::size_t last = std::min<std::size_t>(last_shard + 1, shard_count);
+
+    if (first < std::min(last, frame->data_shards)) {
+      platf::batched_send_info_t data {
+        nullptr, frame->block_size, frame->data_shards,
+        frame->native_socket,
+        target_address, target_port, frame->source_address,
+        frame->headers.data(), sizeof(video_shard_header_t), frame->payload_size,
+        frame->segments.data(), frame->segments.size()
+      };
+
+      auto resent = data.slice(first, std::min(last, frame->data_shards) - first);
+      send_shards(resent);
+    }
+
+    auto first_parity = std::max(first, frame->data_shards);
+    if (first_parity < last) {
+      platf::batched_send_info_t parity {
+        frame->parity.data(), frame->block_size, frame->parity_count,
+        frame->native_socket,
+        target_address, target_port, frame->source_address
+      };
+
+      auto resent = parity.slice(first_parity - frame->data_shards, last - first_parity);
+      send_shards(resent);
+    }
+
+    return result_e::sent;
+  }
+
+  pacer_t::pacer_t(int percentage, std::size_t burst_size, bool kernel_pacing):
+      percentage { std::clamp(percentage, 0, 100) }, burst_size { std::max<std::size_t>(1, burst_size) }, kernel_pacing { kernel_pacing } {
+    if (this->percentage && !kernel_pacing) {
+      timer = platf::create_high_precision_timer();
+    }
+  }
+
+  std::size_t
+  pacer_t::send(std::vector<platf::batched_send_info_t> &batches, std::chrono::nanoseconds frame_interval) {
+    std::size_t failed = 0;
+    if (!percentage) {
+      for (auto &send_info : batches) {
+        failed += send_shards(send_info);
+      }
+      return failed;
+    }
+
+    // Anything slower than 10 fps is a stall rather than the frame rate
+    frame_interval = std::min<std::chrono::nanoseconds>(frame_interval, 100ms);
+    this->frame_interval = this->frame_interval.count() ? (this->frame_interval * 7 + frame_interval) / 8 : frame_interval;
+
+    std::size_t frame_bytes = 0;
+    std::size_t max_block_size = 0;
+    for (auto &send_info : batches) {
+      frame_bytes += send_info.block_count * send_info.block_size;
+      max_block_size = std::max(max_block_size, send_info.block_size);
+    }
+
+    auto window = this->frame_interval * percentage / 100;
+    auto capacity = (double) (burst_size * max_block_size);
+    auto rate = (double) frame_bytes / std::max<std::int64_t>(1, window.count());
+
+    auto start = std::chrono::steady_clock::now();
+
+    // With kernel pacing, the departures of the previous frame may still be ahead
+    auto now = kernel_pacing ? std::max(start, last_refill) : start;
+
+    for (auto &send_info : batches) {
+      std::size_t blocks_sent = 0;
+      while (blocks_sent < send_info.block_count) {
+        tokens = std::min(capacity, tokens + rate * std::chrono::nanoseconds { now - last_refill }.count());
+        last_refill = now;
+
+        auto burst = std::min(burst_size, send_info.block_count - blocks_sent);
+        auto burst_bytes = (double) (burst * send_info.block_size);
+        if (tokens < burst_bytes) {
+          std::chrono::nanoseconds delay { (std::int64_t) ((burst_bytes - tokens) / rate) };
+
+          // The burst leaves once the bucket has refilled, the qdisc waits instead of the thread
+          if (kernel_pacing) {
+            now += std::max<std::chrono::nanoseconds>(1ns, delay);
+            continue;
+          }
+
+          if (timer && *timer) {
+            timer->sleep_for(delay);
+          }
+          else {
+            std::this_thread::sleep_for(delay);
+          }
+
+          now = std::chrono::steady_clock::now();
+          continue;
+        }
+
+        auto burst_info = send_info.slice(blocks_sent, burst);
+        if (kernel_pacing) {
+          burst_info.txtime = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        }
+        failed += send_shards(burst_info);
+
+        tokens -= burst_bytes;
+        blocks_sent += burst;
+        if (!kernel_pacing) {
+          now = std::chrono::steady_clock::now();
+        }
+      }
+    }
+
+    // Print queue delay stats to debug log every 20 seconds
+    auto callback = [&](double stat_min, double stat_max, double stat_avg) {
+      auto f = stat_trackers::one_digit_after_decimal();
+      BOOST_LOG(debug) << "Pacer: queue delay (min max avg) " << f % stat_min << " " << f % stat_max << " " << f % stat_avg << " ms";
+    };
+    std::chrono::duration<double, std::milli> queue_delay = now - start;
+    queue_delay_tracker.collect_and_callback_on_interval(queue_delay.count(), callback, 20s);
+
+    return failed;
+  }
+}  // namespace stream
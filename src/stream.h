@@ -0,0 +1,447 @@
+/**
+ * @file src/stream.h
+ * @brief Packetization of encoded frames into datagrams for the UDP transport.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "cipher.h"
+#include "fec.h"
+#include "platform/common.h"
+#include "stat_trackers.h"
+#include "video.h"
+
+namespace stream {
+  // IPv4 and IPv6 headers plus the UDP header
+  constexpr std::size_t IPV4_UDP_OVERHEAD = 20 + 8;
+  constexpr std::size_t IPV6_UDP_OVERHEAD = 40 + 8;
+
+  // Bumped whenever the layout of the datagram headers changes
+  constexpr std::uint8_t HEADER_VERSION = 2;
+
+  namespace flag {
+    constexpr std::uint8_t IDR = 0x01;  ///< The frame is an IDR frame
+    constexpr std::uint8_t AFTER_REF_FRAME_INVALIDATION = 0x02;  ///< First frame after a reference frame invalidation
+    constexpr std::uint8_t MORE_SLICES = 0x04;  ///< More slices of the frame follow with the same frame index
+    constexpr std::uint8_t ENCRYPTED = 0x08;  ///< The payload is encrypted, the only flag of audio
+  }  // namespace flag
+
+#pragma pack(push, 1)
+  /**
+   * @brief Header in front of every video datagram. All fields are little-endian.
+   * @details Timestamps are microseconds since the Unix epoch on the clock of the sender,
+   *          the encode and send times are microseconds after the capture.
+   *
+   *          Datagrams flagged `flag::ENCRYPTED` carry the IV, the AES-GCM ciphertext of the payload and the
+   *          tag behind the header, with the header as additional authenticated data. Parity is computed
+   *          over the plaintext, so shards recovered by FEC need no decryption.
+   */
+  struct video_shard_header_t {
+    std::uint8_t version;  // HEADER_VERSION
+    std::uint8_t flags;
+    std::uint8_t slice_index;  // Part of a frame sent in slices, slices are decoded in order
+    std::uint8_t fec_data_shards;  // Data shards per FEC block, the last block may be shorter
+    std::uint8_t fec_parity_shards;  // Parity shards per FEC block, 0 when FEC is disabled
+    std::uint8_t temporal_layer;  // 0 is the base layer, a frame of a higher layer that never arrives breaks no later frame
+    std::uint8_t reserved[2];
+    std::uint64_t capture_time;
+    std::uint32_t frame_index;
+    std::uint32_t frame_size;  // Size of the whole encoded frame or of the slices of this part, the last shard is padded
+    std::uint32_t encode_time;  // The encoder returned the frame, 0 when unknown
+    std::uint32_t send_time;  // The frame was handed to the pacer
+    std::uint16_t shard_index;
+    std::uint16_t shard_count;
+  };
+
+  /**
+   * @brief Header in front of every audio datagram. All fields are little-endian.
+   * @details Parity datagrams carry the frame index and the times of the first packet in their FEC
+   *          block. The parity covers the little-endian payload size followed by the payload,
+   *          so the size of a recovered packet is known as well.
+   *
+   *          The capture time of audio is when its first sample was recorded, on the clock of the video
+   *          frames, so the streams can be aligned. encode_time is 0.
+   *
+   *          Encrypted datagrams are laid out as those of the video.
+   */
+  struct audio_shard_header_t {
+    std::uint8_t version;  // HEADER_VERSION
+    std::uint8_t fec_index;  // Position within the FEC block, parity shards start at fec_data_shards
+    std::uint8_t fec_data_shards;
+    std::uint8_t fec_parity_shards;  // 0 when FEC is disabled
+    std::uint16_t payload_size;  // Of the plaintext
+    std::uint8_t flags;
+    std::uint8_t reserved;
+    std::uint64_t capture_time;
+    std::uint32_t frame_index;
+    std::uint32_t encode_time;
+    std::uint32_t send_time;
+  };
+#pragma pack(pop)
+
+  /**
+   * @brief Microseconds since the Unix epoch of a steady_clock time point.
+   * @details The offset between the clocks is taken once, so timestamps of a stream never jump
+   *          when the system clock is adjusted.
+   */
+  std::uint64_t
+  wall_clock_us(std::chrono::steady_clock::time_point time_point);
+
+  /**
+   * @brief Largest datagram that fits in the path MTU without IP fragmentation.
+   * @param mtu The path MTU.
+   * @param ipv6 Whether the traffic is IPv6.
+   */
+  std::size_t
+  max_datagram_size(int mtu, bool ipv6);
+
+  /**
+   * @brief Send a batch of shards, one shard at a time where batched sends are unsupported or stopped short.
+   * @param send_info The shards to send.
+   * @return The number of shards that couldn't be sent, 0 on success.
+   */
+  std::size_t
+  send_shards(platf::batched_send_info_t &send_info);
+
+  /**
+   * @brief Split an encoded frame into segments, applying the SPS/VPS replacements of IDR frames.
+   * @details The segments point into the frame and into the replacements.
+   * @param packet The encoded frame.
+   * @param segments The segments, they are overwritten.
+   * @return The size of the frame after the replacements.
+   */
+  std::size_t
+  splice(video::packet_raw_t &packet, std::vector<platf::buffer_descriptor_t> &segments);
+
+  /**
+   * @brief Splits encoded video frames into equally sized shards.
+   * @details Every shard is prefixed with a `video_shard_header_t`. The headers are kept in a
+   *          buffer of their own and the payload is sent straight from the encoded frame, so the
+   *          whole frame can be handed to `platf::send_batch()` as a single GSO/USO batch without
+   *          copying it. The last shard may be shorter than the others.
+   *
+   *          When FEC is enabled, the data shards are grouped into blocks of at most
+   *          `fec::MAX_SHARDS` shards including parity, and the parity shards of every block
+   *          follow the data shards with `shard_index >= shard_count`. The last data shard is
+   *          treated as zero padded to the full size when computing parity.
+   *
+   *          Frames encoded in slices are packetized one part at a time, every part but the last
+   *          is flagged `flag::MORE_SLICES`.
+   *
+   *          With a cipher, every shard is encrypted as a message of its own, so a lost datagram doesn't
+   *          take the others with it. The whole frame is encrypted in one pass into a buffer that is reused
+   *          for every frame and sent from there, parity shards are encrypted in place.
+   */
+  class video_packetizer_t {
+  public:
+    /**
+     * @param datagram_size Largest datagram including the header.
+     * @param gcm Encrypts the shards, nullptr sends them in the clear.
+     */
+    explicit video_packetizer_t(std::size_t datagram_size, std::unique_ptr<cipher::gcm_t> gcm = nullptr);
+
+    /**
+     * @brief Packetize a frame.
+     * @param packet The encoded frame, it must outlive the send of the data shards.
+     * @param frame_index The transport frame index.
+     */
+    void
+    packetize(video::packet_raw_t &packet, std::uint32_t frame_index);
+
+    /**
+     * @brief Change the parity overhead, takes effect from the next frame.
+     * @param percentage Parity shards in percent of the data shards, 0 disables FEC.
+     */
+    void
+    fec_percentage(int percentage);
+
+    std::size_t
+    block_size() const {
+      return datagram_size;
+    }
+
+    /**
+     * @brief Headers of the data shards, `sizeof(video_shard_header_t)` bytes each.
+     */
+    const char *
+    headers() const {
+      return shard_headers.data();
+    }
+
+    /**
+     * @brief Payload of the data shards, the buffers point into the encoded frame.
+     * @details IDR frames with SPS/VPS replacements are split around the old parameter sets
+     *          and the new ones are spliced in as buffers of their own. Encrypted shards are a single
+     *          buffer of the packetizer, valid until the next frame.
+     */
+    const platf::buffer_descriptor_t *
+    payload_buffers() const {
+      return gcm ? &ciphertext_segment : segments.data();
+    }
+
+    std::size_t
+    payload_buffer_count() const {
+      return gcm ? 1 : segments.size();
+    }
+
+    std::size_t
+    payload_size() const {
+      return gcm ? ciphertext.size() : frame_size;
+    }
+
+    bool
+    encrypted() const {
+      return (bool) gcm;
+    }
+
+    std::size_t
+    shard_count() const {
+      return data_shards;
+    }
+
+    /**
+     * @brief Parity shards including their headers, `block_size()` bytes each.
+     */
+    const char *
+    parity() const {
+      return parity_shards.data();
+    }
+
+    std::size_t
+    parity_count() const {
+      return parity_shard_count;
+    }
+
+  private:
+    std::size_t datagram_size;
+    std::size_t shard_payload_size;
+    int percentage;
+    std::unique_ptr<cipher::gcm_t> gcm;
+
+    std::vector<platf::buffer_descriptor_t> segments;
+    std::size_t frame_size = 0;
+    std::size_t data_shards = 0;
+    std::size_t parity_shard_count = 0;
+
+    std::vector<char> shard_headers;
+    std::vector<char> parity_shards;
+
+    // The encrypted data shards and the parts of the frame a shard is encrypted from
+    std::vector<char> ciphertext;
+    platf::buffer_descriptor_t ciphertext_segment {};
+    std::vector<platf::buffer_descriptor_t> shard_segments;
+
+    // Zero padded copies of the data shards that are not contiguous, only needed for FEC
+    std::vector<std::uint8_t> bounce_shards;
+    std::vector<std::uint8_t> zero_shard;
+    std::optional<fec::rs_t> rs;
+  };
+
+  /**
+   * @brief Prefixes audio packets with an `audio_shard_header_t` and protects them with FEC.
+   * @details Data packets are sent as soon as they are packetized, the parity of a block becomes
+   *          available once its last data packet has been packetized.
+   */
+  class audio_packetizer_t {
+  public:
+    /**
+     * @param block_size Number of data packets per FEC block.
+     * @param gcm Encrypts the packets and the parity, nullptr sends them in the clear.
+     */
+    explicit audio_packetizer_t(std::size_t block_size, std::unique_ptr<cipher::gcm_t> gcm = nullptr);
+
+    /**
+     * @brief Packetize an encoded audio packet.
+     * @param data The encoded packet.
+     * @param frame_index The transport frame index.
+     * @param capture_time When the packet was captured.
+     * @return The header to send in front of `payload()`, empty if the packet is too large or couldn't be encrypted.
+     */
+    std::string_view
+    packetize(std::string_view data, std::uint32_t frame_index, std::chrono::steady_clock::time_point capture_time);
+
+    /**
+     * @brief What follows the header of the last packet, the packet itself or its ciphertext.
+     */
+    std::string_view
+    payload() const {
+      return sent_payload;
+    }
+
+    /**
+     * @brief Change the parity overhead, takes effect from the next FEC block.
+     * @param percentage Parity shards in percent of the data shards, 0 disables FEC.
+     */
+    void
+    fec_percentage(int percentage);
+
+    /**
+     * @brief Parity datagrams of the block completed by the last call to `packetize()`.
+     */
+    const char *
+    parity_data() const {
+      return parity.data();
+    }
+
+    std::size_t
+    parity_block_size() const {
+      return parity_size;
+    }
+
+    std::size_t
+    parity_block_count() const {
+      return parity_count;
+    }
+
+  private:
+    std::size_t block_size;
+    int percentage;
+    int block_percentage;
+    std::unique_ptr<cipher::gcm_t> gcm;
+
+    std::uint32_t block_start = 0;
+    // Times of the first packet of the block as they are on the wire
+    std::uint64_t block_capture_time = 0;
+    std::uint32_t block_send_time = 0;
+    std::size_t block_fill = 0;
+    std::vector<std::vector<std::uint8_t>> block;
+
+    audio_shard_header_t header {};
+    std::string_view sent_payload;
+    std::vector<char> ciphertext;
+    std::vector<char> parity;
+    std::size_t parity_size = 0;
+    std::size_t parity_count = 0;
+
+    std::optional<fec::rs_t> rs;
+  };
+
+  /**
+   * @brief The shards of the video frames sent during the last `window`, resent when the client reports them lost.
+   * @details Frames keep their encoded packet alive, so data shards are resent straight from it like
+   *          the first time. Only the headers and the parity are copied, into buffers that are reused
+   *          once a frame expires. Encrypted data shards are copied as well, the packetizer reuses their
+   *          buffer for the next frame, and resent as they were. So are IDR frames with parameter set
+   *          replacements, the replacements belong to the encode session and go away with it. Frames
+   *          are inserted by the sender and resent from the control channel, so the cache is guarded
+   *          by a mutex.
+   */
+  class retransmit_cache_t {
+  public:
+    enum class result_e {
+      sent,
+      unknown,  ///< The frame already expired or was never sent
+      late,  ///< The shards would arrive after the playout deadline of the frame
+    };
+
+    /**
+     * @param window How long frames are kept after they were sent.
+     * @param playout_delay Time after the capture a frame has to be at the client.
+     */
+    retransmit_cache_t(std::chrono::milliseconds window, std::chrono::milliseconds playout_delay);
+
+    /**
+     * @brief Keep a frame that was just sent.
+     * @param packet The encoded frame, the data shards of the packetizer point into it.
+     * @param packetizer The packetizer the frame was sent with.
+     * @param send_info Where the frame was sent to.
+     */
+    void
+    insert(std::uint32_t frame_index, video::packet_t &&packet, const video_packetizer_t &packetizer, const platf::batched_send_info_t &send_info);
+
+    /**
+     * @brief Resend shards [first_shard, last_shard] of a frame, parity shards follow the data shards.
+     * @param slice_index Part of a frame sent in slices, 0 otherwise.
+     * @param target Where to resend the shards to, the destination of the frame if empty.
+     */
+    result_e
+    resend(std::uint32_t frame_index, std::uint16_t slice_index, std::uint16_t first_shard, std::uint16_t last_shard,
+      const std::optional<boost::asio::ip::udp::endpoint> &target = std::nullopt);
+
+  private:
+    struct frame_t {
+      std::uint32_t frame_index;
+      std::uint16_t slice_index;
+      std::chrono::steady_clock::time_point capture_time;
+      std::chrono::steady_clock::time_point sent;
+
+      video::packet_t packet;
+      std::vector<char> headers;
+      std::vector<platf::buffer_descriptor_t> segments;
+      // The payload when it doesn't live in the packet alone
+      std::vector<char> payload;
+      std::size_t payload_size;
+      std::size_t data_shards;
+      std::size_t block_size;
+      std::vector<char> parity;
+      std::size_t parity_count;
+
+      std::uintptr_t native_socket;
+      boost::asio::ip::address target_address;
+      std::uint16_t target_port;
+      boost::asio::ip::address source_address;
+    };
+
+    std::chrono::milliseconds window;
+    std::chrono::milliseconds playout_delay;
+
+    std::mutex mutex;
+    std::deque<frame_t> frames;
+  };
+
+  /**
+   * @brief Token-bucket pacer that spreads the shards of a frame over a fraction of the frame interval.
+   * @details The bucket holds at most `burst_size` shards, so the NIC never sees more than that
+   *          back to back. Bursts that are larger than the switch or Wi-Fi buffers would otherwise
+   *          cause loss on large frames, such as IDR frames.
+   *
+   *          With kernel pacing the pacer doesn't sleep, every burst is handed to the socket at once
+   *          with the time it may leave, and the fq qdisc holds it until then.
+   */
+  class pacer_t {
+  public:
+    /**
+     * @param percentage Percentage of the frame interval the shards of a frame are spread over, 0 disables pacing.
+     * @param burst_size Largest number of shards sent back to back.
+     * @param kernel_pacing The socket honours `batched_send_info_t::txtime`, see `platf::enable_socket_txtime()`.
+     */
+    pacer_t(int percentage, std::size_t burst_size, bool kernel_pacing = false);
+
+    /**
+     * @brief Send the shards of a frame, sleeping between bursts or stamping their departure times.
+     * @param batches The shards of the frame, such as the data shards followed by the parity shards.
+     * @param frame_interval Time since the previous frame.
+     * @return The number of shards that couldn't be sent.
+     */
+    std::size_t
+    send(std::vector<platf::batched_send_info_t> &batches, std::chrono::nanoseconds frame_interval);
+
+  private:
+    int percentage;
+    std::size_t burst_size;
+    bool kernel_pacing;
+
+    // Bytes that may be sent right away
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last_refill = std::chrono::steady_clock::now();
+
+    // Smoothed frame interval, a single late frame must not stretch the next one
+    std::chrono::nanoseconds frame_interval {};
+
+    std::unique_ptr<platf::high_precision_timer> timer;
+
+    // Time between the first and the last shard of a frame leaving the pacer, in milliseconds. With kernel
+    // pacing, the time until the departure of the last shard
+    stat_trackers::min_max_avg_tracker<double> queue_delay_tracker;
+  };
+}  // namespace stream
@@ -15,6 +15,7 @@
 #include <vector>
 
 #include "move_by_copy.h"
+#include "timer_wheel.h"
 #include "utility.h"
 namespace task_pool_util {
 
@@ -61,9 +62,30 @@ namespace task_pool_util {
 
   protected:
     std::deque<__task> _tasks;
-    std::vector<std::pair<__time_point, __task>> _timer_tasks;
+    timer_wheel_t<task_id_t, __task> _timer_tasks;
     std::mutex _task_mutex;
 
+    /**
+     * @brief Move the delayed tasks that are due to the tasks that run right away.
+     * @return The number of tasks that became due.
+     */
+    std::size_t
+    expire() {
+      std::lock_guard lg(_task_mutex);
+      return expire_locked();
+    }
+
+    std::size_t
+    expire_locked() {
+      std::size_t count = 0;
+      _timer_tasks.expire(std::chrono::steady_clock::now(), [this, &count](task_id_t, __task &&task) {
+        _tasks.emplace_back(std::move(task));
+        ++count;
+      });
+
+      return count;
+    }
+
   public:
     TaskPool() = default;
     TaskPool(TaskPool &&other) noexcept:
@@ -103,14 +125,8 @@ namespace task_pool_util {
     pushDelayed(std::pair<__time_point, __task> &&task) {
       std::lock_guard lg(_task_mutex);
 
-      auto it = _timer_tasks.cbegin();
-      for (; it < _timer_tasks.cend(); ++it) {
-        if (std::get<0>(*it) < task.first) {
-          break;
-        }
-      }
-
-      _timer_tasks.emplace(it, task.first, std::move(task.second));
+      auto task_id = &*task.second;
+      _timer_tasks.insert(task_id, task.first, std::move(task.second));
     }
 
     /**
@@ -157,80 +173,42 @@ namespace task_pool_util {
     delay(task_id_t task_id, std::chrono::duration<X, Y> duration) {
       std::lock_guard<std::mutex> lg(_task_mutex);
 
-      auto it = _timer_tasks.begin();
-      for (; it < _timer_tasks.cend(); ++it) {
-        const __task &task = std::get<1>(*it);
-
-        if (&*task == task_id) {
-          std::get<0>(*it) = std::chrono::steady_clock::now() + duration;
-
-          break;
-        }
-      }
-
-      if (it == _timer_tasks.cend()) {
-        return;
-      }
-
-      // smaller time goes to the back
-      auto prev = it - 1;
-      while (it > _timer_tasks.cbegin()) {
-        if (std::get<0>(*it) > std::get<0>(*prev)) {
-          std::swap(*it, *prev);
-        }
-
-        --prev;
-        --it;
+      if (auto task = _timer_tasks.erase(task_id)) {
+        _timer_tasks.insert(task_id, std::chrono::steady_clock::now() + duration, std::move(task->second));
       }
     }
 
+    /**
+     * @return `false` if the task already became due or doesn't exist.
+     */
     bool
     cancel(task_id_t task_id) {
       std::lock_guard lg(_task_mutex);
 
-      auto it = _timer_tasks.begin();
-      for (; it < _timer_tasks.cend(); ++it) {
-        const __task &task = std::get<1>(*it);
-
-        if (&*task == task_id) {
-          _timer_tasks.erase(it);
-
-          return true;
-        }
-      }
-
-      return false;
+      return (bool) _timer_tasks.erase(task_id);
     }
 
     std::optional<std::pair<__time_point, __task>>
     pop(task_id_t task_id) {
       std::lock_guard lg(_task_mutex);
 
-      auto pos = std::find_if(std::begin(_timer_tasks), std::end(_timer_tasks), [&task_id](const auto &t) { return t.second.get() == task_id; });
-
-      if (pos == std::end(_timer_tasks)) {
-        return std::nullopt;
-      }
-
-      return std::move(*pos);
+      return _timer_tasks.erase(task_id);
     }
 
     std::optional<__task>
     pop() {
       std::lock_guard lg(_task_mutex);
 
+      if (_tasks.empty()) {
+        expire_locked();
+      }
+
       if (!_tasks.empty()) {
         __task task = std::move(_tasks.front());
         _tasks.pop_front();
         return task;
       }
 
-      if (!_timer_tasks.empty() && std::get<0>(_timer_tasks.back()) <= std::chrono::steady_clock::now()) {
-        __task task = std::move(std::get<1>(_timer_tasks.back()));
-        _timer_tasks.pop_back();
-        return task;
-      }
-
       return std::nullopt;
     }
 
@@ -238,18 +216,22 @@ namespace task_pool_util {
     ready() {
       std::lock_guard<std::mutex> lg(_task_mutex);
 
-      return !_tasks.empty() || (!_timer_tasks.empty() && std::get<0>(_timer_tasks.back()) <= std::chrono::steady_clock::now());
+      if (!_tasks.empty()) {
+        return true;
+      }
+
+      auto tp = _timer_tasks.next();
+      return tp && *tp <= std::chrono::steady_clock::now();
     }
 
+    /**
+     * @brief When the delayed tasks have to be checked next, no later than the first deadline.
+     */
     std::optional<__time_point>
     next() {
       std::lock_guard<std::mutex> lg(_task_mutex);
 
-      if (_timer_tasks.empty()) {
-        return std::nullopt;
-      }
-
-      return std::get<0>(_timer_tasks.back());
+      return _timer_tasks.next();
     }
 
   private:
@@ -0,0 +1,265 @@
+/**
+ * @file src/test_pattern.cpp
+ * @brief Synthetic capture that draws the frame number and the capture time into every frame.
+ */
+#include <algorithm>
+#include <thread>
+
+#include "logging.h"
+#include "stream.h"
+#include "test_pattern.h"
+
+using namespace std::literals;
+
+namespace test_pattern {
+  namespace {
+    constexpr std::uint32_t WHITE = 0xFFFFFFFF;
+    constexpr std::uint32_t BLACK = 0xFF000000;
+    constexpr std::uint32_t BACKGROUND = 0xFF404040;
+
+    // Segments a to g of a seven-segment digit, a is the top one and g the middle one
+    constexpr std::uint8_t DIGIT_SEGMENTS[] { 0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F };
+    constexpr int DIGITS = 10;
+
+    void
+    fill(platf::img_t &img, int left, int top, int right, int bottom, std::uint32_t color) {
+      left = std::clamp(left, 0, img.width);
+      right = std::clamp(right, left, img.width);
+      top = std::clamp(top, 0, img.height);
+      bottom = std::clamp(bottom, top, img.height);
+
+      for (int y = top; y < bottom; ++y) {
+        std::fill_n((std::uint32_t *) (img.data + (std::size_t) y * img.row_pitch) + left, right - left, color);
+      }
+    }
+
+    platf::rect_t
+    grid_rect(const platf::img_t &img) {
+      return { 0, 0, GRID_COLUMNS * img.width / 32, GRID_ROWS * img.height / 32 };
+    }
+
+    platf::rect_t
+    digits_rect(const platf::img_t &img) {
+      auto height = img.height / 8;
+      auto left = img.width / 64;
+      auto top = img.height * 9 / 32;
+      return { left, top, left + DIGITS * height * 3 / 4, top + height };
+    }
+
+    void
+    draw_digit(platf::img_t &img, int left, int top, int height, int digit) {
+      auto width = height / 2;
+      auto thickness = std::max(1, height / 10);
+      auto middle = top + (height - thickness) / 2;
+      auto segments = DIGIT_SEGMENTS[digit];
+
+      // a, b, c, d, e, f, g
+      const platf::rect_t rects[] {
+        { left, top, left + width, top + thickness },
+        { left + width - thickness, top, left + width, middle + thickness },
+        { left + width - thickness, middle, left + width, top + height },
+        { left, top + height - thickness, left + width, top + height },
+        { left, middle, left + thickness, top + height },
+        { left, top, left + thickness, middle + thickness },
+        { left, middle, left + width, middle + thickness },
+      };
+      for (int x = 0; x < 7; ++x) {
+        if (segments & (1 << x)) {
+          fill(img, rects[x].left, rects[x].top, rects[x].right, rects[x].bottom, WHITE);
+        }
+      }
+    }
+
+    /**
+     * @brief Images the pattern can be drawn into.
+     */
+    bool
+    writable(platf::mem_type_e mem_type, const platf::img_t &img) {
+#ifdef __linux__
+      // The RAM captures of X11, wlroots and PipeWire feed every encoder, the GPU images have no data
+      return img.data && img.pixel_pitch == 4;
+#else
+      // The data of a GPU image may point at its texture
+      return mem_type == platf::mem_type_e::system && img.data && img.pixel_pitch == 4;
+#endif
+    }
+
+    class pattern_display_t: public platf::display_t {
+    public:
+      pattern_display_t(std::shared_ptr<platf::display_t> display, platf::mem_type_e mem_type, int framerate):
+          display { std::move(display) }, mem_type { mem_type }, delay { std::chrono::nanoseconds { 1s } / std::max(1, framerate) } {
+        offset_x = this->display->offset_x;
+        offset_y = this->display->offset_y;
+        env_width = this->display->env_width;
+        env_height = this->display->env_height;
+        width = this->display->width;
+        height = this->display->height;
+      }
+
+      platf::capture_e
+      capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override {
+        auto next_frame = std::chrono::steady_clock::now();
+        while (true) {
+          std::shared_ptr<platf::img_t> img;
+          if (!pull_free_image_cb(img)) {
+            return platf::capture_e::interrupted;
+          }
+
+          auto now = std::chrono::steady_clock::now();
+          if (prepare(*img)) {
+            return platf::capture_e::error;
+          }
+
+          ++frame_number;
+          if (writable(mem_type, *img)) {
+            draw(*img, frame_number, stream::wall_clock_us(now));
+          }
+          img->frame_timestamp = now;
+          img->capture_sequence = frame_number;
+          img->damage = std::vector<platf::rect_t> { grid_rect(*img), digits_rect(*img) };
+
+          if (!push_captured_image_cb(std::move(img), true)) {
+            return platf::capture_e::ok;
+          }
+
+          // After a stall the pattern continues at the frame rate instead of catching up
+          next_frame = std::max(next_frame + delay, std::chrono::steady_clock::now());
+          std::this_thread::sleep_until(next_frame);
+        }
+      }
+
+      std::shared_ptr<platf::img_t>
+      alloc_img() override {
+        return display->alloc_img();
+      }
+
+      int
+      dummy_img(platf::img_t *img) override {
+        return display->dummy_img(img);
+      }
+
+      std::unique_ptr<platf::avcodec_encode_device_t>
+      make_avcodec_encode_device(platf::pix_fmt_e pix_fmt) override {
+        return display->make_avcodec_encode_device(pix_fmt);
+      }
+
+      std::unique_ptr<platf::nvenc_encode_device_t>
+      make_nvenc_encode_device(platf::pix_fmt_e pix_fmt) override {
+        return display->make_nvenc_encode_device(pix_fmt);
+      }
+
+      std::unique_ptr<platf::amf_encode_device_t>
+      make_amf_encode_device(platf::pix_fmt_e pix_fmt) override {
+        return display->make_amf_encode_device(pix_fmt);
+      }
+
+      bool
+      is_codec_supported(std::string_view name, const video::config_t &config) override {
+        return display->is_codec_supported(name, config);
+      }
+
+    private:
+      /**
+       * @brief Give an image from the pool its content the first time it's used.
+       * @return 0 on success, -1 on error.
+       */
+      int
+      prepare(platf::img_t &img) {
+        // The pattern overwrites the same regions of every image it has drawn into before
+        if (img.capture_sequence) {
+          return 0;
+        }
+
+        if (!img.data && display->dummy_img(&img)) {
+          BOOST_LOG(error) << "Couldn't initialize an image of the test pattern"sv;
+          return -1;
+        }
+
+        if (writable(mem_type, img)) {
+          fill(img, 0, 0, img.width, img.height, BACKGROUND);
+          return 0;
+        }
+
+        if (!warned) {
+          BOOST_LOG(error) << "The test pattern can't be drawn into the images of this capture, it needs images in system memory"sv;
+          warned = true;
+        }
+        return 0;
+      }
+
+      std::shared_ptr<platf::display_t> display;
+      platf::mem_type_e mem_type;
+      std::chrono::nanoseconds delay;
+
+      std::uint32_t frame_number = 0;
+      bool warned = false;
+    };
+  }  // namespace
+
+  std::uint16_t
+  crc16(const std::uint8_t *data, std::size_t size) {
+    std::uint16_t crc = 0xFFFF;
+    for (std::size_t x = 0; x < size; ++x) {
+      crc ^= (std::uint16_t) data[x] << 8;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+      }
+    }
+    return crc;
+  }
+
+  void
+  draw(platf::img_t &img, std::uint32_t frame_number, std::uint64_t capture_time) {
+    std::uint8_t bytes[12];
+    for (int x = 0; x < 4; ++x) {
+      bytes[x] = (std::uint8_t) (frame_number >> (x * 8));
+    }
+    for (int x = 0; x < 8; ++x) {
+      bytes[4 + x] = (std::uint8_t) (capture_time >> (x * 8));
+    }
+    auto crc = crc16(bytes, sizeof(bytes));
+
+    auto bit = [&](int cell) -> bool {
+      if (cell < 32) {
+        return (frame_number >> cell) & 1;
+      }
+      if (cell < 96) {
+        return (capture_time >> (cell - 32)) & 1;
+      }
+      if (cell < 112) {
+        return (crc >> (cell - 96)) & 1;
+      }
+      return (SYNC_WORD >> (cell - 112)) & 1;
+    };
+
+    // Cell edges are computed from the frame size, so a scaled frame keeps the cell centers in place
+    for (int cell = 0; cell < GRID_COLUMNS * GRID_ROWS; ++cell) {
+      auto column = cell % GRID_COLUMNS;
+      auto row = cell / GRID_COLUMNS;
+      fill(img,
+        column * img.width / 32, row * img.height / 32,
+        (column + 1) * img.width / 32, (row + 1) * img.height / 32,
+        bit(cell) ? WHITE : BLACK);
+    }
+
+    auto digits = digits_rect(img);
+    auto digit_height = digits.bottom - digits.top;
+    fill(img, digits.left, digits.top, digits.right, digits.bottom, BLACK);
+
+    auto number = frame_number;
+    for (int x = DIGITS - 1; x >= 0; --x) {
+      draw_digit(img, digits.left + x * digit_height * 3 / 4 + digit_height / 8, digits.top + digit_height / 16, digit_height * 7 / 8, number % 10);
+      number /= 10;
+    }
+  }
+
+  std::shared_ptr<platf::display_t>
+  display(std::shared_ptr<platf::display_t> display, platf::mem_type_e mem_type, int framerate) {
+    if (!display) {
+      return nullptr;
+    }
+
+    BOOST_LOG(info) << "Streaming the test pattern at "sv << framerate << " fps instead of the display"sv;
+    return std::make_shared<pattern_display_t>(std::move(display), mem_type, framerate);
+  }
+}  // namespace test_pattern
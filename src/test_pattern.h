@@ -0,0 +1,51 @@
+/**
+ * @file src/test_pattern.h
+ * @brief Synthetic capture that draws the frame number and the capture time into every frame.
+ * @details A receiver that decodes the video reads both back and measures the latency from the capture
+ *          until the frame was decoded, on one host or across the network with synchronized clocks.
+ *
+ *          The pattern is a grid of `GRID_COLUMNS` by `GRID_ROWS` cells over the left half and the top
+ *          quarter of the frame, every cell is `1/32` of the width and of the height of the frame. Cell `i`
+ *          is in column `i % GRID_COLUMNS` and row `i / GRID_COLUMNS`, white is a 1 and black a 0:
+ *
+ *          - cells 0 to 31: the frame number, least significant bit first
+ *          - cells 32 to 95: the capture time in microseconds since the Unix epoch, as in the datagram headers
+ *          - cells 96 to 111: CRC-16/CCITT-FALSE of the 12 bytes of both, little-endian
+ *          - cells 112 to 127: `SYNC_WORD`
+ *
+ *          The frame number is also drawn in digits below the grid, for a camera pointed at the client.
+ *          Scaling keeps the pattern readable as long as the aspect ratio of the stream is the one of the display.
+ */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "platform/common.h"
+
+namespace test_pattern {
+  constexpr int GRID_COLUMNS = 16;
+  constexpr int GRID_ROWS = 8;
+  constexpr std::uint16_t SYNC_WORD = 0xA55A;
+
+  /**
+   * @brief Checksum of the frame number and the capture time.
+   */
+  std::uint16_t
+  crc16(const std::uint8_t *data, std::size_t size);
+
+  /**
+   * @brief Draw the pattern of a frame into an image of 4 bytes per pixel.
+   */
+  void
+  draw(platf::img_t &img, std::uint32_t frame_number, std::uint64_t capture_time);
+
+  /**
+   * @brief A display that draws the pattern at `framerate` instead of capturing.
+   * @details The images and the encode devices still come from `display`, so every encoder sees the
+   *          images it sees during a real capture. The pattern can only be drawn into images in system
+   *          memory, images only the GPU can write to are streamed as the display's dummy image.
+   */
+  std::shared_ptr<platf::display_t>
+  display(std::shared_ptr<platf::display_t> display, platf::mem_type_e mem_type, int framerate);
+}  // namespace test_pattern
@@ -5,33 +5,41 @@
 #pragma once
 
 #include "task_pool.h"
+#include <functional>
 #include <thread>
 
 namespace thread_pool_util {
   /**
    * Allow threads to execute unhindered while keeping full control over the threads.
+   * A dedicated timer thread hands the delayed tasks to the workers when they become due.
    */
   class ThreadPool: public task_pool_util::TaskPool {
   public:
     typedef TaskPool::__task __task;
+    typedef std::function<void(std::chrono::nanoseconds)> sleep_f;
 
   private:
+    // The timer thread waits on the condition variable until this close to a deadline, then sleeps precisely
+    static constexpr std::chrono::milliseconds precise_sleep_margin { 2 };
+
     std::vector<std::thread> _thread;
+    std::thread _timer_thread;
 
     std::condition_variable _cv;
+    std::condition_variable _timer_cv;
     std::mutex _lock;
 
+    sleep_f _sleep;
+
     bool _continue;
 
   public:
     ThreadPool():
         _continue { false } {}
 
-    explicit ThreadPool(int threads):
-        _thread(threads), _continue { true } {
-      for (auto &t : _thread) {
-        t = std::thread(&ThreadPool::_main, this);
-      }
+    explicit ThreadPool(int threads, sleep_f sleep = {}):
+        _continue { false } {
+      start(threads, std::move(sleep));
     }
 
     ~ThreadPool() noexcept {
@@ -64,20 +72,36 @@ namespace thread_pool_util {
       std::lock_guard lg(_lock);
       auto future = TaskPool::pushDelayed(std::forward<Function>(newTask), duration, std::forward<Args>(args)...);
 
-      // Update all timers for wait_until
-      _cv.notify_all();
+      // The new task may be due before the one the timer thread waits for
+      _timer_cv.notify_one();
       return future;
     }
 
+    template <class X, class Y>
     void
-    start(int threads) {
+    delay(task_id_t task_id, std::chrono::duration<X, Y> duration) {
+      std::lock_guard lg(_lock);
+      TaskPool::delay(task_id, duration);
+
+      _timer_cv.notify_one();
+    }
+
+    /**
+     * @param sleep Sleeps the last stretch before a deadline, e.g. with platf::high_precision_timer.
+     *              std::this_thread::sleep_for() if empty.
+     */
+    void
+    start(int threads, sleep_f sleep = {}) {
       _continue = true;
+      _sleep = std::move(sleep);
 
       _thread.resize(threads);
 
       for (auto &t : _thread) {
         t = std::thread(&ThreadPool::_main, this);
       }
+
+      _timer_thread = std::thread(&ThreadPool::_timer_main, this);
     }
 
     void
@@ -86,6 +110,7 @@ namespace thread_pool_util {
 
       _continue = false;
       _cv.notify_all();
+      _timer_cv.notify_all();
     }
 
     void
@@ -93,6 +118,10 @@ namespace thread_pool_util {
       for (auto &t : _thread) {
         t.join();
       }
+
+      if (_timer_thread.joinable()) {
+        _timer_thread.join();
+      }
     }
 
   public:
@@ -113,12 +142,8 @@ namespace thread_pool_util {
             break;
           }
 
-          if (auto tp = next()) {
-            _cv.wait_until(uniq_lock, *tp);
-          }
-          else {
-            _cv.wait(uniq_lock);
-          }
+          // The timer thread wakes the workers when delayed tasks become due
+          _cv.wait(uniq_lock);
         }
       }
 
@@ -127,5 +152,40 @@ namespace thread_pool_util {
         (*task)->run();
       }
     }
+
+    void
+    _timer_main() {
+      std::unique_lock uniq_lock(_lock);
+
+      while (_continue) {
+        if (expire()) {
+          _cv.notify_all();
+        }
+
+        auto tp = next();
+        if (!tp) {
+          _timer_cv.wait(uniq_lock);
+          continue;
+        }
+
+        // Sleeping on the condition variable is coarse, but new tasks can wake it
+        auto remaining = *tp - std::chrono::steady_clock::now();
+        if (remaining > precise_sleep_margin) {
+          _timer_cv.wait_until(uniq_lock, *tp - precise_sleep_margin);
+          continue;
+        }
+
+        if (remaining > std::chrono::nanoseconds::zero()) {
+          uniq_lock.unlock();
+          if (_sleep) {
+            _sleep(remaining);
+          }
+          else {
+            std::this_thread::sleep_for(remaining);
+          }
+          uniq_lock.lock();
+        }
+      }
+    }
   };
 }  // namespace thread_pool_util
@@ -4,17 +4,159 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <vector>
 
+#include "futex.h"
 #include "utility.h"
 
 namespace safe {
+  class watchers_t;
+
+  /**
+   * @brief Sleeps until one of the events and queues it watches is raised or stopped.
+   * @details The watched objects must outlive the selector. Any number of selectors may watch the same object.
+   */
+  class selector_t {
+  public:
+    selector_t() = default;
+    selector_t(const selector_t &) = delete;
+    selector_t &
+    operator=(const selector_t &) = delete;
+
+    ~selector_t();
+
+    template <class... Watchable>
+    void
+    watch(Watchable &...objects) {
+      (add(objects.watchers()), ...);
+    }
+
+    /**
+     * @brief Called by the watched objects when they change.
+     */
+    void
+    notify() {
+      _signal.fetch_add(1);
+      if (_sleeping.load()) {
+        futex::wake_all(_signal);
+      }
+    }
+
+    /**
+     * @brief Sleep until `ready()` is true or the deadline passed.
+     * @param ready Checks the watched objects, e.g. with peek().
+     * @return The last result of `ready()`.
+     */
+    template <class F>
+    bool
+    wait_until(std::chrono::steady_clock::time_point deadline, F &&ready) {
+      while (true) {
+        // A change after the load changes the signal, the futex doesn't sleep through it
+        auto signal = _signal.load();
+        if (ready()) {
+          return true;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+          return false;
+        }
+
+        _sleeping.store(true);
+        futex::wait_for(_signal, signal, deadline - now);
+        _sleeping.store(false);
+      }
+    }
+
+    template <class Rep, class Period, class F>
+    bool
+    wait_for(std::chrono::duration<Rep, Period> delay, F &&ready) {
+      return wait_until(std::chrono::steady_clock::now() + delay, std::forward<F>(ready));
+    }
+
+    template <class F>
+    void
+    wait(F &&ready) {
+      while (true) {
+        auto signal = _signal.load();
+        if (ready()) {
+          return;
+        }
+
+        _sleeping.store(true);
+        futex::wait(_signal, signal);
+        _sleeping.store(false);
+      }
+    }
+
+  private:
+    void
+    add(watchers_t &watchers);
+
+    std::vector<watchers_t *> _watched;
+
+    std::atomic<std::uint32_t> _signal { 0 };
+    std::atomic_bool _sleeping { false };
+  };
+
+  /**
+   * @brief Selectors watching an event or a queue, notifying them costs nothing while there are none.
+   */
+  class watchers_t {
+  public:
+    void
+    add(selector_t *selector) {
+      std::lock_guard lg { _lock };
+      _selectors.push_back(selector);
+      _count.fetch_add(1);
+    }
+
+    void
+    remove(selector_t *selector) {
+      std::lock_guard lg { _lock };
+      _selectors.erase(std::remove(std::begin(_selectors), std::end(_selectors), selector), std::end(_selectors));
+      _count.store((int) _selectors.size());
+    }
+
+    void
+    notify() {
+      if (!_count.load()) {
+        return;
+      }
+
+      std::lock_guard lg { _lock };
+      for (auto selector : _selectors) {
+        selector->notify();
+      }
+    }
+
+  private:
+    std::atomic_int _count { 0 };
+    std::mutex _lock;
+    std::vector<selector_t *> _selectors;
+  };
+
+  inline void
+  selector_t::add(watchers_t &watchers) {
+    watchers.add(this);
+    _watched.push_back(&watchers);
+  }
+
+  inline selector_t::~selector_t() {
+    for (auto watchers : _watched) {
+      watchers->remove(this);
+    }
+  }
+
   template <class T>
   class event_t {
   public:
@@ -36,6 +178,7 @@ namespace safe {
       }
 
       _cv.notify_all();
+      _watchers.notify();
     }
 
     // pop and view should not be used interchangeably
@@ -132,6 +275,7 @@ namespace safe {
       _continue = false;
 
       _cv.notify_all();
+      _watchers.notify();
     }
 
     void
@@ -148,12 +292,19 @@ namespace safe {
       return _continue;
     }
 
+    watchers_t &
+    watchers() {
+      return _watchers;
+    }
+
   private:
     bool _continue { true };
     status_t _status { util::false_v<status_t> };
 
     std::condition_variable _cv;
     std::mutex _lock;
+
+    watchers_t _watchers;
   };
 
   template <class T>
@@ -257,17 +408,52 @@ namespace safe {
     return std::make_shared<alarm_raw_t<T>>();
   }
 
+  /**
+   * @brief How a queue_t hands its elements over.
+   */
+  enum class queue_mode_e {
+    locked,  ///< Mutex and condition variable, any number of producers and consumers.
+    spsc,  ///< Lock-free ring with a single producer and a single consumer.
+    mpsc,  ///< Lock-free ring with any number of producers and a single consumer.
+  };
+
+  /**
+   * @brief Bounded queue, a full queue makes room for the new element by dropping elements.
+   * @details The locked queue drops everything it holds, the ring drops the element being raised.
+   *          Either way the producer isn't told, consumers that can't lose an element in the middle of
+   *          a stream watch dropped() and resynchronize when it moves.
+   *          Consumers of the ring spin briefly before sleeping on a futex, producers only wake them
+   *          when they sleep.
+   */
   template <class T>
   class queue_t {
   public:
     using status_t = util::optional_t<T>;
 
-    queue_t(std::uint32_t max_elements = 32):
-        _max_elements { max_elements } {}
+    queue_t(std::uint32_t max_elements = 32, queue_mode_e mode = queue_mode_e::locked):
+        _max_elements { max_elements }, _mode { mode } {
+      if (_mode != queue_mode_e::locked) {
+        std::size_t capacity = 1;
+        while (capacity < max_elements) {
+          capacity *= 2;
+        }
+
+        _mask = capacity - 1;
+        _slots = std::make_unique<slot_t[]>(capacity);
+        for (std::size_t x = 0; x < capacity; ++x) {
+          _slots[x].sequence.store(x, std::memory_order_relaxed);
+        }
+      }
+    }
 
     template <class... Args>
     void
     raise(Args &&...args) {
+      if (_mode != queue_mode_e::locked) {
+        ring_raise(std::forward<Args>(args)...);
+        return;
+      }
+
       std::lock_guard ul { _lock };
 
       if (!_continue) {
@@ -275,22 +461,32 @@ namespace safe {
       }
 
       if (_queue.size() == _max_elements) {
+        _dropped.fetch_add(_queue.size(), std::memory_order_relaxed);
         _queue.clear();
       }
 
       _queue.emplace_back(std::forward<Args>(args)...);
 
       _cv.notify_all();
+      _watchers.notify();
     }
 
     bool
     peek() {
+      if (_mode != queue_mode_e::locked) {
+        return _continue && ring_ready();
+      }
+
       return _continue && !_queue.empty();
     }
 
     template <class Rep, class Period>
     status_t
     pop(std::chrono::duration<Rep, Period> delay) {
+      if (_mode != queue_mode_e::locked) {
+        return ring_pop(std::chrono::steady_clock::now() + delay);
+      }
+
       std::unique_lock ul { _lock };
 
       if (!_continue) {
@@ -311,6 +507,10 @@ namespace safe {
 
     status_t
     pop() {
+      if (_mode != queue_mode_e::locked) {
+        return ring_pop(std::nullopt);
+      }
+
       std::unique_lock ul { _lock };
 
       if (!_continue) {
@@ -331,6 +531,31 @@ namespace safe {
       return val;
     }
 
+    /**
+     * @return Elements waiting for the consumer, it may have changed by the time it's read.
+     */
+    std::size_t
+    size() {
+      if (_mode != queue_mode_e::locked) {
+        // Slots a producer claimed but didn't fill yet are counted as well
+        auto head = _head.load(std::memory_order_relaxed);
+        auto tail = _tail.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+      }
+
+      std::lock_guard lg { _lock };
+      return _queue.size();
+    }
+
+    /**
+     * @return Elements dropped because the queue was full.
+     */
+    std::uint64_t
+    dropped() const {
+      return _dropped.load(std::memory_order_relaxed);
+    }
+
+    // Only the locked queue keeps its elements here
     std::vector<T> &
     unsafe() {
       return _queue;
@@ -343,6 +568,13 @@ namespace safe {
       _continue = false;
 
       _cv.notify_all();
+
+      if (_mode != queue_mode_e::locked) {
+        _signal.fetch_add(1);
+        futex::wake_all(_signal);
+      }
+
+      _watchers.notify();
     }
 
     [[nodiscard]] bool
@@ -350,14 +582,150 @@ namespace safe {
       return _continue;
     }
 
+    watchers_t &
+    watchers() {
+      return _watchers;
+    }
+
   private:
-    bool _continue { true };
+    // Pauses of the consumer before it sleeps, about a microsecond each
+    static constexpr int spin_count = 64;
+
+    /**
+     * @brief Slot of the ring, the sequence tells whose turn it is.
+     * @details A slot at position `pos` can be written when its sequence is `pos`
+     *          and read when it is `pos + 1`, reading it moves it a lap ahead.
+     */
+    struct slot_t {
+      std::atomic<std::size_t> sequence;
+      std::optional<T> value;
+    };
+
+    template <class... Args>
+    void
+    ring_raise(Args &&...args) {
+      if (!_continue) {
+        return;
+      }
+
+      auto pos = _tail.load(std::memory_order_relaxed);
+      slot_t *slot;
+      while (true) {
+        slot = &_slots[pos & _mask];
+        auto sequence = slot->sequence.load(std::memory_order_acquire);
+        auto lag = (std::intptr_t) sequence - (std::intptr_t) pos;
+
+        if (lag < 0) {
+          // The consumer is a lap behind
+          _dropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+
+        if (lag > 0) {
+          pos = _tail.load(std::memory_order_relaxed);
+          continue;
+        }
+
+        if (_mode == queue_mode_e::spsc) {
+          _tail.store(pos + 1, std::memory_order_relaxed);
+          break;
+        }
+
+        if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+
+      slot->value.emplace(std::forward<Args>(args)...);
+      slot->sequence.store(pos + 1, std::memory_order_release);
+
+      // Pairs with the consumer announcing it sleeps before it checks the ring a last time
+      _signal.fetch_add(1);
+      if (_sleeping.load()) {
+        futex::wake_all(_signal);
+      }
+
+      _watchers.notify();
+    }
+
+    bool
+    ring_ready() {
+      auto pos = _head.load(std::memory_order_relaxed);
+      return _slots[pos & _mask].sequence.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    bool
+    ring_take(std::optional<T> &val) {
+      auto pos = _head.load(std::memory_order_relaxed);
+      auto &slot = _slots[pos & _mask];
+      if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+        return false;
+      }
+
+      val = std::move(slot.value);
+      slot.value.reset();
+      slot.sequence.store(pos + _mask + 1, std::memory_order_release);
+      _head.store(pos + 1, std::memory_order_relaxed);
+
+      return true;
+    }
+
+    status_t
+    ring_pop(std::optional<std::chrono::steady_clock::time_point> deadline) {
+      std::optional<T> val;
+      for (int spins = 0; _continue; ++spins) {
+        if (ring_take(val)) {
+          return std::move(*val);
+        }
+
+        if (spins < spin_count) {
+          futex::pause();
+          continue;
+        }
+
+        // A raise after the load changes the signal, the futex doesn't sleep through it
+        auto signal = _signal.load();
+        _sleeping.store(true);
+        if (_continue && !ring_ready()) {
+          if (!deadline) {
+            futex::wait(_signal, signal);
+          }
+          else {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= *deadline) {
+              _sleeping.store(false);
+              return util::false_v<status_t>;
+            }
+
+            futex::wait_for(_signal, signal, *deadline - now);
+          }
+        }
+        _sleeping.store(false);
+      }
+
+      return util::false_v<status_t>;
+    }
+
+    std::atomic_bool _continue { true };
     std::uint32_t _max_elements;
+    queue_mode_e _mode;
 
     std::mutex _lock;
     std::condition_variable _cv;
 
     std::vector<T> _queue;
+
+    // Lock-free ring, the producers and the consumer work on separate cache lines
+    std::unique_ptr<slot_t[]> _slots;
+    std::size_t _mask = 0;
+    alignas(64) std::atomic<std::size_t> _tail { 0 };
+    alignas(64) std::atomic<std::size_t> _head { 0 };
+    alignas(64) std::atomic<std::uint32_t> _signal { 0 };
+    std::atomic_bool _sleeping { false };
+
+    std::atomic<std::uint64_t> _dropped { 0 };
+
+    watchers_t _watchers;
   };
 
   template <class T>
@@ -471,7 +839,7 @@ namespace safe {
 
     std::array<std::uint8_t, sizeof(element_type)> _object_buf;
 
-    std::uint32_t _count;
+    std::uint32_t _count = 0;
     std::mutex _lock;
   };
 
@@ -534,9 +902,12 @@ namespace safe {
       return post;
     }
 
+    /**
+     * @param mode Handoff of the queue, only the caller that creates the queue decides it.
+     */
     template <class T>
     queue_t<T>
-    queue(const std::string_view &id) {
+    queue(const std::string_view &id, queue_mode_e mode = queue_mode_e::locked) {
       std::lock_guard lg { mutex };
 
       auto it = id_to_post.find(id);
@@ -544,7 +915,7 @@ namespace safe {
         return lock<queue_t<T>>(it->second);
       }
 
-      auto post = std::make_shared<typename queue_t<T>::element_type>(shared_from_this(), 32);
+      auto post = std::make_shared<typename queue_t<T>::element_type>(shared_from_this(), 32, mode);
       id_to_post.emplace(std::pair<std::string, std::weak_ptr<void>> { std::string { id }, post });
 
       return post;
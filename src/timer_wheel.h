@@ -0,0 +1,246 @@
+/**
+ * @file src/timer_wheel.h
+ * @brief Hierarchical timer wheel, inserting and cancelling a timer is O(1).
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+namespace task_pool_util {
+  /**
+   * @brief Timers keyed by `Key`, expiring with a resolution of one tick.
+   * @details Level 0 has a slot per tick, every higher level a slot per lap of the level below it.
+   *          Timers move down a level each time the level below completes a lap, so every timer is
+   *          touched at most once per level. Timers too far away for the top level wait in it and
+   *          are placed again whenever their slot comes up.
+   */
+  template <class Key, class Value>
+  class timer_wheel_t {
+  public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    static constexpr std::chrono::milliseconds tick { 1 };
+
+    explicit timer_wheel_t(time_point origin = std::chrono::steady_clock::now()):
+        _origin { origin } {}
+
+    /**
+     * @brief Add a timer, a deadline in the past expires on the next call to expire().
+     */
+    void
+    insert(Key key, time_point deadline, Value &&value) {
+      // An empty wheel has no laps to go through, it catches up with the clock right away
+      if (_entries.empty()) {
+        _now = std::max(_now, elapsed_ticks(std::chrono::steady_clock::now()));
+      }
+
+      auto expiry = ticks(deadline);
+
+      auto &slot = _slots[slot_of(expiry)];
+      auto it = slot.emplace(std::end(slot), entry_t { key, deadline, expiry, slot_of(expiry), std::move(value) });
+      _entries[key] = it;
+    }
+
+    /**
+     * @brief Remove a timer before it expires.
+     * @return The deadline and the value of the timer, std::nullopt if there is no such timer.
+     */
+    std::optional<std::pair<time_point, Value>>
+    erase(Key key) {
+      auto entry = _entries.find(key);
+      if (entry == std::end(_entries)) {
+        return std::nullopt;
+      }
+
+      auto it = entry->second;
+      _entries.erase(entry);
+
+      std::pair<time_point, Value> timer { it->deadline, std::move(it->value) };
+      _slots[it->slot].erase(it);
+
+      return timer;
+    }
+
+    /**
+     * @brief Remove the timers that expired by `now`, in the order of their ticks.
+     * @param expired Called with the key and the value of every expired timer.
+     */
+    template <class F>
+    void
+    expire(time_point now, F &&expired) {
+      auto target = elapsed_ticks(now);
+
+      while (_now < target) {
+        // Nothing left to cascade, the empty laps are skipped
+        if (_entries.size() == _slots[due_slot].size()) {
+          _now = target;
+          break;
+        }
+
+        ++_now;
+        if (!(_now & level0_mask)) {
+          cascade();
+        }
+
+        move_all(_slots[_now & level0_mask]);
+      }
+
+      auto &due = _slots[due_slot];
+      while (!due.empty()) {
+        auto &entry = due.front();
+        _entries.erase(entry.key);
+
+        auto key = entry.key;
+        auto value = std::move(entry.value);
+        due.pop_front();
+
+        expired(key, std::move(value));
+      }
+    }
+
+    /**
+     * @brief When expire() has to be called next.
+     * @return The tick of the first timer, or the next lap of level 0 if all timers are further away.
+     *         std::nullopt if there are no timers.
+     */
+    std::optional<time_point>
+    next() const {
+      if (_entries.empty()) {
+        return std::nullopt;
+      }
+
+      if (!_slots[due_slot].empty()) {
+        return time_of(_now);
+      }
+
+      for (std::uint64_t x = _now + 1; x <= _now + level0_slots; ++x) {
+        if (!_slots[x & level0_mask].empty()) {
+          return time_of(x);
+        }
+      }
+
+      return time_of((_now | level0_mask) + 1);
+    }
+
+    [[nodiscard]] bool
+    empty() const {
+      return _entries.empty();
+    }
+
+    [[nodiscard]] std::size_t
+    size() const {
+      return _entries.size();
+    }
+
+  private:
+    static constexpr int level0_bits = 8;
+    static constexpr int level_bits = 6;
+    static constexpr int levels = 5;
+
+    static constexpr std::uint64_t level0_slots = 1 << level0_bits;
+    static constexpr std::uint64_t level_slots = 1 << level_bits;
+    static constexpr std::uint64_t level0_mask = level0_slots - 1;
+    static constexpr std::uint64_t level_mask = level_slots - 1;
+
+    // Expired timers are kept after the slots of the levels
+    static constexpr std::size_t due_slot = level0_slots + (levels - 1) * level_slots;
+
+    struct entry_t {
+      Key key;
+      time_point deadline;
+      std::uint64_t expiry;
+      std::size_t slot;
+      Value value;
+    };
+
+    using list_t = std::list<entry_t>;
+
+    // Shift of the slot index for the levels above 0
+    static constexpr int
+    shift_of(int level) {
+      return level0_bits + (level - 1) * level_bits;
+    }
+
+    std::uint64_t
+    ticks(time_point deadline) const {
+      // Rounded up, a timer never expires before its deadline
+      auto elapsed = deadline - _origin;
+      auto count = elapsed / tick + (elapsed % tick > time_point::duration::zero() ? 1 : 0);
+      return (std::uint64_t) std::max<std::int64_t>(0, count);
+    }
+
+    // Rounded down, the ticks that completely passed by `now`
+    std::uint64_t
+    elapsed_ticks(time_point now) const {
+      return (std::uint64_t) std::max<std::int64_t>(0, (now - _origin) / tick);
+    }
+
+    time_point
+    time_of(std::uint64_t ticks) const {
+      return _origin + tick * (std::int64_t) ticks;
+    }
+
+    std::size_t
+    slot_of(std::uint64_t expiry) const {
+      if (expiry <= _now) {
+        return due_slot;
+      }
+
+      auto delta = expiry - _now;
+      if (delta < level0_slots) {
+        return expiry & level0_mask;
+      }
+
+      for (int level = 1; level < levels; ++level) {
+        if (level == levels - 1 || delta < (std::uint64_t) 1 << shift_of(level + 1)) {
+          return level0_slots + (level - 1) * level_slots + ((expiry >> shift_of(level)) & level_mask);
+        }
+      }
+
+      return due_slot;
+    }
+
+    // Place the timers of a slot again relative to the current tick
+    void
+    move_all(list_t &slot) {
+      list_t pending;
+      pending.splice(std::end(pending), slot);
+
+      while (!pending.empty()) {
+        auto it = std::begin(pending);
+        it->slot = slot_of(it->expiry);
+
+        auto &destination = _slots[it->slot];
+        destination.splice(std::end(destination), pending, it);
+      }
+    }
+
+    // Level 0 completed a lap, the slots of the higher levels that come up move down
+    void
+    cascade() {
+      for (int level = 1; level < levels; ++level) {
+        auto index = (_now >> shift_of(level)) & level_mask;
+        move_all(_slots[level0_slots + (level - 1) * level_slots + index]);
+
+        if (index) {
+          break;
+        }
+      }
+    }
+
+    time_point _origin;
+
+    // Last tick expire() went through
+    std::uint64_t _now = 0;
+
+    std::array<list_t, due_slot + 1> _slots;
+    std::unordered_map<Key, typename list_t::iterator> _entries;
+  };
+}  // namespace task_pool_util
@@ -0,0 +1,244 @@
+/**
+ * @file src/trace.cpp
+ * @brief Timeline of the streaming pipeline, written as a Chrome trace that Perfetto opens.
+ */
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "logging.h"
+#include "trace.h"
+
+using namespace std::literals;
+
+namespace trace {
+  namespace {
+    struct event_t {
+      const char *name;
+      std::int64_t start;  // Nanoseconds of the steady clock
+      std::int64_t duration;  // Nanoseconds, negative for instants
+      std::int64_t frame;
+    };
+
+    /**
+     * @brief Events of a single thread. The thread is the only writer, the dump reads them without locking.
+     */
+    struct thread_buffer_t {
+      std::uint32_t tid;
+      std::string name;  // Guarded by the mutex of the registry
+      std::atomic_bool retired { false };
+
+      // Position after the last event, published with release semantics once the event is written
+      std::atomic<std::uint64_t> head { 0 };
+      std::unique_ptr<event_t[]> events { new event_t[EVENTS_PER_THREAD] };
+    };
+
+    // Buffers of threads that exited are kept for the next dump, up to this many
+    constexpr std::size_t MAX_RETIRED = 16;
+
+    struct registry_t {
+      std::mutex mutex;
+      std::uint32_t next_tid = 1;
+      std::vector<std::shared_ptr<thread_buffer_t>> buffers;
+    };
+
+    registry_t &
+    registry() {
+      static registry_t registry;
+      return registry;
+    }
+
+    struct thread_handle_t {
+      std::shared_ptr<thread_buffer_t> buffer;
+
+      ~thread_handle_t() {
+        if (buffer) {
+          buffer->retired.store(true, std::memory_order_relaxed);
+        }
+      }
+    };
+
+    thread_buffer_t &
+    this_thread() {
+      thread_local thread_handle_t handle;
+      if (handle.buffer) {
+        return *handle.buffer;
+      }
+
+      auto buffer = std::make_shared<thread_buffer_t>();
+
+      auto &reg = registry();
+      std::lock_guard lg { reg.mutex };
+      buffer->tid = reg.next_tid++;
+      buffer->name = "thread "s + std::to_string(buffer->tid);
+
+      // Threads of sessions come and go, only the latest of those that exited are kept
+      auto retired = std::count_if(std::begin(reg.buffers), std::end(reg.buffers), [](auto &buffer) {
+        return buffer->retired.load(std::memory_order_relaxed);
+      });
+      for (auto it = std::begin(reg.buffers); it != std::end(reg.buffers) && retired >= (std::ptrdiff_t) MAX_RETIRED;) {
+        if ((*it)->retired.load(std::memory_order_relaxed)) {
+          it = reg.buffers.erase(it);
+          --retired;
+        }
+        else {
+          ++it;
+        }
+      }
+      reg.buffers.push_back(buffer);
+
+      handle.buffer = std::move(buffer);
+      return *handle.buffer;
+    }
+
+    void
+    record(const event_t &event) {
+      auto &buffer = this_thread();
+      auto head = buffer.head.load(std::memory_order_relaxed);
+      buffer.events[head % EVENTS_PER_THREAD] = event;
+      buffer.head.store(head + 1, std::memory_order_release);
+    }
+
+    std::int64_t
+    nanoseconds(time_point tp) {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+    }
+
+    /**
+     * @brief Copy the events of a thread that weren't overwritten while copying them.
+     */
+    std::vector<event_t>
+    snapshot(thread_buffer_t &buffer) {
+      auto head = buffer.head.load(std::memory_order_acquire);
+      auto first = head > EVENTS_PER_THREAD ? head - EVENTS_PER_THREAD : 0;
+
+      std::vector<event_t> events;
+      events.reserve(head - first);
+      for (auto x = first; x < head; ++x) {
+        events.push_back(buffer.events[x % EVENTS_PER_THREAD]);
+      }
+
+      // The thread may have wrapped around onto the oldest events meanwhile
+      std::atomic_thread_fence(std::memory_order_acquire);
+      auto new_head = buffer.head.load(std::memory_order_relaxed);
+      if (new_head > first + EVENTS_PER_THREAD) {
+        auto overwritten = std::min<std::uint64_t>(new_head - EVENTS_PER_THREAD - first, events.size());
+        events.erase(std::begin(events), std::begin(events) + overwritten);
+      }
+
+      return events;
+    }
+
+    void
+    write_string(std::ostream &out, std::string_view str) {
+      out << '"';
+      for (auto ch : str) {
+        if (ch == '"' || ch == '\\') {
+          out << '\\' << ch;
+        }
+        else if ((unsigned char) ch >= 0x20) {
+          out << ch;
+        }
+      }
+      out << '"';
+    }
+
+    std::uint32_t
+    process_id() {
+#ifdef _WIN32
+      return GetCurrentProcessId();
+#else
+      return getpid();
+#endif
+    }
+  }  // namespace
+
+  void
+  thread_name(std::string_view name) {
+    auto &buffer = this_thread();
+
+    std::lock_guard lg { registry().mutex };
+    buffer.name = name;
+  }
+
+  void
+  span(const char *name, time_point start, time_point end, std::int64_t frame) {
+    record(event_t { name, nanoseconds(start), nanoseconds(end) - nanoseconds(start), frame });
+  }
+
+  void
+  instant(const char *name, std::int64_t frame) {
+    record(event_t { name, nanoseconds(std::chrono::steady_clock::now()), -1, frame });
+  }
+
+  int
+  dump(const std::string &path) {
+#ifndef SUNSHINE_TRACE
+    BOOST_LOG(warning) << "No trace written to "sv << path << ", the build has no trace points"sv;
+    return -1;
+#else
+    std::vector<std::pair<std::shared_ptr<thread_buffer_t>, std::string>> buffers;
+    {
+      auto &reg = registry();
+      std::lock_guard lg { reg.mutex };
+      for (auto &buffer : reg.buffers) {
+        buffers.emplace_back(buffer, buffer->name);
+      }
+    }
+
+    std::ofstream out { path, std::ios::trunc };
+    if (!out) {
+      BOOST_LOG(error) << "Couldn't open trace file "sv << path;
+      return -1;
+    }
+
+    auto pid = process_id();
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":["sv;
+
+    std::size_t count = 0;
+    bool first = true;
+    for (auto &[buffer, name] : buffers) {
+      out << (first ? ""sv : ","sv) << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":"sv << pid << ",\"tid\":"sv << buffer->tid << ",\"args\":{\"name\":"sv;
+      write_string(out, name);
+      out << "}}"sv;
+      first = false;
+
+      for (auto &event : snapshot(*buffer)) {
+        out << ",\n{\"name\":"sv;
+        write_string(out, event.name);
+        out << ",\"pid\":"sv << pid << ",\"tid\":"sv << buffer->tid << ",\"ts\":"sv << event.start / 1000.0;
+        if (event.duration < 0) {
+          out << ",\"ph\":\"i\",\"s\":\"t\""sv;
+        }
+        else {
+          out << ",\"ph\":\"X\",\"dur\":"sv << event.duration / 1000.0;
+        }
+        if (event.frame != NO_FRAME) {
+          out << ",\"args\":{\"frame\":"sv << event.frame << '}';
+        }
+        out << '}';
+        ++count;
+      }
+    }
+    out << "\n]}\n"sv;
+
+    if (!out) {
+      BOOST_LOG(error) << "Couldn't write trace file "sv << path;
+      return -1;
+    }
+
+    BOOST_LOG(info) << "Wrote "sv << count << " trace events of "sv << buffers.size() << " threads to "sv << path;
+    return 0;
+#endif
+  }
+}  // namespace trace
@@ -0,0 +1,88 @@
+/**
+ * @file src/trace.h
+ * @brief Timeline of the streaming pipeline, written as a Chrome trace that Perfetto opens.
+ * @details Trace points only exist in builds configured with SUNSHINE_ENABLE_TRACE, otherwise
+ *          the macros expand to nothing and their arguments aren't evaluated.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace trace {
+  using time_point = std::chrono::steady_clock::time_point;
+
+  // Events that don't belong to a frame
+  constexpr std::int64_t NO_FRAME = -1;
+
+  // Events kept per thread, the oldest ones are overwritten
+  constexpr std::size_t EVENTS_PER_THREAD = 1 << 15;
+
+  /**
+   * @brief Name of the calling thread in the timeline.
+   */
+  void
+  thread_name(std::string_view name);
+
+  /**
+   * @brief Record that the calling thread spent `start` to `end` in `name`.
+   * @param name A string literal, only the pointer is kept.
+   * @param frame Index of the frame the work belongs to, `NO_FRAME` if none.
+   */
+  void
+  span(const char *name, time_point start, time_point end, std::int64_t frame = NO_FRAME);
+
+  /**
+   * @brief Record that `name` happened on the calling thread just now.
+   */
+  void
+  instant(const char *name, std::int64_t frame = NO_FRAME);
+
+  /**
+   * @brief Records a span from its construction until its destruction.
+   */
+  class scope_t {
+  public:
+    explicit scope_t(const char *name, std::int64_t frame = NO_FRAME):
+        name { name }, frame { frame }, start { std::chrono::steady_clock::now() } {}
+
+    ~scope_t() {
+      span(name, start, std::chrono::steady_clock::now(), frame);
+    }
+
+    scope_t(const scope_t &) = delete;
+    scope_t &
+    operator=(const scope_t &) = delete;
+
+  private:
+    const char *name;
+    std::int64_t frame;
+    time_point start;
+  };
+
+  /**
+   * @brief Write the events of every thread as Chrome trace JSON.
+   * @details Timestamps are microseconds of the steady clock, so traces of the processes of a host can be merged.
+   * @return 0 on success, -1 on error or when the build has no trace points.
+   */
+  int
+  dump(const std::string &path);
+}  // namespace trace
+
+#define TRACE_CONCAT_IMPL(x, y) x##y
+#define TRACE_CONCAT(x, y) TRACE_CONCAT_IMPL(x, y)
+
+#ifdef SUNSHINE_TRACE
+  #define TRACE_THREAD(name) trace::thread_name(name)
+  #define TRACE_SCOPE(...) trace::scope_t TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+  #define TRACE_SPAN(...) trace::span(__VA_ARGS__)
+  #define TRACE_INSTANT(...) trace::instant(__VA_ARGS__)
+#else
+  #define TRACE_THREAD(name) ((void) 0)
+  #define TRACE_SCOPE(...) ((void) 0)
+  #define TRACE_SPAN(...) ((void) 0)
+  #define TRACE_INSTANT(...) ((void) 0)
+#endif
@@ -456,6 +456,62 @@ namespace util {
     return from_chars(std::begin(number), std::end(number));
   }
 
+  /**
+   * @brief Parse a list of CPUs in the format of the Linux sysfs, such as "0-3,8,10-11".
+   * @return The CPUs in ascending order, empty if the list is malformed.
+   */
+  inline std::vector<int>
+  parse_cpu_list(std::string_view list) {
+    std::vector<int> cpus;
+
+    auto number = [&](int &value) {
+      auto begin = list.data();
+      while (!list.empty() && list.front() >= '0' && list.front() <= '9') {
+        list.remove_prefix(1);
+      }
+      if (begin == list.data() || list.data() - begin > 6) {
+        return false;
+      }
+
+      value = (int) from_chars(begin, list.data());
+      return true;
+    };
+
+    while (!list.empty() && list.back() <= ' ') {
+      list.remove_suffix(1);
+    }
+
+    while (!list.empty()) {
+      int first, last;
+      if (!number(first)) {
+        return {};
+      }
+
+      last = first;
+      if (!list.empty() && list.front() == '-') {
+        list.remove_prefix(1);
+        if (!number(last) || last < first) {
+          return {};
+        }
+      }
+
+      for (auto cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+
+      if (!list.empty()) {
+        if (list.front() != ',' || list.size() == 1) {
+          return {};
+        }
+        list.remove_prefix(1);
+      }
+    }
+
+    std::sort(std::begin(cpus), std::end(cpus));
+    cpus.erase(std::unique(std::begin(cpus), std::end(cpus)), std::end(cpus));
+    return cpus;
+  }
+
   template <class X, class Y>
   class Either: public std::variant<std::monostate, X, Y> {
   public:
@@ -810,8 +866,35 @@ namespace util {
     (std::is_same_v<T, bool> || is_pointer_v<T>),
     T, std::optional<T>>;
 
+  /**
+   * @brief Allocation policy of `buffer_t`, value-initialized elements from `new[]`.
+   */
   template <class T>
+  struct new_allocator_t {
+    static T *
+    allocate(size_t elements) {
+      return new T[elements]();
+    }
+
+    static void
+    deallocate(T *data) {
+      delete[] data;
+    }
+  };
+
+  /**
+   * @tparam Allocator Policy with static `T *allocate(size_t)` and `void deallocate(T *)`,
+   *         `memory::allocator_t` gives cache line aligned buffers backed by huge pages.
+   */
+  template <class T, class Allocator = new_allocator_t<T>>
   class buffer_t {
+    struct deleter_t {
+      void
+      operator()(T *data) const {
+        Allocator::deallocate(data);
+      }
+    };
+
   public:
     buffer_t():
         _els { 0 } {};
@@ -820,7 +903,7 @@ namespace util {
       o._els = 0;
     }
     buffer_t(const buffer_t &o):
-        _els { o._els }, _buf { std::make_unique<T[]>(_els) } {
+        _els { o._els }, _buf { Allocator::allocate(_els) } {
       std::copy(o.begin(), o.end(), begin());
     }
     buffer_t &
@@ -832,9 +915,9 @@ namespace util {
     };
 
     explicit buffer_t(size_t elements):
-        _els { elements }, _buf { std::make_unique<T[]>(elements) } {}
+        _els { elements }, _buf { Allocator::allocate(elements) } {}
     explicit buffer_t(size_t elements, const T &t):
-        _els { elements }, _buf { std::make_unique<T[]>(elements) } {
+        _els { elements }, _buf { Allocator::allocate(elements) } {
       std::fill_n(_buf.get(), elements, t);
     }
 
@@ -880,7 +963,7 @@ namespace util {
 
   private:
     size_t _els;
-    std::unique_ptr<T[]> _buf;
+    std::unique_ptr<T[], deleter_t> _buf;
   };
 
   template <class T>
@@ -4,10 +4,20 @@
  */
 #include <atomic>
 #include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
 #include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <thread>
 
 #include <boost/pointer_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 extern "C" {
 #include <libavutil/imgutils.h>
@@ -18,19 +28,28 @@ extern "C" {
 
 #include "cbs.h"
 #include "config.h"
+#include "focus.h"
 #include "globals.h"
 #include "input.h"
 #include "logging.h"
 #include "nvenc/nvenc_base.h"
+#include "overload.h"
 #include "platform/common.h"
+#include "scheduler.h"
 #include "sync.h"
+#include "test_pattern.h"
+#include "trace.h"
+#include "version.h"
 #include "video.h"
+#include "yuv.h"
 
 #ifdef _WIN32
 #include <Windows.h>
 extern "C" {
   #include <libavutil/hwcontext_d3d11va.h>
 }
+
+#include "amf/amf_base.h"
 #endif
 
 // #define ALLOW_SW_ENCODER
@@ -92,6 +111,8 @@ namespace video {
   util::Either<avcodec_buffer_t, int>
   cuda_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *);
   util::Either<avcodec_buffer_t, int>
+  vulkan_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *);
+  util::Either<avcodec_buffer_t, int>
   vt_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *);
 
   class avcodec_software_encode_device_t: public platf::avcodec_encode_device_t {
@@ -101,11 +122,17 @@ namespace video {
       // If we need to add aspect ratio padding, we need to scale into an intermediate output buffer
       bool requires_padding = (sw_frame->width != sws_output_frame->width || sw_frame->height != sws_output_frame->height);
 
+      if (yuv_layout) {
+        yuv::convert(*yuv_layout, yuv_coefficients, img.data, img.row_pitch, sw_frame->data, sw_frame->linesize, sw_frame->width, sw_frame->height);
+        return transfer_frame();
+      }
+
       // Setup the input frame using the caller's img_t
       sws_input_frame->data[0] = img.data;
       sws_input_frame->linesize[0] = img.row_pitch;
 
-      // Perform color conversion and scaling to the final size
+      // Perform color conversion and scaling to the final size, the slices are spread over the threads of the SwsContext.
+      // With aspect ratio padding, sws_output_frame is a view of the picture area inside of the padded frame.
       auto status = sws_scale_frame(sws.get(), requires_padding ? sws_output_frame.get() : sw_frame.get(), sws_input_frame.get());
       if (status < 0) {
         char string[AV_ERROR_MAX_STRING_SIZE];
@@ -113,24 +140,11 @@ namespace video {
         return -1;
       }
 
-      // If we require aspect ratio padding, copy the output frame into the final padded frame
-      if (requires_padding) {
-        auto fmt_desc = av_pix_fmt_desc_get((AVPixelFormat) sws_output_frame->format);
-        auto planes = av_pix_fmt_count_planes((AVPixelFormat) sws_output_frame->format);
-        for (int plane = 0; plane < planes; plane++) {
-          auto shift_h = plane == 0 ? 0 : fmt_desc->log2_chroma_h;
-          auto shift_w = plane == 0 ? 0 : fmt_desc->log2_chroma_w;
-          auto offset = ((offsetW >> shift_w) * fmt_desc->comp[plane].step) + (offsetH >> shift_h) * sw_frame->linesize[plane];
-
-          // Copy line-by-line to preserve leading padding for each row
-          for (int line = 0; line < sws_output_frame->height >> shift_h; line++) {
-            memcpy(sw_frame->data[plane] + offset + (line * sw_frame->linesize[plane]),
-              sws_output_frame->data[plane] + (line * sws_output_frame->linesize[plane]),
-              (size_t) (sws_output_frame->width >> shift_w) * fmt_desc->comp[plane].step);
-          }
-        }
-      }
+      return transfer_frame();
+    }
 
+    int
+    transfer_frame() {
       // If frame is not a software frame, it means we still need to transfer from main memory
       // to vram memory
       if (frame->hw_frames_ctx) {
@@ -159,7 +173,7 @@ namespace video {
         sw_frame.reset(frame);
       }
 
-      return 0;
+      return map_output_frame();
     }
 
     void
@@ -169,6 +183,65 @@ namespace video {
         sws_getCoefficients(SWS_CS_DEFAULT), 0,
         sws_getCoefficients(avcodec_colorspace.software_format), avcodec_colorspace.range - 1,
         0, 1 << 16, 1 << 16);
+
+      yuv_coefficients = yuv::coefficients(*color_vectors_from_colorspace(colorspace));
+    }
+
+    /**
+     * @brief The layouts the converters of yuv.h write, without scaling.
+     */
+    static std::optional<yuv::layout_e>
+    yuv_layout_from_format(AVPixelFormat format) {
+      switch (format) {
+        case AV_PIX_FMT_NV12:
+          return yuv::layout_e::nv12;
+        case AV_PIX_FMT_YUV420P:
+          return yuv::layout_e::i420;
+        case AV_PIX_FMT_YUV444P:
+          return yuv::layout_e::i444;
+        default:
+          return std::nullopt;
+      }
+    }
+
+    /**
+     * @brief Time the converters of yuv.h against swscale on a blank image, and keep them if they are faster.
+     */
+    void
+    select_converter(int in_width, int in_height) {
+      auto target = sw_frame ? sw_frame.get() : this->frame;
+
+      std::vector<std::uint8_t> image(in_width * in_height * 4);
+      sws_input_frame->data[0] = image.data();
+      sws_input_frame->linesize[0] = in_width * 4;
+
+      auto coefficients = yuv::coefficients(*color_vectors_from_colorspace(colorspace_e::rec709, false));
+
+      // The best of a few runs, after one to warm up the caches
+      auto time = [](auto &&convert) {
+        convert();
+
+        auto best = std::chrono::steady_clock::duration::max();
+        for (int x = 0; x < 3; ++x) {
+          auto start = std::chrono::steady_clock::now();
+          convert();
+          best = std::min(best, std::chrono::steady_clock::now() - start);
+        }
+
+        return std::chrono::duration_cast<std::chrono::microseconds>(best);
+      };
+
+      auto sws_time = time([&]() {
+        sws_scale_frame(sws.get(), target, sws_input_frame.get());
+      });
+      auto yuv_time = time([&]() {
+        yuv::convert(*yuv_layout, coefficients, image.data(), in_width * 4, target->data, target->linesize, in_width, in_height);
+      });
+
+      BOOST_LOG(info) << "Color conversion takes "sv << yuv_time.count() << "us with the "sv << yuv::kernel_name() << " converter and "sv << sws_time.count() << "us with swscale"sv;
+      if (yuv_time >= sws_time) {
+        yuv_layout.reset();
+      }
     }
 
     /**
@@ -183,8 +256,42 @@ namespace video {
       av_image_fill_black(frame->data, linesize, (AVPixelFormat) frame->format, frame->color_range, frame->width, frame->height);
     }
 
+    /**
+     * When preserving aspect ratio, point the output frame at the picture area of the padded frame,
+     * so the scaler writes the final frame directly instead of an intermediate copy
+     */
+    int
+    map_output_frame() {
+      if (sw_frame->width == sws_output_frame->width && sw_frame->height == sws_output_frame->height) {
+        return 0;
+      }
+
+      auto fmt_desc = av_pix_fmt_desc_get((AVPixelFormat) sws_output_frame->format);
+      auto planes = av_pix_fmt_count_planes((AVPixelFormat) sws_output_frame->format);
+      for (int plane = 0; plane < planes; plane++) {
+        auto shift_h = plane == 0 ? 0 : fmt_desc->log2_chroma_h;
+        auto shift_w = plane == 0 ? 0 : fmt_desc->log2_chroma_w;
+        auto offset = ((offsetW >> shift_w) * fmt_desc->comp[plane].step) + (offsetH >> shift_h) * sw_frame->linesize[plane];
+
+        sws_output_frame->data[plane] = sw_frame->data[plane] + offset;
+        sws_output_frame->linesize[plane] = sw_frame->linesize[plane];
+      }
+
+      // sws_scale_frame() allocates a destination without buffers, so the view holds a reference to the padded frame
+      av_buffer_unref(&sws_output_frame->buf[0]);
+      sws_output_frame->buf[0] = av_buffer_ref(sw_frame->buf[0]);
+      if (!sws_output_frame->buf[0]) {
+        return -1;
+      }
+
+      return 0;
+    }
+
+    /**
+     * @param threads Slices the color conversion is split into, each runs on a thread of its own.
+     */
     int
-    init(int in_width, int in_height, AVFrame *frame, AVPixelFormat format, bool hardware) {
+    init(int in_width, int in_height, AVFrame *frame, AVPixelFormat format, bool hardware, int threads) {
       // If the device used is hardware, yet the image resides on main memory
       if (hardware) {
         sw_frame.reset(av_frame_alloc());
@@ -235,7 +342,7 @@ namespace video {
       av_dict_set_int(&options, "dsth", sws_output_frame->height, 0);
       av_dict_set_int(&options, "dst_format", sws_output_frame->format, 0);
       av_dict_set_int(&options, "sws_flags", SWS_LANCZOS | SWS_ACCURATE_RND, 0);
-      av_dict_set_int(&options, "threads", config::video.min_threads, 0);
+      av_dict_set_int(&options, "threads", threads, 0);
 
       auto status = av_opt_set_dict(sws.get(), &options);
       av_dict_free(&options);
@@ -252,6 +359,14 @@ namespace video {
         return -1;
       }
 
+      // Without scaling, dedicated converters may beat the generic path of swscale
+      if (in_width == frame->width && in_height == frame->height) {
+        yuv_layout = yuv_layout_from_format(format);
+        if (yuv_layout) {
+          select_converter(in_width, in_height);
+        }
+      }
+
       return 0;
     }
 
@@ -263,6 +378,10 @@ namespace video {
     avcodec_frame_t sws_output_frame;
     sws_t sws;
 
+    // Set when the converters of yuv.h replace swscale
+    std::optional<yuv::layout_e> yuv_layout;
+    yuv::coefficients_t yuv_coefficients;
+
     // Offset of input image to output frame in pixels
     int offsetW;
     int offsetH;
@@ -280,8 +399,153 @@ namespace video {
     REF_FRAMES_INVALIDATION = 1 << 8,  ///< Support reference frames invalidation
     ALWAYS_REPROBE = 1 << 9,  ///< This is an encoder of last resort and we want to aggressively probe for a better one
     YUV444_SUPPORT = 1 << 10,  ///< Encoder may support 4:4:4 chroma sampling depending on hardware
+    DYNAMIC_BITRATE = 1 << 11,  ///< Encoder picks up rate control changes on an open codec context
   };
 
+  /**
+   * @brief Set the rate control options of a codec context.
+   * @param ctx The codec context.
+   * @param encoder The encoder the context belongs to.
+   * @param config The requested bitrate and framerate.
+   * @param encoder_framerate The framerate the context was opened with. The bitrate is scaled
+   *                          so the budget of each frame matches the requested framerate.
+   * @param hardware Whether the encoder is a hardware encoder.
+   */
+  void
+  set_rate_control(AVCodecContext *ctx, const encoder_t &encoder, const config_t &config, int encoder_framerate, bool hardware) {
+    auto bitrate = (int64_t) config.bitrate * 1000 * encoder_framerate / config.framerate;
+    ctx->rc_max_rate = bitrate;
+    ctx->bit_rate = bitrate;
+
+    if (encoder.flags & CBR_WITH_VBR) {
+      // Ensure rc_max_bitrate != bit_rate to force VBR mode
+      ctx->bit_rate--;
+    }
+    else {
+      ctx->rc_min_rate = bitrate;
+    }
+
+    if (!(encoder.flags & NO_RC_BUF_LIMIT)) {
+      if (!hardware && (ctx->slices > 1 || config.videoFormat == 1)) {
+        // Use a larger rc_buffer_size for software encoding when slices are enabled,
+        // because libx264 can severely degrade quality if the buffer is too small.
+        // libx265 encounters this issue more frequently, so always scale the
+        // buffer by 1.5x for software HEVC encoding.
+        ctx->rc_buffer_size = bitrate / ((encoder_framerate * 10) / 15);
+      }
+      else {
+        ctx->rc_buffer_size = bitrate / encoder_framerate;
+
+#ifndef __APPLE__
+        if (encoder.name == "nvenc" && config::video.nv_legacy.vbv_percentage_increase > 0) {
+          ctx->rc_buffer_size += ctx->rc_buffer_size * config::video.nv_legacy.vbv_percentage_increase / 100;
+        }
+#endif
+      }
+    }
+  }
+
+  void
+  packet_raw_avcodec::recycle() {
+    if (!pool) {
+      delete this;
+      return;
+    }
+
+    // The pool may be gone once the last packet is back, so hold on to it until then
+    auto owner = std::move(pool);
+    owner->give_back(this);
+  }
+
+  avcodec_packet_pool_t::avcodec_packet_pool_t(std::size_t max_packets):
+      max_packets { max_packets } {
+    free_packets.reserve(max_packets);
+  }
+
+  avcodec_packet_pool_t::~avcodec_packet_pool_t() {
+    for (auto packet : free_packets) {
+      delete packet;
+    }
+  }
+
+  avcodec_packet_pool_t::packet_ptr
+  avcodec_packet_pool_t::acquire() {
+    packet_raw_avcodec *packet = nullptr;
+    std::size_t free_count;
+    {
+      std::lock_guard lg { mutex };
+
+      if (!free_packets.empty()) {
+        packet = free_packets.back();
+        free_packets.pop_back();
+      }
+      free_count = free_packets.size();
+    }
+
+    if (config::sunshine.min_log_level <= 1) {
+      // Print packet pool stats to debug log every 20 seconds
+      auto callback = [&](double stat_min, double stat_max, double stat_avg) {
+        auto f = stat_trackers::one_digit_after_decimal();
+        BOOST_LOG(debug) << "Encoder: free pooled packets (min max avg) " << f % stat_min << " " << f % stat_max << " " << f % stat_avg;
+      };
+      free_packets_tracker.collect_and_callback_on_interval(free_count, callback, 20s);
+    }
+
+    if (!packet) {
+      packet = new packet_raw_avcodec;
+    }
+    packet->pool = shared_from_this();
+
+    return packet_ptr { packet };
+  }
+
+  void
+  avcodec_packet_pool_t::give_back(packet_raw_avcodec *packet) {
+    av_packet_unref(packet->av_packet);
+    packet->replacements = nullptr;
+    packet->channel_data = nullptr;
+    packet->after_ref_frame_invalidation = false;
+    packet->frame_timestamp.reset();
+    packet->timing = {};
+
+    {
+      std::lock_guard lg { mutex };
+      if (free_packets.size() < max_packets) {
+        free_packets.push_back(packet);
+        return;
+      }
+    }
+
+    delete packet;
+  }
+
+  /**
+   * @brief `AVCodecContext::get_encode_buffer` callback that hands out slabs of the pool in `ctx->opaque`.
+   * @details Only encoders with `AV_CODEC_CAP_DR1` call it, the others keep allocating their own packets.
+   */
+  int
+  get_pooled_encode_buffer(AVCodecContext *ctx, AVPacket *pkt, int flags) {
+    auto pool = (buffer_pool::pool_t *) ctx->opaque;
+
+    auto slab = pool->acquire(pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!slab) {
+      return AVERROR(ENOMEM);
+    }
+    std::memset(slab.data() + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    auto data = slab.data();
+    auto free_slab = [](void *opaque, uint8_t *) {
+      buffer_pool::pool_t::recycle(opaque);
+    };
+    pkt->buf = av_buffer_create(data, slab.size(), free_slab, slab.release(), 0);
+    if (!pkt->buf) {
+      return AVERROR(ENOMEM);
+    }
+    pkt->data = data;
+
+    return 0;
+  }
+
   class avcodec_encode_session_t: public encode_session_t {
   public:
     avcodec_encode_session_t() = default;
@@ -301,10 +565,15 @@ namespace video {
       device = std::move(other.device);
       avcodec_ctx = std::move(other.avcodec_ctx);
       replacements = std::move(other.replacements);
-      sps = std::move(other.sps);
-      vps = std::move(other.vps);
+      parameter_sets = std::move(other.parameter_sets);
 
       inject = other.inject;
+      encoder = other.encoder;
+      config = other.config;
+      hardware = other.hardware;
+      intra_refresh = other.intra_refresh;
+      packet_pool = std::move(other.packet_pool);
+      av_packet_pool = std::move(other.av_packet_pool);
 
       return *this;
     }
@@ -312,7 +581,42 @@ namespace video {
     int
     convert(platf::img_t &img) override {
       if (!device) return -1;
-      return device->convert(img);
+      if (auto ret = device->convert(img)) {
+        return ret;
+      }
+
+      set_focus(focus::regions(img, device->frame->width, device->frame->height));
+      return 0;
+    }
+
+    /**
+     * @brief Attach the focus regions to the frame as regions of interest, encoders without ROI support ignore them.
+     */
+    void
+    set_focus(const std::vector<focus::region_t> &regions) {
+      auto frame = device->frame;
+      av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+      if (regions.empty()) {
+        return;
+      }
+
+      auto side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, regions.size() * sizeof(AVRegionOfInterest));
+      if (!side_data) {
+        return;
+      }
+
+      auto roi = (AVRegionOfInterest *) side_data->data;
+      for (std::size_t x = 0; x < regions.size(); ++x) {
+        auto &rect = regions[x].rect;
+        roi[x].self_size = sizeof(AVRegionOfInterest);
+        roi[x].top = rect.top;
+        roi[x].bottom = rect.bottom;
+        roi[x].left = rect.left;
+        roi[x].right = rect.right;
+
+        // The offset is a fraction of the QP range, 51 for H.264 and HEVC
+        roi[x].qoffset = av_make_q(regions[x].qp_delta, 51);
+      }
     }
 
     void
@@ -333,10 +637,38 @@ namespace video {
       }
     }
 
+    bool
+    request_intra_refresh() override {
+      // The waves repeat on their own, the next one repairs the picture
+      return intra_refresh;
+    }
+
     void
     invalidate_ref_frames(int64_t first_frame, int64_t last_frame) override {
       BOOST_LOG(error) << "Encoder doesn't support reference frame invalidation";
-      request_idr_frame();
+      if (!request_intra_refresh()) {
+        request_idr_frame();
+      }
+    }
+
+    bool
+    reconfigure(int bitrate, int framerate) override {
+      if (!avcodec_ctx || !encoder || !(encoder->flags & DYNAMIC_BITRATE)) {
+        return false;
+      }
+
+      // The context keeps the framerate it was opened with, only the rate control changes
+      config.bitrate = bitrate;
+      config.framerate = framerate;
+      set_rate_control(avcodec_ctx.get(), *encoder, config, avcodec_ctx->framerate.num, hardware);
+
+      return true;
+    }
+
+    bool
+    set_content(content::content_e content) override {
+      // The options of an open context are fixed
+      return false;
     }
 
     avcodec_ctx_t avcodec_ctx;
@@ -344,11 +676,25 @@ namespace video {
 
     std::vector<packet_raw_t::replace_t> replacements;
 
-    cbs::nal_t sps;
-    cbs::nal_t vps;
+    // Shared with the sessions of the same encoder, codec, resolution and colorspace
+    std::shared_ptr<const cbs::parameter_sets_t> parameter_sets;
 
-    // inject sps/vps data into idr pictures
+    // inject sps/vps data or the AV1 sequence header into idr pictures
     int inject;
+
+    // Needed to change the rate control of the open context
+    const encoder_t *encoder = nullptr;
+    config_t config {};
+    bool hardware = false;
+
+    // The codec refreshes the picture with continuous intra-refresh waves
+    bool intra_refresh = false;
+
+    // Backs the packets of the context through get_pooled_encode_buffer()
+    std::shared_ptr<buffer_pool::pool_t> packet_pool;
+
+    // Recycled packet_raw_avcodec objects for encode_avcodec()
+    std::shared_ptr<avcodec_packet_pool_t> av_packet_pool = std::make_shared<avcodec_packet_pool_t>(buffer_pool::ENCODER_SLABS);
   };
 
   class nvenc_encode_session_t: public encode_session_t {
@@ -357,10 +703,29 @@ namespace video {
         device(std::move(encode_device)) {
     }
 
+    ~nvenc_encode_session_t() {
+      // The retrieval thread uses the encoder, so it must be gone before the device
+      if (retrieval_thread.joinable()) {
+        {
+          std::lock_guard lg { pending_mutex };
+          stop_retrieval = true;
+        }
+        pending_cv.notify_all();
+        retrieval_thread.join();
+      }
+    }
+
     int
     convert(platf::img_t &img) override {
       if (!device) return -1;
-      return device->convert(img);
+      if (auto ret = device->convert(img)) {
+        return ret;
+      }
+
+      if (device->nvenc) {
+        device->nvenc->add_focus(img);
+      }
+      return 0;
     }
 
     void
@@ -373,28 +738,224 @@ namespace video {
       force_idr = false;
     }
 
+    bool
+    request_intra_refresh() override {
+      if (!device || !device->nvenc) return false;
+
+      return device->nvenc->request_intra_refresh();
+    }
+
     void
     invalidate_ref_frames(int64_t first_frame, int64_t last_frame) override {
       if (!device || !device->nvenc) return;
 
-      if (!device->nvenc->invalidate_ref_frames(first_frame, last_frame)) {
+      if (!device->nvenc->invalidate_ref_frames(first_frame, last_frame) && !request_intra_refresh()) {
+        force_idr = true;
+      }
+    }
+
+    bool
+    reconfigure(int bitrate, int framerate) override {
+      if (!device || !device->nvenc) return false;
+
+      return device->nvenc->reconfigure(bitrate, framerate);
+    }
+
+    bool
+    set_content(content::content_e content) override {
+      if (!device || !device->nvenc) return false;
+
+      return device->nvenc->set_screen_content(content == content::content_e::screen);
+    }
+
+    nvenc::nvenc_encoded_frame
+    encode_frame(uint64_t frame_index) {
+      if (!device || !device->nvenc) return {};
+
+      auto result = device->nvenc->encode_frame(frame_index, force_idr);
+      force_idr = false;
+      return result;
+    }
+
+    bool
+    slice_output() const {
+      return device && device->nvenc && device->nvenc->slice_output();
+    }
+
+    bool
+    encode_frame_in_slices(uint64_t frame_index, const std::function<void(nvenc::nvenc_encoded_frame &&)> &on_slice) {
+      if (!device || !device->nvenc) return false;
+
+      auto result = device->nvenc->encode_frame_in_slices(frame_index, force_idr, on_slice);
+      force_idr = false;
+      return result;
+    }
+
+    uint32_t
+    async_depth() const {
+      if (!device || !device->nvenc) return 1;
+
+      return device->nvenc->async_depth();
+    }
+
+    /**
+     * @brief Submit a frame to the encoder, the retrieval thread raises the packet once it is encoded.
+     * @details Blocks while every slot of the encoder is in flight.
+     * @return 0 on success, -1 on error.
+     */
+    int
+    submit_frame(uint64_t frame_index, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp, const latency::frame_timing_t &timing) {
+      if (!device || !device->nvenc) return -1;
+
+      std::unique_lock ul { pending_mutex };
+      if (!retrieval_thread.joinable()) {
+        retrieval_thread = std::thread { &nvenc_encode_session_t::retrieve_frames, this, packets };
+      }
+
+      auto depth = device->nvenc->async_depth();
+      if (!pending_cv.wait_for(ul, 1s, [&] { return retrieval_failed || pending.size() < depth; })) {
+        BOOST_LOG(error) << "NvENC async encode stalled"sv;
+        return -1;
+      }
+      if (retrieval_failed) {
+        return -1;
+      }
+
+      if (!device->nvenc->submit_frame(frame_index, force_idr)) {
+        return -1;
+      }
+      force_idr = false;
+
+      pending.push_back({ frame_index, channel_data, frame_timestamp, timing });
+      ul.unlock();
+      pending_cv.notify_all();
+
+      return 0;
+    }
+
+  private:
+    struct pending_frame_t {
+      uint64_t frame_index;
+      void *channel_data;
+      std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
+      latency::frame_timing_t timing;
+    };
+
+    void
+    retrieve_frames(safe::mail_raw_t::queue_t<packet_t> packets) {
+      while (true) {
+        pending_frame_t frame;
+        {
+          std::unique_lock ul { pending_mutex };
+          pending_cv.wait(ul, [&] { return stop_retrieval || !pending.empty(); });
+          if (stop_retrieval) return;
+
+          frame = pending.front();
+        }
+
+        auto encoded_frame = device->nvenc->retrieve_frame(100);
+        if (encoded_frame.data.empty()) {
+          BOOST_LOG(error) << "NvENC returned empty packet";
+          {
+            std::lock_guard lg { pending_mutex };
+            retrieval_failed = true;
+          }
+          pending_cv.notify_all();
+          return;
+        }
+
+        if (frame.frame_index != encoded_frame.frame_index) {
+          BOOST_LOG_LIMITED(error) << "NvENC frame index mismatch " << frame.frame_index << " " << encoded_frame.frame_index;
+        }
+
+        auto packet = std::make_unique<packet_raw_pooled>(std::move(encoded_frame.data), encoded_frame.frame_index, encoded_frame.idr);
+        packet->channel_data = frame.channel_data;
+        packet->after_ref_frame_invalidation = encoded_frame.after_ref_frame_invalidation;
+        packet->temporal_layer = encoded_frame.temporal_layer;
+        packet->temporal_layers = encoded_frame.temporal_layers;
+        packet->frame_timestamp = frame.frame_timestamp;
+        packet->timing = frame.timing;
+        packet->timing.encode_complete = std::chrono::steady_clock::now();
+        packets->raise(std::move(packet));
+
+        {
+          std::lock_guard lg { pending_mutex };
+          pending.pop_front();
+        }
+        pending_cv.notify_all();
+      }
+    }
+
+    std::unique_ptr<platf::nvenc_encode_device_t> device;
+    bool force_idr = false;
+
+    // Frames in flight on the encoder in async mode, guarded by pending_mutex
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    std::deque<pending_frame_t> pending;
+    bool stop_retrieval = false;
+    bool retrieval_failed = false;
+    std::thread retrieval_thread;
+  };
+
+#ifdef _WIN32
+  class amf_encode_session_t: public encode_session_t {
+  public:
+    amf_encode_session_t(std::unique_ptr<platf::amf_encode_device_t> encode_device):
+        device(std::move(encode_device)) {
+    }
+
+    int
+    convert(platf::img_t &img) override {
+      if (!device) return -1;
+      return device->convert(img);
+    }
+
+    void
+    request_idr_frame() override {
+      force_idr = true;
+    }
+
+    void
+    request_normal_frame() override {
+      force_idr = false;
+    }
+
+    void
+    invalidate_ref_frames(int64_t first_frame, int64_t last_frame) override {
+      if (!device || !device->amf) return;
+
+      if (!device->amf->invalidate_ref_frames(first_frame, last_frame)) {
         force_idr = true;
       }
     }
 
-    nvenc::nvenc_encoded_frame
+    bool
+    reconfigure(int bitrate, int framerate) override {
+      if (!device || !device->amf) return false;
+
+      return device->amf->reconfigure(bitrate, framerate);
+    }
+
+    bool
+    set_content(content::content_e content) override {
+      return false;
+    }
+
+    amfenc::amf_encoded_frame
     encode_frame(uint64_t frame_index) {
-      if (!device || !device->nvenc) return {};
+      if (!device || !device->amf) return {};
 
-      auto result = device->nvenc->encode_frame(frame_index, force_idr);
+      auto result = device->amf->encode_frame(frame_index, force_idr);
       force_idr = false;
       return result;
     }
 
   private:
-    std::unique_ptr<platf::nvenc_encode_device_t> device;
+    std::unique_ptr<platf::amf_encode_device_t> device;
     bool force_idr = false;
   };
+#endif
 
   struct sync_session_ctx_t {
     safe::signal_t *join_event;
@@ -403,6 +964,7 @@ namespace video {
     safe::mail_raw_t::event_t<bool> idr_events;
     safe::mail_raw_t::event_t<hdr_info_t> hdr_events;
     safe::mail_raw_t::event_t<input::touch_port_t> touch_port_events;
+    safe::mail_raw_t::event_t<encoding_t> encoding_events;
 
     config_t* config;
     int frame_nr;
@@ -412,6 +974,7 @@ namespace video {
   struct sync_session_t {
     sync_session_ctx_t *ctx;
     std::unique_ptr<encode_session_t> session;
+    std::optional<content::classifier_t> classifier;
   };
 
   using encode_session_ctx_queue_t = safe::queue_t<sync_session_ctx_t>;
@@ -445,15 +1008,38 @@ namespace video {
   end_capture_async(capture_thread_async_ctx_t &ctx);
 
   // Keep a reference counter to ensure the capture thread only runs when other threads have a reference to the capture thread
-  auto capture_thread_async = safe::make_shared<capture_thread_async_ctx_t>(start_capture_async, end_capture_async);
   auto capture_thread_sync = safe::make_shared<capture_thread_sync_ctx_t>(start_capture_sync, end_capture_sync);
 
-#ifdef _WIN32
+  // Every display has a capture thread of its own, the encoders pick the frames of their display from it.
+  // Entries stay after their thread ended, the next session of the display starts it again.
+  std::mutex capture_threads_async_mutex;
+  std::map<std::string, safe::shared_t<capture_thread_async_ctx_t>> capture_threads_async;
+
+  /**
+   * @brief Reference the capture thread of the display of a session, starting it for the first session.
+   */
+  safe::shared_t<capture_thread_async_ctx_t>::ptr_t
+  ref_capture_thread_async(const config_t &config) {
+    auto display_name = config.display.value_or(config::video.output_name);
+
+    std::lock_guard lg { capture_threads_async_mutex };
+    auto capture_thread = capture_threads_async.try_emplace(display_name, start_capture_async, end_capture_async).first;
+    return capture_thread->second.ref();
+  }
+
+#if defined(_WIN32) || defined(SUNSHINE_BUILD_CUDA)
+  // Driven through nvenc_base directly, on Linux the CUDA conversion writes into the input of the encoder
   encoder_t nvenc {
     "nvenc"sv,
     std::make_unique<encoder_platform_formats_nvenc>(
+  #ifdef _WIN32
       platf::mem_type_e::dxgi,
       platf::pix_fmt_e::nv12, platf::pix_fmt_e::p010),
+  #else
+      platf::mem_type_e::cuda,
+      platf::pix_fmt_e::nv12, platf::pix_fmt_e::p010,
+      platf::pix_fmt_e::yuv444p, platf::pix_fmt_e::yuv444p16),
+  #endif
     {
       {},  // Common options
       {},  // SDR-specific options
@@ -481,7 +1067,11 @@ namespace video {
       {},  // Fallback options
       "h264_nvenc"s,
     },
+  #ifdef _WIN32
     PARALLEL_ENCODING | REF_FRAMES_INVALIDATION  // flags
+  #else
+    PARALLEL_ENCODING | REF_FRAMES_INVALIDATION | YUV444_SUPPORT  // flags
+  #endif
   };
 #elif !defined(__APPLE__)
   encoder_t nvenc {
@@ -572,7 +1162,7 @@ namespace video {
       {},  // Fallback options
       "h264_nvenc"s,
     },
-    PARALLEL_ENCODING
+    PARALLEL_ENCODING | DYNAMIC_BITRATE
   };
 #endif
 
@@ -676,7 +1266,43 @@ namespace video {
       },
       "h264_qsv"s,
     },
-    PARALLEL_ENCODING | CBR_WITH_VBR | RELAXED_COMPLIANCE | NO_RC_BUF_LIMIT | YUV444_SUPPORT
+    PARALLEL_ENCODING | CBR_WITH_VBR | RELAXED_COMPLIANCE | NO_RC_BUF_LIMIT | YUV444_SUPPORT | DYNAMIC_BITRATE
+  };
+
+  // Driven through amf_base directly, the names match the FFmpeg codecs so the AMD GPU checks apply to both
+  encoder_t amf_native {
+    "amf"sv,
+    std::make_unique<encoder_platform_formats_amf>(
+      platf::mem_type_e::dxgi,
+      platf::pix_fmt_e::nv12, platf::pix_fmt_e::p010),
+    {
+      {},  // Common options
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // YUV444 SDR-specific options
+      {},  // YUV444 HDR-specific options
+      {},  // Fallback options
+      "av1_amf"s,
+    },
+    {
+      {},  // Common options
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // YUV444 SDR-specific options
+      {},  // YUV444 HDR-specific options
+      {},  // Fallback options
+      "hevc_amf"s,
+    },
+    {
+      {},  // Common options
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // YUV444 SDR-specific options
+      {},  // YUV444 HDR-specific options
+      {},  // Fallback options
+      "h264_amf"s,
+    },
+    PARALLEL_ENCODING | REF_FRAMES_INVALIDATION  // flags
   };
 
   encoder_t amdvce {
@@ -781,7 +1407,10 @@ namespace video {
       {},  // HDR-specific options
       {},  // YUV444 SDR-specific options
       {},  // YUV444 HDR-specific options
-      {},  // Fallback options
+      {
+        // Fallback options
+        { "low_power"s, 0 },  // The driver advertises the low-power entrypoint, yet it can't encode with these settings
+      },
       "av1_vaapi"s,
     },
     {
@@ -795,7 +1424,10 @@ namespace video {
       {},  // HDR-specific options
       {},  // YUV444 SDR-specific options
       {},  // YUV444 HDR-specific options
-      {},  // Fallback options
+      {
+        // Fallback options
+        { "low_power"s, 0 },  // The driver advertises the low-power entrypoint, yet it can't encode with these settings
+      },
       "hevc_vaapi"s,
     },
     {
@@ -809,89 +1441,366 @@ namespace video {
       {},  // HDR-specific options
       {},  // YUV444 SDR-specific options
       {},  // YUV444 HDR-specific options
-      {},  // Fallback options
+      {
+        // Fallback options
+        { "low_power"s, 0 },  // The driver advertises the low-power entrypoint, yet it can't encode with these settings
+      },
       "h264_vaapi"s,
     },
     LIMITED_GOP_SIZE | PARALLEL_ENCODING | SINGLE_SLICE_ONLY | NO_RC_BUF_LIMIT
   };
 #endif
 
-#ifdef __APPLE__
-  encoder_t videotoolbox {
-    "videotoolbox"sv,
-    std::make_unique<encoder_platform_formats_avcodec>(
-      AV_HWDEVICE_TYPE_VIDEOTOOLBOX, AV_HWDEVICE_TYPE_NONE,
-      AV_PIX_FMT_VIDEOTOOLBOX,
-      AV_PIX_FMT_NV12, AV_PIX_FMT_P010,
-      AV_PIX_FMT_NONE, AV_PIX_FMT_NONE,
-      vt_init_avcodec_hardware_input_buffer),
-    {
-      // Common options
-      {
-        { "allow_sw"s, &config::video.vt.vt_allow_sw },
-        { "require_sw"s, &config::video.vt.vt_require_sw },
-        { "realtime"s, &config::video.vt.vt_realtime },
-        { "prio_speed"s, 1 },
-      },
-      {},  // SDR-specific options
-      {},  // HDR-specific options
-      {},  // Fallback options
-      std::nullopt,
-      "av1_videotoolbox"s,
-    },
-    {
-      // Common options
-      {
-        { "allow_sw"s, &config::video.vt.vt_allow_sw },
-        { "require_sw"s, &config::video.vt.vt_require_sw },
-        { "realtime"s, &config::video.vt.vt_realtime },
-        { "prio_speed"s, 1 },
-      },
-      {},  // SDR-specific options
-      {},  // HDR-specific options
-      {},  // Fallback options
-      std::nullopt,
-      "hevc_videotoolbox"s,
-    },
-    {
-      // Common options
-      {
-        { "allow_sw"s, &config::video.vt.vt_allow_sw },
-        { "require_sw"s, &config::video.vt.vt_require_sw },
-        { "realtime"s, &config::video.vt.vt_realtime },
-        { "prio_speed"s, 1 },
-      },
-      {},  // SDR-specific options
-      {},  // HDR-specific options
-      {},  // Fallback options
-      std::nullopt,
-      "h264_videotoolbox"s,
-    },
-    DEFAULT
-  };
-#endif
+#ifdef SUNSHINE_BUILD_VULKAN
+  // Vulkan Video through FFmpeg, the device is derived from the DRM device of the render node
+  encoder_t vulkan {
+    "vulkan"sv,
+    std::make_unique<encoder_platform_formats_avcodec>(
+      AV_HWDEVICE_TYPE_DRM, AV_HWDEVICE_TYPE_VULKAN,
+      AV_PIX_FMT_VULKAN,
+      AV_PIX_FMT_NV12, AV_PIX_FMT_P010,
+      AV_PIX_FMT_NONE, AV_PIX_FMT_NONE,
+      vulkan_init_avcodec_hardware_input_buffer),
+    {
+      // Common options
+      {
+        { "async_depth"s, 1 },
+        { "tune"s, "ull"s },
+        { "usage"s, "stream"s },
+        { "content"s, "rendered"s },
+      },
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // YUV444 SDR-specific options
+      {},  // YUV444 HDR-specific options
+      {},  // Fallback options
+      "av1_vulkan"s,
+    },
+    {
+      // Common options
+      {
+        { "async_depth"s, 1 },
+        { "tune"s, "ull"s },
+        { "usage"s, "stream"s },
+        { "content"s, "rendered"s },
+      },
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // YUV444 SDR-specific options
+      {},  // YUV444 HDR-specific options
+      {},  // Fallback options
+      "hevc_vulkan"s,
+    },
+    {
+      // Common options
+      {
+        { "async_depth"s, 1 },
+        { "tune"s, "ull"s },
+        { "usage"s, "stream"s },
+        { "content"s, "rendered"s },
+      },
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // YUV444 SDR-specific options
+      {},  // YUV444 HDR-specific options
+      {},  // Fallback options
+      "h264_vulkan"s,
+    },
+    LIMITED_GOP_SIZE | PARALLEL_ENCODING | SINGLE_SLICE_ONLY
+  };
+#endif
+
+#ifdef __APPLE__
+  encoder_t videotoolbox {
+    "videotoolbox"sv,
+    std::make_unique<encoder_platform_formats_avcodec>(
+      AV_HWDEVICE_TYPE_VIDEOTOOLBOX, AV_HWDEVICE_TYPE_NONE,
+      AV_PIX_FMT_VIDEOTOOLBOX,
+      AV_PIX_FMT_NV12, AV_PIX_FMT_P010,
+      AV_PIX_FMT_NONE, AV_PIX_FMT_NONE,
+      vt_init_avcodec_hardware_input_buffer),
+    {
+      // Common options
+      {
+        { "allow_sw"s, &config::video.vt.vt_allow_sw },
+        { "require_sw"s, &config::video.vt.vt_require_sw },
+        { "realtime"s, &config::video.vt.vt_realtime },
+        { "prio_speed"s, 1 },
+      },
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // Fallback options
+      std::nullopt,
+      "av1_videotoolbox"s,
+    },
+    {
+      // Common options
+      {
+        { "allow_sw"s, &config::video.vt.vt_allow_sw },
+        { "require_sw"s, &config::video.vt.vt_require_sw },
+        { "realtime"s, &config::video.vt.vt_realtime },
+        { "prio_speed"s, 1 },
+      },
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // Fallback options
+      std::nullopt,
+      "hevc_videotoolbox"s,
+    },
+    {
+      // Common options
+      {
+        { "allow_sw"s, &config::video.vt.vt_allow_sw },
+        { "require_sw"s, &config::video.vt.vt_require_sw },
+        { "realtime"s, &config::video.vt.vt_realtime },
+        { "prio_speed"s, 1 },
+      },
+      {},  // SDR-specific options
+      {},  // HDR-specific options
+      {},  // Fallback options
+      std::nullopt,
+      "h264_videotoolbox"s,
+    },
+    DEFAULT
+  };
+#endif
+
+  static const std::vector<encoder_t *> encoders {
+#ifndef __APPLE__
+    &nvenc,
+#endif
+#ifdef _WIN32
+    &quicksync,
+    &amf_native,
+    &amdvce
+#endif
+#ifdef __linux__
+    &vaapi,
+#endif
+#ifdef SUNSHINE_BUILD_VULKAN
+    &vulkan,
+#endif
+#ifdef __APPLE__
+    &videotoolbox
+#endif
+
+  };
+
+  const std::vector<encoder_t *> &
+  platform_encoders() {
+    return encoders;
+  }
+
+  static encoder_t *chosen_encoder;
+  int active_hevc_mode;
+  int active_av1_mode;
+  bool last_encoder_probe_supported_ref_frames_invalidation = false;
+
+  bool
+  concurrent_displays() {
+    return chosen_encoder && chosen_encoder->flags & PARALLEL_ENCODING;
+  }
+
+  bool
+  codec_supported(int video_format, bool dynamic_range, bool yuv444) {
+    if (!chosen_encoder || video_format < 0 || video_format > 2) {
+      return false;
+    }
+
+    // The probe leaves the modes at 1 for codecs the encoder lacks and at 3 when they encode 10-bit as well
+    const auto &codec = video_format == 0 ? chosen_encoder->h264 : video_format == 1 ? chosen_encoder->hevc : chosen_encoder->av1;
+    if (!codec[encoder_t::PASSED]) {
+      return false;
+    }
+
+    auto mode = video_format == 1 ? active_hevc_mode : video_format == 2 ? active_av1_mode : 0;
+    if (video_format && mode < 2) {
+      return false;
+    }
+
+    if (dynamic_range && (video_format ? mode < 3 : !codec[encoder_t::DYNAMIC_RANGE])) {
+      return false;
+    }
+
+    return !yuv444 || codec[encoder_t::YUV444];
+  }
+
+  void
+  fit_resolution(int &width, int &height, int max_width, int max_height) {
+    if (width <= 0 || height <= 0) {
+      return;
+    }
+
+    double scale = 1.0;
+    if (max_width > 0 && width > max_width) {
+      scale = std::min(scale, (double) max_width / width);
+    }
+    if (max_height > 0 && height > max_height) {
+      scale = std::min(scale, (double) max_height / height);
+    }
+
+    if (scale < 1.0) {
+      width = std::max(2, (int) (width * scale) & ~1);
+      height = std::max(2, (int) (height * scale) & ~1);
+    }
+  }
+
+  /**
+   * @brief Give a session that follows the display resolution the size of the display, within the limits of its client.
+   */
+  static void
+  follow_display(config_t &config, const platf::display_t &display) {
+    if (!config.native_resolution) {
+      return;
+    }
+
+    auto region = display.region();
+    config.width = region.right - region.left;
+    config.height = region.bottom - region.top;
+    fit_resolution(config.width, config.height, config.max_width, config.max_height);
+  }
+
+  /**
+   * @brief The region of `config::video.crop` on the display, or of the window it follows.
+   * @return The region in display coordinates with an even size, empty if the whole display is encoded.
+   */
+  static platf::rect_t
+  crop_region(const platf::display_t &display) {
+    auto &crop = config::video.crop;
+
+    platf::rect_t region { crop.x, crop.y, crop.x + crop.width, crop.y + crop.height };
+    if (!crop.window.empty()) {
+      auto window = platf::window_rect(crop.window);
+      if (!window) {
+        return {};
+      }
+
+      // From the desktop to the display
+      region = platf::rect_t {
+        window->left - display.offset_x,
+        window->top - display.offset_y,
+        window->right - display.offset_x,
+        window->bottom - display.offset_y,
+      };
+    }
+
+    region.left = std::clamp(region.left, 0, display.width) & ~1;
+    region.top = std::clamp(region.top, 0, display.height) & ~1;
+    region.right = region.left + ((std::clamp(region.right, 0, display.width) - region.left) & ~1);
+    region.bottom = region.top + ((std::clamp(region.bottom, 0, display.height) - region.top) & ~1);
+
+    // Too small to encode, or nothing to cut away
+    constexpr int min_size = 64;
+    if (region.right - region.left < min_size || region.bottom - region.top < min_size ||
+        (region.right - region.left == display.width && region.bottom - region.top == display.height)) {
+      return {};
+    }
+
+    return region;
+  }
+
+  /**
+   * @brief Let the encode devices of a new display convert only the region of `config::video.crop`.
+   */
+  static void
+  apply_crop(platf::display_t &display) {
+    auto &crop = config::video.crop;
+    if (crop.window.empty() && (crop.width <= 0 || crop.height <= 0)) {
+      return;
+    }
+
+    if (!display.can_crop()) {
+      BOOST_LOG(warning) << "The capture method can't crop on the GPU, the whole display is encoded"sv;
+      return;
+    }
+
+    display.crop = crop_region(display);
+
+    auto region = display.region();
+    BOOST_LOG(info) << "Encoding the region "sv << region.right - region.left << 'x' << region.bottom - region.top
+                    << " at "sv << region.left << ',' << region.top << " of the display"sv;
+  }
+
+  /**
+   * @brief Whether the window the crop follows moved or changed its size, checked once a second.
+   * @details The sizes of the encode sessions follow the region, so they're rebuilt along with the display when it changed.
+   */
+  static bool
+  crop_moved(platf::display_t &display, std::chrono::steady_clock::time_point &next_check) {
+    if (config::video.crop.window.empty() || !display.can_crop()) {
+      return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now < next_check) {
+      return false;
+    }
+    next_check = now + 1s;
+
+    auto region = crop_region(display);
+    if (region.left == display.crop.left && region.top == display.crop.top &&
+        region.right == display.crop.right && region.bottom == display.crop.bottom) {
+      return false;
+    }
+
+    BOOST_LOG(info) << "The window "sv << config::video.crop.window << " moved, reinitializing the capture"sv;
+    return true;
+  }
+
+  /**
+   * @brief Take the settings of a negotiation into the config of a session, it must be rebuilt for them.
+   */
+  static void
+  apply_encoding(config_t &config, const encoding_t &encoding) {
+    constexpr std::string_view codec_names[] { "H.264"sv, "HEVC"sv, "AV1"sv };
+
+    config.native_resolution = !encoding.width || !encoding.height;
+    config.width = encoding.width;
+    config.height = encoding.height;
+    config.max_width = encoding.max_width;
+    config.max_height = encoding.max_height;
+    config.videoFormat = encoding.videoFormat;
+    config.dynamicRange = encoding.dynamicRange;
+    config.chromaSamplingType = encoding.chromaSamplingType;
+
+    BOOST_LOG(info) << "Encoding changed to "sv << codec_names[std::clamp(encoding.videoFormat, 0, 2)]
+                    << (encoding.dynamicRange ? " 10-bit"sv : ""sv) << (encoding.chromaSamplingType ? " 4:4:4"sv : ""sv)
+                    << ", rebuilding the session"sv;
+  }
+
+  /**
+   * @brief Memory an image holds, GPU images report the pitch of their texture.
+   */
+  static std::uint64_t
+  image_bytes(const platf::img_t &img) {
+    auto row_pitch = img.row_pitch ? img.row_pitch : img.width * std::max(img.pixel_pitch, 4);
+    return (std::uint64_t) row_pitch * img.height;
+  }
 
-  static const std::vector<encoder_t *> encoders {
-#ifndef __APPLE__
-    &nvenc,
-#endif
-#ifdef _WIN32
-    &quicksync,
-    &amdvce
-#endif
-#ifdef __linux__
-    &vaapi
-#endif
-#ifdef __APPLE__
-    &videotoolbox
-#endif
+  /**
+   * @brief Drop the encoder cache after an encoder failed at runtime, the next launch probes all encoders again.
+   */
+  void
+  invalidate_encoder_cache() {
+    if (config::video.encoder_cache.empty()) {
+      return;
+    }
 
-  };
+    std::error_code ec;
+    if (std::filesystem::remove(config::video.encoder_cache, ec)) {
+      BOOST_LOG(info) << "Encoder failed, encoders will be probed again on the next launch"sv;
+    }
+  }
 
-  static encoder_t *chosen_encoder;
-  int active_hevc_mode;
-  int active_av1_mode;
-  bool last_encoder_probe_supported_ref_frames_invalidation = false;
+  /**
+   * @brief Stream the test pattern instead of the display when it's enabled.
+   */
+  static void
+  apply_test_pattern(std::shared_ptr<platf::display_t> &disp, platf::mem_type_e type, int framerate) {
+    if (disp && config::video.test_pattern) {
+      disp = test_pattern::display(std::move(disp), type, framerate);
+    }
+  }
 
   void
   reset_display(std::shared_ptr<platf::display_t> &disp, const platf::mem_type_e &type, const std::string &display_name, config_t *config) {
@@ -902,6 +1811,7 @@ namespace video {
       if (disp) {
         config->width = disp->width;
         config->height = disp->height;
+        apply_crop(*disp);
         break;
       }
 
@@ -965,6 +1875,43 @@ namespace video {
     }
   }
 
+  /**
+   * @brief Keeps the capture of a display that refreshes faster than its sessions encode at their framerate.
+   * @details Waiting before the backend acquires the next frame skips the frames in between, they're
+   *          neither acquired nor copied. The wait ends a quarter interval before the frame is due, the
+   *          display delivers the frame with its next refresh, so the frame stays as fresh as it was.
+   */
+  class capture_throttle_t {
+  public:
+    /**
+     * @brief Wait until the next frame is due, after a frame was captured.
+     * @param framerate Framerate of the fastest session.
+     */
+    void
+    wait(int framerate) {
+      if (!config::video.capture_throttle || framerate <= 0 || !timer || !*timer) {
+        return;
+      }
+
+      // The frames stay on a grid of the interval, a frame that came late doesn't delay the next
+      auto interval = std::chrono::nanoseconds { 1s } / framerate;
+      auto now = std::chrono::steady_clock::now();
+      next_capture += interval;
+      if (next_capture < now) {
+        next_capture = now + interval;
+      }
+
+      auto wake = next_capture - interval / 4;
+      if (now < wake) {
+        timer->sleep_for(wake - now);
+      }
+    }
+
+  private:
+    std::unique_ptr<platf::high_precision_timer> timer = platf::create_high_precision_timer();
+    std::chrono::steady_clock::time_point next_capture;
+  };
+
   void
   captureThread(
     std::shared_ptr<safe::queue_t<capture_ctx_t>> capture_ctx_queue,
@@ -998,17 +1945,81 @@ namespace video {
     std::vector<std::string> display_names;
     int display_p = -1;
     refresh_displays(encoder.platform_formats->dev_type, display_names, display_p);
-    auto disp = platf::display(encoder.platform_formats->dev_type, display_names[display_p], *capture_ctxs.front().config);
+
+    // The sessions of this thread share their display, a display that isn't found is handled like a switch
+    if (auto &display = capture_ctxs.front().config->display) {
+      auto display_name = std::find(std::begin(display_names), std::end(display_names), *display);
+      if (display_name != std::end(display_names)) {
+        display_p = (int) (display_name - std::begin(display_names));
+      }
+    }
+
+    // The display captures at the highest framerate of the sessions it feeds, every session scales on its own
+    auto display_config = [&]() {
+      auto config = *capture_ctxs.front().config;
+      for (auto &capture_ctx : capture_ctxs) {
+        config.framerate = std::max(config.framerate, capture_ctx.config->framerate);
+      }
+
+      return config;
+    };
+
+    auto disp_config = display_config();
+    auto disp = platf::display(encoder.platform_formats->dev_type, display_names[display_p], disp_config);
+    apply_test_pattern(disp, encoder.platform_formats->dev_type, disp_config.framerate);
     if (!disp) {
       return;
     }
-    capture_ctxs.front().config->width = disp->width;
-    capture_ctxs.front().config->height = disp->height;
     display_wp = disp;
 
-    constexpr auto capture_buffer_size = 12;
+    // The pool never grows beyond its size, an encoder that stalls can't make the capture allocate more
+    const std::size_t capture_buffer_size = std::max(1, config::video.image_pool.size);
+    const std::size_t preallocated_count = std::clamp<int>(config::video.image_pool.preallocate, 0, (int) capture_buffer_size);
     std::list<std::shared_ptr<platf::img_t>> imgs(capture_buffer_size);
 
+    // What the pool holds as of its last allocation or release, the sessions report it with their metrics
+    image_pool_stats_t pool_stats { display_names[display_p], capture_buffer_size, 0, 0, 0 };
+    auto account_imgs = [&]() {
+      std::size_t allocated = 0;
+      std::size_t used = 0;
+      std::uint64_t bytes = 0;
+      for (const auto &img : imgs) {
+        if (img) {
+          allocated += 1;
+          used += img.use_count() > 1;
+          bytes += image_bytes(*img);
+        }
+      }
+
+      bool resized = allocated != pool_stats.allocated || pool_stats.display != display_names[display_p];
+      pool_stats.display = display_names[display_p];
+      pool_stats.allocated = allocated;
+      pool_stats.used = used;
+      pool_stats.bytes = bytes;
+
+      if (resized) {
+        BOOST_LOG(debug) << "Image pool of "sv << pool_stats.display << ": "sv << allocated << '/' << capture_buffer_size
+                         << " images, "sv << (bytes >> 20) << " MiB"sv;
+      }
+    };
+
+    // Allocated with the display, so the first frames and the encoder initialization don't wait for allocations
+    auto preallocate_imgs = [&]() {
+      std::size_t count = 0;
+      for (auto &img : imgs) {
+        if (count++ == preallocated_count) {
+          break;
+        }
+
+        if (!img) {
+          img = disp->alloc_img();
+        }
+      }
+
+      account_imgs();
+    };
+    preallocate_imgs();
+
     std::vector<std::optional<std::chrono::steady_clock::time_point>> imgs_used_timestamps;
     const std::chrono::seconds trim_timeot = 3s;
     auto trim_imgs = [&]() {
@@ -1040,6 +2051,9 @@ namespace video {
         }
       }
 
+      // the preallocated images stay
+      trim_target = std::max(trim_target, preallocated_count);
+
       // trim allocated unused above the newly decided trim target
       if (allocated_count > trim_target) {
         size_t to_trim = allocated_count - trim_target;
@@ -1054,7 +2068,35 @@ namespace video {
         }
         // forget timestamps that no longer relevant
         imgs_used_timestamps.resize(trim_target + 1);
+        account_imgs();
+      }
+    };
+
+    // Drop the frame that waits the longest for a session, its image returns to the pool unless another session holds it
+    auto drop_oldest_frame = [&]() -> bool {
+      capture_ctx_t *oldest = nullptr;
+      std::optional<std::chrono::steady_clock::time_point> oldest_timestamp;
+      for (auto &capture_ctx : capture_ctxs) {
+        auto pending = capture_ctx.images->peek() ? capture_ctx.images->view(0ms) : nullptr;
+        if (!pending) {
+          continue;
+        }
+
+        if (!oldest || (pending->frame_timestamp && (!oldest_timestamp || *pending->frame_timestamp < *oldest_timestamp))) {
+          oldest = &capture_ctx;
+          oldest_timestamp = pending->frame_timestamp;
+        }
+      }
+
+      if (!oldest) {
+        return false;
+      }
+
+      oldest->images->pop(0ms);
+      if (oldest->config->metrics) {
+        oldest->config->metrics->dropped_frames.fetch_add(1, std::memory_order_relaxed);
       }
+      return true;
     };
 
     auto pull_free_image_callback = [&](std::shared_ptr<platf::img_t> &img_out) -> bool {
@@ -1084,6 +2126,7 @@ namespace video {
                 imgs.erase(it);
                 imgs.push_front(img_out);
               }
+              account_imgs();
               break;
             }
           }
@@ -1094,21 +2137,42 @@ namespace video {
           img_out->frame_timestamp.reset();
           return true;
         }
-        else {
-          // sleep and retry if image pool is full
+        else if (!drop_oldest_frame()) {
+          // sleep and retry if the encoders hold every image of the pool
           std::this_thread::sleep_for(1ms);
         }
       }
       return false;
     };
 
+    capture_throttle_t capture_throttle;
+    auto throttle_capture = [&]() {
+      int framerate = 0;
+      for (auto &capture_ctx : capture_ctxs) {
+        framerate = std::max(framerate, capture_ctx.config->framerate);
+      }
+      capture_throttle.wait(framerate);
+    };
+
     // Capture takes place on this thread
     platf::adjust_thread_priority(platf::thread_priority_e::critical);
+    platf::place_pipeline_thread("video capture"sv);
+    TRACE_THREAD("video capture");
+
+    // Set when the last reinit only recreated the capture, until a frame comes through
+    bool capture_reinit_pending = false;
+
+    auto next_crop_check = std::chrono::steady_clock::now();
 
     while (capture_ctx_queue->running()) {
       bool artificial_reinit = false;
 
       auto push_captured_image_callback = [&](std::shared_ptr<platf::img_t> &&img, bool frame_captured) -> bool {
+        if (frame_captured) {
+          TRACE_INSTANT("capture.push");
+          capture_reinit_pending = false;
+        }
+
         KITTY_WHILE_LOOP(auto capture_ctx = std::begin(capture_ctxs), capture_ctx != std::end(capture_ctxs), {
           if (!capture_ctx->images->running()) {
             capture_ctx = capture_ctxs.erase(capture_ctx);
@@ -1117,6 +2181,18 @@ namespace video {
           }
 
           if (frame_captured) {
+            // A frame the encoder didn't take yet is replaced
+            if (auto &metrics = capture_ctx->config->metrics) {
+              metrics->captured_frames.fetch_add(1, std::memory_order_relaxed);
+              if (capture_ctx->images->peek()) {
+                metrics->dropped_frames.fetch_add(1, std::memory_order_relaxed);
+              }
+
+              metrics->pool_capacity.store((std::uint32_t) pool_stats.capacity, std::memory_order_relaxed);
+              metrics->pool_allocated.store((std::uint32_t) pool_stats.allocated, std::memory_order_relaxed);
+              metrics->pool_used.store((std::uint32_t) pool_stats.used, std::memory_order_relaxed);
+              metrics->pool_bytes.store(pool_stats.bytes, std::memory_order_relaxed);
+            }
             capture_ctx->images->raise(img);
           }
 
@@ -1135,14 +2211,32 @@ namespace video {
 
         while (capture_ctx_queue->peek()) {
           capture_ctxs.emplace_back(std::move(*capture_ctx_queue->pop()));
+
+          if (capture_ctxs.back().config->framerate > disp_config.framerate) {
+            BOOST_LOG(info) << "Session requested "sv << capture_ctxs.back().config->framerate << " fps, reinitializing the capture"sv;
+            artificial_reinit = true;
+          }
         }
 
+        if (frame_captured && crop_moved(*disp, next_crop_check)) {
+          artificial_reinit = true;
+        }
+
+        if (artificial_reinit) {
+          return false;
+        }
+
+        if (frame_captured) {
+          throttle_capture();
+        }
 
         return true;
       };
 
       auto status = disp->capture(push_captured_image_callback, pull_free_image_callback, &display_cursor);
 
+      // Reinits the sessions asked for, such as a display switch, always recreate the display
+      bool requested_reinit = artificial_reinit;
       if (artificial_reinit && status != platf::capture_e::error) {
         status = platf::capture_e::reinit;
 
@@ -1151,12 +2245,23 @@ namespace video {
 
       switch (status) {
         case platf::capture_e::reinit: {
+          // When the access to the desktop was lost but its mode didn't change, only the capture is recreated
+          // and the sessions keep encoding with their devices. A reinit before the next frame came through
+          // recreates the display after all.
+          if (!requested_reinit && !capture_reinit_pending && disp->reinit_capture()) {
+            BOOST_LOG(info) << "Recreated the capture of "sv << display_names[display_p] << ", the encode sessions continue"sv;
+            capture_reinit_pending = true;
+            continue;
+          }
+          capture_reinit_pending = false;
+
           reinit_event.raise(true);
 
           // Some classes of images contain references to the display --> display won't delete unless img is deleted
           for (auto &img : imgs) {
             img.reset();
           }
+          account_imgs();
 
           // display_wp is modified in this thread only
           // Wait for the other shared_ptr's of display to be destroyed.
@@ -1207,7 +2312,9 @@ namespace video {
           next:
 
             // reset_display() will sleep between retries
-            reset_display(disp, encoder.platform_formats->dev_type, display_names[display_p], capture_ctxs.front().config);
+            disp_config = display_config();
+            reset_display(disp, encoder.platform_formats->dev_type, display_names[display_p], &disp_config);
+            apply_test_pattern(disp, encoder.platform_formats->dev_type, disp_config.framerate);
             if (disp) {
               break;
             }
@@ -1217,6 +2324,7 @@ namespace video {
           }
 
           display_wp = disp;
+          preallocate_imgs();
 
           reinit_event.reset();
           continue;
@@ -1234,15 +2342,13 @@ namespace video {
   }
 
   int
-  encode_avcodec(int64_t frame_nr, avcodec_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
+  encode_avcodec(int64_t frame_nr, avcodec_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp, latency::frame_timing_t timing) {
     auto &frame = session.device->frame;
     frame->pts = frame_nr;
+    timing.encode_submit = std::chrono::steady_clock::now();
 
     auto &ctx = session.avcodec_ctx;
 
-    auto &sps = session.sps;
-    auto &vps = session.vps;
-
     // send the frame to the encoder
     auto ret = avcodec_send_frame(ctx.get(), frame);
     if (ret < 0) {
@@ -1253,7 +2359,8 @@ namespace video {
     }
 
     while (ret >= 0) {
-      auto packet = std::make_unique<packet_raw_avcodec>();
+      // On EAGAIN the packet simply goes back to the pool
+      auto packet = session.av_packet_pool->acquire();
       auto av_packet = packet.get()->av_packet;
 
       ret = avcodec_receive_packet(ctx.get(), av_packet);
@@ -1265,35 +2372,30 @@ namespace video {
       }
 
       if ((frame->flags & AV_FRAME_FLAG_KEY) && !(av_packet->flags & AV_PKT_FLAG_KEY)) {
-        BOOST_LOG(error) << "Encoder did not produce IDR frame when requested!"sv;
+        BOOST_LOG_LIMITED(error) << "Encoder did not produce IDR frame when requested!"sv;
       }
 
       if (session.inject) {
-        if (session.inject == 1) {
-          auto h264 = cbs::make_sps_h264(ctx.get(), av_packet);
+        session.inject = 0;
 
-          sps = std::move(h264.sps);
+        // A rebuilt session finds the parameter sets of its predecessor in the cache
+        session.parameter_sets = cbs::parameter_sets(ctx.get(), av_packet);
+        if (!session.parameter_sets) {
+          BOOST_LOG(error) << "Couldn't rewrite the parameter sets, the stream goes out without colorspace information"sv;
         }
         else {
-          auto hevc = cbs::make_sps_hevc(ctx.get(), av_packet);
-
-          sps = std::move(hevc.sps);
-          vps = std::move(hevc.vps);
-
-          session.replacements.emplace_back(
-            std::string_view((char *) std::begin(vps.old), vps.old.size()),
-            std::string_view((char *) std::begin(vps._new), vps._new.size()));
+          for (auto &unit : session.parameter_sets->units) {
+            session.replacements.emplace_back(
+              std::string_view((const char *) std::begin(unit.old), unit.old.size()),
+              std::string_view((const char *) std::begin(unit._new), unit._new.size()));
+          }
         }
-
-        session.inject = 0;
-
-        session.replacements.emplace_back(
-          std::string_view((char *) std::begin(sps.old), sps.old.size()),
-          std::string_view((char *) std::begin(sps._new), sps._new.size()));
       }
 
       if (av_packet && av_packet->pts == frame_nr) {
         packet->frame_timestamp = frame_timestamp;
+        packet->timing = timing;
+        packet->timing.encode_complete = std::chrono::steady_clock::now();
       }
 
       packet->replacements = &session.replacements;
@@ -1305,7 +2407,38 @@ namespace video {
   }
 
   int
-  encode_nvenc(int64_t frame_nr, nvenc_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
+  encode_nvenc(int64_t frame_nr, nvenc_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp, latency::frame_timing_t timing) {
+    timing.encode_submit = std::chrono::steady_clock::now();
+
+    if (session.async_depth() > 1) {
+      // Conversion of the next frame overlaps with encoding, the packet is raised by the retrieval thread
+      return session.submit_frame(frame_nr, packets, channel_data, frame_timestamp, timing);
+    }
+
+    if (session.slice_output()) {
+      // Every part goes out as soon as it is written, the rest of the frame is still being encoded
+      auto raise_slice = [&](nvenc::nvenc_encoded_frame &&encoded_slice) {
+        auto packet = std::make_unique<packet_raw_pooled>(std::move(encoded_slice.data), encoded_slice.frame_index, encoded_slice.idr);
+        packet->channel_data = channel_data;
+        packet->after_ref_frame_invalidation = encoded_slice.after_ref_frame_invalidation;
+        packet->temporal_layer = encoded_slice.temporal_layer;
+        packet->temporal_layers = encoded_slice.temporal_layers;
+        packet->frame_timestamp = frame_timestamp;
+        packet->timing = timing;
+        packet->timing.encode_complete = std::chrono::steady_clock::now();
+        packet->slice_index = encoded_slice.slice_index;
+        packet->end_of_frame = encoded_slice.end_of_frame;
+        packets->raise(std::move(packet));
+      };
+
+      if (!session.encode_frame_in_slices(frame_nr, raise_slice)) {
+        BOOST_LOG(error) << "NvENC failed to encode frame " << frame_nr << " in slices";
+        return -1;
+      }
+
+      return 0;
+    }
+
     auto encoded_frame = session.encode_frame(frame_nr);
     if (encoded_frame.data.empty()) {
       BOOST_LOG(error) << "NvENC returned empty packet";
@@ -1313,30 +2446,116 @@ namespace video {
     }
 
     if (frame_nr != encoded_frame.frame_index) {
-      BOOST_LOG(error) << "NvENC frame index mismatch " << frame_nr << " " << encoded_frame.frame_index;
+      BOOST_LOG_LIMITED(error) << "NvENC frame index mismatch " << frame_nr << " " << encoded_frame.frame_index;
+    }
+
+    auto packet = std::make_unique<packet_raw_pooled>(std::move(encoded_frame.data), encoded_frame.frame_index, encoded_frame.idr);
+    packet->channel_data = channel_data;
+    packet->after_ref_frame_invalidation = encoded_frame.after_ref_frame_invalidation;
+    packet->temporal_layer = encoded_frame.temporal_layer;
+    packet->temporal_layers = encoded_frame.temporal_layers;
+    packet->frame_timestamp = frame_timestamp;
+    packet->timing = timing;
+    packet->timing.encode_complete = std::chrono::steady_clock::now();
+    packets->raise(std::move(packet));
+
+    return 0;
+  }
+
+#ifdef _WIN32
+  int
+  encode_amf(int64_t frame_nr, amf_encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp, latency::frame_timing_t timing) {
+    timing.encode_submit = std::chrono::steady_clock::now();
+
+    auto encoded_frame = session.encode_frame(frame_nr);
+    if (encoded_frame.data.empty()) {
+      BOOST_LOG(error) << "AMF returned empty packet";
+      return -1;
+    }
+
+    if (frame_nr != encoded_frame.frame_index) {
+      BOOST_LOG_LIMITED(error) << "AMF frame index mismatch " << frame_nr << " " << encoded_frame.frame_index;
     }
 
-    auto packet = std::make_unique<packet_raw_generic>(std::move(encoded_frame.data), encoded_frame.frame_index, encoded_frame.idr);
+    auto packet = std::make_unique<packet_raw_pooled>(std::move(encoded_frame.data), encoded_frame.frame_index, encoded_frame.idr);
     packet->channel_data = channel_data;
     packet->after_ref_frame_invalidation = encoded_frame.after_ref_frame_invalidation;
     packet->frame_timestamp = frame_timestamp;
+    packet->timing = timing;
+    packet->timing.encode_complete = std::chrono::steady_clock::now();
     packets->raise(std::move(packet));
 
     return 0;
   }
+#endif
+
+  /**
+   * @brief Classify a converted frame and retune the session when its content changed class.
+   * @details A session that can't be retuned stops classifying, the log says so once.
+   */
+  void
+  adapt_to_content(encode_session_t &session, std::optional<content::classifier_t> &classifier, const platf::img_t &img) {
+    if (!classifier) {
+      return;
+    }
+
+    auto content = classifier->frame(img);
+    if (!content) {
+      return;
+    }
+
+    if (!session.set_content(*content)) {
+      BOOST_LOG(info) << "Encoder can't be retuned for the content, content-adaptive encoding is off for this session"sv;
+      classifier.reset();
+      return;
+    }
+
+    BOOST_LOG(info) << "Encoder tuned for "sv << content::to_string(*content);
+  }
 
   int
-  encode(int64_t frame_nr, encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp) {
+  encode(int64_t frame_nr, encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp, latency::frame_timing_t timing) {
     if (auto avcodec_session = dynamic_cast<avcodec_encode_session_t *>(&session)) {
-      return encode_avcodec(frame_nr, *avcodec_session, packets, channel_data, frame_timestamp);
+      return encode_avcodec(frame_nr, *avcodec_session, packets, channel_data, frame_timestamp, timing);
     }
     else if (auto nvenc_session = dynamic_cast<nvenc_encode_session_t *>(&session)) {
-      return encode_nvenc(frame_nr, *nvenc_session, packets, channel_data, frame_timestamp);
+      return encode_nvenc(frame_nr, *nvenc_session, packets, channel_data, frame_timestamp, timing);
+    }
+#ifdef _WIN32
+    else if (auto amf_session = dynamic_cast<amf_encode_session_t *>(&session)) {
+      return encode_amf(frame_nr, *amf_session, packets, channel_data, frame_timestamp, timing);
     }
+#endif
 
     return -1;
   }
 
+  /**
+   * @brief Set the options that make the codec refresh the picture with intra-refresh waves.
+   * @details avcodec can't start a wave on demand, so the waves repeat back to back.
+   * @param frames Number of frames a wave spans.
+   * @return `false` if the codec doesn't support intra refresh.
+   */
+  bool
+  set_intra_refresh_options(AVCodecContext *ctx, const std::string &codec_name, AVDictionary **options, int frames) {
+    if (codec_name == "h264_qsv"sv || codec_name == "hevc_qsv"sv) {
+      // Vertical refresh
+      av_dict_set_int(options, "int_ref_type", 1, 0);
+      av_dict_set_int(options, "int_ref_cycle_size", frames, 0);
+      return true;
+    }
+
+    if (codec_name == "h264_amf"sv) {
+      // AMF takes the number of macroblocks refreshed per frame
+      auto macroblocks = ((ctx->width + 15) / 16) * ((ctx->height + 15) / 16);
+      av_dict_set_int(options, "intra_refresh_mb", (macroblocks + frames - 1) / frames, 0);
+      return true;
+    }
+
+    BOOST_LOG(warning) << codec_name << ": intra refresh not supported, recovering with IDR frames"sv;
+    return false;
+  }
+
   std::unique_ptr<avcodec_encode_session_t>
   make_avcodec_encode_session(platf::display_t *disp, const encoder_t &encoder, const config_t &config, int width, int height, std::unique_ptr<platf::avcodec_encode_device_t> encode_device) {
     auto platform_formats = dynamic_cast<const encoder_platform_formats_avcodec *>(encoder.platform_formats.get());
@@ -1381,9 +2600,14 @@ namespace video {
     // Note: If we later end up needing multiple sets of
     // fallback options, we may need to allow more retries
     // to try applying each set.
+    auto packet_pool = std::make_shared<buffer_pool::pool_t>(buffer_pool::ENCODER_SLABS);
+
     avcodec_ctx_t ctx;
+    bool intra_refresh = false;
     for (int retries = 0; retries < 2; retries++) {
       ctx.reset(avcodec_alloc_context3(codec));
+      ctx->opaque = packet_pool.get();
+      ctx->get_encode_buffer = get_pooled_encode_buffer;
       ctx->width = config.width;
       ctx->height = config.height;
       ctx->time_base = AVRational { 1, config.framerate };
@@ -1552,41 +2776,14 @@ namespace video {
         }
       }
 
-      auto bitrate = config.bitrate * 1000;
-      ctx->rc_max_rate = bitrate;
-      ctx->bit_rate = bitrate;
+      set_rate_control(ctx.get(), encoder, config, config.framerate, hardware);
 
-      if (encoder.flags & CBR_WITH_VBR) {
-        // Ensure rc_max_bitrate != bit_rate to force VBR mode
-        ctx->bit_rate--;
-      }
-      else {
-        ctx->rc_min_rate = bitrate;
-      }
+      intra_refresh = config.enableIntraRefresh && set_intra_refresh_options(ctx.get(), video_format.name, &options, config::video.intra_refresh_frames);
 
       if (encoder.flags & RELAXED_COMPLIANCE) {
         ctx->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
       }
 
-      if (!(encoder.flags & NO_RC_BUF_LIMIT)) {
-        if (!hardware && (ctx->slices > 1 || config.videoFormat == 1)) {
-          // Use a larger rc_buffer_size for software encoding when slices are enabled,
-          // because libx264 can severely degrade quality if the buffer is too small.
-          // libx265 encounters this issue more frequently, so always scale the
-          // buffer by 1.5x for software HEVC encoding.
-          ctx->rc_buffer_size = bitrate / ((config.framerate * 10) / 15);
-        }
-        else {
-          ctx->rc_buffer_size = bitrate / config.framerate;
-
-#ifndef __APPLE__
-          if (encoder.name == "nvenc" && config::video.nv_legacy.vbv_percentage_increase > 0) {
-            ctx->rc_buffer_size += ctx->rc_buffer_size * config::video.nv_legacy.vbv_percentage_increase / 100;
-          }
-#endif
-        }
-      }
-
       // Allow the encoding device a final opportunity to set/unset or override any options
       encode_device->init_codec_options(ctx.get(), &options);
 
@@ -1663,7 +2860,9 @@ namespace video {
     if (!encode_device->data) {
       auto software_encode_device = std::make_unique<avcodec_software_encode_device_t>();
 
-      if (software_encode_device->init(width, height, frame.get(), sw_fmt, hardware)) {
+      // Convert in as many slices as the encoder has threads, so the conversion doesn't bottleneck a 4K encode
+      auto threads = std::max(ctx->thread_count, config::video.min_threads);
+      if (software_encode_device->init(width, height, frame.get(), sw_fmt, hardware, threads)) {
         return nullptr;
       }
       software_encode_device->colorspace = colorspace;
@@ -1684,20 +2883,36 @@ namespace video {
       std::move(ctx),
       std::move(encode_device_final),
 
-      // 0 ==> don't inject, 1 ==> inject for h264, 2 ==> inject for hevc
-      config.videoFormat <= 1 ? (1 - (int) video_format[encoder_t::VUI_PARAMETERS]) * (1 + config.videoFormat) : 0);
+      // 0 ==> don't inject, 1 ==> inject for h264, 2 ==> inject for hevc, 3 ==> inject for av1
+      (1 - (int) video_format[encoder_t::VUI_PARAMETERS]) * (1 + config.videoFormat));
+    session->encoder = &encoder;
+    session->config = config;
+    session->hardware = hardware;
+    session->intra_refresh = intra_refresh;
+    session->packet_pool = std::move(packet_pool);
 
     return session;
   }
 
-  std::unique_ptr<nvenc_encode_session_t>
-  make_nvenc_encode_session(const config_t &client_config, std::unique_ptr<platf::nvenc_encode_device_t> encode_device) {
+  std::unique_ptr<nvenc_encode_session_t>
+  make_nvenc_encode_session(const config_t &client_config, std::unique_ptr<platf::nvenc_encode_device_t> encode_device) {
+    if (!encode_device->init_encoder(client_config, encode_device->colorspace)) {
+      return nullptr;
+    }
+
+    return std::make_unique<nvenc_encode_session_t>(std::move(encode_device));
+  }
+
+#ifdef _WIN32
+  std::unique_ptr<amf_encode_session_t>
+  make_amf_encode_session(const config_t &client_config, std::unique_ptr<platf::amf_encode_device_t> encode_device) {
     if (!encode_device->init_encoder(client_config, encode_device->colorspace)) {
       return nullptr;
     }
 
-    return std::make_unique<nvenc_encode_session_t>(std::move(encode_device));
+    return std::make_unique<amf_encode_session_t>(std::move(encode_device));
   }
+#endif
 
   std::unique_ptr<encode_session_t>
   make_encode_session(platf::display_t *disp, const encoder_t &encoder, const config_t &config, int width, int height, std::unique_ptr<platf::encode_device_t> encode_device) {
@@ -1731,6 +2946,12 @@ namespace video {
       auto nvenc_encode_device = boost::dynamic_pointer_cast<platf::nvenc_encode_device_t>(std::move(encode_device));
       return make_nvenc_encode_session(config, std::move(nvenc_encode_device));
     }
+#ifdef _WIN32
+    else if (dynamic_cast<platf::amf_encode_device_t *>(encode_device.get())) {
+      auto amf_encode_device = boost::dynamic_pointer_cast<platf::amf_encode_device_t>(std::move(encode_device));
+      return make_amf_encode_session(config, std::move(amf_encode_device));
+    }
+#endif
 
     return nullptr;
   }
@@ -1745,9 +2966,18 @@ namespace video {
     std::unique_ptr<platf::encode_device_t> encode_device,
     safe::signal_t &reinit_event,
     const encoder_t &encoder,
+    scheduler::session_t &schedule,
+    overload::controller_t &overload_control,
     void *channel_data) {
     auto session = make_encode_session(disp.get(), encoder, *config, disp->width, disp->height, std::move(encode_device));
     if (!session) {
+      // Past its session limit the driver refuses sessions the encoder would take otherwise
+      if (schedule.refused()) {
+        mail->event<bool>(mail::shutdown)->raise(true);
+        return;
+      }
+
+      invalidate_encoder_cache();
       return;
     }
 
@@ -1758,9 +2988,10 @@ namespace video {
     BOOST_LOG(info) << "framerate "sv << config->framerate;
     BOOST_LOG(info) << "bitrate "sv << config->bitrate;
 
-    auto packets = mail->queue<packet_t>(mail::video_packets);
+    auto packets = mail->queue<packet_t>(mail::video_packets, mail::video_packets_mode);
     auto idr_events = mail->event<bool>(mail::idr);
     auto invalidate_ref_frames_events = mail->event<std::pair<int64_t, int64_t>>(mail::invalidate_ref_frames);
+    auto encoding_events = mail->event<encoding_t>(mail::encoding);
 
     {
       // Load a dummy image into the AVFrame to ensure we have something to encode
@@ -1773,18 +3004,49 @@ namespace video {
       }
     }
 
-#ifdef _WIN32
-    auto timer = CreateWaitableTimerEx(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
-    if (!timer) 
-        timer = CreateWaitableTimerEx(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
-#endif
-
+    auto timer = platf::create_high_precision_timer();
+    if (!timer || !*timer) {
+      BOOST_LOG(error) << "Couldn't create the frame timer"sv;
+      return;
+    }
 
     std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
     auto last_frametimestamp = frame_timestamp;
+    latency::frame_timing_t timing;
+    std::chrono::steady_clock::time_point ref_frames_invalidated;
+
+    // Frames are due on absolute deadlines, so sleep jitter doesn't accumulate into framerate drift
+    auto frame_interval = std::chrono::nanoseconds { 1s } / config->framerate;
+    auto next_deadline = std::chrono::steady_clock::now() + frame_interval;
+
+    // Consecutive frames that repeated the last capture
+    int static_frames = 0;
+
+    std::optional<content::classifier_t> classifier;
+    if (config::video.content_adaptive.enabled) {
+      classifier.emplace(config->framerate);
+    }
+
+    // The loop sleeps until the frame is due, a capture or any of the events wakes it earlier
+    safe::selector_t selector;
+    selector.watch(*shutdown_event, reinit_event, *images, *bitrate_events, *framerate_events, *idr_events, *invalidate_ref_frames_events, *encoding_events);
+    auto ready = [&]() {
+      return images->peek() || !images->running() ||
+             shutdown_event->peek() || reinit_event.peek() ||
+             bitrate_events->peek() || framerate_events->peek() ||
+             idr_events->peek() || invalidate_ref_frames_events->peek() ||
+             encoding_events->peek();
+    };
+
+    // Longest interval between repeated frames while the content is static
+    auto static_interval = [&]() -> std::chrono::nanoseconds {
+      auto &static_content = config::video.static_content;
+      if (static_content.min_framerate > 0) {
+        return std::max<std::chrono::nanoseconds>(std::chrono::nanoseconds { 1s } / static_content.min_framerate, frame_interval);
+      }
 
-    auto last_encode_timestamp = std::chrono::steady_clock::now();
-    auto encode_timestamp = last_encode_timestamp;
+      return std::max<std::chrono::nanoseconds>(std::chrono::milliseconds { static_content.refresh_interval }, frame_interval);
+    };
 
     while (true) {
       if (shutdown_event->peek() || reinit_event.peek() || !images->running()) {
@@ -1793,24 +3055,51 @@ namespace video {
 
       bool requested_idr_frame = false;
 
+      // Taken before the requests are, a request raised until then is part of the frames after it
+      auto invalidation_time = std::chrono::steady_clock::now();
+      if (invalidate_ref_frames_events->peek()) {
+        ref_frames_invalidated = invalidation_time;
+      }
       while (invalidate_ref_frames_events->peek()) {
         if (auto frames = invalidate_ref_frames_events->pop(0ms)) {
           session->invalidate_ref_frames(frames->first, frames->second);
         }
       }
 
-      if (bitrate_events->peek()) {
+      if (bitrate_events->peek() || framerate_events->peek()) {
+        if (bitrate_events->peek()) {
           config->bitrate = bitrate_events->pop().value();
           BOOST_LOG(info) << "bitrate changed to "sv << config->bitrate;
-          break;
-      } else if (framerate_events->peek()) {
-          config->framerate = framerate_events->pop().value();
+        }
+        if (framerate_events->peek()) {
+          scheduler::load_t load { config->width, config->height, framerate_events->pop().value() };
+          schedule.update(load, false);
+          config->framerate = load.framerate;
           BOOST_LOG(info) << "framerate changed to "sv << config->framerate;
+        }
+
+        // Only rebuild the session when the encoder can't change its rate control on the fly
+        if (!session->reconfigure(config->bitrate, config->framerate)) {
+          BOOST_LOG(info) << "Encoder can't be reconfigured, rebuilding the session"sv;
+          break;
+        }
+
+        frame_interval = std::chrono::nanoseconds { 1s } / config->framerate;
+      }
+
+      // The new session starts with an IDR frame of the new codec
+      if (encoding_events->peek()) {
+        if (auto encoding = encoding_events->pop(0ms)) {
+          apply_encoding(*config, *encoding);
           break;
+        }
       }
 
       if (idr_events->peek()) {
-        requested_idr_frame = true;
+        // An intra-refresh wave repairs the picture without the bitrate spike of an IDR frame
+        if (!session->request_intra_refresh()) {
+          requested_idr_frame = true;
+        }
         idr_events->pop();
       }
 
@@ -1818,46 +3107,105 @@ namespace video {
         session->request_idr_frame();
       }
 
+      bool new_frame = false;
       if (!requested_idr_frame || images->peek()) {
-        if (auto img = images->pop(1ms)) {
+        // Wait for capture until the frame is due, the events that woke us are handled on the next iteration
+        selector.wait_until(next_deadline, ready);
+        if (auto img = images->pop(0ms)) {
           frame_timestamp = img->frame_timestamp;
+
+          // Repeated frames aren't converted again, they keep the timing of the conversion empty
+          timing = {};
+          timing.convert_start = std::chrono::steady_clock::now();
           if (session->convert(*img)) {
             BOOST_LOG(error) << "Could not convert image"sv;
             return;
           }
+          timing.convert_end = std::chrono::steady_clock::now();
+          TRACE_SPAN("convert", timing.convert_start, timing.convert_end, frame_nr);
+          new_frame = true;
+
+          adapt_to_content(*session, classifier, *img);
         }
         else if (!images->running()) {
           break;
         }
       }
 
+      // The deadline may be far away after static content, new content is encoded right away
+      const bool resume = new_frame && static_frames > 0;
+
+      auto now = std::chrono::steady_clock::now();
+      if (!requested_idr_frame && now < next_deadline) {
+        if (!new_frame) {
+          // Nothing captured yet, keep waiting for the frame or the deadline
+          continue;
+        }
+
+        if (!config::video.encode_on_arrival && !resume) {
+          timer->sleep_for(next_deadline - now);
+        }
+      }
+
       // use encode timestamp instead of frame timestamp in case 
       // we are re using the last frame
-      if (frame_timestamp == last_frametimestamp)
-        frame_timestamp = std::chrono::steady_clock::now(); 
+      if (frame_timestamp == last_frametimestamp) {
+        frame_timestamp = std::chrono::steady_clock::now();
+        timing = {};
+      }
       last_frametimestamp = frame_timestamp;
-      
-      encode_timestamp = std::chrono::steady_clock::now();
-      auto sleep_period = 
-        std::chrono::nanoseconds(1s).count() / config->framerate 
-        - (encode_timestamp - last_encode_timestamp).count();
+      if (frame_timestamp) {
+        timing.captured = *frame_timestamp;
+      }
 
-      last_encode_timestamp = encode_timestamp;
+      if (new_frame) {
+        static_frames = 0;
+      }
+      else if (config::video.static_content.enabled && !requested_idr_frame) {
+        static_frames = std::min(static_frames + 1, 16);
+      }
 
-      if(sleep_period > 0) {
-#ifdef _WIN32
-        LARGE_INTEGER due_time;
-        due_time.QuadPart = sleep_period / -100;
-        SetWaitableTimer(timer, &due_time, 0, nullptr, nullptr, false);
-        WaitForSingleObject(timer, INFINITE);
-#else
-        std::this_thread::sleep_for(sleep_period * 1ns);
-#endif
+      now = std::chrono::steady_clock::now();
+      if (new_frame && (config::video.encode_on_arrival || resume)) {
+        // The deadline only repeats the last frame when capture stalls
+        next_deadline = now + frame_interval;
       }
+      else {
+        auto interval = frame_interval;
 
-      if (encode(frame_nr++, *session, packets, channel_data, frame_timestamp)) {
-        BOOST_LOG(error) << "Could not encode video packet"sv;
-        return;
+        // A single missed capture isn't static content yet, after that the interval doubles
+        // with every repeated frame until it reaches the floor
+        if (static_frames > 2) {
+          interval = std::min(frame_interval * (1 << (static_frames - 2)), static_interval());
+        }
+
+        next_deadline += interval;
+
+        // Don't try to catch up on frames that are long overdue, such as after a stall
+        if (next_deadline < now) {
+          next_deadline = now + interval;
+        }
+      }
+
+      TRACE_SCOPE("encode", frame_nr);
+      {
+        // The frame is due a frame interval after its capture, the sessions sharing the encoder are served by that
+        auto turn = schedule.turn(frame_timestamp.value_or(now) + frame_interval);
+        timing.ref_frames_invalidated = ref_frames_invalidated;
+        if (encode(frame_nr++, *session, packets, channel_data, frame_timestamp, timing)) {
+          BOOST_LOG(error) << "Could not encode video packet"sv;
+          invalidate_encoder_cache();
+          return;
+        }
+      }
+      if (config->metrics) {
+        config->metrics->encoded_frames.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // Waiting for the turn counts as well, a shared encoder is just as overloaded
+      auto busy = std::chrono::steady_clock::now() - now + (timing.convert_end - timing.convert_start);
+      if (overload_control.frame(busy, frame_interval, packets->size())) {
+        break;
       }
 
       session->request_normal_frame();
@@ -1866,8 +3214,11 @@ namespace video {
 
   input::touch_port_t
   make_port(platf::display_t *display, const config_t &config) {
-    float wd = display->width;
-    float hd = display->height;
+    // The encoded frame shows the region of the display
+    auto region = display->region();
+
+    float wd = region.right - region.left;
+    float hd = region.bottom - region.top;
 
     float wt = config.width;
     float ht = config.height;
@@ -1882,8 +3233,8 @@ namespace video {
 
     return input::touch_port_t {
       {
-        display->offset_x,
-        display->offset_y,
+        display->offset_x + region.left,
+        display->offset_y + region.top,
         config.width,
         config.height,
       },
@@ -1900,7 +3251,10 @@ namespace video {
     std::unique_ptr<platf::encode_device_t> result;
 
     auto colorspace = colorspace_from_client_config(config, disp.is_hdr());
-    auto pix_fmt = (colorspace.bit_depth == 10) ? encoder.platform_formats->pix_fmt_10bit : encoder.platform_formats->pix_fmt_8bit;
+    auto &formats = *encoder.platform_formats;
+    auto pix_fmt = config.chromaSamplingType == 1 ?
+                     (colorspace.bit_depth == 10 ? formats.pix_fmt_yuv444_10bit : formats.pix_fmt_yuv444_8bit) :
+                     (colorspace.bit_depth == 10 ? formats.pix_fmt_10bit : formats.pix_fmt_8bit);
 
     if (dynamic_cast<const encoder_platform_formats_avcodec *>(encoder.platform_formats.get())) {
       result = disp.make_avcodec_encode_device(pix_fmt);
@@ -1908,6 +3262,9 @@ namespace video {
     else if (dynamic_cast<const encoder_platform_formats_nvenc *>(encoder.platform_formats.get())) {
       result = disp.make_nvenc_encode_device(pix_fmt);
     }
+    else if (dynamic_cast<const encoder_platform_formats_amf *>(encoder.platform_formats.get())) {
+      result = disp.make_amf_encode_device(pix_fmt);
+    }
 
     if (result) {
       result->colorspace = colorspace;
@@ -1924,6 +3281,7 @@ namespace video {
 
     auto encode_device = make_encode_device(*disp, encoder, *ctx.config);
     if (!encode_device) {
+      invalidate_encoder_cache();
       return std::nullopt;
     }
 
@@ -1944,6 +3302,7 @@ namespace video {
 
     auto session = make_encode_session(disp, encoder, *ctx.config, img.width, img.height, std::move(encode_device));
     if (!session) {
+      invalidate_encoder_cache();
       return std::nullopt;
     }
 
@@ -1954,6 +3313,9 @@ namespace video {
     }
 
     encode_session.session = std::move(session);
+    if (config::video.content_adaptive.enabled) {
+      encode_session.classifier.emplace(ctx.config->framerate);
+    }
 
     return encode_session;
   }
@@ -1996,7 +3358,9 @@ namespace video {
     next:
 
       // reset_display() will sleep between retries
-      reset_display(disp, encoder.platform_formats->dev_type, display_names[display_p], synced_session_ctxs.front()->config);
+      auto disp_config = *synced_session_ctxs.front()->config;
+      reset_display(disp, encoder.platform_formats->dev_type, display_names[display_p], &disp_config);
+      apply_test_pattern(disp, encoder.platform_formats->dev_type, disp_config.framerate);
       if (disp) {
         break;
       }
@@ -2006,6 +3370,10 @@ namespace video {
       return encode_e::error;
     }
 
+    for (auto &ctx : synced_session_ctxs) {
+      follow_display(*ctx->config, *disp);
+    }
+
     auto img = disp->alloc_img();
     if (!img || disp->dummy_img(img.get())) {
       return encode_e::error;
@@ -2022,8 +3390,25 @@ namespace video {
     }
 
     auto ec = platf::capture_e::ok;
+
+    // Set when the last reinit only recreated the capture, until a frame comes through
+    bool capture_reinit_pending = false;
+
+    capture_throttle_t capture_throttle;
+
+    auto next_crop_check = std::chrono::steady_clock::now();
+
     while (encode_session_ctx_queue.running()) {
       auto push_captured_image_callback = [&](std::shared_ptr<platf::img_t> &&img, bool frame_captured) -> bool {
+        if (frame_captured) {
+          capture_reinit_pending = false;
+        }
+
+        if (frame_captured && crop_moved(*disp, next_crop_check)) {
+          ec = platf::capture_e::reinit;
+          return false;
+        }
+
         while (encode_session_ctx_queue.peek()) {
           auto encode_session_ctx = encode_session_ctx_queue.pop();
           if (!encode_session_ctx) {
@@ -2032,6 +3417,8 @@ namespace video {
 
           synced_session_ctxs.emplace_back(std::make_unique<sync_session_ctx_t>(std::move(*encode_session_ctx)));
 
+          follow_display(*synced_session_ctxs.back()->config, *disp);
+
           auto encode_session = make_synced_session(disp.get(), encoder, *img, *synced_session_ctxs.back());
           if (!encode_session) {
             ec = platf::capture_e::error;
@@ -2065,35 +3452,72 @@ namespace video {
             return false;
           }
 
+          // Every session of the display is rebuilt, so the one that changed starts with an IDR frame of the new codec
+          if (ctx->encoding_events->peek()) {
+            if (auto encoding = ctx->encoding_events->pop(0ms)) {
+              apply_encoding(*ctx->config, *encoding);
+              ec = platf::capture_e::reinit;
+              return false;
+            }
+          }
+
           if (ctx->idr_events->peek()) {
-            pos->session->request_idr_frame();
+            if (!pos->session->request_intra_refresh()) {
+              pos->session->request_idr_frame();
+            }
             ctx->idr_events->pop();
           }
 
-          if (frame_captured && pos->session->convert(*img)) {
-            BOOST_LOG(error) << "Could not convert image"sv;
-            ctx->shutdown_event->raise(true);
+          latency::frame_timing_t timing;
+          if (frame_captured) {
+            timing.convert_start = std::chrono::steady_clock::now();
+            if (pos->session->convert(*img)) {
+              BOOST_LOG(error) << "Could not convert image"sv;
+              ctx->shutdown_event->raise(true);
 
-            continue;
+              continue;
+            }
+            timing.convert_end = std::chrono::steady_clock::now();
+            TRACE_SPAN("convert", timing.convert_start, timing.convert_end, ctx->frame_nr);
+
+            adapt_to_content(*pos->session, pos->classifier, *img);
           }
 
           std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
           if (img) {
             frame_timestamp = img->frame_timestamp;
           }
+          if (frame_timestamp) {
+            timing.captured = *frame_timestamp;
+          }
 
-          if (encode(ctx->frame_nr++, *pos->session, ctx->packets, ctx->channel_data, frame_timestamp)) {
+          TRACE_SCOPE("encode", ctx->frame_nr);
+          if (encode(ctx->frame_nr++, *pos->session, ctx->packets, ctx->channel_data, frame_timestamp, timing)) {
             BOOST_LOG(error) << "Could not encode video packet"sv;
+            invalidate_encoder_cache();
             ctx->shutdown_event->raise(true);
 
             continue;
           }
+          if (auto &metrics = ctx->config->metrics) {
+            if (frame_captured) {
+              metrics->captured_frames.fetch_add(1, std::memory_order_relaxed);
+            }
+            metrics->encoded_frames.fetch_add(1, std::memory_order_relaxed);
+          }
 
           pos->session->request_normal_frame();
 
           ++pos;
         })
 
+        if (frame_captured) {
+          int framerate = 0;
+          for (auto &synced_session : synced_sessions) {
+            framerate = std::max(framerate, synced_session.ctx->config->framerate);
+          }
+          capture_throttle.wait(framerate);
+        }
 
         return true;
       };
@@ -2105,6 +3529,14 @@ namespace video {
       };
 
       auto status = disp->capture(push_captured_image_callback, pull_free_image_callback, &display_cursor);
+
+      // The sessions keep encoding when only the capture had to be recreated, as in captureThread()
+      if (status == platf::capture_e::reinit && ec == platf::capture_e::ok && !capture_reinit_pending && disp->reinit_capture()) {
+        BOOST_LOG(info) << "Recreated the capture of "sv << display_names[display_p] << ", the encode sessions continue"sv;
+        capture_reinit_pending = true;
+        continue;
+      }
+
       switch (status) {
         case platf::capture_e::reinit:
         case platf::capture_e::error:
@@ -2141,6 +3573,8 @@ namespace video {
 
     // Encoding and capture takes place on this thread
     platf::adjust_thread_priority(platf::thread_priority_e::high);
+    platf::place_pipeline_thread("video encode"sv);
+    TRACE_THREAD("video encode");
 
     std::vector<std::string> display_names;
     int display_p = -1;
@@ -2160,7 +3594,7 @@ namespace video {
       shutdown_event->raise(true);
     });
 
-    auto ref = capture_thread_async.ref();
+    auto ref = ref_capture_thread_async(config);
     if (!ref) {
       return;
     }
@@ -2176,8 +3610,16 @@ namespace video {
     auto touch_port_event = mail->event<input::touch_port_t>(mail::touch_port);
     auto hdr_event = mail->event<hdr_info_t>(mail::hdr);
 
+    // The share of the encoder, with the load the session asked for and the load it got
+    std::unique_ptr<scheduler::session_t> schedule;
+    scheduler::load_t requested {};
+    scheduler::load_t granted {};
+    overload::controller_t overload_control;
+
     // Encoding takes place on this thread
     platf::adjust_thread_priority(platf::thread_priority_e::high);
+    platf::place_pipeline_thread("video encode"sv);
+    TRACE_THREAD("video encode");
 
     while (!shutdown_event->peek() && images->running()) {
       // Wait for the main capture event when the display is being reinitialized
@@ -2198,8 +3640,35 @@ namespace video {
 
       auto &encoder = *chosen_encoder;
 
+      follow_display(config, *display);
+
+      // A configuration nobody changed since it was granted still asks for the load before the overload steps and the scheduler lowered it
+      scheduler::load_t load { config.width, config.height, config.framerate };
+      if (!schedule || load != granted) {
+        requested = load;
+      }
+
+      load = requested;
+      overload_control.apply(load.width, load.height, load.framerate);
+      if (schedule) {
+        schedule->update(load);
+      }
+      else {
+        auto adapter = config::video.encode_adapter_name.empty() ? config::video.adapter_name : config::video.encode_adapter_name;
+        schedule = scheduler::admit(std::string { encoder.name } + '|' + adapter, load);
+        if (!schedule) {
+          return;
+        }
+      }
+
+      granted = load;
+      config.width = load.width;
+      config.height = load.height;
+      config.framerate = load.framerate;
+
       auto encode_device = make_encode_device(*display, encoder, config);
       if (!encode_device) {
+        invalidate_encoder_cache();
         return;
       }
 
@@ -2224,6 +3693,7 @@ namespace video {
         &config, display,
         std::move(encode_device),
         ref->reinit_event, *ref->encoder_p,
+        *schedule, overload_control,
         channel_data);
     }
   }
@@ -2235,6 +3705,9 @@ namespace video {
     void *channel_data) {
     auto idr_events = mail->event<bool>(mail::idr);
 
+    config.native_resolution = !config.width || !config.height;
+    config.enableIntraRefresh = config::video.intra_refresh_frames > 1;
+
     idr_events->raise(true);
     if (chosen_encoder->flags & PARALLEL_ENCODING) {
       capture_async(std::move(mail), config, channel_data);
@@ -2245,10 +3718,11 @@ namespace video {
       ref->encode_session_ctx_queue.raise(sync_session_ctx_t {
         &join_event,
         mail->event<bool>(mail::shutdown),
-        mail->queue<packet_t>(mail::video_packets),
+        mail->queue<packet_t>(mail::video_packets, mail::video_packets_mode),
         std::move(idr_events),
         mail->event<hdr_info_t>(mail::hdr),
         mail->event<input::touch_port_t>(mail::touch_port),
+        mail->event<encoding_t>(mail::encoding),
         &config,
         1,
         channel_data,
@@ -2263,17 +3737,71 @@ namespace video {
     VUI_PARAMS = 0x01,
   };
 
+  // validate_config() returns it when the encode session couldn't be opened
+  constexpr int SESSION_UNAVAILABLE = -2;
+
+  enum class probe_e {
+    passed,
+    failed,  ///< The encoder rejected the config, running the probe again changes nothing
+    busy,  ///< An encode session couldn't be opened, maybe only because the other probes held theirs
+  };
+
+  /**
+   * @brief Run independent probes side by side on the task pool, then run the busy probes again one at a time.
+   * @details Drivers limit how many encode sessions can be open at once, so a probe that couldn't open
+   *          one side by side is only trusted once it failed on its own as well. The calling thread runs
+   *          queued tasks while it waits, so probes may run probes of their own.
+   * @param probes The probes.
+   */
+  void
+  run_probes(const std::vector<std::function<probe_e()>> &probes) {
+    std::vector<std::future<probe_e>> futures;
+    for (auto &probe : probes) {
+      futures.emplace_back(task_pool.push(probe));
+    }
+
+    std::vector<std::size_t> busy;
+    for (std::size_t x = 0; x < futures.size(); ++x) {
+      auto &future = futures[x];
+      while (future.wait_for(0ms) != std::future_status::ready) {
+        if (auto task = task_pool.pop()) {
+          (*task)->run();
+        }
+        else {
+          future.wait_for(1ms);
+        }
+      }
+
+      if (future.get() == probe_e::busy) {
+        busy.push_back(x);
+      }
+    }
+
+    if (probes.size() < 2) {
+      return;
+    }
+
+    for (auto x : busy) {
+      probes[x]();
+    }
+  }
+
   int
-  validate_config(std::shared_ptr<platf::display_t> disp, const encoder_t &encoder, const config_t &config) {
+  validate_config(std::shared_ptr<platf::display_t> disp, const encoder_t &encoder, const config_t &config, std::mutex &display_mutex) {
+    // Probes of the same encoder share the display, only the encode sessions are opened side by side
+    std::unique_lock display_lock { display_mutex };
+
     auto encode_device = make_encode_device(*disp, encoder, config);
     if (!encode_device) {
       return -1;
     }
 
+    display_lock.unlock();
     auto session = make_encode_session(disp.get(), encoder, config, disp->width, disp->height, std::move(encode_device));
     if (!session) {
-      return -1;
+      return SESSION_UNAVAILABLE;
     }
+    display_lock.lock();
 
     {
       // Image buffers are large, so we use a separate scope to free it immediately after convert()
@@ -2282,12 +3810,15 @@ namespace video {
         return -1;
       }
     }
-      
+    display_lock.unlock();
+
     session->request_idr_frame();
 
-    auto packets = mail::man->queue<packet_t>(mail::video_packets);
+    // Every probe has a mailbox of its own, probes run side by side
+    auto probe_mail = std::make_shared<safe::mail_raw_t>();
+    auto packets = probe_mail->queue<packet_t>(mail::video_packets, mail::video_packets_mode);
     while (!packets->peek()) {
-      if (encode(1, *session, packets, nullptr, {})) {
+      if (encode(1, *session, packets, nullptr, {}, {})) {
         return -1;
       }
     }
@@ -2301,29 +3832,48 @@ namespace video {
 
     int flag = 0;
 
-    // This check only applies for H.264 and HEVC
-    if (config.videoFormat <= 1) {
-      if (auto packet_avcodec = dynamic_cast<packet_raw_avcodec *>(packet.get())) {
-        if (cbs::validate_sps(packet_avcodec->av_packet, config.videoFormat ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264)) {
-          flag |= VUI_PARAMS;
-        }
-      }
-      else {
-        // Don't check it for non-avcodec encoders.
+    // The AV1 sequence header counts as VUI when it describes the colorspace
+    if (auto packet_avcodec = dynamic_cast<packet_raw_avcodec *>(packet.get())) {
+      auto codec_id = config.videoFormat == 2 ? AV_CODEC_ID_AV1 : config.videoFormat ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264;
+      if (cbs::validate_sps(packet_avcodec->av_packet, codec_id)) {
         flag |= VUI_PARAMS;
       }
     }
+    else {
+      // Don't check it for non-avcodec encoders.
+      flag |= VUI_PARAMS;
+    }
 
     return flag;
   }
 
   bool
-  validate_encoder(encoder_t &encoder, bool expect_failure) {
+  validate_encoder(encoder_t &encoder, bool expect_failure, bool *busy) {
     std::shared_ptr<platf::display_t> disp;
+    std::mutex display_mutex;
+
+    // Capture backends initialize global state when the first display is created, so encoders create them one at a time
+    static std::mutex reset_display_mutex;
+    auto reset_probe_display = [&](config_t *config) {
+      std::lock_guard lg { reset_display_mutex };
+      reset_display(disp, encoder.platform_formats->dev_type, config::video.output_name, config);
+    };
+
+    std::atomic<bool> session_unavailable = false;
+    auto validate = [&](const config_t &config) {
+      auto result = validate_config(disp, encoder, config, display_mutex);
+      if (result == SESSION_UNAVAILABLE) {
+        session_unavailable = true;
+      }
+      return result;
+    };
 
     BOOST_LOG(info) << "Trying encoder ["sv << encoder.name << ']';
     auto fg = util::fail_guard([&]() {
       BOOST_LOG(info) << "Encoder ["sv << encoder.name << "] failed"sv;
+      if (busy) {
+        *busy = session_unavailable;
+      }
     });
 
     auto test_hevc = active_hevc_mode >= 2 || (active_hevc_mode == 0 && !(encoder.flags & H264_ONLY));
@@ -2338,7 +3888,7 @@ namespace video {
     config_t config_autoselect { std::nullopt, 1920, 1080, 60, 1000, 1, 0, 1, 0, 0 };
 
     // If the encoder isn't supported at all (not even H.264), bail early
-    reset_display(disp, encoder.platform_formats->dev_type, config::video.output_name, &config_autoselect);
+    reset_probe_display(&config_autoselect);
     if (!disp) {
       return false;
     }
@@ -2350,14 +3900,14 @@ namespace video {
 
     // If we're expecting failure, use the autoselect ref config first since that will always succeed
     // if the encoder is available.
-    auto max_ref_frames_h264 = expect_failure ? -1 : validate_config(disp, encoder, config_max_ref_frames);
-    auto autoselect_h264 = max_ref_frames_h264 >= 0 ? max_ref_frames_h264 : validate_config(disp, encoder, config_autoselect);
+    auto max_ref_frames_h264 = expect_failure ? -1 : validate(config_max_ref_frames);
+    auto autoselect_h264 = max_ref_frames_h264 >= 0 ? max_ref_frames_h264 : validate(config_autoselect);
     if (autoselect_h264 < 0) {
       return false;
     }
     else if (expect_failure) {
       // We expected failure, but actually succeeded. Do the max_ref_frames probe we skipped.
-      max_ref_frames_h264 = validate_config(disp, encoder, config_max_ref_frames);
+      max_ref_frames_h264 = validate(config_max_ref_frames);
     }
 
     std::vector<std::pair<validate_flag_e, encoder_t::flag_e>> packet_deficiencies {
@@ -2371,30 +3921,45 @@ namespace video {
     encoder.h264[encoder_t::REF_FRAMES_RESTRICT] = max_ref_frames_h264 >= 0;
     encoder.h264[encoder_t::PASSED] = true;
 
-    if (test_hevc) {
-      config_max_ref_frames.videoFormat = 1;
-      config_autoselect.videoFormat = 1;
-
-      if (disp->is_codec_supported(encoder.hevc.name, config_autoselect)) {
-        auto max_ref_frames_hevc = validate_config(disp, encoder, config_max_ref_frames);
+    // HEVC and AV1 are probed side by side, the probe passes if every config passed
+    auto probe_codec = [&](encoder_t::codec_t &codec, int video_format) {
+      auto max_ref_frames_config = config_max_ref_frames;
+      auto autoselect_config = config_autoselect;
+      max_ref_frames_config.videoFormat = video_format;
+      autoselect_config.videoFormat = video_format;
+
+      std::unique_lock display_lock { display_mutex };
+      if (!disp->is_codec_supported(codec.name, autoselect_config)) {
+        BOOST_LOG(info) << "Encoder ["sv << codec.name << "] is not supported on this GPU"sv;
+        codec.capabilities.reset();
+        return probe_e::failed;
+      }
+      display_lock.unlock();
 
-        // If H.264 succeeded with max ref frames specified, assume that we can count on
-        // HEVC to also succeed with max ref frames specified if HEVC is supported.
-        auto autoselect_hevc = (max_ref_frames_hevc >= 0 || max_ref_frames_h264 >= 0) ?
-                                 max_ref_frames_hevc :
-                                 validate_config(disp, encoder, config_autoselect);
+      auto max_ref_frames = validate(max_ref_frames_config);
 
-        for (auto [validate_flag, encoder_flag] : packet_deficiencies) {
-          encoder.hevc[encoder_flag] = (max_ref_frames_hevc & validate_flag && autoselect_hevc & validate_flag);
-        }
+      // If H.264 succeeded with max ref frames specified, assume that we can count on
+      // HEVC and AV1 to also succeed with max ref frames specified if they are supported.
+      auto autoselect = (max_ref_frames >= 0 || max_ref_frames_h264 >= 0) ?
+                          max_ref_frames :
+                          validate(autoselect_config);
 
-        encoder.hevc[encoder_t::REF_FRAMES_RESTRICT] = max_ref_frames_hevc >= 0;
-        encoder.hevc[encoder_t::PASSED] = max_ref_frames_hevc >= 0 || autoselect_hevc >= 0;
+      for (auto [validate_flag, encoder_flag] : packet_deficiencies) {
+        codec[encoder_flag] = (max_ref_frames & validate_flag && autoselect & validate_flag);
       }
-      else {
-        BOOST_LOG(info) << "Encoder ["sv << encoder.hevc.name << "] is not supported on this GPU"sv;
-        encoder.hevc.capabilities.reset();
+
+      codec[encoder_t::REF_FRAMES_RESTRICT] = max_ref_frames >= 0;
+      codec[encoder_t::PASSED] = max_ref_frames >= 0 || autoselect >= 0;
+
+      if (max_ref_frames == SESSION_UNAVAILABLE || autoselect == SESSION_UNAVAILABLE) {
+        return probe_e::busy;
       }
+      return max_ref_frames >= 0 && autoselect >= 0 ? probe_e::passed : probe_e::failed;
+    };
+
+    std::vector<std::function<probe_e()>> codec_probes;
+    if (test_hevc) {
+      codec_probes.emplace_back([&]() { return probe_codec(encoder.hevc, 1); });
     }
     else {
       // Clear all cap bits for HEVC if we didn't probe it
@@ -2402,39 +3967,23 @@ namespace video {
     }
 
     if (test_av1) {
-      config_max_ref_frames.videoFormat = 2;
-      config_autoselect.videoFormat = 2;
-
-      if (disp->is_codec_supported(encoder.av1.name, config_autoselect)) {
-        auto max_ref_frames_av1 = validate_config(disp, encoder, config_max_ref_frames);
-
-        // If H.264 succeeded with max ref frames specified, assume that we can count on
-        // AV1 to also succeed with max ref frames specified if AV1 is supported.
-        auto autoselect_av1 = (max_ref_frames_av1 >= 0 || max_ref_frames_h264 >= 0) ?
-                                max_ref_frames_av1 :
-                                validate_config(disp, encoder, config_autoselect);
-
-        for (auto [validate_flag, encoder_flag] : packet_deficiencies) {
-          encoder.av1[encoder_flag] = (max_ref_frames_av1 & validate_flag && autoselect_av1 & validate_flag);
-        }
-
-        encoder.av1[encoder_t::REF_FRAMES_RESTRICT] = max_ref_frames_av1 >= 0;
-        encoder.av1[encoder_t::PASSED] = max_ref_frames_av1 >= 0 || autoselect_av1 >= 0;
-      }
-      else {
-        BOOST_LOG(info) << "Encoder ["sv << encoder.av1.name << "] is not supported on this GPU"sv;
-        encoder.av1.capabilities.reset();
-      }
+      codec_probes.emplace_back([&]() { return probe_codec(encoder.av1, 2); });
     }
     else {
       // Clear all cap bits for AV1 if we didn't probe it
       encoder.av1.capabilities.reset();
     }
 
+    run_probes(codec_probes);
+
     std::vector<std::pair<encoder_t::flag_e, config_t>> configs {
       { encoder_t::DYNAMIC_RANGE, { std::nullopt, 1920, 1080, 60, 1000, 1, 0, 3, 1, 1 } },
     };
 
+    if (encoder.flags & YUV444_SUPPORT) {
+      configs.emplace_back(encoder_t::YUV444, config_t { std::nullopt, 1920, 1080, 60, 1000, 1, 0, 1, 1, 0, 1 });
+    }
+
     for (auto &[flag, config] : configs) {
       auto h264 = config;
       auto hevc = config;
@@ -2444,26 +3993,36 @@ namespace video {
       hevc.videoFormat = 1;
       av1.videoFormat = 2;
 
-      // Reset the display since we're switching from SDR to HDR
-      reset_display(disp, encoder.platform_formats->dev_type, config::video.output_name, &config);
+      // Reset the display, the probe may switch it from SDR to HDR
+      reset_probe_display(&config);
       if (!disp) {
         return false;
       }
 
       // HDR is not supported with H.264. Don't bother even trying it.
-      encoder.h264[flag] = flag != encoder_t::DYNAMIC_RANGE && validate_config(disp, encoder, h264) >= 0;
+      encoder.h264[flag] = flag != encoder_t::DYNAMIC_RANGE && validate(h264) >= 0;
+
+      auto probe_flag = [&](encoder_t::codec_t &codec, encoder_t::flag_e flag, const config_t &codec_config) {
+        auto result = validate(codec_config);
+        codec[flag] = result >= 0;
+        return result == SESSION_UNAVAILABLE ? probe_e::busy : codec[flag] ? probe_e::passed : probe_e::failed;
+      };
 
+      std::vector<std::function<probe_e()>> flag_probes;
       if (encoder.hevc[encoder_t::PASSED]) {
-        encoder.hevc[flag] = validate_config(disp, encoder, hevc) >= 0;
+        flag_probes.emplace_back([&, flag = flag]() { return probe_flag(encoder.hevc, flag, hevc); });
       }
 
       if (encoder.av1[encoder_t::PASSED]) {
-        encoder.av1[flag] = validate_config(disp, encoder, av1) >= 0;
+        flag_probes.emplace_back([&, flag = flag]() { return probe_flag(encoder.av1, flag, av1); });
       }
+
+      run_probes(flag_probes);
     }
 
     encoder.h264[encoder_t::VUI_PARAMETERS] = encoder.h264[encoder_t::VUI_PARAMETERS] && !config::sunshine.flags[config::flag::FORCE_VIDEO_HEADER_REPLACE];
     encoder.hevc[encoder_t::VUI_PARAMETERS] = encoder.hevc[encoder_t::VUI_PARAMETERS] && !config::sunshine.flags[config::flag::FORCE_VIDEO_HEADER_REPLACE];
+    encoder.av1[encoder_t::VUI_PARAMETERS] = encoder.av1[encoder_t::VUI_PARAMETERS] && !config::sunshine.flags[config::flag::FORCE_VIDEO_HEADER_REPLACE];
 
     if (!encoder.h264[encoder_t::VUI_PARAMETERS]) {
       BOOST_LOG(warning) << encoder.name << ": h264 missing sps->vui parameters"sv;
@@ -2471,11 +4030,109 @@ namespace video {
     if (encoder.hevc[encoder_t::PASSED] && !encoder.hevc[encoder_t::VUI_PARAMETERS]) {
       BOOST_LOG(warning) << encoder.name << ": hevc missing sps->vui parameters"sv;
     }
+    if (encoder.av1[encoder_t::PASSED] && !encoder.av1[encoder_t::VUI_PARAMETERS]) {
+      BOOST_LOG(warning) << encoder.name << ": av1 missing color description in the sequence header"sv;
+    }
 
     fg.disable();
     return true;
   }
 
+  /**
+   * @brief Probe results of an encoder, as kept in the encoder cache.
+   */
+  struct cached_probe_t {
+    bool passed;
+    std::bitset<encoder_t::MAX_FLAGS> h264;
+    std::bitset<encoder_t::MAX_FLAGS> hevc;
+    std::bitset<encoder_t::MAX_FLAGS> av1;
+  };
+
+  /**
+   * @brief Probe results only hold for the GPUs, drivers, version and settings they were probed with.
+   * @return The key of the encoder cache, empty if the GPUs can't be identified.
+   */
+  std::string
+  encoder_cache_key() {
+    auto gpu_identity = platf::gpu_identity();
+    if (gpu_identity.empty()) {
+      return {};
+    }
+
+    std::stringstream key;
+    key << PROJECT_VER << '|' << gpu_identity << '|'
+        << config::video.adapter_name << '|' << config::video.encode_adapter_name << '|' << config::video.output_name << '|'
+        << config::video.hevc_mode << '|' << config::video.av1_mode << '|'
+        << config::video.vaapi.low_power << '|'
+        << config::sunshine.flags[config::flag::FORCE_VIDEO_HEADER_REPLACE];
+    return key.str();
+  }
+
+  std::map<std::string, cached_probe_t>
+  load_encoder_cache(const std::string &key) {
+    namespace pt = boost::property_tree;
+
+    if (key.empty() || config::video.encoder_cache.empty() || !std::filesystem::exists(config::video.encoder_cache)) {
+      return {};
+    }
+
+    std::map<std::string, cached_probe_t> probes;
+    try {
+      pt::ptree tree;
+      pt::read_json(config::video.encoder_cache, tree);
+
+      if (tree.get<std::string>("key") != key) {
+        BOOST_LOG(info) << "GPUs, drivers or settings changed since the encoders were last probed"sv;
+        return {};
+      }
+
+      for (auto &[name, probe] : tree.get_child("encoders")) {
+        probes.emplace(name, cached_probe_t {
+                               probe.get<bool>("passed"),
+                               probe.get<unsigned long>("h264"),
+                               probe.get<unsigned long>("hevc"),
+                               probe.get<unsigned long>("av1"),
+                             });
+      }
+    }
+    catch (const std::exception &e) {
+      BOOST_LOG(warning) << "Couldn't read the encoder cache "sv << config::video.encoder_cache << ": "sv << e.what();
+      return {};
+    }
+
+    return probes;
+  }
+
+  void
+  save_encoder_cache(const std::string &key, const std::map<std::string, cached_probe_t> &probes) {
+    namespace pt = boost::property_tree;
+
+    if (key.empty() || config::video.encoder_cache.empty()) {
+      return;
+    }
+
+    pt::ptree encoders;
+    for (auto &[name, probe] : probes) {
+      pt::ptree node;
+      node.put("passed", probe.passed);
+      node.put("h264", probe.h264.to_ulong());
+      node.put("hevc", probe.hevc.to_ulong());
+      node.put("av1", probe.av1.to_ulong());
+      encoders.push_back({ name, std::move(node) });
+    }
+
+    pt::ptree tree;
+    tree.put("key", key);
+    tree.add_child("encoders", encoders);
+
+    try {
+      pt::write_json(config::video.encoder_cache, tree);
+    }
+    catch (const std::exception &e) {
+      BOOST_LOG(warning) << "Couldn't write the encoder cache "sv << config::video.encoder_cache << ": "sv << e.what();
+    }
+  }
+
   /**
    * This is called once at startup and each time a stream is launched to
    * ensure the best encoder is selected. Encoder availability can change
@@ -2499,6 +4156,41 @@ namespace video {
     active_av1_mode = config::video.av1_mode;
     last_encoder_probe_supported_ref_frames_invalidation = false;
 
+    // Encoders probed on an earlier launch aren't probed again, as long as nothing changed since
+    auto cache_key = encoder_cache_key();
+    auto cached_probes = load_encoder_cache(cache_key);
+    bool cache_changed = false;
+
+    // Encoders probed during this launch
+    std::map<std::string, cached_probe_t> prevalidated;
+    auto validate = [&](encoder_t &encoder, bool expect_failure) {
+      auto name = std::string { encoder.name };
+      if (auto it = prevalidated.find(name); it != std::end(prevalidated)) {
+        encoder.h264.capabilities = it->second.h264;
+        encoder.hevc.capabilities = it->second.hevc;
+        encoder.av1.capabilities = it->second.av1;
+
+        return it->second.passed;
+      }
+
+      if (auto it = cached_probes.find(name); it != std::end(cached_probes)) {
+        encoder.h264.capabilities = it->second.h264;
+        encoder.hevc.capabilities = it->second.hevc;
+        encoder.av1.capabilities = it->second.av1;
+
+        BOOST_LOG(info) << "Encoder ["sv << encoder.name << (it->second.passed ? "] passed"sv : "] failed"sv) << " on an earlier launch"sv;
+        return it->second.passed;
+      }
+
+      auto passed = validate_encoder(encoder, expect_failure);
+      cached_probe_t probe { passed, encoder.h264.capabilities, encoder.hevc.capabilities, encoder.av1.capabilities };
+      prevalidated[name] = probe;
+      cached_probes[name] = probe;
+      cache_changed = true;
+
+      return passed;
+    };
+
     auto adjust_encoder_constraints = [&](encoder_t *encoder) {
       // If we can't satisfy both the encoder and codec requirement, prefer the encoder over codec support
       if (active_hevc_mode == 3 && !encoder->hevc[encoder_t::DYNAMIC_RANGE]) {
@@ -2527,7 +4219,7 @@ namespace video {
 
         if (encoder->name == config::video.encoder) {
           // Remove the encoder from the list entirely if it fails validation
-          if (!validate_encoder(*encoder, previous_encoder && previous_encoder != encoder)) {
+          if (!validate(*encoder, previous_encoder && previous_encoder != encoder)) {
             pos = encoder_list.erase(pos);
             break;
           }
@@ -2549,13 +4241,56 @@ namespace video {
 
     BOOST_LOG(info) << "// Testing for available encoders, this may generate errors. You can safely ignore those errors. //"sv;
 
+    // The preferred encoder is probed on its own, the others are only needed when it falls short.
+    // Those are probed side by side, so the selection below finds their results ready.
+    if (chosen_encoder == nullptr && !encoder_list.empty()) {
+      auto preferred = encoder_list.front();
+      auto preferred_passed = validate(*preferred, previous_encoder && previous_encoder != preferred);
+      auto preferred_sufficient = preferred_passed &&
+                                  (active_hevc_mode < 2 || preferred->hevc[encoder_t::PASSED]) &&
+                                  (active_av1_mode < 2 || preferred->av1[encoder_t::PASSED]) &&
+                                  (active_hevc_mode != 3 || preferred->hevc[encoder_t::DYNAMIC_RANGE]) &&
+                                  (active_av1_mode != 3 || preferred->av1[encoder_t::DYNAMIC_RANGE]);
+
+      if (!preferred_sufficient) {
+        std::vector<encoder_t *> remaining;
+        for (auto encoder : encoder_list) {
+          if (encoder != preferred && !cached_probes.count(std::string { encoder->name })) {
+            remaining.push_back(encoder);
+          }
+        }
+
+        auto results = std::make_unique<bool[]>(remaining.size());
+        std::vector<std::function<probe_e()>> probes;
+        for (std::size_t x = 0; x < remaining.size(); ++x) {
+          probes.emplace_back([&, x]() {
+            auto encoder = remaining[x];
+            bool busy = false;
+            results[x] = validate_encoder(*encoder, previous_encoder && previous_encoder != encoder, &busy);
+            return results[x] ? probe_e::passed : busy ? probe_e::busy : probe_e::failed;
+          });
+        }
+        run_probes(probes);
+
+        for (std::size_t x = 0; x < remaining.size(); ++x) {
+          auto encoder = remaining[x];
+          cached_probe_t probe { results[x], encoder->h264.capabilities, encoder->hevc.capabilities, encoder->av1.capabilities };
+
+          prevalidated[std::string { encoder->name }] = probe;
+          cached_probes[std::string { encoder->name }] = probe;
+        }
+
+        cache_changed = cache_changed || !remaining.empty();
+      }
+    }
+
     // If we haven't found an encoder yet, but we want one with specific codec support, search for that now.
     if (chosen_encoder == nullptr && (active_hevc_mode >= 2 || active_av1_mode >= 2)) {
       KITTY_WHILE_LOOP(auto pos = std::begin(encoder_list), pos != std::end(encoder_list), {
         auto encoder = *pos;
 
         // Remove the encoder from the list entirely if it fails validation
-        if (!validate_encoder(*encoder, previous_encoder && previous_encoder != encoder)) {
+        if (!validate(*encoder, previous_encoder && previous_encoder != encoder)) {
           pos = encoder_list.erase(pos);
           continue;
         }
@@ -2592,7 +4327,7 @@ namespace video {
         // If we've used a previous encoder and it's not this one, we expect this encoder to
         // fail to validate. It will use a slightly different order of checks to more quickly
         // eliminate failing encoders.
-        if (!validate_encoder(*encoder, previous_encoder && previous_encoder != encoder)) {
+        if (!validate(*encoder, previous_encoder && previous_encoder != encoder)) {
           pos = encoder_list.erase(pos);
           continue;
         }
@@ -2606,6 +4341,8 @@ namespace video {
     }
 
     if (chosen_encoder == nullptr) {
+      invalidate_encoder_cache();
+
       BOOST_LOG(fatal) << "Unable to find display or encoder during startup."sv;
       if (!config::video.adapter_name.empty() || !config::video.output_name.empty()) {
         BOOST_LOG(fatal) << "Please ensure your manually chosen GPU and monitor are connected and powered on."sv;
@@ -2620,6 +4357,10 @@ namespace video {
     BOOST_LOG(info) << "// Ignore any errors mentioned above, they are not relevant. //"sv;
     BOOST_LOG(info);
 
+    if (cache_changed) {
+      save_encoder_cache(cache_key, cached_probes);
+    }
+
     auto &encoder = *chosen_encoder;
 
     last_encoder_probe_supported_ref_frames_invalidation = (encoder.flags & REF_FRAMES_INVALIDATION);
@@ -2693,6 +4434,34 @@ namespace video {
     return hw_device_buf;
   }
 
+  // Linux only declaration
+  typedef int (*vulkan_init_avcodec_hardware_input_buffer_fn)(platf::avcodec_encode_device_t *encode_device, AVBufferRef **hw_device_buf);
+
+  util::Either<avcodec_buffer_t, int>
+  vulkan_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *encode_device) {
+    avcodec_buffer_t hw_device_buf;
+
+    // If an egl hwdevice
+    if (encode_device->data) {
+      if (((vulkan_init_avcodec_hardware_input_buffer_fn) encode_device->data)(encode_device, &hw_device_buf)) {
+        return -1;
+      }
+
+      return hw_device_buf;
+    }
+
+    auto render_device = config::video.adapter_name.empty() ? "/dev/dri/renderD128" : config::video.adapter_name.c_str();
+
+    auto status = av_hwdevice_ctx_create(&hw_device_buf, AV_HWDEVICE_TYPE_DRM, render_device, nullptr, 0);
+    if (status < 0) {
+      char string[AV_ERROR_MAX_STRING_SIZE];
+      BOOST_LOG(error) << "Failed to create a DRM device: "sv << av_make_error_string(string, AV_ERROR_MAX_STRING_SIZE, status);
+      return -1;
+    }
+
+    return hw_device_buf;
+  }
+
   util::Either<avcodec_buffer_t, int>
   cuda_init_avcodec_hardware_input_buffer(platf::avcodec_encode_device_t *encode_device) {
     avcodec_buffer_t hw_device_buf;
@@ -2797,6 +4566,8 @@ namespace video {
         return platf::mem_type_e::vaapi;
       case AV_HWDEVICE_TYPE_CUDA:
         return platf::mem_type_e::cuda;
+      case AV_HWDEVICE_TYPE_DRM:
+        return platf::mem_type_e::vulkan;
       case AV_HWDEVICE_TYPE_NONE:
         return platf::mem_type_e::system;
       case AV_HWDEVICE_TYPE_VIDEOTOOLBOX:
@@ -2819,6 +4590,10 @@ namespace video {
         return platf::pix_fmt_e::nv12;
       case AV_PIX_FMT_P010:
         return platf::pix_fmt_e::p010;
+      case AV_PIX_FMT_YUV444P:
+        return platf::pix_fmt_e::yuv444p;
+      case AV_PIX_FMT_YUV444P16:
+        return platf::pix_fmt_e::yuv444p16;
       default:
         return platf::pix_fmt_e::unknown;
     }
@@ -4,8 +4,13 @@
  */
 #pragma once
 
+#include "buffer_pool.h"
+#include "content.h"
 #include "input.h"
+#include "latency.h"
+#include "metrics.h"
 #include "platform/common.h"
+#include "stat_trackers.h"
 #include "thread_safe.h"
 #include "video_colorspace.h"
 
@@ -42,6 +47,14 @@ namespace video {
     int chromaSamplingType;  // 0 - 4:2:0, 1 - 4:4:4
 
     int enableIntraRefresh;  // 0 - disabled, 1 - enabled
+
+    bool native_resolution;  // Set by capture() when width and height are 0, the session follows the display resolution
+
+    // Largest picture the client decodes when the session follows the display, 0 if it has no limit
+    int max_width;
+    int max_height;
+
+    std::shared_ptr<metrics::session_t> metrics;  // Counters of the session, may be null
   };
 
   platf::mem_type_e
@@ -106,12 +119,29 @@ namespace video {
 
   struct encoder_platform_formats_nvenc: encoder_platform_formats_t {
     encoder_platform_formats_nvenc(
+      const platf::mem_type_e &dev_type,
+      const platf::pix_fmt_e &pix_fmt_8bit,
+      const platf::pix_fmt_e &pix_fmt_10bit,
+      const platf::pix_fmt_e &pix_fmt_yuv444_8bit = platf::pix_fmt_e::unknown,
+      const platf::pix_fmt_e &pix_fmt_yuv444_10bit = platf::pix_fmt_e::unknown) {
+      encoder_platform_formats_t::dev_type = dev_type;
+      encoder_platform_formats_t::pix_fmt_8bit = pix_fmt_8bit;
+      encoder_platform_formats_t::pix_fmt_10bit = pix_fmt_10bit;
+      encoder_platform_formats_t::pix_fmt_yuv444_8bit = pix_fmt_yuv444_8bit;
+      encoder_platform_formats_t::pix_fmt_yuv444_10bit = pix_fmt_yuv444_10bit;
+    }
+  };
+
+  struct encoder_platform_formats_amf: encoder_platform_formats_t {
+    encoder_platform_formats_amf(
       const platf::mem_type_e &dev_type,
       const platf::pix_fmt_e &pix_fmt_8bit,
       const platf::pix_fmt_e &pix_fmt_10bit) {
       encoder_platform_formats_t::dev_type = dev_type;
       encoder_platform_formats_t::pix_fmt_8bit = pix_fmt_8bit;
       encoder_platform_formats_t::pix_fmt_10bit = pix_fmt_10bit;
+      encoder_platform_formats_t::pix_fmt_yuv444_8bit = platf::pix_fmt_e::unknown;
+      encoder_platform_formats_t::pix_fmt_yuv444_10bit = platf::pix_fmt_e::unknown;
     }
   };
 
@@ -209,8 +239,31 @@ namespace video {
     virtual void
     request_normal_frame() = 0;
 
+    /**
+     * @brief Recover from loss with an intra-refresh wave instead of an IDR frame.
+     * @return `false` if the session doesn't use intra refresh, an IDR frame must be requested instead.
+     */
+    virtual bool
+    request_intra_refresh() = 0;
+
     virtual void
     invalidate_ref_frames(int64_t first_frame, int64_t last_frame) = 0;
+
+    /**
+     * @brief Change the bitrate and framerate of the running encoder.
+     * @param bitrate Video bitrate in kilobits.
+     * @param framerate Requested framerate.
+     * @return `true` on success, `false` if the session has to be rebuilt instead.
+     */
+    virtual bool
+    reconfigure(int bitrate, int framerate) = 0;
+
+    /**
+     * @brief Retune the running encoder for the class of the captured content.
+     * @return `false` if the encoder has no tuning for the class or can't change it on the fly.
+     */
+    virtual bool
+    set_content(content::content_e content) = 0;
   };
 
 #if !defined(__APPLE__)
@@ -218,6 +271,7 @@ namespace video {
 #endif
 
 #ifdef _WIN32
+  extern encoder_t amf_native;
   extern encoder_t amdvce;
   extern encoder_t quicksync;
 #endif
@@ -233,6 +287,15 @@ namespace video {
   struct packet_raw_t {
     virtual ~packet_raw_t() = default;
 
+    /**
+     * @brief Called by `packet_t` when the consumer drops the packet.
+     * @details Pooled packets return themselves to their pool instead of being deleted.
+     */
+    virtual void
+    recycle() {
+      delete this;
+    }
+
     virtual bool
     is_idr() = 0;
 
@@ -259,8 +322,22 @@ namespace video {
     void *channel_data = nullptr;
     bool after_ref_frame_invalidation = false;
     std::optional<std::chrono::steady_clock::time_point> frame_timestamp;
+    latency::frame_timing_t timing;
+
+    // Frames encoded in slices are raised one part at a time, as soon as the encoder has written it
+    uint16_t slice_index = 0;
+    bool end_of_frame = true;
+
+    // 0 is the base layer, frames of the layers above reference no frame of their own layer or above and
+    // may be dropped, see config::video.temporal_layers
+    uint8_t temporal_layer = 0;
+
+    // Layers the encoder codes, fewer than config::video.temporal_layers where the encoder caps them
+    uint8_t temporal_layers = 0;
   };
 
+  class avcodec_packet_pool_t;
+
   struct packet_raw_avcodec: packet_raw_t {
     packet_raw_avcodec() {
       av_packet = av_packet_alloc();
@@ -270,6 +347,9 @@ namespace video {
       av_packet_free(&this->av_packet);
     }
 
+    void
+    recycle() override;
+
     bool
     is_idr() override {
       return av_packet->flags & AV_PKT_FLAG_KEY;
@@ -291,6 +371,9 @@ namespace video {
     }
 
     AVPacket *av_packet;
+
+    // Set while the packet is borrowed from a pool
+    std::shared_ptr<avcodec_packet_pool_t> pool;
   };
 
   struct packet_raw_generic: packet_raw_t {
@@ -323,7 +406,96 @@ namespace video {
     bool idr;
   };
 
-  using packet_t = std::unique_ptr<packet_raw_t>;
+  /**
+   * @brief Encoded frame in a slab borrowed from a `buffer_pool::pool_t`.
+   * @details The slab goes back to the pool when the packet is destroyed.
+   */
+  struct packet_raw_pooled: packet_raw_t {
+    packet_raw_pooled(buffer_pool::slab_t &&frame_data, int64_t frame_index, bool idr):
+        frame_data { std::move(frame_data) }, index { frame_index }, idr { idr } {
+    }
+
+    bool
+    is_idr() override {
+      return idr;
+    }
+
+    int64_t
+    frame_index() override {
+      return index;
+    }
+
+    uint8_t *
+    data() override {
+      return frame_data.data();
+    }
+
+    size_t
+    data_size() override {
+      return frame_data.size();
+    }
+
+    buffer_pool::slab_t frame_data;
+    int64_t index;
+    bool idr;
+  };
+
+  /**
+   * @brief Deleter of `packet_t`, lets pooled packets return to their pool.
+   */
+  struct packet_deleter_t {
+    packet_deleter_t() = default;
+
+    // Allows std::make_unique() results to be moved into a packet_t
+    template <class T>
+    packet_deleter_t(const std::default_delete<T> &) {}
+
+    void
+    operator()(packet_raw_t *packet) const {
+      packet->recycle();
+    }
+  };
+
+  using packet_t = std::unique_ptr<packet_raw_t, packet_deleter_t>;
+
+  /**
+   * @brief Per-session free list of `packet_raw_avcodec` objects.
+   * @details Dropped packets have their `AVPacket` unreferenced and are handed out again, so the
+   *          receive loop does not allocate a packet object or an `AVPacket` per frame. Borrowed
+   *          packets keep the pool alive. The pool must be owned by a `std::shared_ptr`.
+   */
+  class avcodec_packet_pool_t: public std::enable_shared_from_this<avcodec_packet_pool_t> {
+  public:
+    using packet_ptr = std::unique_ptr<packet_raw_avcodec, packet_deleter_t>;
+
+    /**
+     * @param max_packets Number of packets kept for reuse, packets returned beyond that are deleted.
+     */
+    explicit avcodec_packet_pool_t(std::size_t max_packets);
+    ~avcodec_packet_pool_t();
+
+    avcodec_packet_pool_t(const avcodec_packet_pool_t &) = delete;
+    avcodec_packet_pool_t &
+    operator=(const avcodec_packet_pool_t &) = delete;
+
+    /**
+     * @brief Borrow a packet with an empty `AVPacket`.
+     */
+    packet_ptr
+    acquire();
+
+    void
+    give_back(packet_raw_avcodec *packet);
+
+  private:
+    std::size_t max_packets;
+
+    std::mutex mutex;
+    std::vector<packet_raw_avcodec *> free_packets;
+
+    // Packets waiting for reuse, sampled on every acquire()
+    stat_trackers::min_max_avg_tracker<double> free_packets_tracker;
+  };
 
   struct hdr_info_raw_t {
     explicit hdr_info_raw_t(bool enabled):
@@ -342,14 +514,88 @@ namespace video {
   extern int active_av1_mode;
   extern bool last_encoder_probe_supported_ref_frames_invalidation;
 
+  /**
+   * @brief Images the capture of a display holds, reported with the metrics of its sessions.
+   */
+  struct image_pool_stats_t {
+    std::string display;
+    std::size_t capacity;
+    std::size_t allocated;
+    std::size_t used;
+    std::uint64_t bytes;  // Memory of the allocated images, CPU or GPU
+  };
+
+  /**
+   * @brief Whether the chosen encoder lets a process capture several displays at once.
+   * @details Encoders that capture and encode on separate threads get a capture thread per display,
+   *          the others capture and encode every session on a single thread.
+   */
+  bool
+  concurrent_displays();
+
+  /**
+   * @brief Settings of a running session that take a new encode session, raised on mail::encoding.
+   * @details The new session starts with an IDR frame, the packets of the old one are all sent before it.
+   */
+  struct encoding_t {
+    int width;  // 0 follows the display resolution
+    int height;
+    int max_width;  // Limits of the client when the session follows the display, 0 if none
+    int max_height;
+    int videoFormat;  // As in config_t
+    int dynamicRange;
+    int chromaSamplingType;
+
+    bool
+    operator==(const encoding_t &) const = default;
+  };
+
+  /**
+   * @brief Whether the probed encoder encodes a codec with the given options.
+   * @param video_format 0 - H.264, 1 - HEVC, 2 - AV1
+   * @param dynamic_range 10-bit encoding as well.
+   * @param yuv444 4:4:4 chroma as well.
+   */
+  bool
+  codec_supported(int video_format, bool dynamic_range, bool yuv444);
+
+  /**
+   * @brief Scale a resolution down to fit the limits, keeping its aspect ratio and the dimensions even.
+   * @param max_width 0 if there is no limit.
+   * @param max_height 0 if there is no limit.
+   */
+  void
+  fit_resolution(int &width, int &height, int max_width, int max_height);
+
   void
   capture(
     safe::mail_t mail,
     config_t config,
     void *channel_data);
 
+  /**
+   * @param busy Set on failure if an encode session couldn't be opened, the encoder may pass on its own.
+   */
   bool
-  validate_encoder(encoder_t &encoder, bool expect_failure);
+  validate_encoder(encoder_t &encoder, bool expect_failure, bool *busy = nullptr);
   int
   probe_encoders();
+
+  /**
+   * @brief The encoders of this platform, in the order `probe_encoders()` tries them.
+   */
+  const std::vector<encoder_t *> &
+  platform_encoders();
+
+  std::unique_ptr<platf::encode_device_t>
+  make_encode_device(platf::display_t &disp, const encoder_t &encoder, const config_t &config);
+  std::unique_ptr<encode_session_t>
+  make_encode_session(platf::display_t *disp, const encoder_t &encoder, const config_t &config, int width, int height, std::unique_ptr<platf::encode_device_t> encode_device);
+
+  /**
+   * @brief Encode the image of the last `convert()`, the packets are raised on `packets`.
+   * @return 0 on success, the encoder may hold the frame back and raise its packet later.
+   */
+  int
+  encode(int64_t frame_nr, encode_session_t &session, safe::mail_raw_t::queue_t<packet_t> &packets, void *channel_data, std::optional<std::chrono::steady_clock::time_point> frame_timestamp, latency::frame_timing_t timing);
 }  // namespace video
@@ -0,0 +1,394 @@
+/**
+ * @file src/yuv.cpp
+ * @brief Conversion of 32-bit BGRA images in system memory to 8-bit YUV.
+ */
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+  #define SUNSHINE_YUV_X86 1
+  #include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+  #define SUNSHINE_YUV_NEON 1
+  #include <arm_neon.h>
+#endif
+
+#include "yuv.h"
+
+namespace yuv {
+  namespace {
+    // The kernels of a row convert the pixels from `first` up to `width`, so the SIMD ones hand their tail to the scalar ones
+    using luma_fn = void (*)(std::uint8_t *y, const std::uint8_t *src, int first, int width, const coefficients_t &c);
+    using chroma420_fn = void (*)(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *row0, const std::uint8_t *row1, int first, int width, const coefficients_t &c);
+    using chroma444_fn = void (*)(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *src, int first, int width, const coefficients_t &c);
+
+    constexpr int SHIFT = 14;
+
+    inline std::uint8_t
+    clamp8(std::int32_t x) {
+      return (std::uint8_t) std::clamp(x, 0, 0xFF);
+    }
+
+    inline std::int32_t
+    dot(const std::int16_t c[3], std::int32_t r, std::int32_t g, std::int32_t b) {
+      return c[0] * r + c[1] * g + c[2] * b;
+    }
+
+    void
+    luma_row_scalar(std::uint8_t *y, const std::uint8_t *src, int first, int width, const coefficients_t &c) {
+      for (int x = first; x < width; ++x) {
+        auto p = src + x * 4;
+        y[x] = clamp8((dot(c.y, p[2], p[1], p[0]) + c.y_offset) >> SHIFT);
+      }
+    }
+
+    /**
+     * @tparam interleaved U and V share the plane of `u`, as in NV12.
+     */
+    template <bool interleaved>
+    void
+    chroma420_row_scalar(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *row0, const std::uint8_t *row1, int first, int width, const coefficients_t &c) {
+      for (int x = first; x < width; x += 2) {
+        // An odd width repeats the last column
+        auto p0 = row0 + x * 4;
+        auto p1 = row1 + x * 4;
+        auto next = x + 1 < width ? 4 : 0;
+
+        std::int32_t b = p0[0] + p0[next + 0] + p1[0] + p1[next + 0];
+        std::int32_t g = p0[1] + p0[next + 1] + p1[1] + p1[next + 1];
+        std::int32_t r = p0[2] + p0[next + 2] + p1[2] + p1[next + 2];
+
+        // The sum of four pixels takes two more bits
+        auto u_ = clamp8((dot(c.u, r, g, b) + (c.u_offset << 2)) >> (SHIFT + 2));
+        auto v_ = clamp8((dot(c.v, r, g, b) + (c.v_offset << 2)) >> (SHIFT + 2));
+        if constexpr (interleaved) {
+          u[x] = u_;
+          u[x + 1] = v_;
+        }
+        else {
+          u[x / 2] = u_;
+          v[x / 2] = v_;
+        }
+      }
+    }
+
+    void
+    chroma444_row_scalar(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *src, int first, int width, const coefficients_t &c) {
+      for (int x = first; x < width; ++x) {
+        auto p = src + x * 4;
+        u[x] = clamp8((dot(c.u, p[2], p[1], p[0]) + c.u_offset) >> SHIFT);
+        v[x] = clamp8((dot(c.v, p[2], p[1], p[0]) + c.v_offset) >> SHIFT);
+      }
+    }
+
+#ifdef SUNSHINE_YUV_X86
+    /**
+     * @brief The coefficients in the order of the channels of a BGRA pixel, for _mm256_madd_epi16().
+     */
+    inline std::int64_t
+    madd_coefficients(const std::int16_t c[3]) {
+      return (std::int64_t) ((std::uint64_t) (std::uint16_t) c[2] | (std::uint64_t) (std::uint16_t) c[1] << 16 | (std::uint64_t) (std::uint16_t) c[0] << 32);
+    }
+
+    /**
+     * @brief Weighted sum of the channels of 8 pixels, widened to 16 bits.
+     * @return Eight 32-bit sums, in the order of the pixels.
+     */
+    __attribute__((target("avx2"))) inline __m256i
+    madd_avx2(__m256i lo, __m256i hi, __m256i coefficients) {
+      // Both work within 128-bit lanes: lo holds the pixels 0, 1, 4 and 5, hi the pixels 2, 3, 6 and 7
+      return _mm256_hadd_epi32(_mm256_madd_epi16(lo, coefficients), _mm256_madd_epi16(hi, coefficients));
+    }
+
+    __attribute__((target("avx2"))) inline __m256i
+    dot_avx2(__m256i pixels, __m256i coefficients, __m256i offset) {
+      auto zero = _mm256_setzero_si256();
+      auto sum = madd_avx2(_mm256_unpacklo_epi8(pixels, zero), _mm256_unpackhi_epi8(pixels, zero), coefficients);
+
+      return _mm256_srai_epi32(_mm256_add_epi32(sum, offset), SHIFT);
+    }
+
+    /**
+     * @brief Saturate two vectors of 8 32-bit values to 16 bytes, in order.
+     */
+    __attribute__((target("avx2"))) inline __m128i
+    pack_avx2(__m256i a, __m256i b) {
+      // Packing interleaves the lanes of a and b, the permutation puts them back in order
+      auto words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+      return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+    }
+
+    __attribute__((target("avx2"))) void
+    luma_row_avx2(std::uint8_t *y, const std::uint8_t *src, int first, int width, const coefficients_t &c) {
+      auto coefficients = _mm256_set1_epi64x(madd_coefficients(c.y));
+      auto offset = _mm256_set1_epi32(c.y_offset);
+
+      int x = first;
+      for (; x + 16 <= width; x += 16) {
+        auto a = dot_avx2(_mm256_loadu_si256((const __m256i *) (src + x * 4)), coefficients, offset);
+        auto b = dot_avx2(_mm256_loadu_si256((const __m256i *) (src + x * 4 + 32)), coefficients, offset);
+
+        _mm_storeu_si128((__m128i *) (y + x), pack_avx2(a, b));
+      }
+
+      luma_row_scalar(y, src, x, width, c);
+    }
+
+    template <bool interleaved>
+    __attribute__((target("avx2"))) void
+    chroma420_row_avx2(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *row0, const std::uint8_t *row1, int first, int width, const coefficients_t &c) {
+      auto u_coefficients = _mm256_set1_epi64x(madd_coefficients(c.u));
+      auto v_coefficients = _mm256_set1_epi64x(madd_coefficients(c.v));
+      auto u_offset = _mm256_set1_epi32(c.u_offset << 2);
+      auto v_offset = _mm256_set1_epi32(c.v_offset << 2);
+      auto zero = _mm256_setzero_si256();
+
+      int x = first;
+      for (; x + 16 <= width; x += 16) {
+        // Sum every 2x2 block of 8 pixels: the two rows first, then the neighbouring pixels.
+        // Each half of 8 pixels leaves the sums of the blocks 0, 1 in the low lane and 2, 3 in the high lane.
+        __m256i blocks[2];
+        for (int half = 0; half < 2; ++half) {
+          auto a = _mm256_loadu_si256((const __m256i *) (row0 + x * 4 + half * 32));
+          auto b = _mm256_loadu_si256((const __m256i *) (row1 + x * 4 + half * 32));
+
+          auto lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+          auto hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+          lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+          hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+
+          blocks[half] = _mm256_unpacklo_epi64(lo, hi);
+        }
+
+        // The sums of both halves come out as the blocks 0, 1, 4, 5 and 2, 3, 6, 7
+        auto u_ = _mm256_permute4x64_epi64(madd_avx2(blocks[0], blocks[1], u_coefficients), 0xD8);
+        auto v_ = _mm256_permute4x64_epi64(madd_avx2(blocks[0], blocks[1], v_coefficients), 0xD8);
+        u_ = _mm256_srai_epi32(_mm256_add_epi32(u_, u_offset), SHIFT + 2);
+        v_ = _mm256_srai_epi32(_mm256_add_epi32(v_, v_offset), SHIFT + 2);
+
+        // 8 bytes of U followed by 8 bytes of V
+        auto uv = pack_avx2(u_, v_);
+        if constexpr (interleaved) {
+          _mm_storeu_si128((__m128i *) (u + x), _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+        }
+        else {
+          _mm_storel_epi64((__m128i *) (u + x / 2), uv);
+          _mm_storel_epi64((__m128i *) (v + x / 2), _mm_srli_si128(uv, 8));
+        }
+      }
+
+      chroma420_row_scalar<interleaved>(u, v, row0, row1, x, width, c);
+    }
+
+    __attribute__((target("avx2"))) void
+    chroma444_row_avx2(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *src, int first, int width, const coefficients_t &c) {
+      auto u_coefficients = _mm256_set1_epi64x(madd_coefficients(c.u));
+      auto v_coefficients = _mm256_set1_epi64x(madd_coefficients(c.v));
+      auto u_offset = _mm256_set1_epi32(c.u_offset);
+      auto v_offset = _mm256_set1_epi32(c.v_offset);
+
+      int x = first;
+      for (; x + 16 <= width; x += 16) {
+        auto a = _mm256_loadu_si256((const __m256i *) (src + x * 4));
+        auto b = _mm256_loadu_si256((const __m256i *) (src + x * 4 + 32));
+
+        _mm_storeu_si128((__m128i *) (u + x), pack_avx2(dot_avx2(a, u_coefficients, u_offset), dot_avx2(b, u_coefficients, u_offset)));
+        _mm_storeu_si128((__m128i *) (v + x), pack_avx2(dot_avx2(a, v_coefficients, v_offset), dot_avx2(b, v_coefficients, v_offset)));
+      }
+
+      chroma444_row_scalar(u, v, src, x, width, c);
+    }
+#endif
+
+#ifdef SUNSHINE_YUV_NEON
+    inline int16x8_t
+    widen_lo(uint8x16_t x) {
+      return vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(x)));
+    }
+
+    inline int16x8_t
+    widen_hi(uint8x16_t x) {
+      return vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(x)));
+    }
+
+    /**
+     * @brief Weighted sum of the channels of 8 pixels, saturated to bytes.
+     */
+    template <int shift>
+    inline uint8x8_t
+    dot_neon(int16x8_t r, int16x8_t g, int16x8_t b, const std::int16_t c[3], int32x4_t offset) {
+      auto lo = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(offset, vget_low_s16(r), c[0]), vget_low_s16(g), c[1]), vget_low_s16(b), c[2]);
+      auto hi = vmlal_n_s16(vmlal_n_s16(vmlal_n_s16(offset, vget_high_s16(r), c[0]), vget_high_s16(g), c[1]), vget_high_s16(b), c[2]);
+
+      return vqmovun_s16(vcombine_s16(vshrn_n_s32(lo, shift), vshrn_n_s32(hi, shift)));
+    }
+
+    void
+    luma_row_neon(std::uint8_t *y, const std::uint8_t *src, int first, int width, const coefficients_t &c) {
+      auto offset = vdupq_n_s32(c.y_offset);
+
+      int x = first;
+      for (; x + 16 <= width; x += 16) {
+        // Loading deinterleaves the channels: B, G, R and A
+        auto p = vld4q_u8(src + x * 4);
+
+        auto lo = dot_neon<SHIFT>(widen_lo(p.val[2]), widen_lo(p.val[1]), widen_lo(p.val[0]), c.y, offset);
+        auto hi = dot_neon<SHIFT>(widen_hi(p.val[2]), widen_hi(p.val[1]), widen_hi(p.val[0]), c.y, offset);
+        vst1q_u8(y + x, vcombine_u8(lo, hi));
+      }
+
+      luma_row_scalar(y, src, x, width, c);
+    }
+
+    template <bool interleaved>
+    void
+    chroma420_row_neon(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *row0, const std::uint8_t *row1, int first, int width, const coefficients_t &c) {
+      auto u_offset = vdupq_n_s32(c.u_offset << 2);
+      auto v_offset = vdupq_n_s32(c.v_offset << 2);
+
+      int x = first;
+      for (; x + 16 <= width; x += 16) {
+        auto p0 = vld4q_u8(row0 + x * 4);
+        auto p1 = vld4q_u8(row1 + x * 4);
+
+        // Pairwise additions sum the neighbouring pixels of both rows
+        auto sum = [&](int channel) {
+          return vreinterpretq_s16_u16(vpadalq_u8(vpaddlq_u8(p0.val[channel]), p1.val[channel]));
+        };
+        auto b = sum(0);
+        auto g = sum(1);
+        auto r = sum(2);
+
+        auto u_ = dot_neon<SHIFT + 2>(r, g, b, c.u, u_offset);
+        auto v_ = dot_neon<SHIFT + 2>(r, g, b, c.v, v_offset);
+        if constexpr (interleaved) {
+          vst2_u8(u + x, (uint8x8x2_t { { u_, v_ } }));
+        }
+        else {
+          vst1_u8(u + x / 2, u_);
+          vst1_u8(v + x / 2, v_);
+        }
+      }
+
+      chroma420_row_scalar<interleaved>(u, v, row0, row1, x, width, c);
+    }
+
+    void
+    chroma444_row_neon(std::uint8_t *u, std::uint8_t *v, const std::uint8_t *src, int first, int width, const coefficients_t &c) {
+      auto u_offset = vdupq_n_s32(c.u_offset);
+      auto v_offset = vdupq_n_s32(c.v_offset);
+
+      int x = first;
+      for (; x + 16 <= width; x += 16) {
+        auto p = vld4q_u8(src + x * 4);
+
+        auto r_lo = widen_lo(p.val[2]), g_lo = widen_lo(p.val[1]), b_lo = widen_lo(p.val[0]);
+        auto r_hi = widen_hi(p.val[2]), g_hi = widen_hi(p.val[1]), b_hi = widen_hi(p.val[0]);
+
+        vst1q_u8(u + x, vcombine_u8(dot_neon<SHIFT>(r_lo, g_lo, b_lo, c.u, u_offset), dot_neon<SHIFT>(r_hi, g_hi, b_hi, c.u, u_offset)));
+        vst1q_u8(v + x, vcombine_u8(dot_neon<SHIFT>(r_lo, g_lo, b_lo, c.v, v_offset), dot_neon<SHIFT>(r_hi, g_hi, b_hi, c.v, v_offset)));
+      }
+
+      chroma444_row_scalar(u, v, src, x, width, c);
+    }
+#endif
+
+    struct kernel_t {
+      luma_fn luma;
+      chroma420_fn nv12;
+      chroma420_fn i420;
+      chroma444_fn i444;
+      const char *name;
+    };
+
+    kernel_t
+    select_kernel() {
+#ifdef SUNSHINE_YUV_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return { luma_row_avx2, chroma420_row_avx2<true>, chroma420_row_avx2<false>, chroma444_row_avx2, "avx2" };
+      }
+#elif defined(SUNSHINE_YUV_NEON)
+      return { luma_row_neon, chroma420_row_neon<true>, chroma420_row_neon<false>, chroma444_row_neon, "neon" };
+#endif
+
+      return { luma_row_scalar, chroma420_row_scalar<true>, chroma420_row_scalar<false>, chroma444_row_scalar, "scalar" };
+    }
+
+    const kernel_t &
+    kernel() {
+      static const kernel_t selected = select_kernel();
+      return selected;
+    }
+
+    template <layout_e layout>
+    void
+    convert(const kernel_t &k, const coefficients_t &c, const std::uint8_t *src, std::size_t src_pitch, std::uint8_t *const planes[3], const int pitches[3], int width, int height) {
+      // Both rows of a block are converted together, while they are still in the cache
+      for (int y = 0; y < height; y += 2) {
+        auto row0 = src + y * src_pitch;
+
+        // An odd height repeats the last row
+        auto rows = std::min(2, height - y);
+        auto row1 = rows > 1 ? row0 + src_pitch : row0;
+
+        for (int row = 0; row < rows; ++row) {
+          k.luma(planes[0] + (y + row) * pitches[0], row ? row1 : row0, 0, width, c);
+        }
+
+        if constexpr (layout == layout_e::i444) {
+          for (int row = 0; row < rows; ++row) {
+            k.i444(planes[1] + (y + row) * pitches[1], planes[2] + (y + row) * pitches[2], row ? row1 : row0, 0, width, c);
+          }
+        }
+        else if constexpr (layout == layout_e::nv12) {
+          k.nv12(planes[1] + y / 2 * pitches[1], nullptr, row0, row1, 0, width, c);
+        }
+        else {
+          k.i420(planes[1] + y / 2 * pitches[1], planes[2] + y / 2 * pitches[2], row0, row1, 0, width, c);
+        }
+      }
+    }
+  }  // namespace
+
+  coefficients_t
+  coefficients(const video::color_t &color) {
+    auto fixed = [](float x) {
+      return (std::int32_t) std::lround(x * (1 << SHIFT));
+    };
+
+    // The color matrix maps RGB in [0, 1] to YUV in [0, 1], so the offsets scale to 8 bits while the factors don't.
+    // Half of the last bit rounds to nearest.
+    coefficients_t c;
+    for (int x = 0; x < 3; ++x) {
+      c.y[x] = (std::int16_t) fixed(color.color_vec_y[x] * color.range_y[0]);
+      c.u[x] = (std::int16_t) fixed(color.color_vec_u[x] * color.range_uv[0]);
+      c.v[x] = (std::int16_t) fixed(color.color_vec_v[x] * color.range_uv[0]);
+    }
+    c.y_offset = fixed(255.0f * color.range_y[1]) + (1 << (SHIFT - 1));
+    c.u_offset = fixed(255.0f * (color.color_vec_u[3] * color.range_uv[0] + color.range_uv[1])) + (1 << (SHIFT - 1));
+    c.v_offset = fixed(255.0f * (color.color_vec_v[3] * color.range_uv[0] + color.range_uv[1])) + (1 << (SHIFT - 1));
+
+    return c;
+  }
+
+  const char *
+  kernel_name() {
+    return kernel().name;
+  }
+
+  void
+  convert(layout_e layout, const coefficients_t &coefficients, const std::uint8_t *src, std::size_t src_pitch, std::uint8_t *const planes[3], const int pitches[3], int width, int height) {
+    switch (layout) {
+      case layout_e::nv12:
+        convert<layout_e::nv12>(kernel(), coefficients, src, src_pitch, planes, pitches, width, height);
+        break;
+      case layout_e::i420:
+        convert<layout_e::i420>(kernel(), coefficients, src, src_pitch, planes, pitches, width, height);
+        break;
+      case layout_e::i444:
+        convert<layout_e::i444>(kernel(), coefficients, src, src_pitch, planes, pitches, width, height);
+        break;
+    }
+  }
+}  // namespace yuv
@@ -0,0 +1,48 @@
+/**
+ * @file src/yuv.h
+ * @brief Conversion of 32-bit BGRA images in system memory to 8-bit YUV.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "video_colorspace.h"
+
+namespace yuv {
+  enum class layout_e {
+    nv12,  ///< Y plane followed by a plane of interleaved U and V at half the size
+    i420,  ///< Y, U and V planes, U and V at half the size
+    i444,  ///< Y, U and V planes of the same size
+  };
+
+  /**
+   * @brief Fixed point form of a color matrix, for 8-bit BGRA input and output.
+   * @details Every output is `(c[0] * R + c[1] * G + c[2] * B + offset) >> 14`, rounded to nearest.
+   */
+  struct coefficients_t {
+    std::int16_t y[3];
+    std::int16_t u[3];
+    std::int16_t v[3];
+    std::int32_t y_offset;
+    std::int32_t u_offset;
+    std::int32_t v_offset;
+  };
+
+  coefficients_t
+  coefficients(const video::color_t &color);
+
+  /**
+   * @brief Name of the conversion kernels that were selected for this CPU.
+   */
+  const char *
+  kernel_name();
+
+  /**
+   * @brief Convert a BGRA image to YUV of the same size, the alpha channel is ignored.
+   * @details Chroma at half the size is the average of each 2x2 block of pixels.
+   * @param planes, pitches The Y, U and V planes, U alone for layout_e::nv12.
+   */
+  void
+  convert(layout_e layout, const coefficients_t &coefficients, const std::uint8_t *src, std::size_t src_pitch, std::uint8_t *const planes[3], const int pitches[3], int width, int height);
+}  // namespace yuv
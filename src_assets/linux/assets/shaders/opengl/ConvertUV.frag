@@ -6,6 +6,23 @@ precision lowp float;
 
 uniform sampler2D image;
 
+uniform sampler2D cursor;
+
+// Top-left corner of the cursor in texture coordinates of the image and the inverse of its size,
+// a hidden cursor is placed beyond the image
+uniform highp vec4 cursor_rect;
+
+// The cursor is premultiplied, as both X11 and the KMS cursor plane deliver it
+vec3 blend_cursor(vec3 rgb, highp vec2 pos) {
+  highp vec2 uv = (pos - cursor_rect.xy) * cursor_rect.zw;
+  if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+    return rgb;
+  }
+
+  vec4 overlay = texture(cursor, uv);
+  return overlay.rgb + rgb * (1.0 - overlay.a);
+}
+
 layout(shared) uniform ColorMatrix {
   vec4 color_vec_y;
   vec4 color_vec_u;
@@ -21,8 +38,8 @@ layout(location = 0) out vec2 color;
 // Pixel Shader
 //--------------------------------------------------------------------------------------
 void main() {
-  vec3 rgb_left  = texture(image, uuv.xz).rgb;
-  vec3 rgb_right = texture(image, uuv.yz).rgb;
+  vec3 rgb_left  = blend_cursor(texture(image, uuv.xz).rgb, uuv.xz);
+  vec3 rgb_right = blend_cursor(texture(image, uuv.yz).rgb, uuv.yz);
   vec3 rgb       = (rgb_left + rgb_right) * 0.5;
 
   float u = dot(color_vec_u.xyz, rgb) + color_vec_u.w;
@@ -6,6 +6,23 @@ precision lowp float;
 
 uniform sampler2D image;
 
+uniform sampler2D cursor;
+
+// Top-left corner of the cursor in texture coordinates of the image and the inverse of its size,
+// a hidden cursor is placed beyond the image
+uniform highp vec4 cursor_rect;
+
+// The cursor is premultiplied, as both X11 and the KMS cursor plane deliver it
+vec3 blend_cursor(vec3 rgb, highp vec2 pos) {
+  highp vec2 uv = (pos - cursor_rect.xy) * cursor_rect.zw;
+  if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+    return rgb;
+  }
+
+  vec4 overlay = texture(cursor, uv);
+  return overlay.rgb + rgb * (1.0 - overlay.a);
+}
+
 layout(shared) uniform ColorMatrix {
   vec4 color_vec_y;
   vec4 color_vec_u;
@@ -19,7 +36,7 @@ layout(location = 0) out float color;
 
 void main()
 {
-	vec3 rgb = texture(image, tex).rgb;
+	vec3 rgb = blend_cursor(texture(image, tex).rgb, tex);
 	float y = dot(color_vec_y.xyz, rgb);
 
 	color = y * range_y.x + range_y.y;
@@ -0,0 +1,152 @@
+/**
+ * @file tools/bench/cbs.cpp
+ * @brief Rewriting the SPS of an H.264 IDR frame, as the first frame of every session needs.
+ * @details The frame is encoded once with libx264 from a fixed gradient, so every run parses the same bitstream.
+ */
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include <benchmark/benchmark.h>
+
+#include "src/cbs.h"
+#include "src/utility.h"
+
+namespace {
+  void
+  free_ctx(AVCodecContext *ctx) {
+    avcodec_free_context(&ctx);
+  }
+
+  void
+  free_frame(AVFrame *frame) {
+    av_frame_free(&frame);
+  }
+
+  void
+  free_packet(AVPacket *packet) {
+    av_packet_free(&packet);
+  }
+
+  struct idr_t {
+    util::safe_ptr<AVCodecContext, free_ctx> ctx;
+    util::safe_ptr<AVPacket, free_packet> packet;
+  };
+
+  /**
+   * @return The encoder and its first packet, nullptr on error.
+   */
+  const idr_t *
+  h264_idr() {
+    static idr_t idr = []() -> idr_t {
+      auto codec = avcodec_find_encoder_by_name("libx264");
+      if (!codec) {
+        return {};
+      }
+
+      util::safe_ptr<AVCodecContext, free_ctx> ctx { avcodec_alloc_context3(codec) };
+      ctx->width = 1920;
+      ctx->height = 1080;
+      ctx->time_base = { 1, 60 };
+      ctx->framerate = { 60, 1 };
+      ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+      ctx->color_range = AVCOL_RANGE_MPEG;
+      ctx->color_primaries = AVCOL_PRI_BT709;
+      ctx->color_trc = AVCOL_TRC_BT709;
+      ctx->colorspace = AVCOL_SPC_BT709;
+      ctx->thread_count = 1;
+      av_opt_set(ctx->priv_data, "preset", "ultrafast", 0);
+      av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+      if (avcodec_open2(ctx.get(), codec, nullptr) < 0) {
+        return {};
+      }
+
+      util::safe_ptr<AVFrame, free_frame> frame { av_frame_alloc() };
+      frame->format = ctx->pix_fmt;
+      frame->width = ctx->width;
+      frame->height = ctx->height;
+      if (av_frame_get_buffer(frame.get(), 0) < 0) {
+        return {};
+      }
+
+      for (int plane = 0; plane < 3; ++plane) {
+        auto height = plane ? ctx->height / 2 : ctx->height;
+        for (int y = 0; y < height; ++y) {
+          auto row = frame->data[plane] + y * frame->linesize[plane];
+          for (int x = 0; x < frame->linesize[plane]; ++x) {
+            row[x] = plane ? 128 : (std::uint8_t) (16 + (x + y) % 220);
+          }
+        }
+      }
+
+      util::safe_ptr<AVPacket, free_packet> packet { av_packet_alloc() };
+      if (avcodec_send_frame(ctx.get(), frame.get()) < 0 || avcodec_receive_packet(ctx.get(), packet.get()) < 0) {
+        return {};
+      }
+
+      return { std::move(ctx), std::move(packet) };
+    }();
+
+    return idr.packet ? &idr : nullptr;
+  }
+
+  /**
+   * @brief Parse the frame and write the SPS with the colorspace of the encoder, without the cache.
+   */
+  void
+  cbs_make_sps_h264(benchmark::State &state) {
+    auto idr = h264_idr();
+    if (!idr) {
+      state.SkipWithError("libx264 couldn't encode the frame");
+      return;
+    }
+
+    for (auto _ : state) {
+      auto sps = cbs::make_sps_h264(idr->ctx.get(), idr->packet.get());
+      benchmark::DoNotOptimize(sps);
+    }
+    state.SetBytesProcessed(state.iterations() * idr->packet->size);
+  }
+  BENCHMARK(cbs_make_sps_h264);
+
+  /**
+   * @brief The rewrite of a session rebuilt with the same encoder, served from the cache.
+   */
+  void
+  cbs_parameter_sets_cached(benchmark::State &state) {
+    auto idr = h264_idr();
+    if (!idr) {
+      state.SkipWithError("libx264 couldn't encode the frame");
+      return;
+    }
+
+    if (!cbs::parameter_sets(idr->ctx.get(), idr->packet.get())) {
+      state.SkipWithError("The frame couldn't be parsed");
+      return;
+    }
+
+    for (auto _ : state) {
+      auto parameter_sets = cbs::parameter_sets(idr->ctx.get(), idr->packet.get());
+      benchmark::DoNotOptimize(parameter_sets);
+    }
+  }
+  BENCHMARK(cbs_parameter_sets_cached);
+
+  /**
+   * @brief Check for the VUI the encoder wrote, done once per session to decide whether to rewrite.
+   */
+  void
+  cbs_validate_sps(benchmark::State &state) {
+    auto idr = h264_idr();
+    if (!idr) {
+      state.SkipWithError("libx264 couldn't encode the frame");
+      return;
+    }
+
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(cbs::validate_sps(idr->packet.get(), AV_CODEC_ID_H264));
+    }
+  }
+  BENCHMARK(cbs_validate_sps);
+}  // namespace
@@ -0,0 +1,179 @@
+/**
+ * @file tools/bench/interprocess.cpp
+ * @brief Packets and events through the queues of `interprocess.cpp`, in process private memory.
+ */
+#include <atomic>
+#include <chrono>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "src/interprocess.h"
+
+using namespace std::literals;
+
+namespace {
+  // Sizes of an audio packet, a P-frame and an IDR frame
+  constexpr std::int64_t PACKET_SIZES[] { 1 << 10, 64 << 10, 512 << 10 };
+
+  Queue *
+  video_queue() {
+    static SharedMemory *memory = []() {
+      SharedMemory *memory = nullptr;
+      init_shared_memory(&memory, "", 1 << QueueType::Video);
+      return memory;
+    }();
+
+    return memory ? &memory->queues[QueueType::Video] : nullptr;
+  }
+
+  std::vector<char>
+  make_payload(std::size_t size) {
+    std::vector<char> payload(size);
+    for (std::size_t x = 0; x < size; ++x) {
+      payload[x] = (char) (x * 31 + 7);
+    }
+    return payload;
+  }
+
+  void
+  interprocess_push(benchmark::State &state) {
+    auto queue = video_queue();
+    if (!queue) {
+      state.SkipWithError("Couldn't map the queues");
+      return;
+    }
+
+    auto payload = make_payload(state.range(0));
+    PacketMetadata metadata {};
+    for (auto _ : state) {
+      push_packet(queue, payload.data(), (int) payload.size(), metadata);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+  }
+  BENCHMARK(interprocess_push)->ArgsProduct({ { std::begin(PACKET_SIZES), std::end(PACKET_SIZES) } });
+
+  /**
+   * @brief Publish a frame made of replaced parameter sets and the rest of the packet.
+   */
+  void
+  interprocess_push_segments(benchmark::State &state) {
+    auto queue = video_queue();
+    if (!queue) {
+      state.SkipWithError("Couldn't map the queues");
+      return;
+    }
+
+    auto payload = make_payload(state.range(0));
+    std::string_view frame { payload.data(), payload.size() };
+    std::string_view segments[] { frame.substr(0, 32), frame.substr(32, 16), frame.substr(48) };
+
+    PacketMetadata metadata {};
+    for (auto _ : state) {
+      push_packet(queue, segments, 3, metadata);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+  }
+  BENCHMARK(interprocess_push_segments)->ArgsProduct({ { std::begin(PACKET_SIZES), std::end(PACKET_SIZES) } });
+
+  /**
+   * @brief Publish and read back a packet on the same thread, the cost of both copies.
+   */
+  void
+  interprocess_push_pop(benchmark::State &state) {
+    auto queue = video_queue();
+    if (!queue) {
+      state.SkipWithError("Couldn't map the queues");
+      return;
+    }
+
+    auto payload = make_payload(state.range(0));
+    std::vector<char> buffer(payload.size());
+
+    PacketMetadata metadata {};
+    auto position = queue->head;
+    for (auto _ : state) {
+      push_packet(queue, payload.data(), (int) payload.size(), metadata);
+      if (pop_packet(queue, &position, buffer.data(), (int) buffer.size(), &metadata) != (int) payload.size()) {
+        state.SkipWithError("The packet didn't come back");
+        break;
+      }
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+  }
+  BENCHMARK(interprocess_push_pop)->ArgsProduct({ { std::begin(PACKET_SIZES), std::end(PACKET_SIZES) } });
+
+  /**
+   * @brief Time until a consumer sleeping in `wait_packet()` has read the packet just published.
+   */
+  void
+  interprocess_handoff(benchmark::State &state) {
+    auto queue = video_queue();
+    if (!queue) {
+      state.SkipWithError("Couldn't map the queues");
+      return;
+    }
+
+    auto payload = make_payload(state.range(0));
+
+    // Taken before the consumer starts, so it can't miss the first packet
+    auto position = queue->head;
+    auto index = queue->index;
+
+    std::atomic<std::int64_t> received { 0 };
+    std::atomic<bool> running { true };
+    std::thread consumer { [&, position, index]() mutable {
+      std::vector<char> buffer(payload.size());
+      PacketMetadata metadata;
+
+      while (running.load(std::memory_order_relaxed)) {
+        index = wait_packet(queue, index, 100ms);
+        while (pop_packet(queue, &position, buffer.data(), (int) buffer.size(), &metadata) != 0) {
+          received.fetch_add(1, std::memory_order_release);
+        }
+      }
+    } };
+
+    PacketMetadata metadata {};
+    std::int64_t sent = 0;
+    for (auto _ : state) {
+      push_packet(queue, payload.data(), (int) payload.size(), metadata);
+      ++sent;
+      while (received.load(std::memory_order_acquire) < sent) {
+        std::this_thread::yield();
+      }
+    }
+
+    running.store(false, std::memory_order_relaxed);
+    consumer.join();
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+  }
+  BENCHMARK(interprocess_handoff)->ArgsProduct({ { std::begin(PACKET_SIZES), std::end(PACKET_SIZES) } })->UseRealTime();
+
+  /**
+   * @brief Raise an event and take it on the same thread, as the bitrate and IDR requests travel.
+   */
+  void
+  interprocess_event(benchmark::State &state) {
+    auto queue = video_queue();
+    if (!queue) {
+      state.SkipWithError("Couldn't map the queues");
+      return;
+    }
+
+    Event event {};
+    event.type = DataType::NUMBER;
+    for (auto _ : state) {
+      event.value_number++;
+      raise_event(queue, EventType::Bitrate, event);
+      if (!peek_event(queue, EventType::Bitrate)) {
+        state.SkipWithError("The event didn't arrive");
+        break;
+      }
+      benchmark::DoNotOptimize(pop_event(queue, EventType::Bitrate));
+    }
+  }
+  BENCHMARK(interprocess_event);
+}  // namespace
@@ -0,0 +1,42 @@
+/**
+ * @file tools/bench/main.cpp
+ * @brief Microbenchmarks of the building blocks of the pipeline.
+ * @details The results are printed as a table and written as JSON to sunshine_bench.json, every flag of
+ *          Google Benchmark overrides these defaults, such as `--benchmark_out=baseline.json` or
+ *          `--benchmark_filter=queue`. Compare two runs with `compare.py` of Google Benchmark.
+ */
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "src/logging.h"
+
+int
+main(int argc, char *argv[]) {
+  // The table goes to stdout as well, only errors are worth interrupting it for
+  auto log_deinit_guard = logging::init(4);
+
+  std::vector<std::string> defaults {
+    "--benchmark_out=sunshine_bench.json",
+    "--benchmark_out_format=json",
+  };
+
+  // Flags parsed later win, so the command line comes after the defaults
+  std::vector<char *> args { argv[0] };
+  for (auto &arg : defaults) {
+    args.push_back(arg.data());
+  }
+  args.insert(std::end(args), argv + 1, argv + argc);
+
+  int count = (int) args.size();
+  benchmark::Initialize(&count, args.data());
+  if (benchmark::ReportUnrecognizedArguments(count, args.data())) {
+    return 2;
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file tools/bench/queue.cpp
+ * @brief Handoff between threads through `safe::queue_t` and `safe::event_t`.
+ */
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "src/thread_safe.h"
+
+namespace {
+  constexpr const char *mode_names[] { "locked", "spsc", "mpsc" };
+
+  /**
+   * @brief Round trip of an element to a thread that raises it on a second queue.
+   * @details Half of the time per iteration is the handoff latency of the queue, including the
+   *          wakeup of a consumer that went to sleep.
+   */
+  void
+  queue_round_trip(benchmark::State &state) {
+    auto mode = (safe::queue_mode_e) state.range(0);
+    state.SetLabel(mode_names[state.range(0)]);
+
+    safe::queue_t<int> ping { 32, mode };
+    safe::queue_t<int> pong { 32, mode };
+
+    std::thread echo { [&]() {
+      while (auto value = ping.pop()) {
+        pong.raise(*value);
+      }
+    } };
+
+    int x = 0;
+    for (auto _ : state) {
+      ping.raise(x++);
+      benchmark::DoNotOptimize(pong.pop());
+    }
+
+    ping.stop();
+    echo.join();
+  }
+  BENCHMARK(queue_round_trip)->DenseRange(0, 2)->UseRealTime();
+
+  /**
+   * @brief Raise and pop on the same thread, the cost of the queue without contention or wakeups.
+   */
+  void
+  queue_raise_pop(benchmark::State &state) {
+    auto mode = (safe::queue_mode_e) state.range(0);
+    state.SetLabel(mode_names[state.range(0)]);
+
+    safe::queue_t<int> queue { 32, mode };
+
+    int x = 0;
+    for (auto _ : state) {
+      queue.raise(x++);
+      benchmark::DoNotOptimize(queue.pop());
+    }
+  }
+  BENCHMARK(queue_raise_pop)->DenseRange(0, 2);
+
+  /**
+   * @brief Elements per second a single consumer drains while producers raise as fast as they can.
+   */
+  void
+  queue_producers(benchmark::State &state) {
+    auto mode = (safe::queue_mode_e) state.range(0);
+    auto producer_count = (int) state.range(1);
+    state.SetLabel(mode_names[state.range(0)]);
+
+    safe::queue_t<int> queue { 1024, mode };
+
+    std::vector<std::thread> producers;
+    for (int x = 0; x < producer_count; ++x) {
+      producers.emplace_back([&queue, x]() {
+        while (queue.running()) {
+          queue.raise(x);
+        }
+      });
+    }
+
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(queue.pop());
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    queue.stop();
+    for (auto &producer : producers) {
+      producer.join();
+    }
+  }
+  BENCHMARK(queue_producers)
+    ->Args({ (int) safe::queue_mode_e::locked, 1 })
+    ->Args({ (int) safe::queue_mode_e::spsc, 1 })
+    ->Args({ (int) safe::queue_mode_e::locked, 4 })
+    ->Args({ (int) safe::queue_mode_e::mpsc, 4 })
+    ->UseRealTime();
+
+  /**
+   * @brief Round trip through two `safe::event_t`, as the IDR and bitrate requests take to the encoder.
+   */
+  void
+  event_round_trip(benchmark::State &state) {
+    safe::event_t<int> ping;
+    safe::event_t<int> pong;
+
+    std::thread echo { [&]() {
+      while (auto value = ping.pop()) {
+        pong.raise(*value);
+      }
+    } };
+
+    int x = 0;
+    for (auto _ : state) {
+      ping.raise(x++);
+      benchmark::DoNotOptimize(pong.pop());
+    }
+
+    ping.stop();
+    echo.join();
+  }
+  BENCHMARK(event_round_trip)->UseRealTime();
+}  // namespace
@@ -0,0 +1,116 @@
+/**
+ * @file tools/bench/send.cpp
+ * @brief Datagrams to a loopback socket through `platf::send_batch()` and one `platf::send()` each.
+ * @details The receiving socket is never read, the kernel drops what doesn't fit into its buffer.
+ *          This measures the cost on the sending side only.
+ */
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include "src/platform/common.h"
+
+namespace {
+  namespace asio = boost::asio;
+  using asio::ip::udp;
+
+  // Datagram of a shard, as large as the MTU allows without fragmentation
+  constexpr std::size_t BLOCK_SIZE = 1400;
+
+  // Size of the header of a video shard
+  constexpr std::size_t HEADER_SIZE = 36;
+
+  constexpr std::int64_t BLOCK_COUNTS[] { 16, 64, 256 };
+
+  struct loopback_t {
+    asio::io_context io_context;
+    asio::ip::address address = asio::ip::address_v4::loopback();
+    udp::socket sink { io_context, udp::endpoint { address, 0 } };
+    udp::socket socket { io_context, udp::endpoint { address, 0 } };
+
+    loopback_t() {
+      socket.set_option(asio::socket_base::send_buffer_size { 4 * 1024 * 1024 });
+    }
+  };
+
+  /**
+   * @brief One call for the batch, the OS segments it (UDP GSO, USO) where it can.
+   * @details The second argument selects the gather layout of the video, a header per block in front of
+   *          the payload of the frame, instead of blocks that are contiguous in memory.
+   */
+  void
+  send_batch(benchmark::State &state) {
+    auto block_count = (std::size_t) state.range(0);
+    auto gather = state.range(1) != 0;
+    state.SetLabel(gather ? "gather" : "contiguous");
+
+    loopback_t loopback;
+    auto port = loopback.sink.local_endpoint().port();
+
+    std::vector<char> buffer(block_count * BLOCK_SIZE, 'x');
+    std::vector<char> headers(block_count * HEADER_SIZE, 'h');
+    platf::buffer_descriptor_t payload { buffer.data(), block_count * (BLOCK_SIZE - HEADER_SIZE) };
+
+    platf::batched_send_info_t send_info {
+      buffer.data(),
+      BLOCK_SIZE,
+      block_count,
+      (std::uintptr_t) loopback.socket.native_handle(),
+      loopback.address,
+      port,
+      loopback.address,
+    };
+    if (gather) {
+      send_info.headers = headers.data();
+      send_info.header_size = HEADER_SIZE;
+      send_info.payload_size = payload.size;
+      send_info.payload_buffers = &payload;
+      send_info.payload_buffer_count = 1;
+    }
+
+    for (auto _ : state) {
+      if (!platf::send_batch(send_info)) {
+        state.SkipWithError("Batched sends are unsupported");
+        break;
+      }
+    }
+    state.SetItemsProcessed(state.iterations() * block_count);
+    state.SetBytesProcessed(state.iterations() * block_count * BLOCK_SIZE);
+  }
+  BENCHMARK(send_batch)->ArgsProduct({ { std::begin(BLOCK_COUNTS), std::end(BLOCK_COUNTS) }, { 0, 1 } });
+
+  /**
+   * @brief The same blocks with a call for each, the fallback where batched sends are unsupported.
+   */
+  void
+  send_each(benchmark::State &state) {
+    auto block_count = (std::size_t) state.range(0);
+
+    loopback_t loopback;
+    auto port = loopback.sink.local_endpoint().port();
+
+    std::vector<char> buffer(block_count * BLOCK_SIZE, 'x');
+    for (auto _ : state) {
+      for (std::size_t x = 0; x < block_count; ++x) {
+        platf::send_info_t send_info {
+          buffer.data() + x * BLOCK_SIZE,
+          BLOCK_SIZE,
+          (std::uintptr_t) loopback.socket.native_handle(),
+          loopback.address,
+          port,
+          loopback.address,
+        };
+
+        if (!platf::send(send_info)) {
+          state.SkipWithError("Send failed");
+          break;
+        }
+      }
+    }
+    state.SetItemsProcessed(state.iterations() * block_count);
+    state.SetBytesProcessed(state.iterations() * block_count * BLOCK_SIZE);
+  }
+  BENCHMARK(send_each)->ArgsProduct({ { std::begin(BLOCK_COUNTS), std::end(BLOCK_COUNTS) } });
+}  // namespace
@@ -0,0 +1,75 @@
+/**
+ * @file tools/bench/task_pool.cpp
+ * @brief Scheduling of tasks on `thread_pool_util::ThreadPool`, the type of `task_pool`.
+ */
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "src/thread_pool.h"
+
+using namespace std::literals;
+
+namespace {
+  /**
+   * @brief Push a task and wait for its result, the latency until a worker picks it up.
+   */
+  void
+  task_pool_round_trip(benchmark::State &state) {
+    thread_pool_util::ThreadPool pool { (int) state.range(0) };
+
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(pool.push([]() { return 1; }).get());
+    }
+  }
+  BENCHMARK(task_pool_round_trip)->Arg(1)->Arg(4)->UseRealTime();
+
+  /**
+   * @brief Push a burst of tasks before waiting for any, the throughput of the queue of tasks.
+   */
+  void
+  task_pool_burst(benchmark::State &state) {
+    constexpr int BURST = 64;
+
+    thread_pool_util::ThreadPool pool { (int) state.range(0) };
+
+    std::vector<std::future<int>> futures;
+    futures.reserve(BURST);
+    for (auto _ : state) {
+      for (int x = 0; x < BURST; ++x) {
+        futures.emplace_back(pool.push([x]() { return x; }));
+      }
+      for (auto &future : futures) {
+        benchmark::DoNotOptimize(future.get());
+      }
+      futures.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * BURST);
+  }
+  BENCHMARK(task_pool_burst)->Arg(1)->Arg(4)->UseRealTime();
+
+  /**
+   * @brief Delayed tasks, `late_us` is how long after their deadline they ran on average.
+   */
+  void
+  task_pool_delayed(benchmark::State &state) {
+    auto delay = std::chrono::microseconds { state.range(0) };
+
+    thread_pool_util::ThreadPool pool { 1 };
+
+    double late = 0;
+    for (auto _ : state) {
+      auto deadline = std::chrono::steady_clock::now() + delay;
+      auto task = pool.pushDelayed([deadline]() {
+        return std::chrono::steady_clock::now() - deadline;
+      },
+        delay);
+
+      late += std::chrono::duration<double, std::micro>(task.future.get()).count();
+    }
+    state.counters["late_us"] = benchmark::Counter(late, benchmark::Counter::kAvgIterations);
+  }
+  BENCHMARK(task_pool_delayed)->Arg(500)->Arg(5000)->UseRealTime();
+}  // namespace
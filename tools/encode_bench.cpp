@@ -0,0 +1,485 @@
+/**
+ * @file tools/encode_bench.cpp
+ * @brief Offline benchmark of the encoders on synthetic content, without a stream.
+ * @details Every encoder that passes its probe encodes each scene with each codec it supports.
+ *          The results are written as CSV, one line per run, and logged.
+ *
+ *          sunshine-encode-bench [--frames=600] [--size=1920x1080] [--fps=60] [--bitrate=20000]
+ *                                [--encoder=nvenc] [--codec=h264,hevc,av1] [--scene=static,scroll,noise]
+ *                                [--output=encode_bench.csv]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/config.h"
+#include "src/globals.h"
+#include "src/logging.h"
+#include "src/platform/common.h"
+#include "src/video.h"
+
+using namespace std::literals;
+
+namespace bench {
+  enum class scene_e {
+    still,  ///< The same image every frame, the encoder only has to skip
+    scroll,  ///< Lines of text that scroll up, like a terminal or a web page
+    noise,  ///< Every pixel changes every frame, the worst case for the rate control
+  };
+
+  constexpr std::string_view scene_names[] { "static"sv, "scroll"sv, "noise"sv };
+  constexpr std::string_view codec_names[] { "h264"sv, "hevc"sv, "av1"sv };
+
+  // Pixels the text moves up per frame
+  constexpr int SCROLL_SPEED = 4;
+
+  struct options_t {
+    int frames = 600;
+    int width = 1920;
+    int height = 1080;
+    int framerate = 60;
+    int bitrate = 20000;  // Kilobits per second
+    std::string encoder;  // Empty for every encoder
+    std::string output = "encode_bench.csv";
+    std::vector<int> codecs { 0, 1, 2 };
+    std::vector<scene_e> scenes { scene_e::still, scene_e::scroll, scene_e::noise };
+  };
+
+  struct result_t {
+    std::string_view encoder;
+    std::string_view codec;
+    std::string_view scene;
+    int frames;
+    int packets;
+    double fps;  // Frames per second of convert() and encode() alone
+    double p50, p95, p99, max;  // Milliseconds from convert() until the encoder returned the frame
+    double kbps;
+    double bitrate_error;  // Percent off the target bitrate
+    std::size_t idr_bytes;  // Average of the requested IDR frames
+    std::size_t frame_bytes;  // Average of the other frames
+  };
+
+  /**
+   * @brief Draws synthetic scenes into the images of the display it wraps.
+   * @details The real display of the encoder's device type provides the encode devices and the
+   *          images, so hardware encoders get the input they get during a stream. Images only the GPU
+   *          can write to, such as the textures of Windows desktop duplication, get the content of
+   *          `dummy_img()` instead.
+   */
+  class synthetic_display_t: public platf::display_t {
+  public:
+    synthetic_display_t(std::shared_ptr<platf::display_t> display, scene_e scene, int framerate):
+        display { std::move(display) }, scene { scene }, delay { 1s / framerate } {
+      offset_x = this->display->offset_x;
+      offset_y = this->display->offset_y;
+      env_width = this->display->env_width;
+      env_height = this->display->env_height;
+      width = this->display->width;
+      height = this->display->height;
+
+      // A page of text twice the height of the display, it wraps around as it scrolls
+      text.resize((std::size_t) width * height * 2, 0xFFFFFFFF);
+      std::uint32_t seed = 0x9E3779B9;
+      for (int line = 0; line * 16 + 12 < height * 2; ++line) {
+        for (int x = 16; x + 8 < width; x += 8) {
+          seed = seed * 1664525 + 1013904223;
+
+          // Words of a few letters, some lines end early
+          if ((seed >> 24) < 40 || x > width * ((seed >> 8) % 64 + 64) / 128) {
+            continue;
+          }
+          for (int y = 0; y < 12; ++y) {
+            for (int dx = 1; dx < 7; ++dx) {
+              if ((seed >> ((y * 6 + dx) % 31)) & 1) {
+                text[(std::size_t) (line * 16 + y) * width + x + dx] = 0xFF202020;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    platf::capture_e
+    capture(const push_captured_image_cb_t &push_captured_image_cb, const pull_free_image_cb_t &pull_free_image_cb, bool *cursor) override {
+      auto next_frame = std::chrono::steady_clock::now();
+      while (true) {
+        std::shared_ptr<platf::img_t> img;
+        if (!pull_free_image_cb(img)) {
+          return platf::capture_e::interrupted;
+        }
+
+        draw(*img);
+        img->frame_timestamp = std::chrono::steady_clock::now();
+        if (!push_captured_image_cb(std::move(img), true)) {
+          return platf::capture_e::ok;
+        }
+
+        next_frame += delay;
+        std::this_thread::sleep_until(next_frame);
+      }
+    }
+
+    std::shared_ptr<platf::img_t>
+    alloc_img() override {
+      return display->alloc_img();
+    }
+
+    int
+    dummy_img(platf::img_t *img) override {
+      return display->dummy_img(img);
+    }
+
+    std::unique_ptr<platf::avcodec_encode_device_t>
+    make_avcodec_encode_device(platf::pix_fmt_e pix_fmt) override {
+      return display->make_avcodec_encode_device(pix_fmt);
+    }
+
+    std::unique_ptr<platf::nvenc_encode_device_t>
+    make_nvenc_encode_device(platf::pix_fmt_e pix_fmt) override {
+      return display->make_nvenc_encode_device(pix_fmt);
+    }
+
+    std::unique_ptr<platf::amf_encode_device_t>
+    make_amf_encode_device(platf::pix_fmt_e pix_fmt) override {
+      return display->make_amf_encode_device(pix_fmt);
+    }
+
+    bool
+    is_hdr() override {
+      return display->is_hdr();
+    }
+
+    bool
+    is_codec_supported(std::string_view name, const video::config_t &config) override {
+      return display->is_codec_supported(name, config);
+    }
+
+    /**
+     * @brief Draw the next frame of the scene.
+     * @return -1 if the image can't be drawn to.
+     */
+    int
+    draw(platf::img_t &img) {
+      auto frame = frames++;
+      if (!img.data || img.pixel_pitch != 4) {
+        return frame ? 0 : dummy_img(&img);
+      }
+
+      auto rows = std::min(img.height, height);
+      auto columns = std::min(img.width, width);
+      switch (scene) {
+        case scene_e::still:
+          if (frame) {
+            return 0;
+          }
+
+          // Color bars over a gradient
+          for (int y = 0; y < rows; ++y) {
+            auto row = (std::uint32_t *) (img.data + (std::size_t) y * img.row_pitch);
+            for (int x = 0; x < columns; ++x) {
+              std::uint32_t bar = (x * 8 / columns);
+              std::uint32_t level = 0xC0 * y / rows + 0x3F;
+              row[x] = 0xFF000000 | (bar & 1 ? level : 0) | (bar & 2 ? level << 8 : 0) | (bar & 4 ? level << 16 : 0);
+            }
+          }
+          break;
+        case scene_e::scroll: {
+          auto offset = (std::size_t) frame * SCROLL_SPEED % (height * 2);
+          for (int y = 0; y < rows; ++y) {
+            auto line = (offset + y) % (height * 2);
+            std::memcpy(img.data + (std::size_t) y * img.row_pitch, &text[line * width], columns * sizeof(std::uint32_t));
+          }
+          break;
+        }
+        case scene_e::noise:
+          for (int y = 0; y < rows; ++y) {
+            auto row = (std::uint64_t *) (img.data + (std::size_t) y * img.row_pitch);
+            for (int x = 0; x < columns / 2; ++x) {
+              noise ^= noise << 13;
+              noise ^= noise >> 7;
+              noise ^= noise << 17;
+              row[x] = noise | 0xFF000000FF000000;
+            }
+          }
+          break;
+      }
+
+      return 0;
+    }
+
+  private:
+    std::shared_ptr<platf::display_t> display;
+    scene_e scene;
+    std::chrono::nanoseconds delay;
+
+    std::uint64_t frames = 0;
+    std::uint64_t noise = 0x2545F4914F6CDD1D;
+    std::vector<std::uint32_t> text;
+  };
+
+  double
+  percentile(std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+      return 0;
+    }
+    auto index = (std::size_t) std::max(0.0, std::ceil(p * sorted.size()) - 1);
+    return sorted[std::min(index, sorted.size() - 1)];
+  }
+
+  std::optional<result_t>
+  run(video::encoder_t &encoder, const video::config_t &config, scene_e scene, int frames) {
+    auto real_display = platf::display(encoder.platform_formats->dev_type, config::video.output_name, config);
+    if (!real_display) {
+      BOOST_LOG(error) << "No display for encoder ["sv << encoder.name << ']';
+      return std::nullopt;
+    }
+    synthetic_display_t display { std::move(real_display), scene, config.framerate };
+
+    auto encode_device = video::make_encode_device(display, encoder, config);
+    if (!encode_device) {
+      return std::nullopt;
+    }
+    auto session = video::make_encode_session(&display, encoder, config, display.width, display.height, std::move(encode_device));
+    if (!session) {
+      return std::nullopt;
+    }
+
+    auto img = display.alloc_img();
+    if (!img) {
+      return std::nullopt;
+    }
+
+    auto mail = std::make_shared<safe::mail_raw_t>();
+    auto packets = mail->queue<video::packet_t>(mail::video_packets, mail::video_packets_mode);
+
+    result_t result {};
+    result.encoder = encoder.name;
+    result.codec = codec_names[config.videoFormat];
+    result.scene = scene_names[(int) scene];
+    result.frames = frames;
+
+    std::vector<double> latencies;
+    std::size_t bytes = 0, idr_bytes = 0, idr_count = 0;
+    std::chrono::nanoseconds busy {};
+    for (int x = 0; x < frames; ++x) {
+      if (display.draw(*img)) {
+        return std::nullopt;
+      }
+
+      // The first IDR frame is sized by a cold rate control, the one halfway through by a settled one
+      bool idr = x == 0 || x == frames / 2;
+
+      latency::frame_timing_t timing {};
+      timing.captured = timing.convert_start = std::chrono::steady_clock::now();
+      if (session->convert(*img)) {
+        BOOST_LOG(error) << "Couldn't convert frame "sv << x;
+        return std::nullopt;
+      }
+      timing.convert_end = std::chrono::steady_clock::now();
+
+      if (idr) {
+        session->request_idr_frame();
+      }
+      if (video::encode(x + 1, *session, packets, nullptr, timing.captured, timing)) {
+        BOOST_LOG(error) << "Couldn't encode frame "sv << x;
+        return std::nullopt;
+      }
+      if (idr) {
+        session->request_normal_frame();
+      }
+      busy += std::chrono::steady_clock::now() - timing.convert_start;
+
+      while (packets->peek()) {
+        auto packet = packets->pop();
+        ++result.packets;
+        bytes += packet->data_size();
+        if (packet->is_idr()) {
+          idr_bytes += packet->data_size();
+          ++idr_count;
+        }
+
+        if (packet->timing.encode_complete != std::chrono::steady_clock::time_point {}) {
+          latencies.push_back(std::chrono::duration<double, std::milli>(packet->timing.encode_complete - packet->timing.convert_start).count());
+        }
+      }
+    }
+
+    std::sort(std::begin(latencies), std::end(latencies));
+    result.p50 = percentile(latencies, 0.50);
+    result.p95 = percentile(latencies, 0.95);
+    result.p99 = percentile(latencies, 0.99);
+    result.max = latencies.empty() ? 0 : latencies.back();
+
+    result.fps = frames / std::chrono::duration<double>(busy).count();
+    result.kbps = bytes * 8.0 / 1000 / ((double) frames / config.framerate);
+    result.bitrate_error = (result.kbps - config.bitrate) * 100 / config.bitrate;
+    result.idr_bytes = idr_count ? idr_bytes / idr_count : 0;
+    result.frame_bytes = result.packets > (int) idr_count ? (bytes - idr_bytes) / (result.packets - idr_count) : 0;
+    return result;
+  }
+
+  std::vector<std::string>
+  split(const std::string &list) {
+    std::vector<std::string> result;
+    std::size_t begin = 0;
+    while (begin <= list.size()) {
+      auto end = std::min(list.find(',', begin), list.size());
+      result.emplace_back(list.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    return result;
+  }
+
+  std::optional<options_t>
+  parse(int argc, char *argv[]) {
+    options_t options;
+    try {
+      for (int x = 1; x < argc; ++x) {
+        std::string arg = argv[x];
+        auto pos = arg.find('=');
+        auto name = arg.substr(0, pos);
+        auto value = pos == std::string::npos ? ""s : arg.substr(pos + 1);
+
+        if (name == "--frames") {
+          options.frames = std::stoi(value);
+        }
+        else if (name == "--size") {
+          auto separator = value.find('x');
+          options.width = std::stoi(value.substr(0, separator));
+          options.height = std::stoi(value.substr(separator + 1));
+        }
+        else if (name == "--fps") {
+          options.framerate = std::stoi(value);
+        }
+        else if (name == "--bitrate") {
+          options.bitrate = std::stoi(value);
+        }
+        else if (name == "--output") {
+          options.output = value;
+        }
+        else if (name == "--encoder") {
+          options.encoder = value;
+        }
+        else if (name == "--codec") {
+          options.codecs.clear();
+          for (auto &codec : split(value)) {
+            auto it = std::find(std::begin(codec_names), std::end(codec_names), codec);
+            if (it == std::end(codec_names)) {
+              std::cerr << "Unknown codec "sv << codec << std::endl;
+              return std::nullopt;
+            }
+            options.codecs.push_back(it - std::begin(codec_names));
+          }
+        }
+        else if (name == "--scene") {
+          options.scenes.clear();
+          for (auto &scene : split(value)) {
+            auto it = std::find(std::begin(scene_names), std::end(scene_names), scene);
+            if (it == std::end(scene_names)) {
+              std::cerr << "Unknown scene "sv << scene << std::endl;
+              return std::nullopt;
+            }
+            options.scenes.push_back((scene_e) (it - std::begin(scene_names)));
+          }
+        }
+        else {
+          std::cerr << "Unknown option "sv << arg << std::endl;
+          return std::nullopt;
+        }
+      }
+    }
+    catch (const std::exception &) {
+      std::cerr << "Invalid option value"sv << std::endl;
+      return std::nullopt;
+    }
+
+    if (options.frames < 2 || options.width <= 0 || options.height <= 0 || options.framerate <= 0 || options.bitrate <= 0) {
+      std::cerr << "Invalid options"sv << std::endl;
+      return std::nullopt;
+    }
+    return options;
+  }
+}  // namespace bench
+
+int
+main(int argc, char *argv[]) {
+  auto options = bench::parse(argc, argv);
+  if (!options) {
+    return 2;
+  }
+
+  mail::man = std::make_shared<safe::mail_raw_t>();
+  auto log_deinit_guard = logging::init(config::sunshine.min_log_level);
+
+  // The probes of an encoder run on the pool
+  task_pool.start(2);
+
+  auto platf_deinit_guard = platf::init();
+  if (!platf_deinit_guard) {
+    BOOST_LOG(error) << "Platform failed to initialize"sv;
+    return 1;
+  }
+
+  // The log goes to stdout as well, the results get a file of their own
+  std::ofstream out { options->output, std::ios::trunc };
+  if (!out) {
+    BOOST_LOG(error) << "Couldn't open "sv << options->output;
+    return 1;
+  }
+  out << "encoder,codec,scene,frames,packets,fps,latency_p50_ms,latency_p95_ms,latency_p99_ms,latency_max_ms,"
+         "target_kbps,kbps,bitrate_error_pct,idr_bytes,frame_bytes"sv
+      << std::endl;
+
+  int runs = 0;
+  int failures = 0;
+  for (auto encoder : video::platform_encoders()) {
+    if (!options->encoder.empty() && encoder->name != options->encoder) {
+      continue;
+    }
+    if (!video::validate_encoder(*encoder, false)) {
+      continue;
+    }
+
+    for (auto codec : options->codecs) {
+      video::config_t config { std::nullopt, options->width, options->height, options->framerate, options->bitrate, 1, 0, 1, codec, 0, 0 };
+      if (!encoder->codec_from_config(config)[video::encoder_t::PASSED]) {
+        BOOST_LOG(info) << "Encoder ["sv << encoder->name << "] doesn't support "sv << bench::codec_names[codec];
+        continue;
+      }
+
+      for (auto scene : options->scenes) {
+        auto result = bench::run(*encoder, config, scene, options->frames);
+        if (!result) {
+          BOOST_LOG(error) << "Encoder ["sv << encoder->name << "] failed on "sv << bench::codec_names[codec] << ' ' << bench::scene_names[(int) scene];
+          ++failures;
+          continue;
+        }
+
+        ++runs;
+        BOOST_LOG(info) << "Encoder ["sv << result->encoder << "] "sv << result->codec << ' ' << result->scene << ": "sv
+                        << result->fps << " fps, p99 "sv << result->p99 << " ms, "sv << result->kbps << " kbps, IDR "sv << result->idr_bytes << " bytes"sv;
+        out << result->encoder << ',' << result->codec << ',' << result->scene << ','
+            << result->frames << ',' << result->packets << ',' << result->fps << ','
+            << result->p50 << ',' << result->p95 << ',' << result->p99 << ',' << result->max << ','
+            << options->bitrate << ',' << result->kbps << ',' << result->bitrate_error << ','
+            << result->idr_bytes << ',' << result->frame_bytes << std::endl;
+      }
+    }
+  }
+
+  task_pool.stop();
+  task_pool.join();
+
+  if (!runs) {
+    BOOST_LOG(error) << "No encoder could be benchmarked"sv;
+    return 1;
+  }
+  return failures ? 1 : 0;
+}